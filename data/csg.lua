@@ -42,9 +42,22 @@ function complexscene()
   local d0 = translation(7.0, 5.0, 7.0, s);
   local d1 = translation(7.0, 5.0, 7.0, b0);
   local c = D(d1, d0);
+
+  -- the row of cylinders is decoded natively in one call to build
+  local cyls, n = {}, 0
+  local function emit(...)
+    for k=1,select('#',...) do cyls[n+k] = select(k,...) end
+    n = n + select('#',...)
+  end
   for i=0,15 do
-    c = U(c, capped_cylinder(2.0, 2.0+2.0*i, 1.0, 1.0, 2*i+2.0, mat_snoise_index))
+    local x, z, r, ymin, ymax = 2.0, 2.0+2.0*i, 1.0, 1.0, 2*i+2.0
+    emit(op_cylinderxz, x, z, r, mat_snoise_index,
+         op_plane, 0.0, 1.0, 0.0, -ymin, mat_snoise_index, op_difference,
+         op_plane, 0.0,-1.0, 0.0,  ymax, mat_snoise_index, op_difference,
+         op_bounds, x-r, ymin, z-r, x+r, ymax, z+r)
   end
+  emit(op_unionn, 16)
+  c = U(c, build(cyls))
   local b = box(3.5, 4.0, 3.5, mat_simple_index);
   local scene0 = D(c, translation(2.0,5.0,18.0, b));
 
@@ -76,7 +89,8 @@ end
 
 local env = {
   capped_cylinder=capped_cylinder,
-  arcade=arcade
+  arcade=arcade,
+  select=select
 }
 setmetatable(env, {__index=csg})
 setfenv(complexscene, env)
@@ -1,14 +1,13 @@
 void main() {
   vec2 uv = gl_FragCoord.xy;
-  vec3 nor = normalize(2.0*texture2DRect(u_nortex, uv).xyz-1.0);
   float depth = texture2DRect(u_depthtex, uv).r;
   vec4 outcol;
   if (depth != 1.0) {
+    vec3 nor = decodenormal(texture2DRect(u_nortex, uv));
     vec4 posw = u_invmvp * vec4(uv, depth, 1.0);
     vec3 pos = posw.xyz / posw.w;
-    vec4 diffuse = texture2DRect(u_diffusetex, uv);
-    // outcol = vec4(nor, 1.0); //diffuse*vec4(shade(pos, nor), 1.0);
-    outcol = diffuse*vec4(shade(pos, nor), 1.0);
+    vec3 diffuse = texture2DRect(u_diffusetex, uv).rgb;
+    outcol = vec4(diffuse*shade(pos, nor), 1.0);
   } else {
     vec4 rdh = u_dirinvmvp * vec4(uv, 0.0, 1.0);
     vec3 rd = normalize(rdh.xyz/rdh.w);
@@ -0,0 +1,34 @@
+// distance to the scene from its sparse volume. the index gives the atlas
+// brick of the point or, far from the surface, only the sign of the distance.
+// an atlas brick has one more sample than its cells along each axis such
+// that the trilinear fetch stays in it. the shader declares u_distindex,
+// u_distatlas, u_distorg, u_rcpdistcell, u_distbrickdim and u_distmax
+float scenedist(vec3 pos) {
+  vec3 g = (pos-u_distorg) * u_rcpdistcell;
+  ivec3 brick = ivec3(floor(g / u_distbrickdim));
+  ivec3 dim = textureSize(u_distindex, 0);
+  if (any(lessThan(brick, ivec3(0))) || any(greaterThanEqual(brick, dim)))
+    return u_distmax;
+  int idx = int(texelFetch(u_distindex, brick, 0).r);
+  if (idx < 2) return idx == 0 ? u_distmax : -u_distmax;
+  int samples = int(u_distbrickdim)+1;
+  ivec3 atlassize = textureSize(u_distatlas, 0);
+  ivec3 atlasdim = atlassize / samples;
+  int slot = idx-2;
+  ivec3 atlas = ivec3(slot % atlasdim.x, (slot / atlasdim.x) % atlasdim.y,
+                      slot / (atlasdim.x*atlasdim.y));
+  vec3 local = g - vec3(brick)*u_distbrickdim;
+  vec3 texel = vec3(atlas*samples) + local + 0.5;
+  return texture(u_distatlas, texel / vec3(atlassize)).r;
+}
+
+// occlusion of a point by the distances along its normal at a few steps
+float distao(vec3 pos, vec3 nor, float step) {
+  float occ = 0.0, w = 0.5;
+  for (int i = 1; i <= 4; ++i) {
+    float h = step*float(i);
+    occ += w * max(h-scenedist(pos+h*nor), 0.0) / h;
+    w *= 0.5;
+  }
+  return clamp(1.0-occ, 0.0, 1.0);
+}
@@ -0,0 +1,26 @@
+// the normals are stored as is in rgb8 or octahedron encoded in rg16 when
+// PACKEDGBUFFER is defined. the alpha of the diffuse target is the material
+vec4 encodenormal(vec3 n) {
+#if defined(PACKEDGBUFFER)
+  n /= abs(n.x)+abs(n.y)+abs(n.z);
+  vec2 s = 2.0*step(0.0, n.xy)-1.0;
+  vec2 e = n.z >= 0.0 ? n.xy : (1.0-abs(n.yx))*s;
+  return vec4(0.5*e+0.5, 0.0, 1.0);
+#else
+  return vec4(0.5*n+0.5, 1.0);
+#endif
+}
+
+vec3 decodenormal(vec4 t) {
+#if defined(PACKEDGBUFFER)
+  vec2 e = 2.0*t.xy-1.0;
+  vec3 n = vec3(e, 1.0-abs(e.x)-abs(e.y));
+  vec2 s = 2.0*step(0.0, n.xy)-1.0;
+  n.xy -= s*max(-n.z, 0.0);
+  return normalize(n);
+#else
+  return normalize(2.0*t.xyz-1.0);
+#endif
+}
+
+vec4 encodediffuse(vec3 col, float mat) { return vec4(col, mat/255.0); }
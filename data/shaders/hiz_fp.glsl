@@ -0,0 +1,12 @@
+// farthest depth of the HIZSIZE x HIZSIZE block of pixels
+void main() {
+  vec2 org = floor(gl_FragCoord.xy)*float(HIZSIZE);
+  float depth = 0.0;
+  for (int j = 0; j < HIZSIZE; ++j)
+  for (int i = 0; i < HIZSIZE; ++i) {
+    vec2 uv = min(org+vec2(float(i),float(j))+0.5, u_depthdim-0.5);
+    depth = max(depth, texture2DRect(u_depthtex, uv).r);
+  }
+  SWITCH_WEBGL(gl_FragColor, rt_col) = vec4(depth);
+}
+
@@ -1,9 +1,33 @@
 VS_OUT vec2 fs_tex;
 VS_OUT vec3 fs_nor;
+
+vec4 instancedata(int base, int i) {
+  return texelFetch(u_instances, base+i);
+}
+
+// key frames store 8 bits positions and the index of their normal. the
+// transformation to model space is already in the instance matrices
+vec3 md2pos(uvec4 v, vec3 scale, vec3 translate) {
+  vec3 p = vec3(v.xyz)*scale;
+  if (u_snap != 0) p = vec3(ivec3(p+0.5*float(u_snap)) & ~(u_snap-1));
+  return p+translate;
+}
 void main() {
+  int base = INSTANCESZ*(u_firstinstance+gl_InstanceID);
+  mat4 mvp = mat4(instancedata(base,0), instancedata(base,1),
+                  instancedata(base,2), instancedata(base,3));
+  mat3 nortransform = mat3(instancedata(base,4).xyz, instancedata(base,5).xyz,
+                           instancedata(base,6).xyz);
+  vec4 frame = instancedata(base,7);
+  int idx = int(vs_vertex);
+  uvec4 v0 = texelFetch(u_vertices, int(frame.x)+idx);
+  uvec4 v1 = texelFetch(u_vertices, int(frame.y)+idx);
+  vec3 nor0 = texelFetch(u_normals, int(v0.w)).xyz;
+  vec3 nor1 = texelFetch(u_normals, int(v1.w)).xyz;
+  vec3 pos0 = md2pos(v0, instancedata(base,8).xyz, instancedata(base,9).xyz);
+  vec3 pos1 = md2pos(v1, instancedata(base,10).xyz, instancedata(base,11).xyz);
   fs_tex = vs_tex;
-  fs_nor = u_nortransform*mix(vs_nor0,vs_nor1,u_delta);
-  vec3 vs_pos = mix(vs_pos0,vs_pos1,u_delta);
-  gl_Position = u_mvp*vec4(vs_pos,1.0);
+  fs_nor = nortransform*mix(nor0,nor1,frame.z);
+  gl_Position = mvp*vec4(mix(pos0,pos1,frame.z),1.0);
 }
 
@@ -0,0 +1,18 @@
+VS_OUT vec3 fs_pos;
+VS_OUT vec3 fs_nor;
+// octahedral encoded normal: unfold the lower half of the octahedron
+vec3 octdecode(vec2 e) {
+  vec3 n = vec3(e, 1.0-abs(e.x)-abs(e.y));
+  if (n.z < 0.0) {
+    vec2 s = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    n.xy = (1.0-abs(n.yx))*s;
+  }
+  return normalize(n);
+}
+void main() {
+  vec3 p = u_chunkorg+u_chunkscale*vs_pos;
+  fs_nor = octdecode(vs_nor);
+  fs_pos = p;
+  gl_Position = u_mvp*vec4(p,1.0);
+}
+
@@ -0,0 +1,7 @@
+PS_IN vec3 fs_tex;
+PS_IN vec3 fs_col;
+void main() {
+  vec4 col = texture(u_diffuse, fs_tex)*vec4(fs_col,1.0);
+  SWITCH_WEBGL(gl_FragColor, rt_col) = col;
+}
+
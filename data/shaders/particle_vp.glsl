@@ -0,0 +1,12 @@
+VS_OUT vec3 fs_tex;
+VS_OUT vec3 fs_col;
+void main() {
+  // one instance per particle: position and size, color and sprite layer.
+  // the quad is a strip made from the vertex id
+  vec2 corner = vec2(float(gl_VertexID&1), float(gl_VertexID>>1));
+  vec2 offset = (2.0*corner-1.0)*vs_pos.w;
+  fs_tex = vec3(corner, vs_col.w);
+  fs_col = vs_col.xyz;
+  gl_Position = u_mvp*vec4(vs_pos.xyz+offset.x*u_right+offset.y*u_up,1.0);
+}
+
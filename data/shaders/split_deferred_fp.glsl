@@ -3,7 +3,7 @@ void main() {
   vec2 bufindex = uv * u_rcpsubbufferdim;
   vec2 pixindex = mod(uv, u_subbufferdim);
   vec2 splituv = SPLITNUM * pixindex + bufindex;
-  vec3 nor = normalize(2.0*texture2DRect(u_nortex, splituv).xyz-1.0);
+  vec3 nor = decodenormal(texture2DRect(u_nortex, splituv));
   float depth = texture2DRect(u_depthtex, splituv).r;
   vec4 posw = u_invmvp * vec4(splituv, depth, 1.0);
   vec3 pos = posw.xyz / posw.w;
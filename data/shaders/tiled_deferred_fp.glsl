@@ -0,0 +1,57 @@
+// lights are binned in screen tiles of TILESIZE pixels. the grid starts with
+// the offset and the number of lights of each tile followed by light indices.
+// a light with a shadow bit (plus one, zero if none) is skipped when this bit
+// is set in the ray traced shadow mask
+vec3 shade(vec3 pos, vec3 nor) {
+  ivec2 tile = ivec2(gl_FragCoord.xy) / TILESIZE;
+  int idx = 2*(tile.x + tile.y*u_tilew);
+  int first = int(texelFetch(u_lightgrid, idx).r);
+  int num = int(texelFetch(u_lightgrid, idx+1).r);
+  uint shadowbits = 0u;
+  if (u_shadowscale != 0)
+    shadowbits = texelFetch(u_shadowmask, ivec2(gl_FragCoord.xy) / u_shadowscale, 0).r;
+  vec3 outcol = vec3(0.0);
+  for (int i = 0; i < num; ++i) {
+    int light = int(texelFetch(u_lightgrid, first+i).r);
+    vec4 lpow = texelFetch(u_lights, 2*light+1);
+    int shadow = int(lpow.w);
+    if (shadow != 0 && (shadowbits & (1u << uint(shadow-1))) != 0u) continue;
+    vec3 lpos = texelFetch(u_lights, 2*light).xyz;
+    outcol += diffuse(pos, nor, lpos, lpow.xyz);
+  }
+  return outcol;
+}
+
+// baked probes give l0 + dot(l1, normal) per color channel. their textures
+// are not bound and u_probescale is zero when the scene has none
+vec3 irradiance(vec3 pos, vec3 nor) {
+  if (u_probescale == 0.0) return vec3(0.0);
+  vec3 uvw = (pos - u_probeorg) * u_rcpprobeextent;
+  vec4 n = vec4(nor, 1.0);
+  vec3 sh = vec3(dot(texture(u_prober, uvw), n),
+                 dot(texture(u_probeg, uvw), n),
+                 dot(texture(u_probeb, uvw), n));
+  vec3 e = u_probescale * max(sh, vec3(0.0));
+  // the probes are coarse. the distance field darkens their light in corners
+  if (u_distao != 0.0) e *= mix(1.0, distao(pos, nor, 2.0/u_rcpdistcell), u_distao);
+  return e;
+}
+
+void main() {
+  vec2 uv = gl_FragCoord.xy;
+  float depth = texture(u_depthtex, uv).r;
+  vec4 outcol;
+  if (depth != 1.0) {
+    vec3 nor = decodenormal(texture(u_nortex, uv));
+    vec4 posw = u_invmvp * vec4(uv, depth, 1.0);
+    vec3 pos = posw.xyz / posw.w;
+    vec3 diffuse = texture(u_diffusetex, uv).rgb;
+    outcol = vec4(diffuse*(shade(pos, nor)+irradiance(pos, nor)), 1.0);
+  } else {
+    vec4 rdh = u_dirinvmvp * vec4(uv, 0.0, 1.0);
+    vec3 rd = normalize(rdh.xyz/rdh.w);
+    outcol = vec4(getsky(rd, u_sundir), 1.0);
+  }
+  rt_col = outcol;
+}
+
@@ -218,5 +218,54 @@ template<class T, class F> INLINE void quicksort(T *buf, int n, F fun) {
 template<class T> INLINE void quicksort(T *buf, int n) {
   quicksort(buf, buf+n, compareless<T>);
 }
+
+// radix sort keys. floats compare as unsigned integers once the sign bit is
+// flipped for positive numbers and all bits are flipped for negative ones
+INLINE u32 radixkey(u32 x) { return x; }
+INLINE u64 radixkey(u64 x) { return x; }
+INLINE u32 radixkey(float x) {
+  u32 u;
+  memcpy(&u, &x, sizeof(u));
+  return u ^ (u32(-s32(u>>31)) | 0x80000000u);
+}
+template<class T> struct radixkeyof {
+  INLINE auto operator() (const T &x) const -> decltype(radixkey(x)) {
+    return radixkey(x);
+  }
+};
+
+// stable lsd radix sort with 8 bits digits. key returns an u32 or u64 for
+// each element and tmp holds n elements. all digit histograms are built in
+// one pass and the passes where all keys share the same digit are skipped
+template<class T, class F> void radixsort(T *buf, T *tmp, u32 n, F key) {
+  typedef decltype(key(*buf)) K;
+  static const u32 DIGITNUM = sizeof(K);
+  if (n < 2) return;
+  u32 count[DIGITNUM][256];
+  memset(count, 0, sizeof(count));
+  loopi(s32(n)) {
+    const K k = key(buf[i]);
+    loopj(s32(DIGITNUM)) ++count[j][u32(k >> (8*j)) & 0xff];
+  }
+  auto src = buf, dst = tmp;
+  loopj(s32(DIGITNUM)) {
+    auto &c = count[j];
+    const auto shift = 8*j;
+    if (c[u32(key(src[0]) >> shift) & 0xff] == n) continue;
+    u32 sum = 0;
+    loopi(256) {
+      const auto num = c[i];
+      c[i] = sum;
+      sum += num;
+    }
+    loopi(s32(n)) dst[c[u32(key(src[i]) >> shift) & 0xff]++] = src[i];
+    swap(src, dst);
+  }
+  if (src != buf) copy_n(src, n, buf);
+}
+
+template<class T> INLINE void radixsort(T *buf, T *tmp, u32 n) {
+  radixsort(buf, tmp, n, radixkeyof<T>());
+}
 } /* namespace q */
 
@@ -4,6 +4,7 @@
  -------------------------------------------------------------------------*/
 #pragma once
 #include "sys.hpp"
+#include "utility.hpp"
 
 namespace q {
 
@@ -80,6 +81,41 @@ struct DEFAULT_ALIGNED linear_allocator {
   char *head, data[size];
 };
 
+// linear allocator growing by chunks. everything is freed at once with it.
+// no lock is taken here so only one thread may allocate from a given arena
+struct arena : noncopyable {
+  enum { CHUNK_SIZE = 256*1024, ALIGNMENT = 16 };
+  INLINE arena() : chunks(NULL), curr(NULL), left(0) {}
+  INLINE ~arena() {
+    while (chunks) {
+      const auto next = *(char**) chunks;
+      FREE(chunks);
+      chunks = next;
+    }
+  }
+  INLINE void *alloc(size_t sz) {
+    sz = ALIGN(sz, size_t(ALIGNMENT));
+    if (sz > left) {
+      // the first bytes of each chunk link it to the previous one
+      const auto chunksize = (sz > CHUNK_SIZE ? sz : size_t(CHUNK_SIZE)) + ALIGNMENT;
+      const auto chunk = (char*) MALLOC(chunksize);
+      *(char**) chunk = chunks;
+      chunks = chunk;
+      curr = chunk + ALIGNMENT;
+      left = chunksize - ALIGNMENT;
+    }
+    const auto ptr = curr;
+    curr += sz;
+    left -= sz;
+    return ptr;
+  }
+  template <typename T> INLINE T *alloc(u32 n) {
+    return n ? (T*) alloc(n*sizeof(T)) : NULL;
+  }
+  char *chunks, *curr;
+  size_t left;
+};
+
 /*-------------------------------------------------------------------------
  - allocator
  -------------------------------------------------------------------------*/
@@ -0,0 +1,110 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - bench.cpp -> implements the helpers shared by the benchmarks
+ -------------------------------------------------------------------------*/
+#include "bench.hpp"
+#include "algorithm.hpp"
+#include "math.hpp"
+#include <cstdlib>
+
+namespace q {
+namespace bench {
+
+u32 parselist(const char *str, u32 *values, u32 maxnum) {
+  u32 n = 0;
+  while (*str) {
+    char *end;
+    const auto x = strtol(str, &end, 10);
+    if (end == str || x <= 0 || n == maxnum) return 0;
+    values[n++] = u32(x);
+    str = *end == ',' ? end+1 : end;
+  }
+  return n;
+}
+
+stats summarize(vector<double> &samples) {
+  stats s = {0.0, 0.0, 0.0, 0.0};
+  const auto n = samples.length();
+  if (n == 0) return s;
+  quicksort(&samples[0], n);
+  s.best = samples[0];
+  s.median = n&1 ? samples[n/2] : 0.5*(samples[n/2-1]+samples[n/2]);
+  s.p95 = samples[max(int(ceil(0.95*double(n)))-1, 0)];
+  s.worst = samples[n-1];
+  return s;
+}
+
+// the items of the root object and of the arrays go on their own line
+void json::separate(const char *name) {
+  const auto broken = depth > 0 && lines[depth-1];
+  if (!first) fputc(',', f);
+  if (broken)
+    fprintf(f, "\n%*s", int(2*depth), "");
+  else if (!first)
+    fputc(' ', f);
+  first = false;
+  if (name == NULL) return;
+  quote(name);
+  fputs(": ", f);
+}
+
+void json::begin(const char *name, char open) {
+  assert(depth < MAXJSONDEPTH);
+  separate(name);
+  fputc(open, f);
+  lines[depth] = depth == 0 || open == '[';
+  ++depth;
+  first = true;
+}
+
+void json::end(char close) {
+  assert(depth > 0);
+  --depth;
+  if (lines[depth] && !first) fprintf(f, "\n%*s", int(2*depth), "");
+  fputc(close, f);
+  first = false;
+  if (depth == 0) fputc('\n', f);
+}
+
+void json::quote(const char *str) {
+  fputc('"', f);
+  for (; *str; ++str) {
+    const auto c = u8(*str);
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\u%04x", c);
+    else
+      fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+void json::beginobject(const char *name) { begin(name, '{'); }
+void json::endobject() { end('}'); }
+void json::beginarray(const char *name) { begin(name, '['); }
+void json::endarray() { end(']'); }
+
+void json::value(const char *name, const char *str) {
+  separate(name);
+  quote(str);
+}
+void json::value(const char *name, bool x) {
+  separate(name);
+  fputs(x ? "true" : "false", f);
+}
+void json::value(const char *name, int x) {
+  separate(name);
+  fprintf(f, "%d", x);
+}
+void json::value(const char *name, u32 x) {
+  separate(name);
+  fprintf(f, "%u", x);
+}
+void json::value(const char *name, double x, const char *format) {
+  separate(name);
+  fprintf(f, format, x);
+}
+} /* namespace bench */
+} /* namespace q */
+
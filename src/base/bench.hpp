@@ -0,0 +1,47 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - bench.hpp -> argument lists, statistics and json output of the benchmarks
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "sys.hpp"
+#include "vector.hpp"
+#include "utility.hpp"
+#include <cstdio>
+
+namespace q {
+namespace bench {
+
+// comma separated list of positive integers. 0 when one entry is not one or
+// when there are more than maxnum of them
+u32 parselist(const char *str, u32 *values, u32 maxnum);
+
+// the samples are sorted in place. all zero without any sample
+struct stats { double best, median, p95, worst; };
+stats summarize(vector<double> &samples);
+
+// streams json in the file. the root object and the arrays have one item per
+// line, the objects inside them stay on a single line
+static const u32 MAXJSONDEPTH = 8;
+struct json : noncopyable {
+  INLINE json(FILE *f) : f(f), depth(0), first(true) {}
+  void beginobject(const char *name = NULL);
+  void endobject();
+  void beginarray(const char *name);
+  void endarray();
+  void value(const char *name, const char *str);
+  void value(const char *name, bool x);
+  void value(const char *name, int x);
+  void value(const char *name, u32 x);
+  void value(const char *name, double x, const char *format = "%.3f");
+  void separate(const char *name);
+  void begin(const char *name, char open);
+  void end(char close);
+  void quote(const char *str);
+  FILE *f;
+  u32 depth;
+  bool first;
+  bool lines[MAXJSONDEPTH];
+};
+} /* namespace bench */
+} /* namespace q */
+
@@ -9,10 +9,13 @@
 #include "menu.hpp"
 #include "text.hpp"
 #include "sys.hpp"
+#include <SDL/SDL_thread.h>
+#include <cstdio>
 
 namespace q {
 namespace con {
 struct cline { char *cref; int outtime; };
+// only the main thread touches the lines. the others go through the ring
 static vector<cline> conlines;
 static const int ndraw = 5;
 static const unsigned int WORDWRAP = 80;
@@ -29,14 +32,16 @@ static void setconskip(int n) {
 }
 CMDN(conskip, setconskip);
 
-// keymap is defined externally in keymap.q
-struct keym { int code; char *name; char *action; } keyms[256];
+// keymap is defined externally in keymap.q. actions are compiled when bound
+// so that a keypress only calls a lua function
+struct keym { int code; char *name; char *action; int fun; } keyms[256];
 static int numkm = 0;
 
 static void keymap(const char *code, const char *key, const char *action) {
   keyms[numkm].code = ATOI(code);
   keyms[numkm].name = NEWSTRING(key);
-  keyms[numkm++].action = NEWSTRINGBUF(action);
+  keyms[numkm].action = NEWSTRINGBUF(action);
+  keyms[numkm++].fun = script::compilestring(action);
 }
 CMD(keymap);
 
@@ -47,25 +52,14 @@ static void bindkey(const char *key, const char *action) {
   *dst = 0;
   loopi(numkm) if (strcmp(keyms[i].name, upper.c_str())==0) {
     strcpy_cs(keyms[i].action, action);
+    script::releasecompiled(keyms[i].fun);
+    keyms[i].fun = script::compilestring(keyms[i].action);
     return;
   }
   out("unknown key \"%s\"", key);
 }
 CMDN(bind, bindkey);
 
-#if !defined(RELEASE)
-void finish() {
-  loopv(conlines) FREE(conlines[i].cref);
-  loopv(vhistory) FREE(vhistory[i]);
-  vhistory.destroy();
-  conlines.destroy();
-  loopi(numkm) {
-    FREE(keyms[i].name);
-    FREE(keyms[i].action);
-  }
-}
-#endif
-
 static void line(const char *sf, bool highlight) {
   cline cl;
   cl.cref = conlines.length()>100 ? conlines.pop().cref : NEWSTRINGBUF("");
@@ -83,9 +77,14 @@ static void line(const char *sf, bool highlight) {
 #endif
 }
 
-void out(const char *s, ...) {
-  vasprintfsd(sf, s, s);
-  s = sf.c_str();
+// lines also go to this file when opened with logfile
+static FILE *logstream = NULL;
+
+static void print(const char *s) {
+  if (logstream) {
+    fputs(s, logstream);
+    fputc('\n', logstream);
+  }
   int n = 0;
   while (strlen(s)>WORDWRAP) { // cut strings to fit on screen
     fixedstring t;
@@ -96,6 +95,103 @@ void out(const char *s, ...) {
   line(s, n!=0);
 }
 
+static void logfile(const char *name) {
+  if (logstream) fclose(logstream);
+  logstream = name && name[0] ? fopen(name, "a") : NULL;
+  if (name && name[0] && logstream == NULL) out("unable to open log file %s", name);
+}
+CMD(logfile);
+
+/*-------------------------------------------------------------------------
+ - the other threads format their lines in a bounded multi-producer ring
+ - without lock nor allocation. a producer claims a slot by moving the tail
+ - and publishes it with the sequence number of the slot. the main thread
+ - drains the ring in order. when it is full, lines are dropped and counted
+ - rather than blocking the producer
+ -------------------------------------------------------------------------*/
+static const u32 RINGSIZE = 256;
+static struct ring {
+  ring() : tail(0), dropped(0), head(0) {
+    loopi(s32(RINGSIZE)) slots[i].seq = i;
+  }
+  struct slot {
+    volatile s32 seq;
+    char text[MAXDEFSTR];
+  } slots[RINGSIZE];
+  volatile s32 tail, dropped;
+  s32 head;
+} ring;
+static const SDL_threadID mainthread = SDL_ThreadID();
+
+// differences of sequence numbers stay right when they wrap
+static INLINE s32 seqdiff(s32 a, s32 b) { return s32(u32(a)-u32(b)); }
+static INLINE s32 seqadd(s32 a, u32 n) { return s32(u32(a)+n); }
+
+static void push(const char *s, va_list va) {
+  auto pos = loadacquire(&ring.tail);
+  for (;;) {
+    auto &slot = ring.slots[u32(pos) % RINGSIZE];
+    const auto diff = seqdiff(loadacquire(&slot.seq), pos);
+    if (diff == 0) {
+      const auto prev = atomic_cmpxchg(&ring.tail, seqadd(pos,1), pos);
+      if (prev == pos) {
+        vsnprintf(slot.text, sizeof(slot.text), s, va);
+        storerelease(&slot.seq, seqadd(pos,1));
+        return;
+      }
+      pos = prev;
+    } else if (diff < 0) { // the main thread did not drain this slot yet
+      atomic_add(&ring.dropped, 1);
+      return;
+    } else
+      pos = loadacquire(&ring.tail);
+  }
+}
+
+void flush() {
+  if (SDL_ThreadID() != mainthread) return;
+  for (;;) {
+    auto &slot = ring.slots[u32(ring.head) % RINGSIZE];
+    if (loadacquire(&slot.seq) != seqadd(ring.head,1)) break;
+    print(slot.text);
+    storerelease(&slot.seq, seqadd(ring.head,RINGSIZE));
+    ring.head = seqadd(ring.head,1);
+  }
+  const auto dropped = loadacquire(&ring.dropped);
+  if (dropped == 0) return;
+  atomic_add(&ring.dropped, -dropped);
+  fixedstring msg(fmt, "console: %d lines dropped", dropped);
+  print(msg.c_str());
+}
+
+void out(const char *s, ...) {
+  va_list va;
+  va_start(va, s);
+  if (SDL_ThreadID() == mainthread) {
+    flush(); // older lines of the other threads go first
+    const fixedstring sf(s, va);
+    print(sf.c_str());
+  } else
+    push(s, va);
+  va_end(va);
+}
+
+#if !defined(RELEASE)
+void finish() {
+  flush();
+  logfile(NULL);
+  loopv(conlines) FREE(conlines[i].cref);
+  loopv(vhistory) FREE(vhistory[i]);
+  vhistory.destroy();
+  conlines.destroy();
+  loopi(numkm) {
+    FREE(keyms[i].name);
+    FREE(keyms[i].action);
+    script::releasecompiled(keyms[i].fun);
+  }
+}
+#endif
+
 VAR(confadeout, 1, 5000, 256000);
 static int conlinenum(char *refs[ndraw]) {
   int nd = 0;
@@ -118,6 +214,7 @@ float height() {
 
 void render() {
   char *refs[ndraw];
+  flush();
   const int nd = conlinenum(refs);
 
   // console output
@@ -200,7 +297,7 @@ void keypress(int code, bool isdown) {
   } else if (!menu::key(code, isdown)) { // keystrokes go to menu
     loopi(numkm) if (keyms[i].code==code) { // keystrokes go to game, lookup in keymap and execute
       setkeydownflag(isdown);
-      script::execstring(keyms[i].action);
+      script::execcompiled(keyms[i].fun);
       return;
     }
   }
@@ -8,7 +8,10 @@ namespace q {
 namespace con {
 void finish();
 const char *curcmd();
+// any thread may print. the lines of the other threads show up when the main
+// thread flushes them, which out and render also do
 void out(const char *s, ...);
+void flush();
 void setkeydownflag(bool on);
 bool iskeydown();
 float height();
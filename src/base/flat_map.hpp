@@ -0,0 +1,204 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - flat_map.hpp -> exposes open addressing hash map with byte metadata
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "sys.hpp"
+#include "hash.hpp"
+#include "pair.hpp"
+#include "utility.hpp"
+
+namespace q {
+
+// slots are split into groups of 16. every slot has one control byte: empty,
+// deleted or the 7 top bits of the hash of its key. a lookup compares the 16
+// control bytes of a group at once and only looks at the keys that match.
+// groups are probed in triangular order and the probe stops at the first
+// group with an empty slot. keys and values are moved with memcpy on growth
+template <typename K, typename V, typename H = hash<K>>
+struct flat_map : noncopyable {
+  typedef pair<K,V> value_type;
+  static const u8 EMPTY = 0x80, DELETED = 0xfe;
+  static const u32 GROUPSIZE = 16;
+
+  template <typename T> struct iterator_base {
+    INLINE iterator_base(const flat_map *map, u32 idx) : map(map), idx(idx) {}
+    INLINE T &operator*() const { return (T&) map->slots[idx]; }
+    INLINE T *operator->() const { return (T*) &map->slots[idx]; }
+    INLINE iterator_base &operator++() {
+      ++idx;
+      while (idx < map->capacity && (map->ctrl[idx] & EMPTY)) ++idx;
+      return *this;
+    }
+    INLINE bool operator==(const iterator_base &other) const { return idx == other.idx; }
+    INLINE bool operator!=(const iterator_base &other) const { return idx != other.idx; }
+    const flat_map *map;
+    u32 idx;
+  };
+  typedef iterator_base<value_type> iterator;
+  typedef iterator_base<const value_type> const_iterator;
+
+  INLINE flat_map() : ctrl(NULL), slots(NULL), capacity(0), num(0), deleted(0) {}
+  INLINE ~flat_map() { destroy(); }
+
+  INLINE u32 size() const { return num; }
+  INLINE bool empty() const { return num == 0; }
+  INLINE iterator begin() { return ++iterator(this, ~0u); }
+  INLINE iterator end() { return iterator(this, capacity); }
+  INLINE const_iterator begin() const { return ++const_iterator(this, ~0u); }
+  INLINE const_iterator end() const { return const_iterator(this, capacity); }
+
+  INLINE iterator find(const K &key) { return iterator(this, lookup(key)); }
+  INLINE const_iterator find(const K &key) const { return const_iterator(this, lookup(key)); }
+
+  // the value is not replaced if the key is already here
+  pair<iterator,bool> insert(const value_type &x) {
+    const auto found = lookup(x.first);
+    if (found != capacity) return makepair(iterator(this, found), false);
+    const auto idx = emplace(x.first);
+    sys::callctor<value_type>(slots+idx, x);
+    return makepair(iterator(this, idx), true);
+  }
+  V &operator[](const K &key) {
+    const auto found = lookup(key);
+    if (found != capacity) return slots[found].second;
+    const auto idx = emplace(key);
+    sys::callctor<value_type>(slots+idx, key, V());
+    return slots[idx].second;
+  }
+  bool erase(const K &key) {
+    const auto idx = lookup(key);
+    if (idx == capacity) return false;
+    slots[idx].~value_type();
+    // if the group has an empty slot, no probe ever went through it
+    const auto group = idx & ~(GROUPSIZE-1);
+    if (match(group, EMPTY) != 0)
+      ctrl[idx] = EMPTY;
+    else {
+      ctrl[idx] = DELETED;
+      ++deleted;
+    }
+    --num;
+    return true;
+  }
+  void clear() {
+    loopi(s32(capacity)) if (!(ctrl[i] & EMPTY)) slots[i].~value_type();
+    if (ctrl) memset(ctrl, EMPTY, capacity);
+    num = deleted = 0;
+  }
+  void destroy() {
+    clear();
+    SAFE_DELA(ctrl);
+    FREE(slots);
+    slots = NULL;
+    capacity = 0;
+  }
+  void reserve(u32 n) {
+    const auto needed = nextpowerof2(max(n + n/7 + 1, 2*GROUPSIZE));
+    if (needed > capacity) rehash(needed);
+  }
+
+private:
+  static INLINE u32 hash1(u32 h) { return h; }
+  static INLINE u8 hash2(u32 h) { return u8(h >> 25); }
+
+  // one bit per slot of the group whose control byte is c
+  INLINE u32 match(u32 group, u8 c) const {
+#if defined(__SSE2_INTRINSICS__)
+    const auto bytes = _mm_loadu_si128((const __m128i*) (ctrl+group));
+    return u32(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(char(c)))));
+#else
+    u32 mask = 0;
+    loopi(s32(GROUPSIZE)) if (ctrl[group+i] == c) mask |= 1u<<i;
+    return mask;
+#endif
+  }
+  // empty or deleted slots of the group
+  INLINE u32 matchfree(u32 group) const {
+#if defined(__SSE2_INTRINSICS__)
+    const auto bytes = _mm_loadu_si128((const __m128i*) (ctrl+group));
+    return u32(_mm_movemask_epi8(bytes));
+#else
+    u32 mask = 0;
+    loopi(s32(GROUPSIZE)) if (ctrl[group+i] & EMPTY) mask |= 1u<<i;
+    return mask;
+#endif
+  }
+
+  // index of the key or capacity if missing
+  u32 lookup(const K &key) const {
+    if (num == 0) return capacity;
+    const auto h = hasher(key);
+    const auto h2 = hash2(h);
+    const auto groupmask = capacity/GROUPSIZE-1;
+    auto g = hash1(h) & groupmask;
+    for (u32 step = 1;; ++step) {
+      const auto group = g*GROUPSIZE;
+      for (auto m = match(group, h2); m != 0; m &= m-1) {
+        const auto idx = group + u32(__bsf(m));
+        if (slots[idx].first == key) return idx;
+      }
+      if (match(group, EMPTY) != 0 || step > groupmask) return capacity;
+      g = (g+step) & groupmask;
+    }
+  }
+
+  // claim a free slot for a key known to be missing
+  u32 emplace(const K &key) {
+    if (capacity == 0 || 8*(num+deleted+1) > 7*capacity)
+      rehash(8*(num+1) > 7*capacity/2 ? max(2*capacity, 2*GROUPSIZE) : capacity);
+    const auto h = hasher(key);
+    const auto groupmask = capacity/GROUPSIZE-1;
+    auto g = hash1(h) & groupmask;
+    for (u32 step = 1;; ++step) {
+      const auto group = g*GROUPSIZE;
+      const auto m = matchfree(group);
+      if (m != 0) {
+        const auto idx = group + u32(__bsf(m));
+        if (ctrl[idx] == DELETED) --deleted;
+        ctrl[idx] = hash2(h);
+        ++num;
+        return idx;
+      }
+      g = (g+step) & groupmask;
+    }
+  }
+
+  // also drops the deleted slots when the size does not change
+  void rehash(u32 newcapacity) {
+    auto oldctrl = ctrl;
+    const auto oldslots = slots;
+    const auto oldcapacity = capacity;
+    ctrl = NEWAE(u8, newcapacity);
+    slots = (value_type*) MALLOC(newcapacity*sizeof(value_type));
+    memset(ctrl, EMPTY, newcapacity);
+    capacity = newcapacity;
+    num = deleted = 0;
+    const auto groupmask = capacity/GROUPSIZE-1;
+    loopi(s32(oldcapacity)) {
+      if (oldctrl[i] & EMPTY) continue;
+      const auto h = hasher(oldslots[i].first);
+      auto g = hash1(h) & groupmask;
+      for (u32 step = 1;; ++step) {
+        const auto m = matchfree(g*GROUPSIZE);
+        if (m != 0) {
+          const auto idx = g*GROUPSIZE + u32(__bsf(m));
+          ctrl[idx] = hash2(h);
+          memcpy((void*) (slots+idx), oldslots+i, sizeof(value_type));
+          ++num;
+          break;
+        }
+        g = (g+step) & groupmask;
+      }
+    }
+    SAFE_DELA(oldctrl);
+    FREE(oldslots);
+  }
+
+  u8 *ctrl;
+  value_type *slots;
+  u32 capacity, num, deleted;
+  H hasher;
+};
+} /* namespace q */
+
@@ -20,6 +20,27 @@ template<typename T>
 struct hash {
   hash_value_t operator()(const T &t) const { return murmurhash2(t); }
 };
+// integer keys only need their bits mixed: a few multiplies and shifts
+// instead of the byte loop of murmurhash2
+INLINE u32 hashint(u32 x) {
+  x ^= x >> 16; x *= 0x7feb352du;
+  x ^= x >> 15; x *= 0x846ca68bu;
+  return x ^ (x >> 16);
+}
+INLINE u32 hashint(u64 x) {
+  x ^= x >> 33; x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ull;
+  return u32(x ^ (x >> 33));
+}
+#define HASHINT(T, U) template<> struct hash<T> {\
+  hash_value_t operator()(T x) const { return hashint(U(x)); }\
+};
+HASHINT(s32, u32)
+HASHINT(u32, u32)
+HASHINT(s64, u64)
+HASHINT(u64, u64)
+#undef HASHINT
+
 template<>
 struct hash<const char*> {
   hash_value_t operator()(const char *str) const {
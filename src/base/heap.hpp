@@ -0,0 +1,87 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - heap.hpp -> binary min heap indexed by key (with decrease/increase key)
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "base/vector.hpp"
+
+namespace q {
+// keys are integers in [0,keynum). each key is stored at most once and its
+// priority can be changed or removed in o(log n) since we track its position
+template <typename T> struct indexedheap : noncopyable {
+  INLINE void init(int keynum) {
+    heap.setsize(0);
+    pos.setsize(keynum);
+    value.setsize(keynum);
+    loopv(pos) pos[i] = -1;
+  }
+  INLINE bool empty() const { return heap.length() == 0; }
+  INLINE int length() const { return heap.length(); }
+  INLINE bool contains(int key) const { return pos[key] != -1; }
+  INLINE int top() const { return heap[0]; }
+  INLINE const T &get(int key) const { return value[key]; }
+
+  // insert the key or change its priority
+  void update(int key, const T &x) {
+    if (!contains(key)) {
+      value[key] = x;
+      pos[key] = heap.length();
+      heap.add(key);
+      upheap(pos[key]);
+    } else if (x < value[key]) {
+      value[key] = x;
+      upheap(pos[key]);
+    } else {
+      value[key] = x;
+      downheap(pos[key]);
+    }
+  }
+
+  void remove(int key) {
+    const auto i = pos[key];
+    if (i == -1) return;
+    const auto last = heap.pop();
+    pos[key] = -1;
+    if (i == heap.length()) return;
+    heap[i] = last;
+    pos[last] = i;
+    downheap(upheap(i));
+  }
+
+  int pop() {
+    const auto key = top();
+    remove(key);
+    return key;
+  }
+
+private:
+  static INLINE int parent(int i) { return (i - 1) >> 1; }
+  static INLINE int child(int i) { return (i << 1) + 1; }
+  INLINE bool less(int i, int j) const { return value[heap[i]] < value[heap[j]]; }
+  INLINE void swapnodes(int i, int j) {
+    swap(heap[i], heap[j]);
+    pos[heap[i]] = i;
+    pos[heap[j]] = j;
+  }
+  int upheap(int i) {
+    while (i > 0 && less(i, parent(i))) {
+      swapnodes(i, parent(i));
+      i = parent(i);
+    }
+    return i;
+  }
+  void downheap(int i) {
+    for (;;) {
+      auto ci = child(i);
+      if (ci >= heap.length()) break;
+      if (ci+1 < heap.length() && less(ci+1, ci)) ++ci;
+      if (!less(ci, i)) break;
+      swapnodes(i, ci);
+      i = ci;
+    }
+  }
+  vector<int> heap, pos;
+  vector<T> value;
+};
+} /* namespace q */
+
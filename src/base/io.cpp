@@ -0,0 +1,84 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - io.cpp -> implements asynchronous file reads
+ -------------------------------------------------------------------------*/
+#include "io.hpp"
+#include "pack.hpp"
+#include "task.hpp"
+#include "vector.hpp"
+#include <SDL/SDL_thread.h>
+
+namespace q {
+namespace io {
+
+// reads block: they run on their own threads rather than on the workers
+// which keep computing meanwhile. requests are served in order
+static const u32 IOTHREADNUM = 2;
+struct request { file *f; task *next; };
+static SDL_mutex *mutex = NULL;
+static SDL_cond *cond = NULL;
+static vector<SDL_Thread*> threads;
+static vector<request> requests;
+static u32 first = 0; // first pending request
+static bool terminate = false;
+
+file::~file(void) { if (data) FREE(data); }
+
+// pending requests are still served when we terminate
+static int threadfunc(void*) {
+  for (;;) {
+    SDL_LockMutex(mutex);
+    while (first == u32(requests.length()) && !terminate) SDL_CondWait(cond, mutex);
+    if (first == u32(requests.length())) {
+      SDL_UnlockMutex(mutex);
+      break;
+    }
+    const auto r = requests[first++];
+    if (first == u32(requests.length())) {
+      requests.setsize(0);
+      first = 0;
+    }
+    SDL_UnlockMutex(mutex);
+    r.f->data = pack::loadfile(r.f->name.c_str(), &r.f->size);
+    storerelease(&r.f->done, 1);
+    if (r.next) r.next->unhold();
+    r.f->release();
+  }
+  return 0;
+}
+
+void start(void) {
+  mutex = SDL_CreateMutex();
+  cond = SDL_CreateCond();
+  terminate = false;
+  loopi(s32(IOTHREADNUM)) threads.add(SDL_CreateThread(threadfunc, "io thread", NULL));
+}
+
+void finish(void) {
+  SDL_LockMutex(mutex);
+  terminate = true;
+  SDL_CondBroadcast(cond);
+  SDL_UnlockMutex(mutex);
+  loopv(threads) SDL_WaitThread(threads[i], NULL);
+  vector<SDL_Thread*>().moveto(threads);
+  vector<request>().moveto(requests);
+  SDL_DestroyCond(cond);
+  SDL_DestroyMutex(mutex);
+  cond = NULL;
+  mutex = NULL;
+}
+
+ref<file> read(const char *name, task *next) {
+  // our reference is taken before the io thread may drop its own one
+  ref<file> f = NEW(file, name);
+  f->acquire();
+  if (next) next->hold();
+  const request r = {f, next};
+  SDL_LockMutex(mutex);
+  requests.add(r);
+  SDL_CondSignal(cond);
+  SDL_UnlockMutex(mutex);
+  return f;
+}
+} /* namespace io */
+} /* namespace q */
@@ -0,0 +1,33 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - io.hpp -> exposes asynchronous file reads
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "sys.hpp"
+#include "ref.hpp"
+#include "string.hpp"
+
+namespace q {
+class task;
+namespace io {
+
+// the io threads belong to the tasking system which starts and stops them
+void start(void);
+void finish(void);
+
+// a file read by the io threads. the data (zero terminated, NULL if the
+// file is missing) may be used once done is set or the next task started
+struct file : public refcount {
+  INLINE file(const char *name) : name(name), data(NULL), size(0), done(0) {}
+  ~file(void);
+  fixedstring name;
+  char *data;
+  int size;
+  volatile s32 done;
+};
+
+// same lookup as pack::loadfile. "next" (still unscheduled) is held until
+// the data is in memory such that it only starts once scheduled and read
+ref<file> read(const char *name, task *next = NULL);
+} /* namespace io */
+} /* namespace q */
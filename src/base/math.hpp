@@ -737,7 +737,7 @@ template <typename T> struct interval {
 TINLINE itv op- (itvarg x)  {return itv(-x.M,-x.m);}
 TINLINE itv op+ (itvarg x)  {return itv(+x.m,+x.M);}
 TINLINE itv op+ (itvarg x, itvarg y) {return itv(x.m+y.m,x.M+y.M);}
-TINLINE itv op- (itvarg x, itvarg y) {return itv(x.m+(-y.m),x.M+(-y.M));}
+TINLINE itv op- (itvarg x, itvarg y) {return itv(x.m-y.M,x.M-y.m);}
 TINLINE itv op* (itvarg x, itvarg y) {
   return itv(min(x.m*y.m, x.M*y.m, x.M*y.M, x.m*y.M),
              max(x.m*y.m, x.M*y.m, x.M*y.M, x.m*y.M));
@@ -860,6 +860,39 @@ struct aabb {
   static INLINE aabb all() { return aabb(-FLT_MAX, FLT_MAX); }
   vec3f pmin, pmax;
 };
+// morton codes interleave the bits of the three coordinates: 10 bits per
+// axis in 32 bits and 21 bits per axis in 64 bits
+INLINE u32 spreadbits(u32 x) {
+  x &= 0x3ff;
+  x = (x | x << 16) & 0x030000ff;
+  x = (x | x << 8)  & 0x0300f00f;
+  x = (x | x << 4)  & 0x030c30c3;
+  x = (x | x << 2)  & 0x09249249;
+  return x;
+}
+INLINE u64 spreadbits(u64 x) {
+  x &= 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffffull;
+  x = (x | x << 16) & 0x1f0000ff0000ffull;
+  x = (x | x << 8)  & 0x100f00f00f00f00full;
+  x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+  x = (x | x << 2)  & 0x1249249249249249ull;
+  return x;
+}
+INLINE u32 morton(u32 x, u32 y, u32 z) {
+  return spreadbits(x) | spreadbits(y) << 1 | spreadbits(z) << 2;
+}
+INLINE u64 morton(u64 x, u64 y, u64 z) {
+  return spreadbits(x) | spreadbits(y) << 1 | spreadbits(z) << 2;
+}
+// 30 bits code of a point quantized in the given box
+INLINE u32 morton(const vec3f &p, const aabb &box) {
+  const auto ext = box.pmax - box.pmin;
+  const auto scale = 1024.f * (1.f-1e-5f) / max(ext, vec3f(FLT_MIN));
+  const auto q = clamp((p - box.pmin) * scale, vec3f(zero), vec3f(1023.f));
+  return morton(u32(q.x), u32(q.y), u32(q.z));
+}
+
 INLINE aabb sum(const aabb &b0, const aabb &b1) {
   return aabb(min(b0.pmin, b1.pmin), max(b0.pmax, b1.pmax));
 }
@@ -870,6 +903,15 @@ INLINE bool intersect(const aabb &b0, const aabb &b1) {
   return !(any(gt(b0.pmin, b1.pmax)) || any(gt(b1.pmin, b0.pmax)));
 }
 
+// box of an affinely transformed box. its center goes through the transform
+// and its half extent through the absolute value of the linear part
+INLINE aabb xfmbox(const mat3x3f &m, const vec3f &t, const aabb &box) {
+  const auto c = xfmpoint(m, 0.5f*(box.pmin+box.pmax)) + t;
+  const auto h = 0.5f*(box.pmax-box.pmin);
+  const auto e = h.x*abs(m.vx) + h.y*abs(m.vy) + h.z*abs(m.vz);
+  return aabb(c-e, c+e);
+}
+
 struct isecres {
   INLINE isecres(bool isec, float t = FLT_MAX) : t(t), isec(isec) {}
   float t;
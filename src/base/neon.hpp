@@ -0,0 +1,184 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - neon.hpp -> sse2 intrinsics implemented with arm neon
+ -------------------------------------------------------------------------*/
+#pragma once
+#if !defined(__aarch64__)
+#error "neon.hpp needs aarch64"
+#endif
+#include <arm_neon.h>
+#include <stdint.h>
+
+// ssef, ssei, sseb and all the code written over them use the subset below.
+// only sse2 is provided: __SSE3__ and __SSE4_1__ stay undefined and their
+// fallbacks are taken. lanes and bits are the same as on x86
+typedef float32x4_t __m128;
+typedef int32x4_t __m128i;
+typedef float64x2_t __m128d;
+
+#define _MM_SHUFFLE(fp3,fp2,fp1,fp0) (((fp3)<<6)|((fp2)<<4)|((fp1)<<2)|(fp0))
+
+/*-------------------------------------------------------------------------
+ - casts
+ -------------------------------------------------------------------------*/
+INLINE __m128 _mm_castsi128_ps(__m128i a) {return vreinterpretq_f32_s32(a);}
+INLINE __m128i _mm_castps_si128(__m128 a) {return vreinterpretq_s32_f32(a);}
+INLINE __m128d _mm_castps_pd(__m128 a) {return vreinterpretq_f64_f32(a);}
+INLINE __m128 _mm_castpd_ps(__m128d a) {return vreinterpretq_f32_f64(a);}
+INLINE __m128d _mm_castsi128_pd(__m128i a) {return vreinterpretq_f64_s32(a);}
+INLINE __m128i _mm_castpd_si128(__m128d a) {return vreinterpretq_s32_f64(a);}
+
+/*-------------------------------------------------------------------------
+ - floats
+ -------------------------------------------------------------------------*/
+INLINE __m128 _mm_setzero_ps() {return vdupq_n_f32(0.f);}
+INLINE __m128 _mm_set1_ps(float a) {return vdupq_n_f32(a);}
+INLINE __m128 _mm_set_ps(float d, float c, float b, float a) {
+  const float32x4_t r = {a,b,c,d};
+  return r;
+}
+INLINE __m128 _mm_load_ps(const float *p) {return vld1q_f32(p);}
+INLINE __m128 _mm_loadu_ps(const float *p) {return vld1q_f32(p);}
+INLINE __m128 _mm_load_ss(const float *p) {return vsetq_lane_f32(*p, vdupq_n_f32(0.f), 0);}
+INLINE void _mm_store_ps(float *p, __m128 a) {vst1q_f32(p, a);}
+INLINE void _mm_storeu_ps(float *p, __m128 a) {vst1q_f32(p, a);}
+INLINE float _mm_cvtss_f32(__m128 a) {return vgetq_lane_f32(a, 0);}
+
+INLINE __m128 _mm_add_ps(__m128 a, __m128 b) {return vaddq_f32(a, b);}
+INLINE __m128 _mm_sub_ps(__m128 a, __m128 b) {return vsubq_f32(a, b);}
+INLINE __m128 _mm_mul_ps(__m128 a, __m128 b) {return vmulq_f32(a, b);}
+INLINE __m128 _mm_div_ps(__m128 a, __m128 b) {return vdivq_f32(a, b);}
+INLINE __m128 _mm_sqrt_ps(__m128 a) {return vsqrtq_f32(a);}
+
+// x86 returns b when either one is a nan (fmin and fmax do not). the ray box
+// slabs rely on it to drop the nans of 0*inf
+INLINE __m128 _mm_min_ps(__m128 a, __m128 b) {return vbslq_f32(vcltq_f32(a, b), a, b);}
+INLINE __m128 _mm_max_ps(__m128 a, __m128 b) {return vbslq_f32(vcgtq_f32(a, b), a, b);}
+
+// the neon estimates have 8 bits against 12 on x86: one newton step brings
+// them to the same precision or better before the one done by ssef
+INLINE __m128 _mm_rcp_ps(__m128 a) {
+  const auto r = vrecpeq_f32(a);
+  return vmulq_f32(r, vrecpsq_f32(a, r));
+}
+INLINE __m128 _mm_rsqrt_ps(__m128 a) {
+  const auto r = vrsqrteq_f32(a);
+  return vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(r, r), a)); // r*r first: a=0 gives inf
+}
+
+#define NEON_BITWISE(NAME, OP)\
+INLINE __m128 NAME(__m128 a, __m128 b) {\
+  return vreinterpretq_f32_u32(OP(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b)));\
+}
+NEON_BITWISE(_mm_and_ps, vandq_u32)
+NEON_BITWISE(_mm_or_ps, vorrq_u32)
+NEON_BITWISE(_mm_xor_ps, veorq_u32)
+#undef NEON_BITWISE
+INLINE __m128 _mm_andnot_ps(__m128 a, __m128 b) {
+  return vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(b), vreinterpretq_u32_f32(a)));
+}
+
+// the negated ones are true with nans as on x86
+INLINE __m128 _mm_cmpeq_ps(__m128 a, __m128 b) {return vreinterpretq_f32_u32(vceqq_f32(a, b));}
+INLINE __m128 _mm_cmplt_ps(__m128 a, __m128 b) {return vreinterpretq_f32_u32(vcltq_f32(a, b));}
+INLINE __m128 _mm_cmple_ps(__m128 a, __m128 b) {return vreinterpretq_f32_u32(vcleq_f32(a, b));}
+INLINE __m128 _mm_cmpneq_ps(__m128 a, __m128 b) {return vreinterpretq_f32_u32(vmvnq_u32(vceqq_f32(a, b)));}
+INLINE __m128 _mm_cmpnlt_ps(__m128 a, __m128 b) {return vreinterpretq_f32_u32(vmvnq_u32(vcltq_f32(a, b)));}
+INLINE __m128 _mm_cmpnle_ps(__m128 a, __m128 b) {return vreinterpretq_f32_u32(vmvnq_u32(vcleq_f32(a, b)));}
+
+INLINE int _mm_movemask_ps(__m128 a) {
+  const int32x4_t shift = {0,1,2,3};
+  const auto sign = vshrq_n_u32(vreinterpretq_u32_f32(a), 31);
+  return int(vaddvq_u32(vshlq_u32(sign, shift)));
+}
+
+INLINE __m128 _mm_unpacklo_ps(__m128 a, __m128 b) {return vzip1q_f32(a, b);}
+INLINE __m128 _mm_unpackhi_ps(__m128 a, __m128 b) {return vzip2q_f32(a, b);}
+
+// the selector is a constant at every call site and the compiler folds the
+// lane copies in a dup, ext or zip
+INLINE __m128 _mm_shuffle_ps(__m128 a, __m128 b, int imm) {
+  const float32x4_t r = {a[imm&3], a[(imm>>2)&3], b[(imm>>4)&3], b[(imm>>6)&3]};
+  return r;
+}
+
+/*-------------------------------------------------------------------------
+ - integers
+ -------------------------------------------------------------------------*/
+INLINE __m128i _mm_setzero_si128() {return vdupq_n_s32(0);}
+INLINE __m128i _mm_set1_epi32(int a) {return vdupq_n_s32(a);}
+INLINE __m128i _mm_set_epi32(int d, int c, int b, int a) {
+  const int32x4_t r = {a,b,c,d};
+  return r;
+}
+INLINE __m128i _mm_set1_epi8(char a) {return vreinterpretq_s32_s8(vdupq_n_s8(int8_t(a)));}
+INLINE __m128i _mm_cvtsi32_si128(int a) {return vsetq_lane_s32(a, vdupq_n_s32(0), 0);}
+INLINE __m128i _mm_load_si128(const __m128i *p) {return vld1q_s32((const int32_t*) p);}
+INLINE __m128i _mm_loadu_si128(const __m128i *p) {return vld1q_s32((const int32_t*) p);}
+INLINE void _mm_store_si128(__m128i *p, __m128i a) {vst1q_s32((int32_t*) p, a);}
+INLINE void _mm_storeu_si128(__m128i *p, __m128i a) {vst1q_s32((int32_t*) p, a);}
+
+INLINE __m128i _mm_add_epi32(__m128i a, __m128i b) {return vaddq_s32(a, b);}
+INLINE __m128i _mm_sub_epi32(__m128i a, __m128i b) {return vsubq_s32(a, b);}
+INLINE __m128i _mm_and_si128(__m128i a, __m128i b) {return vandq_s32(a, b);}
+INLINE __m128i _mm_or_si128(__m128i a, __m128i b) {return vorrq_s32(a, b);}
+INLINE __m128i _mm_xor_si128(__m128i a, __m128i b) {return veorq_s32(a, b);}
+INLINE __m128i _mm_andnot_si128(__m128i a, __m128i b) {return vbicq_s32(b, a);}
+
+// shifts by a register: ssei shifts by variables too. neon also gives zero
+// (or the sign) past 31
+INLINE __m128i _mm_slli_epi32(__m128i a, int n) {return vshlq_s32(a, vdupq_n_s32(n));}
+INLINE __m128i _mm_srai_epi32(__m128i a, int n) {return vshlq_s32(a, vdupq_n_s32(-n));}
+INLINE __m128i _mm_srli_epi32(__m128i a, int n) {
+  return vreinterpretq_s32_u32(vshlq_u32(vreinterpretq_u32_s32(a), vdupq_n_s32(-n)));
+}
+
+INLINE __m128i _mm_cmpeq_epi32(__m128i a, __m128i b) {return vreinterpretq_s32_u32(vceqq_s32(a, b));}
+INLINE __m128i _mm_cmplt_epi32(__m128i a, __m128i b) {return vreinterpretq_s32_u32(vcltq_s32(a, b));}
+INLINE __m128i _mm_cmpgt_epi32(__m128i a, __m128i b) {return vreinterpretq_s32_u32(vcgtq_s32(a, b));}
+
+// round to nearest even as the default mxcsr does
+INLINE __m128i _mm_cvtps_epi32(__m128 a) {return vcvtnq_s32_f32(a);}
+INLINE __m128 _mm_cvtepi32_ps(__m128i a) {return vcvtq_f32_s32(a);}
+
+INLINE __m128i _mm_shuffle_epi32(__m128i a, int imm) {
+  const int32x4_t r = {a[imm&3], a[(imm>>2)&3], a[(imm>>4)&3], a[(imm>>6)&3]};
+  return r;
+}
+INLINE __m128i _mm_unpacklo_epi8(__m128i a, __m128i b) {
+  return vreinterpretq_s32_s8(vzip1q_s8(vreinterpretq_s8_s32(a), vreinterpretq_s8_s32(b)));
+}
+INLINE __m128i _mm_unpacklo_epi16(__m128i a, __m128i b) {
+  return vreinterpretq_s32_s16(vzip1q_s16(vreinterpretq_s16_s32(a), vreinterpretq_s16_s32(b)));
+}
+INLINE __m128i _mm_cmpeq_epi8(__m128i a, __m128i b) {
+  return vreinterpretq_s32_u8(vceqq_s8(vreinterpretq_s8_s32(a), vreinterpretq_s8_s32(b)));
+}
+
+// the sign bits weighted by their position and summed per half
+INLINE int _mm_movemask_epi8(__m128i a) {
+  const int8x16_t shift = {0,1,2,3,4,5,6,7,0,1,2,3,4,5,6,7};
+  const auto bits = vshlq_u8(vshrq_n_u8(vreinterpretq_u8_s32(a), 7), shift);
+  return int(vaddv_u8(vget_low_u8(bits))) | (int(vaddv_u8(vget_high_u8(bits))) << 8);
+}
+
+/*-------------------------------------------------------------------------
+ - control. only the flush to zero bits of the mxcsr (ftz and daz) exist:
+ - they both map to fpcr.fz which flushes inputs and outputs
+ -------------------------------------------------------------------------*/
+INLINE void _mm_pause() {asm volatile("yield" ::: "memory");}
+
+INLINE unsigned int _mm_getcsr() {
+  uint64_t fpcr;
+  asm volatile("mrs %0, fpcr" : "=r"(fpcr));
+  return 0x1f80u | ((fpcr & (uint64_t(1)<<24)) ? 0x8040u : 0u);
+}
+INLINE void _mm_setcsr(unsigned int csr) {
+  uint64_t fpcr;
+  asm volatile("mrs %0, fpcr" : "=r"(fpcr));
+  if (csr & 0x8040u)
+    fpcr |= uint64_t(1)<<24;
+  else
+    fpcr &= ~(uint64_t(1)<<24);
+  asm volatile("msr fpcr, %0" :: "r"(fpcr));
+}
@@ -0,0 +1,161 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - pack.cpp -> implements the memory mapped asset pack
+ -------------------------------------------------------------------------*/
+#include "pack.hpp"
+#include "hash.hpp"
+#include "string.hpp"
+#include "algorithm.hpp"
+#include <cstdio>
+
+namespace q {
+namespace pack {
+
+/*-------------------------------------------------------------------------
+ - the header is followed by the payloads (16 bytes aligned), the table of
+ - content sorted by name hash and the zero terminated names. nothing is
+ - read at start beyond the table: the payloads are only touched when used
+ -------------------------------------------------------------------------*/
+static const u32 MAGIC = 0x6b637071, VERSION = 1, ALIGNMENT = 16;
+struct header { u32 magic, version, entrynum, pad; u64 tocoffset, namesoffset; };
+struct tocentry { u32 hash, kind, nameoffset, pad; u64 offset, size; };
+
+static char *mapping = NULL;
+static size_t mappingsize = 0;
+static const tocentry *toc = NULL;
+static const char *names = NULL;
+static u32 entrynum = 0;
+
+// one name for a path whatever the path divider
+static u32 normalize(const char *name, fixedstring &dst) {
+  u32 len = 0;
+  for (; name[len] && len < MAXDEFSTR-1; ++len)
+    dst[len] = name[len] == '\\' ? '/' : name[len];
+  dst[len] = 0;
+  return len;
+}
+
+bool start(const char *filename) {
+  finish();
+  size_t size = 0;
+  const auto data = (char*) sys::mapfile(filename, &size);
+  if (data == NULL) return false;
+  const auto h = (const header*) data;
+  auto ok = size >= sizeof(header) && h->magic == MAGIC && h->version == VERSION;
+  ok = ok && h->tocoffset <= size &&
+       u64(h->entrynum)*sizeof(tocentry) <= size-h->tocoffset &&
+       h->namesoffset < size && data[size-1] == 0;
+  if (ok) {
+    const auto entries = (const tocentry*) (data+h->tocoffset);
+    loopi(s32(h->entrynum)) {
+      const auto &e = entries[i];
+      ok = ok && e.offset <= size && e.size <= size-e.offset &&
+           e.nameoffset < size-h->namesoffset;
+    }
+  }
+  if (!ok) {
+    printf("pack: %s is not a valid pack\n", filename);
+    sys::unmapfile(data, size);
+    return false;
+  }
+  mapping = data;
+  mappingsize = size;
+  toc = (const tocentry*) (data+h->tocoffset);
+  names = data+h->namesoffset;
+  entrynum = h->entrynum;
+  return true;
+}
+
+void finish() {
+  if (mapping) sys::unmapfile(mapping, mappingsize);
+  mapping = NULL;
+  mappingsize = 0;
+  toc = NULL;
+  names = NULL;
+  entrynum = 0;
+}
+
+bool find(const char *name, u32 kind, entry &e) {
+  if (entrynum == 0) return false;
+  fixedstring key;
+  const auto len = normalize(name, key);
+  const auto hash = murmurhash2(key.c_str(), len);
+  u32 first = 0, last = entrynum;
+  while (first < last) {
+    const auto mid = (first+last)/2;
+    if (toc[mid].hash < hash) first = mid+1; else last = mid;
+  }
+  for (; first < entrynum && toc[first].hash == hash; ++first) {
+    const auto &t = toc[first];
+    if (t.kind != kind || strcmp(names+t.nameoffset, key.c_str())) continue;
+    e.data = mapping+t.offset;
+    e.size = u32(t.size);
+    return true;
+  }
+  return false;
+}
+
+char *loadfile(const char *fn, int *size) {
+  entry e;
+  if (!find(fn, RAW, e)) return sys::loadfile(fn, size);
+  auto buf = (char*) MALLOC(e.size+1);
+  if (!buf) return NULL;
+  memcpy(buf, e.data, e.size);
+  buf[e.size] = 0;
+  if (size!=NULL) *size = int(e.size);
+  return buf;
+}
+
+writer::~writer() { loopv(items) FREE(items[i].name); }
+
+void writer::add(const char *name, u32 kind, const void *data, u32 size) {
+  fixedstring key;
+  normalize(name, key);
+  const auto offset = u32(blob.length());
+  const item it = {NEWSTRING(key.c_str()), kind, offset, size};
+  items.add(it);
+  blob.setsize(offset + ((size+ALIGNMENT-1) & ~(ALIGNMENT-1)), noinitialize);
+  const auto dst = blob.getbuf()+offset;
+  if (size) memcpy(dst, data, size);
+  memset(dst+size, 0, blob.length()-offset-size);
+}
+
+static INLINE bool cmphash(const tocentry &a, const tocentry &b) {
+  return a.hash < b.hash;
+}
+
+bool writer::write(const char *filename) {
+  vector<tocentry> entries;
+  vector<char> strings;
+  loopv(items) {
+    const auto &it = items[i];
+    const auto len = u32(strlen(it.name));
+    const tocentry e = {
+      murmurhash2(it.name, len), it.kind, u32(strings.length()), 0,
+      u64(sizeof(header)+it.offset), u64(it.size)
+    };
+    entries.add(e);
+    loopj(s32(len+1)) strings.add(it.name[j]);
+  }
+  if (entries.length()) quicksort(entries.begin(), entries.end(), cmphash);
+  if (strings.length() == 0) strings.add(0);
+
+  auto f = fopen(filename, "wb");
+  if (f == NULL) return false;
+  const auto tocoffset = u64(sizeof(header)+blob.length());
+  const header h = {
+    MAGIC, VERSION, u32(entries.length()), 0,
+    tocoffset, tocoffset+entries.length()*sizeof(tocentry)
+  };
+  auto ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  if (blob.length())
+    ok = ok && fwrite(&blob[0], blob.length(), 1, f) == 1;
+  if (entries.length())
+    ok = ok && fwrite(&entries[0], entries.length()*sizeof(tocentry), 1, f) == 1;
+  ok = ok && fwrite(&strings[0], strings.length(), 1, f) == 1;
+  fclose(f);
+  return ok;
+}
+} /* namespace pack */
+} /* namespace q */
+
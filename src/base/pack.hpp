@@ -0,0 +1,40 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - pack.hpp -> exposes the memory mapped asset pack
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "sys.hpp"
+#include "vector.hpp"
+
+namespace q {
+namespace pack {
+
+// what an entry holds. every module writes and reads its own payloads so
+// that textures are already decoded, sounds already resampled and so on
+enum { RAW, TEXTURE, SOUND, MODEL };
+
+struct entry {
+  const void *data;
+  u32 size;
+};
+
+// map the pack. without one, everything comes from the loose files
+bool start(const char *filename);
+void finish();
+// entry of the given path and kind. the data stays mapped until finish
+bool find(const char *name, u32 kind, entry &e);
+// raw entry of the pack or the file itself. same contract as sys::loadfile
+char *loadfile(const char *fn, int *size=NULL);
+
+// builds a pack offline. entries are copied when added
+struct writer : noncopyable {
+  ~writer();
+  void add(const char *name, u32 kind, const void *data, u32 size);
+  bool write(const char *filename);
+  struct item { char *name; u32 kind, offset, size; };
+  vector<item> items;
+  vector<char> blob;
+};
+} /* namespace pack */
+} /* namespace q */
+
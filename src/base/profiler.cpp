@@ -0,0 +1,299 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - profiler.cpp -> implements the phase profiler and the zones
+ -------------------------------------------------------------------------*/
+#include "profiler.hpp"
+#include "console.hpp"
+#include "string.hpp"
+#include "math.hpp"
+#include "script.hpp"
+#include <cstdio>
+
+namespace q {
+namespace profiler {
+
+// what one thread measured for one phase. times are in microseconds
+struct slot {
+  u64 first, last, busy, peak;
+  u32 calls;
+};
+
+static const char *names[MAXPHASENUM];
+static s32 phasenum = 0, threadnum = 0;
+static slot slots[MAXTHREADNUM][MAXPHASENUM];
+
+// threads get their slots on first use. extra threads share the last ones
+static THREAD s32 threadslot = -1;
+static INLINE slot &getslot(u32 phase) {
+  if (threadslot == -1)
+    threadslot = min(atomic_add(&threadnum, 1), s32(MAXTHREADNUM)-1);
+  return slots[threadslot][phase];
+}
+
+u32 phase(const char *name) {
+  const auto id = atomic_add(&phasenum, 1);
+  assert(id < s32(MAXPHASENUM));
+  names[id] = name;
+  return u32(id);
+}
+
+void begin(u32 phase, u64 &start) {
+  auto &s = getslot(phase);
+  start = sys::micros();
+  s.peak = max(s.peak, sys::memused());
+  if (s.calls == 0 || start < s.first) s.first = start;
+  if (zoneson()) zonebegin(names[phase]);
+}
+
+void end(u32 phase, u64 start) {
+  auto &s = getslot(phase);
+  const auto now = sys::micros();
+  s.peak = max(s.peak, sys::memused());
+  s.last = max(s.last, now);
+  s.busy += now-start;
+  ++s.calls;
+  zoneend(names[phase]);
+}
+
+void reset() {
+  memset(slots, 0, sizeof(slots));
+  sys::memresetpeak();
+}
+
+// merge the slots of all threads for one phase
+static slot gather(u32 phase) {
+  slot all;
+  ZERO(&all);
+  const auto n = min(threadnum, s32(MAXTHREADNUM));
+  loopi(n) {
+    const auto &s = slots[i][phase];
+    if (s.calls == 0) continue;
+    all.first = all.calls == 0 ? s.first : min(all.first, s.first);
+    all.last = max(all.last, s.last);
+    all.busy += s.busy;
+    all.peak = max(all.peak, s.peak);
+    all.calls += s.calls;
+  }
+  return all;
+}
+
+static INLINE double ms(u64 us) { return double(us)*1e-3; }
+static INLINE double mb(u64 bytes) { return double(bytes)/(1024.0*1024.0); }
+
+void report() {
+  const auto n = min(threadnum, s32(MAXTHREADNUM));
+  con::out("prof: %-16s %10s %10s %10s %8s %10s",
+           "phase", "wall ms", "busy ms", "max ms", "calls", "peak MB");
+  loopi(phasenum) {
+    const auto all = gather(i);
+    if (all.calls == 0) continue;
+    u64 maxbusy = 0;
+    loopj(n) maxbusy = max(maxbusy, slots[j][i].busy);
+    con::out("prof: %-16s %10.2f %10.2f %10.2f %8u %10.2f", names[i],
+             ms(all.last-all.first), ms(all.busy), ms(maxbusy), all.calls,
+             mb(all.peak));
+  }
+  con::out("prof: memory peak %.2f MB", mb(sys::mempeak()));
+}
+
+bool reportjson(const char *filename) {
+  auto f = fopen(filename, "w");
+  if (f == NULL) {
+    con::out("prof: unable to write %s", filename);
+    return false;
+  }
+  const auto n = min(threadnum, s32(MAXTHREADNUM));
+  fprintf(f, "{\n  \"peak_bytes\": %llu,\n  \"phases\": [",
+          (unsigned long long) sys::mempeak());
+  auto first = true;
+  loopi(phasenum) {
+    const auto all = gather(i);
+    if (all.calls == 0) continue;
+    fprintf(f, "%s\n    {\"name\": \"%s\", \"wall_ms\": %.3f, \"busy_ms\": %.3f, "
+            "\"calls\": %u, \"peak_bytes\": %llu, \"thread_busy_ms\": [",
+            first ? "" : ",", names[i], ms(all.last-all.first), ms(all.busy),
+            all.calls, (unsigned long long) all.peak);
+    loopj(n) fprintf(f, "%s%.3f", j ? ", " : "", ms(slots[j][i].busy));
+    fprintf(f, "]}");
+    first = false;
+  }
+  fprintf(f, "\n  ]\n}\n");
+  fclose(f);
+  return true;
+}
+
+/*-------------------------------------------------------------------------
+ - zones. rings live until destroyzones which bumps their generation such
+ - that the threads still running get new ones
+ -------------------------------------------------------------------------*/
+VAR(profzones, 0, 0, 1);
+struct openzone {
+  const char *name;
+  u64 begin;
+};
+struct zonering {
+  static const u32 CAPACITY = 1u<<16;
+  zone zones[CAPACITY];
+  openzone stack[MAXZONEDEPTH];
+  volatile u64 num; // zones recorded so far
+  u32 depth;        // open zones. deeper ones are not recorded
+  char name[32];
+};
+static zonering *rings[MAXTHREADNUM];
+static s32 ringnum = 0;
+static u32 ringgen = 1;
+static THREAD zonering *localring = NULL;
+static THREAD u32 localringgen = 0;
+static THREAD char localname[32];
+static u64 framebegin = 0, prevframebegin = 0;
+VARF(profallocs, 0, 0, 1, sys::memsampling(profallocs != 0));
+static const u32 FRAMESITENUM = 16;
+static sys::memsite framesites[FRAMESITENUM];
+static u32 framesitenum = 0;
+static u64 frameallocs = 0, prevallocs = 0;
+
+static zonering *getring() {
+  if (localringgen == ringgen) return localring;
+  localringgen = ringgen;
+  localring = NULL;
+  const auto id = atomic_add(&ringnum, 1);
+  if (id >= s32(MAXTHREADNUM)) return NULL;
+  const auto ring = (zonering*) MALLOC(sizeof(zonering));
+  ring->num = 0;
+  ring->depth = 0;
+  if (localname[0])
+    strcpy(ring->name, localname);
+  else
+    sprintf(ring->name, "thread %d", id);
+  storerelease(&rings[id], ring);
+  return localring = ring;
+}
+
+bool zoneson() { return profzones != 0; }
+
+void zonebegin(const char *name) {
+  const auto ring = getring();
+  if (ring == NULL) return;
+  if (ring->depth < MAXZONEDEPTH) {
+    auto &z = ring->stack[ring->depth];
+    z.name = name;
+    z.begin = sys::nanos();
+  }
+  ++ring->depth;
+}
+
+void zoneend(const char *name, s32 first, s32 last) {
+  if (localringgen != ringgen || localring == NULL) return;
+  const auto ring = localring;
+  if (ring->depth == 0) return;
+  const auto depth = ring->depth-1;
+  if (depth < MAXZONEDEPTH) {
+    const auto &open = ring->stack[depth];
+    if (open.name != name) return;
+    auto &z = ring->zones[ring->num % zonering::CAPACITY];
+    z.name = name;
+    z.begin = open.begin;
+    z.end = sys::nanos();
+    z.first = first;
+    z.last = last;
+    z.depth = depth;
+    storerelease(&ring->num, ring->num+1);
+  }
+  ring->depth = depth;
+}
+
+void setthreadname(const char *name) {
+  strncpy(localname, name, sizeof(localname)-1);
+  localname[sizeof(localname)-1] = '\0';
+  if (localringgen == ringgen && localring) strcpy(localring->name, localname);
+}
+
+void frame() {
+  prevframebegin = framebegin;
+  framebegin = sys::nanos();
+  const auto allocs = sys::memallocs();
+  frameallocs = allocs - prevallocs;
+  prevallocs = allocs;
+  framesitenum = profallocs ? sys::memsites(framesites, FRAMESITENUM) : 0;
+}
+
+u64 lastframeallocs() { return frameallocs; }
+u32 lastframesites(const sys::memsite *&sites) {
+  sites = framesites;
+  return framesitenum;
+}
+
+void lastframe(u64 &begin, u64 &end) {
+  begin = prevframebegin;
+  end = framebegin;
+}
+
+u32 zonethreadnum() { return u32(min(ringnum, s32(MAXTHREADNUM))); }
+
+const char *zonethreadname(u32 thread) {
+  const auto ring = loadacquire(&rings[thread]);
+  return ring ? ring->name : "";
+}
+
+u32 getzones(u32 thread, u64 begin, u64 end, zone *zones, u32 maxnum) {
+  const auto ring = loadacquire(&rings[thread]);
+  if (ring == NULL) return 0;
+
+  // zones are written when they end so the ring is sorted by end time
+  const u64 num = loadacquire(&ring->num);
+  const auto oldest = num > zonering::CAPACITY ? num-zonering::CAPACITY : 0;
+  u32 n = 0;
+  for (auto i = num; i > oldest && n < maxnum; --i) {
+    const auto &z = ring->zones[(i-1) % zonering::CAPACITY];
+    if (z.end < begin) break;
+    if (z.end < end) zones[n++] = z;
+  }
+  return n;
+}
+
+bool capture(const char *filename) {
+  auto f = fopen(filename, "w");
+  if (f == NULL) {
+    con::out("prof: unable to write %s", filename);
+    return false;
+  }
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  auto sep = "";
+  const auto n = zonethreadnum();
+  loopi(s32(n)) {
+    const auto ring = loadacquire(&rings[i]);
+    if (ring == NULL) continue;
+    fprintf(f, "%s\n  {\"ph\": \"M\", \"pid\": 0, \"tid\": %d, "
+            "\"name\": \"thread_name\", \"args\": {\"name\": \"%s\"}}",
+            sep, i, ring->name);
+    sep = ",";
+    const u64 num = ring->num;
+    const auto first = num > zonering::CAPACITY ? num-zonering::CAPACITY : 0;
+    for (auto j = first; j < num; ++j) {
+      const auto &z = ring->zones[j % zonering::CAPACITY];
+      fprintf(f, ",\n  {\"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"name\": \"%s\", "
+              "\"ts\": %.3f, \"dur\": %.3f", i, z.name ? z.name : "unnamed",
+              double(z.begin)*1e-3, double(z.end-z.begin)*1e-3);
+      if (z.first >= 0)
+        fprintf(f, ", \"args\": {\"first\": %d, \"last\": %d}", z.first, z.last);
+      fprintf(f, "}");
+    }
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+  return true;
+}
+static void profcapture(const char *filename) { capture(filename); }
+CMD(profcapture);
+
+void destroyzones() {
+  const auto n = zonethreadnum();
+  loopi(s32(n)) if (rings[i]) {
+    FREE(rings[i]);
+    rings[i] = NULL;
+  }
+  ringnum = 0;
+  ++ringgen;
+}
+} /* namespace profiler */
+} /* namespace q */
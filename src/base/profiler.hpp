@@ -0,0 +1,88 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - profiler.hpp -> always available phase profiler (time and memory) and zones
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "sys.hpp"
+#include "utility.hpp"
+
+namespace q {
+namespace profiler {
+
+// phases are registered once by name and timed with scopes. every thread
+// accumulates in its own slots such that timing a phase never locks
+static const u32 MAXPHASENUM = 64;
+static const u32 MAXTHREADNUM = 64;
+u32 phase(const char *name);
+void begin(u32 phase, u64 &start);
+void end(u32 phase, u64 start);
+
+struct scope : noncopyable {
+  INLINE scope(u32 phase) : id(phase) { begin(id, start); }
+  INLINE ~scope() { end(id, start); }
+  u32 id;
+  u64 start;
+};
+
+// clear all timings and the memory peak
+void reset();
+// wall time, busy time (total and per thread), calls and peak bytes seen at
+// the phase boundaries. phases never run are skipped
+void report();
+bool reportjson(const char *filename);
+
+/*-------------------------------------------------------------------------
+ - zones are nested scopes recorded with nanosecond timestamps from any
+ - thread while q.profzones is set. every thread writes its own ring and
+ - the oldest zones are overwritten when it is full. phases and the element
+ - ranges run by the tasks are zones too such that one capture shows it all
+ -------------------------------------------------------------------------*/
+static const u32 MAXZONEDEPTH = 32;
+struct zone {
+  const char *name;
+  u64 begin, end;  // nanoseconds
+  s32 first, last; // element range of the task zones. -1 otherwise
+  u32 depth;
+};
+bool zoneson();
+void zonebegin(const char *name);
+// close the innermost zone if it has this name
+void zoneend(const char *name, s32 first = -1, s32 last = -1);
+// name of the calling thread in the captures and the overlay
+void setthreadname(const char *name);
+
+// the main thread marks the frames. the overlay shows the last complete one
+void frame();
+void lastframe(u64 &begin, u64 &end);
+// allocations of the last complete frame. with q.profallocs set, they are
+// sampled by call site and the busiest sites of the frame are kept as well
+u64 lastframeallocs();
+u32 lastframesites(const sys::memsite *&sites);
+
+// zones of one thread ending in [begin,end), the most recent first. rings
+// may be written meanwhile so this is only meant for display
+u32 zonethreadnum();
+const char *zonethreadname(u32 thread);
+u32 getzones(u32 thread, u64 begin, u64 end, zone *zones, u32 maxnum);
+
+// chrome trace (chrome://tracing, perfetto) of all the recorded zones. the
+// profcapture command does the same. better done when no thread records
+bool capture(const char *filename);
+// free the rings of all threads. better done when no thread records
+void destroyzones();
+
+struct zonescope : noncopyable {
+  INLINE zonescope(const char *name) : name(name), on(zoneson()) {
+    if (on) zonebegin(name);
+  }
+  INLINE ~zonescope() { if (on) zoneend(name); }
+  const char *name;
+  bool on;
+};
+} /* namespace profiler */
+} /* namespace q */
+
+#define PROFILE_PHASE(ID, NAME) static const q::u32 ID = q::profiler::phase(NAME)
+#define PROFILE(ID) const q::profiler::scope JOIN(profile,__LINE__)(ID)
+#define PROFILE_ZONE(NAME) const q::profiler::zonescope JOIN(zone,__LINE__)(NAME)
+
@@ -7,25 +7,112 @@
 #include "client.hpp"
 #include "console.hpp"
 #include "hash_map.hpp"
+#include "pack.hpp"
 #include "base/lua/lualib.h"
 #include <cstdio>
 
 namespace q {
 namespace script {
 
-static void *internalalloc(void*, void *ptr, size_t, size_t nsize) {
-  return sys::memrealloc(ptr, nsize, __FILE__, __LINE__);
+/*-------------------------------------------------------------------------
+ - every lua state allocates from its own pool. lua gives back the size of
+ - the blocks it frees so blocks have no header: strings, tables, closures
+ - and upvalues are mostly below 256 bytes and get 8 bytes size classes cut
+ - in 16KB slabs. bigger blocks go to memrealloc. a state is only used by
+ - one thread at a time so nothing is locked. slabs go away with the state
+ -------------------------------------------------------------------------*/
+struct luapool {
+  static const size_t GRANULARITY = 8, MAXSIZE = 256, SLABSIZE = 16*1024;
+  static const u32 CLASSNUM = MAXSIZE/GRANULARITY;
+  INLINE luapool() { loopi(s32(CLASSNUM)) freelist[i] = NULL; }
+  ~luapool() { loopv(slabs) FREE(slabs[i]); }
+  static INLINE u32 sizeclass(size_t sz) { return u32((sz-1)/GRANULARITY); }
+  void *alloc(u32 cls) {
+    if (freelist[cls] == NULL) {
+      const auto size = (cls+1)*GRANULARITY;
+      const auto slab = (char*) MALLOC(SLABSIZE);
+      if (slab == NULL) return NULL;
+      slabs.add(slab);
+      for (size_t offset = 0; offset+size <= SLABSIZE; offset += size) {
+        *(void**) (slab+offset) = freelist[cls];
+        freelist[cls] = slab+offset;
+      }
+    }
+    const auto block = freelist[cls];
+    freelist[cls] = *(void**) block;
+    return block;
+  }
+  INLINE void release(void *block, u32 cls) {
+    *(void**) block = freelist[cls];
+    freelist[cls] = block;
+  }
+  void *freelist[CLASSNUM];
+  vector<void*> slabs;
+};
+
+static void *poolalloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  MEMORY_TAG(MEM_LUA);
+  auto &pool = *(luapool*) ud;
+  const auto oldpooled = ptr != NULL && osize <= luapool::MAXSIZE;
+  const auto newpooled = nsize != 0 && nsize <= luapool::MAXSIZE;
+  if (nsize == 0) {
+    if (oldpooled)
+      pool.release(ptr, luapool::sizeclass(osize));
+    else if (ptr)
+      FREE(ptr);
+    return NULL;
+  }
+  if (!oldpooled && !newpooled)
+    return sys::memrealloc(ptr, nsize, __FILE__, __LINE__);
+  if (oldpooled && newpooled &&
+      luapool::sizeclass(osize) == luapool::sizeclass(nsize))
+    return ptr;
+  const auto newptr = newpooled ? pool.alloc(luapool::sizeclass(nsize)) : MALLOC(nsize);
+  if (newptr == NULL || ptr == NULL) return newptr;
+  memcpy(newptr, ptr, min(osize, nsize));
+  if (oldpooled)
+    pool.release(ptr, luapool::sizeclass(osize));
+  else
+    FREE(ptr);
+  return newptr;
 }
 
-lua_State *luastate() {
-  static lua_State *L = NULL;
+// lua defaults are 200 and 200. scripts make a lot of short lived objects
+// so we collect a bit sooner and keep the pools small
+static const int GCPAUSE = 150, GCSTEPMUL = 200;
+
+lua_State *newstate() {
+  MEMORY_TAG(MEM_LUA);
+  const auto pool = NEWE(luapool);
+  const auto L = lua_newstate(poolalloc, pool);
   if (L == NULL) {
-    L = lua_newstate(internalalloc, NULL);
-    luaL_openlibs(L);
+    DEL(pool);
+    return NULL;
   }
+  lua_gc(L, LUA_GCSETPAUSE, GCPAUSE);
+  lua_gc(L, LUA_GCSETSTEPMUL, GCSTEPMUL);
+  luaL_openlibs(L);
+  return L;
+}
+
+void closestate(lua_State *L) {
+  void *pool = NULL;
+  lua_getallocf(L, &pool);
+  lua_close(L);
+  auto p = (luapool*) pool;
+  DEL(p);
+}
+
+lua_State *luastate() {
+  static lua_State *L = NULL;
+  if (L == NULL) L = newstate();
   return L;
 }
 
+// gc tuning of the main state. see lua_gc for their meaning
+VARF(luagcpause, 50, GCPAUSE, 1000, lua_gc(luastate(), LUA_GCSETPAUSE, luagcpause));
+VARF(luagcstepmul, 50, GCSTEPMUL, 1000, lua_gc(luastate(), LUA_GCSETSTEPMUL, luagcstepmul));
+
 struct identifier {
   int *storage;
   bool persist;
@@ -35,11 +122,11 @@ struct identifier {
 static int completesize = 0, completeidx = 0;
 
 // contains all vars/commands/aliases
-typedef hash_map<string, identifier> identifier_map;
+typedef hash_map<istring, identifier> identifier_map;
 static identifier_map *idents = NULL;
 
 void finish(void) {
-  lua_close(luastate());
+  closestate(luastate());
   SAFE_DEL(idents);
   idents = NULL;
 }
@@ -52,7 +139,7 @@ int variable(const char *name, int min, int cur, int max,
              int *storage, void (*fun)(), bool persist) {
   initializeidents();
   const identifier v = {storage, persist};
-  idents->insert(makepair(name, v));
+  idents->insert(makepair(istring(name), v));
   luabridge::getGlobalNamespace(luastate())
     .beginNamespace("q")
       .addVariable(name, storage, min, max, fun)
@@ -63,7 +150,7 @@ int variable(const char *name, int min, int cur, int max,
 bool addcommand(const char *name) {
   initializeidents();
   const identifier c = {NULL, false};
-  idents->insert(makepair(name, c));
+  idents->insert(makepair(istring(name), c));
   return false;
 }
 
@@ -83,9 +170,25 @@ int execstring(const char *p) {
   return luareport(lua_pcall(L, 0, 0, 0));
 }
 
+int compilestring(const char *p) {
+  if (*p == 0) return LUA_NOREF;
+  auto L = luastate();
+  if (luareport(luaL_loadstring(L, p))) return LUA_NOREF;
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+int execcompiled(int ref) {
+  if (ref == LUA_NOREF) return 0;
+  auto L = luastate();
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  return luareport(lua_pcall(L, 0, 0, 0));
+}
+
+void releasecompiled(int ref) { luaL_unref(luastate(), LUA_REGISTRYINDEX, ref); }
+
 bool execfile(const char *cfgfile) {
   fixedstring s(cfgfile);
-  const auto buf = sys::loadfile(sys::path(s.c_str()), NULL);
+  const auto buf = pack::loadfile(sys::path(s.c_str()), NULL);
   if (!buf) {
     con::out("unable to find %s", cfgfile);
     return false;
@@ -10,6 +10,10 @@ namespace q {
 namespace script {
 // return complete lua state
 lua_State *luastate();
+// new lua state with the standard libraries and its own allocation pool
+lua_State *newstate();
+// close a state made by newstate and release its pool
+void closestate(lua_State *L);
 // register a console variable (done through globals)
 int variable(const char *name, int min, int cur, int max, int *storage, void (*fun)(), bool persist);
 // register a new command
@@ -24,6 +28,13 @@ void writecfg();
 void finish();
 // execute a given string
 int execstring(const char *p);
+// compile a string once into a function kept by the lua state. returns
+// LUA_NOREF if the string is empty or does not compile
+int compilestring(const char *p);
+// run a function returned by compilestring
+int execcompiled(int ref);
+// release a function returned by compilestring
+void releasecompiled(int ref);
 // execute a given file and print any error in console output
 void execscript(const char *cfgfile);
 // execute a file and says if this succeeded
@@ -94,6 +94,7 @@ public:
   }
 
   using Base::insert;
+  using Base::clear;
   using Base::empty;
   using Base::size;
 };
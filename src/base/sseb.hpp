@@ -105,7 +105,7 @@ INLINE sseb andnot(const sseb& a, const sseb& b) {return _mm_andnot_ps(a.m128, b
 
 template<size_t i0, size_t i1, size_t i2, size_t i3>
 INLINE sseb shuffle(const sseb& a) {
-  return _mm_shuffle_epi32(a, _MM_SHUFFLE(i3, i2, i1, i0));
+  return _mm_castsi128_ps(_mm_shuffle_epi32(a, _MM_SHUFFLE(i3, i2, i1, i0)));
 }
 
 template<size_t i0, size_t i1, size_t i2, size_t i3>
@@ -65,5 +65,72 @@ fixedstring::fixedstring(fmttype, const char *txt, ...) {
   fmt(txt, va);
   va_end(va);
 }
-} /* namespace q */
 
+// open addressing table of the interned strings. the lock is a plain zeroed
+// integer so strings can be interned during static initialization
+static istringrep **istrings = NULL;
+static u32 istringcap = 0, istringcount = 0;
+static volatile s32 istringlock = 0;
+
+static void lockistrings() {
+  while (atomic_cmpxchg(&istringlock, 1, 0) != 0) {
+#if defined(__SSE2_INTRINSICS__)
+    _mm_pause();
+#endif
+  }
+}
+static void unlockistrings() { storerelease(&istringlock, 0); }
+
+static void growistrings() {
+  const auto newcap = istringcap ? 2*istringcap : 256;
+  const auto table = (istringrep**) MALLOC(newcap*sizeof(istringrep*));
+  memset(table, 0, newcap*sizeof(istringrep*));
+  loopi(s32(istringcap)) if (istrings[i]) {
+    auto idx = istrings[i]->hash & (newcap-1);
+    while (table[idx]) idx = (idx+1) & (newcap-1);
+    table[idx] = istrings[i];
+  }
+  FREE(istrings);
+  istrings = table;
+  istringcap = newcap;
+}
+
+istring::istring(const char *str) {
+  const auto len = u32(strlen(str));
+  const auto h = murmurhash2(str, len);
+  lockistrings();
+  if (2*(istringcount+1) > istringcap) growistrings();
+  auto idx = h & (istringcap-1);
+  for (; istrings[idx]; idx = (idx+1) & (istringcap-1)) {
+    const auto other = istrings[idx];
+    if (other->hash == h && other->len == len && !memcmp(other->str, str, len))
+      break;
+  }
+  if (istrings[idx] == NULL) {
+    const auto r = (istringrep*) MALLOC(sizeof(istringrep)+len);
+    r->hash = h;
+    r->id = istringcount++;
+    r->len = len;
+    memcpy(r->str, str, len+1);
+    istrings[idx] = r;
+  }
+  rep = istrings[idx];
+  unlockistrings();
+}
+
+u32 istringnum() {
+  lockistrings();
+  const auto n = istringcount;
+  unlockistrings();
+  return n;
+}
+
+void destroyistrings() {
+  lockistrings();
+  loopi(s32(istringcap)) if (istrings[i]) FREE(istrings[i]);
+  FREE(istrings);
+  istrings = NULL;
+  istringcap = istringcount = 0;
+  unlockistrings();
+}
+} /* namespace q */
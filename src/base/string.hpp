@@ -563,5 +563,33 @@ struct hash<string_ref> {
     return murmurhash2(str.c_str(), strlen(str.c_str()));
   }
 };
-} /* namespace q */
 
+/*-------------------------------------------------------------------------
+ - interned strings. every distinct string is stored once with its hash and
+ - a dense id so comparing or hashing them never reads the characters.
+ - interning is thread safe and strings live until destroyistrings()
+ -------------------------------------------------------------------------*/
+struct istringrep {
+  u32 hash, id, len;
+  char str[1];
+};
+struct istring {
+  INLINE istring() : rep(NULL) {}
+  explicit istring(const char *str);
+  INLINE const char *c_str() const {assert(NULL!=rep);return rep->str;}
+  INLINE u32 length() const {return rep->len;}
+  INLINE u32 id() const {return rep->id;}
+  INLINE u32 hash() const {return rep->hash;}
+  INLINE bool valid() const {return NULL!=rep;}
+  const istringrep *rep;
+};
+INLINE bool operator== (const istring &x, const istring &y) {return x.rep==y.rep;}
+INLINE bool operator!= (const istring &x, const istring &y) {return x.rep!=y.rep;}
+template<>
+struct hash<istring> {
+  INLINE hash_value_t operator()(const istring &str) const {return str.hash();}
+};
+// ids go from 0 to istringnum()-1 and may index flat arrays
+u32 istringnum();
+void destroyistrings();
+} /* namespace q */
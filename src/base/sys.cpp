@@ -6,10 +6,20 @@
 #include "intrusive_list.hpp"
 #if defined(__UNIX__)
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #endif
 #if !defined(__APPLE__)
 #include <malloc.h>
 #endif
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#if defined(__EMSCRIPTEN_PTHREADS__)
+#include <emscripten/threading.h>
+#endif
 
 namespace q {
 namespace sys {
@@ -42,36 +52,580 @@ u32 threadnumber() {
   return sysinfo.dwNumberOfProcessors;
 #endif
 }
+#elif defined(__EMSCRIPTEN_PTHREADS__)
+// the worker threads are web workers. the page preallocates one per core
+u32 threadnumber() { return u32(emscripten_num_logical_cores()); }
+#elif defined(__JAVASCRIPT__)
+u32 threadnumber() { return 1; } // no shared memory, no worker
 #else
 u32 threadnumber() { return sysconf(_SC_NPROCESSORS_CONF); }
 #endif
 
+// cpus of a node as given by a list like "0-7,16-23"
+#if defined(__linux__)
+static u32 parsecpulist(const char *str, u32 *cpus, u32 maxnum) {
+  u32 n = 0;
+  while (*str && n < maxnum) {
+    char *end;
+    const auto first = strtol(str, &end, 10);
+    if (end == str) break;
+    auto last = first;
+    if (*end == '-') last = strtol(end+1, &end, 10);
+    for (auto cpu = first; cpu <= last && n < maxnum; ++cpu) cpus[n++] = u32(cpu);
+    str = *end == ',' ? end+1 : end;
+  }
+  return n;
+}
+#endif
+
+u32 numanodenumber() {
+#if defined(__linux__)
+  u32 n = 0;
+  for (;; ++n) {
+    fixedstring name(fmt, "/sys/devices/system/node/node%u", n);
+    struct stat st;
+    if (stat(name.c_str(), &st) != 0) break;
+  }
+  return max(n, 1u);
+#elif defined(__WIN32__)
+  ULONG highest = 0;
+  return GetNumaHighestNodeNumber(&highest) ? u32(highest)+1 : 1u;
+#else
+  return 1;
+#endif
+}
+
+u32 numanodecpus(u32 node, u32 *cpus, u32 maxnum) {
+  u32 n = 0;
+#if defined(__linux__)
+  fixedstring name(fmt, "/sys/devices/system/node/node%u/cpulist", node);
+  // sysfs does not give the file size so we cannot use loadfile here
+  auto f = fopen(name.c_str(), "r");
+  if (f) {
+    char list[1024];
+    if (fgets(list, sizeof(list), f)) n = parsecpulist(list, cpus, maxnum);
+    fclose(f);
+  }
+#elif defined(__WIN32__)
+  ULONGLONG mask = 0;
+  if (GetNumaNodeProcessorMask(UCHAR(node), &mask))
+    loopi(64) if (n < maxnum && (mask & (1ull<<i))) cpus[n++] = i;
+#endif
+  // unknown topology: all cpus are in node 0
+  if (n == 0 && node == 0)
+    for (; n < min(threadnumber(), maxnum); ++n) cpus[n] = n;
+  return n;
+}
+
+bool setthreadaffinity(u32 cpu) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#elif defined(__WIN32__)
+  return cpu < 64 && SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#else
+  return false;
+#endif
+}
+
+THREAD u32 localstatslot = 0;
+static volatile s32 statslotnum = 0;
+u32 newstatslot() {
+  const auto slot = min(u32(atomic_add(&statslotnum, 1)), STATSLOTNUM-1);
+  localstatslot = slot+1;
+  return slot;
+}
+
+void printstats(const char *name, const statcounter &counter) {
+  printf("%s: %.0lf\n", name, double(counter.get()));
+}
+void printstats(const char *name, const statcounter &x, const statcounter &y, const char *yname) {
+  printf("%s: %.2lf%% (%s)\n", name, double(x.get())/double(y.get())*100.0, yname);
+}
+void printstats(const char *name, const stathistogram &histogram) {
+  s64 total = 0;
+  for (u32 b = 0; b < stathistogram::BUCKETNUM; ++b) total += histogram.get(b);
+  printf("%s: %.0lf samples\n", name, double(total));
+  if (total == 0) return;
+  for (u32 b = 0; b < stathistogram::BUCKETNUM; ++b) {
+    const auto n = histogram.get(b);
+    if (n == 0) continue;
+    const auto lo = b == 0 ? 0.0 : double(u64(1) << (b-1));
+    const auto hi = b == 0 ? 0.0 : double(u64(1) << b) - 1.0;
+    printf("  [%.0lf, %.0lf]: %.0lf (%.2lf%%)\n", lo, hi, double(n),
+           double(n)/double(total)*100.0);
+  }
+}
+
+static volatile s64 memusedbytes = 0, mempeakbytes = 0;
+static volatile s64 tagusedbytes[MEM_TAGNUM], tagpeakbytes[MEM_TAGNUM];
+static u64 tagbudget[MEM_TAGNUM];
+static volatile s64 taghugebytes[MEM_TAGNUM];
+static bool taghuge[MEM_TAGNUM] = {false, true, true, true, false, false, false};
+static THREAD u32 localtag = MEM_OTHER;
+static INLINE void trackpeak(volatile s64 *peakbytes, s64 used) {
+  for (auto peak = *peakbytes; used > peak; peak = *peakbytes)
+    if (atomic_cmpxchg(peakbytes, used, peak) == peak) break;
+}
+static void memtrack(s64 delta, u32 tag) {
+  trackpeak(&mempeakbytes, atomic_add(&memusedbytes, delta) + delta);
+  trackpeak(tagpeakbytes+tag, atomic_add(tagusedbytes+tag, delta) + delta);
+}
+
+const char *memtagname(u32 tag) {
+  static const char *names[MEM_TAGNUM] = {
+    "other", "iso", "geom", "bvh", "render", "net", "lua"
+  };
+  return tag < MEM_TAGNUM ? names[tag] : "invalid";
+}
+u32 memsettag(u32 tag) {
+  const auto prev = localtag;
+  localtag = tag < MEM_TAGNUM ? tag : u32(MEM_OTHER);
+  return prev;
+}
+u32 memgettag() { return localtag; }
+memtagstat memtagstats(u32 tag) {
+  const memtagstat stat = {
+    u64(tagusedbytes[tag]), u64(tagpeakbytes[tag]), tagbudget[tag], u64(taghugebytes[tag])
+  };
+  return stat;
+}
+void memsetbudget(u32 tag, u64 bytes) { if (tag < MEM_TAGNUM) tagbudget[tag] = bytes; }
+void memsethugepages(u32 tag, bool on) { if (tag < MEM_TAGNUM) taghuge[tag] = on; }
+
+static INLINE bool spintrylock(volatile s32 *lock) {
+  return atomic_cmpxchg(lock, 1, 0) == 0;
+}
+static INLINE void spinlock(volatile s32 *lock) {
+  while (!spintrylock(lock)) {
+#if defined(__SSE2_INTRINSICS__)
+    _mm_pause();
+#endif
+  }
+}
+static INLINE void spinunlock(volatile s32 *lock) { storerelease(lock, 0); }
+
+/*-------------------------------------------------------------------------
+ - allocation counter and call site sampling. sites are found by linear
+ - probing on the file pointer and the line number
+ -------------------------------------------------------------------------*/
+static const u32 SITENUM = 1024;
+static volatile s64 allocationnum = 0;
+static volatile bool memsampleon = false;
+static volatile s32 sitelock = 0;
+static memsite sites[SITENUM];
+
+static void memsample(const char *file, int linenum, size_t sz) {
+  atomic_add(&allocationnum, s64(1));
+  if (!memsampleon || file == NULL) return;
+  const auto h = u32((size_t(file) >> 4) * 2654435761u) ^ u32(linenum);
+  spinlock(&sitelock);
+  loopi(s32(SITENUM)) {
+    auto &s = sites[(h+u32(i)) & (SITENUM-1)];
+    if (s.file == NULL) {
+      s.file = file;
+      s.linenum = linenum;
+    } else if (s.file != file || s.linenum != linenum)
+      continue;
+    ++s.num;
+    s.bytes += sz;
+    break;
+  }
+  spinunlock(&sitelock);
+}
+
+u64 memallocs() { return u64(allocationnum); }
+void memsampling(bool on) { memsampleon = on; }
+u32 memsites(memsite *dst, u32 maxnum) {
+  u32 n = 0;
+  spinlock(&sitelock);
+  loopi(s32(SITENUM)) {
+    auto &s = sites[i];
+    if (s.file == NULL) continue;
+    // insertion in the sorted output. only the maxnum first ones are kept
+    auto j = n;
+    if (n < maxnum) ++n;
+    else if (maxnum == 0 || dst[maxnum-1].num >= s.num) j = maxnum;
+    else j = maxnum-1;
+    if (j < maxnum) {
+      for (; j > 0 && dst[j-1].num < s.num; --j) dst[j] = dst[j-1];
+      dst[j] = s;
+    }
+    s.file = NULL;
+    s.num = 0;
+    s.bytes = 0;
+  }
+  spinunlock(&sitelock);
+  return n;
+}
+
+/*-------------------------------------------------------------------------
+ - size class allocator under memalloc. small blocks are cut in 64KB slabs
+ - of one size class. each thread keeps a magazine of free blocks per class
+ - and exchanges half a magazine at once with the shared list of the class.
+ - magazines of exited threads are lost and slabs are never given back
+ -------------------------------------------------------------------------*/
+// every raw block starts with it. "size" is the size asked by the user
+struct DEFAULT_ALIGNED rawheader {
+  size_t size;
+  u16 cls; // CLASSNUM from malloc, HUGECLASS on huge pages
+  u16 tag; // memory tag the block is accounted to
+};
+static const u32 CLASSNUM = 23;
+static const u32 HUGECLASS = CLASSNUM+1;
+static const size_t MAXCLASSSIZE = 2048;
+static const size_t SLABSIZE = 64*1024;
+static const u32 MAGSIZE = 64;
+
+// 16 bytes steps up to 128 bytes then four classes per power of two
+static INLINE u32 sizeclass(size_t total) {
+  if (total <= 128) return u32(max((total+15)/16, size_t(2))-2);
+  const auto e = u32(__bsr(total-1));
+  return 7 + (e-7)*4 + u32((total-1) >> (e-2)) - 4;
+}
+static INLINE size_t classsize(u32 cls) {
+  if (cls < 7) return (cls+2)*16;
+  const auto e = 7 + (cls-7)/4;
+  return size_t(5 + (cls-7)%4) << (e-2);
+}
+
+struct sizeclassinfo {
+  volatile s32 lock;
+  void *free; // linked through their first word
+  u32 freenum, slabnum;
+  u64 allocnum, freednum;
+} CACHE_LINE_ALIGNED;
+static sizeclassinfo classes[CLASSNUM];
+
+struct magazine {
+  void *items[MAGSIZE];
+  u32 num, allocnum, freednum;
+};
+static THREAD magazine magazines[CLASSNUM];
+static bool mempooled = true;
+
+// to be called with the class locked
+static void carveslab(u32 cls) {
+  auto &c = classes[cls];
+  const auto size = classsize(cls);
+  const auto slab = (char*) malloc(SLABSIZE);
+  if (slab == NULL) return;
+  for (size_t offset = 0; offset+size <= SLABSIZE; offset += size) {
+    const auto block = slab+offset;
+    *(void**) block = c.free;
+    c.free = block;
+    ++c.freenum;
+  }
+  ++c.slabnum;
+}
+
+// move half a magazine between the thread and the class
+static void refill(magazine &m, u32 cls) {
+  auto &c = classes[cls];
+  spinlock(&c.lock);
+  if (c.freenum < MAGSIZE/2) carveslab(cls);
+  while (m.num < MAGSIZE/2 && c.free) {
+    m.items[m.num++] = c.free;
+    c.free = *(void**) c.free;
+    --c.freenum;
+  }
+  c.allocnum += m.allocnum;
+  c.freednum += m.freednum;
+  m.allocnum = m.freednum = 0;
+  spinunlock(&c.lock);
+}
+static void flush(magazine &m, u32 cls) {
+  auto &c = classes[cls];
+  spinlock(&c.lock);
+  while (m.num > MAGSIZE/2) {
+    const auto block = m.items[--m.num];
+    *(void**) block = c.free;
+    c.free = block;
+    ++c.freenum;
+  }
+  c.allocnum += m.allocnum;
+  c.freednum += m.freednum;
+  m.allocnum = m.freednum = 0;
+  spinunlock(&c.lock);
+}
+
+/*-------------------------------------------------------------------------
+ - huge pages. the mapping of a block is its size rounded up to whole pages.
+ - linux first tries the pages reserved for MAP_HUGETLB then asks for
+ - transparent ones. windows needs the privilege to lock pages in memory.
+ - when nothing works the block goes to malloc
+ -------------------------------------------------------------------------*/
+// below it a huge page would be mostly empty
+static const size_t HUGEMINSIZE = 1024*1024;
+#if defined(__WIN32__)
+static bool enablelargepages() {
+  HANDLE token;
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES|TOKEN_QUERY, &token))
+    return false;
+  TOKEN_PRIVILEGES tp;
+  tp.PrivilegeCount = 1;
+  tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+  const auto ok = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid) &&
+                  AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) &&
+                  GetLastError() == ERROR_SUCCESS;
+  CloseHandle(token);
+  return ok;
+}
+static size_t hugepagesize() {
+  static volatile s32 state = 0; // 1 with the privilege, -1 without
+  if (state == 0) state = enablelargepages() ? 1 : -1;
+  return state > 0 ? GetLargePageMinimum() : 0;
+}
+static void *hugemap(size_t len) {
+  return VirtualAlloc(NULL, len, MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES, PAGE_READWRITE);
+}
+static void hugeunmap(void *ptr, size_t) { VirtualFree(ptr, 0, MEM_RELEASE); }
+u64 memhugeresident() { return 0; }
+#elif defined(__linux__) && defined(MAP_HUGETLB) && defined(MADV_HUGEPAGE)
+static size_t hugepagesize() { return 2*1024*1024; }
+static volatile bool nohugetlb = false; // none reserved, we stop asking
+static void *hugemap(size_t len) {
+  if (!nohugetlb) {
+    const auto flags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB;
+    const auto ptr = mmap(NULL, len, PROT_READ|PROT_WRITE, flags, -1, 0);
+    if (ptr != MAP_FAILED) return ptr;
+    nohugetlb = true;
+  }
+  // transparent huge pages only back aligned ranges. we map one page more
+  // and trim it around the first boundary
+  const auto page = hugepagesize();
+  const auto raw = (char*) mmap(NULL, len+page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (raw == (char*) MAP_FAILED) return NULL;
+  const auto ptr = (char*) ALIGN(size_t(raw), page);
+  if (ptr != raw) munmap(raw, ptr-raw);
+  munmap(ptr+len, raw+page-ptr);
+  if (madvise(ptr, len, MADV_HUGEPAGE) != 0) {
+    munmap(ptr, len);
+    return NULL;
+  }
+  return ptr;
+}
+static void hugeunmap(void *ptr, size_t len) { munmap(ptr, len); }
+u64 memhugeresident() {
+  const auto f = fopen("/proc/self/smaps_rollup", "r");
+  if (f == NULL) return 0;
+  char line[256];
+  unsigned long long kb = 0;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1) break;
+  fclose(f);
+  return u64(kb)*1024;
+}
+#else
+static size_t hugepagesize() { return 0; }
+static void *hugemap(size_t) { return NULL; }
+static void hugeunmap(void*, size_t) {}
+u64 memhugeresident() { return 0; }
+#endif
+
+static INLINE bool wantshuge(size_t total, u32 tag) {
+  return taghuge[tag] && total >= HUGEMINSIZE;
+}
+static INLINE size_t hugelength(size_t total) {
+  return ALIGN(total, hugepagesize());
+}
+static rawheader *hugealloc(size_t total, u32 tag) {
+  if (hugepagesize() == 0) return NULL;
+  const auto len = hugelength(total);
+  const auto header = (rawheader*) hugemap(len);
+  if (header != NULL) atomic_add(taghugebytes+tag, s64(len));
+  return header;
+}
+static void hugefree(rawheader *header) {
+  const auto len = hugelength(header->size+sizeof(rawheader));
+  atomic_add(taghugebytes+header->tag, -s64(len));
+  hugeunmap(header, len);
+}
+
+// raw blocks return memory right after their header
+static void *rawalloc(size_t sz, u32 tag) {
+  const auto total = sz+sizeof(rawheader);
+  rawheader *header = NULL;
+  u32 cls = CLASSNUM;
+  if (wantshuge(total, tag)) {
+    header = hugealloc(total, tag);
+    if (header != NULL) cls = HUGECLASS;
+  } else if (mempooled && total <= MAXCLASSSIZE) {
+    cls = sizeclass(total);
+    auto &m = magazines[cls];
+    if (m.num == 0) refill(m, cls);
+    if (m.num != 0) {
+      header = (rawheader*) m.items[--m.num];
+      ++m.allocnum;
+    } else
+      cls = CLASSNUM;
+  }
+  if (header == NULL) header = (rawheader*) malloc(total);
+  if (header == NULL) return NULL;
+  header->size = sz;
+  header->cls = u16(cls);
+  header->tag = u16(tag);
+  return header+1;
+}
+static INLINE rawheader *rawgetheader(void *ptr) {
+  return (rawheader*) ptr - 1;
+}
+static void rawfree(void *ptr) {
+  const auto header = rawgetheader(ptr);
+  const auto cls = header->cls;
+  if (cls == CLASSNUM) {
+    free(header);
+    return;
+  }
+  if (cls == HUGECLASS) {
+    hugefree(header);
+    return;
+  }
+  auto &m = magazines[cls];
+  if (m.num == MAGSIZE) flush(m, cls);
+  m.items[m.num++] = header;
+  ++m.freednum;
+}
+static void *rawrealloc(void *ptr, size_t sz) {
+  if (ptr == NULL) return rawalloc(sz, localtag);
+  const auto header = rawgetheader(ptr);
+  const auto total = sz+sizeof(rawheader);
+  if (header->cls == HUGECLASS) {
+    // the block still fits in its pages
+    if (wantshuge(total, header->tag) &&
+        hugelength(total) == hugelength(header->size+sizeof(rawheader))) {
+      header->size = sz;
+      return ptr;
+    }
+  } else if (header->cls == CLASSNUM) {
+    // big blocks stay with malloc until they are worth huge pages
+    if ((total > MAXCLASSSIZE || !mempooled) && !wantshuge(total, header->tag)) {
+      const auto newheader = (rawheader*) realloc(header, total);
+      if (newheader == NULL) return NULL;
+      newheader->size = sz;
+      return newheader+1;
+    }
+  } else if (total <= classsize(header->cls) && (header->cls == 0 ||
+             total > classsize(header->cls-1))) {
+    // still the right class
+    header->size = sz;
+    return ptr;
+  }
+  const auto newptr = rawalloc(sz, header->tag);
+  if (newptr == NULL) return NULL;
+  memcpy(newptr, ptr, min(header->size, sz));
+  rawfree(ptr);
+  return newptr;
+}
+
+u32 mempoolstats(mempoolstat *stats, u32 maxnum) {
+  const auto n = min(maxnum, CLASSNUM);
+  loopi(s32(n)) {
+    auto &c = classes[i];
+    spinlock(&c.lock);
+    stats[i].size = u32(classsize(i));
+    stats[i].slabnum = c.slabnum;
+    stats[i].allocnum = c.allocnum;
+    stats[i].freenum = c.freednum;
+    spinunlock(&c.lock);
+  }
+  return n;
+}
+
 #if defined(MEMORY_DEBUGGER)
+struct memshard;
 struct DEFAULT_ALIGNED memblock : intrusive_list_node {
-  INLINE memblock(size_t sz, const char *file, int linenum) :
-    file(file), linenum(linenum), allocnum(0), size(sz)
+  INLINE memblock(size_t sz, const char *file, int linenum, memshard *shard) :
+    file(file), shard(shard), nextfree(NULL), linenum(linenum), allocnum(0), size(sz)
   {rbound() = lbound() = 0xdeadc0de;}
   const char *file;
+  memshard *shard;    // owner of the list the block is linked in
+  memblock *nextfree; // next block freed by another thread
   u32 linenum, allocnum, size, bound;
   INLINE u32 &rbound(void) {return *(u32*)((char*)this+sizeof(memblock)+size); }
   INLINE u32 &lbound(void) {return bound;}
 };
 
-static intrusive_list<memblock> *memlist = NULL;
-static SDL_mutex *memmutex = NULL;
-static u32 memallocnum = 0;
+// every thread links its blocks in its own shard. blocks freed by another
+// thread are pushed without lock on the "remote" stack of their shard and
+// unlinked by whoever drains it next: the owner on its next allocation or
+// the freeing thread itself if the shard is not busy. the spin lock is only
+// contended by these drains, never by the allocations of other threads
+struct memshard {
+  INLINE memshard(void) : remote(NULL), next(NULL), lock(0) {}
+  intrusive_list<memblock> list;
+  memblock *volatile remote;
+  memshard *next;
+  volatile s32 lock;
+};
+
+static memshard *volatile memshards = NULL;
+static THREAD memshard *localshard = NULL;
+static volatile s32 memallocnum = 0;
 static bool memfirstalloc = true;
 
+// to be called with the shard locked
+static void memdrain(memshard *shard) {
+  auto block = loadacquire(&shard->remote);
+  if (block == NULL) return;
+  for (;;) {
+    const auto prev = atomic_cmpxchg(&shard->remote, (memblock*) NULL, block);
+    if (prev == block) break;
+    block = prev;
+  }
+  while (block) {
+    const auto next = block->nextfree;
+    unlink(block);
+    rawfree(block);
+    block = next;
+  }
+}
+
+static memshard *memgetshard(void) {
+  if (localshard) return localshard;
+  localshard = new (malloc(sizeof(memshard))) memshard;
+  for (;;) {
+    const auto head = loadacquire(&memshards);
+    localshard->next = head;
+    if (atomic_cmpxchg(&memshards, localshard, head) == head) break;
+  }
+  return localshard;
+}
+
 static void memlinkblock(memblock *node) {
-  if (memmutex) SDL_LockMutex(memmutex);
-  node->allocnum = memallocnum++;
-  memlist->push_back(node);
-  if (memmutex) SDL_UnlockMutex(memmutex);
+  memtrack(node->size, rawgetheader(node)->tag);
+  node->allocnum = u32(atomic_add(&memallocnum, 1));
+  const auto shard = node->shard;
+  spinlock(&shard->lock);
+  memdrain(shard);
+  shard->list.push_back(node);
+  spinunlock(&shard->lock);
 }
-static void memunlinkblock(memblock *node) {
-  if (memmutex) SDL_LockMutex(memmutex);
-  unlink(node);
-  if (memmutex) SDL_UnlockMutex(memmutex);
+
+// true if the block can be released now or reused, false if it went on
+// the remote stack of its shard
+static bool memunlinkblock(memblock *node) {
+  memtrack(-s64(node->size), rawgetheader(node)->tag);
+  const auto shard = node->shard;
+  if (shard == localshard) {
+    spinlock(&shard->lock);
+    memdrain(shard);
+    unlink(node);
+    spinunlock(&shard->lock);
+    return true;
+  }
+  for (;;) {
+    const auto head = loadacquire(&shard->remote);
+    node->nextfree = head;
+    if (atomic_cmpxchg(&shard->remote, node, head) == head) break;
+  }
+  if (spintrylock(&shard->lock)) {
+    memdrain(shard);
+    spinunlock(&shard->lock);
+  }
+  return false;
 }
 
 #define MEMOUT(S,B)\
@@ -86,34 +640,43 @@ static void memcheckbounds(memblock *node) {
 }
 static void memoutputalloc(void) {
   size_t sz = 0;
-  if (memlist != NULL) {
-    for (auto it = memlist->begin(); it != memlist->end(); ++it) {
-      MEMOUT(unfreed, it);
-      fprintf(stderr, "unfreed allocation: %s\n", unfreed.c_str());
-      sz += it->size;
+  if (memshards != NULL) {
+    for (auto shard = memshards; shard != NULL; shard = shard->next) {
+      memdrain(shard);
+      auto &list = shard->list;
+      for (auto it = list.begin(); it != list.end(); ++it) {
+        MEMOUT(unfreed, it);
+        fprintf(stderr, "unfreed allocation: %s\n", unfreed.c_str());
+        sz += it->size;
+      }
     }
     if (sz > 0) fprintf(stderr, "total unfreed: %fKB \n", float(sz)/1000.f);
-    delete memlist;
+    for (auto shard = memshards; shard != NULL;) {
+      const auto next = shard->next;
+      shard->~memshard();
+      free(shard);
+      shard = next;
+    }
     _exit(EXIT_FAILURE);
   }
 }
 
 static void memonfirstalloc(void) {
   if (memfirstalloc) {
-    memlist = new intrusive_list<memblock>();
     atexit(memoutputalloc);
     memfirstalloc = false;
   }
 }
 #undef MEMOUT
 
-void memstart(void) { memmutex = SDL_CreateMutex(); }
+void memstart(bool pooled) { mempooled = pooled; }
 void *memalloc(size_t sz, const char *filename, int linenum) {
   memonfirstalloc();
   if (sz) {
+    memsample(filename, linenum, sz);
     sz = ALIGN(sz, DEFAULT_ALIGNMENT);
-    auto ptr = malloc(sz+sizeof(memblock)+sizeof(u32));
-    auto block = new (ptr) memblock(sz, filename, linenum);
+    auto ptr = rawalloc(sz+sizeof(memblock)+sizeof(u32), localtag);
+    auto block = new (ptr) memblock(sz, filename, linenum, memgetshard());
     memlinkblock(block);
     return (void*) (block+1);
   } else
@@ -125,35 +688,69 @@ void memfree(void *ptr) {
   if (ptr) {
     auto block = (memblock*)((char*)ptr-sizeof(memblock));
     memcheckbounds(block);
-    memunlinkblock(block);
-    free(block);
+    if (memunlinkblock(block)) rawfree(block);
   }
 }
 
 void *memrealloc(void *ptr, size_t sz, const char *filename, int linenum) {
   memonfirstalloc();
   auto block = ptr==NULL?(memblock*)NULL:(memblock*)((char*)ptr-sizeof(memblock));
-  if (ptr) {
-    memcheckbounds(block);
-    memunlinkblock(block);
+  if (ptr) memcheckbounds(block);
+
+  // blocks of other threads are copied since we cannot unlink them here
+  if (block && block->shard != memgetshard()) {
+    const auto newptr = memalloc(sz, filename, linenum);
+    if (newptr) memcpy(newptr, ptr, min(size_t(block->size), sz));
+    memfree(ptr);
+    return newptr;
   }
+  if (ptr) memunlinkblock(block);
   if (sz) {
+    memsample(filename, linenum, sz);
     sz = ALIGN(sz, DEFAULT_ALIGNMENT);
-    auto ptr = realloc(block, sz+sizeof(memblock)+sizeof(u32));
-    block = new (ptr) memblock(sz, filename, linenum);
+    auto ptr = rawrealloc(block, sz+sizeof(memblock)+sizeof(u32));
+    block = new (ptr) memblock(sz, filename, linenum, memgetshard());
     memlinkblock(block);
     return (void*) (block+1);
   } else if (ptr)
-    free(block);
+    rawfree(block);
   return NULL;
 }
 #else
-void memstart(void) {}
-void *memalloc(size_t sz, const char*, int) {return malloc(sz);}
-void *memrealloc(void *ptr, size_t sz, const char *, int) {return realloc(ptr,sz);}
-void memfree(void *ptr) {if (ptr) free(ptr);}
+// the raw header keeps the size of the block for memory tracking
+void memstart(bool pooled) { mempooled = pooled; }
+void *memalloc(size_t sz, const char *filename, int linenum) {
+  if (sz == 0) return NULL;
+  memsample(filename, linenum, sz);
+  const auto ptr = rawalloc(sz, localtag);
+  if (ptr) memtrack(s64(sz), localtag);
+  return ptr;
+}
+void memfree(void *ptr) {
+  if (ptr == NULL) return;
+  const auto header = rawgetheader(ptr);
+  memtrack(-s64(header->size), header->tag);
+  rawfree(ptr);
+}
+void *memrealloc(void *ptr, size_t sz, const char *filename, int linenum) {
+  if (ptr == NULL) return memalloc(sz, filename, linenum);
+  if (sz == 0) {
+    memfree(ptr);
+    return NULL;
+  }
+  const auto old = rawgetheader(ptr)->size;
+  const auto tag = u32(rawgetheader(ptr)->tag);
+  memsample(filename, linenum, sz);
+  const auto newptr = rawrealloc(ptr, sz);
+  if (newptr) memtrack(s64(sz)-s64(old), tag);
+  return newptr;
+}
 #endif // defined(MEMORY_DEBUGGER)
 
+u64 memused() { return u64(memusedbytes); }
+u64 mempeak() { return u64(mempeakbytes); }
+void memresetpeak() { mempeakbytes = memusedbytes; }
+
 void *memalignedalloc(size_t size, size_t align, const char *file, int lineno) {
   if (size == 0) return NULL;
   auto base = (char*)memalloc(size+align+sizeof(int), file, lineno);
@@ -195,6 +792,44 @@ char *loadfile(const char *fn, int *size) {
   return buf;
 }
 
+#if defined(__WIN32__)
+void *mapfile(const char *fn, size_t *size) {
+  const auto f = CreateFile(fn, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (f == INVALID_HANDLE_VALUE) return NULL;
+  LARGE_INTEGER len;
+  if (!GetFileSizeEx(f, &len) || len.QuadPart == 0) {
+    CloseHandle(f);
+    return NULL;
+  }
+  const auto mapping = CreateFileMapping(f, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  CloseHandle(f);
+  if (mapping == NULL) return NULL;
+  const auto ptr = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+  CloseHandle(mapping);
+  if (ptr != NULL && size != NULL) *size = size_t(len.QuadPart);
+  return ptr;
+}
+void unmapfile(void *ptr, size_t) { if (ptr) UnmapViewOfFile(ptr); }
+#else
+void *mapfile(const char *fn, size_t *size) {
+  const auto fd = open(fn, O_RDONLY);
+  if (fd == -1) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  const auto len = size_t(st.st_size);
+  const auto ptr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) return NULL;
+  if (size != NULL) *size = len;
+  return ptr;
+}
+void unmapfile(void *ptr, size_t size) { if (ptr) munmap(ptr, size); }
+#endif
+
 void quit(const char *msg) {
 #if defined(RELEASE)
 #if defined(__WIN32__)
@@ -234,12 +869,39 @@ float millis() {
   static double first = double(val.QuadPart) / double(freq.QuadPart) * 1e3;
   return float(double(val.QuadPart) / double(freq.QuadPart) * 1e3 - first);
 }
+u64 micros() {
+  LARGE_INTEGER freq, val;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&val);
+  static const auto first = val.QuadPart;
+  return u64(double(val.QuadPart-first) / double(freq.QuadPart) * 1e6);
+}
+u64 nanos() {
+  LARGE_INTEGER freq, val;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&val);
+  static const auto first = val.QuadPart;
+  return u64(double(val.QuadPart-first) / double(freq.QuadPart) * 1e9);
+}
 #else
 float millis() {
   struct timeval tp; gettimeofday(&tp,NULL);
   static double first = double(tp.tv_sec)*1e3 + double(tp.tv_usec)*1e-3;
   return float(double(tp.tv_sec)*1e3 + double(tp.tv_usec)*1e-3 - first);
 }
+u64 micros() {
+  struct timeval tp; gettimeofday(&tp,NULL);
+  const auto now = u64(tp.tv_sec)*1000000u + u64(tp.tv_usec);
+  static const auto first = now;
+  return now-first;
+}
+u64 nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  const auto now = u64(ts.tv_sec)*1000000000u + u64(ts.tv_nsec);
+  static const auto first = now;
+  return now-first;
+}
 #endif
 
 void writebmp(const int *data, int w, int h, const char *filename) {
@@ -322,6 +984,8 @@ static INLINE int check_xcr0_ymm() {
   u32 xcr0;
 #if defined(__MSVC__)
   xcr0 = u32(_xgetbv(0))
+#elif !defined(__X86__) && !defined(__X86_64__)
+  xcr0 = 0;
 #else
   asm ("xgetbv" : "=a" (xcr0) : "c" (0) : "%edx" );
 #endif
@@ -344,6 +1008,12 @@ bool hasfeature(cpufeature feature) {
     case CPU_FMA:   return has<1,12,ecx>();
     case CPU_F16C:  return has<1,29,ecx>();
     case CPU_YMM:   return check_xcr0_ymm();
+#if defined(__ARM64__)
+    case CPU_NEON:  return true; // part of the base aarch64 isa
+#endif
+#if defined(__wasm_simd128__)
+    case CPU_SIMD128: return true; // a module using it fails to load without
+#endif
     default: return false;
   }
 }
@@ -363,6 +1033,8 @@ const char *featurename(cpufeature feature) {
     case CPU_FMA:   return "fma";
     case CPU_F16C:  return "f16c";
     case CPU_YMM:   return "ymmstate";
+    case CPU_NEON:  return "neon";
+    case CPU_SIMD128: return "simd128";
     default:        return "unknown";
   };
 }
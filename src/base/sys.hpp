@@ -9,6 +9,8 @@
  -------------------------------------------------------------------------*/
 #if defined(__x86_64__) || defined(__ia64__) || defined(_M_X64)
 #define __X86_64__
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define __ARM64__
 #elif !defined(EMSCRIPTEN)
 #define __X86__
 #endif
@@ -163,7 +165,11 @@
 #define THREAD          __thread
 #define ALIGNED(...)    __attribute__((aligned(__VA_ARGS__)))
 #define __FUNCTION__    __PRETTY_FUNCTION__
+#if defined(__ARM64__) || defined(__JAVASCRIPT__)
+#define DEBUGBREAK      __builtin_trap()
+#else
 #define DEBUGBREAK      asm ("int $3")
+#endif
 #define CDECL
 #define PATHDIV         '/'
 #define MAYBE_UNUSED
@@ -173,6 +179,17 @@
 #define MAYALIAS __attribute__((__may_alias__))
 #endif // __MSVC__
 
+// arm64 and webassembly get the sse2 intrinsics from neon and simd128. the
+// code using them checks __SSE2_INTRINSICS__
+#if defined(__ARM_NEON)
+#include "neon.hpp"
+#elif defined(__wasm_simd128__)
+#include "wasm.hpp"
+#endif
+#if defined(__SSE2__) || defined(__ARM_NEON) || defined(__wasm_simd128__)
+#define __SSE2_INTRINSICS__
+#endif
+
 // alignment rules
 #define CACHE_LINE_ALIGNMENT 64
 #define CACHE_LINE_ALIGNED ALIGNED(CACHE_LINE_ALIGNMENT)
@@ -232,18 +249,34 @@ INLINE void NAME##v(First first, Rest... rest) {\
 #define STRINGIFY(X) _DO_STRINGIFY(X)
 #define _DO_STRINGIFY(X) #X
 
-#if !defined(RELEASE)
-#define STATS(X) q::s32 X = 0;
-#define STATS_ADD(X,Y) (atomic_add(&X,Y))
-#define STATS_INC(X) (atomic_add(&X,1))
-#define STATS_OUT(X) { printf(#X": %.0lf\n", double(X)); }
-#define STATS_RATIO(X,Y) printf(#X": %.2lf%% (" #Y ")\n", double(X)/double(Y)*100.0)
+// statistics are cheap per-thread counters (see sys::statcounter). they are
+// compiled out of release builds unless STATS_ENABLED is set to 1
+#if !defined(STATS_ENABLED)
+#if defined(RELEASE)
+#define STATS_ENABLED 0
+#else
+#define STATS_ENABLED 1
+#endif
+#endif
+
+#if STATS_ENABLED
+#define STATS(X) q::sys::statcounter X;
+#define STATS_ADD(X,Y) (X.add(q::s64(Y)))
+#define STATS_INC(X) (X.add(1))
+#define STATS_OUT(X) q::sys::printstats(#X, X)
+#define STATS_RATIO(X,Y) q::sys::printstats(#X, X, Y, #Y)
+#define STATS_HISTOGRAM(X) q::sys::stathistogram X;
+#define STATS_SAMPLE(X,Y) (X.add(q::u32(Y)))
+#define STATS_HISTOGRAM_OUT(X) q::sys::printstats(#X, X)
 #else
 #define STATS(X)
 #define STATS_ADD(X,Y)
 #define STATS_INC(X)
 #define STATS_OUT(X)
 #define STATS_RATIO(X,Y)
+#define STATS_HISTOGRAM(X)
+#define STATS_SAMPLE(X,Y)
+#define STATS_HISTOGRAM_OUT(X)
 #endif
 
 // global variable setter / getter
@@ -465,6 +498,29 @@ INLINE void __cpuid_count(int out[4], int op1, int op2) {
 }
 #endif
 
+#if defined(__ARM64__) || defined(__JAVASCRIPT__)
+#if defined(__ARM64__)
+// the virtual counter ticks at a fixed frequency, not with the cpu clock
+INLINE q::u64 __rdtsc()  {
+  q::u64 t;
+  asm volatile ("mrs %0, cntvct_el0" : "=r"(t));
+  return t;
+}
+#endif
+
+INLINE unsigned int __popcnt(unsigned int in) { return __builtin_popcount(in); }
+INLINE int __bsf(int v) { return __builtin_ctz(v); }
+INLINE int __bsr(int v) { return 31 - __builtin_clz(v); }
+INLINE int __btc(int v, int i) { return v ^ (1<<i); }
+INLINE int __bts(int v, int i) { return v | (1<<i); }
+INLINE int __btr(int v, int i) { return v & ~(1<<i); }
+INLINE size_t __bsf(size_t v) { return __builtin_ctzl(v); }
+INLINE unsigned int __bsf(unsigned int v) { return __builtin_ctz(v); }
+INLINE size_t __bsr(size_t v) { return sizeof(size_t)*8-1 - __builtin_clzl(v); }
+INLINE size_t __btc(size_t v, size_t i) { return v ^ (size_t(1)<<i); }
+INLINE size_t __bts(size_t v, size_t i) { return v | (size_t(1)<<i); }
+INLINE size_t __btr(size_t v, size_t i) { return v & ~(size_t(1)<<i); }
+#else
 INLINE q::u64 __rdtsc()  {
   q::u32 high,low;
   asm volatile ("rdtsc" : "=d"(high), "=a"(low));
@@ -524,6 +580,7 @@ INLINE size_t __bts(size_t v, size_t i) {
 INLINE size_t __btr(size_t v, size_t i) {
   size_t r = 0; asm ("btr %1,%0" : "=r"(r) : "r"(i), "0"(v) : "flags"); return r;
 }
+#endif // __ARM64__ || __JAVASCRIPT__
 
 INLINE int bitscan(int v) {
 #if defined(__AVX2__)
@@ -637,12 +694,22 @@ void fatal(const char *s, const char *o = "");
 void quit(const char *msg = NULL);
 void keyrepeat(bool on);
 float millis();
+u64 micros(); // same clock with a better resolution
+u64 nanos();  // monotonic clock in nanoseconds for the profiler
 char *path(char *s);
 char *loadfile(const char *fn, int *size=NULL);
+// copy-on-write mapping of the whole file. NULL if missing or empty
+void *mapfile(const char *fn, size_t *size=NULL);
+void unmapfile(void *ptr, size_t size);
 void initendiancheck();
 int islittleendian();
 void endianswap(void *memory, int stride, int length);
 u32 threadnumber();
+// numa nodes and the cpus they own. one node with all cpus when unknown
+u32 numanodenumber();
+u32 numanodecpus(u32 node, u32 *cpus, u32 maxnum);
+// pin the calling thread to one cpu. false if not supported
+bool setthreadaffinity(u32 cpu);
 void writebmp(const int *data, int w, int h, const char *filename);
 void textinput(bool on);
 
@@ -652,7 +719,7 @@ void textinput(bool on);
 enum cpufeature {
   CPU_SSE, CPU_SSE2, CPU_SSE3, CPU_SSSE3, CPU_SSE41,
   CPU_SSE42, CPU_AVX, CPU_AVX2, CPU_BMI1, CPU_BMI2,
-  CPU_LZCNT, CPU_FMA, CPU_F16C, CPU_YMM,
+  CPU_LZCNT, CPU_FMA, CPU_F16C, CPU_YMM, CPU_NEON, CPU_SIMD128,
   CPU_FEATURE_NUM
 };
 bool hasfeature(cpufeature feature);
@@ -661,15 +728,79 @@ const char *featurename(cpufeature feature);
 /*-------------------------------------------------------------------------
  - memory debugging / tracking facilities
  -------------------------------------------------------------------------*/
-void memstart();
+// with "pooled", blocks up to 2KB come from per-thread caches of size class
+// slabs. otherwise everything goes to malloc. blocks of both kinds may be
+// freed at any time since every block knows where it comes from
+void memstart(bool pooled = true);
 void *memalloc(size_t sz, const char *filename, int linenum);
 void *memrealloc(void *ptr, size_t sz, const char *filename, int linenum);
 void memfree(void *);
 void *memalignedalloc(size_t size, size_t align, const char *file, int lineno);
 void memalignedfree(const void* ptr);
+// bytes currently allocated by the functions above and their peak since the
+// last reset. tracked in every build
+u64 memused();
+u64 mempeak();
+void memresetpeak();
+// what the size classes saw. allocations and frees made by a thread are
+// accounted when it exchanges blocks with the shared lists of the class
+struct mempoolstat {
+  u32 size, slabnum;
+  u64 allocnum, freenum;
+};
+u32 mempoolstats(mempoolstat *stats, u32 maxnum);
+
+// every block is accounted to a tag: the one of the thread that allocates it.
+// tasks run with the tag their creator had. the tag lives in the header of
+// each block so it costs nothing more per block, in every build
+enum memtag {
+  MEM_OTHER, MEM_ISO, MEM_GEOM, MEM_BVH, MEM_RENDER, MEM_NET, MEM_LUA,
+  MEM_TAGNUM
+};
+const char *memtagname(u32 tag);
+// set the tag of the calling thread and return the previous one
+u32 memsettag(u32 tag);
+u32 memgettag();
+// current and peak bytes of a tag, its budget (0 if none) and the bytes of
+// its blocks mapped on huge pages
+struct memtagstat {
+  u64 used, peak, budget, huge;
+};
+memtagstat memtagstats(u32 tag);
+void memsetbudget(u32 tag, u64 bytes);
+// blocks of a megabyte or more of the tag are mapped on their own, backed
+// by 2MB pages when the os gives them. on for the bvh, geom and iso tags:
+// their node, triangle and vertex arrays are walked all over
+void memsethugepages(u32 tag, bool on);
+// what the os says is backed by huge pages in the whole process. 0 when it
+// does not tell
+u64 memhugeresident();
+struct memtagscope {
+  INLINE memtagscope(u32 tag) : prev(memsettag(tag)) {}
+  INLINE ~memtagscope() { memsettag(prev); }
+  u32 prev;
+};
+#define MEMORY_TAG(TAG) const q::sys::memtagscope JOIN(memtag,__LINE__)(q::sys::TAG)
+
+// number of allocations done so far by all threads. reallocations count
+u64 memallocs();
+// while sampling, allocations are also counted by call site. memsites
+// returns the sites seen since its last call, most frequent first, and
+// clears them. sites past the table capacity are only in memallocs
+struct memsite {
+  const char *file;
+  int linenum;
+  u32 num;
+  u64 bytes;
+};
+void memsampling(bool on);
+u32 memsites(memsite *sites, u32 maxnum);
+
 template <typename T> void callctor(void *ptr) { new (ptr) T; }
 template <typename T, typename... Args>
-INLINE void callctor(void *ptr, Args&&... args) { new (ptr) T(args...); }
+INLINE void callctor(void *ptr, Args&&... args) {
+  new (ptr) T(static_cast<Args&&>(args)...);
+}
 
 template <typename T, typename... Args>
 INLINE T *memconstructa(s32 n, const char *filename, int linenum, Args&&... args) {
@@ -727,16 +858,26 @@ INLINE s32 atomic_add(volatile s32* m, const s32 v) {
 INLINE s32 atomic_cmpxchg(volatile s32* m, const s32 v, const s32 c) {
   return _InterlockedCompareExchange((volatile long*)m,v,c);
 }
-#elif defined(__JAVASCRIPT__)
+INLINE s64 atomic_add(volatile s64* m, const s64 v) {
+  return _InterlockedExchangeAdd64((volatile __int64*)m,v);
+}
+INLINE s64 atomic_cmpxchg(volatile s64* m, const s64 v, const s64 c) {
+  return _InterlockedCompareExchange64((volatile __int64*)m,v,c);
+}
+#elif defined(__ARM64__) || defined(__JAVASCRIPT__)
+// web workers share the wasm memory: the builtins become its atomics, or
+// plain operations in a build without threads
 INLINE s32 atomic_add(s32 volatile* value, s32 input) {
-  const s32 initial = value;
-  *value += input;
-  return initial;
+  return __sync_fetch_and_add(value, input);
 }
-INLINE s32 atomic_cmpxchg(volatile s32* m, const s32 v, const s32 c) {
-  const s32 initial = *m;
-  if (*m == c) *m = v;
-  return initial;
+INLINE s32 atomic_cmpxchg(s32 volatile* value, const s32 input, s32 comparand) {
+  return __sync_val_compare_and_swap(value, comparand, input);
+}
+INLINE s64 atomic_add(s64 volatile* value, s64 input) {
+  return __sync_fetch_and_add(value, input);
+}
+INLINE s64 atomic_cmpxchg(s64 volatile* value, const s64 input, s64 comparand) {
+  return __sync_val_compare_and_swap(value, comparand, input);
 }
 #else
 INLINE s32 atomic_add(s32 volatile* value, s32 input) {
@@ -748,9 +889,28 @@ INLINE s32 atomic_cmpxchg(s32 volatile* value, const s32 input, s32 comparand) {
   asm volatile("lock cmpxchg %2,%0" : "=m"(*value), "=a"(comparand) : "r"(input), "m"(*value), "a"(comparand) : "flags");
   return comparand;
 }
+
+// 64 bits versions also work on 32 bits targets
+INLINE s64 atomic_add(s64 volatile* value, s64 input) {
+  return __sync_fetch_and_add(value, input);
+}
+INLINE s64 atomic_cmpxchg(s64 volatile* value, const s64 input, s64 comparand) {
+  return __sync_val_compare_and_swap(value, comparand, input);
+}
 #endif // __MSVC__
 
-#if defined(__X86__) || defined(__X86_64__) || defined(__JAVASCRIPT__)
+// pointer version on top of the integer ones
+template <typename T>
+INLINE T *atomic_cmpxchg(T *volatile *value, T *input, T *comparand) {
+  if (sizeof(T*) == sizeof(s64))
+    return (T*) intptr_t(atomic_cmpxchg((volatile s64*) value,
+      s64(intptr_t(input)), s64(intptr_t(comparand))));
+  else
+    return (T*) intptr_t(atomic_cmpxchg((volatile s32*) value,
+      s32(intptr_t(input)), s32(intptr_t(comparand))));
+}
+
+#if defined(__X86__) || defined(__X86_64__)
 template <typename T>
 INLINE T loadacquire(volatile T *ptr) {
   COMPILER_READ_WRITE_BARRIER;
@@ -764,8 +924,88 @@ INLINE void storerelease(volatile T *ptr, T x) {
   *ptr = x;
   COMPILER_READ_WRITE_BARRIER;
 }
+// full barrier: stores before are visible before loads after
+INLINE void memfence(void) {
+#if defined(__MSVC__)
+  _mm_mfence();
+#else
+  __sync_synchronize();
+#endif
+}
+#elif defined(__ARM64__) || defined(__JAVASCRIPT__)
+// arm and the wasm threads reorder loads and stores: real barriers
+template <typename T>
+INLINE T loadacquire(volatile T *ptr) {
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+template <typename T>
+INLINE void storerelease(volatile T *ptr, T x) {
+  __atomic_store_n(ptr, x, __ATOMIC_RELEASE);
+}
+INLINE void memfence(void) { __sync_synchronize(); }
 #else
 #error "unknown platform"
 #endif
-} /* namespace q */
 
+namespace sys {
+/*-------------------------------------------------------------------------
+ - statistics counters. every thread owns one cache line of each counter
+ - and adds to it without any bus lock. reads sum all the lines. threads
+ - past the slot number share the last one with atomic adds
+ -------------------------------------------------------------------------*/
+static const u32 STATSLOTNUM = 64;
+extern THREAD u32 localstatslot;
+u32 newstatslot();
+INLINE u32 statslot() {
+  const auto slot = localstatslot;
+  return slot != 0 ? slot-1 : newstatslot();
+}
+
+// must have static storage: it starts zeroed with no constructor
+struct statcounter {
+  INLINE void add(s64 x) {
+    const auto slot = statslot();
+    if (slot == STATSLOTNUM-1)
+      atomic_add(&lines[slot].value, x);
+    else
+      lines[slot].value += x;
+  }
+  s64 get() const {
+    s64 sum = 0;
+    for (u32 i = 0; i < STATSLOTNUM; ++i) sum += loadacquire(&lines[i].value);
+    return sum;
+  }
+  void reset() { for (u32 i = 0; i < STATSLOTNUM; ++i) lines[i].value = 0; }
+  struct CACHE_LINE_ALIGNED line { volatile s64 value; };
+  line lines[STATSLOTNUM];
+};
+
+// log2 histogram: bucket 0 gets zeros and bucket i values in [2^(i-1),2^i)
+struct stathistogram {
+  static const u32 BUCKETNUM = 33;
+  static INLINE u32 bucket(u32 x) { return x == 0 ? 0 : u32(__bsr(int(x)))+1; }
+  INLINE void add(u32 x) {
+    const auto slot = statslot();
+    const auto b = bucket(x);
+    if (slot == STATSLOTNUM-1)
+      atomic_add(&lines[slot].buckets[b], 1);
+    else
+      lines[slot].buckets[b] += 1;
+  }
+  s64 get(u32 b) const {
+    s64 sum = 0;
+    for (u32 i = 0; i < STATSLOTNUM; ++i) sum += loadacquire(&lines[i].buckets[b]);
+    return sum;
+  }
+  void reset() {
+    for (u32 i = 0; i < STATSLOTNUM; ++i)
+      for (u32 b = 0; b < BUCKETNUM; ++b) lines[i].buckets[b] = 0;
+  }
+  struct CACHE_LINE_ALIGNED line { volatile s64 buckets[BUCKETNUM]; };
+  line lines[STATSLOTNUM];
+};
+void printstats(const char *name, const statcounter &counter);
+void printstats(const char *name, const statcounter &x, const statcounter &y, const char *yname);
+void printstats(const char *name, const stathistogram &histogram);
+} /* namespace sys */
+} /* namespace q */
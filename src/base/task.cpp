@@ -3,9 +3,14 @@
  - task.hpp -> implements multi-threaded tasking system
  -------------------------------------------------------------------------*/
 #include "base/task.hpp"
+#include "base/io.hpp"
 #include "base/vector.hpp"
-#include "base/intrusive_list.hpp"
+#include "base/script.hpp"
+#include "base/console.hpp"
+#include "base/profiler.hpp"
+#include "base/string.hpp"
 #include <SDL/SDL_thread.h>
+#include <cstdio>
 
 namespace q {
 namespace tasking {
@@ -21,18 +26,106 @@ enum {
 // all queues as instantiated by the user
 static vector<struct queue*> queues;
 
-static const u32 MAXSTART = 4; // maximum number of tasks we may start
-static const u32 MAXEND   = 4; // maximum number of tasks we may end
-static const u32 MAXDEP   = 8; // maximum number of tasks we may depend on
+static const u32 MAXSTART = 4; // tasks we may start without overflow chunk
+static const u32 MAXEND   = 4; // tasks we may end without overflow chunk
+static const u32 MAXDEP   = 8; // tasks we may depend on without overflow chunk
+static const u32 SPINNUM  = 64;// steal attempts before sleeping
+static const u32 NOWORKER = ~0u;// id of the threads that are not workers
+static const u32 MAXCPUNUM = 256;// cpus we may pin the workers to
+static const u32 BACKGROUNDSHARE = 2;// background runs on 1/n of the workers
+
+// the shared lists of a queue
+enum { LOPRIOLIST, HIPRIOLIST, BACKGROUNDLIST, SHAREDLISTNUM };
+
+// the three lists of tasks related to a task
+enum { STARTLIST, ENDLIST, DEPLIST };
+
+// items of the lists past the inline slots. a task links all its chunks
+// whatever the list they extend. they come from a pool
+static const u32 CHUNKSIZE = 14;
+struct depchunk {
+  task *volatile items[CHUNKSIZE];
+  depchunk *next;
+  u32 list, first; // list we extend and index of items[0] in it
+};
+static SDL_mutex *poolmutex = NULL;
+static depchunk *pool = NULL;
+
+// free lists of task blocks, one per number of cache lines. every thread
+// keeps a few blocks of each class and trades half of them with the shared
+// lists when it runs out or has too many. tasks mostly die on the thread
+// that created them, so the shared lists (and their lock) are rarely hit
+static const u32 BLOCKCLASSNUM = 8; // bigger tasks are plain aligned mallocs
+static const u32 BLOCKCACHE = 32; // blocks of a class a thread may keep
+struct taskblock { taskblock *next; };
+struct blockcache { taskblock *head; u32 num; };
+static THREAD blockcache blockcaches[BLOCKCLASSNUM];
+static THREAD u16 nextblock = task::NOBLOCK; // for the task constructed now
+static taskblock *sharedblocks[BLOCKCLASSNUM]; // locked by poolmutex
+
+// move up to n blocks from one list to the other and return how many moved
+static u32 moveblocks(taskblock *&from, taskblock *&to, u32 n) {
+  u32 moved = 0;
+  for (; moved < n && from != NULL; ++moved) {
+    const auto block = from;
+    from = block->next;
+    block->next = to;
+    to = block;
+  }
+  return moved;
+}
+
+static void *getblock(u32 cls) {
+  auto &cache = blockcaches[cls];
+  if (cache.head == NULL) {
+    SDL_LockMutex(poolmutex);
+    cache.num = moveblocks(sharedblocks[cls], cache.head, BLOCKCACHE/2);
+    SDL_UnlockMutex(poolmutex);
+    if (cache.head == NULL)
+      return ALIGNEDMALLOC((cls+1)*CACHE_LINE_ALIGNMENT, CACHE_LINE_ALIGNMENT);
+  }
+  const auto block = cache.head;
+  cache.head = block->next;
+  --cache.num;
+  return block;
+}
+
+static void putblock(void *ptr, u32 cls) {
+  auto &cache = blockcaches[cls];
+  const auto block = (taskblock*) ptr;
+  block->next = cache.head;
+  cache.head = block;
+  if (++cache.num <= BLOCKCACHE) return;
+  SDL_LockMutex(poolmutex);
+  cache.num -= moveblocks(cache.head, sharedblocks[cls], BLOCKCACHE/2);
+  SDL_UnlockMutex(poolmutex);
+}
+
+// the blocks of an exiting thread would be lost otherwise
+static void flushblocks(void) {
+  SDL_LockMutex(poolmutex);
+  loopi(s32(BLOCKCLASSNUM)) {
+    auto &cache = blockcaches[i];
+    moveblocks(cache.head, sharedblocks[i], cache.num);
+    cache.num = 0;
+  }
+  SDL_UnlockMutex(poolmutex);
+}
 
 // internal hidden structure of the task
-struct MAYALIAS internal : public noncopyable, public intrusive_list_node {
-  INLINE internal(const char *name, u32 n, u32 waiternum, u32 queue, u16 policy);
+struct MAYALIAS internal : public noncopyable {
+  INLINE internal(const char *name, u32 n, u32 waiternum, u32 queue, u16 policy, u32 grain);
+  ~internal(void);
   INLINE task *parent(void);
+  INLINE task *get(u32 list, u32 idx) const;
+  void set(u32 list, u32 idx, task *job);
+  INLINE bool claim(s32 &first, s32 &last);
+  void runrange(s32 first, s32 last);
   void wait(bool recursivewait);
   task *taskstostart[MAXSTART];// all the tasks that wait for us to start
   task *taskstoend[MAXEND];    // all the tasks that wait for us to finish
-  task *deps[MAXDEP];          // all the tasks we depend on to finish or start
+  task *volatile deps[MAXDEP]; // all the tasks we depend on (NULL until set)
+  depchunk *volatile overflow; // items past the inline ones
   tasking::queue *const owner; // where the task runs when ready
   const char *name;            // name of the task (may be NULL)
   atomic elemnum;              // number of items still to run in the set
@@ -42,205 +135,619 @@ struct MAYALIAS internal : public noncopyable, public intrusive_list_node {
   atomic waiternum;            // number of wait() that still need to be done
   atomic tasktostartnum;       // number of tasks we need to start
   atomic tasktoendnum;         // number of tasks we need to end
-  const u16 policy;            // handle fairness and priority
+  atomic depholders;           // terminate and the last waiter
+  const u32 grain;             // maximum number of elements claimed at once
+  const u8 policy;             // handle fairness and priority
+  const u8 memtag;             // memory tag of the creator, used to run it
   volatile u16 state;          // track task state (useful to debug)
 };
 static_assert(sizeof(internal) <= task::SIZE, "opaque storage is too small");
 static_assert(sizeof(task) == 256, "invalid task size");
 
-// a set of threads subscribes this queue and share the work in the list of the
-// tasks. threads terminate when "terminatethreads" become true
+// chase-lev work-stealing deque of one worker thread. the worker pushes and
+// pops at the bottom while the other threads steal at the top. the ring does
+// not grow: when it is full, tasks go to the shared lists of the queue.
+// every task in a deque holds a reference and may have no element left to run
+struct deque {
+  static const s64 CAPACITY = 1024;
+  INLINE deque(struct queue *owner, u32 id, s32 cpu) :
+    owner(owner), id(id), cpu(cpu), top(0), bottom(0) {}
+  INLINE bool push(internal *job);
+  INLINE internal *pop(void);
+  INLINE internal *steal(void);
+  INLINE bool empty(void) const { return loadacquire(&bottom) <= loadacquire(&top); }
+  struct queue *owner;
+  u32 id;
+  s32 cpu; // the worker is pinned to it if >= 0
+  char pad0[CACHE_LINE_ALIGNMENT];
+  volatile s64 top;
+  char pad1[CACHE_LINE_ALIGNMENT-sizeof(s64)];
+  volatile s64 bottom;
+  internal *jobs[CAPACITY];
+};
+
+INLINE bool deque::push(internal *job) {
+  const auto b = bottom, t = loadacquire(&top);
+  if (b-t >= CAPACITY) return false;
+  jobs[b&(CAPACITY-1)] = job;
+  storerelease(&bottom, b+1);
+  return true;
+}
+
+INLINE internal *deque::pop(void) {
+  const auto b = bottom-1;
+  bottom = b;
+  memfence();
+  const auto t = top;
+  if (t > b) {
+    bottom = b+1;
+    return NULL;
+  }
+  auto job = jobs[b&(CAPACITY-1)];
+  if (t == b) {
+    // last one: we race with the thieves
+    if (atomic_cmpxchg(&top, t+1, t) != t) job = NULL;
+    bottom = b+1;
+  }
+  return job;
+}
+
+INLINE internal *deque::steal(void) {
+  const auto t = loadacquire(&top);
+  const auto b = loadacquire(&bottom);
+  if (t >= b) return NULL;
+  auto job = jobs[t&(CAPACITY-1)];
+  if (atomic_cmpxchg(&top, t+1, t) != t) return NULL;
+  return job;
+}
+
+// the worker threads of the queue run from their own deques and steal from
+// the others. tasks appended by other threads (or with a high priority) go
+// through the shared lists which are the only ones to be locked. background
+// tasks only live in their own shared list: at most "backgroundmax" threads
+// take them at the same time. threads running them (and waiting in them)
+// are not counted twice. threads terminate when "terminatethreads" become true
 struct queue {
-  queue(u32 threadnum);
+  queue(u32 threadnum, s32 node);
   ~queue(void);
   void append(task*);
   void terminate(task*);
+  void push(internal&);
+  internal *get(u32 id, bool background);
+  internal *getshared(void);
+  internal *getbackground(void);
+  void run(internal&, bool once = false);
+  bool hasforegroundwork(void) const;
+  bool haswork(void) const;
+  void sleep(void);
+  void park(internal&);
+  void wakeup(void);
+  void notify(void);
   static int threadfunc(void*);
-  SDL_cond *cond;
+  SDL_cond *cond;              // sleeping worker threads
+  SDL_cond *donecond;          // threads parked in task::wait
   SDL_mutex *mutex;
   vector<SDL_Thread*> threads;
-  intrusive_list<internal> readylist;
+  vector<deque*> deques;       // one per worker thread
+  vector<internal*> shared[SHAREDLISTNUM]; // fifos, from others or full deques
+  u32 sharedfirst[SHAREDLISTNUM]; // first task of each shared list
+  atomic sharednum;            // tasks in the low and high priority lists
+  atomic hiprionum;            // tasks in the high priority list
+  atomic backgroundnum;        // tasks in the background list
+  atomic backgroundrunning;    // threads running background tasks
+  const u32 backgroundmax;     // cap of backgroundrunning
+  atomic sleepernum;           // worker threads waiting for the condition
+  atomic parkednum;            // threads waiting for a task to end
   volatile bool terminatethreads;
 };
 
-INLINE internal::internal(const char *name, u32 n, u32 waiternum, u32 queue, u16 policy) :
+// the worker thread we are in if any
+static THREAD queue *ownerqueue = NULL;
+static THREAD u32 ownerid = 0;
+
+// true while the thread runs the elements of a background task
+static THREAD bool inbackground = false;
+
+// workers are named in the profiler zones on their first range. the queue
+// they belong to is known by then
+static THREAD bool ownernamed = false;
+static void nameworker() {
+  ownernamed = true;
+  loopv(queues) if (queues[i] == ownerqueue) {
+    const fixedstring name(fmt, "worker %d.%u", i, ownerid);
+    profiler::setthreadname(name.c_str());
+  }
+}
+
+INLINE internal::internal(const char *name, u32 n, u32 waiternum, u32 queue, u16 policy, u32 grain) :
   owner(tasking::queues[queue]), name(name), elemnum(n), tostart(1), toend(n),
   depnum(0), waiternum(waiternum), tasktostartnum(0), tasktoendnum(0),
-  policy(policy), state(tasking::UNSCHEDULED)
-{}
+  depholders(waiternum ? 2 : 1), grain(max(grain, 1u)),
+  policy(u8(policy | (inbackground ? task::BACKGROUND : 0))), memtag(u8(sys::memgettag())),
+  state(tasking::UNSCHEDULED)
+{
+  loopi(s32(MAXDEP)) deps[i] = NULL;
+  overflow = NULL;
+}
+
+// no one uses the task anymore: the chunks go back to the pool
+internal::~internal(void) {
+  if (overflow == NULL) return;
+  SDL_LockMutex(poolmutex);
+  while (overflow) {
+    const auto chunk = overflow;
+    overflow = chunk->next;
+    chunk->next = pool;
+    pool = chunk;
+  }
+  SDL_UnlockMutex(poolmutex);
+}
+
+INLINE task *internal::get(u32 list, u32 idx) const {
+  if (list == STARTLIST && idx < MAXSTART) return taskstostart[idx];
+  if (list == ENDLIST && idx < MAXEND) return taskstoend[idx];
+  if (list == DEPLIST && idx < MAXDEP) return deps[idx];
+  for (auto chunk = overflow; chunk != NULL; chunk = chunk->next)
+    if (chunk->list == list && idx-chunk->first < CHUNKSIZE)
+      return chunk->items[idx-chunk->first];
+  return NULL;
+}
+
+// dependencies may be added while the task runs: chunks are only linked
+// once complete and items remain NULL until set
+void internal::set(u32 list, u32 idx, task *job) {
+  if (list == STARTLIST && idx < MAXSTART) { taskstostart[idx] = job; return; }
+  if (list == ENDLIST && idx < MAXEND) { taskstoend[idx] = job; return; }
+  if (list == DEPLIST && idx < MAXDEP) { storerelease(&deps[idx], job); return; }
+  const u32 inlinenum = list == STARTLIST ? MAXSTART : list == ENDLIST ? MAXEND : MAXDEP;
+  const u32 first = inlinenum + (idx-inlinenum)/CHUNKSIZE*CHUNKSIZE;
+  SDL_LockMutex(poolmutex);
+  auto chunk = overflow;
+  while (chunk != NULL && (chunk->list != list || chunk->first != first))
+    chunk = chunk->next;
+  if (chunk == NULL) {
+    if (pool) {
+      chunk = pool;
+      pool = pool->next;
+    } else
+      chunk = NEWE(depchunk);
+    loopi(s32(CHUNKSIZE)) chunk->items[i] = NULL;
+    chunk->list = list;
+    chunk->first = first;
+    chunk->next = overflow;
+    storerelease(&overflow, chunk);
+  }
+  SDL_UnlockMutex(poolmutex);
+  storerelease(&chunk->items[idx-first], job);
+}
 INLINE task *internal::parent(void) {
   return (task*)((char*)this-OFFSETOF(task,opaque));
 }
 INLINE internal &inner(task *job) { return *(internal*)job->opaque; }
 
+// claim elements [first,last) with one atomic. the range shrinks with the
+// number of elements left such that all threads still get some at the end
+INLINE bool internal::claim(s32 &first, s32 &last) {
+  s32 n = 1;
+  if (grain > 1) {
+    const s32 left = elemnum, threadnum = owner->threads.length()+1;
+    n = max(min(left/(2*threadnum), s32(grain)), 1);
+  }
+  last = (elemnum += -n) + n;
+  first = max(last-n, 0);
+  return last > 0;
+}
+
+void internal::runrange(s32 first, s32 last) {
+  auto job = parent();
+  const sys::memtagscope tag(memtag);
+  const auto zone = profiler::zoneson();
+  if (zone) {
+    if (!ownernamed && ownerqueue) nameworker();
+    profiler::zonebegin(name);
+  }
+  const auto wasbackground = inbackground;
+  inbackground = (policy & task::BACKGROUND) != 0;
+  for (auto elt = last-1; elt >= first; --elt) job->run(elt);
+  inbackground = wasbackground;
+  if (zone) profiler::zoneend(name, first, last);
+  if ((toend += first-last) == 0) owner->terminate(job);
+}
+
 void internal::wait(bool recursivewait) {
   assert((recursivewait||state >= tasking::SCHEDULED) &&
          (recursivewait||waiternum > 0));
-  auto job = parent();
 
   // execute all starting dependencies
   while (tostart)
-    loopi(depnum)
-      if (tasking::inner(deps[i]).toend)
-        inner(deps[i]).wait(true);
-
-  // execute the run function
-  for (;;) {
-    const auto elt = --elemnum;
-    if (elt == 0) {
-      SDL_LockMutex(owner->mutex);
-        owner->readylist.pop_front();
-      SDL_UnlockMutex(owner->mutex);
-    }
-    if (elt >= 0) {
-      job->run(elt);
-      if (--toend == 0) owner->terminate(job);
+    loopi(depnum) {
+      const auto dep = get(DEPLIST, i);
+      if (dep && tasking::inner(dep).toend)
+        inner(dep).wait(true);
     }
-    if (elt <= 0) break;
-  }
 
-  // execute all ending dependencies. n.a.u.g.h.t.y -> busy waiting here
-#if defined(__SSE__)
-  int pausenum = 1;
-#endif
+  // execute the run function. the task may still be in some deques: they
+  // drop it when they find no more elements
+  s32 first, last;
+  while (claim(first, last)) runrange(first, last);
+
+  // execute all ending dependencies and any other ready task while the
+  // last elements run elsewhere. we park if nothing shows up for a while.
+  // only waiting for a background task lets us run background work
+  const auto id = ownerqueue == owner ? ownerid : NOWORKER;
+  const auto background = (policy & task::BACKGROUND) != 0;
+  u32 idlenum = 0;
   while (toend) {
-    loopi(depnum)
-      if (tasking::inner(deps[i]).toend)
-        inner(deps[i]).wait(true);
-#if defined(__SSE__)
-    else
-      loopj(pausenum) _mm_pause();
-      pausenum = min(pausenum*2, 64);
+    bool helped = false;
+    // a task running one of our elements may be adding a dependency
+    loopi(depnum) {
+      const auto dep = get(DEPLIST, i);
+      if (dep && tasking::inner(dep).toend) {
+        inner(dep).wait(true);
+        helped = true;
+      }
+    }
+    if (!helped) {
+      const auto other = owner->get(id, background);
+      if (other) {
+        owner->run(*other, true);
+        helped = true;
+      }
+    }
+    if (helped)
+      idlenum = 0;
+    else if (++idlenum < SPINNUM) {
+#if defined(__SSE2_INTRINSICS__)
+      _mm_pause();
 #endif
+    } else {
+      owner->park(*this);
+      idlenum = 0;
+    }
   }
 
-  // finished and no more waiters, we can safely release the dependency array
-  if (!recursivewait && --waiternum == 0)
-    loopi(depnum) deps[i]->release();
+  // finished and no more waiters. terminate may still be running: the last
+  // one of us two releases the dependency array
+  if (!recursivewait && --waiternum == 0 && --depholders == 0)
+    loopi(depnum) get(DEPLIST, i)->release();
+}
+
+void queue::push(internal &self) {
+  self.parent()->acquire();
+  if (self.policy & task::BACKGROUND) {
+    assert(!(self.policy & task::HI_PRIO) && "background tasks have no priority");
+    SDL_LockMutex(mutex);
+      shared[BACKGROUNDLIST].add(&self);
+      ++backgroundnum;
+    SDL_UnlockMutex(mutex);
+  } else {
+    const u32 hiprio = (self.policy & task::HI_PRIO) ? 1 : 0;
+    if (hiprio || ownerqueue != this || !deques[ownerid]->push(&self)) {
+      SDL_LockMutex(mutex);
+        shared[hiprio ? HIPRIOLIST : LOPRIOLIST].add(&self);
+        if (hiprio) ++hiprionum;
+        ++sharednum;
+      SDL_UnlockMutex(mutex);
+    }
+  }
+  wakeup();
+}
+
+// pop the first task of the list. the mutex is held
+INLINE internal *popshared(vector<internal*> &list, u32 &first) {
+  if (first == u32(list.length())) return NULL;
+  const auto job = list[first++];
+  if (first == u32(list.length())) {
+    list.setsize(0);
+    first = 0;
+  }
+  return job;
+}
+
+internal *queue::getshared(void) {
+  internal *job = NULL;
+  SDL_LockMutex(mutex);
+  for (s32 list = HIPRIOLIST; list >= LOPRIOLIST && job == NULL; --list) {
+    job = popshared(shared[list], sharedfirst[list]);
+    if (job == NULL) continue;
+    if (list == HIPRIOLIST) --hiprionum;
+    --sharednum;
+  }
+  SDL_UnlockMutex(mutex);
+  return job;
+}
+
+// a thread already in a background task takes more of them freely. the
+// other ones need a free slot which they hold until queue::run is done
+internal *queue::getbackground(void) {
+  internal *job = NULL;
+  SDL_LockMutex(mutex);
+  if (inbackground || u32(backgroundrunning) < backgroundmax) {
+    job = popshared(shared[BACKGROUNDLIST], sharedfirst[BACKGROUNDLIST]);
+    if (job) {
+      --backgroundnum;
+      if (!inbackground) ++backgroundrunning;
+    }
+  }
+  SDL_UnlockMutex(mutex);
+  return job;
+}
+
+// high priority tasks first, then our own deque and the other ones. threads
+// that are not workers of the queue have no deque and only steal. background
+// tasks come last and only if asked for
+internal *queue::get(u32 id, bool background) {
+  if (hiprionum > 0) {
+    const auto job = getshared();
+    if (job) return job;
+  }
+  const u32 n = deques.length();
+  if (id != NOWORKER) {
+    const auto job = deques[id]->pop();
+    if (job) return job;
+  }
+  for (u32 i = id == NOWORKER ? 0 : 1; i < n; ++i) {
+    const auto stolen = deques[id == NOWORKER ? i : (id+i)%n]->steal();
+    if (stolen) return stolen;
+  }
+  if (sharednum > 0) {
+    const auto job = getshared();
+    if (job) return job;
+  }
+  return background && backgroundnum > 0 ? getbackground() : NULL;
+}
+
+// if unfair, we run all elements until there is nothing else to do in this
+// job. if fair, we run once and go back to the queue to possibly run
+// something with hi-prio that just arrived. in both cases, the remaining
+// elements are pushed back first such that idle threads can steal them.
+// waiting threads only run once since they look after their own task.
+// background tasks also stop as soon as some other work is waiting
+void queue::run(internal &self, bool once) {
+  auto job = self.parent();
+  const auto background = (self.policy & task::BACKGROUND) != 0;
+  const auto slot = background && !inbackground; // taken by getbackground
+  bool pushed = false;
+  s32 first, last;
+  while (self.claim(first, last)) {
+    if (first > 0 && !pushed) {
+      push(self);
+      pushed = true;
+    }
+    self.runrange(first, last);
+    if (once || !(self.policy & task::UNFAIR) || first == 0) break;
+    if (background && hasforegroundwork()) break;
+  }
+  // sleepers may have found the background slots all taken. the one we give
+  // back lets one of them run what is left in the list
+  if (slot) {
+    --backgroundrunning;
+    if (backgroundnum > 0) wakeup();
+  }
+  job->release();
+}
+
+bool queue::hasforegroundwork(void) const {
+  if (sharednum > 0) return true;
+  loopv(deques) if (!deques[i]->empty()) return true;
+  return false;
+}
+
+// background work only counts when there is a slot to run it
+bool queue::haswork(void) const {
+  if (hasforegroundwork()) return true;
+  return backgroundnum > 0 && u32(backgroundrunning) < backgroundmax;
+}
+
+// sleepernum is raised before we look for work and pushers read it after
+// they publish theirs. one of the two sees the other
+void queue::sleep(void) {
+  SDL_LockMutex(mutex);
+  ++sleepernum;
+  if (!haswork() && !terminatethreads) SDL_CondWait(cond, mutex);
+  --sleepernum;
+  SDL_UnlockMutex(mutex);
+}
+
+// same for a thread waiting in task::wait: it goes back to help when some
+// work arrives or get out when its task ends
+void queue::park(internal &self) {
+  SDL_LockMutex(mutex);
+  ++parkednum;
+  if (self.toend && !haswork() && !terminatethreads) SDL_CondWait(donecond, mutex);
+  --parkednum;
+  SDL_UnlockMutex(mutex);
+}
+
+void queue::wakeup(void) {
+  memfence();
+  if (sleepernum == 0 && parkednum == 0) return;
+  SDL_LockMutex(mutex);
+  if (sleepernum) SDL_CondSignal(cond);
+  if (parkednum) SDL_CondBroadcast(donecond);
+  SDL_UnlockMutex(mutex);
+}
+
+void queue::notify(void) {
+  memfence();
+  if (parkednum == 0) return;
+  SDL_LockMutex(mutex);
+  SDL_CondBroadcast(donecond);
+  SDL_UnlockMutex(mutex);
 }
 
 void queue::append(task *job) {
   auto &self = inner(job);
   assert(self.owner == this && self.tostart == 0);
-  SDL_LockMutex(self.owner->mutex);
-    if (self.policy & task::HI_PRIO)
-      self.owner->readylist.push_front(&self);
-    else
-      self.owner->readylist.push_back(&self);
-  SDL_CondBroadcast(cond);
-  SDL_UnlockMutex(self.owner->mutex);
+  push(self);
 }
 
 void queue::terminate(task *job) {
   auto &self = inner(job);
   assert(self.owner == this && self.toend == 0);
   storerelease(&self.state, u16(DONE));
+  notify();
 
   // go over all tasks that depend on us
   loopi(self.tasktostartnum) {
-    if (--inner(self.taskstostart[i]).tostart == 0)
-      append(self.taskstostart[i]);
-    self.taskstostart[i]->release();
+    const auto other = self.get(STARTLIST, i);
+    if (--inner(other).tostart == 0) append(other);
+    other->release();
   }
   loopi(self.tasktoendnum) {
-    if (--inner(self.taskstoend[i]).toend == 0)
-      terminate(self.taskstoend[i]);
-    self.taskstoend[i]->release();
+    const auto other = self.get(ENDLIST, i);
+    if (--inner(other).toend == 0) terminate(other);
+    other->release();
   }
 
   // if no more waiters, we can safely free all dependencies since we are done
-  if (self.waiternum == 0)
-    loopi(self.depnum) self.deps[i]->release();
+  if (--self.depholders == 0)
+    loopi(self.depnum) self.get(DEPLIST, i)->release();
   job->release();
 }
 
 int queue::threadfunc(void *data) {
-#if defined(__X86__) || defined(__X86_64__)
+#if defined(__X86__) || defined(__X86_64__) || defined(__ARM64__)
   // flush to zero and no denormals
   _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
 #endif
-  auto q = (queue*) data;
-  for (;;) {
-    SDL_LockMutex(q->mutex);
-    while (q->readylist.empty() && !q->terminatethreads)
-      SDL_CondWait(q->cond, q->mutex);
-    if (q->terminatethreads) {
-      SDL_UnlockMutex(q->mutex);
-      break;
-    }
-    auto &self = *q->readylist.front();
-    auto job = self.parent();
-
-    // if unfair, we run all elements until there is nothing else to do in this
-    // job. we do not care if a hi-prio job arrives while we run
-    if (self.policy & task::UNFAIR) {
-      job->acquire();
-      SDL_UnlockMutex(q->mutex);
-      for (;;) {
-        const auto elt = --self.elemnum;
-        if (elt >= 0) {
-          job->run(elt);
-          if (--self.toend == 0) q->terminate(job);
-        }
-        if (elt == 0) {
-          SDL_LockMutex(q->mutex);
-            q->readylist.pop_front();
-          SDL_UnlockMutex(q->mutex);
-        }
-        if (elt <= 0) break;
-      }
-      job->release();
-    }
-    // if fair, we run once and go back to the queue to possibly run something
-    // with hi-prio that just arrived
-    else {
-      const auto elt = --self.elemnum;
-      if (elt == 0) q->readylist.pop_front();
-      SDL_UnlockMutex(q->mutex);
-      if (elt >= 0) {
-        job->run(elt);
-        if (--self.toend == 0) q->terminate(job);
-      }
+  auto d = (deque*) data;
+  auto q = d->owner;
+  if (d->cpu >= 0) sys::setthreadaffinity(u32(d->cpu));
+  ownerqueue = q;
+  ownerid = d->id;
+  u32 idlenum = 0;
+  while (!q->terminatethreads) {
+    const auto self = q->get(ownerid, true);
+    if (self) {
+      q->run(*self);
+      idlenum = 0;
+    } else if (++idlenum < SPINNUM) {
+#if defined(__SSE2_INTRINSICS__)
+      _mm_pause();
+#endif
+    } else {
+      q->sleep();
+      idlenum = 0;
     }
   }
-
+  flushblocks();
   return 0;
 }
 
-queue::queue(u32 threadnum) : terminatethreads(false) {
+// cpus the workers are pinned to, one after the other. with any node, we
+// fill the first node before going to the next one
+static u32 nodecpus(s32 node, u32 *cpus) {
+  if (node == task::NOAFFINITY) return 0;
+  if (node != task::ANYNODE) return sys::numanodecpus(u32(node), cpus, MAXCPUNUM);
+  u32 n = 0;
+  const auto nodenum = sys::numanodenumber();
+  for (u32 i = 0; i < nodenum && n < MAXCPUNUM; ++i)
+    n += sys::numanodecpus(i, cpus+n, MAXCPUNUM-n);
+  return n;
+}
+
+queue::queue(u32 threadnum, s32 node) :
+  sharednum(0), hiprionum(0), backgroundnum(0), backgroundrunning(0),
+  backgroundmax(max(threadnum/BACKGROUNDSHARE, 1u)), sleepernum(0), parkednum(0),
+  terminatethreads(false)
+{
   mutex = SDL_CreateMutex();
   cond = SDL_CreateCond();
-  loopi(s32(threadnum)) threads.add(SDL_CreateThread(threadfunc, "worker thread", this));
+  donecond = SDL_CreateCond();
+  loopi(s32(SHAREDLISTNUM)) sharedfirst[i] = 0;
+  u32 cpus[MAXCPUNUM];
+  const auto cpunum = nodecpus(node, cpus);
+  loopi(s32(threadnum)) {
+    const auto cpu = cpunum ? s32(cpus[u32(i)%cpunum]) : -1;
+    deques.add(NEW(deque, this, u32(i), cpu));
+  }
+  loopi(s32(threadnum)) threads.add(SDL_CreateThread(threadfunc, "worker thread", deques[i]));
 }
 
+// whatever remains is done: the references are dropped
 queue::~queue(void) {
   SDL_LockMutex(mutex);
   terminatethreads = true;
   SDL_CondBroadcast(cond);
   SDL_UnlockMutex(mutex);
   loopv(threads) SDL_WaitThread(threads[i], NULL);
+  loopv(deques) {
+    while (!deques[i]->empty()) deques[i]->steal()->parent()->release();
+    DEL(deques[i]);
+  }
+  loopi(s32(SHAREDLISTNUM)) for (auto j = sharedfirst[i]; j < u32(shared[i].length()); ++j)
+    shared[i][j]->parent()->release();
   SDL_DestroyMutex(mutex);
   SDL_DestroyCond(cond);
+  SDL_DestroyCond(donecond);
 }
 } /* namespace tasking */
 
 
-void task::start(const u32 *queueinfo, u32 n) {
+void task::start(const u32 *queueinfo, u32 n, const s32 *nodes) {
+  tasking::poolmutex = SDL_CreateMutex();
   tasking::queues.setsize(n);
-  loopi(s32(n)) tasking::queues[i] = NEW(tasking::queue, queueinfo[i]);
+  loopi(s32(n)) {
+    const auto node = nodes ? nodes[i] : NOAFFINITY;
+    tasking::queues[i] = NEW(tasking::queue, queueinfo[i], node);
+  }
+  io::start();
 }
 
 void task::finish(void) {
+  io::finish(); // its last completions still go to the queues
   loopv(tasking::queues) DEL(tasking::queues[i]);
   vector<tasking::queue*>().moveto(tasking::queues);
+  while (tasking::pool) {
+    const auto chunk = tasking::pool;
+    tasking::pool = chunk->next;
+    DEL(chunk);
+  }
+  tasking::flushblocks();
+  loopi(s32(tasking::BLOCKCLASSNUM)) while (tasking::sharedblocks[i]) {
+    const auto block = tasking::sharedblocks[i];
+    tasking::sharedblocks[i] = block->next;
+    ALIGNEDFREE(block);
+  }
+  SDL_DestroyMutex(tasking::poolmutex);
+  tasking::poolmutex = NULL;
+  profiler::destroyzones();
 }
 
-task::task(const char *name, u32 n, u32 waiternum, u32 queue, u16 policy) {
+task::task(const char *name, u32 n, u32 waiternum, u32 queue, u16 policy, u32 grain) :
+  blockclass(tasking::nextblock)
+{
   assert(n > 0 && "cannot create a task with no work to do");
-  new (opaque) tasking::internal(name,n,waiternum,queue,policy);
+  tasking::nextblock = NOBLOCK;
+  new (opaque) tasking::internal(name,n,waiternum,queue,policy,grain);
 }
 task::~task(void) { tasking::inner(this).~internal(); }
 
+void *task::allocate(size_t size) {
+  const u32 lines = u32((size+CACHE_LINE_ALIGNMENT-1)/CACHE_LINE_ALIGNMENT);
+  if (lines > tasking::BLOCKCLASSNUM) {
+    tasking::nextblock = BIGBLOCK;
+    return ALIGNEDMALLOC(size, CACHE_LINE_ALIGNMENT);
+  }
+  tasking::nextblock = u16(lines-1);
+  return tasking::getblock(lines-1);
+}
+
+void task::destroy(void) {
+  const auto cls = blockclass;
+  if (cls == NOBLOCK) {
+    auto ptr = this;
+    DEL(ptr);
+    return;
+  }
+  this->~task();
+  if (cls == BIGBLOCK)
+    ALIGNEDFREE(this);
+  else
+    tasking::putblock(this, cls);
+}
+
 void task::run(u32 elt) {}
 
 void task::scheduled(void) {
@@ -256,15 +763,30 @@ void task::scheduled(void) {
 
 void task::wait(void) {tasking::inner(this).wait(false);}
 
+void task::hold(void) {
+  auto &self = tasking::inner(this);
+  assert(self.state == tasking::UNSCHEDULED);
+  acquire();
+  self.tostart++;
+}
+
+void task::unhold(void) {
+  auto &self = tasking::inner(this);
+  if (--self.tostart == 0) {
+    storerelease(&self.state, u16(tasking::RUNNING));
+    self.owner->append(this);
+  }
+  release();
+}
+
 void task::starts(task &dep) {
   auto &self = tasking::inner(this);
   auto &other = tasking::inner(&dep);
   assert(self.state == tasking::UNSCHEDULED && other.state == tasking::UNSCHEDULED);
   const u32 startindex = self.tasktostartnum++;
   const u32 depindex = other.depnum++;
-  assert(startindex < tasking::MAXSTART && depindex < tasking::MAXDEP);
-  self.taskstostart[startindex] = &dep;
-  other.deps[depindex] = this;
+  self.set(tasking::STARTLIST, startindex, &dep);
+  other.set(tasking::DEPLIST, depindex, this);
   acquire();
   dep.acquire();
   other.tostart++;
@@ -276,9 +798,8 @@ void task::ends(task &dep) {
   assert(self.state == tasking::UNSCHEDULED && other.state < tasking::DONE);
   const u32 endindex = self.tasktoendnum++;
   const u32 depindex = other.depnum++;
-  assert(endindex < tasking::MAXEND && depindex < tasking::MAXDEP);
-  self.taskstoend[endindex] = &dep;
-  other.deps[depindex] = this;
+  self.set(tasking::ENDLIST, endindex, &dep);
+  other.set(tasking::DEPLIST, depindex, this);
   acquire();
   dep.acquire();
   other.toend++;
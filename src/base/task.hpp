@@ -5,25 +5,124 @@
 #pragma once
 #include "sys.hpp"
 #include "ref.hpp"
+#include "math.hpp"
 
 namespace q {
 class CACHE_LINE_ALIGNED task : public noncopyable, public refcount {
 public:
-  static void start(const u32 *queueinfo, u32 n);
+  // queueinfo[i] worker threads for queue i. when given, the workers of
+  // queue i are pinned to the cpus of numa node nodes[i] (one cpu each) so
+  // that what they allocate and touch first stays local to them
+  static void start(const u32 *queueinfo, u32 n, const s32 *nodes=NULL);
   static void finish(void);
-  task(const char *name, u32 elem=1, u32 waiter=0, u32 queue=0, u16 policy=0);
+  // up to "grain" elements are claimed at once. less when few are left
+  task(const char *name, u32 elem=1, u32 waiter=0, u32 queue=0, u16 policy=0, u32 grain=1);
   virtual ~task(void);
   void starts(task&);
   void ends(task&);
   void wait(void);
   void scheduled(void);
+  // one more event out of the task graph (an io completion...) the task
+  // needs before it starts. unhold is called once it happened
+  void hold(void);
+  void unhold(void);
   virtual void run(u32);
+  // hides refcount::release: the last one gives the block back to its list
+  INLINE void release(void) { if (--refcounter == 0) destroy(); }
+  // block of "size" bytes from the free lists of the calling thread. the
+  // task constructed next in it remembers where to give it back
+  static void *allocate(size_t size);
   static const u32 LO_PRIO = 0u;
   static const u32 HI_PRIO = 1u;
   static const u32 FAIR    = 0u;
   static const u32 UNFAIR  = 2u;
+  // background tasks (bakes, rebuilds, streaming) run on a capped share of
+  // the workers, after any other task, and give the thread back between two
+  // ranges when frame work shows up. the tasks they create are background too
+  static const u32 BACKGROUND = 4u;
   static const u32 SIZE    = 192u;
+  static const s32 ANYNODE    = -1; // pinned, filling the nodes in order
+  static const s32 NOAFFINITY = -2; // not pinned at all
+  static const u16 NOBLOCK    = 0xffff; // allocated with NEW
+  static const u16 BIGBLOCK   = 0xfffe; // too big for the free lists
+private:
+  void destroy(void);
+  u16 blockclass; // free list the task goes back to
+public:
   char DEFAULT_ALIGNED opaque[SIZE];
 };
+
+// tasks are created with NEWTASK instead of NEW. once the free lists are
+// warm, creating and dropping them never touches the heap
+template <typename T, typename... Args>
+INLINE T *newtask(Args&&... args) {
+  return new (task::allocate(sizeof(T))) T(static_cast<Args&&>(args)...);
+}
+#define NEWTASK(X,...) q::newtask<X>(__VA_ARGS__)
+#define NEWTASKE(X) q::newtask<X>()
+
+/*-------------------------------------------------------------------------
+ - parallel loops over [0,n) on top of the tasks. the calling thread waits
+ - for the end of the loop and helps with the work meanwhile, so loops may
+ - be nested in other tasks. "f" is any functor, a lambda included
+ -------------------------------------------------------------------------*/
+template <typename F> struct parallelfortask : public task {
+  INLINE parallelfortask(const char *name, u32 n, u32 grain, const F &f) :
+    task(name, n, 1, 0, FAIR, grain), f(f) {}
+  virtual void run(u32 idx) { f(idx); }
+  const F &f;
+};
+
+// f(idx) for all elements. up to "grain" elements are claimed at once
+template <typename F>
+void parallelfor(const char *name, u32 n, u32 grain, const F &f) {
+  if (n <= grain) {
+    loopi(s32(n)) f(u32(i));
+    return;
+  }
+  ref<task> job = NEWTASK(parallelfortask<F>, name, n, grain, f);
+  job->scheduled();
+  job->wait();
+}
+
+template <typename T, typename F, typename R>
+struct parallelreducetask : public task {
+  INLINE parallelreducetask(const char *name, u32 n, u32 grain, T *partials,
+                            const F &f, const R &reduce) :
+    task(name, (n+grain-1)/grain, 1), n(n), grain(grain), partials(partials),
+    f(f), reduce(reduce) {}
+  virtual void run(u32 chunk) {
+    auto &acc = partials[chunk];
+    const auto last = min((chunk+1)*grain, n);
+    for (auto idx = chunk*grain; idx < last; ++idx) acc = reduce(acc, f(idx));
+  }
+  const u32 n, grain;
+  T *partials;
+  const F &f;
+  const R &reduce;
+};
+
+// reduce(... reduce(reduce(identity, f(0)), f(1)) ..., f(n-1)) computed by
+// chunks of "grain" elements. chunks are combined in order so the result
+// does not depend on the scheduling even when "reduce" only is associative
+template <typename T, typename F, typename R>
+T parallelreduce(const char *name, u32 n, u32 grain, const T &identity,
+                 const F &f, const R &reduce) {
+  grain = max(grain, 1u);
+  T result = identity;
+  if (n <= grain) {
+    loopi(s32(n)) result = reduce(result, f(u32(i)));
+    return result;
+  }
+  const auto chunknum = (n+grain-1)/grain;
+  auto partials = NEWA(T, chunknum, identity);
+  typedef parallelreducetask<T,F,R> reducetask;
+  ref<task> job = NEWTASK(reducetask, name, n, grain, partials, f, reduce);
+  job->scheduled();
+  job->wait();
+  loopi(s32(chunknum)) result = reduce(result, partials[i]);
+  DELA(partials);
+  return result;
+}
 } /* namespace q */
 
@@ -0,0 +1,134 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - timerwheel.hpp -> hierarchical timer wheel indexed by key
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "base/vector.hpp"
+
+namespace q {
+// keys are integers and each key is scheduled at most once. level l has
+// SLOTNUM slots of SLOTNUM^l ticks: schedule and cancel are o(1) and advance
+// only touches the due timers and the ones cascading down a level. the unit
+// of the ticks is up to the user. times wrap and compare as signed deltas
+struct timerwheel : noncopyable {
+  enum {
+    SLOTBITS = 6,
+    SLOTNUM = 1<<SLOTBITS,
+    LEVELNUM = 4,
+    HORIZON = 1<<(SLOTBITS*LEVELNUM) // farther timers cascade from the top again
+  };
+
+  timerwheel(u32 now = 0) : current(now), total(0) {
+    loopi(LEVELNUM*SLOTNUM) head[i] = -1;
+    loopi(LEVELNUM) count[i] = 0;
+  }
+  INLINE bool empty() const { return total == 0; }
+  INLINE bool pending(int key) const {
+    return key < nodes.length() && nodes[key].slot != -1;
+  }
+  INLINE u32 when(int key) const { return nodes[key].when; }
+
+  // insert the key or move it. a time already passed fires on next advance
+  void schedule(int key, u32 when) {
+    while (nodes.length() <= key) {
+      const node n = {0u, -1, -1, -1};
+      nodes.add(n);
+    }
+    if (pending(key)) unlink(key);
+    nodes[key].when = when;
+    insert(key, 1u);
+  }
+
+  void cancel(int key) { if (pending(key)) unlink(key); }
+
+  // push the keys due at or before now in due, in no particular order
+  void advance(u32 now, vector<int> &due) {
+    if (s32(now-current) < 0 || now-current >= u32(HORIZON)) rebase(now-1);
+    while (s32(now-current) > 0) {
+      if (total == 0) {
+        current = now;
+        break;
+      }
+
+      // jump to the next boundary of the first level with a timer
+      int l = 0;
+      while (count[l] == 0) ++l;
+      const auto mask = (1u<<(SLOTBITS*l))-1u;
+      if (mask != 0) {
+        const auto boundary = (current|mask)+1u;
+        if (s32(now-boundary) < 0) {
+          current = now;
+          break;
+        }
+        current = boundary-1u;
+      }
+      ++current;
+
+      // higher levels first since they may refill the lower ones
+      int wrapped = 0;
+      while (wrapped+1 < LEVELNUM && (current&((1u<<(SLOTBITS*(wrapped+1)))-1u)) == 0)
+        ++wrapped;
+      for (int level = wrapped; level > 0; --level) {
+        auto &slot = head[level*SLOTNUM + ((current>>(SLOTBITS*level))&(SLOTNUM-1))];
+        while (slot != -1) {
+          const auto key = slot;
+          unlink(key);
+          insert(key, 0u);
+        }
+      }
+
+      auto &slot = head[current&(SLOTNUM-1)];
+      while (slot != -1) {
+        const auto key = slot;
+        unlink(key);
+        due.add(key);
+      }
+    }
+  }
+
+private:
+  struct node { u32 when; int prev, next, slot; };
+
+  // place every timer again after a jump of the clock
+  void rebase(u32 now) {
+    current = now;
+    loopv(nodes) if (nodes[i].slot != -1) {
+      unlink(i);
+      insert(i, 1u);
+    }
+  }
+
+  // the current tick is already expired unless we are cascading into it
+  void insert(int key, u32 soonest) {
+    auto &n = nodes[key];
+    const auto ahead = s32(n.when-current);
+    const auto delta = ahead >= s32(soonest) ? min(u32(ahead), u32(HORIZON-1)) : soonest;
+    const auto when = current+delta;
+    int level = 0;
+    while (delta >= (1u<<(SLOTBITS*(level+1)))) ++level;
+    n.slot = level*SLOTNUM + ((when>>(SLOTBITS*level))&(SLOTNUM-1));
+    n.prev = -1;
+    n.next = head[n.slot];
+    if (n.next != -1) nodes[n.next].prev = key;
+    head[n.slot] = key;
+    ++count[level];
+    ++total;
+  }
+
+  void unlink(int key) {
+    auto &n = nodes[key];
+    if (n.prev != -1) nodes[n.prev].next = n.next;
+    else head[n.slot] = n.next;
+    if (n.next != -1) nodes[n.next].prev = n.prev;
+    --count[n.slot/SLOTNUM];
+    --total;
+    n.slot = -1;
+  }
+
+  vector<node> nodes;
+  int head[LEVELNUM*SLOTNUM];
+  int count[LEVELNUM];
+  u32 current; // last tick advanced
+  int total;
+};
+} /* namespace q */
@@ -22,10 +22,13 @@ template <class T> struct vector : noncopyable {
     alen = ulen;
     buf = (T*)REALLOC(buf, alen*sizeof(T));
   }
+  // x is only copied aside when it lives in the buffer we are about to grow
   INLINE T &add(const T &x) {
-    const T copy(x);
-    if (ulen==alen) realloc();
-    sys::callctor<T>(buf+ulen, copy);
+    if (ulen==alen) {
+      if (&x >= buf && &x < buf+ulen) return emplace(T(x));
+      realloc();
+    }
+    sys::callctor<T>(buf+ulen, x);
     return buf[ulen++];
   }
   INLINE T &add() {
@@ -33,6 +36,21 @@ template <class T> struct vector : noncopyable {
     sys::callctor<T>(buf+ulen);
     return buf[ulen++];
   }
+  // construct in place. on growth the new element is built in the new buffer
+  // before the old one goes away so the arguments may refer to the elements
+  template <typename... Args> INLINE T &emplace(Args&&... args) {
+    if (ulen==alen) {
+      const auto newalen = 2*alen>1?2*alen:1;
+      const auto newbuf = (T*) MALLOC(newalen*sizeof(T));
+      sys::callctor<T>(newbuf+ulen, static_cast<Args&&>(args)...);
+      if (ulen) memcpy((void*) newbuf, buf, ulen*sizeof(T)); // relocated like REALLOC does
+      FREE(buf);
+      buf = newbuf;
+      alen = newalen;
+    } else
+      sys::callctor<T>(buf+ulen, static_cast<Args&&>(args)...);
+    return buf[ulen++];
+  }
   pair<T*,u32> move() {
     const auto dst = makepair(buf,u32(ulen));
     alen = ulen = 0;
@@ -65,6 +83,13 @@ template <class T> struct vector : noncopyable {
       buf = (T*)REALLOC(buf, alen*sizeof(T));
     }
   }
+  // room for len elements. a known count is allocated exactly while growing
+  // step by step still doubles the capacity
+  INLINE void reserve(int len) {
+    if (len <= alen) return;
+    alen = len > 2*alen ? len : 2*alen;
+    buf = (T*)REALLOC(buf, alen*sizeof(T));
+  }
   INLINE void realloc() {
     alen = 2*alen>1?2*alen:1;
     buf = (T*)REALLOC(buf, alen*sizeof(T));
@@ -78,6 +103,14 @@ template <class T> struct vector : noncopyable {
       for(; i>ulen; ++ulen) sys::callctor<T>(buf+ulen);
     }
   }
+  // new elements are left as is and the caller writes all of them. only for
+  // plain data types: nothing runs if the element is never written
+  INLINE void setsize(int i, noinitializetype) {
+    static_assert(__has_trivial_destructor(T),
+                  "uninitialized elements must not need a destructor");
+    if (i>alen) reserve(i);
+    ulen = i;
+  }
 
   T remove(int i) {
     assert(i<ulen);
@@ -111,7 +144,7 @@ template <class T> struct vector : noncopyable {
   static INLINE int heapparent(int i) { return (i - 1) >> 1; }
   static INLINE int heapchild(int i) { return (i << 1) + 1; }
 
-  void buildheap() { for(int i = ulen/2; i >= 0; i--) downheap(i); }
+  void buildheap() { for(int i = ulen/2-1; i >= 0; i--) downheap(i); }
 
   int upheap(int i) {
     auto score = buf[i];
@@ -158,6 +191,108 @@ template <class T> struct vector : noncopyable {
     return e;
   }
 };
+// vector with room for N elements in place. it only goes to the heap when
+// it grows past them. like vector, elements are moved around with memcpy
+template <class T, int N> struct smallvector : noncopyable {
+  T *buf;
+  int alen, ulen;
+  char DEFAULT_ALIGNED local[N*sizeof(T)];
+  INLINE smallvector() : buf((T*) local), alen(N), ulen(0) {}
+  INLINE ~smallvector() { setsize(0); if (!islocal()) FREE(buf); }
+  INLINE bool islocal() const { return buf == (const T*) local; }
+  INLINE T &add(const T &x) {
+    const T copy(x);
+    if (ulen==alen) prealloc(ulen+1);
+    sys::callctor<T>(buf+ulen, copy);
+    return buf[ulen++];
+  }
+  INLINE T &add() {
+    if (ulen==alen) prealloc(ulen+1);
+    sys::callctor<T>(buf+ulen);
+    return buf[ulen++];
+  }
+  T *begin() { return buf; }
+  T *end() { return buf+ulen; }
+  const T *begin() const { return buf; }
+  const T *end() const { return buf+ulen; }
+  INLINE T &pop() { return buf[--ulen]; }
+  INLINE T &last() { return buf[ulen-1]; }
+  INLINE bool empty() const { return ulen==0; }
+  INLINE int length() const { return ulen; }
+  INLINE const T &operator[](int i) const { assert(i>=0 && i<ulen); return buf[i]; }
+  INLINE T &operator[](int i) { assert(i>=0 && i<ulen); return buf[i]; }
+  INLINE T *getbuf() { return buf; }
+  INLINE void prealloc(int len) {
+    if (len <= alen) return;
+    alen = nextpowerof2(len);
+    if (islocal()) {
+      const auto heap = (T*) MALLOC(alen*sizeof(T));
+      memcpy((void*) heap, buf, ulen*sizeof(T));
+      buf = heap;
+    } else
+      buf = (T*) REALLOC(buf, alen*sizeof(T));
+  }
+  void setsize(int i) {
+    if (i<ulen)
+      for(; ulen>i; --ulen) buf[ulen-1].~T();
+    else if (i>ulen) {
+      prealloc(i);
+      for(; i>ulen; ++ulen) sys::callctor<T>(buf+ulen);
+    }
+  }
+  T removeunordered(int i) {
+    assert(i<ulen);
+    T e = buf[i];
+    ulen--;
+    if(ulen>0) buf[i] = buf[ulen];
+    return e;
+  }
+};
+
+// at most N elements and never any heap allocation
+template <class T, int N> struct fixedvector : noncopyable {
+  int ulen;
+  char DEFAULT_ALIGNED local[N*sizeof(T)];
+  INLINE fixedvector() : ulen(0) {}
+  INLINE ~fixedvector() { setsize(0); }
+  INLINE T &add(const T &x) {
+    assert(ulen<N && "fixedvector is full");
+    sys::callctor<T>(getbuf()+ulen, x);
+    return getbuf()[ulen++];
+  }
+  INLINE T &add() {
+    assert(ulen<N && "fixedvector is full");
+    sys::callctor<T>(getbuf()+ulen);
+    return getbuf()[ulen++];
+  }
+  T *begin() { return getbuf(); }
+  T *end() { return getbuf()+ulen; }
+  const T *begin() const { return getbuf(); }
+  const T *end() const { return getbuf()+ulen; }
+  INLINE T &pop() { return getbuf()[--ulen]; }
+  INLINE T &last() { return getbuf()[ulen-1]; }
+  INLINE bool empty() const { return ulen==0; }
+  INLINE bool full() const { return ulen==N; }
+  INLINE int length() const { return ulen; }
+  INLINE const T &operator[](int i) const { assert(i>=0 && i<ulen); return getbuf()[i]; }
+  INLINE T &operator[](int i) { assert(i>=0 && i<ulen); return getbuf()[i]; }
+  INLINE T *getbuf() { return (T*) local; }
+  INLINE const T *getbuf() const { return (const T*) local; }
+  void setsize(int i) {
+    assert(i<=N && "fixedvector is full");
+    if (i<ulen)
+      for(; ulen>i; --ulen) getbuf()[ulen-1].~T();
+    else
+      for(; i>ulen; ++ulen) sys::callctor<T>(getbuf()+ulen);
+  }
+  T removeunordered(int i) {
+    assert(i<ulen);
+    T e = getbuf()[i];
+    ulen--;
+    if(ulen>0) getbuf()[i] = getbuf()[ulen];
+    return e;
+  }
+};
 typedef vector<char *> cvector;
 typedef vector<int> ivector;
 } /* namespace q */
@@ -0,0 +1,137 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - wasm.hpp -> sse2 intrinsics implemented with webassembly simd128
+ -------------------------------------------------------------------------*/
+#pragma once
+#include <wasm_simd128.h>
+#include <stdint.h>
+
+// the same subset as neon.hpp. simd128 has one v128_t for all lanes: the
+// three sse types stay distinct for the overloads of ssef, ssei and sseb
+typedef float __m128 __attribute__((__vector_size__(16), __aligned__(16)));
+typedef v128_t __m128i;
+typedef double __m128d __attribute__((__vector_size__(16), __aligned__(16)));
+
+#define _MM_SHUFFLE(fp3,fp2,fp1,fp0) (((fp3)<<6)|((fp2)<<4)|((fp1)<<2)|(fp0))
+
+/*-------------------------------------------------------------------------
+ - casts
+ -------------------------------------------------------------------------*/
+INLINE __m128 _mm_castsi128_ps(__m128i a) {return (__m128) a;}
+INLINE __m128i _mm_castps_si128(__m128 a) {return (__m128i) a;}
+INLINE __m128d _mm_castps_pd(__m128 a) {return (__m128d) a;}
+INLINE __m128 _mm_castpd_ps(__m128d a) {return (__m128) a;}
+INLINE __m128d _mm_castsi128_pd(__m128i a) {return (__m128d) a;}
+INLINE __m128i _mm_castpd_si128(__m128d a) {return (__m128i) a;}
+
+/*-------------------------------------------------------------------------
+ - floats
+ -------------------------------------------------------------------------*/
+#define WASM_PS(X) ((__m128) (X))
+#define WASM_V(X) ((v128_t) (X))
+INLINE __m128 _mm_setzero_ps() {return WASM_PS(wasm_f32x4_splat(0.f));}
+INLINE __m128 _mm_set1_ps(float a) {return WASM_PS(wasm_f32x4_splat(a));}
+INLINE __m128 _mm_set_ps(float d, float c, float b, float a) {
+  return WASM_PS(wasm_f32x4_make(a,b,c,d));
+}
+INLINE __m128 _mm_load_ps(const float *p) {return WASM_PS(wasm_v128_load(p));}
+INLINE __m128 _mm_loadu_ps(const float *p) {return WASM_PS(wasm_v128_load(p));}
+INLINE __m128 _mm_load_ss(const float *p) {return WASM_PS(wasm_f32x4_make(*p,0.f,0.f,0.f));}
+INLINE void _mm_store_ps(float *p, __m128 a) {wasm_v128_store(p, WASM_V(a));}
+INLINE void _mm_storeu_ps(float *p, __m128 a) {wasm_v128_store(p, WASM_V(a));}
+INLINE float _mm_cvtss_f32(__m128 a) {return a[0];}
+
+#define WASM_BINARY(NAME, OP)\
+INLINE __m128 NAME(__m128 a, __m128 b) {return WASM_PS(OP(WASM_V(a), WASM_V(b)));}
+WASM_BINARY(_mm_add_ps, wasm_f32x4_add)
+WASM_BINARY(_mm_sub_ps, wasm_f32x4_sub)
+WASM_BINARY(_mm_mul_ps, wasm_f32x4_mul)
+WASM_BINARY(_mm_div_ps, wasm_f32x4_div)
+WASM_BINARY(_mm_and_ps, wasm_v128_and)
+WASM_BINARY(_mm_or_ps, wasm_v128_or)
+WASM_BINARY(_mm_xor_ps, wasm_v128_xor)
+WASM_BINARY(_mm_cmpeq_ps, wasm_f32x4_eq)
+WASM_BINARY(_mm_cmplt_ps, wasm_f32x4_lt)
+WASM_BINARY(_mm_cmple_ps, wasm_f32x4_le)
+WASM_BINARY(_mm_cmpneq_ps, wasm_f32x4_ne)
+#undef WASM_BINARY
+INLINE __m128 _mm_andnot_ps(__m128 a, __m128 b) {return WASM_PS(wasm_v128_andnot(WASM_V(b), WASM_V(a)));}
+INLINE __m128 _mm_cmpnlt_ps(__m128 a, __m128 b) {return WASM_PS(wasm_v128_not(wasm_f32x4_lt(WASM_V(a), WASM_V(b))));}
+INLINE __m128 _mm_cmpnle_ps(__m128 a, __m128 b) {return WASM_PS(wasm_v128_not(wasm_f32x4_le(WASM_V(a), WASM_V(b))));}
+INLINE __m128 _mm_sqrt_ps(__m128 a) {return WASM_PS(wasm_f32x4_sqrt(WASM_V(a)));}
+
+// pmin(b,a) is a<b ? a : b, the x86 rule returning b with nans
+INLINE __m128 _mm_min_ps(__m128 a, __m128 b) {return WASM_PS(wasm_f32x4_pmin(WASM_V(b), WASM_V(a)));}
+INLINE __m128 _mm_max_ps(__m128 a, __m128 b) {return WASM_PS(wasm_f32x4_pmax(WASM_V(b), WASM_V(a)));}
+
+// no estimates in simd128: exact values, the newton step of ssef is a no-op
+INLINE __m128 _mm_rcp_ps(__m128 a) {return WASM_PS(wasm_f32x4_div(wasm_f32x4_splat(1.f), WASM_V(a)));}
+INLINE __m128 _mm_rsqrt_ps(__m128 a) {
+  return WASM_PS(wasm_f32x4_div(wasm_f32x4_splat(1.f), wasm_f32x4_sqrt(WASM_V(a))));
+}
+
+INLINE int _mm_movemask_ps(__m128 a) {return int(wasm_i32x4_bitmask(WASM_V(a)));}
+INLINE __m128 _mm_unpacklo_ps(__m128 a, __m128 b) {return WASM_PS(wasm_i32x4_shuffle(WASM_V(a), WASM_V(b), 0,4,1,5));}
+INLINE __m128 _mm_unpackhi_ps(__m128 a, __m128 b) {return WASM_PS(wasm_i32x4_shuffle(WASM_V(a), WASM_V(b), 2,6,3,7));}
+
+// the selector is a constant at every call site and folds in a shuffle
+INLINE __m128 _mm_shuffle_ps(__m128 a, __m128 b, int imm) {
+  const __m128 r = {a[imm&3], a[(imm>>2)&3], b[(imm>>4)&3], b[(imm>>6)&3]};
+  return r;
+}
+
+/*-------------------------------------------------------------------------
+ - integers
+ -------------------------------------------------------------------------*/
+INLINE __m128i _mm_setzero_si128() {return wasm_i32x4_splat(0);}
+INLINE __m128i _mm_set1_epi32(int a) {return wasm_i32x4_splat(a);}
+INLINE __m128i _mm_set_epi32(int d, int c, int b, int a) {return wasm_i32x4_make(a,b,c,d);}
+INLINE __m128i _mm_set1_epi8(char a) {return wasm_i8x16_splat(int8_t(a));}
+INLINE __m128i _mm_cvtsi32_si128(int a) {return wasm_i32x4_make(a,0,0,0);}
+INLINE __m128i _mm_load_si128(const __m128i *p) {return wasm_v128_load(p);}
+INLINE __m128i _mm_loadu_si128(const __m128i *p) {return wasm_v128_load(p);}
+INLINE void _mm_store_si128(__m128i *p, __m128i a) {wasm_v128_store(p, a);}
+INLINE void _mm_storeu_si128(__m128i *p, __m128i a) {wasm_v128_store(p, a);}
+
+INLINE __m128i _mm_add_epi32(__m128i a, __m128i b) {return wasm_i32x4_add(a, b);}
+INLINE __m128i _mm_sub_epi32(__m128i a, __m128i b) {return wasm_i32x4_sub(a, b);}
+INLINE __m128i _mm_and_si128(__m128i a, __m128i b) {return wasm_v128_and(a, b);}
+INLINE __m128i _mm_or_si128(__m128i a, __m128i b) {return wasm_v128_or(a, b);}
+INLINE __m128i _mm_xor_si128(__m128i a, __m128i b) {return wasm_v128_xor(a, b);}
+INLINE __m128i _mm_andnot_si128(__m128i a, __m128i b) {return wasm_v128_andnot(b, a);}
+
+// simd128 takes the count modulo 32 where x86 gives zero (or the sign)
+INLINE __m128i _mm_slli_epi32(__m128i a, int n) {
+  return unsigned(n) > 31u ? wasm_i32x4_splat(0) : wasm_i32x4_shl(a, n);
+}
+INLINE __m128i _mm_srli_epi32(__m128i a, int n) {
+  return unsigned(n) > 31u ? wasm_i32x4_splat(0) : wasm_u32x4_shr(a, n);
+}
+INLINE __m128i _mm_srai_epi32(__m128i a, int n) {
+  return wasm_i32x4_shr(a, unsigned(n) > 31u ? 31 : n);
+}
+
+INLINE __m128i _mm_cmpeq_epi32(__m128i a, __m128i b) {return wasm_i32x4_eq(a, b);}
+INLINE __m128i _mm_cmplt_epi32(__m128i a, __m128i b) {return wasm_i32x4_lt(a, b);}
+INLINE __m128i _mm_cmpgt_epi32(__m128i a, __m128i b) {return wasm_i32x4_gt(a, b);}
+
+// round to nearest even as the default mxcsr does
+INLINE __m128i _mm_cvtps_epi32(__m128 a) {return wasm_i32x4_trunc_sat_f32x4(wasm_f32x4_nearest(WASM_V(a)));}
+INLINE __m128 _mm_cvtepi32_ps(__m128i a) {return WASM_PS(wasm_f32x4_convert_i32x4(a));}
+
+INLINE __m128i _mm_shuffle_epi32(__m128i a, int imm) {
+  return wasm_i32x4_make(a[imm&3], a[(imm>>2)&3], a[(imm>>4)&3], a[(imm>>6)&3]);
+}
+INLINE __m128i _mm_unpacklo_epi8(__m128i a, __m128i b) {
+  return wasm_i8x16_shuffle(a, b, 0,16,1,17,2,18,3,19,4,20,5,21,6,22,7,23);
+}
+INLINE __m128i _mm_unpacklo_epi16(__m128i a, __m128i b) {
+  return wasm_i16x8_shuffle(a, b, 0,8,1,9,2,10,3,11);
+}
+INLINE __m128i _mm_cmpeq_epi8(__m128i a, __m128i b) {return wasm_i8x16_eq(a, b);}
+INLINE int _mm_movemask_epi8(__m128i a) {return int(wasm_i8x16_bitmask(a));}
+#undef WASM_V
+#undef WASM_PS
+
+// no spin hint and no flush to zero control in webassembly
+INLINE void _mm_pause() {}
@@ -8,11 +8,13 @@
 #include "bvh.hpp"
 #include "bvhinternal.hpp"
 #include "base/algorithm.hpp"
+#include "base/atomics.hpp"
 #include "base/console.hpp"
 #include "base/script.hpp"
 #include "base/math.hpp"
 #include "base/sys.hpp"
 #include "base/sse.hpp"
+#include "base/task.hpp"
 #include "base/vector.hpp"
 
 namespace q {
@@ -38,142 +40,190 @@ struct centroid {
   vec3f v;
 };
 
-enum {OTHERAXISNUM = 2};
 enum {ONLEFT, ONRIGHT};
 
-// n log(n) compiler with bounding box sweeping and SAH heuristics
+// binned sah compiler. each node bins the centroids of its primitives along
+// the three axes and the best bin boundary gives the partition. large nodes
+// spawn tasks such that subtrees are built in parallel. leaves store their
+// triangles at the position of their primitives in "ids" such that every
+// subtree owns one contiguous range of triangles (see refit)
+static const u32 BINNUM = 16;
+static const s32 PARALLEL_PRIMNUM = 4096;
+
 struct compiler {
-  compiler(void) : n(0), accnum(0), currid(0), leafnum(0), nodenum(0) {}
+  compiler(void) : n(0), linear(false), nodenum(1), leafnum(0), instnum(0) {}
   void injection(const primitive *soup, u32 primnum);
-  void compile(void);
-  vector<u8> istri;
-  vector<s32> pos;
-  vector<u32> ids[3];
-  vector<u32> tmpids;
+  void compile(bool parallel = true, bool spatial = false);
+  vector<u32> ids;
+  vector<u32> codes; // morton code of the centroid of each ids entry
+  vector<centroid> centroids;
   vector<aabb> boxes;
-  vector<aabb> rlboxes;
   const primitive *prims;
   vector<waldtriangle> acc;
+  vector<instanceleaf> instances;
   intersector::node *root;
-  s32 n, accnum;
-  u32 currid;
+  s32 n;
+  bool linear; // split at the highest differing bit of the codes (lbvh)
   aabb scenebox;
-  u32 leafnum, nodenum;
+  atomic nodenum, leafnum, instnum;
 };
 
-template<u32 axis> struct sorter {
-  const vector<centroid> &centroids;
-  sorter(const vector<centroid> &c) : centroids(c) {}
-  INLINE int operator() (const u32 a, const u32 b) const  {
-    return centroids[a].v[axis] < centroids[b].v[axis];
-  }
+struct mortonid { u32 key, id; };
+struct mortonkeyof {
+  INLINE u32 operator() (const mortonid &x) const { return x.key; }
 };
 
 void compiler::injection(const primitive *soup, const u32 primnum) {
-  vector<centroid> centroids;
-
   root = NEWAE(intersector::node,2*primnum+1);
-
-  loopi(3) ids[i].setsize(primnum);
-  pos.setsize(primnum);
-  tmpids.setsize(primnum);
-  centroids.setsize(primnum);
-  boxes.setsize(primnum);
-  rlboxes.setsize(primnum);
-  istri.setsize(primnum);
+  ids.setsize(primnum, noinitialize);
+  centroids.setsize(primnum, noinitialize);
+  boxes.setsize(primnum, noinitialize);
   n = primnum;
 
   scenebox = aabb(FLT_MAX, -FLT_MAX);
+  s32 instnum = 0;
   loopi(n) {
-    istri[i] = soup[i].type == primitive::TRI;
+    ids[i] = i;
     centroids[i] = centroid(soup[i]);
     boxes[i] = soup[i].getaabb();
     scenebox.compose(boxes[i]);
+    instnum += soup[i].type == primitive::INSTANCE ? 1 : 0;
   }
 
-  loopi(3) loopj(n) ids[i][j] = j;
-  quicksort(&ids[0][0], &ids[0][0]+primnum, sorter<0>(centroids));
-  quicksort(&ids[1][0], &ids[1][0]+primnum, sorter<1>(centroids));
-  quicksort(&ids[2][0], &ids[2][0]+primnum, sorter<2>(centroids));
+  // presort the primitives along a morton curve such that the ranges the
+  // binning walks through stay coherent in memory from the root down
+  codes.setsize(primnum, noinitialize);
+  if (n > 1) {
+    vector<mortonid> keys, tmp;
+    keys.setsize(n, noinitialize);
+    tmp.setsize(n, noinitialize);
+    loopi(n) keys[i] = mortonid{morton(centroids[i].v, scenebox), u32(i)};
+    radixsort(&keys[0], &tmp[0], n, mortonkeyof());
+    loopi(n) {
+      ids[i] = keys[i].id;
+      codes[i] = keys[i].key;
+    }
+  } else
+    codes[0] = 0;
   prims = soup;
   acc.setsize(primnum);
+  instances.setsize(instnum);
 }
 
+struct segment {
+  segment(void) {}
+  segment(s32 first, s32 last, u32 id, const aabb &box) :
+    first(first), last(last), id(id), box(box) {}
+  s32 first, last;
+  u32 id;
+  aabb box;
+};
+
 struct partition {
   aabb boxes[2];
-  float cost;
-  u32 axis;
-  int first[2], last[2];
-  partition() {}
-  partition(int f, int l, u32 d) : cost(FLT_MAX), axis(d) {
-    boxes[ONLEFT] = boxes[ONRIGHT] = aabb(FLT_MAX, -FLT_MAX);
-    first[ONRIGHT] = first[ONLEFT] = f;
-    last[ONRIGHT] = last[ONLEFT] = l;
+  float cost, org, scale;
+  u32 axis, bin;
+  INLINE u32 binof(const vec3f &c) const {
+    return u32(clamp(int((c[axis]-org)*scale), 0, int(BINNUM)-1));
   }
 };
 
-// sweep the bounding boxen from left to right
-template <u32 axis> INLINE partition sweep(compiler &c, int first, int last) {
-  partition part(first, last, axis);
-
-  // compute the inclusion sequence
-  c.rlboxes[c.ids[axis][last]] = c.boxes[c.ids[axis][last]];
-  for (s32 j = last - 1; j >= first; --j) {
-    c.rlboxes[c.ids[axis][j]] = c.boxes[c.ids[axis][j]];
-    c.rlboxes[c.ids[axis][j]].compose(c.rlboxes[c.ids[axis][j + 1]]);
+// find the best bin boundary on all three axes. return false if all
+// centroids are the same and binning cannot split them
+static bool binning(const compiler &c, const segment &seg, partition &best,
+                    bool &alltris) {
+  aabb cbox(FLT_MAX, -FLT_MAX);
+  alltris = true;
+  for (auto j = seg.first; j <= seg.last; ++j) {
+    const auto id = c.ids[j];
+    cbox.compose(aabb(c.centroids[id].v, c.centroids[id].v));
+    if (c.prims[id].type != primitive::TRI) alltris = false;
   }
 
-  // sweep from left to right and find the best partition
-  aabb box(FLT_MAX, -FLT_MAX);
-  s32 primnum = (last-first)+1, n = 1;
-  part.cost = FLT_MAX;
-  bool alltris = true;
-  for (s32 j = first; j < last; ++j) {
-    const u32 left = c.ids[axis][j], right = c.ids[axis][j+1];
-    box.compose(c.boxes[left]);
-    const auto larea = box.halfarea(), rarea = c.rlboxes[right].halfarea();
-    const auto cost = larea*n + rarea*(primnum-n);
-    n++;
-    if (!c.istri[left]) alltris = false;
-    if (cost > part.cost) continue;
-    part.cost = cost;
-    part.last[ONLEFT] = j;
-    part.first[ONRIGHT] = j + 1;
-    part.boxes[ONLEFT] = box;
-    part.boxes[ONRIGHT] = c.rlboxes[c.ids[axis][j + 1]];
-  }
-
-  // if there is a box, we do not try to make a leaf from this node since we
-  // want to have one box per leaf only
-  const u32 id = c.ids[axis][last];
-  if (!alltris || !c.istri[id]) return part;
-
-  // get the real cost (with takes into account traversal and intersection)
-  box.compose(c.boxes[id]);
-  const auto harea = box.halfarea();
-  part.cost *= sahintersectioncost;
-  part.cost += sahtraversalcost * harea;
-  if (primnum > maxprimitivenum) return part;
+  best.cost = FLT_MAX;
+  const auto extent = cbox.pmax - cbox.pmin;
+  loopk(3) {
+    if (extent[k] <= 0.f) continue;
+    partition part;
+    part.axis = k;
+    part.org = cbox.pmin[k];
+    part.scale = float(BINNUM) * (1.f-1e-5f) / extent[k];
+
+    // bounding boxes and primitive numbers of each bin
+    aabb bins[BINNUM];
+    s32 num[BINNUM];
+    loopi(s32(BINNUM)) {
+      bins[i] = aabb(FLT_MAX, -FLT_MAX);
+      num[i] = 0;
+    }
+    for (auto j = seg.first; j <= seg.last; ++j) {
+      const auto id = c.ids[j];
+      const auto b = part.binof(c.centroids[id].v);
+      bins[b].compose(c.boxes[id]);
+      ++num[b];
+    }
 
-  // test the last partition where all primitives are inside one node
-  const auto cost = sahintersectioncost*primnum*harea;
-  if (cost <= part.cost) {
-    part.cost = cost;
-    part.last[ONRIGHT]  = part.last[ONLEFT]  = -1;
-    part.first[ONRIGHT] = part.first[ONLEFT] = -1;
-    part.boxes[ONRIGHT] = part.boxes[ONLEFT] = box;
+    // sweep from right to left, then from left to right to get the costs
+    aabb rboxes[BINNUM];
+    s32 rnum[BINNUM];
+    rboxes[BINNUM-1] = bins[BINNUM-1];
+    rnum[BINNUM-1] = num[BINNUM-1];
+    for (s32 i = BINNUM-2; i > 0; --i) {
+      rboxes[i] = bins[i];
+      rboxes[i].compose(rboxes[i+1]);
+      rnum[i] = num[i] + rnum[i+1];
+    }
+    aabb lbox(FLT_MAX, -FLT_MAX);
+    s32 lnum = 0;
+    for (u32 i = 1; i < BINNUM; ++i) {
+      lbox.compose(bins[i-1]);
+      lnum += num[i-1];
+      if (lnum == 0 || rnum[i] == 0) continue;
+      const auto cost = lbox.halfarea()*lnum + rboxes[i].halfarea()*rnum[i];
+      if (cost >= best.cost) continue;
+      part.cost = cost;
+      part.bin = i;
+      part.boxes[ONLEFT] = lbox;
+      part.boxes[ONRIGHT] = rboxes[i];
+      best = part;
+    }
   }
-  return part;
+  return best.cost != FLT_MAX;
 }
 
-struct segment {
-  segment(void) {}
-  segment(s32 first, s32 last, u32 id, const aabb &box) :
-    first(first), last(last), id(id), box(box) {}
-  s32 first, last;
-  u32 id;
-  aabb box;
-};
+// linear split: the codes of the segment are sorted so the primitives with
+// the highest differing bit set are all on the right. this is the radix tree
+// of karras et al. built top down. equal codes are cut in the middle. ids
+// are never moved so positions and codes stay in sync. returns the first
+// index of the right child
+static s32 mortonsplit(const compiler &c, const segment &seg, partition &best,
+                       bool &alltris) {
+  const auto first = c.codes[seg.first], last = c.codes[seg.last];
+  s32 middle;
+  if (first == last) {
+    middle = (seg.first + seg.last + 1) / 2;
+    best.axis = 0;
+  } else {
+    const auto bit = u32(__bsr(int(first ^ last)));
+    auto lo = seg.first, hi = seg.last;
+    while (hi - lo > 1) {
+      const auto mid = (lo + hi) / 2;
+      if ((c.codes[mid] >> bit) & 1) hi = mid; else lo = mid;
+    }
+    middle = hi;
+    best.axis = bit % 3;
+  }
+  alltris = true;
+  loopk(2) best.boxes[k] = aabb(FLT_MAX, -FLT_MAX);
+  for (auto j = seg.first; j <= seg.last; ++j) {
+    const auto id = c.ids[j];
+    best.boxes[j < middle ? ONLEFT : ONRIGHT].compose(c.boxes[id]);
+    if (c.prims[id].type != primitive::TRI) alltris = false;
+  }
+  best.cost = best.boxes[ONLEFT].halfarea()*float(middle-seg.first) +
+              best.boxes[ONRIGHT].halfarea()*float(seg.last-middle+1);
+  return middle;
+}
 
 INLINE void maketriangle(const primitive &t, waldtriangle &w, u32 id, u32 matid) {
   const vec3f &A(t.v[0]), &B(t.v[1]), &C(t.v[2]);
@@ -193,134 +243,944 @@ INLINE void maketriangle(const primitive &t, waldtriangle &w, u32 id, u32 matid)
   w.matid = matid;
 }
 
-INLINE void makenode(compiler &c, const segment &data, u32 axis) {
+// children are always allocated in pairs right after their parent
+INLINE u32 makenode(compiler &c, const segment &data, u32 axis) {
+  const u32 childid = (c.nodenum += 2) - 2;
   c.root[data.id].box = data.box;
   c.root[data.id].setflag(intersector::NONLEAF);
   c.root[data.id].setaxis(axis);
-  c.root[data.id].setoffset(c.currid+1-data.id);
-  c.nodenum++;
+  c.root[data.id].setoffset(childid-data.id);
+  return childid;
 }
 
 INLINE void makeleaf(compiler &c, const segment &data) {
   const auto n = data.last - data.first + 1;
-  const auto &first = c.prims[c.ids[0][data.first]];
+  const auto &first = c.prims[c.ids[data.first]];
   auto &node = c.root[data.id];
   node.box = data.box;
   if (first.type == primitive::INTERSECTOR) {
     assert(n==1);
     node.setflag(intersector::ISECLEAF);
     node.setptr(first.isec);
+  } else if (first.type == primitive::INSTANCE) {
+    assert(n==1);
+    auto &inst = c.instances[(c.instnum += 1) - 1];
+    inst.toobj = first.inst->linear.inverse();
+    inst.tonormal = inst.toobj.transposed();
+    inst.org = -xfmvector(inst.toobj, first.inst->translation);
+    inst.isec = first.inst->isec;
+    node.setflag(intersector::INSTLEAF);
+    node.setptr(&inst);
   } else {
+    auto accnum = data.first;
     node.setflag(intersector::TRILEAF);
-    node.setptr(&c.acc[c.accnum]);
-    for (auto j = data.first; j <= data.last; ++j) {
-      const auto id = c.ids[0][j];
+    node.setptr(&c.acc[accnum]);
+    for (auto j = data.first; j <= data.last; ++j, ++accnum) {
+      const auto id = c.ids[j];
       assert(c.prims[id].type == primitive::TRI);
-      maketriangle(c.prims[id], c.acc[c.accnum], id, 0);
-      c.acc[c.accnum++].num = n; // encode number of prims in each triangle
+      maketriangle(c.prims[id], c.acc[accnum], id, 0);
+      c.acc[accnum].num = n; // encode number of prims in each triangle
     }
   }
-  c.leafnum++;
-  c.nodenum++;
+  ++c.leafnum;
 }
 
+static const float AABBEPS = 1e-6f;
 INLINE void growboxes(compiler &c) {
-  const float aabbeps = 1e-6f;
-  loopi(2*c.n-1) {
-    c.root[i].box.pmin = c.root[i].box.pmin - vec3f(aabbeps);
-    c.root[i].box.pmax = c.root[i].box.pmax + vec3f(aabbeps);
+  loopi(s32(c.nodenum)) {
+    c.root[i].box.pmin = c.root[i].box.pmin - vec3f(AABBEPS);
+    c.root[i].box.pmax = c.root[i].box.pmax + vec3f(AABBEPS);
   }
 }
 
-void compiler::compile(void) {
+static void build(compiler &c, const segment &seg, task *owner);
+
+// build one subtree per element
+struct buildtask : public task {
+  INLINE buildtask(compiler &c, const segment *s, u32 n, u32 waiternum = 0) :
+    task("buildtask", n, waiternum), c(c)
+  {
+    loopi(s32(n)) seg[i] = s[i];
+  }
+  virtual void run(u32 idx) { build(c, seg[idx], this); }
+  compiler &c;
+  segment seg[2];
+};
+
+// build the subtree serially. with an owner task, large nodes give their two
+// children to a new task that ends the owner
+static void build(compiler &c, const segment &seg, task *owner) {
   segment node;
   segment stack[64];
   u32 stacksz = 1;
-  stack[0] = segment(0,n-1,0,scenebox);
+  stack[0] = seg;
 
   while (stacksz) {
     node = stack[--stacksz];
     for (;;) {
+      const auto primnum = node.last - node.first + 1;
 
       // we are done and we make a leaf
-      if (node.last-node.first == 0) {
-        makeleaf(*this, node);
+      if (primnum == 1) {
+        makeleaf(c, node);
         break;
       }
 
-      // find the best partition for this node
-      partition best = sweep<0>(*this, node.first, node.last);
-      partition part = sweep<1>(*this, node.first, node.last);
-      if (part.cost < best.cost) best = part;
-      part = sweep<2>(*this, node.first, node.last);
-      if (part.cost < best.cost) best = part;
+      // find the best partition for this node. if centroids cannot be
+      // binned, we simply cut the range in two
+      partition best;
+      bool alltris;
+      s32 middle = node.first;
+      auto binned = true;
+      if (c.linear)
+        middle = mortonsplit(c, node, best, alltris);
+      else
+        binned = binning(c, node, best, alltris);
 
-      // The best partition is actually *no* partition: we make a leaf
-      if (best.first[ONLEFT] == -1) {
-        makeleaf(*this, node);
-        break;
+      // if there is a box, we do not try to make a leaf from this node since
+      // we want to have one box per leaf only
+      if (alltris && primnum <= maxprimitivenum) {
+        const auto harea = node.box.halfarea();
+        const auto leafcost = sahintersectioncost*primnum*harea;
+        const auto splitcost = binned ?
+          sahintersectioncost*best.cost + sahtraversalcost*harea : FLT_MAX;
+        if (leafcost <= splitcost) {
+          makeleaf(c, node);
+          break;
+        }
       }
 
-      // register this node
-      makenode(*this, node, best.axis);
-
-      // first, store the positions of the primitives
-      for (int j = best.first[ONLEFT]; j <= best.last[ONLEFT]; ++j)
-        pos[ids[best.axis][j]] = ONLEFT;
-      for (int j = best.first[ONRIGHT]; j <= best.last[ONRIGHT]; ++j)
-        pos[ids[best.axis][j]] = ONRIGHT;
-
-      // then, for each axis, reorder the indices for the next step
-      int leftnum, rightnum;
-      loopi(OTHERAXISNUM) {
-        const int otheraxis[] = {1,2,0,1};
-        const int d0 = otheraxis[best.axis + i];
-        leftnum = 0, rightnum = 0;
-        for (int j = node.first; j <= node.last; ++j)
-          if (pos[ids[d0][j]] == ONLEFT)
-            ids[d0][node.first + leftnum++] = ids[d0][j];
+      // partition the indices in place. linear splits do not move them
+      if (c.linear)
+        assert(middle > node.first && middle <= node.last);
+      else if (binned) {
+        auto i = node.first, j = node.last;
+        while (i <= j)
+          if (best.binof(c.centroids[c.ids[i]].v) < best.bin)
+            ++i;
           else
-            tmpids[rightnum++] = ids[d0][j];
-        for (int j = node.first + leftnum; j <= node.last; ++j)
-          ids[d0][j] = tmpids[j - leftnum - node.first];
+            swap(c.ids[i], c.ids[j--]);
+        middle = i;
+      } else {
+        middle = (node.first + node.last + 1) / 2;
+        best.axis = 0;
+        loopk(2) best.boxes[k] = aabb(FLT_MAX, -FLT_MAX);
+        for (auto j = node.first; j <= node.last; ++j)
+          best.boxes[j < middle ? ONLEFT : ONRIGHT].compose(c.boxes[c.ids[j]]);
+      }
+
+      // register this node and its children
+      const auto childid = makenode(c, node, best.axis);
+      const segment children[] = {
+        segment(node.first, middle-1, childid, best.boxes[ONLEFT]),
+        segment(middle, node.last, childid+1, best.boxes[ONRIGHT])
+      };
+      if (owner != NULL && primnum >= PARALLEL_PRIMNUM) {
+        ref<task> job = NEWTASK(buildtask, c, children, 2);
+        job->ends(*owner);
+        job->scheduled();
+        break;
       }
 
-      // prepare the stack data for the next step
+      // go down in the smallest child to bound the stack size
+      const auto leftnum = middle - node.first, rightnum = node.last - middle + 1;
       const int p0 = rightnum > leftnum ? ONLEFT : ONRIGHT;
-      const int p1 = rightnum > leftnum ? ONRIGHT : ONLEFT;
-      stack[stacksz++] = segment(best.first[p1], best.last[p1], currid+p1+1, best.boxes[p1]);
-      node.first = best.first[p0];
-      node.last = best.last[p0];
-      node.box = best.boxes[p0];
-      node.id = currid+p0+1;
-      currid += 2;
+      stack[stacksz++] = children[p0^1];
+      node = children[p0];
+    }
+  }
+}
+
+/*-------------------------------------------------------------------------
+ - spatial splits (sbvh). long and thin triangles make boxes overlap a lot.
+ - when the children of the best object split overlap, we also try to cut
+ - the node with a plane and to clip the straddling triangles in both
+ - children. a triangle is then referenced by several leaves and the number
+ - of extra references is bounded by a budget. the build is serial
+ -------------------------------------------------------------------------*/
+VAR(bvhspatialsplit, 0, 0, 1);
+VAR(bvhspatialbudget, 0, 30, 100); // extra references in percent of the triangles
+static const float SPATIAL_ALPHA = 1e-5f; // overlap (relative to the scene area) to try
+static const u32 SPATIAL_MAXDEPTH = 48; // traversal stacks store 64 nodes
+
+struct reference {
+  INLINE reference(void) {}
+  INLINE reference(const aabb &box, u32 id) : box(box), id(id) {}
+  INLINE vec3f center(void) const { return (box.pmin+box.pmax)*0.5f; }
+  aabb box;
+  u32 id;
+};
+
+struct spatialcompiler {
+  compiler *c;
+  s32 budget;
+  float rootarea;
+};
+
+// box of the part of the triangle between lo and hi along axis and inside the
+// box of the reference
+static aabb clip(const primitive &tri, const aabb &box, u32 axis, float lo, float hi) {
+  aabb clipped = aabb::empty();
+  loopi(3) {
+    const auto &a = tri.v[i], &b = tri.v[(i+1)%3];
+    if (a[axis] >= lo && a[axis] <= hi) clipped.compose(aabb(a,a));
+    const float planes[] = {lo, hi};
+    loopj(2) {
+      const auto p = planes[j];
+      if ((a[axis] < p && b[axis] > p) || (a[axis] > p && b[axis] < p)) {
+        const auto t = (p-a[axis]) / (b[axis]-a[axis]);
+        auto x = a + t*(b-a);
+        x[axis] = p;
+        clipped.compose(aabb(x,x));
+      }
+    }
+  }
+  return intersection(clipped, box);
+}
+
+INLINE bool isempty(const aabb &box) { return any(gt(box.pmin, box.pmax)); }
+
+static aabb bounds(const vector<reference> &refs) {
+  aabb box = aabb::empty();
+  loopv(refs) box.compose(refs[i].box);
+  return box;
+}
+
+// usual binned sah over the centers of the references
+static bool objectbinning(const vector<reference> &refs, partition &best) {
+  aabb cbox = aabb::empty();
+  loopv(refs) {
+    const auto c = refs[i].center();
+    cbox.compose(aabb(c,c));
+  }
+  best.cost = FLT_MAX;
+  const auto extent = cbox.pmax - cbox.pmin;
+  loopk(3) {
+    if (extent[k] <= 0.f) continue;
+    partition part;
+    part.axis = k;
+    part.org = cbox.pmin[k];
+    part.scale = float(BINNUM) * 0.99f / extent[k];
+    aabb bins[BINNUM], rboxes[BINNUM];
+    s32 num[BINNUM], rnum[BINNUM];
+    loopi(s32(BINNUM)) {
+      bins[i] = aabb::empty();
+      num[i] = 0;
+    }
+    loopv(refs) {
+      const auto bin = part.binof(refs[i].center());
+      bins[bin].compose(refs[i].box);
+      ++num[bin];
+    }
+    rboxes[BINNUM-1] = bins[BINNUM-1];
+    rnum[BINNUM-1] = num[BINNUM-1];
+    for (s32 i = BINNUM-2; i >= 0; --i) {
+      rboxes[i] = sum(rboxes[i+1], bins[i]);
+      rnum[i] = rnum[i+1] + num[i];
+    }
+    aabb lbox = aabb::empty();
+    s32 lnum = 0;
+    for (u32 i = 1; i < BINNUM; ++i) {
+      lbox.compose(bins[i-1]);
+      lnum += num[i-1];
+      if (lnum == 0 || rnum[i] == 0) continue;
+      const auto cost = lbox.halfarea()*lnum + rboxes[i].halfarea()*rnum[i];
+      if (cost >= best.cost) continue;
+      part.cost = cost;
+      part.bin = i;
+      part.boxes[ONLEFT] = lbox;
+      part.boxes[ONRIGHT] = rboxes[i];
+      best = part;
     }
   }
+  return best.cost != FLT_MAX;
+}
+
+struct spatialpartition {
+  float cost, plane;
+  u32 axis;
+  s32 dupnum; // references added by the split
+};
+
+// bin the clipped references in slabs of the node box. a reference enters
+// in its first bin and exits in its last one
+static bool spatialbinning(const compiler &c, const vector<reference> &refs,
+                           const aabb &box, spatialpartition &best)
+{
+  best.cost = FLT_MAX;
+  const auto extent = box.pmax - box.pmin;
+  loopk(3) {
+    if (extent[k] <= 0.f) continue;
+    const auto org = box.pmin[k], width = extent[k] / float(BINNUM);
+    aabb bins[BINNUM], rboxes[BINNUM];
+    s32 entry[BINNUM], exit[BINNUM], rnum[BINNUM];
+    loopi(s32(BINNUM)) {
+      bins[i] = aabb::empty();
+      entry[i] = exit[i] = 0;
+    }
+    loopv(refs) {
+      const auto &ref = refs[i];
+      const auto &tri = c.prims[ref.id];
+      const auto first = u32(clamp(int((ref.box.pmin[k]-org)/width), 0, int(BINNUM)-1));
+      const auto last = u32(clamp(int((ref.box.pmax[k]-org)/width), int(first), int(BINNUM)-1));
+      for (auto bin = first; bin <= last; ++bin) {
+        const auto lo = bin == 0 ? -FLT_MAX : org + float(bin)*width;
+        const auto hi = bin == BINNUM-1 ? FLT_MAX : org + float(bin+1)*width;
+        const auto clipped = clip(tri, ref.box, k, lo, hi);
+        if (!isempty(clipped)) bins[bin].compose(clipped);
+      }
+      ++entry[first];
+      ++exit[last];
+    }
+    rboxes[BINNUM-1] = bins[BINNUM-1];
+    rnum[BINNUM-1] = exit[BINNUM-1];
+    for (s32 i = BINNUM-2; i >= 0; --i) {
+      rboxes[i] = sum(rboxes[i+1], bins[i]);
+      rnum[i] = rnum[i+1] + exit[i];
+    }
+    aabb lbox = aabb::empty();
+    s32 lnum = 0;
+    for (u32 i = 1; i < BINNUM; ++i) {
+      lbox.compose(bins[i-1]);
+      lnum += entry[i-1];
+      if (lnum == 0 || rnum[i] == 0) continue;
+      const auto cost = lbox.halfarea()*lnum + rboxes[i].halfarea()*rnum[i];
+      if (cost >= best.cost) continue;
+      best.cost = cost;
+      best.plane = org + float(i)*width;
+      best.axis = k;
+      best.dupnum = lnum + rnum[i] - refs.length();
+    }
+  }
+  return best.cost != FLT_MAX;
+}
 
+static void spatialbuild(spatialcompiler &sc, vector<reference> &refs,
+                         u32 id, const aabb &box, u32 depth)
+{
+  auto &c = *sc.c;
+  const auto num = refs.length();
+  const segment node(c.ids.length(), c.ids.length()+num-1, id, box);
+  if (num == 1) {
+    c.ids.add(refs[0].id);
+    makeleaf(c, node);
+    return;
+  }
+
+  // best object split first and spatial split if its children overlap
+  partition object;
+  spatialpartition spatial;
+  const auto binned = objectbinning(refs, object);
+  bool split = false;
+  if (sc.budget > 0 && depth < SPATIAL_MAXDEPTH) {
+    auto overlap = 0.f;
+    if (binned && intersect(object.boxes[ONLEFT], object.boxes[ONRIGHT]))
+      overlap = intersection(object.boxes[ONLEFT], object.boxes[ONRIGHT]).halfarea();
+    if (!binned || overlap > SPATIAL_ALPHA*sc.rootarea)
+      split = spatialbinning(c, refs, box, spatial) &&
+              spatial.dupnum <= sc.budget &&
+              (!binned || spatial.cost < object.cost);
+  }
+
+  // make a leaf if it is cheaper
+  const auto harea = box.halfarea();
+  const auto bestcost = split ? spatial.cost : (binned ? object.cost : FLT_MAX);
+  if (num <= maxprimitivenum && (bestcost == FLT_MAX ||
+      sahintersectioncost*num*harea <= sahintersectioncost*bestcost + sahtraversalcost*harea)) {
+    loopv(refs) c.ids.add(refs[i].id);
+    makeleaf(c, node);
+    return;
+  }
+
+  // distribute the references in both children
+  vector<reference> children[2];
+  u32 axis;
+  if (split) {
+    axis = spatial.axis;
+    loopv(refs) {
+      const auto &ref = refs[i];
+      if (ref.box.pmax[axis] <= spatial.plane)
+        children[ONLEFT].add(ref);
+      else if (ref.box.pmin[axis] >= spatial.plane)
+        children[ONRIGHT].add(ref);
+      else {
+        const auto &tri = c.prims[ref.id];
+        const auto l = clip(tri, ref.box, axis, -FLT_MAX, spatial.plane);
+        const auto r = clip(tri, ref.box, axis, spatial.plane, FLT_MAX);
+        if (!isempty(l)) children[ONLEFT].add(reference(l, ref.id));
+        if (!isempty(r)) children[ONRIGHT].add(reference(r, ref.id));
+        if (!isempty(l) && !isempty(r)) --sc.budget;
+      }
+    }
+  } else if (binned) {
+    axis = object.axis;
+    loopv(refs) {
+      const auto side = object.binof(refs[i].center()) < object.bin ? ONLEFT : ONRIGHT;
+      children[side].add(refs[i]);
+    }
+  } else {
+    axis = 0;
+    loopv(refs) children[i < num/2 ? ONLEFT : ONRIGHT].add(refs[i]);
+  }
+  // clipping may leave one side empty: we cut the range in two instead
+  if (children[ONLEFT].length() == 0 || children[ONRIGHT].length() == 0) {
+    loopk(2) children[k].setsize(0);
+    loopv(refs) children[i < num/2 ? ONLEFT : ONRIGHT].add(refs[i]);
+  }
+  refs.destroy();
+
+  const auto childid = makenode(c, node, axis);
+  loopk(2) {
+    const auto childbox = bounds(children[k]);
+    spatialbuild(sc, children[k], childid+k, childbox, depth+1);
+  }
+}
+
+// every triangle is first referenced once with its full box
+static void spatialcompile(compiler &c) {
+  const auto maxrefnum = c.n + c.n*bvhspatialbudget/100;
+  vector<reference> refs(c.n);
+  loopi(c.n) refs[i] = reference(c.boxes[i], i);
+  SAFE_DELA(c.root);
+  c.root = NEWAE(intersector::node, 2*maxrefnum+1);
+  c.acc.setsize(maxrefnum);
+  c.ids.setsize(0);
+  c.ids.prealloc(maxrefnum);
+  spatialcompiler sc;
+  sc.c = &c;
+  sc.budget = maxrefnum - c.n;
+  sc.rootarea = c.scenebox.halfarea();
+  spatialbuild(sc, refs, 0, c.scenebox, 0);
+  c.acc.setsize(c.ids.length());
+}
+
+void compiler::compile(bool parallel, bool spatial) {
+  const segment seg(0,n-1,0,scenebox);
+  bool alltris = true;
+  loopi(n) alltris &= prims[i].type == primitive::TRI;
+  if (spatial && alltris)
+    spatialcompile(*this);
+  else if (!parallel || n < PARALLEL_PRIMNUM)
+    build(*this, seg, NULL);
+  else {
+    ref<task> job = NEWTASK(buildtask, *this, &seg, 1, 1);
+    job->scheduled();
+    job->wait();
+  }
   growboxes(*this);
 }
 
-intersector *create(const primitive *prims, int n) {
+// sah cost of the tree and overlap of sibling boxes, both relative to the
+// area of the root. leaves count one intersection per triangle
+static void reportquality(const intersector &tree) {
+  const auto rootarea = max(tree.root[0].box.halfarea(), FLT_MIN);
+  double cost = 0.0, overlap = 0.0;
+  loopi(s32(tree.nodenum)) {
+    const auto &node = tree.root[i];
+    const auto area = double(node.box.halfarea()/rootarea);
+    const auto flag = node.getflag();
+    if (flag == intersector::NONLEAF) {
+      const auto children = &node + node.getoffset();
+      const auto overlapbox = intersection(children[0].box, children[1].box);
+      cost += sahtraversalcost * area;
+      if (all(le(overlapbox.pmin, overlapbox.pmax)))
+        overlap += double(overlapbox.halfarea()/rootarea);
+    } else if (flag == intersector::TRILEAF)
+      cost += sahintersectioncost * area * double(node.getptr<waldtriangle>()->num);
+    else
+      cost += sahintersectioncost * area;
+  }
+  con::out("bvh: sah cost %f, sibling overlap %f root areas", cost, overlap);
+}
+
+intersector *create(const primitive *prims, int n, u32 builder) {
   if (n==0) return NULL;
+  MEMORY_TAG(MEM_BVH);
   compiler c;
   auto tree = NEWE(intersector);
+  c.linear = builder == LINEARBVH;
   c.injection(prims, n);
-  c.compile();
+  c.compile(true, !c.linear && bvhspatialsplit != 0);
   c.acc.moveto(tree->acc);
-  tree->root = c.root;
+  c.instances.moveto(tree->instances);
+
+  // the compiler allocates nodes for the worst case. we only keep the used ones
+  tree->nodenum = c.nodenum;
+  tree->root = NEWAE(intersector::node, tree->nodenum);
+  loopi(s32(tree->nodenum)) tree->root[i] = c.root[i];
+  SAFE_DELA(c.root);
+  tree->root4 = NULL;
+  tree->node4num = 0;
+  tree->tris4 = NULL;
+  tree->tri4num = 0;
   if (bvhstatitics) {
-    con::out("bvh: %d nodes %d leaves", c.nodenum, c.leafnum);
-    con::out("bvh: %f triangles/leaf", float(n) / float(c.leafnum));
+    con::out("bvh: %d nodes %d leaves", s32(c.nodenum), s32(c.leafnum));
+    con::out("bvh: %f triangles/leaf", float(tree->acc.length()) / float(c.leafnum));
+    if (tree->acc.length() != n)
+      con::out("bvh: %d references for %d triangles", tree->acc.length(), n);
+    reportquality(*tree);
   }
   return tree;
 }
 
+aabb getaabb(const intersector *isec) { return isec->root[0].box; }
+
 void destroy(intersector *bvhtree) {
   if (bvhtree == NULL) return;
   SAFE_DELA(bvhtree->root);
+  SAFE_DELA(bvhtree->root4);
+  SAFE_DELA(bvhtree->tris4);
   SAFE_DEL(bvhtree);
 }
 
+/*-------------------------------------------------------------------------
+ - 4-wide bvh. every wide node opens the inner binary nodes with the largest
+ - surface until it gets four children. the triangles of the leaves are
+ - transposed in groups of four
+ -------------------------------------------------------------------------*/
+typedef intersector::node4 node4;
+typedef intersector::tri4 tri4;
+
+static u32 packleaf(const intersector &isec, u32 id, vector<tri4> &groups) {
+  const auto tris = isec.root[id].getptr<waldtriangle>();
+  const s32 n = tris->num;
+  const u32 first = groups.length();
+  for (s32 i = 0; i < n; i += 4) {
+    auto &g = groups.add();
+    const auto num = min(n-i, 4);
+    loopj(4) {
+      const auto &tri = tris[i+min(j,num-1)];
+      g.nd[j] = tri.nd;
+      g.nu[j] = tri.n.x;
+      g.nv[j] = tri.n.y;
+      g.pu[j] = tri.vertk.x;
+      g.pv[j] = tri.vertk.y;
+      g.bu[j] = tri.bn.x;
+      g.bv[j] = tri.bn.y;
+      g.cu[j] = tri.cn.x;
+      g.cv[j] = tri.cn.y;
+      g.k[j] = u32(tri.k) | u32(tri.sign)<<2;
+      g.id[j] = tri.id;
+    }
+    g.num = num;
+    g.last = i+4 >= n ? 1 : 0;
+    g.pad[0] = g.pad[1] = 0;
+  }
+  return first;
+}
+
+// smallest power of two step such that 255 steps from org cover hi
+static u8 quantstep(float org, float hi) {
+  int e;
+  frexp((hi-org)/255.f, &e);
+  u32 biased = u32(clamp(e+127, 1, 254));
+  node4 probe;
+  probe.org[0] = org;
+  for (;;) {
+    probe.exp[0] = u8(biased);
+    if (org + 255.f*probe.step(0) >= hi || biased == 254) break;
+    ++biased;
+  }
+  return u8(biased);
+}
+
+// round the planes outward. rounding in the decoding is checked since the
+// traversal must see boxes at least as large as the exact ones
+static void quantize(node4 &wide, u32 i, const aabb &box) {
+  loopk(3) {
+    const auto org = wide.org[k], step = wide.step(k);
+    auto lo = clamp(int(floor((box.pmin[k]-org)/step)), 0, 255);
+    auto hi = clamp(int(ceil((box.pmax[k]-org)/step)), lo, 255);
+    while (lo > 0 && org + float(lo)*step > box.pmin[k]) --lo;
+    while (hi < 255 && org + float(hi)*step < box.pmax[k]) ++hi;
+    wide.qmin[k][i] = u8(lo);
+    wide.qmax[k][i] = u8(hi);
+  }
+}
+
+static u32 collapse(const intersector &isec, vector<node4> &nodes,
+                    vector<tri4> &groups, u32 id) {
+  u32 children[4], num = 0;
+  const auto &root = isec.root[id];
+  if (root.getflag() == intersector::NONLEAF) {
+    children[num++] = id + root.getoffset();
+    children[num++] = id + root.getoffset() + 1;
+  } else
+    children[num++] = id;
+  while (num < 4) {
+    s32 best = -1;
+    float area = -FLT_MAX;
+    loopi(s32(num)) {
+      const auto &node = isec.root[children[i]];
+      if (node.getflag() != intersector::NONLEAF) continue;
+      if (node.box.halfarea() <= area) continue;
+      area = node.box.halfarea();
+      best = i;
+    }
+    if (best == -1) break;
+
+    // keep the children in order: the first one replaces its parent
+    const auto parentid = children[best];
+    const auto offset = isec.root[parentid].getoffset();
+    for (s32 i = num; i > best+1; --i) children[i] = children[i-1];
+    children[best] = parentid + offset;
+    children[best+1] = parentid + offset + 1;
+    ++num;
+  }
+
+  const u32 idx = nodes.length();
+  auto &wide = nodes.add();
+  aabb box = aabb::empty();
+  loopi(s32(num)) box.compose(isec.root[children[i]].box);
+  wide.num = num;
+  loopk(3) {
+    wide.org[k] = box.pmin[k];
+    wide.exp[k] = quantstep(box.pmin[k], box.pmax[k]);
+  }
+  loopi(4) {
+    if (i < s32(num))
+      quantize(wide, i, isec.root[children[i]].box);
+    else loopk(3) wide.qmin[k][i] = wide.qmax[k][i] = 0;
+    wide.child[i] = 0;
+  }
+  wide.pad[0] = wide.pad[1] = 0;
+  loopi(s32(num)) {
+    const auto child = children[i];
+    const auto isleaf = isec.root[child].getflag() != intersector::NONLEAF;
+    nodes[idx].child[i] = isleaf ?
+      (intersector::LEAF4|packleaf(isec, child, groups)) :
+      collapse(isec, nodes, groups, child);
+  }
+  return idx;
+}
+
+void widen(intersector *isec, bool enable) {
+  if (isec == NULL) return;
+  SAFE_DELA(isec->root4);
+  SAFE_DELA(isec->tris4);
+  isec->node4num = isec->tri4num = 0;
+  if (!enable) return;
+  loopi(s32(isec->nodenum)) {
+    const auto flag = isec->root[i].getflag();
+    if (flag == intersector::ISECLEAF || flag == intersector::INSTLEAF) return;
+  }
+  vector<node4> nodes;
+  vector<tri4> groups;
+  collapse(*isec, nodes, groups, 0);
+  isec->node4num = nodes.length();
+  isec->root4 = NEWAE(node4, nodes.length());
+  memcpy(isec->root4, &nodes[0], sizeof(node4)*nodes.length());
+  isec->tri4num = groups.length();
+  isec->tris4 = NEWAE(tri4, groups.length());
+  memcpy(isec->tris4, &groups[0], sizeof(tri4)*groups.length());
+  if (bvhstatitics)
+    con::out("bvh: %d wide nodes %d triangle groups", nodes.length(), groups.length());
+}
+
+/*-------------------------------------------------------------------------
+ - refitting. topology is kept and boxes are recomputed bottom-up. the top of
+ - the tree is split in subtrees refitted in parallel. subtrees whose sah cost
+ - grew too much since they were built are rebuilt from scratch. they keep
+ - their root node and triangle range while other nodes are appended
+ -------------------------------------------------------------------------*/
+VAR(bvhrefitrebuild, 0, 50, 1000); // rebuild above this % of extra cost (0: never)
+static const u32 REFIT_DEPTH = 6;
+
+static aabb refitbox(intersector &isec, const vec3f *pos, u32 id) {
+  auto &node = isec.root[id];
+  const auto flag = node.getflag();
+  if (flag == intersector::NONLEAF) {
+    const auto child = id + node.getoffset();
+    node.box = refitbox(isec, pos, child);
+    node.box.compose(refitbox(isec, pos, child+1));
+  } else if (flag == intersector::TRILEAF) {
+    auto tris = const_cast<waldtriangle*>(node.getptr<waldtriangle>());
+    const auto n = tris->num;
+    aabb box(FLT_MAX, -FLT_MAX);
+    loopi(s32(n)) {
+      const auto v = pos + 3*tris[i].id;
+      const primitive prim(v[0], v[1], v[2]);
+      maketriangle(prim, tris[i], tris[i].id, tris[i].matid);
+      tris[i].num = n;
+      box.compose(prim.getaabb());
+    }
+    node.box = aabb(box.pmin - vec3f(AABBEPS), box.pmax + vec3f(AABBEPS));
+  }
+  // nested intersectors are not refitted
+  return node.box;
+}
+
+// sah cost of the subtree relative to its root area. we also return the
+// range of triangles it spans
+static float refitcost(const intersector &isec, u32 id, s32 &first, s32 &num) {
+  float cost = 0.f;
+  s32 last = -1;
+  first = isec.acc.length();
+  num = 0;
+  u32 stack[128];
+  u32 stacksz = 1;
+  stack[0] = id;
+  while (stacksz) {
+    const auto &node = isec.root[stack[--stacksz]];
+    const auto area = node.box.halfarea();
+    const auto flag = node.getflag();
+    if (flag == intersector::NONLEAF) {
+      cost += sahtraversalcost*area;
+      const auto child = u32(&node - isec.root) + node.getoffset();
+      stack[stacksz++] = child;
+      stack[stacksz++] = child+1;
+    } else if (flag == intersector::TRILEAF) {
+      const auto tris = node.getptr<waldtriangle>();
+      const s32 idx = tris - &isec.acc[0];
+      cost += sahintersectioncost*area*tris->num;
+      first = min(first, idx);
+      last = max(last, idx + s32(tris->num) - 1);
+      num += tris->num;
+    } else
+      num = -1; // nested intersectors cannot be rebuilt
+  }
+  if (num > 0 && last-first+1 != num) num = -1;
+  return cost / max(isec.root[id].box.halfarea(), FLT_MIN);
+}
+
+struct refitcontext {
+  intersector *isec;
+  const vec3f *pos;
+  vector<u32> top, subtrees;
+  vector<compiler*> rebuilt;
+  vector<s32> rebuiltfirst;
+};
+
+// build a new subtree from the triangles of the old one
+static compiler *rebuild(const refitcontext &ctx, s32 first, s32 num) {
+  const auto &isec = *ctx.isec;
+  vector<primitive> prims(num);
+  loopi(num) {
+    const auto v = ctx.pos + 3*isec.acc[first+i].id;
+    prims[i] = primitive(v[0], v[1], v[2]);
+  }
+  auto c = NEWE(compiler);
+  c->injection(&prims[0], num);
+  c->compile(false);
+  loopi(num) c->acc[i].id = isec.acc[first+c->acc[i].id].id;
+  return c;
+}
+
+static void refitsubtree(refitcontext &ctx, u32 idx) {
+  auto &isec = *ctx.isec;
+  const auto id = ctx.subtrees[idx];
+  s32 first, num;
+  if (bvhrefitrebuild && isec.refitcost[idx] == 0.f)
+    isec.refitcost[idx] = refitcost(isec, id, first, num);
+  refitbox(isec, ctx.pos, id);
+  if (bvhrefitrebuild == 0) return;
+  const auto cost = refitcost(isec, id, first, num);
+  const auto maxcost = isec.refitcost[idx] * (1.f + float(bvhrefitrebuild)*0.01f);
+  if (cost <= maxcost || num <= 1) return;
+  ctx.rebuilt[idx] = rebuild(ctx, first, num);
+  ctx.rebuiltfirst[idx] = first;
+}
+
+struct refittask : public task {
+  INLINE refittask(refitcontext &ctx) :
+    task("refittask", ctx.subtrees.length(), 1), ctx(ctx) {}
+  virtual void run(u32 idx) { refitsubtree(ctx, idx); }
+  refitcontext &ctx;
+};
+
+// move the rebuilt subtrees in the tree. their roots replace the old roots,
+// the other nodes are appended and the triangles go back in the same range.
+// old nodes are left unreferenced until we compact the tree
+static void splice(intersector &isec, const refitcontext &ctx) {
+  auto nodenum = isec.nodenum;
+  loopv(ctx.rebuilt) if (ctx.rebuilt[i]) nodenum += u32(ctx.rebuilt[i]->nodenum)-1;
+  auto nodes = NEWAE(intersector::node, nodenum);
+  loopi(s32(isec.nodenum)) nodes[i] = isec.root[i];
+  auto last = isec.nodenum;
+  loopv(ctx.rebuilt) {
+    const auto c = ctx.rebuilt[i];
+    if (c == NULL) continue;
+    const auto id = ctx.subtrees[i];
+    const auto first = ctx.rebuiltfirst[i];
+    rangej(1, s32(c->nodenum)) nodes[last+j-1] = c->root[j];
+    nodes[id] = c->root[0];
+    if (nodes[id].getflag() == intersector::NONLEAF)
+      nodes[id].setoffset(last + nodes[id].getoffset() - 1 - id);
+    loopj(s32(c->n)) isec.acc[first+j] = c->acc[j];
+    loopj(s32(c->nodenum)) {
+      auto &node = j == 0 ? nodes[id] : nodes[last+j-1];
+      if (node.getflag() != intersector::TRILEAF) continue;
+      const auto idx = s32(node.getptr<waldtriangle>() - &c->acc[0]);
+      node.setptr(&isec.acc[first+idx]);
+    }
+    last += u32(c->nodenum)-1;
+  }
+  SAFE_DELA(isec.root);
+  isec.root = nodes;
+  isec.nodenum = nodenum;
+}
+
+// drop the nodes no longer referenced after a splice. children are copied in
+// breadth first order so they stay next to each other
+static void compact(intersector &isec) {
+  auto nodes = NEWAE(intersector::node, isec.nodenum);
+  vector<u32> old;
+  old.add(0);
+  nodes[0] = isec.root[0];
+  u32 num = 1;
+  for (u32 i = 0; i < num; ++i) {
+    auto &node = nodes[i];
+    if (node.getflag() != intersector::NONLEAF) continue;
+    const auto child = old[i] + node.getoffset();
+    nodes[num] = isec.root[child];
+    nodes[num+1] = isec.root[child+1];
+    old.add(child);
+    old.add(child+1);
+    node.setoffset(num-i);
+    num += 2;
+  }
+  SAFE_DELA(isec.root);
+  isec.root = nodes;
+  isec.nodenum = num;
+}
+
+bool refit(intersector *isec, const vec3f *pos, u32 trinum) {
+  if (isec == NULL || u32(isec->acc.length()) != trinum) return false;
+  refitcontext ctx;
+  ctx.isec = isec;
+  ctx.pos = pos;
+
+  // split the top of the tree in subtrees
+  vector<pair<u32,u32>> fifo;
+  fifo.add(makepair(0u,0u));
+  for (int i = 0; i < fifo.length(); ++i) {
+    const auto id = fifo[i].first, depth = fifo[i].second;
+    const auto &node = isec->root[id];
+    if (depth == REFIT_DEPTH || node.getflag() != intersector::NONLEAF) {
+      ctx.subtrees.add(id);
+      continue;
+    }
+    ctx.top.add(id);
+    fifo.add(makepair(id+node.getoffset(), depth+1));
+    fifo.add(makepair(id+node.getoffset()+1, depth+1));
+  }
+  const auto subtreenum = ctx.subtrees.length();
+  if (isec->refitcost.length() != subtreenum) {
+    isec->refitcost.setsize(subtreenum);
+    loopi(subtreenum) isec->refitcost[i] = 0.f;
+  }
+  ctx.rebuilt.setsize(subtreenum);
+  ctx.rebuiltfirst.setsize(subtreenum);
+  loopi(subtreenum) ctx.rebuilt[i] = NULL;
+
+  // refit (or rebuild) the subtrees, then the top nodes
+  if (isec->acc.length() < PARALLEL_PRIMNUM)
+    loopi(subtreenum) refitsubtree(ctx, i);
+  else {
+    ref<task> job = NEWTASK(refittask, ctx);
+    job->scheduled();
+    job->wait();
+  }
+  // rebuilt subtrees get their baseline cost back on the next refit
+  bool rebuilt = false;
+  loopi(subtreenum) if (ctx.rebuilt[i] != NULL) {
+    isec->refitcost[i] = 0.f;
+    rebuilt = true;
+  }
+  if (rebuilt) splice(*isec, ctx);
+  for (int i = ctx.top.length()-1; i >= 0; --i) {
+    auto &node = isec->root[ctx.top[i]];
+    const auto child = ctx.top[i] + node.getoffset();
+    node.box = isec->root[child].box;
+    node.box.compose(isec->root[child+1].box);
+  }
+  if (rebuilt) {
+    loopi(subtreenum) if (ctx.rebuilt[i] != NULL) {
+      SAFE_DELA(ctx.rebuilt[i]->root);
+      DEL(ctx.rebuilt[i]);
+    }
+    compact(*isec);
+  }
+  if (isec->root4 != NULL) widen(isec, true);
+  return true;
+}
+
+/*-------------------------------------------------------------------------
+ - serialized bvh: header, nodes and triangles. leaf pointers are stored as
+ - byte offsets in the triangle array. node and triangle sizes are checked
+ - since the layout depends on the platform
+ -------------------------------------------------------------------------*/
+static const u32 BVH_MAGIC = 0x4856424d; // "MBVH"
+struct bvhheader { u32 magic, nodesize, trisize, nodenum, accnum; };
+
+void *serialize(const intersector *isec, u32 &size) {
+  size = 0;
+  if (isec == NULL) return NULL;
+  const auto nodenum = isec->nodenum, accnum = u32(isec->acc.length());
+  const auto nodes = sizeof(intersector::node)*nodenum;
+  const auto tris = sizeof(waldtriangle)*accnum;
+  size = u32(sizeof(bvhheader) + nodes + tris);
+  auto data = (char*) MALLOC(size);
+  const bvhheader h = {
+    BVH_MAGIC, u32(sizeof(intersector::node)), u32(sizeof(waldtriangle)),
+    nodenum, accnum
+  };
+  memcpy(data, &h, sizeof(h));
+  auto node = (intersector::node*) (data + sizeof(h));
+  memcpy((void*) node, isec->root, nodes);
+  if (accnum) memcpy(data + sizeof(h) + nodes, &isec->acc[0], tris);
+  const auto acc = (const char*) (accnum ? &isec->acc[0] : NULL);
+  loopi(int(nodenum)) {
+    const auto flag = node[i].getflag();
+    if (flag == intersector::ISECLEAF || flag == intersector::INSTLEAF) {
+      FREE(data);
+      size = 0;
+      return NULL;
+    }
+    if (flag == intersector::TRILEAF)
+      node[i].prim = uintptr((const char*) node[i].getptr<waldtriangle>() - acc) | flag;
+  }
+  return data;
+}
+
+intersector *deserialize(const void *data, u32 size) {
+  bvhheader h;
+  if (size < sizeof(h)) return NULL;
+  memcpy(&h, data, sizeof(h));
+  const auto nodes = u64(sizeof(intersector::node))*h.nodenum;
+  const auto tris = u64(sizeof(waldtriangle))*h.accnum;
+  if (h.magic != BVH_MAGIC || h.nodesize != sizeof(intersector::node) ||
+      h.trisize != sizeof(waldtriangle) || h.nodenum == 0 ||
+      sizeof(h)+nodes+tris != size)
+    return NULL;
+  auto tree = NEWE(intersector);
+  tree->nodenum = h.nodenum;
+  tree->root4 = NULL;
+  tree->node4num = 0;
+  tree->tris4 = NULL;
+  tree->tri4num = 0;
+  tree->root = NEWAE(intersector::node, h.nodenum);
+  tree->acc.setsize(h.accnum);
+  memcpy((void*) tree->root, (const char*) data + sizeof(h), size_t(nodes));
+  if (h.accnum) memcpy((void*) &tree->acc[0], (const char*) data + sizeof(h) + nodes, size_t(tris));
+  loopi(int(h.nodenum)) {
+    auto &node = tree->root[i];
+    const auto flag = node.getflag();
+    if (flag == intersector::ISECLEAF || flag == intersector::INSTLEAF) {
+      destroy(tree);
+      return NULL;
+    }
+    if (flag != intersector::TRILEAF) continue;
+    const auto offset = uintptr(node.getptr<char>());
+    if (offset % sizeof(waldtriangle) != 0 || offset >= tris) {
+      destroy(tree);
+      return NULL;
+    }
+    node.setptr(&tree->acc[int(offset / sizeof(waldtriangle))]);
+  }
+  return tree;
+}
+
 } /* namespace rt */
 } /* namespace q */
 
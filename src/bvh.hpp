@@ -20,14 +20,48 @@ struct hit {
 
 struct intersector;
 
+// sah builds give the fastest trees. linear builds only sort the primitives
+// along a morton curve and split them at the highest differing bit. they
+// are much faster to build and fit per frame rebuilds of dynamic geometry
+enum { SAHBVH, LINEARBVH };
+
 // opaque intersector data structure
-struct intersector *create(const struct primitive*, int n);
+struct intersector *create(const struct primitive*, int n, u32 builder = SAHBVH);
 void destroy(intersector*);
 aabb getaabb(const intersector*);
 
-// May be either a triangle, a bounding box and an intersector
+// flatten a bvh of triangles in one relocatable buffer allocated with MALLOC.
+// bvhs with nested intersectors are not supported and return NULL
+void *serialize(const intersector*, u32 &size);
+// rebuild a bvh from a serialized buffer. returns NULL if it is invalid
+intersector *deserialize(const void *data, u32 size);
+
+// recompute the boxes of a triangle bvh from new positions (three vertices
+// per triangle in the order given to create). topology is kept but subtrees
+// that got too expensive are rebuilt. false if the triangle number differs
+bool refit(intersector*, const vec3f *pos, u32 trinum);
+
+// collapse the bvh in a 4-wide bvh used by the "4" traversal kernels (or free
+// it). bvhs with nested intersectors stay binary only
+void widen(intersector*, bool enable);
+
+// bvh placed in the world with an affine transform (object to world). many
+// instances may share the same intersector
+struct instance {
+  INLINE instance(void) {}
+  INLINE instance(const intersector *isec, const mat3x3f &m, const vec3f &t) :
+    isec(isec), linear(m), translation(t) {}
+  INLINE vec3f xfmpoint(const vec3f &p) const {
+    return q::xfmpoint(linear, p) + translation;
+  }
+  const intersector *isec;
+  mat3x3f linear;
+  vec3f translation;
+};
+
+// May be either a triangle, a bounding box, an intersector or an instance
 struct primitive {
-  enum { TRI, INTERSECTOR };
+  enum { TRI, INTERSECTOR, INSTANCE };
   INLINE primitive(void) {}
   INLINE primitive(vec3f a, vec3f b, vec3f c) : isec(NULL), type(TRI) {
     v[0]=a;
@@ -39,13 +73,21 @@ struct primitive {
     v[0]=box.pmin;
     v[1]=box.pmax;
   }
+  INLINE primitive(const instance *inst) : inst(inst), type(INSTANCE) {
+    const auto box = xfmbox(inst->linear, inst->translation, rt::getaabb(inst->isec));
+    v[0] = box.pmin;
+    v[1] = box.pmax;
+  }
   INLINE aabb getaabb(void) const {
     if (type == TRI)
       return aabb(min(min(v[0],v[1]),v[2]), max(max(v[0],v[1]),v[2]));
     else
       return aabb(v[0],v[1]);
   }
-  const intersector *isec;
+  union {
+    const intersector *isec;
+    const instance *inst;
+  };
   vec3f v[3];
   u32 type;
 };
@@ -4,6 +4,7 @@
  -------------------------------------------------------------------------*/
 #pragma once
 #include "base/vector.hpp"
+#include "rt.hpp"
 
 namespace q {
 namespace rt {
@@ -15,8 +16,17 @@ struct waldtriangle {
   u32 id, matid;
 };
 
+// instance stored in the tree. rays are moved in object space on entry and
+// normals are moved back in world space
+struct instanceleaf {
+  mat3x3f toobj, tonormal; // world to object and object to world normal
+  vec3f org;               // world to object translation
+  const intersector *isec;
+};
+
 struct intersector {
   static const u32 NONLEAF = 0x0;
+  static const u32 INSTLEAF = 0x1;
   static const u32 TRILEAF = 0x2;
   static const u32 ISECLEAF = 0x3;
   static const u32 MASK = 0x3;
@@ -42,13 +52,111 @@ struct intersector {
     INLINE void setaxis(u32 d) { axis = d; }
     INLINE void setflag(u32 flag) { offsetflag = (offsetflag&~MASK)|flag; }
   };
+  // 4-wide node collapsed from the binary tree. child boxes are quantized
+  // on 8 bits per plane relative to the box of the node and stored in soa
+  // form such that one simd slab test handles the four of them. decoded
+  // boxes always contain the exact ones
+  static const u32 LEAF4 = 1u<<31;
+  struct node4 {
+    float org[3];              // lower corner of the node box
+    u8 exp[3];                 // quantization step is 2^(exp-127) on each axis
+    u8 num;                    // number of valid children (always the first ones)
+    u8 qmin[3][4], qmax[3][4]; // child boxes in steps from org
+    u32 child[4];              // index of a node4 or LEAF4|index of a tri4
+    u32 pad[2];
+    INLINE float step(u32 axis) const {
+      union {float f; u32 u;};
+      u = u32(exp[axis])<<23;
+      return f;
+    }
+    INLINE aabb getaabb(u32 i) const {
+      aabb box;
+      loopk(3) {
+        box.pmin[k] = org[k] + float(qmin[k][i])*step(k);
+        box.pmax[k] = org[k] + float(qmax[k][i])*step(k);
+      }
+      return box;
+    }
+  };
+  // triangles of a leaf of the 4-wide bvh transposed in groups of four. one
+  // ray is tested against the four of them at once. the groups of a leaf
+  // are contiguous and missing lanes repeat the last triangle
+  struct tri4 {
+    float nd[4], nu[4], nv[4]; // planes
+    float pu[4], pv[4];        // vertk
+    float bu[4], bv[4], cu[4], cv[4];
+    u32 k[4];                  // projection axis | sign<<2
+    u32 id[4];
+    u32 num;                   // number of valid lanes
+    u32 last;                  // non zero for the last group of the leaf
+    u32 pad[2];
+  };
   node *root;
   vector<waldtriangle> acc;
+  u32 nodenum;
+  node4 *root4; // NULL until widened (see rt::widen)
+  u32 node4num;
+  tri4 *tris4;  // leaves of root4
+  u32 tri4num;
+  vector<float> refitcost; // sah cost of each refitted subtree when built
+  vector<instanceleaf> instances;
 };
 static_assert(sizeof(intersector::node) == 32,"invalid node size");
+static_assert(sizeof(intersector::node4) == 64,"invalid node4 size");
+static_assert(sizeof(intersector::tri4) == 192,"invalid tri4 size");
+
+// lane j of a group back in wald form. only the intersection data are set
+INLINE waldtriangle gettri(const intersector::tri4 &g, u32 j) {
+  waldtriangle tri;
+  tri.nd = g.nd[j];
+  tri.n = vec2f(g.nu[j], g.nv[j]);
+  tri.vertk = vec2f(g.pu[j], g.pv[j]);
+  tri.bn = vec2f(g.bu[j], g.bv[j]);
+  tri.cn = vec2f(g.cu[j], g.cv[j]);
+  tri.k = g.k[j] & 3;
+  tri.sign = g.k[j] >> 2;
+  tri.num = 1;
+  tri.id = g.id[j];
+  tri.matid = 0;
+  return tri;
+}
+
+// directions are not normalized such that distances stay the same in both
+// spaces
+INLINE ray xfmray(const instanceleaf &inst, const ray &r) {
+  ray out = r;
+  out.org = xfmpoint(inst.toobj, r.org) + inst.org;
+  out.dir = xfmvector(inst.toobj, r.dir);
+  return out;
+}
+
+INLINE void xfmpacket(const instanceleaf &inst, const raypacket &p, raypacket &out) {
+  out.raynum = p.raynum;
+  out.flags = p.flags & ~raypacket::INTERVALARITH;
+  out.sharedorg = xfmpoint(inst.toobj, p.sharedorg) + inst.org;
+  out.shareddir = xfmvector(inst.toobj, p.shareddir);
+  loopi(4) {
+    const vec3f corner(p.crx[i], p.cry[i], p.crz[i]);
+    const auto c = xfmvector(inst.toobj, corner);
+    out.crx[i] = c.x;
+    out.cry[i] = c.y;
+    out.crz[i] = c.z;
+  }
+  loopi(s32(p.raynum)) {
+    out.setdir(xfmvector(inst.toobj, p.dir(i)), i);
+    if ((p.flags & raypacket::SHAREDORG) == 0)
+      out.setorg(xfmpoint(inst.toobj, p.org(i)) + inst.org, i);
+  }
+}
 
-INLINE aabb getaabb(const struct intersector *isec) {
-  return isec->root[0].box;
+// move back the normals of the rays that hit the instance
+INLINE void xfmnormals(const instanceleaf &inst, const raypacket &p,
+                       const arrayf &oldt, packethit &hit)
+{
+  loopi(s32(p.raynum)) if (hit.t[i] != oldt[i]) {
+    const auto n = xfmvector(inst.tonormal, hit.getnormal(i));
+    loopj(3) hit.n[j][i] = n[j];
+  }
 }
 } /* namespace rt */
 } /* namespace q */
@@ -0,0 +1,304 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - capture.cpp -> implements screenshots and video recording
+ -------------------------------------------------------------------------*/
+#include "capture.hpp"
+#include "ogl.hpp"
+#include "base/console.hpp"
+#include "base/script.hpp"
+#include "base/string.hpp"
+#include "base/task.hpp"
+#include "base/vector.hpp"
+#include <SDL2/SDL_image.h>
+#include <cstdio>
+
+namespace q {
+namespace capture {
+
+VARP(videofps, 10, 60, 240);
+
+// a new write waits for the oldest one once that many are still running. a
+// video frame stays in flight until the ones before it are on the disk
+static const int MAXPENDING = 8;
+// the gpu has that many frames to finish a readback before we map it
+static const int READBACKNUM = 3;
+
+/*-------------------------------------------------------------------------
+ - encoding. every image or video frame is a task owning its pixels
+ -------------------------------------------------------------------------*/
+static struct video {
+  FILE *f;
+  SDL_mutex *mutex;
+  u8 *ready[MAXPENDING]; // converted frames waiting for the ones before them
+  int w, h;
+  u32 framenum, next; // frames handed to the tasks and frames written
+  fixedstring name;
+} vid;
+
+struct encode : public task {
+  INLINE encode(u8 *rgba, int w, int h, const char *path, u32 frame, bool video) :
+    task("encode", 1, 1), rgba(rgba), w(w), h(h), path(path), frame(frame),
+    video(video), done(0) {}
+  virtual ~encode() { if (rgba) FREE(rgba); }
+  virtual void run(u32);
+  u8 *rgba;
+  int w, h;
+  fixedstring path;
+  u32 frame;
+  bool video;
+  volatile s32 done;
+};
+static vector<ref<encode>> jobs;
+
+static bool hasext(const char *name, const char *ext) {
+  const auto n = strlen(name), m = strlen(ext);
+  return n >= m && !strcmp(name+n-m, ext);
+}
+
+static void writepng(u8 *rgba, int w, int h, const char *name) {
+  // png rows go top down and the back buffer alpha is anything
+  const auto pitch = 4*w;
+  const auto row = (u8*) MALLOC(pitch);
+  loopi(h/2) {
+    const auto top = rgba+i*pitch, bottom = rgba+(h-1-i)*pitch;
+    memcpy(row, top, pitch);
+    memcpy(top, bottom, pitch);
+    memcpy(bottom, row, pitch);
+  }
+  FREE(row);
+  loopi(w*h) rgba[4*i+3] = 0xff;
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+  const u32 rmask = 0xff000000, gmask = 0x00ff0000, bmask = 0x0000ff00, amask = 0x000000ff;
+#else
+  const u32 rmask = 0x000000ff, gmask = 0x0000ff00, bmask = 0x00ff0000, amask = 0xff000000;
+#endif
+  const auto s = SDL_CreateRGBSurfaceFrom(rgba, w, h, 32, pitch, rmask, gmask, bmask, amask);
+  const auto ok = s != NULL && IMG_SavePNG(s, name) == 0;
+  if (s != NULL) SDL_FreeSurface(s);
+  if (!ok) con::out("capture: unable to write %s", name);
+}
+
+// bt.601 with the limited range most players expect. chroma is the mean of
+// each 2x2 block
+static INLINE u8 luma(const u8 *c) {
+  return u8(((66*c[0]+129*c[1]+25*c[2]+128)>>8)+16);
+}
+static u8 *toyuv(const u8 *rgba, int sw, int sh, int w, int h) {
+  const auto yuv = (u8*) MALLOC(w*h*3/2);
+  const auto py = yuv, pu = yuv+w*h, pv = pu+w*h/4;
+  for (int y = 0; y < h; y += 2) {
+    const auto top = rgba+4*sw*(sh-1-y), bottom = top-4*sw;
+    for (int x = 0; x < w; x += 2) {
+      const u8 *c[] = {top+4*x, top+4*x+4, bottom+4*x, bottom+4*x+4};
+      py[y*w+x] = luma(c[0]);
+      py[y*w+x+1] = luma(c[1]);
+      py[(y+1)*w+x] = luma(c[2]);
+      py[(y+1)*w+x+1] = luma(c[3]);
+      const auto r = (c[0][0]+c[1][0]+c[2][0]+c[3][0]+2)>>2;
+      const auto g = (c[0][1]+c[1][1]+c[2][1]+c[3][1]+2)>>2;
+      const auto b = (c[0][2]+c[1][2]+c[2][2]+c[3][2]+2)>>2;
+      const auto uv = (y/2)*(w/2)+x/2;
+      pu[uv] = u8(((-38*r-74*g+112*b+128)>>8)+128);
+      pv[uv] = u8(((112*r-94*g-18*b+128)>>8)+128);
+    }
+  }
+  return yuv;
+}
+
+// the task converting the next expected frame writes it and every frame
+// after it already converted
+static void writeframe(u32 frame, u8 *yuv) {
+  const auto size = size_t(vid.w*vid.h*3/2);
+  SDL_LockMutex(vid.mutex);
+  vid.ready[frame%MAXPENDING] = yuv;
+  while (u8 *p = vid.ready[vid.next%MAXPENDING]) {
+    fputs("FRAME\n", vid.f);
+    fwrite(p, 1, size, vid.f);
+    FREE(p);
+    vid.ready[vid.next++%MAXPENDING] = NULL;
+  }
+  SDL_UnlockMutex(vid.mutex);
+}
+
+void encode::run(u32) {
+  if (video)
+    writeframe(frame, toyuv(rgba, w, h, vid.w, vid.h));
+  else if (hasext(path.c_str(), ".bmp"))
+    sys::writebmp((const int*) rgba, w, h, path.c_str());
+  else
+    writepng(rgba, w, h, path.c_str());
+  FREE(rgba);
+  rgba = NULL;
+  storerelease(&done, 1);
+}
+
+static void waitall() {
+  loopv(jobs) jobs[i]->wait();
+  jobs.destroy();
+}
+
+static void dispatch(u8 *rgba, int w, int h, const char *path, bool video) {
+  while (jobs.length() && loadacquire(&jobs[0]->done)) jobs.remove(0);
+  // two writes of the same file keep their order
+  if (!video) loopv(jobs)
+    if (!jobs[i]->video && !strcmp(jobs[i]->path.c_str(), path)) jobs[i]->wait();
+  while (jobs.length() >= MAXPENDING) {
+    jobs[0]->wait();
+    jobs.remove(0);
+  }
+  const auto frame = video ? vid.framenum++ : 0u;
+  ref<encode> job = NEWTASK(encode, rgba, w, h, path, frame, video);
+  jobs.add(job);
+  job->scheduled();
+}
+
+void writeimage(const int *pixels, int w, int h, const char *name) {
+  const auto size = size_t(4*w*h);
+  const auto rgba = (u8*) MALLOC(size);
+  memcpy(rgba, pixels, size);
+  dispatch(rgba, w, h, name, false);
+}
+
+/*-------------------------------------------------------------------------
+ - readbacks of the back buffer. as for the hiz, the map of a buffer is
+ - delayed until the gpu wrote it such that nothing stalls
+ -------------------------------------------------------------------------*/
+enum { READ_IMAGE = 1<<0, READ_VIDEO = 1<<1 };
+static struct readback {
+  u32 pbo, size;
+  GLsync fence;
+  int w, h, kind;
+  fixedstring name;
+} readbacks[READBACKNUM];
+static int readcurr = 0;
+static fixedstring shotname;
+static bool shotpending = false;
+
+static void fetch(readback &r) {
+  if (r.fence == NULL) return;
+  GLenum res;
+  do OGLR(res, ClientWaitSync, r.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+  while (res == GL_TIMEOUT_EXPIRED);
+  OGL(DeleteSync, r.fence);
+  r.fence = NULL;
+  const auto size = size_t(4*r.w*r.h);
+  void *ptr;
+  ogl::bindbuffer(ogl::PIXEL_PACK_BUFFER, r.pbo);
+  OGLR(ptr, MapBufferRange, GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+  if (ptr != NULL) {
+    if (r.kind & READ_IMAGE) {
+      const auto rgba = (u8*) MALLOC(size);
+      memcpy(rgba, ptr, size);
+      dispatch(rgba, r.w, r.h, r.name.c_str(), false);
+    }
+    if ((r.kind & READ_VIDEO) && vid.f != NULL) {
+      const auto rgba = (u8*) MALLOC(size);
+      memcpy(rgba, ptr, size);
+      dispatch(rgba, r.w, r.h, "", true);
+    }
+    OGL(UnmapBuffer, GL_PIXEL_PACK_BUFFER);
+  }
+  ogl::bindbuffer(ogl::PIXEL_PACK_BUFFER, 0);
+}
+
+static void fetchall() {
+  loopi(READBACKNUM) fetch(readbacks[(readcurr+i)%READBACKNUM]);
+}
+
+void frame(int w, int h) {
+  auto &r = readbacks[readcurr];
+  fetch(r);
+  // frames smaller than the video are dropped. larger ones are cropped
+  const auto video = vid.f != NULL && w >= vid.w && h >= vid.h;
+  r.kind = (shotpending ? READ_IMAGE : 0) | (video ? READ_VIDEO : 0);
+  if (r.kind != 0) {
+    const auto size = u32(4*w*h);
+    if (r.pbo == 0) ogl::genbuffers(1, &r.pbo);
+    ogl::bindbuffer(ogl::PIXEL_PACK_BUFFER, r.pbo);
+    if (r.size < size) {
+      OGL(BufferData, GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+      r.size = size;
+    }
+    OGL(ReadPixels, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    OGLR(r.fence, FenceSync, GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ogl::bindbuffer(ogl::PIXEL_PACK_BUFFER, 0);
+    r.w = w;
+    r.h = h;
+    if (shotpending) r.name = shotname;
+    shotpending = false;
+  }
+  readcurr = (readcurr+1)%READBACKNUM;
+}
+
+/*-------------------------------------------------------------------------
+ - video file
+ -------------------------------------------------------------------------*/
+bool startvideo(const char *name, int fpsnum, int fpsden) {
+  if (vid.f != NULL) stopvideo();
+  vid.f = fopen(name, "wb");
+  if (vid.f == NULL) {
+    con::out("capture: unable to write %s", name);
+    return false;
+  }
+  if (vid.mutex == NULL) vid.mutex = SDL_CreateMutex();
+  vid.w = sys::scrw & ~1;
+  vid.h = sys::scrh & ~1;
+  vid.framenum = vid.next = 0;
+  vid.name = name;
+  fprintf(vid.f, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n",
+          vid.w, vid.h, fpsnum, fpsden);
+  con::out("capture: recording %dx%d video to %s", vid.w, vid.h, name);
+  return true;
+}
+
+void stopvideo() {
+  if (vid.f == NULL) return;
+  fetchall();
+  waitall();
+  fclose(vid.f);
+  vid.f = NULL;
+  con::out("capture: %u frames written to %s", vid.next, vid.name.c_str());
+}
+
+bool recording() { return vid.f != NULL; }
+
+void finish() {
+  fetchall();
+  waitall();
+  stopvideo();
+  loopi(READBACKNUM) {
+    auto &r = readbacks[i];
+    if (r.pbo) ogl::deletebuffers(1, &r.pbo);
+    r.pbo = r.size = 0;
+  }
+  if (vid.mutex != NULL) SDL_DestroyMutex(vid.mutex);
+  vid.mutex = NULL;
+}
+
+/*-------------------------------------------------------------------------
+ - commands
+ -------------------------------------------------------------------------*/
+static void screenshot(const char *name) {
+  if (name != NULL && name[0] != '\0') {
+    shotname = name;
+    shotpending = true;
+    return;
+  }
+  static int shotnum = 0;
+  for (;;) {
+    shotname.fmt("screenshot%04d.png", shotnum++);
+    const auto f = fopen(shotname.c_str(), "rb");
+    if (f == NULL) break;
+    fclose(f);
+  }
+  shotpending = true;
+}
+CMD(screenshot);
+
+static void recordvideo(const char *name) {
+  startvideo(name != NULL && name[0] != '\0' ? name : "video.y4m", videofps, 1);
+}
+CMD(recordvideo);
+CMD(stopvideo);
+} /* namespace capture */
+} /* namespace q */
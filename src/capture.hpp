@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer FPS
+ - capture.hpp -> exposes screenshots and video recording
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "base/sys.hpp"
+
+namespace q {
+namespace capture {
+
+// frame rate of the recorded videos
+extern int videofps;
+
+// rgba pixels with the rows bottom up as gl reads them back and bmps store
+// them. they are copied and a task writes a png or a bmp after the extension
+// of the name. main thread only
+void writeimage(const int *pixels, int w, int h, const char *name);
+// yuv4mpeg2 video of fpsnum/fpsden frames per second. all the frames are
+// converted and written by tasks in order
+bool startvideo(const char *name, int fpsnum, int fpsden);
+void stopvideo();
+bool recording();
+// called right before the swap. the back buffer goes to a pixel buffer when
+// a screenshot or a video needs it and the readback of an older frame,
+// finished by now, is handed to the tasks
+void frame(int w, int h);
+// drains the readbacks, waits for all the writes and closes the video
+void finish();
+
+} /* namespace capture */
+} /* namespace q */
@@ -5,6 +5,7 @@
 #include "mini.q.hpp"
 #include "enet/enet.h"
 #include "base/vector.hpp"
+#include <zlib.h>
 
 namespace q {
 namespace client {
@@ -22,6 +23,94 @@ static fixedstring toservermap;
 static bool senditemstoserver = false; // after a map change (server doesn't have map)
 static fixedstring clientpassword;
 
+// decoded server snapshots, the base of the next deltas
+static struct snapshot {
+  int id;
+  vector<snapentry> entries;
+} snapshots[SNAPSHOTNUM];
+static int lastsnapshot = -1, lastack = -1;
+static int lastpos[POSNUM], lastposupdate = 0;
+static bool possent = false;
+static bool wantfull = false; // acks -1 until a full snapshot comes
+
+// remote players are drawn interpdelay milliseconds behind the snapshots and
+// interpolated between them. snapshot ids give the server time so bunched
+// packets still land at the right place. with interpdelay 0 the delay is one
+// snapshot plus twice the measured arrival jitter
+VARP(interpdelay, 0, 0, 500);
+enum { INTERPNUM = 8 };
+static const float INTERPJUMP = 16.f; // teleports and respawns are not smoothed
+struct interpsample { int millis; vec3f o, ypr; };
+struct interpbuffer {
+  interpsample samples[INTERPNUM]; // newest first
+  int num;
+};
+static vector<interpbuffer> interps;
+static double clockoffset = 0.0; // local minus server time
+static float clockjitter = 0.f;
+static bool hasclock = false;
+
+void requestfullsnapshot(void) { wantfull = true; }
+
+void resetsnapshots(void) {
+  loopi(SNAPSHOTNUM) {
+    snapshots[i].id = -1;
+    snapshots[i].entries.destroy();
+  }
+  lastsnapshot = -1;
+  lastack = -2; // acknowledges -1 to ask for a full snapshot
+  possent = false;
+  wantfull = false;
+  interps.setsize(0);
+  hasclock = false;
+}
+
+static void updateclock(int id) {
+  const auto offset = game::lastmillis()-double(id)*SNAPSHOTMILLIS;
+  if (!hasclock) {
+    clockoffset = offset;
+    clockjitter = 0.f;
+    hasclock = true;
+    return;
+  }
+  const auto dev = offset-clockoffset;
+  clockjitter += (float(abs(dev))-clockjitter)/8.f;
+  clockoffset += dev/16.0;
+}
+
+static void addsample(int cn, int id, const game::dynent *d) {
+  while (interps.length()<=cn) interps.add().num = 0;
+  auto &b = interps[cn];
+  if (b.num && distance(b.samples[0].o, d->o)>INTERPJUMP) b.num = 0;
+  for (int i = INTERPNUM-1; i > 0; --i) b.samples[i] = b.samples[i-1];
+  b.samples[0].millis = id*SNAPSHOTMILLIS;
+  b.samples[0].o = d->o;
+  b.samples[0].ypr = d->ypr;
+  b.num = min(b.num+1, int(INTERPNUM));
+}
+
+bool interpolate(int cn, game::dynent *d) {
+  if (!hasclock || demo::playing() || cn>=interps.length()) return false;
+  const auto &b = interps[cn];
+  const auto delay = interpdelay ? float(interpdelay) : SNAPSHOTMILLIS+2.f*clockjitter;
+  const auto t = game::lastmillis()-clockoffset-double(delay);
+  if (b.num<2 || t>b.samples[0].millis) return false; // extrapolated instead
+  loopi(b.num-1) {
+    const auto &next = b.samples[i], &prev = b.samples[i+1];
+    if (t<prev.millis) continue;
+    const auto f = float((t-prev.millis)/double(next.millis-prev.millis));
+    auto dypr = next.ypr-prev.ypr;
+    loopj(3) {
+      if (dypr[j]>180.f) dypr[j] -= 360.f;
+      else if (dypr[j]<-180.f) dypr[j] += 360.f;
+    }
+    d->o = prev.o+f*(next.o-prev.o);
+    d->ypr = prev.ypr+f*dypr;
+    return true;
+  }
+  return false;
+}
+
 int getclientnum(void) { return clientnum; }
 
 bool multiplayer(void) {
@@ -81,8 +170,15 @@ void connect(const char *servername) {
   disconnect(1);  // reset state
   browser::addserver(servername);
   con::out("attempting to connect to %s", servername);
+  // "host:port" joins one of the matches of a multi match server
+  fixedstring hostname(servername);
   ENetAddress address = {ENET_HOST_ANY, CUBE_SERVER_PORT};
-  if (enet_address_set_host(&address, servername) < 0) {
+  const auto colon = strchr(hostname.c_str(), ':');
+  if (colon) {
+    *colon = '\0';
+    address.port = enet_uint16(atoi(colon+1));
+  }
+  if (enet_address_set_host(&address, hostname.c_str()) < 0) {
     con::out("could not resolve server %s", servername);
     return;
   }
@@ -90,7 +186,7 @@ void connect(const char *servername) {
   clienthost = enet_host_create(NULL, 1, rate, rate);
 
   if (clienthost) {
-    enet_host_connect(clienthost, &address, 1); 
+    enet_host_connect(clienthost, &address, CHANNELNUM);
     enet_host_flush(clienthost);
     connecting = int(game::lastmillis());
     connattempts = 0;
@@ -123,6 +219,7 @@ void disconnect(int onlyclean, int async) {
   disconnecting = 0;
   clientnum = -1;
   c2sinit = false;
+  resetsnapshots();
   game::player1->lifesequence = 0;
   loopv(game::players)
     game::zapdynent(game::players[i]);
@@ -203,14 +300,29 @@ void initclientnet(void) {
 
 void sendpackettoserv(void *packet) {
   if (clienthost) {
-    enet_host_broadcast(clienthost, 0, (ENetPacket *)packet);
+    enet_host_broadcast(clienthost, EVENTCHANNEL, (ENetPacket *)packet);
     enet_host_flush(clienthost);
   }
   else
     server::localclienttoserver((ENetPacket *)packet);
 }
 
+static void sendtoserv(ENetPacket *packet, u8 *start, u8 *p, u8 channel, bool extras) {
+  *(u16 *)start = ENET_HOST_TO_NET_16(p-start);
+  enet_packet_resize(packet, p-start);
+  demo::incomingdata(start, p-start, extras);
+  if (clienthost) {
+    enet_host_broadcast(clienthost, channel, packet);
+    enet_host_flush(clienthost);
+  } else
+    server::localclienttoserver(packet);
+}
+
+// movement goes unreliable on its own channel such that a lost reliable
+// packet does not hold back the positions behind it. the events start with
+// SV_CLIENT to tell the server who sends them
 void c2sinfo(const game::dynent *d) {
+  MEMORY_TAG(MEM_NET);
   // we haven't had a welcome message from the server yet
   if (clientnum<0) return;
   // do not update faster than 25fps
@@ -221,77 +333,104 @@ void c2sinfo(const game::dynent *d) {
   bool serveriteminitdone = false;
   if (toservermap[0]) { // suggest server to change map
     // do this exclusively as map change may invalidate rest of update
-    packet->flags = ENET_PACKET_FLAG_RELIABLE;
+    packet->flags |= ENET_PACKET_FLAG_RELIABLE;
     putint(p, SV_MAPCHANGE);
     sendstring(toservermap.c_str(), p);
     toservermap[0] = 0;
     putint(p, game::nextmode());
-  } else {
-    putint(p, SV_POS);
-    putint(p, clientnum);
-    // quantize coordinates to 1/16th of a cube, between 1 and 3 bytes
-    putint(p, (int)(d->o.x*DMF));
-    putint(p, (int)(d->o.y*DMF));
-    putint(p, (int)(d->o.z*DMF));
-    putint(p, (int)(d->ypr.x*DAF));
-    putint(p, (int)(d->ypr.y*DAF));
-    putint(p, (int)(d->ypr.z*DAF));
-    // quantize to 1/100, almost always 1 byte
-    putint(p, (int)(d->vel.x*DVF));
-    putint(p, (int)(d->vel.y*DVF));
-    putint(p, (int)(d->vel.z*DVF));
-    // pack rest in 1 byte: strafe:2, move:2, onfloor:1, state:3
-    putint(p, (d->strafe&3) |
-              ((d->move&3)<<2) |
-              (((int)d->onfloor)<<4) |
-              ((edit::mode() ? CS_EDITING : d->state)<<5));
-
-    if (senditemstoserver) {
-      packet->flags = ENET_PACKET_FLAG_RELIABLE;
-      putint(p, SV_ITEMLIST);
-      if (!m_noitems) game::putitems(p);
-      putint(p, -1);
-      senditemstoserver = false;
-      serveriteminitdone = true;
-    }
-    // player chat, not flood protected for now
-    if (ctext[0]) {
-      packet->flags = ENET_PACKET_FLAG_RELIABLE;
-      putint(p, SV_TEXT);
-      sendstring(ctext.c_str(), p);
-      ctext[0] = 0;
-    }
-    // tell other clients who I am
-    if (!c2sinit) {
-      packet->flags = ENET_PACKET_FLAG_RELIABLE;
-      c2sinit = true;
-      putint(p, SV_INITC2S);
-      sendstring(game::player1->name.c_str(), p);
-      sendstring(game::player1->team.c_str(), p);
-      putint(p, game::player1->lifesequence);
-    }
-    // send messages collected during the previous frames
-    loopv(messages) {
-      ivector &msg = messages[i];
-      if (msg[1]) packet->flags = ENET_PACKET_FLAG_RELIABLE;
-      loopi(msg[0]) putint(p, msg[i+2]);
-    }
-    messages.setsize(0);
-    if (game::lastmillis()-lastping>250) {
-      putint(p, SV_PING);
-      putint(p, int(game::lastmillis()));
-      lastping = int(game::lastmillis());
-    }
+    sendtoserv(packet, start, p, EVENTCHANNEL, true);
+    lastupdate = int(game::lastmillis());
+    return;
   }
 
-  *(u16 *)start = ENET_HOST_TO_NET_16(p-start);
-  enet_packet_resize(packet, p-start);
-  demo::incomingdata(start, p-start, true);
-  if (clienthost) {
-    enet_host_broadcast(clienthost, 0, packet);
-    enet_host_flush(clienthost);
+  // quantize coordinates to 1/16th of a cube, between 1 and 3 bytes
+  int pos[POSNUM];
+  pos[0] = (int)(d->o.x*DMF);
+  pos[1] = (int)(d->o.y*DMF);
+  pos[2] = (int)(d->o.z*DMF);
+  pos[3] = (int)(d->ypr.x*DAF);
+  pos[4] = (int)(d->ypr.y*DAF);
+  pos[5] = (int)(d->ypr.z*DAF);
+  // quantize to 1/100, almost always 1 byte
+  pos[6] = (int)(d->vel.x*DVF);
+  pos[7] = (int)(d->vel.y*DVF);
+  pos[8] = (int)(d->vel.z*DVF);
+  // pack rest in 1 byte: strafe:2, move:2, onfloor:1, state:3
+  pos[9] = (d->strafe&3) |
+           ((d->move&3)<<2) |
+           (((int)d->onfloor)<<4) |
+           ((edit::mode() ? CS_EDITING : d->state)<<5);
+  // SV_POS always goes first since it tells who sends the rest. an
+  // unchanged position is still sent every second in case it was lost
+  bool idle = possent && !memcmp(pos, lastpos, sizeof(pos)) &&
+              lastack==lastsnapshot && game::lastmillis()-lastposupdate<1000;
+  memcpy(lastpos, pos, sizeof(pos));
+  possent = true;
+  putint(p, SV_POS);
+  putint(p, clientnum);
+  loopi(POSNUM) putint(p, pos[i]);
+  u8 *posend = p;
+  const int ack = wantfull ? -1 : lastsnapshot;
+  if (lastack!=ack) {
+    putint(p, SV_SNAPACK);
+    putint(p, lastack = ack);
+  }
+  if (game::lastmillis()-lastping>250) {
+    putint(p, SV_PING);
+    putint(p, int(game::lastmillis()));
+    lastping = int(game::lastmillis());
+  }
+
+  // everything that must arrive goes in the event packet
+  ENetPacket *events = enet_packet_create (NULL, MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+  u8 *evstart = events->data;
+  u8 *q = evstart+2;
+  putint(q, SV_CLIENT);
+  putint(q, clientnum);
+  u8 *evbegin = q;
+  if (senditemstoserver) {
+    putint(q, SV_ITEMLIST);
+    if (!m_noitems) game::putitems(q);
+    putint(q, -1);
+    senditemstoserver = false;
+    serveriteminitdone = true;
+  }
+  // player chat, not flood protected for now
+  if (ctext[0]) {
+    putint(q, SV_TEXT);
+    sendstring(ctext.c_str(), q);
+    ctext[0] = 0;
+  }
+  // tell other clients who I am
+  if (!c2sinit) {
+    c2sinit = true;
+    putint(q, SV_INITC2S);
+    sendstring(game::player1->name.c_str(), q);
+    sendstring(game::player1->team.c_str(), q);
+    putint(q, game::player1->lifesequence);
+  }
+  // send messages collected during the previous frames. the unreliable
+  // ones may be dropped with the movement
+  loopv(messages) {
+    ivector &msg = messages[i];
+    if (msg[1]) loopi(msg[0]) putint(q, msg[i+2]);
+    else loopi(msg[0]) putint(p, msg[i+2]);
+  }
+  messages.setsize(0);
+
+  // the server already has our position and nothing else came
+  idle = idle && p==posend;
+  if (!idle) lastposupdate = int(game::lastmillis());
+  if (idle) {
+    *(u16 *)start = ENET_HOST_TO_NET_16(p-start);
+    demo::incomingdata(start, p-start, true);
+    enet_packet_destroy(packet);
   } else
-    server::localclienttoserver(packet);
+    sendtoserv(packet, start, p, MOVECHANNEL, true);
+  if (q!=evbegin)
+    sendtoserv(events, evstart, q, EVENTCHANNEL, false);
+  else
+    enet_packet_destroy(events);
   lastupdate = int(game::lastmillis());
   if (serveriteminitdone)
     demo::loadgamerest();  // hack
@@ -323,12 +462,92 @@ static void updatepos(game::dynent *d) {
   }
 }
 
+static void setpos(game::dynent *d, const int *pos) {
+  d->o     = vec3f(float(pos[0]), float(pos[1]), float(pos[2]))/DMF;
+  d->o    += vec3f(0.5f/DMF); // avoid false intersection with ground
+  d->ypr.x = pos[3]/DAF;
+  d->ypr.y = pos[4]/DAF;
+  d->ypr.z = pos[5]/DAF;
+  d->vel   = vec3f(float(pos[6]), float(pos[7]), float(pos[8]))/DVF;
+  int f = pos[9];
+  d->strafe = (f&3)==3 ? -1 : f&3;
+  f >>= 2;
+  d->move = (f&3)==3 ? -1 : f&3;
+  d->onfloor = (f>>2)&1;
+  int state = f>>3;
+  if (state==CS_DEAD && d->state!=CS_DEAD)
+    d->lastaction = int(game::lastmillis());
+  d->state = state;
+  if (!demo::playing()) updatepos(d);
+}
+
 // process forced map change from the server
 static void changemapserv(const char *name, int mode) {
   game::setmode(mode);
   world::load(name);
 }
 
+// map download. the chunks received so far are kept across reconnections so
+// that getmap resumes the download of the same map
+static fixedstring dlname;
+static u32 dlhash = 0;
+static vector<u8> dldata, dlgot;
+static int dlmissing = 0;
+
+static int firstmissingchunk(void) {
+  loopv(dlgot) if (!dlgot[i]) return i;
+  return 0;
+}
+
+static void getmap(void) {
+  if (!clienthost) {
+    con::out("not connected to a server");
+    return;
+  }
+  con::out("requesting map from server...");
+  addmsg(1, 3, SV_RECVMAP, dlmissing ? int(dlhash) : 0, dlmissing ? firstmissingchunk() : 0);
+}
+CMD(getmap);
+
+static void savemap(void) {
+  if (u32(crc32(crc32(0L, Z_NULL, 0), &dldata[0], dldata.length()))!=dlhash) {
+    con::out("map \"%s\" is corrupted", dlname.c_str());
+    return;
+  }
+  fixedstring fn(fmt, "data/%s.lua", dlname.c_str());
+  auto f = fopen(sys::path(fn.c_str()), "wb");
+  if (!f) {
+    con::out("unable to write map \"%s\"", fn.c_str());
+    return;
+  }
+  fwrite(&dldata[0], 1, dldata.length(), f);
+  fclose(f);
+  con::out("received map \"%s\" from server, reloading..", dlname.c_str());
+  changemapserv(dlname.c_str(), game::mode());
+}
+
+static bool addmapchunk(const char *name, u32 hash, int size, int chunk, const u8 *src, int srcsize) {
+  const int chunknum = (size+MAPCHUNKSIZE-1)/MAPCHUNKSIZE;
+  if (size<=0 || size>MAXMAPSIZE || chunk<0 || chunk>=chunknum) return false;
+  if (hash!=dlhash || size!=dldata.length() || strcmp(name, dlname.c_str())) {
+    strcpy_s(dlname, name);
+    dlhash = hash;
+    dldata.setsize(size);
+    dlgot.setsize(0);
+    dlgot.setsize(chunknum);
+    dlmissing = chunknum;
+  }
+  if (dlgot[chunk]) return true;
+  const int offset = chunk*MAPCHUNKSIZE;
+  uLongf dstsize = min(int(MAPCHUNKSIZE), size-offset);
+  const auto expected = dstsize;
+  if (uncompress(&dldata[offset], &dstsize, src, srcsize)!=Z_OK || dstsize!=expected)
+    return false;
+  dlgot[chunk] = 1;
+  if (--dlmissing==0) savemap();
+  return true;
+}
+
 void localservertoclient(u8 *buf, int len) {
   if (ENET_NET_TO_HOST_16(*(u16 *)buf) != len)
     neterr("packet length");
@@ -353,6 +572,7 @@ void localservertoclient(u8 *buf, int len) {
       }
       toservermap[0] = 0;
       clientnum = cn; // we are now fully connected
+      resetsnapshots();
       if (!getint(p)) // we are the first client on this server, set map
       strcpy_s(toservermap, game::getclientmap());
       sgetstr();
@@ -369,24 +589,72 @@ void localservertoclient(u8 *buf, int len) {
       cn = getint(p);
       d = game::getclient(cn);
       if (!d) return;
-      d->o     = getvec<vec3f>(p)/DMF;
-      d->o    += vec3f(0.5f/DMF); // avoid false intersection with ground
-      d->ypr.x   = getint(p)/DAF;
-      d->ypr.y = getint(p)/DAF;
-      d->ypr.z  = getint(p)/DAF;
-      d->vel   = getvec<vec3f>(p)/DVF;
-      int f = getint(p);
-      d->strafe = (f&3)==3 ? -1 : f&3;
-      f >>= 2;
-      d->move = (f&3)==3 ? -1 : f&3;
-      d->onfloor = (f>>2)&1;
-      int state = f>>3;
-      if (state==CS_DEAD && d->state!=CS_DEAD)
-        d->lastaction = int(game::lastmillis());
-      d->state = state;
-      if (!demo::playing()) updatepos(d);
+      int pos[POSNUM];
+      loopi(POSNUM) pos[i] = getint(p);
+      setpos(d, pos);
     }
     break;
+    case SV_CLIENT:
+      cn = getint(p);
+      d = game::getclient(cn);
+      if (!d) return;
+    break;
+    case SV_SNAPSHOT: {
+      const int id = getint(p), baseid = getint(p);
+      const snapshot *base = NULL;
+      if (baseid>=0 && snapshots[baseid%SNAPSHOTNUM].id==baseid)
+        base = &snapshots[baseid%SNAPSHOTNUM];
+      // older than the last one or against a base we do not have anymore
+      const bool valid = id>lastsnapshot && (baseid<0 || base);
+      vector<snapentry> entries;
+      if (valid && base) loopv(base->entries) entries.add(base->entries[i]);
+      const int size = p+2<=end ? p[0] | (p[1]<<8) : MAXTRANS;
+      if (p+2+size>end) {
+        neterr("snapshot");
+        return;
+      }
+      bitreader r(p+2, p+2+size);
+      const int zero[POSNUM] = {0};
+      while (r.get(1)) {
+        const int n = int(r.get(CNBITS));
+        int idx = -1;
+        loopv(entries) if (entries[i].cn==n) { idx = i; break; }
+        int pos[POSNUM];
+        if (!getposdelta(r, idx>=0 ? entries[idx].pos : zero, pos)) {
+          if (idx>=0) {
+            entries[idx] = entries.last();
+            entries.setsize(entries.length()-1);
+          }
+          continue;
+        }
+        if (!valid) continue;
+        if (idx<0) {
+          idx = entries.length();
+          entries.add().cn = n;
+        }
+        memcpy(entries[idx].pos, pos, sizeof(pos));
+        auto other = game::getclient(n);
+        if (!other) continue;
+        setpos(other, pos);
+        addsample(n, id, other);
+      }
+      p += size+2;
+      if (r.overflow()) {
+        neterr("snapshot");
+        return;
+      }
+      if (!valid) break;
+      updateclock(id);
+      auto &snap = snapshots[id%SNAPSHOTNUM];
+      snap.id = id;
+      entries.moveto(snap.entries);
+      lastsnapshot = id;
+      if (baseid<0) wantfull = false;
+    }
+    break;
+    case SV_SNAPACK:
+      getint(p);
+    break;
     case SV_SOUND:
       sound::play(getint(p), &d->o);
     break;
@@ -440,6 +708,7 @@ void localservertoclient(u8 *buf, int len) {
       con::out("player %s disconnected",
                d->name[0] ? d->name.c_str() : "[incompatible client]"); 
       game::zapdynent(game::players[cn]);
+      if (cn<interps.length()) interps[cn].num = 0;
     break;
     case SV_SHOT: {
       const int gun = getint(p);
@@ -545,6 +814,7 @@ void localservertoclient(u8 *buf, int len) {
       game::ents[i].attr3 = getint(p);
       game::ents[i].attr4 = getint(p);
       game::ents[i].spawned = false;
+      game::invalidateentgrid();
     }
     break;
     case SV_PING:
@@ -584,6 +854,17 @@ void localservertoclient(u8 *buf, int len) {
       break;
     }
 #endif
+    case SV_MAPCHUNK: {
+      sgetstr();
+      const auto hash = u32(getint(p));
+      const int size = getint(p), chunk = getint(p), datasize = getint(p);
+      if (datasize<0 || p+datasize>end || !addmapchunk(text, hash, size, chunk, p, datasize)) {
+        neterr("map chunk");
+        return;
+      }
+      p += datasize;
+    }
+    break;
     case SV_SERVMSG:
       sgetstr();
       con::out("%s", text);
@@ -599,6 +880,7 @@ void localservertoclient(u8 *buf, int len) {
 }
 
 void gets2c(void) {
+  MEMORY_TAG(MEM_NET);
   ENetEvent event;
   if (!clienthost) return;
   if (connecting && game::lastmillis()/3000 > connecting/3000) {
@@ -41,6 +41,13 @@ int getclientnum(void);
 void writeclientinfo(FILE*);
 // request map change, server may ignore
 void changemap(const char *name);
+// forget the server snapshots such that the next one is sent in full
+void resetsnapshots(void);
+// keep our snapshots but have the server send the next one in full
+void requestfullsnapshot(void);
+// move a remote player along its buffered snapshots. false if the buffer
+// does not cover the current time and the position must be extrapolated
+bool interpolate(int cn, game::dynent *d);
 
 } /* namespace client */
 } /* namespace q */
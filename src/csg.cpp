@@ -4,27 +4,1022 @@
  -------------------------------------------------------------------------*/
 #include "csg.hpp"
 #include "csginternal.hpp"
+#include "csgscalar.hpp"
+#include "kernel.hpp"
 #include "base/math.hpp"
 #include "base/script.hpp"
 #include "base/sys.hpp"
+#include "base/algorithm.hpp"
+#include "base/flat_map.hpp"
+#include "base/console.hpp"
+#include "base/task.hpp"
+#include "base/io.hpp"
 
 namespace q {
 namespace csg {
 static ref<node> root;
 static void setroot(const ref<node> &node) {root = node;}
-node *makescene() {
-  return root.ptr;
+
+/*-------------------------------------------------------------------------
+ - scene optimizer. consecutive translations are folded, empty branches are
+ - dropped and cylinders capped by two axis aligned planes become one
+ - primitive. a node is only replaced by one of its children if this does
+ - not lose a tighter box set by the scripts
+ -------------------------------------------------------------------------*/
+static INLINE bool contains(const aabb &b0, const aabb &b1) {
+  return all(le(b0.pmin, b1.pmin)) && all(ge(b0.pmax, b1.pmax));
+}
+static INLINE bool isempty(const ref<node> &n) { return n->type == C_EMPTY; }
+static INLINE ref<node> withbox(node *n, const aabb &box) {
+  n->box = intersection(n->box, box);
+  return n;
 }
 
-void destroyscene(node *n) {
-  assert(n == root.ptr);
-  root = NULL;
+// +/-(axis+1) if the plane is orthogonal to one axis. zero otherwise
+static int planeaxis(const vec4f &p) {
+  loopi(3) {
+    const auto j = (i+1)%3, k = (i+2)%3;
+    if (p[j] == 0.f && p[k] == 0.f && abs(p[i]) == 1.f)
+      return p[i] > 0.f ? i+1 : -(i+1);
+  }
+  return 0;
+}
+
+// D(D(cylinder, plane), plane) with two opposite planes orthogonal to the
+// cylinder axis
+static ref<node> capped(const D *d) {
+  if (d->left->type != C_DIFFERENCE) return NULL;
+  const auto inner = static_cast<const D*>(d->left.ptr);
+  const auto c = inner->left.ptr;
+  CSGOP type;
+  vec2f center;
+  float r;
+  int axis;
+  switch (c->type) {
+#define CYL(NAME, COORD, AXIS)\
+    case C_CYLINDER##NAME: {\
+      const auto cyl = static_cast<const cylinder##COORD*>(c);\
+      type = C_CAPPEDCYLINDER##NAME;\
+      center = cyl->c##COORD;\
+      r = cyl->r;\
+      axis = AXIS;\
+    }\
+    break;
+    CYL(XZ,xz,1) CYL(XY,xy,2) CYL(YZ,yz,0)
+#undef CYL
+    default: return NULL;
+  }
+  if (inner->right->type != C_PLANE || d->right->type != C_PLANE) return NULL;
+  const auto &p0 = static_cast<const plane*>(inner->right.ptr)->p;
+  const auto &p1 = static_cast<const plane*>(d->right.ptr)->p;
+  const auto a0 = planeaxis(p0), a1 = planeaxis(p1);
+  if (abs(a0) != axis+1 || a1 != -a0) return NULL;
+
+  // the outside of the plane with the positive normal is the lower cap
+  const auto caps = a0 > 0 ? vec2f(-p0.w, p1.w) : vec2f(-p1.w, p0.w);
+  auto box = intersection(d->box, intersection(inner->box, c->box));
+  box.pmin[axis] = max(box.pmin[axis], caps.x);
+  box.pmax[axis] = min(box.pmax[axis], caps.y);
+  const auto matindex = static_cast<const materialnode*>(c)->matindex;
+  return NEW(cappedcylinder, type, center, r, caps, box, matindex);
 }
 
-void start() {
+ref<node> optimize(const ref<node> &n) {
+  switch (n->type) {
+    case C_UNION: {
+      const auto u = static_cast<const U*>(n.ptr);
+      const auto l = optimize(u->left), r = optimize(u->right);
+      if (isempty(l) && isempty(r)) return NEWE(emptynode);
+      if (isempty(r) && contains(n->box, l->box)) return l;
+      if (isempty(l) && contains(n->box, r->box)) return r;
+      if (l.ptr == u->left.ptr && r.ptr == u->right.ptr) return n;
+      return withbox(NEW(U, l, r), n->box);
+    }
+    case C_DIFFERENCE: {
+      const auto d = static_cast<const D*>(n.ptr);
+      const auto l = optimize(d->left), r = optimize(d->right);
+      if (isempty(l)) return NEWE(emptynode);
+      if (isempty(r) && contains(n->box, l->box)) return l;
+      const auto same = l.ptr == d->left.ptr && r.ptr == d->right.ptr;
+      const auto nd = same ? n : withbox(NEW(D, l, r), n->box);
+      const auto c = capped(static_cast<const D*>(nd.ptr));
+      return c ? c : nd;
+    }
+    case C_INTERSECTION: {
+      const auto i = static_cast<const I*>(n.ptr);
+      const auto l = optimize(i->left), r = optimize(i->right);
+      if (isempty(l) || isempty(r)) return NEWE(emptynode);
+      if (l.ptr == i->left.ptr && r.ptr == i->right.ptr) return n;
+      return withbox(NEW(I, l, r), n->box);
+    }
+    case C_REPLACE: {
+      const auto rn = static_cast<const R*>(n.ptr);
+      const auto l = optimize(rn->left), r = optimize(rn->right);
+      if (isempty(l)) return NEWE(emptynode);
+      if (isempty(r) && contains(n->box, l->box)) return l;
+      if (l.ptr == rn->left.ptr && r.ptr == rn->right.ptr) return n;
+      return withbox(NEW(R, l, r), n->box);
+    }
+    case C_TRANSLATION: {
+      const auto t = static_cast<const translation*>(n.ptr);
+      const auto c = optimize(t->n);
+      if (isempty(c)) return NEWE(emptynode);
+      if (c->type == C_TRANSLATION) {
+        const auto ct = static_cast<const translation*>(c.ptr);
+        const aabb cbox(ct->box.pmin+t->p, ct->box.pmax+t->p);
+        const auto box = intersection(n->box, cbox);
+        return withbox(NEW(translation, t->p+ct->p, ct->n), box);
+      }
+      if (c.ptr == t->n.ptr) return n;
+      return withbox(NEW(translation, t->p, c), n->box);
+    }
+    case C_ROTATION: {
+      const auto r = static_cast<const rotation*>(n.ptr);
+      const auto c = optimize(r->n);
+      if (isempty(c)) return NEWE(emptynode);
+      if (c.ptr == r->n.ptr) return n;
+      return withbox(NEW(rotation, r->q, c), n->box);
+    }
+    case C_DISPLACEMENT: {
+      const auto d = static_cast<const displacement*>(n.ptr);
+      const auto c = optimize(d->n);
+      if (isempty(c)) return NEWE(emptynode);
+      if (c.ptr == d->n.ptr) return n;
+      return withbox(NEW(displacement, d->amplitude, d->frequency, c, d->matindex), n->box);
+    }
+    default: return n;
+  }
+}
+
+/*-------------------------------------------------------------------------
+ - flatten the tree into a program
+ -------------------------------------------------------------------------*/
+aabb xfmbox(const quat3f &q, const aabb &box) {
+  if (any(gt(box.pmin, box.pmax))) return box;
+  const auto big = vec3f(FLT_MAX);
+  if (any(ge(abs(box.pmin), big)) || any(ge(abs(box.pmax), big)))
+    return aabb::all();
+  auto xfm = aabb::empty();
+  loopi(8) {
+    const vec3f p(i&1 ? box.pmax.x : box.pmin.x,
+                  i&2 ? box.pmax.y : box.pmin.y,
+                  i&4 ? box.pmax.z : box.pmin.z);
+    const auto xp = xfmpoint(q, p);
+    xfm.pmin = min(xfm.pmin, xp);
+    xfm.pmax = max(xfm.pmax, xp);
+  }
+  return xfm;
+}
+
+// box of the inside or the outside of a plane orthogonal to one axis.
+// scripts usually cap objects with them
+static aabb halfspace(const instruction &ins, bool inside) {
+  auto box = aabb::all();
+  if (ins.op != C_PLANE) return box;
+  const auto axis = planeaxis(ins.k);
+  if (axis == 0) return box;
+  const auto i = abs(axis)-1;
+  const auto bound = axis > 0 ? -ins.k.w : ins.k.w;
+  if ((axis > 0) != inside)
+    box.pmin[i] = bound;
+  else
+    box.pmax[i] = bound;
+  return box;
+}
+
+// children to sort. unbounded boxes are clamped to get a usable centroid
+struct bvhref {
+  INLINE bvhref() {}
+  INLINE bvhref(const aabb &box, u32 pc) : pc(pc) {
+    const auto big = vec3f(1e18f);
+    c = 0.5f * (max(box.pmin,-big) + min(box.pmax,big));
+  }
+  vec3f c;
+  u32 pc;
+};
+struct bvhsorter {
+  INLINE bvhsorter(int axis) : axis(axis) {}
+  INLINE bool operator() (const bvhref &r0, const bvhref &r1) const {
+    return r0.c[axis] < r1.c[axis];
+  }
+  int axis;
+};
+
+// object median split along the largest extent of the children centroids
+static const u32 BVHLEAFNUM = 4;
+static void buildbvh(program &p, bvhref *refs, u32 num, u32 idx) {
+  auto box = aabb::empty(), cbox = aabb::empty();
+  loopi(num) {
+    box = sum(box, p.code[refs[i].pc].box);
+    cbox.pmin = min(cbox.pmin, refs[i].c);
+    cbox.pmax = max(cbox.pmax, refs[i].c);
+  }
+  p.bvh[idx].box = box;
+  if (num <= BVHLEAFNUM) {
+    p.bvh[idx].offset = p.children.length();
+    p.bvh[idx].num = num;
+    loopi(num) p.children.add(refs[i].pc);
+    return;
+  }
+  const auto ext = cbox.pmax - cbox.pmin;
+  const auto axis = ext.x > ext.y ? (ext.x > ext.z ? 0 : 2) : (ext.y > ext.z ? 1 : 2);
+  quicksort(refs, num, bvhsorter(axis));
+  const auto first = p.bvh.length();
+  p.bvh.add();
+  p.bvh.add();
+  p.bvh[idx].offset = first;
+  p.bvh[idx].num = 0;
+  buildbvh(p, refs, num/2, first);
+  buildbvh(p, refs+num/2, num-num/2, first+1);
+}
+
+bool gather(const program &p, u32 pc, const aabb &box, u32 *hits, u32 &hitnum) {
+  u32 stack[64], top = 0;
+  stack[top++] = p.code[pc].bvh;
+  hitnum = 0;
+  while (top) {
+    const auto &n = p.bvh[stack[--top]];
+    const auto isec = intersection(n.box, box);
+    if (any(gt(isec.pmin, isec.pmax))) continue;
+    if (n.num == 0) {
+      assert(top+2 <= 64);
+      stack[top++] = n.offset+1;
+      stack[top++] = n.offset;
+      continue;
+    }
+    loopi(n.num) {
+      const auto child = p.children[n.offset+i];
+      const auto cisec = intersection(p.code[child].box, box);
+      if (any(gt(cisec.pmin, cisec.pmax))) continue;
+      if (hitnum == MAXHITNUM) return false;
+      hits[hitnum++] = child;
+    }
+  }
+  insertionsort(hits, hitnum);
+  return true;
+}
+
+static void emit(program &p, const node *n) {
+  auto &code = p.code;
+  const auto pc = code.length();
+  instruction ins;
+  ins.box = n->box;
+  ins.k = vec4f(zero);
+  ins.op = n->type;
+  ins.next = ins.num = 0;
+  ins.matindex = MAT_AIR_INDEX;
+  ins.bvh = NOBVH;
+  ins.caps = vec2f(zero);
+  if (isprimitive(n->type))
+    ins.matindex = static_cast<const materialnode*>(n)->matindex;
+  switch (n->type) {
+    case C_BOX: ins.k = vec4f(static_cast<const struct box*>(n)->extent, 0.f); break;
+    case C_PLANE: ins.k = static_cast<const plane*>(n)->p; break;
+    case C_SPHERE: ins.k.x = static_cast<const sphere*>(n)->r; break;
+    case C_CYLINDERXY: {
+      const auto c = static_cast<const cylinderxy*>(n);
+      ins.k = vec4f(c->cxy.x, c->cxy.y, c->r, 0.f);
+    }
+    break;
+    case C_CYLINDERXZ: {
+      const auto c = static_cast<const cylinderxz*>(n);
+      ins.k = vec4f(c->cxz.x, c->cxz.y, c->r, 0.f);
+    }
+    break;
+    case C_CYLINDERYZ: {
+      const auto c = static_cast<const cylinderyz*>(n);
+      ins.k = vec4f(c->cyz.x, c->cyz.y, c->r, 0.f);
+    }
+    break;
+    case C_CAPPEDCYLINDERXY:
+    case C_CAPPEDCYLINDERXZ:
+    case C_CAPPEDCYLINDERYZ: {
+      const auto c = static_cast<const cappedcylinder*>(n);
+      ins.k = vec4f(c->c.x, c->c.y, c->r, 0.f);
+      ins.caps = c->caps;
+    }
+    break;
+    case C_TRANSLATION: ins.k = vec4f(static_cast<const translation*>(n)->p, 0.f); break;
+    case C_ROTATION: {
+      // we directly store the inverse rotation
+      const auto q = conj(static_cast<const rotation*>(n)->q);
+      ins.k = vec4f(q.i, q.j, q.k, q.r);
+    }
+    break;
+    case C_DISPLACEMENT: {
+      const auto d = static_cast<const displacement*>(n);
+      ins.k = vec4f(d->amplitude, d->frequency, 0.f, 0.f);
+      ins.matindex = d->matindex;
+    }
+    break;
+    default: break;
+  }
+  code.add(ins);
+
+  // emit the children and tighten the box with their compiled boxes. this
+  // notably gives real boxes to rotations and everything above them
+  auto box = n->box;
+  switch (n->type) {
+    case C_UNION: {
+      // min and max are associative and the union of a left-nested chain is
+      // a left fold. we can therefore merge the chain into one n-ary union
+      smallvector<const node*,16> children;
+      auto u = n;
+      while (u->type == C_UNION) {
+        children.add(static_cast<const U*>(u)->right.ptr);
+        u = static_cast<const U*>(u)->left.ptr;
+      }
+      children.add(u);
+      smallvector<u32,16> pcs;
+      for (int i = children.length()-1; i >= 0; --i) {
+        pcs.add(code.length());
+        emit(p, children[i]);
+      }
+      auto sumbox = aabb::empty();
+      loopv(pcs) sumbox = sum(sumbox, code[pcs[i]].box);
+      box = intersection(box, sumbox);
+      code[pc].num = pcs.length();
+
+      // large unions get a bvh over their children
+      if (u32(pcs.length()) >= UNIONBVHNUM) {
+        vector<bvhref> refs;
+        loopv(pcs) refs.add(bvhref(code[pcs[i]].box, pcs[i]));
+        code[pc].bvh = p.bvh.length();
+        p.bvh.add();
+        buildbvh(p, &refs[0], refs.length(), code[pc].bvh);
+      }
+    }
+    break;
+#define BINARY(NAME, TYPE, BOX)\
+    case TYPE: {\
+      const auto left = code.length();\
+      emit(p, static_cast<const NAME*>(n)->left.ptr);\
+      const auto right = code.length();\
+      emit(p, static_cast<const NAME*>(n)->right.ptr);\
+      box = intersection(box, BOX);\
+      (void) right;\
+    }\
+    break;
+    BINARY(D, C_DIFFERENCE,
+      intersection(code[left].box, halfspace(code[right], false)))
+    BINARY(I, C_INTERSECTION,
+      intersection(intersection(code[left].box, halfspace(code[left], true)),
+                   intersection(code[right].box, halfspace(code[right], true))))
+    BINARY(R, C_REPLACE, code[left].box)
+#undef BINARY
+    case C_TRANSLATION: {
+      const auto t = static_cast<const translation*>(n);
+      emit(p, t->n.ptr);
+      const auto &child = code[pc+1].box;
+      box = intersection(box, aabb(child.pmin+t->p, child.pmax+t->p));
+    }
+    break;
+    case C_ROTATION: {
+      const auto r = static_cast<const rotation*>(n);
+      emit(p, r->n.ptr);
+      box = intersection(box, xfmbox(r->q, code[pc+1].box));
+    }
+    break;
+    case C_DISPLACEMENT: {
+      const auto d = static_cast<const displacement*>(n);
+      emit(p, d->n.ptr);
+      const auto &child = code[pc+1].box;
+      const auto a = vec3f(abs(d->amplitude));
+      box = intersection(box, aabb(child.pmin-a, child.pmax+a));
+    }
+    break;
+    default: break;
+  }
+  code[pc].box = box;
+  code[pc].next = code.length();
+}
+
+// scenes baked in csgbaked.hxx. the simd kernels have their code in the
+// same order
+static const u64 bakedhashes[] = {
+#define CSGBAKEDSCENE(HASH, ROOT) HASH,
+#include "csgbaked.hxx"
+#undef CSGBAKEDSCENE
+  0
+};
+
+static void lookupbaked(program &p) {
+  const auto h = hash(&p);
+  loopi(s32(ARRAY_ELEM_NUM(bakedhashes))-1) if (bakedhashes[i] == h) p.baked = i;
+}
+
+bool isbaked(const program *p) { return p->baked != NOBAKED; }
+
+program *compile(const node &n) {
+  const auto p = NEWE(program);
+  const auto root = optimize(const_cast<node*>(&n));
+  emit(*p, root.ptr);
+  lookupbaked(*p);
+  return p;
+}
+void destroy(program *p) { SAFE_DEL(p); }
+
+// fields are hashed one by one to skip the padding of the instructions. the
+// union bvh and children are derived from the code and are not hashed
+u64 hash(const program *p) {
+  u32 h[] = {0x9e3779b9u, 0x85ebca6bu};
+  loopi(2) loopvj(p->code) {
+    const auto &ins = p->code[j];
+    h[i] = murmurhash2(&ins.box, sizeof(ins.box), h[i]);
+    h[i] = murmurhash2(&ins.k, sizeof(ins.k), h[i]);
+    const u32 fields[] = {u32(ins.op), ins.next, ins.num, ins.matindex};
+    h[i] = murmurhash2(fields, sizeof(fields), h[i]);
+    h[i] = murmurhash2(&ins.caps, sizeof(ins.caps), h[i]);
+  }
+  return u64(h[0]) << 32 | u64(h[1]);
+}
+
+/*-------------------------------------------------------------------------
+ - specialize a program to a box. the evaluators skip whatever their query
+ - box misses. for queries inside the box, all of this is dead code we drop
+ - once instead of testing it again and again for every packet
+ -------------------------------------------------------------------------*/
+static INLINE bool culled(const instruction &ins, const aabb &box) {
+  const auto isec = intersection(ins.box, box);
+  return any(gt(isec.pmin, isec.pmax));
+}
+
+// stands for a subtree that writes nothing. it keeps the box of the subtree
+// such that the parent still culls it the same way
+static void pruneempty(program &dst, const aabb &box) {
+  instruction ins;
+  ins.box = box;
+  ins.k = vec4f(zero);
+  ins.op = C_EMPTY;
+  ins.num = 0;
+  ins.next = dst.code.length()+1;
+  ins.matindex = MAT_AIR_INDEX;
+  ins.bvh = NOBVH;
+  ins.caps = vec2f(zero);
+  dst.code.add(ins);
+}
+
+static void prune(const program &src, u32 pc, const aabb &box, program &dst);
+
+// the only child left replaces its parent. queries went through the culling
+// of both boxes. as products of intervals, a query box misses their (non
+// empty) intersection only if it misses one of them
+static void collapse(const program &src, u32 pc, u32 child, const aabb &box,
+                     program &dst) {
+  const auto at = dst.code.length();
+  prune(src, child, box, dst);
+  dst.code[at].box = intersection(dst.code[at].box, src.code[pc].box);
+}
+
+static void prune(const program &src, u32 pc, const aabb &box, program &dst) {
+  const auto code = &src.code[0];
+  const auto &ins = code[pc];
+  const auto at = dst.code.length();
+  switch (ins.op) {
+    case C_UNION: {
+      smallvector<u32,16> kept;
+      for (u32 k = 0, child = pc+1; k < ins.num; ++k, child = code[child].next)
+        if (!culled(code[child], box)) kept.add(child);
+      if (kept.length() == 0) return pruneempty(dst, ins.box);
+      if (kept.length() == 1) return collapse(src, pc, kept[0], box, dst);
+      dst.code.add(ins);
+      smallvector<u32,16> pcs;
+      loopv(kept) {
+        pcs.add(dst.code.length());
+        prune(src, kept[i], box, dst);
+      }
+      dst.code[at].num = pcs.length();
+      dst.code[at].bvh = NOBVH;
+      if (u32(pcs.length()) >= UNIONBVHNUM) {
+        vector<bvhref> refs;
+        loopv(pcs) refs.add(bvhref(dst.code[pcs[i]].box, pcs[i]));
+        dst.code[at].bvh = dst.bvh.length();
+        dst.bvh.add();
+        buildbvh(dst, &refs[0], refs.length(), dst.code[at].bvh);
+      }
+    }
+    break;
+    case C_DIFFERENCE:
+    case C_REPLACE:
+    case C_INTERSECTION: {
+      const auto left = pc+1, right = code[left].next;
+      const auto noleft = culled(code[left], box);
+      const auto noright = culled(code[right], box);
+      if (noleft || (noright && ins.op == C_INTERSECTION))
+        return pruneempty(dst, ins.box);
+      if (noright) return collapse(src, pc, left, box, dst);
+      dst.code.add(ins);
+      prune(src, left, box, dst);
+      prune(src, right, box, dst);
+    }
+    break;
+    case C_TRANSLATION:
+    case C_ROTATION:
+    case C_DISPLACEMENT: {
+      if (culled(ins, box)) return pruneempty(dst, ins.box);
+      aabb cbox;
+      if (ins.op == C_TRANSLATION)
+        cbox = aabb(box.pmin-ins.k.xyz(), box.pmax-ins.k.xyz());
+      else if (ins.op == C_ROTATION)
+        cbox = xfmbox(getquat(ins), box);
+      else
+        cbox = displacedbox(ins, box);
+      dst.code.add(ins);
+      prune(src, pc+1, cbox, dst);
+    }
+    break;
+    default:
+      if (ins.op != C_EMPTY && culled(ins, box)) return pruneempty(dst, ins.box);
+      dst.code.add(ins);
+    break;
+  }
+  dst.code[at].next = dst.code.length();
+}
+
+program *prune(const program *p, const aabb &box, program *dst) {
+  if (dst == NULL) dst = NEWE(program);
+  dst->code.setsize(0);
+  dst->bvh.setsize(0);
+  dst->children.setsize(0);
+  prune(*p, 0, box, *dst);
+  return dst;
+}
+
+/*-------------------------------------------------------------------------
+ - bake the program of a static scene into c++ code. the simd kernels
+ - include csgbaked.hxx and run the functions it defines in place of the
+ - interpreter for programs with the same hash. scenes are appended to the
+ - file such that all the shipped maps go in the same one
+ -------------------------------------------------------------------------*/
+static const char *opnames[] = {
+  "C_EMPTY", "C_UNION", "C_DIFFERENCE", "C_INTERSECTION", "C_REPLACE",
+  "C_SPHERE", "C_BOX", "C_PLANE", "C_CYLINDERXZ", "C_CYLINDERYZ", "C_CYLINDERXY",
+  "C_CAPPEDCYLINDERXZ", "C_CAPPEDCYLINDERYZ", "C_CAPPEDCYLINDERXY",
+  "C_TRANSLATION", "C_ROTATION", "C_DISPLACEMENT"
+};
+
+// nine digits are enough to give back the exact same float
+static void bakefloats(FILE *f, const float *x, u32 n) {
+  loopi(s32(n)) {
+    const auto sep = i ? "," : "";
+    if (abs(x[i]) > FLT_MAX) fprintf(f, "%s%s2.f*FLT_MAX", sep, x[i] < 0.f ? "-" : "");
+    else fprintf(f, "%s%.9ef", sep, x[i]);
+  }
+}
+
+static void bakeinstruction(FILE *f, const instruction &ins) {
+  fprintf(f, "bakedinstruction(%s, aabb(vec3f(", opnames[ins.op]);
+  bakefloats(f, &ins.box.pmin.x, 3);
+  fprintf(f, "), vec3f(");
+  bakefloats(f, &ins.box.pmax.x, 3);
+  fprintf(f, ")), vec4f(");
+  bakefloats(f, &ins.k.x, 4);
+  fprintf(f, "), %uu, vec2f(", ins.matindex);
+  bakefloats(f, &ins.caps.x, 2);
+  fprintf(f, "))");
+}
+
+// children are written first since their parent calls them
+static void bake(FILE *f, const program &p, u32 pc, u64 h) {
+  const auto code = &p.code[0];
+  const auto &ins = code[pc];
+  u32 children[2] = {pc+1, 0}, childnum = 0;
+  switch (ins.op) {
+    case C_UNION:
+      for (u32 k = 0, child = pc+1; k < ins.num; ++k, child = code[child].next)
+        if (!isprimitive(code[child].op)) bake(f, p, child, h);
+    break;
+    case C_DIFFERENCE: case C_INTERSECTION: case C_REPLACE:
+      children[1] = code[pc+1].next;
+      childnum = 2;
+    break;
+    case C_TRANSLATION: case C_ROTATION: case C_DISPLACEMENT: childnum = 1; break;
+    default: break;
+  }
+  loopi(s32(childnum)) bake(f, p, children[i], h);
+
+  fprintf(f, "CSGBAKEDNODE(s%016llx_%u) {\n", (unsigned long long) h, pc);
+  switch (ins.op) {
+    case C_UNION: {
+      // the culling is done once for all the children. runs of primitives
+      // are then merged packet by packet in registers
+      vector<u32> children;
+      for (u32 k = 0, child = pc+1; k < ins.num; ++k, child = code[child].next) {
+        fprintf(f, "  const auto c%u = ", child);
+        bakeinstruction(f, code[child]);
+        fprintf(f, ";\n  const auto a%u = !culled(c%u, box);\n", child, child);
+        children.add(child);
+      }
+      fprintf(f, "  auto first = true;\n");
+      for (int i = 0; i < children.length();) {
+        const auto child = children[i];
+        if (!isprimitive(code[child].op)) {
+          fprintf(f, "  if (a%u) {\n", child);
+          fprintf(f, "    unite(c%u, bakedchild<s%016llx_%u>(), first, CSGARGS);\n",
+                  child, (unsigned long long) h, child);
+          fprintf(f, "    first = false;\n  }\n");
+          ++i;
+          continue;
+        }
+        auto end = i;
+        while (end < children.length() && isprimitive(code[children[end]].op)) ++end;
+        fprintf(f, "  if (");
+        rangej(i, end) fprintf(f, "%sa%u", j==i ? "" : " || ", children[j]);
+        fprintf(f, ") {\n    loopi(packetnum) {\n");
+        fprintf(f, "      unitepacket packet(CSGARGS, i);\n      auto pfirst = first;\n");
+        rangej(i, end) {
+          fprintf(f, "      if (a%u) {\n", children[j]);
+          fprintf(f, "        packet.merge(c%u, pfirst, normaldist, grad);\n", children[j]);
+          fprintf(f, "        pfirst = false;\n      }\n");
+        }
+        fprintf(f, "      packet.store(dist, matindex, grad);\n    }\n");
+        fprintf(f, "    first = false;\n  }\n");
+        i = end;
+      }
+    }
+    break;
+    case C_DIFFERENCE: case C_INTERSECTION: case C_REPLACE: {
+      const auto name = ins.op == C_DIFFERENCE ? "subtract" :
+                        ins.op == C_INTERSECTION ? "intersect" : "replace";
+      fprintf(f, "  %s(", name);
+      loopi(2) {
+        bakeinstruction(f, code[children[i]]);
+        fprintf(f, ", bakedchild<s%016llx_%u>(), ", (unsigned long long) h, children[i]);
+      }
+      fprintf(f, "CSGARGS);\n");
+    }
+    break;
+    case C_TRANSLATION: case C_ROTATION: case C_DISPLACEMENT: {
+      const auto name = ins.op == C_TRANSLATION ? "translate" :
+                        ins.op == C_ROTATION ? "rotate" : "displace";
+      fprintf(f, "  %s(", name);
+      bakeinstruction(f, ins);
+      fprintf(f, ", bakedchild<s%016llx_%u>(), CSGARGS);\n",
+              (unsigned long long) h, pc+1);
+    }
+    break;
+    case C_EMPTY: break;
+    default:
+      fprintf(f, "  shape(");
+      bakeinstruction(f, ins);
+      fprintf(f, ", CSGARGS);\n");
+    break;
+  }
+  fprintf(f, "}\n");
+}
+
+bool bake(const program *p, const char *filename) {
+  const auto h = hash(p);
+  const fixedstring entry(fmt, "CSGBAKEDSCENE(0x%016llxull,", (unsigned long long) h);
+  const auto old = sys::loadfile(filename);
+  const auto found = old && strstr(old, entry.c_str()) != NULL;
+  FREE(old);
+  if (found) return true;
+  auto f = fopen(filename, "ab");
+  if (f == NULL) return false;
+  fprintf(f, "\n// generated by csgbake. %d instructions\n", p->code.length());
+  fprintf(f, "#if defined(CSGBAKEDNODE)\n");
+  bake(f, *p, 0, h);
+  fprintf(f, "#endif\n%s s%016llx_0)\n", entry.c_str(), (unsigned long long) h);
+  fclose(f);
+  return true;
+}
+
+static void csgbake(const char *filename) {
+  const auto n = makescene();
+  if (n == NULL) {
+    con::out("csg: no scene to bake");
+    return;
+  }
+  const auto p = compile(*n);
+  if (bake(p, filename))
+    con::out("csg: scene %016llx baked in %s", (unsigned long long) hash(p), filename);
+  else
+    con::out("csg: unable to write %s", filename);
+  destroy(p);
+}
+CMD(csgbake);
+
+/*-------------------------------------------------------------------------
+ - distance brick cache
+ -------------------------------------------------------------------------*/
+static const u32 BRICKSAMPLENUM = BRICKSAMPLEDIM*BRICKSAMPLEDIM*BRICKSAMPLEDIM;
+struct distbrick {
+  float d[BRICKSAMPLENUM];
+};
+
+struct distcache : noncopyable {
+  INLINE distcache(float cellsize) : prog(NULL), cellsize(cellsize) {}
+  ~distcache() {
+    clear();
+    destroy(prog);
+  }
+  void clear() {
+    for (auto it = bricks.begin(); it != bricks.end(); ++it) DEL(it->second);
+    bricks.clear();
+  }
+  static INLINE u64 key(const vec3i &xyz) {
+    const u64 mask = (1u<<21)-1;
+    return (u64(xyz.x)&mask) | (u64(xyz.y)&mask)<<21 | (u64(xyz.z)&mask)<<42;
+  }
+  INLINE aabb brickbox(const vec3i &xyz) const {
+    const auto org = cellsize*vec3f(xyz*int(BRICKDIM));
+    return aabb(org, org+vec3f(cellsize*float(BRICKDIM)));
+  }
+
+  // sample the brick by packets
+  distbrick *sample(const vec3i &xyz) {
+    const auto b = NEWE(distbrick);
+    const auto box = brickbox(xyz);
+    const auto maxdist = cellsize*float(BRICKDIM);
+    array3f pos;
+    arrayf d;
+    arrayi m;
+    u32 first = 0, num = 0;
+    loopxyz(vec3i(zero), vec3i(BRICKSAMPLEDIM)) {
+      set(pos, box.pmin+cellsize*vec3f(xyz), num++);
+      if (num == MAXPOINTNUM || first+num == BRICKSAMPLENUM) {
+        csg::dist(prog, pos, NULL, d, m, int(num), box);
+        loopi(num) b->d[first+i] = clamp(d[i], -maxdist, maxdist);
+        first += num;
+        num = 0;
+      }
+    }
+    bricks.insert(makepair(key(xyz), b));
+    return b;
+  }
+
+  static INLINE float lerp(float a, float b, float t) { return a+t*(b-a); }
+  float dist(const vec3f &p) {
+    const auto g = p/cellsize;
+    const auto cell = vec3i(floor(g));
+    const auto xyz = vec3i(floor(vec3f(cell)/float(BRICKDIM)));
+    const auto it = bricks.find(key(xyz));
+    const auto b = it != bricks.end() ? it->second : sample(xyz);
+
+    // trilinear interpolation of the eight samples around p
+    const auto l = cell-xyz*int(BRICKDIM);
+    const auto t = g-vec3f(cell);
+    const auto s = BRICKSAMPLEDIM;
+    const auto idx = (l.z*s+l.y)*s+l.x;
+    const auto d = b->d;
+    const auto d00 = lerp(d[idx],       d[idx+1],       t.x);
+    const auto d10 = lerp(d[idx+s],     d[idx+s+1],     t.x);
+    const auto d01 = lerp(d[idx+s*s],   d[idx+s*s+1],   t.x);
+    const auto d11 = lerp(d[idx+s*s+s], d[idx+s*s+s+1], t.x);
+    return lerp(lerp(d00, d10, t.y), lerp(d01, d11, t.y), t.z);
+  }
+
+  void invalidate(const aabb &dirty) {
+    const auto big = vec3f(float(1<<20)*cellsize*float(BRICKDIM));
+    if (any(gt(abs(dirty.pmin), big)) || any(gt(abs(dirty.pmax), big))) {
+      clear();
+      return;
+    }
+    // drop the bricks whose samples may see the changes
+    const auto margin = vec3f(cellsize);
+    const aabb box(dirty.pmin-margin, dirty.pmax+margin);
+    vector<u64> dropped;
+    for (auto it = bricks.begin(); it != bricks.end(); ++it) {
+      const auto k = it->first;
+      const u64 mask = (1u<<21)-1;
+      const auto x = s32(u32(k&mask)<<11)>>11;
+      const auto y = s32(u32((k>>21)&mask)<<11)>>11;
+      const auto z = s32(u32((k>>42)&mask)<<11)>>11;
+      const auto isec = intersection(brickbox(vec3i(x,y,z)), box);
+      if (any(gt(isec.pmin, isec.pmax))) continue;
+      DEL(it->second);
+      dropped.add(k);
+    }
+    loopv(dropped) bricks.erase(dropped[i]);
+  }
+
+  flat_map<u64,distbrick*> bricks;
+  program *prog;
+  float cellsize;
+};
+
+distcache *makedistcache(const node &n, float cellsize) {
+  const auto c = NEW(distcache, cellsize);
+  c->prog = compile(n);
+  return c;
+}
+void destroy(distcache *c) { SAFE_DEL(c); }
+float dist(distcache *c, const vec3f &pos) { return c->dist(pos); }
+void update(distcache *c, const node &n, const aabb &dirty) {
+  destroy(c->prog);
+  c->prog = compile(n);
+  c->invalidate(dirty);
+}
+
+/*-------------------------------------------------------------------------
+ - sparse distance volume
+ -------------------------------------------------------------------------*/
+distvolume *makedistvolume(const program *p, const aabb &box, float cellsize) {
+  const auto start = sys::millis();
+  const auto &k = kernel::get();
+  const auto side = cellsize*float(BRICKDIM);
+  const auto v = NEWE(distvolume);
+  v->org = box.pmin;
+  v->cellsize = cellsize;
+  v->dim = max(vec3i(ceil((box.pmax-box.pmin)/side)), vec3i(one));
+  const auto n = u32(v->dim.x*v->dim.y*v->dim.z);
+  v->index = (u16*) MALLOC(sizeof(u16)*n);
+  const auto brickorg = [&](u32 idx) {
+    const vec3i xyz(idx%v->dim.x, (idx/v->dim.x)%v->dim.y, idx/(v->dim.x*v->dim.y));
+    return v->org + side*vec3f(xyz);
+  };
+
+  // one distance per brick center by packets of bricks
+  const auto halfdiag = 0.5f*sqrt(3.f)*side;
+  parallelfor("distvolumecenters", (n+MAXPOINTNUM-1)/MAXPOINTNUM, 1, [&](u32 packet) {
+    array3f pos;
+    arrayf d;
+    arrayi m;
+    const auto first = packet*MAXPOINTNUM, num = min(n-first, MAXPOINTNUM);
+    auto cull = aabb::empty();
+    loopi(s32(num)) {
+      const auto org = brickorg(first+i);
+      set(pos, org+0.5f*side, i);
+      cull = sum(cull, aabb(org, org+side));
+    }
+    // the kernel runs whole simd lanes: the tail repeats the last center
+    rangei(s32(num), s32(MAXPOINTNUM)) set(pos, brickorg(first+num-1)+0.5f*side, i);
+    k.csgdist(p, pos, NULL, d, m, int(num), cull, NULL);
+    loopi(s32(num))
+      v->index[first+i] = abs(d[i]) > halfdiag ? u16(d[i] < 0.f ? 1 : 0) : u16(~0);
+  });
+
+  // the bricks near the surface get their atlas brick in order
+  u32 dropped = 0;
+  v->bricknum = 0;
+  loopi(s32(n)) if (v->index[i] == u16(~0)) {
+    if (v->bricknum+2 < 0xffffu)
+      v->index[i] = u16(2+v->bricknum++);
+    else {
+      v->index[i] = 0;
+      ++dropped;
+    }
+  }
+  if (dropped) con::out("csg: distance volume too large, %u bricks dropped", dropped);
+  const auto a = max(u32(ceil(pow(float(v->bricknum), 1.f/3.f))), 1u);
+  v->atlasdim = vec3i(a, a, max((v->bricknum+a*a-1)/(a*a), 1u));
+  const auto atlasw = u32(v->atlasdim.x)*BRICKSAMPLEDIM;
+  const auto atlash = u32(v->atlasdim.y)*BRICKSAMPLEDIM;
+  const auto atlasnum = atlasw*atlash*u32(v->atlasdim.z)*BRICKSAMPLEDIM;
+  v->atlas = (float*) MALLOC(sizeof(float)*atlasnum);
+  loopi(s32(atlasnum)) v->atlas[i] = side;
+
+  // every brick of the atlas is sampled by packets at its corners
+  parallelfor("distvolumebricks", n, 4, [&](u32 idx) {
+    if (v->index[idx] < 2) return;
+    const auto slot = u32(v->index[idx]-2);
+    const auto ax = slot%v->atlasdim.x, ay = (slot/v->atlasdim.x)%v->atlasdim.y;
+    const auto az = slot/(v->atlasdim.x*v->atlasdim.y);
+    const auto org = brickorg(idx);
+    const aabb cull(org, org+side);
+    array3f pos;
+    arrayf d;
+    arrayi m;
+    u32 offset[MAXPOINTNUM], num = 0, done = 0;
+    loopxyz(vec3i(zero), vec3i(BRICKSAMPLEDIM)) {
+      set(pos, org+cellsize*vec3f(xyz), num);
+      const auto x = ax*BRICKSAMPLEDIM+xyz.x, y = ay*BRICKSAMPLEDIM+xyz.y;
+      const auto z = az*BRICKSAMPLEDIM+xyz.z;
+      offset[num++] = (z*atlash+y)*atlasw+x;
+      if (num == MAXPOINTNUM || done+num == BRICKSAMPLENUM) {
+        k.csgdist(p, pos, NULL, d, m, int(num), cull, NULL);
+        loopi(s32(num)) v->atlas[offset[i]] = clamp(d[i], -side, side);
+        done += num;
+        num = 0;
+      }
+    }
+  });
+  con::out("csg: distance volume %dx%dx%d, %u bricks near the surface in %f ms",
+           v->dim.x, v->dim.y, v->dim.z, v->bricknum, float(sys::millis()-start));
+  return v;
+}
+
+void destroy(distvolume *v) {
+  if (v == NULL) return;
+  FREE(v->index);
+  FREE(v->atlas);
+  DEL(v);
+}
+
+/*-------------------------------------------------------------------------
+ - bulk construction. csg.build decodes a flat array of numbers in one call
+ - instead of going through one bridged constructor per node. instructions
+ - are in postfix order: an opcode followed by its constants. primitives
+ - push one node, transformations replace the top node and combinations pop
+ - their operands and push the result
+ -------------------------------------------------------------------------*/
+enum {
+  OP_UNION, OP_DIFFERENCE, OP_INTERSECTION, OP_REPLACE,
+  OP_BOX, OP_PLANE, OP_SPHERE, OP_CYLINDERXZ, OP_CYLINDERXY, OP_CYLINDERYZ,
+  OP_TRANSLATION, OP_ROTATION, OP_DISPLACEMENT,
+  OP_UNIONN,  // count: left nested union of the count top nodes
+  OP_BOUNDS,  // pmin, pmax: same as setmin / setmax on the top node
+  OP_NUM
+};
+static const struct opdesc {
+  const char *name;
+  u32 argnum, popnum;
+} opdescs[OP_NUM] = {
+  {"op_union",0,2}, {"op_difference",0,2}, {"op_intersection",0,2},
+  {"op_replace",0,2}, {"op_box",4,0}, {"op_plane",5,0}, {"op_sphere",2,0},
+  {"op_cylinderxz",4,0}, {"op_cylinderxy",4,0}, {"op_cylinderyz",4,0},
+  {"op_translation",3,1}, {"op_rotation",3,1}, {"op_displacement",3,1},
+  {"op_unionn",1,0}, {"op_bounds",6,1}
+};
+
+static INLINE ref<node> popnode(vector<ref<node>> &stack) {
+  const auto n = stack.last();
+  stack.setsize(stack.length()-1);
+  return n;
+}
+
+// lua errors long jump so no node may be alive when we report one
+static const char *decode(lua_State *L, ref<node> &result) {
+  const auto n = u32(lua_objlen(L, 1));
+  vector<float> args;
+  vector<ref<node>> stack;
+  for (u32 i = 1; i <= n;) {
+    lua_rawgeti(L, 1, int(i++));
+    const auto op = u32(lua_tonumber(L, -1));
+    lua_pop(L, 1);
+    if (op >= OP_NUM) return "invalid opcode";
+    const auto &desc = opdescs[op];
+    if (i+desc.argnum > n+1) return "missing constants";
+    args.setsize(0);
+    loopj(s32(desc.argnum)) {
+      lua_rawgeti(L, 1, int(i++));
+      args.add(float(lua_tonumber(L, -1)));
+      lua_pop(L, 1);
+    }
+    if (u32(stack.length()) < desc.popnum) return "missing operands";
+    const auto a = &args[0];
+    ref<node> top;
+    if (desc.popnum == 1) top = popnode(stack);
+    switch (op) {
+      case OP_UNION: case OP_DIFFERENCE: case OP_INTERSECTION: case OP_REPLACE: {
+        const auto right = popnode(stack);
+        const auto left = popnode(stack);
+        if (op == OP_UNION) stack.add(NEW(U, left, right));
+        else if (op == OP_DIFFERENCE) stack.add(NEW(D, left, right));
+        else if (op == OP_INTERSECTION) stack.add(NEW(I, left, right));
+        else stack.add(NEW(R, left, right));
+      }
+      break;
+      case OP_BOX: stack.add(NEW(box, a[0], a[1], a[2], u32(a[3]))); break;
+      case OP_PLANE: stack.add(NEW(plane, a[0], a[1], a[2], a[3], u32(a[4]))); break;
+      case OP_SPHERE: stack.add(NEW(sphere, a[0], u32(a[1]))); break;
+      case OP_CYLINDERXZ: stack.add(NEW(cylinderxz, a[0], a[1], a[2], u32(a[3]))); break;
+      case OP_CYLINDERXY: stack.add(NEW(cylinderxy, a[0], a[1], a[2], u32(a[3]))); break;
+      case OP_CYLINDERYZ: stack.add(NEW(cylinderyz, a[0], a[1], a[2], u32(a[3]))); break;
+      case OP_TRANSLATION: stack.add(NEW(translation, a[0], a[1], a[2], top)); break;
+      case OP_ROTATION: stack.add(NEW(rotation, a[0], a[1], a[2], top)); break;
+      case OP_DISPLACEMENT: stack.add(NEW(displacement, a[0], a[1], top, u32(a[2]))); break;
+      case OP_UNIONN: {
+        const auto num = s32(a[0]);
+        if (num <= 0 || num > stack.length()) return "missing operands";
+        const auto first = stack.length()-num;
+        ref<node> u = stack[first];
+        rangej(first+1, stack.length()) u = NEW(U, u, stack[j]);
+        stack.setsize(first);
+        stack.add(u);
+      }
+      break;
+      case OP_BOUNDS:
+        top->setmin(a[0], a[1], a[2]);
+        top->setmax(a[3], a[4], a[5]);
+        stack.add(top);
+      break;
+    }
+  }
+  if (stack.length() != 1) return "one node must be left";
+  result = stack[0];
+  return NULL;
+}
+
+static int build(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  const char *err;
+  {
+    ref<node> result;
+    err = decode(L, result);
+    if (err == NULL) {
+      luabridge::push(L, result);
+      return 1;
+    }
+  }
+  return luaL_error(L, "csg.build: %s", err);
+}
+
+static void bind(lua_State *L) {
 #define ENUM(NAMESPACE,NAME,VALUE)\
   static const u32 NAME = VALUE;\
-  luabridge::getGlobalNamespace(script::luastate())\
+  luabridge::getGlobalNamespace(L)\
   .beginNamespace(#NAMESPACE)\
     .addVariable(#NAME, const_cast<u32*>(&NAME), false)\
   .endNamespace()
@@ -32,14 +1027,23 @@ void start() {
   ENUM(csg, mat_simple_index, MAT_SIMPLE_INDEX);
   ENUM(csg, mat_snoise_index, MAT_SNOISE_INDEX);
 #undef ENUM
+  static u32 opcodes[OP_NUM];
+  loopi(OP_NUM) {
+    opcodes[i] = u32(i);
+    luabridge::getGlobalNamespace(L)
+    .beginNamespace("csg")
+      .addVariable(opdescs[i].name, opcodes+i, false)
+    .endNamespace();
+  }
 
 #define ADDCLASS(NAME, CONSTRUCTOR) \
   .deriveClass<NAME,node>(#NAME)\
     .addConstructor<CONSTRUCTOR, ref<NAME>>()\
   .endClass()
-  luabridge::getGlobalNamespace(script::luastate())
+  luabridge::getGlobalNamespace(L)
   .beginNamespace("csg")
     .addFunction("setroot", setroot)
+    .addCFunction("build", build)
     .beginClass<node>("node")
       .addFunction("setmin", &node::setmin)
       .addFunction("setmax", &node::setmax)
@@ -56,10 +1060,172 @@ void start() {
     ADDCLASS(cylinderyz,void(*)(float,float,float,u32))
     ADDCLASS(translation,void(*)(float,float,float,const ref<node>&))
     ADDCLASS(rotation,void(*)(float,float,float,const ref<node>&))
+    ADDCLASS(displacement,void(*)(float,float,const ref<node>&,u32))
   .endNamespace();
 #undef ADDCLASS
 }
-void finish() {root=NULL;}
+
+/*-------------------------------------------------------------------------
+ - sphere tracing by packets of 8x8 rays. every step evaluates the active
+ - rays together with the simd kernels. children whose box stays farther
+ - than MAXSTEP from all the points are culled so steps never go beyond it
+ -------------------------------------------------------------------------*/
+static const u32 TRACETILE = 8;
+static const u32 MAXSTEPNUM = 128;
+static const float MAXSTEP = 4.f;
+static const float HITEPS = 1e-3f;
+
+struct tracetask : public task {
+  tracetask(const program *p, int *pixels, vec2i dim, vec2i tile, const vec3f &org,
+            const mat4x4f &invmvp, const vec3f &lightdir, float farplane) :
+    task("tracetask", u32(tile.x*tile.y), 1, 0, UNFAIR),
+    p(p), pixels(pixels), dim(dim), tile(tile), org(org), invmvp(invmvp),
+    lightdir(lightdir), farplane(farplane)
+  {}
+  INLINE void positions(array3f &pos, aabb &box, const vec3f *dir, const float *t,
+                        const u32 *rays, u32 num) const {
+    box = aabb::empty();
+    loopi(s32(num)) {
+      const auto xyz = org+t[rays[i]]*dir[rays[i]];
+      set(pos, xyz, i);
+      box.pmin = min(box.pmin, xyz);
+      box.pmax = max(box.pmax, xyz);
+    }
+    box.pmin -= vec3f(MAXSTEP);
+    box.pmax += vec3f(MAXSTEP);
+  }
+  virtual void run(u32 tileID) {
+    const auto csgdist = kernel::get().csgdist;
+    const vec2i tileorg = int(TRACETILE) * vec2i(tileID%tile.x, tileID/tile.x);
+    vec3f dir[MAXPOINTNUM];
+    float t[MAXPOINTNUM];
+    u32 active[MAXPOINTNUM], hits[MAXPOINTNUM], activenum = 0, hitnum = 0;
+    loopi(s32(MAXPOINTNUM)) {
+      const auto x = min(tileorg.x+i%int(TRACETILE), dim.x-1);
+      const auto y = min(tileorg.y+i/int(TRACETILE), dim.y-1);
+      const auto end = invmvp * vec4f(float(x)+0.5f, float(y)+0.5f, 1.f, 1.f);
+      dir[i] = normalize(end.xyz()/end.w-org);
+      t[i] = 0.f;
+      active[activenum++] = i;
+    }
+
+    // march the active rays until they hit, leave the frustum or give up
+    array3f pos;
+    arrayf d;
+    arrayi m;
+    aabb box;
+    for (u32 step = 0; step < MAXSTEPNUM && activenum != 0; ++step) {
+      positions(pos, box, dir, t, active, activenum);
+      csgdist(p, pos, NULL, d, m, int(activenum), box, NULL);
+      u32 next = 0;
+      loopi(s32(activenum)) {
+        const auto ray = active[i];
+        if (d[i] < HITEPS*max(t[ray], 1.f))
+          hits[hitnum++] = ray;
+        else if ((t[ray] += min(d[i], MAXSTEP)) < farplane)
+          active[next++] = ray;
+      }
+      activenum = next;
+    }
+
+    // lambert shading with the analytic gradient of the hit points
+    int rgba[MAXPOINTNUM];
+    memset(rgba, 0, sizeof(rgba));
+    if (hitnum != 0) {
+      array3f grad;
+      positions(pos, box, dir, t, hits, hitnum);
+      csgdist(p, pos, NULL, d, m, int(hitnum), box, &grad);
+      loopi(s32(hitnum)) {
+        const auto g = get(grad, i);
+        const auto n = g == vec3f(zero) ? -dir[hits[i]] : normalize(g);
+        const auto albedo = m[i] == s32(MAT_SNOISE_INDEX) ?
+          vec3f(0.8f,0.7f,0.5f) : vec3f(0.7f,0.7f,0.7f);
+        const auto c = albedo*(0.25f+0.75f*max(dot(n,lightdir),0.f));
+        const auto rgb = vec3i(clamp(c, vec3f(zero), vec3f(one))*255.f);
+        rgba[hits[i]] = rgb.x|(rgb.y<<8)|(rgb.z<<16)|(0xff<<24);
+      }
+    }
+    const auto w = min(int(TRACETILE), dim.x-tileorg.x);
+    const auto h = min(int(TRACETILE), dim.y-tileorg.y);
+    loopi(h) memcpy(pixels+(tileorg.y+i)*dim.x+tileorg.x, rgba+i*TRACETILE, w*sizeof(int));
+  }
+  const program *p;
+  int *pixels;
+  vec2i dim, tile;
+  vec3f org;
+  mat4x4f invmvp;
+  vec3f lightdir;
+  float farplane;
+};
+
+void spheretrace(const program *p, int *pixels, int w, int h, const vec3f &org,
+                 const mat4x4f &invmvp, const vec3f &lightdir, float farplane)
+{
+  const vec2i dim(w,h), tile((dim+int(TRACETILE)-1)/int(TRACETILE));
+  if (tile.x*tile.y == 0) return;
+  ref<task> job = NEWTASK(tracetask, p, pixels, dim, tile, org, invmvp, lightdir, farplane);
+  job->scheduled();
+  job->wait();
+}
+
+/*-------------------------------------------------------------------------
+ - scene scripts run on their own lua state in a task such that the scene
+ - is built while the rest of the game starts. makescene waits for it. the
+ - script is read by the io threads and the task only starts afterwards
+ -------------------------------------------------------------------------*/
+struct scenetask : public task {
+  INLINE scenetask(const char *filename) :
+    task("csgscene", 1, 1, 0, BACKGROUND), filename(filename) {}
+  virtual void run(u32) {
+    auto L = script::newstate();
+    bind(L);
+    const auto buf = file->data;
+    if (buf == NULL)
+      err.fmt("unable to find %s", filename.c_str());
+    else if (luaL_loadstring(L, buf) || lua_pcall(L, 0, 0, 0)) {
+      const auto msg = lua_tostring(L, -1);
+      err.fmt("%s failed with %s", filename.c_str(), msg ? msg : "?");
+    }
+    file = nil;
+    // the other script nodes go away here. the root is only read once the
+    // task is done
+    script::closestate(L);
+  }
+  fixedstring filename, err; // the console is only used by the main thread
+  ref<io::file> file;
+};
+static ref<scenetask> scenejob;
+
+void loadscene(const char *filename, task *next) {
+  if (scenejob) scenejob->wait();
+  root = NULL;
+  scenejob = NEWTASK(scenetask, filename);
+  if (next) scenejob->starts(*next);
+  scenejob->file = io::read(sys::path(scenejob->filename.c_str()), scenejob.ptr);
+  scenejob->scheduled();
+}
+
+node *makescene() {
+  if (scenejob) {
+    scenejob->wait();
+    if (scenejob->err[0] != '\0') con::out("csg: %s", scenejob->err.c_str());
+    scenejob = NULL;
+  }
+  return root.ptr;
+}
+
+node *scene() { return root.ptr; }
+
+void destroyscene(node *n) {
+  assert(n == root.ptr);
+  root = NULL;
+}
+
+void start() { bind(script::luastate()); }
+void finish() {
+  makescene();
+  root = NULL;
+}
 } /* namespace csg */
 } /* namespace q */
 
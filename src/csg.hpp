@@ -8,6 +8,7 @@
 #include "soa.hpp"
 
 namespace q {
+class task;
 namespace csg {
 
 /*--------------------------------------------------------------------------
@@ -39,7 +40,8 @@ material *getmaterial(u32 matindex);
 enum CSGOP {
   C_EMPTY, C_UNION, C_DIFFERENCE, C_INTERSECTION, C_REPLACE,
   C_SPHERE, C_BOX, C_PLANE, C_CYLINDERXZ, C_CYLINDERYZ, C_CYLINDERXY,
-  C_TRANSLATION, C_ROTATION,
+  C_CAPPEDCYLINDERXZ, C_CAPPEDCYLINDERYZ, C_CAPPEDCYLINDERXY,
+  C_TRANSLATION, C_ROTATION, C_DISPLACEMENT,
   C_INVALID = 0xffffffff
 };
 struct node : refcount {
@@ -53,9 +55,70 @@ struct node : refcount {
   CSGOP type;
 };
 
+// run a scene script on its own lua state in a task. makescene waits for it.
+// next, if any, only starts once the scene is built and may read it with scene
+void loadscene(const char *filename, task *next = NULL);
 node *makescene();
+node *scene();
 void destroyscene(node *n);
 
+// flatten the tree into the program evaluated by the distance routines
+struct program;
+program *compile(const node &n);
+void destroy(program *p);
+// copy in dst (allocated if null) the part of the program the box reaches.
+// culled subtrees are dropped and unions or differences left with one child
+// are replaced by it. queries with boxes inside box give the same results
+program *prune(const program *p, const aabb &box, program *dst = NULL);
+
+// content hash of a compiled program. used to key baked scenes
+u64 hash(const program *p);
+
+// append to the file the c++ code of the program for csgbaked.hxx. once
+// compiled in, the simd kernels run it instead of interpreting any program
+// with the same hash. csgbake(filename) bakes the current scene
+bool bake(const program *p, const char *filename);
+bool isbaked(const program *p);
+
+// render the compiled scene by sphere tracing its distance field, without
+// any mesh or bvh. invmvp maps the w x h pixels (and their depth) to the
+// world and org is the eye. pixels are rgba and black without hit
+void spheretrace(const program *p, int *pixels, int w, int h, const vec3f &org,
+                 const mat4x4f &invmvp, const vec3f &lightdir, float farplane);
+/*--------------------------------------------------------------------------
+ - sparse cache of the distance field for gameplay queries. the field is
+ - lazily sampled by bricks of BRICKDIM^3 cells and trilinearly interpolated.
+ - distances are clamped to the brick size. the cache is not thread safe
+ -------------------------------------------------------------------------*/
+static const u32 BRICKDIM = 8;
+struct distcache;
+distcache *makedistcache(const node &n, float cellsize);
+void destroy(distcache *c);
+float dist(distcache *c, const vec3f &pos);
+// recompile the scene and drop all bricks overlapping the dirty box
+void update(distcache *c, const node &n, const aabb &dirty = aabb::all());
+
+/*--------------------------------------------------------------------------
+ - sparse distance volume for the gpu. the box is cut in bricks sampled as
+ - the cache ones such that a trilinear fetch never reads two bricks. bricks
+ - whose center is further from the surface than their half diagonal only
+ - keep their sign. the others are packed in an atlas
+ -------------------------------------------------------------------------*/
+static const u32 BRICKSAMPLEDIM = BRICKDIM+1;
+struct distvolume {
+  vec3f org;      // corner of the first brick
+  float cellsize;
+  vec3i dim;      // bricks of the volume
+  vec3i atlasdim; // bricks of the atlas
+  u16 *index;     // per brick: 0 outside, 1 inside, atlas brick+2 otherwise
+  float *atlas;   // BRICKSAMPLEDIM^3 samples per atlas brick, x first
+  u32 bricknum;   // bricks used in the atlas
+};
+// the box is grown to whole bricks. the calling thread waits for the bake
+// and helps with it
+distvolume *makedistvolume(const program *p, const aabb &box, float cellsize);
+void destroy(distvolume *v);
+
 /*--------------------------------------------------------------------------
  - for soa computations
  -------------------------------------------------------------------------*/
@@ -0,0 +1,9 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - csgavx2.cpp -> instantiates avx2+fma routines for csg evulation
+ -------------------------------------------------------------------------*/
+#define NAMESPACE avx2
+#include "csgsimd.cxx"
+#undef avx2
+
+
@@ -0,0 +1,7 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - csgbaked.hxx -> code of the baked csg scenes. appended to by csgbake
+ -------------------------------------------------------------------------*/
+// every scene gives the functions of its instructions, only compiled by the
+// simd kernels where CSGBAKEDNODE is defined, and one CSGBAKEDSCENE(hash,
+// root) entry. this file is included several times and has no guard
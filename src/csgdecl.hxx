@@ -2,8 +2,9 @@
  - mini.q - a minimalistic multiplayer fps
  - csgdecl.hxx -> template to declare various csg evaluation routines
  -------------------------------------------------------------------------*/
-// many points evaluation
-void dist(const node *RESTRICT, const array3f &RESTRICT,
+// many points evaluation. if grad is given, the analytic gradient of the
+// distance is also computed
+void dist(const program *RESTRICT, const array3f &RESTRICT,
           const arrayf *RESTRICT, arrayf &RESTRICT, arrayi &RESTRICT,
-          int num, const aabb &RESTRICT);
+          int num, const aabb &RESTRICT, array3f *RESTRICT grad = NULL);
 
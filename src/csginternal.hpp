@@ -4,6 +4,8 @@
  -------------------------------------------------------------------------*/
 #pragma once
 #include "csg.hpp"
+#include "base/vector.hpp"
+#include "base/utility.hpp"
 
 namespace q {
 namespace csg {
@@ -93,6 +95,16 @@ struct cylinderyz : materialnode {
   vec2f cyz;
   float r;
 };
+// cylinder capped by two planes orthogonal to its axis. scripts build them
+// with differences which the scene optimizer then folds in this node
+struct cappedcylinder : materialnode {
+  INLINE cappedcylinder(CSGOP type, const vec2f &c, float r, const vec2f &caps,
+                        const aabb &box, u32 matindex) :
+    materialnode(type, box, matindex), c(c), r(r), caps(caps) {}
+  vec2f c;
+  float r;
+  vec2f caps; // lower and upper bounds along the axis
+};
 struct translation : node {
   INLINE translation(const vec3f &p, const ref<node> &n) :
     node(C_TRANSLATION, aabb(p+fixedaabb(n).pmin, p+fixedaabb(n).pmax)), p(p),
@@ -111,6 +123,133 @@ struct rotation : node {
   quat3f q;
   ref<node> n;
 };
+// displace the surface of the child with value noise. points the noise
+// moves inside the child get the material of the displacement
+struct displacement : materialnode {
+  INLINE displacement(float amplitude, float frequency, const ref<node> &n,
+                      u32 matindex = MAT_SNOISE_INDEX) :
+    materialnode(C_DISPLACEMENT, aabb(fixedaabb(n).pmin-vec3f(abs(amplitude)),
+                                      fixedaabb(n).pmax+vec3f(abs(amplitude))),
+                 matindex),
+    amplitude(amplitude), frequency(frequency), n(fixednode(n)) {}
+  float amplitude, frequency;
+  ref<node> n;
+};
+
+/*-------------------------------------------------------------------------
+ - compiled csg tree. nodes are flattened in pre-order into one linear
+ - stream of instructions with their constants packed and their boxes
+ - inlined. each instruction knows where its subtree ends. left-nested
+ - chains of unions are merged into one n-ary union whose children directly
+ - follow it. boxes are tightened with the ones of the children such that
+ - rotated subtrees are culled as well
+ -------------------------------------------------------------------------*/
+struct instruction {
+  aabb box;     // bounding box of the subtree
+  vec4f k;      // extent, plane, radius, center+radius, offset or quaternion
+  CSGOP op;
+  u32 next;     // first instruction after the subtree
+  u32 num;      // number of children of n-ary unions
+  u32 matindex;
+  u32 bvh;      // root of the bvh over the children of large unions
+  vec2f caps;   // axis bounds of capped cylinders
+};
+
+// unions with at least this many children get a bvh over them. inner bvh
+// nodes have their two children at offset and offset+1. leaves reference
+// num union children stored from offset in program::children
+static const u32 UNIONBVHNUM = 8;
+static const u32 NOBVH = ~0u;
+struct bvhnode {
+  aabb box;
+  u32 offset, num;
+};
+static const u32 NOBAKED = ~0u;
+struct program : noncopyable {
+  INLINE program() : baked(NOBAKED) {}
+  vector<instruction> code;
+  vector<bvhnode> bvh;
+  vector<u32> children;
+  u32 baked; // index of the code csgbake generated for it if any
+};
+
+// gather the children of the large union at "pc" that overlap the box. they
+// are sorted in program order such that the union folds them exactly as the
+// linear scan does. returns false if more than MAXHITNUM children overlap
+static const u32 MAXHITNUM = 256;
+bool gather(const program &p, u32 pc, const aabb &box, u32 *hits, u32 &hitnum);
+
+// bounding box of a rotated box. unbounded boxes stay unbounded
+aabb xfmbox(const quat3f &q, const aabb &box);
+
+// rewrite the tree into a smaller equivalent one. input nodes are shared
+// but never modified since the scripts may still reference them
+ref<node> optimize(const ref<node> &n);
+INLINE bool isprimitive(CSGOP op) { return op >= C_SPHERE && op <= C_CAPPEDCYLINDERXY; }
+INLINE quat3f getquat(const instruction &ins) {
+  return quat3f(ins.k.w, ins.k.xyz());
+}
+
+/*-------------------------------------------------------------------------
+ - value noise in [-1,1] shared by all evaluators. T is either float or
+ - soaf. the lattice hash only uses float operations since sse2 has neither
+ - 32 bits integer multiplies nor floor
+ -------------------------------------------------------------------------*/
+INLINE float latticefloor(float x) { return floor(x); }
+INLINE soaf latticefloor(const soaf &x) {
+#if defined(__AVX__)
+  // avx has a floor while its integers are emulated over two sse halves
+  // without avx2. the conversions below are several times slower
+  return floor(x);
+#else
+  const auto r = soaf(soai(x)); // round to nearest
+  return select(r > x, r-soaf(1.f), r);
+#endif
+}
+template <typename T> INLINE T latticefract(const T &x) {
+  return x-latticefloor(x);
+}
+template <typename T> INLINE T latticehash(const T &x, const T &y, const T &z) {
+  const auto k = T(0.1031f), c = T(33.33f);
+  const auto fx = latticefract(x*k), fy = latticefract(y*k), fz = latticefract(z*k);
+  const auto d = fx*(fy+c) + fy*(fz+c) + fz*(fx+c);
+  return latticefract((fx+fy+d+d)*(fz+d));
+}
+template <typename T> INLINE T noiselerp(const T &a, const T &b, const T &t) {
+  return a+(b-a)*t;
+}
+
+// children of displacements see points up to the amplitude away. their
+// query box grows accordingly
+INLINE aabb displacedbox(const instruction &ins, const aabb &box) {
+  const auto a = vec3f(abs(ins.k.x));
+  return aabb(box.pmin-a, box.pmax+a);
+}
+
+// if grad is not null, it receives the gradient of the noise
+template <typename T>
+INLINE T valuenoise(const vec3<T> &p, vec3<T> *grad = NULL) {
+  const auto one = T(1.f);
+  const auto i = vec3<T>(latticefloor(p.x), latticefloor(p.y), latticefloor(p.z));
+  const auto f = p-i;
+  const auto w = f*f*(T(3.f)-T(2.f)*f);
+  const auto ix = i.x+one, iy = i.y+one, iz = i.z+one;
+  const auto c000 = latticehash(i.x,i.y,i.z), c100 = latticehash(ix,i.y,i.z);
+  const auto c010 = latticehash(i.x,iy,i.z),  c110 = latticehash(ix,iy,i.z);
+  const auto c001 = latticehash(i.x,i.y,iz),  c101 = latticehash(ix,i.y,iz);
+  const auto c011 = latticehash(i.x,iy,iz),   c111 = latticehash(ix,iy,iz);
+  const auto x00 = noiselerp(c000,c100,w.x), x10 = noiselerp(c010,c110,w.x);
+  const auto x01 = noiselerp(c001,c101,w.x), x11 = noiselerp(c011,c111,w.x);
+  const auto y0 = noiselerp(x00,x10,w.y), y1 = noiselerp(x01,x11,w.y);
+  if (grad) {
+    const auto dw = T(6.f)*f*(one-f);
+    const auto dx = noiselerp(noiselerp(c100-c000, c110-c010, w.y),
+                              noiselerp(c101-c001, c111-c011, w.y), w.z);
+    const auto dy = noiselerp(x10-x00, x11-x01, w.z);
+    const auto dz = y1-y0;
+    *grad = T(2.f)*vec3<T>(dx*dw.x, dy*dw.y, dz*dw.z);
+  }
+  return T(2.f)*noiselerp(y0,y1,w.z)-one;
+}
 } /* namespace csg */
 } /* namespace q */
-
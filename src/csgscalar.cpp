@@ -8,243 +8,449 @@
 
 namespace q {
 namespace csg {
-static void distr(const node *RESTRICT n, const array3f &RESTRICT pos,
-                  const arrayf *RESTRICT normaldist, arrayf &RESTRICT dist,
-                  arrayi &RESTRICT matindex, int num, const aabb &RESTRICT box)
+static INLINE bool culled(const instruction &ins, const aabb &box) {
+  const auto isec = intersection(ins.box, box);
+  return any(gt(isec.pmin, isec.pmax));
+}
+
+static INLINE float primitive(const instruction &ins, const vec3f &pos) {
+  switch (ins.op) {
+    case C_PLANE: return dot(pos, ins.k.xyz()) + ins.k.w;
+    case C_CYLINDERXY: return length(pos.xy()-ins.k.xy()) - ins.k.z;
+    case C_CYLINDERXZ: return length(pos.xz()-ins.k.xy()) - ins.k.z;
+    case C_CYLINDERYZ: return length(pos.yz()-ins.k.xy()) - ins.k.z;
+    case C_CAPPEDCYLINDERXY: {
+      const auto d = length(pos.xy()-ins.k.xy()) - ins.k.z;
+      return max(max(d, ins.caps.x-pos.z), pos.z-ins.caps.y);
+    }
+    case C_CAPPEDCYLINDERXZ: {
+      const auto d = length(pos.xz()-ins.k.xy()) - ins.k.z;
+      return max(max(d, ins.caps.x-pos.y), pos.y-ins.caps.y);
+    }
+    case C_CAPPEDCYLINDERYZ: {
+      const auto d = length(pos.yz()-ins.k.xy()) - ins.k.z;
+      return max(max(d, ins.caps.x-pos.x), pos.x-ins.caps.y);
+    }
+    case C_SPHERE: return length(pos) - ins.k.x;
+    case C_BOX: {
+      const auto pd = abs(pos)-ins.k.xyz();
+      return min(max(pd.x,max(pd.y,pd.z)),0.0f) + length(max(pd,vec3f(zero)));
+    }
+    default: assert("unreachable" && false); return FLT_MAX;
+  }
+}
+
+// analytic gradient of the primitive distance. degenerated points where the
+// gradient is undefined get a null vector
+static INLINE vec3f cylgrad(const vec2f &v) {
+  const auto l = length(v);
+  return l > 0.f ? vec3f(v.x/l, v.y/l, 0.f) : vec3f(zero);
+}
+// move the gradient computed in the xy plane to the xz and yz planes
+static INLINE vec3f toxz(const vec3f &g) { return vec3f(g.x,g.z,g.y); }
+static INLINE vec3f toyz(const vec3f &g) { return vec3f(g.z,g.x,g.y); }
+static INLINE vec3f capgrad(const vec3f &g, float d, float lo, float hi) {
+  if (d >= lo && d >= hi) return g;
+  return lo >= hi ? vec3f(0.f,0.f,-1.f) : vec3f(0.f,0.f,1.f);
+}
+static INLINE vec3f gradient(const instruction &ins, const vec3f &pos) {
+  switch (ins.op) {
+    case C_PLANE: return ins.k.xyz();
+    case C_CYLINDERXY: return cylgrad(pos.xy()-ins.k.xy());
+    case C_CYLINDERXZ: return toxz(cylgrad(pos.xz()-ins.k.xy()));
+    case C_CYLINDERYZ: return toyz(cylgrad(pos.yz()-ins.k.xy()));
+    case C_CAPPEDCYLINDERXY: {
+      const auto d = length(pos.xy()-ins.k.xy()) - ins.k.z;
+      const auto g = cylgrad(pos.xy()-ins.k.xy());
+      return capgrad(g, d, ins.caps.x-pos.z, pos.z-ins.caps.y);
+    }
+    case C_CAPPEDCYLINDERXZ: {
+      const auto d = length(pos.xz()-ins.k.xy()) - ins.k.z;
+      const auto g = cylgrad(pos.xz()-ins.k.xy());
+      return toxz(capgrad(g, d, ins.caps.x-pos.y, pos.y-ins.caps.y));
+    }
+    case C_CAPPEDCYLINDERYZ: {
+      const auto d = length(pos.yz()-ins.k.xy()) - ins.k.z;
+      const auto g = cylgrad(pos.yz()-ins.k.xy());
+      return toyz(capgrad(g, d, ins.caps.x-pos.x, pos.x-ins.caps.y));
+    }
+    case C_SPHERE: {
+      const auto l = length(pos);
+      return l > 0.f ? pos/l : vec3f(zero);
+    }
+    case C_BOX: {
+      const auto pd = abs(pos)-ins.k.xyz();
+      const auto s = select(lt(pos,vec3f(zero)), vec3f(-1.f), vec3f(1.f));
+      const auto out = max(pd,vec3f(zero));
+      const auto l = length(out);
+      if (l > 0.f) return s*out/l;
+      if (pd.x >= pd.y && pd.x >= pd.z) return vec3f(s.x,0.f,0.f);
+      if (pd.y >= pd.z) return vec3f(0.f,s.y,0.f);
+      return vec3f(0.f,0.f,s.z);
+    }
+    default: assert("unreachable" && false); return vec3f(zero);
+  }
+}
+
+static void exec(const program &p, u32 pc, const array3f &RESTRICT pos,
+                 const arrayf *RESTRICT normaldist, arrayf &RESTRICT dist,
+                 arrayi &RESTRICT matindex, array3f *RESTRICT grad, int num,
+                 const aabb &RESTRICT box);
+
+INLINE void cleartemp(arrayf &RESTRICT dist, arrayi *RESTRICT matindex,
+                      array3f *RESTRICT grad, int num)
+{
+  loopi(num) dist[i] = FLT_MAX;
+  if (matindex) loopi(num) (*matindex)[i] = MAT_AIR_INDEX;
+  if (grad) loopi(num) set(*grad, vec3f(zero), i);
+}
+
+// the first child of a union writes directly in the output. the other ones
+// are merged one by one. primitives are directly merged without temporary
+static void unite(const program &p, u32 child, bool first,
+                  const array3f &RESTRICT pos, const arrayf *RESTRICT normaldist,
+                  arrayf &RESTRICT dist, arrayi &RESTRICT matindex,
+                  array3f *RESTRICT grad, int num, const aabb &RESTRICT box)
+{
+  const auto &c = p.code[child];
+  if (first)
+    exec(p, child, pos, normaldist, dist, matindex, grad, num, box);
+  else if (isprimitive(c.op)) {
+    loopi(num) {
+      const auto td = primitive(c, get(pos,i));
+      const auto tm = td < 0.f ? int(c.matindex) : int(MAT_AIR_INDEX);
+      const auto take = normaldist && abs(td) < (*normaldist)[i] ? true : td < dist[i];
+      matindex[i] = max(matindex[i], tm);
+      if (grad && take) set(*grad, gradient(c, get(pos,i)), i);
+      dist[i] = take ? td : dist[i];
+    }
+  } else {
+    arrayf tempdist;
+    arrayi tempmatindex;
+    array3f tempgrad;
+    const auto tgrad = grad ? &tempgrad : NULL;
+    cleartemp(tempdist, &tempmatindex, tgrad, num);
+    exec(p, child, pos, normaldist, tempdist, tempmatindex, tgrad, num, box);
+    loopi(num) {
+      const auto td = tempdist[i];
+      const auto take = normaldist && abs(td) < (*normaldist)[i] ? true : td < dist[i];
+      matindex[i] = max(matindex[i], tempmatindex[i]);
+      if (grad && take) set(*grad, get(tempgrad,i), i);
+      dist[i] = take ? td : dist[i];
+    }
+  }
+}
+
+static void exec(const program &p, u32 pc, const array3f &RESTRICT pos,
+                 const arrayf *RESTRICT normaldist, arrayf &RESTRICT dist,
+                 arrayi &RESTRICT matindex, array3f *RESTRICT grad, int num,
+                 const aabb &RESTRICT box)
 {
-  switch (n->type) {
+  const auto code = &p.code[0];
+  const auto &ins = code[pc];
+  switch (ins.op) {
     case C_UNION: {
-      const auto u = static_cast<const U*>(n);
-      const auto isecleft = intersection(u->left->box, box);
-      const auto isecright = intersection(u->right->box, box);
-      const auto goleft = all(le(isecleft.pmin, isecleft.pmax));
-      const auto goright = all(le(isecright.pmin, isecright.pmax));
-      if (goleft && goright) {
-        distr(u->left, pos, normaldist, dist, matindex, num, box);
-        arrayf tempdist;
-        arrayi tempmatindex;
-        loopi(num) {
-          tempdist[i] = FLT_MAX;
-          tempmatindex[i] = MAT_AIR_INDEX;
+      u32 hits[MAXHITNUM], hitnum;
+      if (ins.bvh != NOBVH && gather(p, pc, box, hits, hitnum))
+        loopi(hitnum)
+          unite(p, hits[i], i==0, pos, normaldist, dist, matindex, grad, num, box);
+      else {
+        auto first = true;
+        for (u32 k = 0, child = pc+1; k < ins.num; ++k, child = code[child].next) {
+          if (culled(code[child], box)) continue;
+          unite(p, child, first, pos, normaldist, dist, matindex, grad, num, box);
+          first = false;
         }
-        distr(u->right, pos, normaldist, tempdist, tempmatindex, num, box);
-        loopi(num) matindex[i] = max(matindex[i], tempmatindex[i]);
-        if (normaldist)
-          loopi(num)
-            dist[i] = abs(tempdist[i]) < (*normaldist)[i] ?
-              tempdist[i] :
-              min(dist[i], tempdist[i]);
-        else
-          loopi(num) dist[i] = min(dist[i], tempdist[i]);
-      } else if (goleft)
-        distr(u->left, pos, normaldist, dist, matindex, num, box);
-      else if (goright)
-        distr(u->right, pos, normaldist, dist, matindex, num, box);
+      }
     }
     break;
     case C_REPLACE: {
-      const auto r = static_cast<const R*>(n);
-      const auto isecleft = intersection(r->left->box, box);
-      const auto goleft = all(le(isecleft.pmin, isecleft.pmax));
-      if (!goleft) return;
-      distr(r->left, pos, normaldist, dist, matindex, num, box);
-      const auto isecright = intersection(r->right->box, box);
-      const auto goright = all(le(isecright.pmin, isecright.pmax));
-      if (!goright) return;
+      const auto left = pc+1, right = code[left].next;
+      if (culled(code[left], box)) return;
+      exec(p, left, pos, normaldist, dist, matindex, grad, num, box);
+      if (culled(code[right], box)) return;
       arrayf tempdist;
       arrayi tempmatindex;
-      loopi(num) {
-        tempdist[i] = FLT_MAX;
-        tempmatindex[i] = MAT_AIR_INDEX;
-      }
-      distr(r->right, pos, normaldist, tempdist, tempmatindex, num, box);
+      array3f tempgrad;
+      const auto tgrad = grad ? &tempgrad : NULL;
+      cleartemp(tempdist, &tempmatindex, tgrad, num);
+      exec(p, right, pos, normaldist, tempdist, tempmatindex, tgrad, num, box);
       loopi(num) {
         const auto insideright = tempdist[i] < 0.f && dist[i] < 0.f;
         matindex[i] = insideright ? tempmatindex[i] : matindex[i];
       }
       if (normaldist)
-        loopi(num)
-          dist[i] = dist[i] < 0.f && abs(tempdist[i]) < (*normaldist)[i] ?
-            tempdist[i] : dist[i];
+        loopi(num) {
+          const auto take = dist[i] < 0.f && abs(tempdist[i]) < (*normaldist)[i];
+          if (grad && take) set(*grad, get(tempgrad,i), i);
+          dist[i] = take ? tempdist[i] : dist[i];
+        }
     }
     break;
     case C_INTERSECTION: {
-      const auto in = static_cast<const I*>(n);
-      const auto isecleft = intersection(in->left->box, box);
-      if (!all(le(isecleft.pmin, isecleft.pmax))) break;
-      const auto isecright = intersection(in->right->box, box);
-      if (!all(le(isecright.pmin, isecright.pmax))) break;
-      distr(in->left, pos, normaldist, dist, matindex, num, box);
+      const auto left = pc+1, right = code[left].next;
+      if (culled(code[left], box)) break;
+      if (culled(code[right], box)) break;
+      exec(p, left, pos, normaldist, dist, matindex, grad, num, box);
       arrayf tempdist;
-      loopi(num) tempdist[i] = FLT_MAX;
-      distr(in->right, pos, normaldist, tempdist, matindex, num, box);
+      array3f tempgrad;
+      const auto tgrad = grad ? &tempgrad : NULL;
+      cleartemp(tempdist, NULL, tgrad, num);
+      exec(p, right, pos, normaldist, tempdist, matindex, tgrad, num, box);
       loopi(num) {
+        if (grad && tempdist[i] > dist[i]) set(*grad, get(tempgrad,i), i);
         dist[i] = max(dist[i], tempdist[i]);
         matindex[i] = dist[i] >= 0.f ? MAT_AIR_INDEX : matindex[i];
       }
     }
     break;
     case C_DIFFERENCE: {
-      const auto d = static_cast<const D*>(n);
-      const auto isecleft = intersection(d->left->box, box);
-      if (!all(le(isecleft.pmin, isecleft.pmax))) break;
-      distr(d->left, pos, normaldist, dist, matindex, num, box);
-
-      const auto isecright = intersection(d->right->box, box);
-      if (!all(le(isecright.pmin, isecright.pmax))) break;
+      const auto left = pc+1, right = code[left].next;
+      if (culled(code[left], box)) break;
+      exec(p, left, pos, normaldist, dist, matindex, grad, num, box);
+      if (culled(code[right], box)) break;
       arrayf tempdist;
       arrayi tempmatindex;
-      loopi(num) tempdist[i] = FLT_MAX;
-      distr(d->right, pos, normaldist, tempdist, tempmatindex, num, box);
+      array3f tempgrad;
+      const auto tgrad = grad ? &tempgrad : NULL;
+      cleartemp(tempdist, NULL, tgrad, num);
+      exec(p, right, pos, normaldist, tempdist, tempmatindex, tgrad, num, box);
       loopi(num) {
+        if (grad && -tempdist[i] > dist[i]) set(*grad, -get(tempgrad,i), i);
         dist[i] = max(dist[i], -tempdist[i]);
         matindex[i] = dist[i] >= 0.f ? MAT_AIR_INDEX : matindex[i];
       }
     }
     break;
     case C_TRANSLATION: {
-      const auto isec = intersection(n->box, box);
-      if (any(gt(isec.pmin, isec.pmax))) break;
-      const auto t = static_cast<const translation*>(n);
+      if (culled(ins, box)) break;
+      const auto t = ins.k.xyz();
       array3f tpos;
-      loopi(num) set(tpos, get(pos,i) - t->p, i);
-      const aabb tbox(box.pmin-t->p, box.pmax-t->p);
-      distr(t->n, tpos, normaldist, dist, matindex, num, tbox);
+      loopi(num) set(tpos, get(pos,i) - t, i);
+      const aabb tbox(box.pmin-t, box.pmax-t);
+      exec(p, pc+1, tpos, normaldist, dist, matindex, grad, num, tbox);
     }
     break;
     case C_ROTATION: {
-      const auto isec = intersection(n->box, box);
-      if (any(gt(isec.pmin, isec.pmax))) break;
-      const auto r = static_cast<const rotation*>(n);
+      if (culled(ins, box)) break;
+      const auto q = getquat(ins);
       array3f tpos;
-      loopi(num) set(tpos, xfmpoint(conj(r->q), get(pos,i)), i);
-      distr(r->n, tpos, normaldist, dist, matindex, num, aabb::all());
+      loopi(num) set(tpos, xfmpoint(q, get(pos,i)), i);
+
+      // gradients go to the local frame and back since the children may
+      // leave some of them untouched
+      if (grad) loopi(num) set(*grad, xfmvector(q, get(*grad,i)), i);
+      exec(p, pc+1, tpos, normaldist, dist, matindex, grad, num, xfmbox(q, box));
+      if (grad) {
+        const auto iq = conj(q);
+        loopi(num) set(*grad, xfmvector(iq, get(*grad,i)), i);
+      }
     }
     break;
-    case C_PLANE: {
-      const auto isec = intersection(n->box, box);
-      if (any(gt(isec.pmin, isec.pmax))) break;
-      const auto p = static_cast<const plane*>(n);
+    case C_DISPLACEMENT: {
+      if (culled(ins, box)) break;
+      exec(p, pc+1, pos, normaldist, dist, matindex, grad, num, displacedbox(ins, box));
+      const auto amplitude = ins.k.x, frequency = ins.k.y;
       loopi(num) {
-        dist[i] = dot(get(pos,i), p->p.xyz()) + p->p.w;
-        matindex[i] = dist[i] < 0.f ? p->matindex : matindex[i];
+        vec3f g;
+        const auto n = valuenoise(frequency*get(pos,i), grad ? &g : NULL);
+        const auto d = dist[i] + amplitude*n;
+        const auto m = dist[i] < 0.f ? matindex[i] : int(ins.matindex);
+        matindex[i] = d < 0.f ? m : int(MAT_AIR_INDEX);
+        dist[i] = d;
+        if (grad) set(*grad, get(*grad,i) + (amplitude*frequency)*g, i);
       }
     }
     break;
-
-#define CYL(NAME, COORD)\
-  case C_CYLINDER##NAME: {\
-    const auto isec = intersection(n->box, box);\
-    if (any(gt(isec.pmin, isec.pmax))) break;\
-    const auto c = static_cast<const cylinder##COORD*>(n);\
-    loopi(num) {\
-      dist[i] = length(get(pos,i).COORD()-c->c##COORD) - c->r;\
-      matindex[i] = dist[i] < 0.f ? c->matindex : matindex[i];\
-    }\
-  }\
-  break;
-  CYL(XY,xy); CYL(XZ,xz); CYL(YZ,yz);
-#undef CYL
-
-    case C_SPHERE: {
-      const auto isec = intersection(n->box, box);
-      if (any(gt(isec.pmin, isec.pmax))) break;
-      const auto s = static_cast<const sphere*>(n);
+    case C_PLANE: case C_SPHERE: case C_BOX:
+    case C_CYLINDERXY: case C_CYLINDERXZ: case C_CYLINDERYZ:
+      if (culled(ins, box)) break;
       loopi(num) {
-        dist[i] = length(get(pos,i)) - s->r;
-        matindex[i] = dist[i] < 0.f ? s->matindex : matindex[i];
+        dist[i] = primitive(ins, get(pos,i));
+        matindex[i] = dist[i] < 0.f ? ins.matindex : matindex[i];
       }
-    }
+      if (grad) loopi(num) set(*grad, gradient(ins, get(pos,i)), i);
     break;
-    case C_BOX: {
-      const auto isec = intersection(n->box, box);
-      if (any(gt(isec.pmin, isec.pmax))) break;
-      const auto b = static_cast<const struct box*>(n);
-      const auto extent = b->extent;
+    case C_CAPPEDCYLINDERXY: case C_CAPPEDCYLINDERXZ: case C_CAPPEDCYLINDERYZ:
+      // as the differences it replaces, it is air outside
+      if (culled(ins, box)) break;
       loopi(num) {
-        const auto pd = abs(get(pos,i))-extent;
-        dist[i] = min(max(pd.x,max(pd.y,pd.z)),0.0f) + length(max(pd,vec3f(zero)));
-        matindex[i] = dist[i] < 0.f ? b->matindex : matindex[i];
+        dist[i] = primitive(ins, get(pos,i));
+        matindex[i] = dist[i] < 0.f ? ins.matindex : MAT_AIR_INDEX;
       }
-    }
+      if (grad) loopi(num) set(*grad, gradient(ins, get(pos,i)), i);
     break;
     case C_EMPTY: break;
     case C_INVALID: assert("unreachable" && false);
   }
 }
 
-void dist(const node *RESTRICT n, const array3f &RESTRICT pos,
+void dist(const program *RESTRICT p, const array3f &RESTRICT pos,
           const arrayf *RESTRICT normaldist, arrayf &RESTRICT d,
-          arrayi &RESTRICT mat, int num, const aabb &RESTRICT box)
+          arrayi &RESTRICT mat, int num, const aabb &RESTRICT box,
+          array3f *RESTRICT grad)
 {
-  loopi(num) d[i] = FLT_MAX;
-  loopi(num) mat[i] = MAT_AIR_INDEX;
-  distr(n, pos, normaldist, d, mat, num, box);
+  cleartemp(d, &mat, grad, num);
+  exec(*p, 0, pos, normaldist, d, mat, grad, num, box);
 }
 
-float dist(const node *n, const vec3f &pos, const aabb &box) {
-  const auto isec = intersection(box, n->box);
-  if (any(gt(isec.pmin, isec.pmax))) return FLT_MAX;
-  switch (n->type) {
+static float exec(const program &p, u32 pc, const vec3f &pos, const aabb &box) {
+  const auto code = &p.code[0];
+  const auto &ins = code[pc];
+  if (culled(ins, box)) return FLT_MAX;
+  switch (ins.op) {
     case C_UNION: {
-      const auto u = static_cast<const U*>(n);
-      const auto left = dist(u->left, pos, box);
-      const auto right = dist(u->right, pos, box);
-      return min(left,right);
+      auto d = FLT_MAX;
+      u32 hits[MAXHITNUM], hitnum;
+      if (ins.bvh != NOBVH && gather(p, pc, box, hits, hitnum))
+        loopi(hitnum) d = min(d, exec(p, hits[i], pos, box));
+      else for (u32 k = 0, child = pc+1; k < ins.num; ++k, child = code[child].next)
+        d = min(d, exec(p, child, pos, box));
+      return d;
     }
     case C_INTERSECTION: {
-      const auto i = static_cast<const I*>(n);
-      const auto left = dist(i->left, pos, box);
-      const auto right = dist(i->right, pos, box);
+      const auto left = exec(p, pc+1, pos, box);
+      const auto right = exec(p, code[pc+1].next, pos, box);
       return max(left,right);
     }
     case C_DIFFERENCE: {
-      const auto d = static_cast<const D*>(n);
-      const auto left = dist(d->left, pos, box);
-      const auto right = dist(d->right, pos, box);
+      const auto left = exec(p, pc+1, pos, box);
+      const auto right = exec(p, code[pc+1].next, pos, box);
       return max(left,-right);
     }
-    case C_REPLACE: {
-      const auto r = static_cast<const R*>(n);
-      return dist(r->left, pos, box);
-    }
+    case C_REPLACE: return exec(p, pc+1, pos, box);
     case C_TRANSLATION: {
-      const auto t = static_cast<const translation*>(n);
-      return dist(t->n, pos-t->p, aabb(box.pmin-t->p, box.pmax-t->p));
+      const auto t = ins.k.xyz();
+      return exec(p, pc+1, pos-t, aabb(box.pmin-t, box.pmax-t));
     }
     case C_ROTATION: {
-      const auto r = static_cast<const rotation*>(n);
-      return dist(r->n, xfmpoint(conj(r->q), pos), aabb::all());
+      const auto q = getquat(ins);
+      return exec(p, pc+1, xfmpoint(q, pos), xfmbox(q, box));
     }
+    case C_DISPLACEMENT:
+      return exec(p, pc+1, pos, displacedbox(ins, box)) + ins.k.x*valuenoise(ins.k.y*pos);
+    case C_PLANE: case C_SPHERE: case C_BOX:
+    case C_CYLINDERXY: case C_CYLINDERXZ: case C_CYLINDERYZ:
+    case C_CAPPEDCYLINDERXY: case C_CAPPEDCYLINDERXZ: case C_CAPPEDCYLINDERYZ:
+      return primitive(ins, pos);
+    case C_EMPTY: return FLT_MAX;
+    default: assert("unreachable" && false); return FLT_MAX;
+  }
+}
+
+float dist(const program *p, const vec3f &pos, const aabb &box) {
+  return exec(*p, 0, pos, box);
+}
+
+/*-------------------------------------------------------------------------
+ - interval evaluation. x is the lower bound and y the upper bound
+ -------------------------------------------------------------------------*/
+static INLINE vec2f interval(float lo, float hi) { return vec2f(lo, hi); }
+
+// bounds of the distance to the origin over the box
+static INLINE vec2f lengthinterval(const vec3f &pmin, const vec3f &pmax) {
+  const auto nearest = clamp(vec3f(zero), pmin, pmax);
+  const auto farthest = max(abs(pmin), abs(pmax));
+  return interval(length(nearest), length(farthest));
+}
+static INLINE vec2f lengthinterval(const vec2f &pmin, const vec2f &pmax) {
+  const auto nearest = clamp(vec2f(zero), pmin, pmax);
+  const auto farthest = max(abs(pmin), abs(pmax));
+  return interval(length(nearest), length(farthest));
+}
+
+// distance of capped cylinders whose axis coordinate lies in [amin,amax]
+static INLINE vec2f capinterval(const instruction &ins, const vec2f &d,
+                                float amin, float amax)
+{
+  const auto lo = max(max(d.x, ins.caps.x-amax), amin-ins.caps.y);
+  const auto hi = max(max(d.y, ins.caps.x-amin), amax-ins.caps.y);
+  return interval(lo, hi);
+}
+
+static vec2f primitiveinterval(const instruction &ins, const aabb &box) {
+  const auto &pmin = box.pmin, &pmax = box.pmax;
+  const auto c = ins.k.xy();
+  const auto r = vec2f(ins.k.z);
+  switch (ins.op) {
     case C_PLANE: {
-      const auto p = static_cast<const plane*>(n);
-      return dot(pos, p->p.xyz()) + p->p.w;
-    }
-    case C_CYLINDERXZ: {
-      const auto c = static_cast<const cylinderxz*>(n);
-      return length(pos.xz()-c->cxz) - c->r;
+      const auto n = ins.k.xyz();
+      const auto a = n*pmin, b = n*pmax;
+      return interval(reduceadd(min(a,b)), reduceadd(max(a,b))) + vec2f(ins.k.w);
     }
-    case C_CYLINDERXY: {
-      const auto c = static_cast<const cylinderxy*>(n);
-      return length(pos.xy()-c->cxy) - c->r;
+    case C_CYLINDERXY: return lengthinterval(pmin.xy()-c, pmax.xy()-c) - r;
+    case C_CYLINDERXZ: return lengthinterval(pmin.xz()-c, pmax.xz()-c) - r;
+    case C_CYLINDERYZ: return lengthinterval(pmin.yz()-c, pmax.yz()-c) - r;
+    case C_CAPPEDCYLINDERXY: {
+      const auto d = lengthinterval(pmin.xy()-c, pmax.xy()-c) - r;
+      return capinterval(ins, d, pmin.z, pmax.z);
     }
-    case C_CYLINDERYZ: {
-      const auto c = static_cast<const cylinderyz*>(n);
-      return length(pos.yz()-c->cyz) - c->r;
+    case C_CAPPEDCYLINDERXZ: {
+      const auto d = lengthinterval(pmin.xz()-c, pmax.xz()-c) - r;
+      return capinterval(ins, d, pmin.y, pmax.y);
     }
-    case C_SPHERE: {
-      const auto s = static_cast<const sphere*>(n);
-      return length(pos) - s->r;
+    case C_CAPPEDCYLINDERYZ: {
+      const auto d = lengthinterval(pmin.yz()-c, pmax.yz()-c) - r;
+      return capinterval(ins, d, pmin.x, pmax.x);
     }
+    case C_SPHERE: return lengthinterval(pmin, pmax) - vec2f(ins.k.x);
     case C_BOX: {
-      const auto &d = abs(pos)-static_cast<const struct box*>(n)->extent;
-      const auto dist = min(max(d.x,max(d.y,d.z)),0.0f)+length(max(d,vec3f(zero)));
-      return dist;
+      // the box distance grows with the absolute value of each coordinate
+      const auto straddle = le(pmin,vec3f(zero)) & ge(pmax,vec3f(zero));
+      const auto amin = select(straddle, vec3f(zero), min(abs(pmin),abs(pmax)));
+      const auto amax = max(abs(pmin),abs(pmax));
+      const auto lo = amin-ins.k.xyz(), hi = amax-ins.k.xyz();
+      const auto dlo = min(max(lo.x,max(lo.y,lo.z)),0.0f) + length(max(lo,vec3f(zero)));
+      const auto dhi = min(max(hi.x,max(hi.y,hi.z)),0.0f) + length(max(hi,vec3f(zero)));
+      return interval(dlo, dhi);
     }
-    case C_EMPTY: return FLT_MAX;
-    default: assert("unreachable" && false); return FLT_MAX;
+    default: assert("unreachable" && false); return vec2f(FLT_MAX);
   }
 }
+
+static vec2f exec(const program &p, u32 pc, const aabb &box) {
+  const auto code = &p.code[0];
+  const auto &ins = code[pc];
+  if (culled(ins, box)) return vec2f(FLT_MAX);
+  switch (ins.op) {
+    case C_UNION: {
+      auto d = vec2f(FLT_MAX);
+      u32 hits[MAXHITNUM], hitnum;
+      if (ins.bvh != NOBVH && gather(p, pc, box, hits, hitnum))
+        loopi(hitnum) d = min(d, exec(p, hits[i], box));
+      else for (u32 k = 0, child = pc+1; k < ins.num; ++k, child = code[child].next)
+        d = min(d, exec(p, child, box));
+      return d;
+    }
+    case C_INTERSECTION: {
+      const auto left = exec(p, pc+1, box);
+      const auto right = exec(p, code[pc+1].next, box);
+      return max(left,right);
+    }
+    case C_DIFFERENCE: {
+      const auto left = exec(p, pc+1, box);
+      const auto right = exec(p, code[pc+1].next, box);
+      return max(left,-right.yx());
+    }
+    case C_REPLACE: return exec(p, pc+1, box);
+    case C_TRANSLATION: {
+      const auto t = ins.k.xyz();
+      return exec(p, pc+1, aabb(box.pmin-t, box.pmax-t));
+    }
+    case C_ROTATION: return exec(p, pc+1, xfmbox(getquat(ins), box));
+    case C_DISPLACEMENT:
+      return exec(p, pc+1, displacedbox(ins, box)) + vec2f(-1.f,1.f)*abs(ins.k.x);
+    case C_PLANE: case C_SPHERE: case C_BOX:
+    case C_CYLINDERXY: case C_CYLINDERXZ: case C_CYLINDERYZ:
+    case C_CAPPEDCYLINDERXY: case C_CAPPEDCYLINDERXZ: case C_CAPPEDCYLINDERYZ:
+      return primitiveinterval(ins, box);
+    case C_EMPTY: return vec2f(FLT_MAX);
+    default: assert("unreachable" && false); return vec2f(FLT_MAX);
+  }
+}
+
+vec2f distinterval(const program *p, const aabb &box) {
+  return exec(*p, 0, box);
+}
 } /* namespace csg */
 } /* namespace q */
-
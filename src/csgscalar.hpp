@@ -8,7 +8,10 @@
 namespace q {
 namespace csg {
 // single point csg evaluation
-float dist(const node*, const vec3f&, const aabb &box = aabb::all());
+float dist(const program*, const vec3f&, const aabb &box = aabb::all());
+
+// conservative [min,max] bounds of the distance over the whole box
+vec2f distinterval(const program*, const aabb &box);
 
 INLINE void set(array3f &v, vec3f u, u32 idx) {
   v[0][idx]=u.x; v[1][idx]=u.y; v[2][idx]=u.z;
@@ -11,9 +11,10 @@ namespace csg {
 namespace NAMESPACE {
 struct ssebox {
   ssebox(const ssef &pmin, const ssef &pmax) : pmin(pmin), pmax(pmax) {}
+  // pmax ends the aabb: only its three floats are read
   ssebox(const aabb &box) {
     pmin = ssef::loadu(&box.pmin);
-    pmax = ssef::loadu(&box.pmax);
+    pmax = ssef(box.pmax.x, box.pmax.y, box.pmax.z, 0.f);
   }
   ssef pmin,pmax;
 };
@@ -25,252 +26,477 @@ INLINE bool empty(const ssebox &box) {
   return (movemask(box.pmin>box.pmax)&0x7) != 0;
 }
 
-static void distr(const node *RESTRICT n, const array3f &RESTRICT pos,
-                  const arrayf *RESTRICT normaldist, arrayf &RESTRICT dist,
-                  arrayi &RESTRICT matindex, int packetnum,
-                  const ssebox & RESTRICT box)
-{
-  switch (n->type) {
-    case C_UNION: {
-      const auto u = static_cast<const U*>(n);
-      const auto isecleft = intersection(ssebox(u->left->box), box);
-      const auto isecright = intersection(ssebox(u->right->box), box);
-      const auto goleft = !empty(isecleft);
-      const auto goright = !empty(isecright);
-      if (goleft && goright) {
-        distr(u->left, pos, normaldist, dist, matindex, packetnum, box);
-        CACHE_LINE_ALIGNED arrayf tempdist;
-        CACHE_LINE_ALIGNED arrayi tempmatindex;
-        loopi(packetnum) {
-          const auto idx = i*soaf::size;
-          store(&tempdist[idx], soaf(FLT_MAX));
-          store(&tempmatindex[idx], soai(MAT_AIR_INDEX));
-        }
-        distr(u->right, pos, normaldist, tempdist, tempmatindex, packetnum, box);
-        loopi(packetnum) {
-          const auto idx = i*soaf::size;
-          const auto old = soai::load(&matindex[idx]);
-          const auto tmp = soai::load(&tempmatindex[idx]);
-          const auto newindex = select(old > tmp, old, tmp);
-          store(&matindex[idx], newindex);
-        }
-        if (normaldist) loopi(packetnum) {
-          const auto idx = i*soaf::size;
-          const auto d = soaf::load(&dist[idx]);
-          const auto td = soaf::load(&tempdist[idx]);
-          const auto nd = soaf::load(&(*normaldist)[idx]);
-          const auto mtd = min(d, td);
-          const auto sd = select(abs(td)<nd, td, mtd);
-          store(&dist[idx], sd);
-        } else loopi(packetnum) {
-          const auto idx = i*soaf::size;
-          const auto d = soaf::load(&dist[idx]);
-          const auto td = soaf::load(&tempdist[idx]);
-          store(&dist[idx], min(d,td));
-        }
-      } else if (goleft)
-        distr(u->left, pos, normaldist, dist, matindex, packetnum, box);
-      else if (goright)
-        distr(u->right, pos, normaldist, dist, matindex, packetnum, box);
+INLINE bool culled(const instruction &ins, const ssebox &box) {
+  return empty(intersection(ssebox(ins.box), box));
+}
+
+static INLINE soaf primitive(const instruction &ins, const soa3f &pos) {
+  switch (ins.op) {
+    case C_PLANE: return dot(pos, soa3f(ins.k.xyz())) + soaf(ins.k.w);
+    case C_CYLINDERXY: return length(pos.xy()-soa2f(ins.k.xy())) - soaf(ins.k.z);
+    case C_CYLINDERXZ: return length(pos.xz()-soa2f(ins.k.xy())) - soaf(ins.k.z);
+    case C_CYLINDERYZ: return length(pos.yz()-soa2f(ins.k.xy())) - soaf(ins.k.z);
+    case C_CAPPEDCYLINDERXY: {
+      const auto d = length(pos.xy()-soa2f(ins.k.xy())) - soaf(ins.k.z);
+      return max(max(d, soaf(ins.caps.x)-pos.z), pos.z-soaf(ins.caps.y));
     }
-    break;
-    case C_REPLACE: {
-      const auto r = static_cast<const R*>(n);
-      const auto isecleft = intersection(ssebox(r->left->box), box);
-      const auto goleft = !empty(isecleft);
-      if (!goleft) return;
-      distr(r->left, pos, normaldist, dist, matindex, packetnum, box);
-      const auto isecright = intersection(ssebox(r->right->box), box);
-      const auto goright = !empty(isecright);
-      if (!goright) return;
-      CACHE_LINE_ALIGNED arrayf tempdist;
-      CACHE_LINE_ALIGNED arrayi tempmatindex;
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        store(&tempdist[idx], soaf(FLT_MAX));
-        store(&tempmatindex[idx], soai(MAT_AIR_INDEX));
-      }
-      distr(r->right, pos, normaldist, tempdist, tempmatindex, packetnum, box);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto d = soaf::load(&dist[idx]);
-        const auto td = soaf::load(&tempdist[idx]);
-        const auto insideright = (td<soaf(zero)) & (d<soaf(zero));
-        const auto tmpindex = soai::load(&tempmatindex[idx]);
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto newindex = select(insideright, tmpindex, oldindex);
-        store(&matindex[idx], newindex);
-      }
-      if (normaldist) loopi(packetnum) {
-          const auto idx = i*soaf::size;
-          const auto d = soaf::load(&dist[idx]);
-          const auto td = soaf::load(&tempdist[idx]);
-          const auto nd = soaf::load(&(*normaldist)[idx]);
-          const auto sd = select((d<soaf(zero)) & (abs(td)<nd), td, d);
-          store(&dist[idx], sd);
-      }
+    case C_CAPPEDCYLINDERXZ: {
+      const auto d = length(pos.xz()-soa2f(ins.k.xy())) - soaf(ins.k.z);
+      return max(max(d, soaf(ins.caps.x)-pos.y), pos.y-soaf(ins.caps.y));
     }
-    break;
-    case C_INTERSECTION: {
-      const auto in = static_cast<const I*>(n);
-      const auto isecleft = intersection(ssebox(in->left->box), box);
-      if (empty(isecleft)) return;
-      const auto isecright = intersection(ssebox(in->right->box), box);
-      if (empty(isecright)) return;
-      distr(in->left, pos, normaldist, dist, matindex, packetnum, box);
-      CACHE_LINE_ALIGNED arrayf tempdist;
-      loopi(packetnum) store(&tempdist[i*soaf::size], soaf(FLT_MAX));
-      distr(in->right, pos, normaldist, tempdist, matindex, packetnum, box);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto d = soaf::load(&dist[idx]);
-        const auto td = soaf::load(&tempdist[idx]);
-        const auto md = max(d,td);
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto airindex = soai(MAT_AIR_INDEX);
-        const auto newindex = select(md>=soaf(zero), airindex, oldindex);
-        store(&dist[idx], md);
-        store(&matindex[idx], newindex);
-      }
+    case C_CAPPEDCYLINDERYZ: {
+      const auto d = length(pos.yz()-soa2f(ins.k.xy())) - soaf(ins.k.z);
+      return max(max(d, soaf(ins.caps.x)-pos.x), pos.x-soaf(ins.caps.y));
     }
-    break;
-    case C_DIFFERENCE: {
-      const auto d = static_cast<const D*>(n);
-      const auto isecleft = intersection(ssebox(d->left->box), box);
-      if (empty(isecleft)) break;
-      distr(d->left, pos, normaldist, dist, matindex, packetnum, box);
+    case C_SPHERE: return length(pos) - soaf(ins.k.x);
+    case C_BOX: {
+      const auto pd = abs(pos)-soa3f(ins.k.xyz());
+      return min(max(pd.x,max(pd.y,pd.z)),soaf(zero)) + length(max(pd,soa3f(zero)));
+    }
+    default: assert("unreachable" && false); return soaf(FLT_MAX);
+  }
+}
 
-      const auto isecright = intersection(ssebox(d->right->box), box);
-      if (empty(isecright)) break;
-      CACHE_LINE_ALIGNED arrayf tempdist;
-      CACHE_LINE_ALIGNED arrayi tempmatindex;
-      loopi(packetnum) store(&tempdist[i*soaf::size], soaf(FLT_MAX));
-      distr(d->right, pos, normaldist, tempdist, tempmatindex, packetnum, box);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto d = soaf::load(&dist[idx]);
-        const auto td = soaf::load(&tempdist[idx]);
-        const auto md = max(d,-td);
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto airindex = soai(MAT_AIR_INDEX);
-        const auto newindex = select(md>=soaf(zero), airindex, oldindex);
-        store(&dist[idx], md);
-        store(&matindex[idx], newindex);
-      }
+INLINE soa3f select(const soab &m, const soa3f &t, const soa3f &f) {
+  return soa3f(select(m,t.x,f.x), select(m,t.y,f.y), select(m,t.z,f.z));
+}
+
+// analytic gradient of the primitive distance. degenerated points where the
+// gradient is undefined get a null vector
+static INLINE soa3f cylgrad(const soa2f &v) {
+  const auto l = length(v);
+  const auto rl = select(l>soaf(zero), soaf(1.f)/l, soaf(zero));
+  return soa3f(v.x*rl, v.y*rl, soaf(zero));
+}
+static INLINE soa3f toxz(const soa3f &g) { return soa3f(g.x,g.z,g.y); }
+static INLINE soa3f toyz(const soa3f &g) { return soa3f(g.z,g.x,g.y); }
+static INLINE soa3f capgrad(const soa3f &g, const soaf &d,
+                            const soaf &lo, const soaf &hi)
+{
+  const auto cap = soa3f(soaf(zero), soaf(zero), select(lo>=hi, soaf(-1.f), soaf(1.f)));
+  return select((d>=lo) & (d>=hi), g, cap);
+}
+static INLINE soa3f gradient(const instruction &ins, const soa3f &pos) {
+  switch (ins.op) {
+    case C_PLANE: return soa3f(ins.k.xyz());
+    case C_CYLINDERXY: return cylgrad(pos.xy()-soa2f(ins.k.xy()));
+    case C_CYLINDERXZ: return toxz(cylgrad(pos.xz()-soa2f(ins.k.xy())));
+    case C_CYLINDERYZ: return toyz(cylgrad(pos.yz()-soa2f(ins.k.xy())));
+    case C_CAPPEDCYLINDERXY: {
+      const auto v = pos.xy()-soa2f(ins.k.xy());
+      const auto d = length(v) - soaf(ins.k.z);
+      return capgrad(cylgrad(v), d, soaf(ins.caps.x)-pos.z, pos.z-soaf(ins.caps.y));
     }
-    break;
-    case C_TRANSLATION: {
-      const auto isec = intersection(ssebox(n->box), box);
-      if (empty(isec)) break;
-      const auto t = static_cast<const translation*>(n);
-      const auto tp = soa3f(t->p);
-      CACHE_LINE_ALIGNED array3f tpos;
-      loopi(packetnum) sset(tpos, sget(pos,i) - tp, i);
-      const auto ssep = ssef::loadu(&t->p);
-      const ssebox tbox(box.pmin-ssep, box.pmax-ssep);
-      distr(t->n, tpos, normaldist, dist, matindex, packetnum, tbox);
+    case C_CAPPEDCYLINDERXZ: {
+      const auto v = pos.xz()-soa2f(ins.k.xy());
+      const auto d = length(v) - soaf(ins.k.z);
+      return toxz(capgrad(cylgrad(v), d, soaf(ins.caps.x)-pos.y, pos.y-soaf(ins.caps.y)));
     }
-    break;
-    case C_ROTATION: {
-      const auto isec = intersection(ssebox(n->box), box);
-      if (empty(isec)) break;
-      const auto r = static_cast<const rotation*>(n);
-      const auto rq = quat<soaf>(conj(r->q));
-      CACHE_LINE_ALIGNED array3f tpos;
-      loopi(packetnum) sset(tpos, xfmpoint(rq, sget(pos,i)), i);
-      distr(r->n, tpos, normaldist, dist, matindex, packetnum, aabb::all());
+    case C_CAPPEDCYLINDERYZ: {
+      const auto v = pos.yz()-soa2f(ins.k.xy());
+      const auto d = length(v) - soaf(ins.k.z);
+      return toyz(capgrad(cylgrad(v), d, soaf(ins.caps.x)-pos.x, pos.x-soaf(ins.caps.y)));
     }
-    break;
-    case C_PLANE: {
-      const auto isec = intersection(ssebox(n->box), box);
-      if (empty(isec)) break;
-      const auto p = static_cast<const plane*>(n);
-      const auto pp = soa3f(p->p.xyz());
-      const auto d = soaf(p->p.w);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto nd = dot(sget(pos,i), pp) + d;
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto newindex = soai(p->matindex);
-        const auto m = nd<soaf(zero);
-        store(&dist[idx], nd);
-        store(&matindex[idx], select(m, newindex, oldindex));
-      }
+    case C_SPHERE: {
+      const auto l = length(pos);
+      const auto rl = select(l>soaf(zero), soaf(1.f)/l, soaf(zero));
+      return pos*rl;
     }
-    break;
+    case C_BOX: {
+      const auto z = soaf(zero);
+      const auto pd = abs(pos)-soa3f(ins.k.xyz());
+      const auto s = soa3f(select(pos.x<z, soaf(-1.f), soaf(1.f)),
+                           select(pos.y<z, soaf(-1.f), soaf(1.f)),
+                           select(pos.z<z, soaf(-1.f), soaf(1.f)));
+      const auto out = max(pd,soa3f(zero));
+      const auto l = length(out);
+      const auto rl = select(l>z, soaf(1.f)/l, z);
+      const auto ix = (pd.x>=pd.y) & (pd.x>=pd.z);
+      const auto iy = andnot(ix, pd.y>=pd.z);
+      const auto iz = !(ix|iy);
+      const auto in = soa3f(select(ix,s.x,z), select(iy,s.y,z), select(iz,s.z,z));
+      return select(l>z, s*out*rl, in);
+    }
+    default: assert("unreachable" && false); return soa3f(zero);
+  }
+}
 
-#define CYL(NAME, COORD)\
-  case C_CYLINDER##NAME: {\
-    const auto isec = intersection(ssebox(n->box), box);\
-    if (empty(isec)) break;\
-    const auto c = static_cast<const cylinder##COORD*>(n);\
-    const auto cc = soa2f(c->c##COORD);\
-    const auto r = soaf(c->r);\
-    loopi(packetnum) {\
-      const auto idx = i*soaf::size;\
-      const auto p = sget(pos,i).COORD();\
-      const auto nd = length(p - cc) - r;\
-      const auto oldindex = soai::load(&matindex[idx]);\
-      const auto newindex = soai(c->matindex);\
-      const auto m = nd<soaf(zero);\
-      store(&dist[idx], nd);\
-      store(&matindex[idx], select(m, newindex, oldindex));\
-    }\
-  }\
-  break;
-  CYL(XY,xy); CYL(XZ,xz); CYL(YZ,yz);
-#undef CYL
+// merge the distances, materials and gradients of a union child
+INLINE void merge(arrayf &RESTRICT dist, arrayi &RESTRICT matindex,
+                  const arrayf *RESTRICT normaldist, array3f *RESTRICT grad,
+                  u32 packet, const soaf &td, const soai &tm, const soa3f &tg)
+{
+  const auto idx = packet*soaf::size;
+  const auto old = soai::load(&matindex[idx]);
+  store(&matindex[idx], select(old > tm, old, tm));
+  const auto d = soaf::load(&dist[idx]);
+  auto take = td<d;
+  if (normaldist) {
+    const auto nd = soaf::load(&(*normaldist)[idx]);
+    take |= abs(td)<nd;
+  }
+  store(&dist[idx], select(take, td, d));
+  if (grad) sset(*grad, select(take, tg, sget(*grad,packet)), packet);
+}
 
-    case C_SPHERE: {
-      const auto isec = intersection(ssebox(n->box), box);
-      if (empty(isec)) break;
-      const auto s = static_cast<const sphere*>(n);
-      const auto r = soaf(s->r);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto newindex = soai(s->matindex);
-        const auto nd = length(sget(pos,i)) - r;
-        const auto m = nd<soaf(zero);
-        store(&dist[idx], nd);
-        store(&matindex[idx], select(m, newindex, oldindex));
+INLINE aabb toaabb(const ssebox &box) {
+  vec4f pmin, pmax;
+  storeu4f(&pmin, box.pmin);
+  storeu4f(&pmax, box.pmax);
+  return aabb(pmin.xyz(), pmax.xyz());
+}
+
+INLINE void cleartemp(arrayf &RESTRICT dist, arrayi *RESTRICT matindex,
+                      array3f *RESTRICT grad, int packetnum)
+{
+  loopi(packetnum) {
+    store(&dist[i*soaf::size], soaf(FLT_MAX));
+    if (matindex) store(&(*matindex)[i*soaf::size], soai(MAT_AIR_INDEX));
+    if (grad) sset(*grad, soa3f(zero), i);
+  }
+}
+
+/*-------------------------------------------------------------------------
+ - the operations. children are run by functors called with the arguments
+ - of exec. the interpreter runs them from the program while baked scenes
+ - directly call the code generated for them
+ -------------------------------------------------------------------------*/
+#define CSGPARAMS const array3f &RESTRICT pos, const arrayf *RESTRICT normaldist,\
+                  arrayf &RESTRICT dist, arrayi &RESTRICT matindex,\
+                  array3f *RESTRICT grad, int packetnum, const ssebox &RESTRICT box
+#define CSGARGS pos, normaldist, dist, matindex, grad, packetnum, box
+
+// the first child of a union writes directly in the output. the other ones
+// are merged one by one. primitives are directly merged in registers
+template <typename C>
+INLINE void unite(const instruction &c, const C &child, bool first, CSGPARAMS) {
+  if (first)
+    child(CSGARGS);
+  else if (isprimitive(c.op)) {
+    const auto m = soai(c.matindex);
+    const auto air = soai(MAT_AIR_INDEX);
+    loopi(packetnum) {
+      const auto pt = sget(pos,i);
+      const auto td = primitive(c, pt);
+      const auto tg = grad ? gradient(c, pt) : soa3f(zero);
+      merge(dist, matindex, normaldist, grad, i, td, select(td<soaf(zero), m, air), tg);
+    }
+  } else {
+    CACHE_LINE_ALIGNED arrayf tempdist;
+    CACHE_LINE_ALIGNED arrayi tempmatindex;
+    CACHE_LINE_ALIGNED array3f tempgrad;
+    const auto tgrad = grad ? &tempgrad : NULL;
+    cleartemp(tempdist, &tempmatindex, tgrad, packetnum);
+    child(pos, normaldist, tempdist, tempmatindex, tgrad, packetnum, box);
+    loopi(packetnum) {
+      const auto idx = i*soaf::size;
+      const auto td = soaf::load(&tempdist[idx]);
+      const auto tm = soai::load(&tempmatindex[idx]);
+      const auto tg = grad ? sget(tempgrad,i) : soa3f(zero);
+      merge(dist, matindex, normaldist, grad, i, td, tm, tg);
+    }
+  }
+}
+
+template <typename L, typename R>
+INLINE void replace(const instruction &l, const L &left,
+                    const instruction &r, const R &right, CSGPARAMS) {
+  if (culled(l, box)) return;
+  left(CSGARGS);
+  if (culled(r, box)) return;
+  CACHE_LINE_ALIGNED arrayf tempdist;
+  CACHE_LINE_ALIGNED arrayi tempmatindex;
+  CACHE_LINE_ALIGNED array3f tempgrad;
+  const auto tgrad = grad ? &tempgrad : NULL;
+  cleartemp(tempdist, &tempmatindex, tgrad, packetnum);
+  right(pos, normaldist, tempdist, tempmatindex, tgrad, packetnum, box);
+  loopi(packetnum) {
+    const auto idx = i*soaf::size;
+    const auto d = soaf::load(&dist[idx]);
+    const auto td = soaf::load(&tempdist[idx]);
+    const auto insideright = (td<soaf(zero)) & (d<soaf(zero));
+    const auto tmpindex = soai::load(&tempmatindex[idx]);
+    const auto oldindex = soai::load(&matindex[idx]);
+    const auto newindex = select(insideright, tmpindex, oldindex);
+    store(&matindex[idx], newindex);
+  }
+  if (normaldist) loopi(packetnum) {
+      const auto idx = i*soaf::size;
+      const auto d = soaf::load(&dist[idx]);
+      const auto td = soaf::load(&tempdist[idx]);
+      const auto nd = soaf::load(&(*normaldist)[idx]);
+      const auto take = (d<soaf(zero)) & (abs(td)<nd);
+      store(&dist[idx], select(take, td, d));
+      if (grad) sset(*grad, select(take, sget(tempgrad,i), sget(*grad,i)), i);
+  }
+}
+
+template <typename L, typename R>
+INLINE void intersect(const instruction &l, const L &left,
+                      const instruction &r, const R &right, CSGPARAMS) {
+  if (culled(l, box)) return;
+  if (culled(r, box)) return;
+  left(CSGARGS);
+  CACHE_LINE_ALIGNED arrayf tempdist;
+  CACHE_LINE_ALIGNED array3f tempgrad;
+  const auto tgrad = grad ? &tempgrad : NULL;
+  cleartemp(tempdist, NULL, tgrad, packetnum);
+  right(pos, normaldist, tempdist, matindex, tgrad, packetnum, box);
+  loopi(packetnum) {
+    const auto idx = i*soaf::size;
+    const auto d = soaf::load(&dist[idx]);
+    const auto td = soaf::load(&tempdist[idx]);
+    const auto md = max(d,td);
+    const auto oldindex = soai::load(&matindex[idx]);
+    const auto airindex = soai(MAT_AIR_INDEX);
+    const auto newindex = select(md>=soaf(zero), airindex, oldindex);
+    store(&dist[idx], md);
+    store(&matindex[idx], newindex);
+    if (grad) sset(*grad, select(td>d, sget(tempgrad,i), sget(*grad,i)), i);
+  }
+}
+
+template <typename L, typename R>
+INLINE void subtract(const instruction &l, const L &left,
+                     const instruction &r, const R &right, CSGPARAMS) {
+  if (culled(l, box)) return;
+  left(CSGARGS);
+  if (culled(r, box)) return;
+  CACHE_LINE_ALIGNED arrayf tempdist;
+  CACHE_LINE_ALIGNED arrayi tempmatindex;
+  CACHE_LINE_ALIGNED array3f tempgrad;
+  const auto tgrad = grad ? &tempgrad : NULL;
+  cleartemp(tempdist, NULL, tgrad, packetnum);
+  right(pos, normaldist, tempdist, tempmatindex, tgrad, packetnum, box);
+  loopi(packetnum) {
+    const auto idx = i*soaf::size;
+    const auto d = soaf::load(&dist[idx]);
+    const auto td = soaf::load(&tempdist[idx]);
+    const auto md = max(d,-td);
+    const auto oldindex = soai::load(&matindex[idx]);
+    const auto airindex = soai(MAT_AIR_INDEX);
+    const auto newindex = select(md>=soaf(zero), airindex, oldindex);
+    store(&dist[idx], md);
+    store(&matindex[idx], newindex);
+    if (grad) sset(*grad, select(-td>d, -sget(tempgrad,i), sget(*grad,i)), i);
+  }
+}
+
+template <typename C>
+INLINE void translate(const instruction &ins, const C &child, CSGPARAMS) {
+  if (culled(ins, box)) return;
+  const auto tp = soa3f(ins.k.xyz());
+  CACHE_LINE_ALIGNED array3f tpos;
+  loopi(packetnum) sset(tpos, sget(pos,i) - tp, i);
+  const auto ssep = ssef::loadu(&ins.k);
+  const ssebox tbox(box.pmin-ssep, box.pmax-ssep);
+  child(tpos, normaldist, dist, matindex, grad, packetnum, tbox);
+}
+
+template <typename C>
+INLINE void rotate(const instruction &ins, const C &child, CSGPARAMS) {
+  if (culled(ins, box)) return;
+  const auto q = getquat(ins);
+  const auto rq = quat<soaf>(q);
+  CACHE_LINE_ALIGNED array3f tpos;
+  loopi(packetnum) sset(tpos, xfmpoint(rq, sget(pos,i)), i);
+  const ssebox rbox(xfmbox(q, toaabb(box)));
+
+  // gradients go to the local frame and back since the children may
+  // leave some of them untouched
+  if (grad) loopi(packetnum) sset(*grad, xfmvector(rq, sget(*grad,i)), i);
+  child(tpos, normaldist, dist, matindex, grad, packetnum, rbox);
+  if (grad) {
+    const auto iq = conj(rq);
+    loopi(packetnum) sset(*grad, xfmvector(iq, sget(*grad,i)), i);
+  }
+}
+
+template <typename C>
+INLINE void displace(const instruction &ins, const C &child, CSGPARAMS) {
+  if (culled(ins, box)) return;
+  const ssebox dbox(displacedbox(ins, toaabb(box)));
+  child(pos, normaldist, dist, matindex, grad, packetnum, dbox);
+  const auto amplitude = soaf(ins.k.x), frequency = soaf(ins.k.y);
+  const auto newindex = soai(ins.matindex);
+  const auto airindex = soai(MAT_AIR_INDEX);
+  loopi(packetnum) {
+    const auto idx = i*soaf::size;
+    soa3f g;
+    const auto n = valuenoise(frequency*sget(pos,i), grad ? &g : NULL);
+    const auto d = soaf::load(&dist[idx]);
+    const auto nd = d + amplitude*n;
+    const auto oldindex = soai::load(&matindex[idx]);
+    const auto m = select(d<soaf(zero), oldindex, newindex);
+    store(&dist[idx], nd);
+    store(&matindex[idx], select(nd<soaf(zero), m, airindex));
+    if (grad) sset(*grad, sget(*grad,i) + (amplitude*frequency)*g, i);
+  }
+}
+
+// capped cylinders are air outside as the differences they replace
+INLINE void shape(const instruction &ins, CSGPARAMS) {
+  if (culled(ins, box)) return;
+  const auto capped = ins.op >= C_CAPPEDCYLINDERXZ;
+  const auto newindex = soai(ins.matindex);
+  const auto airindex = soai(MAT_AIR_INDEX);
+  loopi(packetnum) {
+    const auto idx = i*soaf::size;
+    const auto pt = sget(pos,i);
+    const auto nd = primitive(ins, pt);
+    const auto oldindex = capped ? airindex : soai::load(&matindex[idx]);
+    store(&dist[idx], nd);
+    store(&matindex[idx], select(nd<soaf(zero), newindex, oldindex));
+    if (grad) sset(*grad, gradient(ins, pt), i);
+  }
+}
+
+/*-------------------------------------------------------------------------
+ - interpreter of the compiled programs
+ -------------------------------------------------------------------------*/
+static void exec(const program &p, u32 pc, CSGPARAMS);
+struct interpreter {
+  INLINE interpreter(const program &p, u32 pc) : p(p), pc(pc) {}
+  INLINE void operator() (CSGPARAMS) const { exec(p, pc, CSGARGS); }
+  const program &p;
+  u32 pc;
+};
+
+static void exec(const program &p, u32 pc, CSGPARAMS) {
+  const auto code = &p.code[0];
+  const auto &ins = code[pc];
+  switch (ins.op) {
+    case C_UNION: {
+      u32 hits[MAXHITNUM], hitnum;
+      if (ins.bvh != NOBVH && gather(p, pc, toaabb(box), hits, hitnum))
+        loopi(hitnum)
+          unite(code[hits[i]], interpreter(p, hits[i]), i==0, CSGARGS);
+      else {
+        auto first = true;
+        for (u32 k = 0, child = pc+1; k < ins.num; ++k, child = code[child].next) {
+          if (culled(code[child], box)) continue;
+          unite(code[child], interpreter(p, child), first, CSGARGS);
+          first = false;
+        }
       }
     }
     break;
-    case C_BOX: {
-      const auto isec = intersection(ssebox(n->box), box);
-      if (empty(isec)) break;
-      const auto b = static_cast<const struct box*>(n);
-      const auto extent = soa3f(b->extent);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto newindex = soai(b->matindex);
-        const auto pd = abs(sget(pos,i))-extent;
-        const auto nd = min(max(pd.x,max(pd.y,pd.z)),soaf(zero)) + length(max(pd,soa3f(zero)));
-        const auto m = nd<soaf(zero);
-        store(&dist[idx], nd);
-        store(&matindex[idx], select(m, newindex, oldindex));
-      }
+    case C_REPLACE:
+    case C_INTERSECTION:
+    case C_DIFFERENCE: {
+      const auto left = pc+1, right = code[left].next;
+      const interpreter l(p, left), r(p, right);
+      if (ins.op == C_REPLACE)
+        replace(code[left], l, code[right], r, CSGARGS);
+      else if (ins.op == C_INTERSECTION)
+        intersect(code[left], l, code[right], r, CSGARGS);
+      else
+        subtract(code[left], l, code[right], r, CSGARGS);
     }
     break;
+    case C_TRANSLATION: translate(ins, interpreter(p, pc+1), CSGARGS); break;
+    case C_ROTATION: rotate(ins, interpreter(p, pc+1), CSGARGS); break;
+    case C_DISPLACEMENT: displace(ins, interpreter(p, pc+1), CSGARGS); break;
+    case C_PLANE: case C_SPHERE: case C_BOX:
+    case C_CYLINDERXY: case C_CYLINDERXZ: case C_CYLINDERYZ:
+    case C_CAPPEDCYLINDERXY: case C_CAPPEDCYLINDERXZ: case C_CAPPEDCYLINDERYZ:
+      shape(ins, CSGARGS);
+    break;
     case C_EMPTY: break;
     case C_INVALID: assert("unreachable" && false);
   }
 }
 
-void dist(const node *RESTRICT n, const array3f &RESTRICT pos,
+/*-------------------------------------------------------------------------
+ - scenes baked by csg::bake. csgbaked.hxx has one function per instruction
+ - which runs the same operation as the interpreter but with its constants
+ - given as literals and its children as direct calls
+ -------------------------------------------------------------------------*/
+template <void (*F)(CSGPARAMS)> struct bakedchild {
+  INLINE void operator() (CSGPARAMS) const { F(CSGARGS); }
+};
+INLINE instruction bakedinstruction(CSGOP op, const aabb &box, const vec4f &k,
+                                    u32 matindex, const vec2f &caps) {
+  instruction ins;
+  ins.box = box;
+  ins.k = k;
+  ins.op = op;
+  ins.next = ins.num = 0;
+  ins.matindex = matindex;
+  ins.bvh = NOBVH;
+  ins.caps = caps;
+  return ins;
+}
+
+// a packet kept in registers while a run of primitives of a baked union is
+// merged in it. this is the same as uniting them one by one
+struct unitepacket {
+  INLINE unitepacket(CSGPARAMS, int packet) : idx(packet*soaf::size) {
+    pt = sget(pos,packet);
+    d = soaf::load(&dist[idx]);
+    m = soai::load(&matindex[idx]);
+    g = grad ? sget(*grad,packet) : soa3f(zero);
+  }
+  INLINE void merge(const instruction &c, bool first,
+                    const arrayf *RESTRICT normaldist, array3f *RESTRICT grad) {
+    const auto td = primitive(c, pt);
+    const auto tg = grad ? gradient(c, pt) : soa3f(zero);
+    const auto newindex = soai(c.matindex), airindex = soai(MAT_AIR_INDEX);
+    if (first) {
+      const auto capped = c.op >= C_CAPPEDCYLINDERXZ;
+      m = select(td<soaf(zero), newindex, capped ? airindex : m);
+      d = td;
+      g = tg;
+    } else {
+      const auto tm = select(td<soaf(zero), newindex, airindex);
+      m = select(m > tm, m, tm);
+      auto take = td<d;
+      if (normaldist) take |= abs(td)<soaf::load(&(*normaldist)[idx]);
+      d = select(take, td, d);
+      g = grad ? select(take, tg, g) : g;
+    }
+  }
+  INLINE void store(arrayf &RESTRICT dist, arrayi &RESTRICT matindex,
+                    array3f *RESTRICT grad) const {
+    q::store(&dist[idx], d);
+    q::store(&matindex[idx], m);
+    if (grad) sset(*grad, g, idx/soaf::size);
+  }
+  soa3f pt, g;
+  soaf d;
+  soai m;
+  int idx;
+};
+#define CSGBAKEDNODE(NAME) static void NAME(CSGPARAMS)
+#define CSGBAKEDSCENE(HASH, ROOT)
+#include "csgbaked.hxx"
+#undef CSGBAKEDSCENE
+#undef CSGBAKEDNODE
+
+// same order as the hashes csg::compile looks the programs up with
+typedef void (*bakedfn)(CSGPARAMS);
+static const bakedfn bakedscenes[] = {
+#define CSGBAKEDSCENE(HASH, ROOT) ROOT,
+#include "csgbaked.hxx"
+#undef CSGBAKEDSCENE
+  NULL
+};
+
+void dist(const program *RESTRICT p, const array3f &RESTRICT pos,
           const arrayf *RESTRICT normaldist, arrayf &RESTRICT d,
-          arrayi &RESTRICT mat, int num, const aabb &RESTRICT box)
+          arrayi &RESTRICT mat, int num, const aabb &RESTRICT box,
+          array3f *RESTRICT grad)
 {
   const auto packetnum = num/soaf::size + (num%soaf::size?1:0);
-  loopi(packetnum) {
-    store(&d[i*soaf::size], soaf(FLT_MAX));
-    store(&mat[i*soaf::size], soai(MAT_AIR_INDEX));
-  }
-  distr(n, pos, normaldist, d, mat, packetnum, ssebox(box));
+  cleartemp(d, &mat, grad, packetnum);
+  if (p->baked != NOBAKED)
+    bakedscenes[p->baked](pos, normaldist, d, mat, grad, packetnum, ssebox(box));
+  else
+    exec(*p, 0, pos, normaldist, d, mat, grad, packetnum, ssebox(box));
   AVX_ZERO_UPPER();
 }
+#undef CSGARGS
+#undef CSGPARAMS
 } /* namespace NAMESPACE */
 } /* namespace rt */
 } /* namespace q */
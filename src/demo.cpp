@@ -3,6 +3,8 @@
  - demo.cpp -> implements demo record / play back
  -------------------------------------------------------------------------*/
 #include "mini.q.hpp"
+#include "capture.hpp"
+#include "base/algorithm.hpp"
 #include <zlib.h>
 
 // loading and saving of savegames & demos, dumps the spawn state of all
@@ -15,39 +17,171 @@ static game::dvector playerhistory;
 static bool demorecording = false;
 static bool demoloading = false;
 static bool demoplayback = false;
+static bool timedemoloading = false;
 static int democlientnum = 0;
 
 static void start(void);
+static void endtiming(void);
+
+// demos hold a keyframe with the full game state every KEYFRAMEMILLIS of demo
+// time. they are records with a KEYFRAME length. their offsets in the
+// uncompressed stream are indexed after the end marker so that playback can
+// jump to any time from the closest keyframe before it
+static const int KEYFRAMEMILLIS = 5000;
+static const int KEYFRAME = -2;
+struct keyframe { int millis, offset; };
+static vector<keyframe> keyframes;
+static int lastkeyframe = 0;
+
+// the stream is written and read by blocks on a background task. recording
+// fills a memory block that is compressed and written once full while the
+// next one fills up. playback reads from the current block while the next one
+// is decompressed
+static const int DEMOBLOCKSIZE = 64*1024;
+
+struct blocktask : public task {
+  INLINE blocktask(bool reading) :
+    task(reading ? "demoread" : "demowrite", 1, 1), reading(reading), done(0) {}
+  virtual void run(u32) {
+    if (reading) {
+      data.setsize(DEMOBLOCKSIZE, noinitialize);
+      data.setsize(max(gzread(f, &data[0], DEMOBLOCKSIZE), 0), noinitialize);
+    } else if (data.length())
+      gzwrite(f, &data[0], data.length());
+    storerelease(&done, 1);
+  }
+  vector<u8> data;
+  bool reading;
+  volatile s32 done;
+};
+static ref<blocktask> blockjob;
+static vector<u8> block;
+static bool writing = false;
+static int blockpos = 0, blockoffset = 0; // block starts at blockoffset in the stream
+
+static void gzopenblocks(bool write) {
+  writing = write;
+  block.setsize(0);
+  blockpos = blockoffset = 0;
+}
+
+static void gzcloseblocks(void) {
+  if (blockjob) blockjob->wait();
+  blockjob = NULL;
+  block.destroy();
+}
+
+// a write still running means the disk is slow so we just keep filling
+static void gzflush(bool wait) {
+  if (blockjob && !loadacquire(&blockjob->done)) {
+    if (!wait) return;
+    blockjob->wait();
+  }
+  blockjob = NEWTASK(blocktask, false);
+  blockoffset += block.length();
+  block.moveto(blockjob->data);
+  blockjob->scheduled();
+  if (wait) blockjob->wait();
+}
+
+static void gzputb(const void *data, int len) {
+  const auto from = block.length();
+  block.setsize(from+len, noinitialize);
+  memcpy(&block[from], data, len);
+  if (block.length()>=DEMOBLOCKSIZE) gzflush(false);
+}
+
+static void gzprefetch(void) {
+  blockjob = NEWTASK(blocktask, true);
+  blockjob->scheduled();
+}
+
+// the block decompressed ahead becomes the current one
+static bool gznextblock(void) {
+  blockoffset += block.length();
+  blockpos = 0;
+  if (!blockjob) gzprefetch();
+  blockjob->wait();
+  blockjob->data.moveto(block);
+  blockjob = NULL;
+  if (block.empty()) return false;
+  gzprefetch();
+  return true;
+}
+
+static int gzgetb(void *data, int len) {
+  auto dst = (u8*) data;
+  int n = 0;
+  while (n<len) {
+    if (blockpos==block.length() && !gznextblock()) break;
+    const int m = min(len-n, block.length()-blockpos);
+    memcpy(dst+n, &block[blockpos], m);
+    blockpos += m;
+    n += m;
+  }
+  return n;
+}
+
+// offsets in the uncompressed stream
+static int gzpos(void) { return blockoffset + (writing ? block.length() : blockpos); }
+static void gzseekto(int offset) {
+  if (offset>=blockoffset && offset<=blockoffset+block.length()) {
+    blockpos = offset-blockoffset;
+    return;
+  }
+  if (blockjob) blockjob->wait();
+  blockjob = NULL;
+  gzseek(f, offset, SEEK_SET);
+  block.setsize(0);
+  blockoffset = offset;
+  blockpos = 0;
+}
+static bool gzend(void) { return blockpos==block.length() && !gznextblock(); }
 
-static void gzput(int i) { gzputc(f, i); }
-static void gzputi(int i) { gzwrite(f, &i, sizeof(int)); }
-static void gzputv(vec3f &v) { gzwrite(f, &v, sizeof(vec3f)); }
+static void gzput(int i) { const char c = char(i); gzputb(&c, 1); }
+static void gzputi(int i) { gzputb(&i, sizeof(int)); }
+static void gzputv(vec3f &v) { gzputb(&v, sizeof(vec3f)); }
 static void gzcheck(int a, int b) {
   if (a!=b) sys::fatal("savegame file corrupt (short)");
 }
 static int gzget(void) {
-  char c = gzgetc(f);
+  char c = 0;
+  gzgetb(&c, 1);
   return c;
 }
 static int gzgeti(void) {
   int i;
-  gzcheck(gzread(f, &i, sizeof(int)), sizeof(int));
+  gzcheck(gzgetb(&i, sizeof(int)), sizeof(int));
   return i;
 }
-static void gzgetv(vec3f &v) { gzcheck(gzread(f, &v, sizeof(vec3f)), sizeof(vec3f)); }
+static void gzgetv(vec3f &v) { gzcheck(gzgetb(&v, sizeof(vec3f)), sizeof(vec3f)); }
+static bool gztryi(int &i) { return gzgetb(&i, sizeof(int))==sizeof(int); }
+static void gzskip(int n) { if (n>0) gzseekto(gzpos()+n); }
 
 bool playing(void) { return demoplayback; }
 int clientnum(void) { return democlientnum; }
 
 void stop(void) {
   if (f) {
-    if (demorecording) gzputi(-1);
+    if (demorecording) {
+      gzputi(-1);
+      gzputi(keyframes.length());
+      loopv(keyframes) {
+        gzputi(keyframes[i].millis);
+        gzputi(keyframes[i].offset);
+      }
+    }
+    if (writing) gzflush(true);
+    gzcloseblocks();
     gzclose(f);
   }
+  endtiming();
+  keyframes.destroy();
   f = NULL;
   demorecording = false;
   demoplayback = false;
   demoloading = false;
+  timedemoloading = false;
   loopv(playerhistory) game::zapdynent(playerhistory[i]);
   playerhistory.setsize(0);
 }
@@ -58,22 +192,23 @@ static void savestate(char *fn) {
   stop();
   f = gzopen(fn, "wb9");
   if (!f) { con::out("could not write %s", fn); return; }
-  gzwrite(f, (void *)"CUBESAVE", 8);
-  gzputc(f, sys::islittleendian());
+  gzopenblocks(true);
+  gzputb("CUBESAVE", 8);
+  gzput(sys::islittleendian());
   gzputi(SAVEGAMEVERSION);
   gzputi(sizeof(game::dynent));
-  gzwrite(f, (const voidp) game::getclientmap(), MAXDEFSTR);
+  gzputb(game::getclientmap(), MAXDEFSTR);
   gzputi(game::mode());
   gzputi(game::ents.length());
-  loopv(game::ents) gzputc(f, game::ents[i].spawned);
-  gzwrite(f, game::player1, sizeof(game::dynent));
+  loopv(game::ents) gzput(game::ents[i].spawned);
+  gzputb(game::player1, sizeof(game::dynent));
   game::dvector &monsters = game::getmonsters();
   gzputi(monsters.length());
-  loopv(monsters) gzwrite(f, monsters[i], sizeof(game::dynent));
+  loopv(monsters) gzputb(monsters[i], sizeof(game::dynent));
   gzputi(game::players.length());
   loopv(game::players) {
     gzput(game::players[i]==NULL);
-    gzwrite(f, game::players[i], sizeof(game::dynent));
+    gzputb(game::players[i], sizeof(game::dynent));
   }
 }
 
@@ -95,12 +230,13 @@ static void loadstate(char *fn) {
   if (client::multiplayer()) return;
   f = gzopen(fn, "rb9");
   if (!f) { con::out("could not open %s", fn); return; }
+  gzopenblocks(false);
 
-  gzread(f, buf.c_str(), 8);
+  gzgetb(buf.c_str(), 8);
   if (strncmp(buf.c_str(), "CUBESAVE", 8)) goto out;
-  if (gzgetc(f)!=sys::islittleendian()) goto out;     // not supporting save->load accross incompatible architectures simpifies things a LOT
+  if (gzget()!=sys::islittleendian()) goto out;     // not supporting save->load accross incompatible architectures simpifies things a LOT
   if (gzgeti()!=SAVEGAMEVERSION || gzgeti()!=sizeof(game::dynent)) goto out;
-  gzread(f, mapname.c_str(), MAXDEFSTR);
+  gzgetb(mapname.c_str(), MAXDEFSTR);
   game::setnextmode(gzgeti());
   // continue below once map has been loaded and client & server have updated
   client::changemap(mapname.c_str());
@@ -125,20 +261,20 @@ void loadgamerest(void) {
   if (demoplayback || !f) return;
   if (gzgeti()!=game::ents.length()) return loadgameout();
   loopv(game::ents) {
-    game::ents[i].spawned = gzgetc(f)!=0;
+    game::ents[i].spawned = gzget()!=0;
     // TODO if (game::ents[i].type==game::CARROT && !game::ents[i].spawned)
       // world::trigger(game::ents[i].attr1, game::ents[i].attr2, true);
   }
   server::restoreserverstate(game::ents);
 
-  gzread(f, game::player1, sizeof(game::dynent));
+  gzgetb(game::player1, sizeof(game::dynent));
   game::player1->lastaction = int(game::lastmillis());
 
   int nmonsters = gzgeti();
   game::dvector &monsters = game::getmonsters();
   if (nmonsters!=monsters.length()) return loadgameout();
   loopv(monsters) {
-    gzread(f, monsters[i], sizeof(game::dynent));
+    gzgetb(monsters[i], sizeof(game::dynent));
     monsters[i]->enemy = game::player1; // lazy, could save id of enemy instead
     monsters[i]->lastaction = monsters[i]->trigger = int(game::lastmillis())+500; // also lazy, but no real noticable effect on game
     if (monsters[i]->state==CS_DEAD) monsters[i]->lastaction = 0;
@@ -149,7 +285,7 @@ void loadgamerest(void) {
   loopi(nplayers) if (!gzget()) {
     game::dynent *d = game::getclient(i);
     assert(d);
-    gzread(f, d, sizeof(game::dynent));
+    gzgetb(d, sizeof(game::dynent));
   }
 
   con::out("savegame restored");
@@ -172,6 +308,7 @@ static void record(const char *name) {
   fixedstring fn(fmt,"demos/%s.cdgz", name);
   savestate(fn.c_str());
   gzputi(cn);
+  client::resetsnapshots(); // playback cannot decode deltas from before
   con::out("started recording demo to %s", fn.c_str());
   demorecording = true;
   starttime = int(game::lastmillis());
@@ -182,11 +319,73 @@ CMD(record);
 void damage(int damage, vec3f &o) { ddamage = damage; dorig = o; }
 void blend(int damage) { bdamage = damage; }
 
+// our own player is the one of our client number in the demo
+static void writekeyframe(int millis) {
+  const keyframe k = {millis, gzpos()};
+  keyframes.add(k);
+  gzputi(millis);
+  gzputi(KEYFRAME);
+  gzputi(game::ents.length());
+  loopv(game::ents) gzput(game::ents[i].spawned);
+  game::dvector &monsters = game::getmonsters();
+  gzputi(monsters.length());
+  loopv(monsters) gzputb(monsters[i], sizeof(game::dynent));
+  const int cn = client::getclientnum();
+  const int num = max(game::players.length(), cn+1);
+  gzputi(num);
+  loopi(num) {
+    game::dynent *d = i==cn ? game::player1 :
+      i<game::players.length() ? game::players[i] : NULL;
+    gzput(d==NULL);
+    if (d) gzputb(d, sizeof(game::dynent));
+  }
+  // positions after the keyframe must not depend on older snapshots
+  client::requestfullsnapshot();
+  lastkeyframe = millis;
+}
+
+static void readkeyframe(void) {
+  const int entnum = gzgeti();
+  loopi(entnum) {
+    const bool spawned = gzget()!=0;
+    if (i<game::ents.length()) game::ents[i].spawned = spawned;
+  }
+  game::dvector &monsters = game::getmonsters();
+  game::dynent scratch;
+  const int nmonsters = gzgeti();
+  loopi(nmonsters) {
+    game::dynent *m = i<monsters.length() ? monsters[i] : &scratch;
+    gzgetb(m, sizeof(game::dynent));
+    m->enemy = game::player1;
+  }
+  const int nplayers = gzgeti();
+  loopi(nplayers) {
+    if (gzget()) {
+      if (i<game::players.length()) game::zapdynent(game::players[i]);
+      continue;
+    }
+    game::dynent *d = game::getclient(i);
+    assert(d);
+    gzgetb(d, sizeof(game::dynent));
+    d->lastupdate = int(game::lastmillis());
+  }
+}
+
+static void skipkeyframe(void) {
+  gzskip(gzgeti());
+  gzskip(gzgeti()*int(sizeof(game::dynent)));
+  const int nplayers = gzgeti();
+  loopi(nplayers) if (!gzget()) gzskip(sizeof(game::dynent));
+}
+
 void incomingdata(u8 *buf, int len, bool extras) {
   if (!demorecording) return;
-  gzputi(int(game::lastmillis())-starttime);
+  const int millis = int(game::lastmillis())-starttime;
+  if (keyframes.empty() || millis-lastkeyframe>=KEYFRAMEMILLIS)
+    writekeyframe(millis);
+  gzputi(millis);
   gzputi(len);
-  gzwrite(f, buf, len);
+  gzputb(buf, len);
   gzput(extras);
   if (extras) {
     gzput(game::player1->gunselect);
@@ -213,6 +412,106 @@ static void demo(const char *name) {
 }
 CMD(demo);
 
+/*-------------------------------------------------------------------------
+ - timedemo: the demo plays as fast as the client renders it. the game clock
+ - moves by timedemostep per frame such that every run draws the same frames
+ - whatever the machine. frame times and the ogl timer results are printed
+ - once the demo stops
+ -------------------------------------------------------------------------*/
+VAR(timedemostep, 1, 16, 100);
+static const u32 MAXTIMERS = 16;
+struct timersamples {
+  const char *name;
+  bool gpu;
+  vector<float> ms;
+};
+static timersamples timers[MAXTIMERS];
+static u32 timernum = 0;
+static vector<float> frames;
+static u64 lastframe = 0;
+static bool timedemorunning = false;
+static fixedstring videoname; // the timedemo is recorded to it when set
+
+static void addtimer(const char *name, bool gpu, float ms) {
+  u32 i = 0;
+  while (i < timernum && (timers[i].name != name || timers[i].gpu != gpu)) ++i;
+  if (i == MAXTIMERS) return;
+  if (i == timernum) {
+    timers[i].name = name;
+    timers[i].gpu = gpu;
+    ++timernum;
+  }
+  timers[i].ms.add(ms);
+}
+
+static void begintiming(void) {
+  timedemorunning = true;
+  timedemoloading = false;
+  ogl::settimercallback(addtimer);
+  lastframe = sys::nanos();
+  if (videoname[0] != '\0') capture::startvideo(videoname.c_str(), 1000, timedemostep);
+}
+
+// the 1% low is the average of the slowest hundredth of the samples
+static void printtimes(const char *name, vector<float> &ms) {
+  const auto n = ms.length();
+  if (n == 0) return;
+  quicksort(&ms[0], n);
+  auto sum = 0.0, low = 0.0;
+  const auto lownum = max(n/100, 1);
+  loopi(n) sum += ms[i];
+  loopi(lownum) low += ms[n-1-i];
+  const auto p99 = ms[max(int(ceil(0.99*double(n)))-1, 0)];
+  con::out("timedemo: %-12s avg %6.2f ms, 1%% low %6.2f ms, p99 %6.2f ms (%d samples)",
+           name, sum/double(n), low/double(lownum), p99, n);
+}
+
+static void endtiming(void) {
+  if (!timedemorunning) return;
+  timedemorunning = false;
+  ogl::settimercallback(NULL);
+  if (videoname[0] != '\0') capture::stopvideo();
+  videoname[0] = '\0';
+  auto total = 0.0;
+  loopv(frames) total += frames[i];
+  if (frames.length())
+    con::out("timedemo: %d frames in %.2f s, %.1f fps", frames.length(),
+             total*1e-3, 1e3*double(frames.length())/total);
+  printtimes("frame", frames);
+  loopi(s32(timernum)) {
+    const fixedstring name(fmt, "%s%s", timers[i].name, timers[i].gpu ? "" : " (cpu)");
+    printtimes(name.c_str(), timers[i].ms);
+    timers[i].ms.destroy();
+  }
+  frames.destroy();
+  timernum = 0;
+}
+
+bool timing(void) { return timedemorunning; }
+double nextmillis(void) { return game::lastmillis()+double(timedemostep); }
+
+void endframe(void) {
+  if (!timedemorunning) return;
+  const auto now = sys::nanos();
+  frames.add(float(double(now-lastframe)*1e-6));
+  lastframe = now;
+}
+
+static void timedemo(const char *name) {
+  demo(name);
+  timedemoloading = true;
+}
+CMD(timedemo);
+
+// one video frame per timedemo step. the demo goes as fast as the frames are
+// encoded and none of them is dropped
+static void videodemo(const char *name, const char *video) {
+  timedemostep = max((1000+capture::videofps/2)/capture::videofps, 1);
+  timedemo(name);
+  videoname = video != NULL && video[0] != '\0' ? video : "demo.y4m";
+}
+CMD(videodemo);
+
 static void stopreset(void) {
   con::out("demo stopped (%d msec elapsed)", game::lastmillis()-starttime);
   stop();
@@ -226,18 +525,71 @@ static int scaletime(int t) {
 }
 
 static void readdemotime() {
-  if (gzeof(f) || (playbacktime = gzgeti())==-1) {
+  if (gzend() || (playbacktime = gzgeti())==-1) {
     stopreset();
     return;
   }
   playbacktime = scaletime(playbacktime);
 }
 
+// restart from the last keyframe before millis and replay what follows it in
+// the next playback step
+static void demoseek(int millis) {
+  if (!demoplayback) {
+    con::out("not playing a demo");
+    return;
+  }
+  if (keyframes.empty()) {
+    con::out("demo has no keyframe to seek from");
+    return;
+  }
+  int k = 0;
+  loopv(keyframes) if (keyframes[i].millis<=millis) k = i;
+  gzseekto(keyframes[k].offset);
+  client::resetsnapshots();
+  loopv(playerhistory) game::zapdynent(playerhistory[i]);
+  playerhistory.setsize(0);
+  millis = max(millis, keyframes[k].millis);
+  starttime = int(game::lastmillis())-int(millis*(100.0f/demoplaybackspeed));
+  readdemotime();
+}
+CMD(demoseek);
+
+// skip all the records up to the end marker and read the keyframe index. a
+// demo cut short has no index and cannot seek
+static void readindex(void) {
+  const auto begin = gzpos();
+  keyframes.setsize(0);
+  int millis, len;
+  while (gztryi(millis) && millis!=-1 && gztryi(len)) {
+    if (len==KEYFRAME) {
+      skipkeyframe();
+      continue;
+    }
+    gzskip(len);
+    if (!gzget()) continue;
+    // see incomingdata for the extras
+    gzskip(2+4*4+1+game::NUMGUNS+1+4);
+    int damage;
+    if (gztryi(damage) && damage) gzskip(sizeof(vec3f));
+  }
+  int num;
+  if (millis==-1 && gztryi(num)) loopi(num) {
+    keyframe k;
+    if (!gztryi(k.millis) || !gztryi(k.offset)) break;
+    keyframes.add(k);
+  }
+  gzseekto(begin);
+}
+
 static void start(void) {
   democlientnum = gzgeti();
+  readindex();
   demoplayback = true;
+  client::resetsnapshots();
   starttime = int(game::lastmillis());
   con::out("now playing demo");
+  if (timedemoloading) begintiming();
   game::dynent *d = game::getclient(democlientnum);
   assert(d);
   *d = *game::player1;
@@ -264,13 +616,18 @@ static void fixwrap(game::dynent *a, game::dynent *b) {
 void playbackstep(void) {
   while (demoplayback && game::lastmillis()>=playbacktime) {
     int len = gzgeti();
+    if (len==KEYFRAME) {
+      readkeyframe();
+      readdemotime();
+      continue;
+    }
     if (len<1 || len>MAXTRANS) {
       con::out("error: huge packet during demo play (%d)", len);
       stopreset();
       return;
     }
     u8 buf[MAXTRANS];
-    gzread(f, buf, len);
+    gzgetb(buf, len);
     client::localservertoclient(buf, len);  // update game state
 
     game::dynent *target = game::players[democlientnum];
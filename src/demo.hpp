@@ -6,7 +6,7 @@
 #include "base/sys.hpp"
 
 // bump if dynent/netprotocol changes or any other savegame/demo data
-#define SAVEGAMEVERSION 4
+#define SAVEGAMEVERSION 5
 
 namespace q {
 namespace demo {
@@ -20,6 +20,11 @@ void damage(int damage, vec3f &o);
 void blend(int damage);
 bool playing(void);
 int clientnum(void);
+// a running timedemo is not paced and its game clock moves by a fixed step
+// per frame. endframe records the time of the frame just drawn
+bool timing(void);
+double nextmillis(void);
+void endframe(void);
 
 } /* namespace demo */
 } /* namespace q */
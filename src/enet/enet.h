@@ -80,7 +80,9 @@ typedef enum
    /** packet will not be sequenced with other packets
      * not supported for reliable packets
      */
-   ENET_PACKET_FLAG_UNSEQUENCED = (1 << 1)
+   ENET_PACKET_FLAG_UNSEQUENCED = (1 << 1),
+   /** internal: packet and data share one pooled slab */
+   ENET_PACKET_FLAG_SLAB        = (1 << 15)
 } ENetPacketFlag;
 
 /**
@@ -158,6 +160,7 @@ enum
    ENET_HOST_RECEIVE_BUFFER_SIZE          = 256 * 1024,
    ENET_HOST_BANDWIDTH_THROTTLE_INTERVAL  = 1000,
    ENET_HOST_DEFAULT_MTU                  = 1400,
+   ENET_HOST_DATAGRAM_BATCH               = 16,
 
    ENET_PEER_DEFAULT_ROUND_TRIP_TIME      = 500,
    ENET_PEER_DEFAULT_PACKET_THROTTLE      = 32,
@@ -275,8 +278,17 @@ typedef struct _ENetHost
    ENetBuffer         buffers [ENET_BUFFER_MAXIMUM];
    size_t             bufferCount;
    ENetAddress        receivedAddress;
-   enet_uint8         receivedData [ENET_PROTOCOL_MAXIMUM_MTU];
+   enet_uint8 *       receivedData;                /**< points into the receive batch */
    size_t             receivedDataLength;
+   ENetAddress        receiveBatchAddresses [ENET_HOST_DATAGRAM_BATCH];
+   ENetBuffer         receiveBatchBuffers [ENET_HOST_DATAGRAM_BATCH];
+   enet_uint8         receiveBatchData [ENET_HOST_DATAGRAM_BATCH][ENET_PROTOCOL_MAXIMUM_MTU];
+   size_t             receiveBatchCount;           /**< datagrams read by the last receive */
+   size_t             receiveBatchIndex;           /**< next datagram of the batch to handle */
+   ENetAddress        sendBatchAddresses [ENET_HOST_DATAGRAM_BATCH];
+   ENetBuffer         sendBatchBuffers [ENET_HOST_DATAGRAM_BATCH];
+   enet_uint8         sendBatchData [ENET_HOST_DATAGRAM_BATCH][ENET_PROTOCOL_MAXIMUM_MTU];
+   size_t             sendBatchCount;              /**< datagrams waiting for the next flush */
 } ENetHost;
 
 /**
@@ -364,6 +376,8 @@ extern ENetSocket enet_socket_accept (ENetSocket, ENetAddress *);
 extern int        enet_socket_connect (ENetSocket, const ENetAddress *);
 extern int        enet_socket_send (ENetSocket, const ENetAddress *, const ENetBuffer *, size_t);
 extern int        enet_socket_receive (ENetSocket, ENetAddress *, ENetBuffer *, size_t);
+extern int        enet_socket_send_batch (ENetSocket, const ENetAddress *, const ENetBuffer *, size_t);
+extern int        enet_socket_receive_batch (ENetSocket, ENetAddress *, ENetBuffer *, size_t);
 extern int        enet_socket_wait (ENetSocket, enet_uint32 *, enet_uint32);
 extern void       enet_socket_destroy (ENetSocket);
 
@@ -397,11 +411,13 @@ ENET_API int enet_address_get_host (const ENetAddress *address, char *hostName,
 ENET_API ENetPacket * enet_packet_create (const void *dataContents, size_t dataLength, enet_uint32 flags);
 ENET_API void         enet_packet_destroy (ENetPacket *packet );
 ENET_API int          enet_packet_resize  (ENetPacket *packet, size_t dataLength );
+ENET_API void         enet_packet_pool_clear (void);
 
 ENET_API ENetHost * enet_host_create (const ENetAddress *address, size_t peerCount, enet_uint32 incomingBandwidth, enet_uint32 outgoingBandwidth );
 ENET_API void       enet_host_destroy (ENetHost *host );
 ENET_API ENetPeer * enet_host_connect (ENetHost *host, const ENetAddress *address, size_t channelCount );
 ENET_API int        enet_host_service (ENetHost *, ENetEvent *, enet_uint32);
+ENET_API int        enet_host_check_events (ENetHost *, ENetEvent *);
 ENET_API void       enet_host_flush (ENetHost *);
 ENET_API void       enet_host_broadcast (ENetHost *, enet_uint8, ENetPacket *);
 ENET_API void       enet_host_bandwidth_limit (ENetHost *, enet_uint32, enet_uint32);
@@ -55,7 +55,11 @@ enet_host_create (const ENetAddress * address, size_t peerCount, enet_uint32 inc
     host -> bufferCount = 0;
     host -> receivedAddress.host = ENET_HOST_ANY;
     host -> receivedAddress.port = 0;
+    host -> receivedData = NULL;
     host -> receivedDataLength = 0;
+    host -> receiveBatchCount = 0;
+    host -> receiveBatchIndex = 0;
+    host -> sendBatchCount = 0;
 
     for (currentPeer = host -> peers;
          currentPeer < & host -> peers [host -> peerCount];
@@ -9,6 +9,34 @@
     @{
 */
 
+/* packets with up to ENET_PACKET_SLAB_DATA bytes live in one slab with
+   their data. freed slabs go to a free list, up to ENET_PACKET_SLAB_CACHE
+   of them, such that building and receiving packets does not malloc. the
+   list is per thread since each thread of a server runs its own host */
+#define ENET_PACKET_SLAB_HEADER ((sizeof (ENetPacket) + 15) & ~15)
+#define ENET_PACKET_SLAB_DATA 8192
+#define ENET_PACKET_SLAB_CACHE 256
+
+typedef struct _ENetPacketSlab
+{
+   struct _ENetPacketSlab * next;
+} ENetPacketSlab;
+
+#ifdef _WIN32
+#define ENET_THREAD __declspec(thread)
+#else
+#define ENET_THREAD __thread
+#endif
+
+static ENET_THREAD ENetPacketSlab * freeSlabs = NULL;
+static ENET_THREAD size_t freeSlabCount = 0;
+
+static enet_uint8 *
+enet_packet_slab_data (ENetPacket * packet)
+{
+    return (enet_uint8 *) packet + ENET_PACKET_SLAB_HEADER;
+}
+
 /** Creates a packet that may be sent to a peer.
     @param dataContents initial contents of the packet's data; the packet's data will remain uninitialized if dataContents is NULL.
     @param dataLength   size of the data allocated for this packet
@@ -18,9 +46,28 @@
 ENetPacket *
 enet_packet_create (const void * data, size_t dataLength, enet_uint32 flags)
 {
-    ENetPacket * packet = (ENetPacket *) enet_malloc (sizeof (ENetPacket));
+    ENetPacket * packet;
+
+    if (dataLength <= ENET_PACKET_SLAB_DATA)
+    {
+       if (freeSlabs != NULL)
+       {
+          packet = (ENetPacket *) freeSlabs;
+          freeSlabs = freeSlabs -> next;
+          -- freeSlabCount;
+       }
+       else
+         packet = (ENetPacket *) enet_malloc (ENET_PACKET_SLAB_HEADER + ENET_PACKET_SLAB_DATA);
 
-    packet -> data = (enet_uint8 *) enet_malloc (dataLength);
+       packet -> data = enet_packet_slab_data (packet);
+       flags |= ENET_PACKET_FLAG_SLAB;
+    }
+    else
+    {
+       packet = (ENetPacket *) enet_malloc (sizeof (ENetPacket));
+       packet -> data = (enet_uint8 *) enet_malloc (dataLength);
+       flags &= ~ ENET_PACKET_FLAG_SLAB;
+    }
 
     if (data != NULL)
       memcpy (packet -> data, data, dataLength);
@@ -38,8 +85,26 @@ enet_packet_create (const void * data, size_t dataLength, enet_uint32 flags)
 void
 enet_packet_destroy (ENetPacket * packet)
 {
-    enet_free (packet -> data);
-    enet_free (packet);
+    if (! (packet -> flags & ENET_PACKET_FLAG_SLAB))
+    {
+       enet_free (packet -> data);
+       enet_free (packet);
+       return;
+    }
+
+    if (packet -> data != enet_packet_slab_data (packet))
+      enet_free (packet -> data);
+
+    if (freeSlabCount >= ENET_PACKET_SLAB_CACHE)
+    {
+       enet_free (packet);
+       return;
+    }
+
+    ENetPacketSlab * slab = (ENetPacketSlab *) packet;
+    slab -> next = freeSlabs;
+    freeSlabs = slab;
+    ++ freeSlabCount;
 }
 
 /** Attempts to resize the data in the packet to length specified in the
@@ -53,7 +118,10 @@ enet_packet_resize (ENetPacket * packet, size_t dataLength)
 {
     enet_uint8 * newData;
 
-    if (dataLength <= packet -> dataLength)
+    if (dataLength <= packet -> dataLength ||
+        (packet -> data == enet_packet_slab_data (packet) &&
+         (packet -> flags & ENET_PACKET_FLAG_SLAB) &&
+         dataLength <= ENET_PACKET_SLAB_DATA))
     {
        packet -> dataLength = dataLength;
 
@@ -62,7 +130,9 @@ enet_packet_resize (ENetPacket * packet, size_t dataLength)
 
     newData = (enet_uint8 *) enet_malloc (dataLength);
     memcpy (newData, packet -> data, packet -> dataLength);
-    enet_free (packet -> data);
+    if (packet -> data != enet_packet_slab_data (packet) ||
+        ! (packet -> flags & ENET_PACKET_FLAG_SLAB))
+      enet_free (packet -> data);
 
     packet -> data = newData;
     packet -> dataLength = dataLength;
@@ -70,4 +140,17 @@ enet_packet_resize (ENetPacket * packet, size_t dataLength)
     return 0;
 }
 
+/** Frees the cached slabs */
+void
+enet_packet_pool_clear (void)
+{
+    while (freeSlabs != NULL)
+    {
+       ENetPacketSlab * slab = freeSlabs;
+       freeSlabs = slab -> next;
+       enet_free (slab);
+    }
+    freeSlabCount = 0;
+}
+
 /** @} */
@@ -119,7 +119,7 @@ enet_peer_send (ENetPeer * peer, enet_uint8 channelID, ENetPacket * packet)
              fragmentNumber,
              fragmentOffset;
 
-      packet -> flags = ENET_PACKET_FLAG_RELIABLE;
+      packet -> flags |= ENET_PACKET_FLAG_RELIABLE;
 
       for (fragmentNumber = 0,
              fragmentOffset = 0;
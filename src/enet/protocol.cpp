@@ -771,30 +771,41 @@ enet_protocol_handle_incoming_commands (ENetHost * host, ENetEvent * event)
 }
 
 static int
-enet_protocol_receive_incoming_commands (ENetHost * host, ENetEvent * event)
+enet_protocol_handle_receive_batch (ENetHost * host, ENetEvent * event)
 {
-    for (;;)
+    while (host -> receiveBatchIndex < host -> receiveBatchCount)
     {
-       int receivedLength;
-       ENetBuffer buffer;
+       size_t index = host -> receiveBatchIndex ++;
 
-       buffer.data = host -> receivedData;
-       buffer.dataLength = sizeof (host -> receivedData);
+       host -> receivedAddress = host -> receiveBatchAddresses [index];
+       host -> receivedData = host -> receiveBatchData [index];
+       host -> receivedDataLength = host -> receiveBatchBuffers [index].dataLength;
 
-       receivedLength = enet_socket_receive (host -> socket,
-                                             & host -> receivedAddress,
-                                             & buffer,
-                                             1);
+       switch (enet_protocol_handle_incoming_commands (host, event))
+       {
+       case 1:
+          return 1;
 
-       if (receivedLength < 0)
-         return -1;
+       case -1:
+          return -1;
 
-       if (receivedLength == 0)
-         return 0;
+       default:
+          break;
+       }
+    }
 
-       host -> receivedDataLength = receivedLength;
+    return 0;
+}
 
-       switch (enet_protocol_handle_incoming_commands (host, event))
+static int
+enet_protocol_receive_incoming_commands (ENetHost * host, ENetEvent * event)
+{
+    for (;;)
+    {
+       int receivedCount;
+       size_t i;
+
+       switch (enet_protocol_handle_receive_batch (host, event))
        {
        case 1:
           return 1;
@@ -805,6 +816,26 @@ enet_protocol_receive_incoming_commands (ENetHost * host, ENetEvent * event)
        default:
           break;
        }
+
+       for (i = 0; i < ENET_HOST_DATAGRAM_BATCH; ++ i)
+       {
+          host -> receiveBatchBuffers [i].data = host -> receiveBatchData [i];
+          host -> receiveBatchBuffers [i].dataLength = sizeof (host -> receiveBatchData [i]);
+       }
+
+       receivedCount = enet_socket_receive_batch (host -> socket,
+                                                  host -> receiveBatchAddresses,
+                                                  host -> receiveBatchBuffers,
+                                                  ENET_HOST_DATAGRAM_BATCH);
+
+       if (receivedCount < 0)
+         return -1;
+
+       if (receivedCount == 0)
+         return 0;
+
+       host -> receiveBatchCount = receivedCount;
+       host -> receiveBatchIndex = 0;
     }
 
     return -1;
@@ -1068,6 +1099,48 @@ enet_protocol_send_reliable_outgoing_commands (ENetHost * host, ENetPeer * peer)
     host -> bufferCount = buffer - host -> buffers;
 }
 
+static int
+enet_protocol_flush_send_batch (ENetHost * host)
+{
+    int sentCount;
+
+    if (host -> sendBatchCount == 0)
+      return 0;
+
+    sentCount = enet_socket_send_batch (host -> socket,
+                                        host -> sendBatchAddresses,
+                                        host -> sendBatchBuffers,
+                                        host -> sendBatchCount);
+
+    host -> sendBatchCount = 0;
+
+    return sentCount < 0 ? -1 : 0;
+}
+
+/* the buffers point to commands and packet data that are released once the
+   peer is done, so the datagram is gathered into the send batch right away */
+static int
+enet_protocol_queue_datagram (ENetHost * host, const ENetAddress * address)
+{
+    enet_uint8 * data = host -> sendBatchData [host -> sendBatchCount];
+    size_t dataLength = 0, i;
+
+    for (i = 0; i < host -> bufferCount; ++ i)
+    {
+       memcpy (data + dataLength, host -> buffers [i].data, host -> buffers [i].dataLength);
+       dataLength += host -> buffers [i].dataLength;
+    }
+
+    host -> sendBatchAddresses [host -> sendBatchCount] = * address;
+    host -> sendBatchBuffers [host -> sendBatchCount].data = data;
+    host -> sendBatchBuffers [host -> sendBatchCount].dataLength = dataLength;
+
+    if (++ host -> sendBatchCount < ENET_HOST_DATAGRAM_BATCH)
+      return 0;
+
+    return enet_protocol_flush_send_batch (host);
+}
+
 static int
 enet_protocol_send_outgoing_commands (ENetHost * host, ENetEvent * event, int checkForTimeouts)
 {
@@ -1099,7 +1172,11 @@ enet_protocol_send_outgoing_commands (ENetHost * host, ENetEvent * event, int ch
                 enet_list_empty (& currentPeer -> sentReliableCommands) == 0 &&
                 ENET_TIME_GREATER_EQUAL (timeCurrent, currentPeer -> nextTimeout) &&
                 enet_protocol_check_timeouts (host, currentPeer, event) == 1)
+            {
+              enet_protocol_flush_send_batch (host);
+
               return 1;
+            }
         }
         if (enet_list_empty (& currentPeer -> outgoingReliableCommands) == 0)
           enet_protocol_send_reliable_outgoing_commands (host, currentPeer);
@@ -1167,7 +1244,7 @@ enet_protocol_send_outgoing_commands (ENetHost * host, ENetEvent * event, int ch
 
         ++ packetsSent;
 
-        sentLength = enet_socket_send (host -> socket, & currentPeer -> address, host -> buffers, host -> bufferCount);
+        sentLength = enet_protocol_queue_datagram (host, & currentPeer -> address);
 
         enet_protocol_remove_sent_unreliable_commands (currentPeer);
 
@@ -1175,7 +1252,7 @@ enet_protocol_send_outgoing_commands (ENetHost * host, ENetEvent * event, int ch
           return -1;
     }
 
-    return 0;
+    return enet_protocol_flush_send_batch (host);
 }
 
 /** Sends any queued packets on the host specified to its designated peers.
@@ -1192,6 +1269,57 @@ enet_host_flush (ENetHost * host)
     enet_protocol_send_outgoing_commands (host, NULL, 0);
 }
 
+/** Checks for any queued events on the host and dispatches one if available.
+    Datagrams left over from the last batched receive are handled as well, but
+    the socket is not polled.
+
+    @param host    host to check for events
+    @param event   an event structure where event details will be placed if available
+    @retval > 0 if an event was dispatched
+    @retval 0 if no events are available
+    @retval < 0 on failure
+    @ingroup host
+*/
+int
+enet_host_check_events (ENetHost * host, ENetEvent * event)
+{
+    event -> type = ENET_EVENT_TYPE_NONE;
+    event -> peer = NULL;
+    event -> packet = NULL;
+
+    timeCurrent = enet_time_get ();
+
+    switch (enet_protocol_dispatch_incoming_commands (host, event))
+    {
+    case 1:
+       return 1;
+
+    case -1:
+       perror ("Error dispatching incoming packets");
+
+       return -1;
+
+    default:
+       break;
+    }
+
+    switch (enet_protocol_handle_receive_batch (host, event))
+    {
+    case 1:
+       return 1;
+
+    case -1:
+       perror ("Error receiving incoming packets");
+
+       return -1;
+
+    default:
+       break;
+    }
+
+    return enet_protocol_dispatch_incoming_commands (host, event);
+}
+
 /** Waits for events on the host specified and shuttles packets between
     the host and its peers.
 
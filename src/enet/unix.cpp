@@ -4,6 +4,10 @@
 */
 #ifndef WIN32
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* recvmmsg and sendmmsg */
+#endif
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
@@ -45,6 +49,7 @@ enet_initialize (void)
 void
 enet_deinitialize (void)
 {
+    enet_packet_pool_clear ();
 }
 
 enet_uint32
@@ -308,6 +313,135 @@ enet_socket_receive (ENetSocket socket,
 #endif
 }
 
+/* one datagram per buffer. on linux a single syscall moves the whole batch,
+   elsewhere the datagrams go through the regular functions one by one */
+int
+enet_socket_send_batch (ENetSocket socket,
+                        const ENetAddress * addresses,
+                        const ENetBuffer * buffers,
+                        size_t count)
+{
+#if defined(__linux__) && !defined(EMSCRIPTEN)
+    struct mmsghdr msgHdrs [ENET_HOST_DATAGRAM_BATCH];
+    struct sockaddr_in sins [ENET_HOST_DATAGRAM_BATCH];
+    size_t i;
+    int sentCount;
+
+    if (count > ENET_HOST_DATAGRAM_BATCH)
+      count = ENET_HOST_DATAGRAM_BATCH;
+
+    memset (msgHdrs, 0, count * sizeof (struct mmsghdr));
+
+    for (i = 0; i < count; ++ i)
+    {
+        sins [i].sin_family = AF_INET;
+        sins [i].sin_port = ENET_HOST_TO_NET_16 (addresses [i].port);
+        sins [i].sin_addr.s_addr = addresses [i].host;
+
+        msgHdrs [i].msg_hdr.msg_name = & sins [i];
+        msgHdrs [i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+        msgHdrs [i].msg_hdr.msg_iov = (struct iovec *) & buffers [i];
+        msgHdrs [i].msg_hdr.msg_iovlen = 1;
+    }
+
+    sentCount = sendmmsg (socket, msgHdrs, count, MSG_NOSIGNAL);
+
+    if (sentCount == -1)
+    {
+       if (errno == EWOULDBLOCK)
+         return 0;
+
+       return -1;
+    }
+
+    return sentCount;
+#else
+    size_t i;
+
+    for (i = 0; i < count; ++ i)
+    {
+        int sentLength = enet_socket_send (socket, & addresses [i], & buffers [i], 1);
+
+        if (sentLength < 0)
+          return -1;
+
+        if (sentLength == 0)
+          break;
+    }
+
+    return (int) i;
+#endif
+}
+
+/* the buffer lengths are set to the sizes of the received datagrams */
+int
+enet_socket_receive_batch (ENetSocket socket,
+                           ENetAddress * addresses,
+                           ENetBuffer * buffers,
+                           size_t count)
+{
+#if defined(__linux__) && !defined(EMSCRIPTEN)
+    struct mmsghdr msgHdrs [ENET_HOST_DATAGRAM_BATCH];
+    struct sockaddr_in sins [ENET_HOST_DATAGRAM_BATCH];
+    size_t i;
+    int recvCount;
+
+    if (count > ENET_HOST_DATAGRAM_BATCH)
+      count = ENET_HOST_DATAGRAM_BATCH;
+
+    memset (msgHdrs, 0, count * sizeof (struct mmsghdr));
+
+    for (i = 0; i < count; ++ i)
+    {
+        msgHdrs [i].msg_hdr.msg_name = & sins [i];
+        msgHdrs [i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+        msgHdrs [i].msg_hdr.msg_iov = (struct iovec *) & buffers [i];
+        msgHdrs [i].msg_hdr.msg_iovlen = 1;
+    }
+
+    recvCount = recvmmsg (socket, msgHdrs, count, MSG_NOSIGNAL | MSG_DONTWAIT, NULL);
+
+    if (recvCount == -1)
+    {
+       if (errno == EWOULDBLOCK)
+         return 0;
+
+       return -1;
+    }
+
+    for (i = 0; i < (size_t) recvCount; ++ i)
+    {
+#ifdef HAS_MSGHDR_FLAGS
+        if (msgHdrs [i].msg_hdr.msg_flags & MSG_TRUNC)
+          return -1;
+#endif
+
+        addresses [i].host = (enet_uint32) sins [i].sin_addr.s_addr;
+        addresses [i].port = ENET_NET_TO_HOST_16 (sins [i].sin_port);
+        buffers [i].dataLength = msgHdrs [i].msg_len;
+    }
+
+    return recvCount;
+#else
+    size_t i;
+
+    for (i = 0; i < count; ++ i)
+    {
+        int recvLength = enet_socket_receive (socket, & addresses [i], & buffers [i], 1);
+
+        if (recvLength < 0)
+          return -1;
+
+        if (recvLength == 0)
+          break;
+
+        buffers [i].dataLength = recvLength;
+    }
+
+    return (int) i;
+#endif
+}
+
 int
 enet_socket_wait (ENetSocket socket, enet_uint32 * condition, enet_uint32 timeout)
 {
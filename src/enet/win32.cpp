@@ -32,6 +32,7 @@ enet_initialize (void)
 void
 enet_deinitialize (void)
 {
+    enet_packet_pool_clear ();
     timeEndPeriod (1);
 
     WSACleanup ();
@@ -252,6 +253,53 @@ enet_socket_receive (ENetSocket socket,
     return (int) recvLength;
 }
 
+int
+enet_socket_send_batch (ENetSocket socket,
+                        const ENetAddress * addresses,
+                        const ENetBuffer * buffers,
+                        size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++ i)
+    {
+        int sentLength = enet_socket_send (socket, & addresses [i], & buffers [i], 1);
+
+        if (sentLength < 0)
+          return -1;
+
+        if (sentLength == 0)
+          break;
+    }
+
+    return (int) i;
+}
+
+/* the buffer lengths are set to the sizes of the received datagrams */
+int
+enet_socket_receive_batch (ENetSocket socket,
+                           ENetAddress * addresses,
+                           ENetBuffer * buffers,
+                           size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++ i)
+    {
+        int recvLength = enet_socket_receive (socket, & addresses [i], & buffers [i], 1);
+
+        if (recvLength < 0)
+          return -1;
+
+        if (recvLength == 0)
+          break;
+
+        buffers [i].dataLength = recvLength;
+    }
+
+    return (int) i;
+}
+
 int
 enet_socket_wait (ENetSocket socket, enet_uint32 * condition, enet_uint32 timeout)
 {
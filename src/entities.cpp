@@ -5,6 +5,7 @@
  -------------------------------------------------------------------------*/
 #include "mini.q.hpp"
 #include "base/vector.hpp"
+#include "base/flat_map.hpp"
 
 namespace q {
 namespace game {
@@ -13,12 +14,58 @@ vector<game::entity> ents; // all entities
 dynent *player1 = newdynent(); // our client
 dvector players; // other clients
 
-void cleanentities(void) {
-  FREE(player1);
-  loopv(players) {
-    FREE(players[i]);
-    players[i] = NULL;
+// map entities are chained by cells of their x and y. the grid is built on
+// map start and again once the entities are added or edited
+static const int ENTCELLSHIFT = 3;
+static flat_map<u64,u32> entcells; // first entity of the cell
+static vector<u32> entnext; // next one in the same cell
+static bool entgridvalid = false;
+
+static INLINE u64 entcell(int x, int y) {
+  return u64(u32(x>>ENTCELLSHIFT))<<32 | u64(u32(y>>ENTCELLSHIFT));
+}
+
+void invalidateentgrid(void) { entgridvalid = false; }
+
+static void buildentgrid(void) {
+  entcells.clear();
+  entnext.setsize(ents.length());
+  loopvrev(ents) {
+    const auto &e = ents[i];
+    if (e.type==NOTUSED) {
+      entnext[i] = ~0u;
+      continue;
+    }
+    auto &head = entcells.insert(makepair(entcell(e.x, e.y), ~0u)).first->second;
+    entnext[i] = head;
+    head = i;
+  }
+  entgridvalid = true;
+}
+
+u32 nearents(const vec3f &o, float radius, u32 *out, u32 maxnum) {
+  if (!entgridvalid || entnext.length()!=ents.length()) buildentgrid();
+  const int x0 = int(floor(o.x-radius)), x1 = int(ceil(o.x+radius));
+  const int y0 = int(floor(o.y-radius)), y1 = int(ceil(o.y+radius));
+  u32 num = 0;
+  for (int y = y0>>ENTCELLSHIFT; y <= y1>>ENTCELLSHIFT; ++y)
+  for (int x = x0>>ENTCELLSHIFT; x <= x1>>ENTCELLSHIFT; ++x) {
+    const auto it = entcells.find(entcell(x<<ENTCELLSHIFT, y<<ENTCELLSHIFT));
+    if (it == entcells.end()) continue;
+    for (auto i = it->second; i != ~0u; i = entnext[i]) {
+      if (num == maxnum) return num;
+      out[num++] = i;
+    }
   }
+  return num;
+}
+
+void cleanentities(void) {
+  zapdynent(player1);
+  loopv(players) zapdynent(players[i]);
+  entcells.destroy();
+  entnext.destroy();
+  entgridvalid = false;
 }
 
 #if 0
@@ -206,9 +253,11 @@ void pickup(int n, game::dynent *d) {
 
 void checkitems(void) {
   if (edit::mode()) return;
-  loopv(ents) {
+  u32 near[MAXNEARENTS];
+  const auto num = nearents(player1->o, 4.f, near, MAXNEARENTS);
+  loopj(s32(num)) {
+    const int i = near[j];
     entity &e = ents[i];
-    if (e.type==NOTUSED) continue;
     if (!ents[i].spawned && e.type!=TELEPORT && e.type!=JUMPPAD) continue;
     const vec3f v(float(e.x), float(e.y), player1->eyeheight);
     const float dist = distance(player1->o, v);
@@ -101,6 +101,11 @@ void renderentities(void);
 void resetspawns(void);
 void setspawn(u32 i, bool on);
 void teleport(int n, dynent *d);
+// indices of the map entities whose x and y may be within radius of o
+static const u32 MAXNEARENTS = 64;
+u32 nearents(const vec3f &o, float radius, u32 *out, u32 maxnum);
+// the entities changed, the grid is rebuilt by the next query
+void invalidateentgrid(void);
 void baseammo(int gun);
 } /* namespace game */
 } /* namespace q */
@@ -5,6 +5,7 @@
 #if !defined(STANDALONE)
 #include "mini.q.hpp"
 #include "enet/enet.h"
+#include "base/profiler.hpp"
 
 namespace q {
 namespace game {
@@ -129,8 +130,68 @@ static void spawnstate(dynent *d) {
     d->ammo[GUN_SG] = 5;
 }
 
+// dynents live in chunks that never move so pointers to them stay valid and
+// the live ones are also listed densely. a handle is a slot and the stamp of
+// the allocation in it: stamps are never reused so a handle to a zapped
+// dynent never finds the one taking its slot. only pods here since player1
+// is allocated during static initialization
+static const u32 DYNCHUNKSIZE = 64;
+struct dynslot { u32 stamp, dense; };
+static dynent **dynchunks = NULL;
+static dynslot *dynslots = NULL;
+static u32 *dynfree = NULL, *dyndense = NULL;
+static u32 dynchunknum = 0, dynfreenum = 0, dyndensenum = 0, dynstamp = 0;
+
+static void growdynents() {
+  const auto slotnum = (dynchunknum+1)*DYNCHUNKSIZE;
+  dynchunks = (dynent**) REALLOC(dynchunks, (dynchunknum+1)*sizeof(dynent*));
+  dynchunks[dynchunknum] = (dynent*) MALLOC(DYNCHUNKSIZE*sizeof(dynent));
+  dynslots = (dynslot*) REALLOC(dynslots, slotnum*sizeof(dynslot));
+  dynfree = (u32*) REALLOC(dynfree, slotnum*sizeof(u32));
+  dyndense = (u32*) REALLOC(dyndense, slotnum*sizeof(u32));
+  // lowest slots are popped first to keep the chunks packed
+  for (u32 i = slotnum; i > slotnum-DYNCHUNKSIZE; --i) {
+    dynslots[i-1].stamp = 0;
+    dynfree[dynfreenum++] = i-1;
+  }
+  ++dynchunknum;
+}
+
+static u32 dynentslot(const dynent *d) {
+  loopi(s32(dynchunknum)) {
+    const auto chunk = dynchunks[i];
+    if (d >= chunk && d < chunk+DYNCHUNKSIZE) return u32(i)*DYNCHUNKSIZE + u32(d-chunk);
+  }
+  assert(false && "dynent not allocated with newdynent");
+  return ~0u;
+}
+
+static INLINE dynent *slotdynent(u32 slot) {
+  return dynchunks[slot/DYNCHUNKSIZE] + slot%DYNCHUNKSIZE;
+}
+
+dynhandle gethandle(const dynent *d) {
+  const auto slot = dynentslot(d);
+  const dynhandle h = {slot, dynslots[slot].stamp};
+  return h;
+}
+
+dynent *getdynent(dynhandle h) {
+  if (h.stamp == 0 || h.slot >= dynchunknum*DYNCHUNKSIZE) return NULL;
+  return dynslots[h.slot].stamp == h.stamp ? slotdynent(h.slot) : NULL;
+}
+
+u32 dynentnum() { return dyndensenum; }
+dynent *dynentat(u32 idx) { return slotdynent(dyndense[idx]); }
+
 dynent *newdynent() {
-  dynent *d = (dynent*) MALLOC(sizeof(dynent));
+  if (dynfreenum == 0) growdynents();
+  const auto slot = dynfree[--dynfreenum];
+  if (++dynstamp == 0) ++dynstamp;
+  dynslots[slot].stamp = dynstamp;
+  dynslots[slot].dense = dyndensenum;
+  dyndense[dyndensenum++] = slot;
+  dynent *d = slotdynent(slot);
   d->o = zero;
   d->ypr = vec3f(270.f,0.f,0.f);
   d->maxspeed = 22.f;
@@ -201,8 +262,27 @@ void arenarespawn() {
 }
 
 void zapdynent(dynent *&d) {
-  if (d) FREE(d);
+  if (d == NULL) return;
+  const auto slot = dynentslot(d);
+  const auto dense = dynslots[slot].dense;
+  const auto last = dyndense[--dyndensenum];
+  dyndense[dense] = last;
+  dynslots[last].dense = dense;
+  dynslots[slot].stamp = 0;
+  dynfree[dynfreenum++] = slot;
   d = NULL;
+
+  // give the storage back once everything is gone. stamps keep counting
+  if (dyndensenum != 0) return;
+  loopi(s32(dynchunknum)) FREE(dynchunks[i]);
+  FREE(dynchunks);
+  FREE(dynslots);
+  FREE(dynfree);
+  FREE(dyndense);
+  dynchunks = NULL;
+  dynslots = NULL;
+  dynfree = dyndense = NULL;
+  dynchunknum = dynfreenum = 0;
 }
 
 static void otherplayers() {
@@ -212,6 +292,8 @@ static void otherplayers() {
       players[i]->state = CS_LAGGED;
       continue;
     }
+    if (players[i]->state!=CS_DEAD && client::interpolate(i, players[i]))
+      continue;
     // use physics to extrapolate player position
     if (lagtime && players[i]->state != CS_DEAD &&
       (!demo::playing() || i!=demo::clientnum()))
@@ -244,6 +326,14 @@ static void sleepf(const char *msec, const char *cmd) {
 }
 CMDN(sleep, sleepf);
 
+PROFILE_PHASE(PHASE_PHYSICS, "physics");
+PROFILE_PHASE(PHASE_PROJECTILES, "projectiles");
+PROFILE_PHASE(PHASE_DEMO, "demo");
+PROFILE_PHASE(PHASE_NETWORK, "network");
+PROFILE_PHASE(PHASE_OTHERPLAYERS, "otherplayers");
+PROFILE_PHASE(PHASE_MONSTERS, "monsters");
+PROFILE_PHASE(PHASE_PLAYER, "player");
+
 void updateworld(int millis) {
   if (lastmillis()) {
     setcurtime(millis - lastmillis());
@@ -251,46 +341,69 @@ void updateworld(int millis) {
       sleepwait = 0;
       script::execstring(sleepcmd.c_str());
     }
-    physics::frame();
+    {
+      PROFILE(PHASE_PHYSICS);
+      physics::frame();
+    }
     checkquad(int(curtime()));
     if (m_arena)
       arenarespawn();
-    moveprojectiles(float(curtime()));
-    demo::playbackstep();
+    {
+      PROFILE(PHASE_PROJECTILES);
+      moveprojectiles(float(curtime()));
+    }
+    {
+      PROFILE(PHASE_DEMO);
+      demo::playbackstep();
+    }
     if (!demo::playing()) {
       if (client::getclientnum()>=0)
         shoot(player1, worldpos_); // only shoot when connected to server
       // do this first, so we have most accurate information when our player
       // moves
+      PROFILE(PHASE_NETWORK);
       client::gets2c();
     }
-    otherplayers();
+    {
+      PROFILE(PHASE_OTHERPLAYERS);
+      otherplayers();
+    }
     if (!demo::playing()) {
-      monsterthink();
+      {
+        PROFILE(PHASE_MONSTERS);
+        monsterthink();
+      }
       if (player1->state==CS_DEAD) {
+        PROFILE(PHASE_PLAYER);
         if (lastmillis()-player1->lastaction<2000) {
           player1->move = player1->strafe = 0;
           physics::moveplayer(player1, 10, false);
         } else if (!m_arena && !m_sp && lastmillis()-player1->lastaction>10000)
           respawn();
       } else if (!intermission) {
+        PROFILE(PHASE_PLAYER);
         physics::moveplayer(player1, 20, true);
         checkitems();
       }
       // do this last, to reduce the effective frame lag
+      PROFILE(PHASE_NETWORK);
       client::c2sinfo(player1);
     }
   }
   setlastmillis(millis);
 }
 
+// the spots the occupancy finds in the air are tried first. the complete
+// collision only runs on them and then, if none fits, on any spot
 void entinmap(dynent *d) {
-  loopi(100) { // try max 100 times
+  const auto passnum = physics::hasoccupancy() ? 2 : 1;
+  loopj(passnum) loopi(100) { // try max 100 times
     float dx = (rnd(21)-10)/10.0f*i;  // increasing distance
     float dy = (rnd(21)-10)/10.0f*i;
     d->o.x += dx;
     d->o.y += dy;
-    if (physics::collide(d, true)) return;
+    const auto tried = j == passnum-1 || physics::mapempty(getaabb(d));
+    if (tried && physics::collide(d, true)) return;
     d->o.x -= dx;
     d->o.y -= dy;
   }
@@ -451,6 +564,7 @@ void startmap(const char *name) {
   player1->frags = 0;
   loopv(players) if (players[i]) players[i]->frags = 0;
   resetspawns();
+  invalidateentgrid();
   strcpy_s(clientmap, name);
   if (edit::mode()) edit::toggleedit();
   script::execstring("q.gamespeed=100");
@@ -464,7 +578,33 @@ void startmap(const char *name) {
 static const int frame[] = {178, 184, 190, 137, 183, 189, 197, 164, 46, 51, 54, 32, 0,  0, 40, 1,  162, 162, 67, 168};
 static const int range[] = {6,   6,   8,   28,  1,   1,   1,   1,   8,  19, 4,  18, 40, 1, 6,  15, 1,   1,   1,  1  };
 
-void renderclient(dynent *d, bool team, const char *mdlname, bool hellpig, float scale) {
+// models stick out of the physics box a bit
+static INLINE aabb modelbox(const dynent *d) {
+  auto box = getaabb(d);
+  box.pmin -= vec3f(d->radius);
+  box.pmax += vec3f(d->radius);
+  return box;
+}
+
+// the boxes of all the candidates are frustum culled in one batch before any
+// model is queued
+static vector<aabb> modelboxes;
+static vector<bool> modelinside, modelvisible;
+
+const bool *cullmodels(const dvector &v) {
+  modelboxes.setsize(0);
+  loopv(v) if (v[i]) modelboxes.add(modelbox(v[i]));
+  modelinside.setsize(modelboxes.length());
+  if (modelboxes.length() != 0)
+    rr::cullboxes(&modelboxes[0], u32(modelboxes.length()), &modelinside[0]);
+  modelvisible.setsize(v.length());
+  auto box = 0;
+  loopv(v) modelvisible[i] = v[i] != NULL && modelinside[box++];
+  return modelvisible.getbuf();
+}
+
+void renderclient(dynent *d, bool team, md2::handle mdl, bool hellpig, float scale) {
+  if (!hellpig && rr::occluded(modelbox(d))) return;
   int n = 3;
   auto speed = 100.0f;
   auto my = d->o.y-d->eyeheight+1.55f*scale;
@@ -512,15 +652,16 @@ void renderclient(dynent *d, bool team, const char *mdlname, bool hellpig, float
   const auto posxfm = ogl::matrix(ogl::MODELVIEW)
                     * mat4x4f::translate(vec3f(d->o.x, my, d->o.z))
                     * mat4x4f(norxfm);
-  md2::render(mdlname, frame[n], range[n], posxfm, norxfm, team, scale, speed, 0, float(basetime));
+  md2::render(mdl, frame[n], range[n], posxfm, norxfm, team, scale, speed, 0, float(basetime));
 }
 
 void renderclients() {
-  dynent *d;
+  static const auto mdl = md2::gethandle(istring("monster/ogro"));
+  const auto visible = cullmodels(players);
   loopv(players)
-    if ((d = players[i]) && (!demo::playing() || i!=demo::clientnum()))
-      renderclient(d, isteam(player1->team.c_str(), d->team.c_str()),
-                   "monster/ogro", false, 1.f);
+    if (visible[i] && (!demo::playing() || i!=demo::clientnum()))
+      renderclient(players[i], isteam(player1->team.c_str(), players[i]->team.c_str()),
+                   mdl, false, 1.f);
 }
 
 struct sline { fixedstring s; };
@@ -4,6 +4,7 @@
  -------------------------------------------------------------------------*/
 #pragma once
 #include "entities.hpp"
+#include "md2.hpp"
 #include "base/sys.hpp"
 
 namespace q {
@@ -51,6 +52,13 @@ void initclient(void);
 void spawnplayer(dynent *d);
 void selfdamage(int damage, int actor, dynent *act);
 dynent *newdynent(void);
+// stable reference to a dynent. stamp is zero for no dynent
+struct dynhandle { u32 slot, stamp; };
+dynhandle gethandle(const dynent *d);
+dynent *getdynent(dynhandle h); // NULL once the dynent is zapped
+// all the live dynents, packed in their chunks. zapping reorders them
+u32 dynentnum(void);
+dynent *dynentat(u32 idx);
 const char *getclientmap(void);
 const char *modestr(int n);
 void zapdynent(dynent *&d);
@@ -61,7 +69,10 @@ void fixplayer1range(void);
 void entinmap(dynent *d);
 void startmap(const char *name);
 void renderclients(void);
-void renderclient(dynent *d, bool team, const char *name, bool hellpig, float scale);
+void renderclient(dynent *d, bool team, md2::handle mdl, bool hellpig, float scale);
+// frustum cull the models of all the entities at once. the flags stay valid
+// until the next call. null entities are not visible
+const bool *cullmodels(const dvector &v);
 void renderscores(void);
 void cleanentities(void);
 void cleanmonsters(void);
@@ -7,7 +7,10 @@
 #include "iso.hpp"
 #include "base/task.hpp"
 #include "base/vector.hpp"
+#include "base/heap.hpp"
+#include "base/atomics.hpp"
 #include "base/console.hpp"
+#include "base/profiler.hpp"
 
 namespace q {
 namespace geom {
@@ -16,10 +19,19 @@ template <typename T>
 INLINE bool isdegenerated(T a, T b, T c) { return a==b || a==c || b==c; }
 
 void mesh::destroy() {
+  if (m_mapping) {
+    sys::unmapfile(m_mapping, m_mappingsize);
+    ZERO(this);
+    return;
+  }
   if (m_pos) {FREE(m_pos); m_pos=NULL;}
   if (m_nor) {FREE(m_nor); m_nor=NULL;}
   if (m_index) {FREE(m_index); m_index=NULL;}
   if (m_segment) {FREE(m_segment); m_segment=NULL;}
+  if (m_chunk) {FREE(m_chunk); m_chunk=NULL;}
+  if (m_meshlet) {FREE(m_meshlet); m_meshlet=NULL;}
+  if (m_bvh) {FREE(m_bvh); m_bvh=NULL; m_bvhsize=0;}
+  if (m_occupancy) {FREE(m_occupancy); m_occupancy=NULL; m_occupancysize=0;}
 }
 
 // error below which we merge vertices
@@ -36,6 +48,12 @@ static const float MIN_EDGE_FACTOR = 1.f/8.f;
 
 // number of iterations of decimations
 static const u32 DECIMATION_NUM = 2;
+PROFILE_PHASE(PHASE_BUILDMESH, "buildmesh");
+PROFILE_PHASE(PHASE_SHARPEN, "sharpen");
+static const u32 PHASE_DECIMATE[DECIMATION_NUM] = {
+  profiler::phase("decimate0"),
+  profiler::phase("decimate1")
+};
 
 // we have to choose between this two meshes and take the one that does not self
 // intersect
@@ -59,32 +77,41 @@ static INLINE const quadmesh &findbestmesh(iso::octree::qefpoint **pt) {
  - build a regular "to-process" mesh from the qef points and quads
  -------------------------------------------------------------------------*/
 struct procmesh {
+  INLINE procmesh() : chunknum(0) {}
   vector<vec3f> pos, nor;
-  vector<u32> idx, mat;
+  vector<u32> idx, mat, chunk;
   vector<int> vidx;
   vector<pair<int,int>> vtri;
+  vector<int> gid; // index in the full mesh of vertices shared by partitions
   INLINE int trinum() const {return idx.length()/3;}
+  u32 chunknum;
 };
 
-static void buildmesh(const iso::octree &o, const iso::octree::node &node, procmesh &pm) {
-  if (!node.isleaf) {
-    loopi(8) buildmesh(o, node.children[i], pm);
-    return;
-  } else if (node.leaf == NULL)
-    return;
-
+static void buildmesh(const iso::octree &o, const iso::octree::linearleaf &node,
+                      procmesh &pm, u32 lod, u32 chunk) {
 #if DEBUGOCTREE
   bool missingpoint = false;
 #endif /* DEBUGOCTREE */
 
-  loopv(node.leaf->quads) {
+  // quad corners are in the leaf or in one of its 26 neighbors
+  const auto leafdim = int(o.m_leafdim);
+  const iso::octree::linearleaf *neighbors[27];
+  loopi(27) {
+    const auto offset = vec3i(i%3-1, (i/3)%3-1, i/9-1) * leafdim;
+    neighbors[i] = o.findleaf(node.org+offset);
+  }
+
+  const auto &leafdata = node.leaf[lod];
+  loopi(leafdata.quadnum) {
     // get four points
-    const auto &q = node.leaf->quads[i];
+    const auto &q = leafdata.quads[i];
     const auto quadmat = q.matindex;
     iso::octree::qefpoint *pt[4];
     loopk(4) {
-      const auto ipos = vec3i(q.index[k]) + node.org;
-      const auto leaf = o.findleaf(ipos);
+      const auto local = vec3i(q.index[k]);
+      const auto ipos = local + node.org;
+      const auto n = (local+leafdim)/leafdim;
+      const auto leaf = all(lt(n,vec3i(3))) ? neighbors[n.x+3*n.y+9*n.z] : o.findleaf(ipos);
 
 #if DEBUGOCTREE
       if (leaf == NULL || leaf->leaf == NULL) {
@@ -96,8 +123,8 @@ static void buildmesh(const iso::octree &o, const iso::octree::node &node, procm
         "leaf node is missing from the octree");
 #endif /* DEBUGOCTREE */
 
-      const auto vidx = ipos % vec3i(iso::SUBGRID);
-      const auto qef = leaf->leaf->get(vidx);
+      const auto vidx = ipos % vec3i(leafdim);
+      const auto qef = leaf->leaf[lod].get(vidx);
       assert(qef != NULL && "point is missing from leaf octree");
       pt[k] = qef;
     }
@@ -116,6 +143,7 @@ static void buildmesh(const iso::octree &o, const iso::octree::node &node, procm
       if (isdegenerated(pt[t[0]],pt[t[1]],pt[t[2]]))
         continue;
       pm.mat.add(quadmat);
+      pm.chunk.add(chunk);
       loopl(3) {
         const auto qef = pt[t[l]];
         if (qef->idx == -1) {
@@ -128,6 +156,21 @@ static void buildmesh(const iso::octree &o, const iso::octree::node &node, procm
   }
 }
 
+// the leaves of a chunk are consecutive in morton order. the triangles are
+// therefore output chunk by chunk
+static void buildmesh(const iso::octree &o, procmesh &pm, u32 lod) {
+  const auto chunkshift = 3*ilog2(max(CHUNKCELLNUM/o.m_leafdim, 1u));
+  u64 chunkkey = 0;
+  loopv(o.m_leaves) {
+    const auto &leaf = o.m_leaves[i];
+    if (i == 0 || (leaf.key >> chunkshift) != chunkkey) {
+      chunkkey = leaf.key >> chunkshift;
+      ++pm.chunknum;
+    }
+    buildmesh(o, leaf, pm, lod, pm.chunknum-1);
+  }
+}
+
 /*-------------------------------------------------------------------------
  - run mesh decimation on a regular "to-process" mesh
  -------------------------------------------------------------------------*/
@@ -136,10 +179,8 @@ struct qemedge {
   INLINE qemedge(int i0, int i1, int mat) : mat(mat), best(0), num(1) {
     idx[0] = i0;
     idx[1] = i1;
-    timestamp[0] = timestamp[1] = 0;
   }
   int idx[2];
-  int timestamp[2];
   int mat;
   int best:1;
   int num:31;
@@ -148,7 +189,6 @@ struct qemedge {
 struct qemheapitem {
   double cost;
   float len2;
-  int idx;
 };
 
 INLINE bool operator< (const qemheapitem &i0, const qemheapitem &i1) {
@@ -162,9 +202,13 @@ struct qemcontext {
   vector<int> vidx;          // list of triangle per vertex
   vector<pair<int,int>> vtri;// <trinum, firstidx> triangle list per vertex
   vector<qef::qem> vqem;     // qem per vertex
+  vector<int> eidx;          // list of edges per vertex
+  vector<pair<int,int>> vedge;// <edgenum, firstidx> edge list per vertex
   vector<qemedge> eqem;      // qem information per edge
-  vector<qemheapitem> heap;  // heap to decimate the mesh
+  indexedheap<qemheapitem> heap; // edges to collapse sorted by cost
   vector<int> mergelist;     // temporary structure when merging triangle lists
+  vector<int> mergeedge;     // temporary structure when merging edge lists
+  vector<bool> locked;       // vertices we cannot move
 };
 
 static void extraplane(const procmesh &pm, const qemedge &edge, int tri,
@@ -267,32 +311,56 @@ static void buildedges(qemcontext &ctx, const procmesh &pm) {
       i0 = i1;
     }
   }
+
+  // vertices of border edges may be locked in place
+  if (ctx.locked.length() == 0) return;
+  loopv(e) if (e[i].num == 1) ctx.locked[e[i].idx[0]] = ctx.locked[e[i].idx[1]] = true;
 }
 
+// evaluate the edge cost and insert, move or remove it from the heap
+static void updateedge(qemcontext &ctx, const procmesh &pm, int idx) {
+  auto &edge = ctx.eqem[idx];
+  const auto idx0 = edge.idx[0], idx1 = edge.idx[1];
+  const auto &p0 = pm.pos[idx0], &p1 = pm.pos[idx1];
+  const auto &q0 = ctx.vqem[idx0], &q1 = ctx.vqem[idx1];
+  const auto best = qef::findbest(q0,q1,p0,p1,QEM_MIN_ERROR);
+  edge.best = best.second;
+  if (best.first > QEM_MIN_ERROR)
+    ctx.heap.remove(idx);
+  else
+    ctx.heap.update(idx, {best.first,distance2(p0,p1)});
+}
+
+// edges are scored in batches with the simd qem evaluation
+static const u32 QEM_BATCH = 256;
+
 static void buildheap(qemcontext &ctx, procmesh &pm) {
-  auto &h = ctx.heap;
   auto &e = ctx.eqem;
-  auto &v = ctx.vqem;
-  auto &p = pm.pos;
-  loopv(e) {
-    const auto idx0 = e[i].idx[0], idx1 = e[i].idx[1];
-    const auto &p0 = p[idx0], &p1 = p[idx1];
-    const auto &q0 = v[idx0], &q1 = v[idx1];
-    const auto best = qef::findbest(q0,q1,p0,p1,QEM_MIN_ERROR);
-    if (best.first > QEM_MIN_ERROR)
-      continue;
-    e[i].best = best.second;
-    h.add({best.first,distance2(p0,p1),i});
+  ctx.heap.init(e.length());
+  int v0[QEM_BATCH], v1[QEM_BATCH];
+  pair<double,int> best[QEM_BATCH];
+  for (int first = 0; first < e.length(); first += QEM_BATCH) {
+    const auto n = min(int(QEM_BATCH), e.length()-first);
+    loopi(n) {
+      v0[i] = e[first+i].idx[0];
+      v1[i] = e[first+i].idx[1];
+    }
+    qef::findbest(&ctx.vqem[0], &pm.pos[0], v0, v1, n,
+                  QEM_MIN_ERROR, QEM_MIN_ERROR, best);
+    loopi(n) {
+      e[first+i].best = best[i].second;
+      if (best[i].first > QEM_MIN_ERROR) continue;
+      const auto &p0 = pm.pos[v0[i]], &p1 = pm.pos[v1[i]];
+      ctx.heap.update(first+i, {best[i].first,distance2(p0,p1)});
+    }
   }
-  h.buildheap();
 }
 
-INLINE int uncollapsedidx(vector<qef::qem> &v, int idx) {
-  while (v[idx].next != -1) idx = v[idx].next;
-  return idx;
-}
-
-static bool merge(qemcontext &ctx, procmesh &pm, const qemedge &edge, int idx0, int idx1) {
+static bool merge(qemcontext &ctx, procmesh &pm, int edgeidx) {
+  const auto &edge = ctx.eqem[edgeidx];
+  const auto idx0 = edge.idx[0], idx1 = edge.idx[1];
+  if (ctx.locked.length() != 0 && (ctx.locked[idx0] || ctx.locked[idx1]))
+    return false;
 
   // first we gather non degenerated triangles from both vertex triangle lists
   ctx.mergelist.setsize(0);
@@ -359,102 +427,97 @@ static bool merge(qemcontext &ctx, procmesh &pm, const qemedge &edge, int idx0,
   ctx.vtri[to].second = ctx.mergelist.length();
 
   // add both qems
-  auto &q0 = ctx.vqem[idx0], &q1 = ctx.vqem[idx1];
-  const auto timestamp0 = q0.timestamp, timestamp1 = q1.timestamp;
-  const auto q = q0+q1;
-  const auto newstamp = max(timestamp0, timestamp1);
-  assert(timestamp0==edge.timestamp[0] && timestamp1==edge.timestamp[1]);
-  if (edge.best == 0) {
-    q0 = q;
-    q1.next = idx0;
-  } else {
-    q1 = q;
-    q0.next = idx1;
-  }
-  q0.timestamp = q1.timestamp = newstamp+1;
+  ctx.vqem[to] = ctx.vqem[idx0] + ctx.vqem[idx1];
+
+  // 'from' edges now point to 'to'. the collapsed edge and the edges that now
+  // duplicate another one are killed (both ends equal) and leave the heap
+  ctx.mergeedge.setsize(0);
+  loopi(2) {
+    const auto first = ctx.vedge[idx[i]].first;
+    const auto n = ctx.vedge[idx[i]].second;
+    loopj(n) {
+      const auto e = ctx.eidx[first+j];
+      auto &curr = ctx.eqem[e];
+      if (curr.idx[0] == curr.idx[1]) continue;
+      loopk(2) if (curr.idx[k] == from) curr.idx[k] = to;
+      const auto o = curr.idx[0] == to ? curr.idx[1] : curr.idx[0];
+      bool duplicated = o == to;
+      loopk(ctx.mergeedge.length()) {
+        const auto &prev = ctx.eqem[ctx.mergeedge[k]];
+        duplicated = duplicated || prev.idx[0] == o || prev.idx[1] == o;
+      }
+      if (duplicated) {
+        curr.idx[0] = curr.idx[1] = to;
+        ctx.heap.remove(e);
+      } else
+        ctx.mergeedge.add(e);
+    }
+  }
+
+  // commit the merged edge list the same way we did for triangles
+  first = -1;
+  loopi(2) if (ctx.vedge[idx[i]].second >= ctx.mergeedge.length()) {
+    first = ctx.vedge[idx[i]].first;
+    break;
+  }
+  if (first == -1) {
+    first = ctx.eidx.length();
+    ctx.eidx.setsize(first+ctx.mergeedge.length());
+  }
+  loopv(ctx.mergeedge) ctx.eidx[first+i] = ctx.mergeedge[i];
+  ctx.vedge[to].first = first;
+  ctx.vedge[to].second = ctx.mergeedge.length();
+  ctx.vedge[from].second = 0;
+
+  // only the costs of the edges around 'to' changed
+  loopv(ctx.mergeedge) updateedge(ctx, pm, ctx.mergeedge[i]);
   return true;
 }
 
 static void decimatemesh(qemcontext &ctx, procmesh &pm, float edgeminlen) {
   auto &heap = ctx.heap;
-  auto &vqem = ctx.vqem;
   auto &eqem = ctx.eqem;
   bool anychange = true;
 
   // first we just remove all edges smaller than the given threshold. we iterate
-  // until there is nothing left to remove
+  // until there is nothing left to remove. merge keeps edge ends and costs up
+  // to date
   while (anychange) {
     anychange = false;
     loopv(eqem) {
-      auto &edge = eqem[i];
-      const auto idx0 = uncollapsedidx(vqem, edge.idx[0]);
-      const auto idx1 = uncollapsedidx(vqem, edge.idx[1]);
-      const auto &p0 = pm.pos[idx0];
-      const auto &p1 = pm.pos[idx1];
+      const auto &edge = eqem[i];
+      const auto idx0 = edge.idx[0], idx1 = edge.idx[1];
 
       // we do not care about this edge if already folded or too big
-      if (idx0 == idx1 || distance(p0,p1) >= edgeminlen) continue;
-
-      // need to update it properly here
-      auto &q0 = vqem[idx0], &q1 = vqem[idx1];
-      if (q0.timestamp != edge.timestamp[0] || q1.timestamp != edge.timestamp[1]) {
-        edge.best = qef::findbest(q0,q1,p0,p1,QEM_MIN_ERROR).second;
-        edge.timestamp[0] = q0.timestamp;
-        edge.timestamp[1] = q1.timestamp;
-      }
-
-      // now we can safely merge it
-      anychange = merge(ctx, pm, edge, idx0, idx1) || anychange;
+      if (idx0 == idx1 || distance(pm.pos[idx0],pm.pos[idx1]) >= edgeminlen)
+        continue;
+      anychange = merge(ctx, pm, i) || anychange;
     }
   }
 
-  // we remove zero cost edges
-  for (;;) {
-    const auto item = heap.removeheap();
-    if (item.len2 > MAX_EDGE_LEN*MAX_EDGE_LEN) continue;
-    auto &edge = eqem[item.idx];
-    const auto idx0 = uncollapsedidx(vqem, edge.idx[0]);
-    const auto idx1 = uncollapsedidx(vqem, edge.idx[1]);
-
-    // already removed. we ignore it
-    if (idx0 == idx1) continue;
-
-    // try to remove it. the cost function needs to be properly updated
-    const auto &p0 = pm.pos[idx0], &p1 = pm.pos[idx1];
-    auto &q0 = vqem[idx0], &q1 = vqem[idx1];
-    assert(q0.timestamp >= edge.timestamp[0]);
-    assert(q1.timestamp >= edge.timestamp[1]);
-
-    // edge is upto date. we can safely remove it
-    const auto timestamp0 = q0.timestamp, timestamp1 = q1.timestamp;
-    if (timestamp0 == edge.timestamp[0] && timestamp1 == edge.timestamp[1]) {
-      if (item.cost > QEM_MIN_ERROR) break;
-      merge(ctx, pm, edge, idx0, idx1);
-      continue;
-    }
-
-    // edge is too old. we need to update its cost and reinsert it
-    const auto best = qef::findbest(q0,q1,p0,p1,QEM_MIN_ERROR);
-    const qemheapitem newitem = {best.first, distance2(p0,p1), item.idx};
-    edge.best = best.second;
-    edge.timestamp[0] = timestamp0;
-    edge.timestamp[1] = timestamp1;
-    edge.idx[0] = idx0;
-    edge.idx[1] = idx1;
-    heap.addheap(newitem);
+  // we remove zero cost edges. the heap only contains live edges with their
+  // current cost. locked vertices may exhaust it
+  while (!heap.empty()) {
+    const auto idx = heap.pop();
+    if (heap.get(idx).len2 > MAX_EDGE_LEN*MAX_EDGE_LEN) continue;
+    merge(ctx, pm, idx);
   }
 
   // now, we remove unused vertices and degenerated triangles
   vector<int> mapping(pm.pos.length());
   loopv(mapping) mapping[i] = -1;
-  vector<u32> newidx, newmat;
+  vector<u32> newidx, newmat, newchunk;
   const auto trinum = pm.trinum();
+  newidx.reserve(3*trinum);
+  newmat.reserve(trinum);
+  newchunk.reserve(trinum);
   auto vertnum = 0;
   loopi(trinum) {
     const u32 idx[] = {pm.idx[3*i+0], pm.idx[3*i+1], pm.idx[3*i+2]};
     if (idx[0] == idx[1] || idx[1] == idx[2] || idx[2] == idx[0])
       continue;
     newmat.add(pm.mat[i]);
+    newchunk.add(pm.chunk[i]);
     loopj(3) {
       if (mapping[idx[j]] == -1) mapping[idx[j]] = vertnum++;
       newidx.add(mapping[idx[j]]);
@@ -462,11 +525,17 @@ static void decimatemesh(qemcontext &ctx, procmesh &pm, float edgeminlen) {
   }
   newidx.moveto(pm.idx);
   newmat.moveto(pm.mat);
+  newchunk.moveto(pm.chunk);
 
   // compact vertex buffer
-  vector<vec3f> newpos(vertnum);
+  vector<vec3f> newpos;
+  newpos.setsize(vertnum, noinitialize);
   loopv(mapping) if (mapping[i] != -1) newpos[mapping[i]] = pm.pos[i];
   newpos.moveto(pm.pos);
+  if (pm.gid.length() == 0) return;
+  vector<int> newgid(vertnum);
+  loopv(mapping) if (mapping[i] != -1) newgid[mapping[i]] = pm.gid[i];
+  newgid.moveto(pm.gid);
 }
 
 static void buildqem(qemcontext &ctx, procmesh &pm) {
@@ -486,9 +555,8 @@ static void buildqem(qemcontext &ctx, procmesh &pm) {
   }
 }
 
-static void buildtrianglelists(qemcontext &ctx, const procmesh &pm) {
-  auto &vtri = ctx.vtri;
-  auto &vidx = ctx.vidx;
+static void buildtrianglelists(vector<pair<int,int>> &vtri, vector<int> &vidx,
+                               const procmesh &pm) {
   vtri.setsize(pm.pos.length());
   vidx.setsize(pm.idx.length());
 
@@ -510,10 +578,41 @@ static void buildtrianglelists(qemcontext &ctx, const procmesh &pm) {
   }
 }
 
-static void decimatemesh(procmesh &pm, float cellsize) {
+static void buildedgelists(qemcontext &ctx, const procmesh &pm) {
+  auto &vedge = ctx.vedge;
+  auto &eidx = ctx.eidx;
+  const auto &e = ctx.eqem;
+  vedge.setsize(pm.pos.length());
+  eidx.setsize(2*e.length());
+
+  // same as triangle lists: count, prefix sum and fill
+  loopv(vedge) vedge[i].first = vedge[i].second = 0;
+  loopv(e) loopj(2) ++vedge[e[i].idx[j]].second;
+  auto accum = 0;
+  loopv(vedge) {
+    vedge[i].first = accum;
+    accum += vedge[i].second;
+    vedge[i].second = 0;
+  }
+  loopv(e) loopj(2) {
+    auto &v = vedge[e[i].idx[j]];
+    eidx[v.first+v.second++] = i;
+  }
+}
+
+static void decimatemesh(procmesh &pm, float cellsize, bool lockborders) {
   if (pm.idx.length() == 0) return;
   qemcontext ctx;
 
+  // vertices shared with other partitions must stay in place
+  bool anyshared = false;
+  loopv(pm.gid) anyshared = anyshared || pm.gid[i] != -1;
+  if (lockborders || anyshared) {
+    ctx.locked.setsize(pm.pos.length());
+    loopv(ctx.locked) ctx.locked[i] = false;
+    loopv(pm.gid) if (pm.gid[i] != -1) ctx.locked[i] = true;
+  }
+
   // we go over all triangles and build all vertex qem
   buildqem(ctx, pm);
 
@@ -525,7 +624,10 @@ static void decimatemesh(procmesh &pm, float cellsize) {
   buildheap(ctx, pm);
 
   // generate the lists of triangles per-vertex
-  buildtrianglelists(ctx, pm);
+  buildtrianglelists(ctx.vtri, ctx.vidx, pm);
+
+  // and the lists of edges per-vertex to update their costs on collapse
+  buildedgelists(ctx, pm);
 
   // decimate the mesh using quadric error functions
   const auto minlen = cellsize*MIN_EDGE_FACTOR;
@@ -533,71 +635,573 @@ static void decimatemesh(procmesh &pm, float cellsize) {
 }
 
 /*-------------------------------------------------------------------------
- - sharpen mesh i.e. duplicate sharp points and compute vertex normals
+ - split the mesh in partitions of consecutive chunks decimated in parallel
  -------------------------------------------------------------------------*/
-static void sharpenmesh(procmesh &pm) {
-  if (pm.idx.length() == 0) return;
-  const auto trinum = pm.trinum();
-  vector<int> vertlist(pm.pos.length());
-  vector<vec3f> newnor(pm.pos.length());
-  vector<u32> newidx, newmat;
+// odd passes shift the partition boundaries by half a partition such that the
+// seams locked by the previous pass get decimated as well
+INLINE u32 partitionof(u32 chunk, u32 chunknum, u32 partnum, u32 pass) {
+  const auto shift = (pass & 1) ? chunknum : 0u;
+  return min(partnum-1, (2*chunk*partnum+shift) / (2*chunknum));
+}
+
+static void splitmesh(procmesh &pm, vector<procmesh> &parts, u32 pass) {
+  const auto vertnum = pm.pos.length(), trinum = pm.trinum();
+  const auto partnum = u32(parts.length());
+  const auto chunknum = max(pm.chunknum, 1u);
+
+  // find the vertices referenced by more than one partition
+  vector<int> owner(vertnum);
+  loopv(owner) owner[i] = -1;
+  loopi(trinum) {
+    const int part = partitionof(pm.chunk[i], chunknum, partnum, pass);
+    loopj(3) {
+      auto &o = owner[pm.idx[3*i+j]];
+      o = o == -1 ? part : (o == part ? o : -2);
+    }
+  }
+
+  // triangles are sorted by chunk so each partition is a range of triangles
+  vector<int> mapping(vertnum);
+  loopv(mapping) mapping[i] = -1;
+  int first = 0;
+  loopv(parts) {
+    auto &part = parts[i];
+    part.pos.setsize(0);
+    part.idx.setsize(0);
+    part.mat.setsize(0);
+    part.chunk.setsize(0);
+    part.gid.setsize(0);
+    part.chunknum = pm.chunknum;
+    int last = first;
+    while (last < trinum && partitionof(pm.chunk[last], chunknum, partnum, pass) == u32(i))
+      ++last;
+    part.idx.reserve(3*(last-first));
+    part.mat.reserve(last-first);
+    part.chunk.reserve(last-first);
+    rangej(first, last) {
+      part.mat.add(pm.mat[j]);
+      part.chunk.add(pm.chunk[j]);
+      loopk(3) {
+        const auto idx = pm.idx[3*j+k];
+        if (mapping[idx] == -1) {
+          mapping[idx] = part.pos.length();
+          part.pos.add(pm.pos[idx]);
+          part.gid.add(owner[idx] == -2 ? int(idx) : -1);
+        }
+        part.idx.add(mapping[idx]);
+      }
+    }
 
-  // init the chain list
-  loopv(vertlist) vertlist[i] = i;
+    // shared vertices may be referenced again by the next partitions
+    rangej(3*first, 3*last) mapping[pm.idx[j]] = -1;
+    first = last;
+  }
+  assert(first == trinum);
+}
+
+static void mergemesh(procmesh &pm, vector<procmesh> &parts) {
+  vector<int> shared(pm.pos.length());
+  loopv(shared) shared[i] = -1;
+  vector<vec3f> newpos;
+  vector<u32> newidx, newmat, newchunk;
+  auto trinum = 0;
+  loopv(parts) trinum += parts[i].trinum();
+  newpos.reserve(pm.pos.length());
+  newidx.reserve(3*trinum);
+  newmat.reserve(trinum);
+  newchunk.reserve(trinum);
+  loopv(parts) {
+    auto &part = parts[i];
+    vector<int> mapping(part.pos.length());
+    loopvj(part.pos) {
+      const auto gid = part.gid[j];
+      if (gid != -1 && shared[gid] != -1)
+        mapping[j] = shared[gid];
+      else {
+        mapping[j] = newpos.length();
+        newpos.add(part.pos[j]);
+        if (gid != -1) shared[gid] = mapping[j];
+      }
+    }
+    loopvj(part.idx) newidx.add(mapping[part.idx[j]]);
+    loopvj(part.mat) {
+      newmat.add(part.mat[j]);
+      newchunk.add(part.chunk[j]);
+    }
+  }
+  newpos.moveto(pm.pos);
+  newidx.moveto(pm.idx);
+  newmat.moveto(pm.mat);
+  newchunk.moveto(pm.chunk);
+}
+
+/*-------------------------------------------------------------------------
+ - sharpen mesh i.e. duplicate sharp points and compute vertex normals.
+ - vertex ranges are processed in parallel. extra vertices get their slots
+ - from an atomic counter and are then compacted in vertex order
+ -------------------------------------------------------------------------*/
+static const u32 SHARPEN_RANGE_NUM = 64;
+
+struct sharpencontext {
+  vector<vec3f> nor;    // normal of each reserved vertex slot
+  vector<int> corner;   // vertex slot of each triangle corner
+  vector<int> extra;    // first slot of the extra copies of each vertex
+  vector<int> extranum; // number of extra copies of each vertex
+  atomic slotnum;       // next free slot
+};
+
+static void sharpeninit(sharpencontext &ctx, procmesh &pm) {
+  buildtrianglelists(pm.vtri, pm.vidx, pm);
+
+  // a vertex is copied at most once per triangle it belongs to
+  const auto vertnum = pm.pos.length();
+  ctx.nor.setsize(vertnum+pm.idx.length());
+  ctx.corner.setsize(pm.idx.length());
+  ctx.extra.setsize(vertnum);
+  ctx.extranum.setsize(vertnum);
+  ctx.slotnum = vertnum;
+}
+
+INLINE int cornerof(const procmesh &pm, int tri, int vert) {
+  const auto t = &pm.idx[3*tri];
+  return int(t[0]) == vert ? 0 : int(t[1]) == vert ? 1 : 2;
+}
+
+static void sharpenrange(sharpencontext &ctx, const procmesh &pm, u32 range) {
+  const auto vertnum = u64(pm.pos.length());
+  const auto first = int(range*vertnum/SHARPEN_RANGE_NUM);
+  const auto last = int((range+1)*vertnum/SHARPEN_RANGE_NUM);
+  vector<vec3f> cluster;
+  rangei(first, last) {
+    const auto list = &pm.vidx[pm.vtri[i].first];
+    const auto n = pm.vtri[i].second;
+
+    // cluster the triangle normals around the vertex. local cluster indices
+    // are stored in the corners for now
+    cluster.setsize(0);
+    loopj(n) {
+      const auto tri = list[j];
+      const auto t = &pm.idx[3*tri];
+      const auto edge0 = pm.pos[t[2]]-pm.pos[t[0]];
+      const auto edge1 = pm.pos[t[2]]-pm.pos[t[1]];
+
+      // zero sized edge are not possible since we got rid of them...
+      assert(length(edge0) != 0.f && length(edge1) != 0.f);
+
+      // ...but colinear edges are still possible. the triangle is dropped
+      const auto corner = 3*tri+cornerof(pm, tri, i);
+      const auto dir = cross(edge0, edge1);
+      const auto len2 = length2(dir);
+      if (len2 == 0.f) {
+        ctx.corner[corner] = -1;
+        continue;
+      }
+      const auto nor = dir*rsqrt(len2);
+      auto c = 0;
+      for (; c < cluster.length(); ++c)
+        if (dot(nor, normalize(cluster[c])) > SHARP_EDGE_THRESHOLD) break;
+      if (c == cluster.length())
+        cluster.add(dir);
+      else
+        cluster[c] += dir;
+      ctx.corner[corner] = c;
+    }
+
+    // the first cluster keeps the vertex. others get reserved slots
+    const auto extranum = max(cluster.length()-1, 0);
+    const auto extra = (ctx.slotnum += extranum) - extranum;
+    ctx.extra[i] = extra;
+    ctx.extranum[i] = extranum;
+    ctx.nor[i] = vec3f(zero);
+    loopvj(cluster) {
+      const auto slot = j == 0 ? i : extra+j-1;
+      const auto len2 = length2(cluster[j]);
+      ctx.nor[slot] = len2 != 0.f ? cluster[j]*rsqrt(len2) : vec3f(zero);
+    }
+    loopj(n) {
+      const auto tri = list[j];
+      auto &c = ctx.corner[3*tri+cornerof(pm, tri, i)];
+      if (c > 0) c = extra+c-1; else if (c == 0) c = i;
+    }
+  }
+}
+
+static void sharpencompact(sharpencontext &ctx, procmesh &pm) {
+  // original vertices keep their index and extra copies follow in order
+  const auto vertnum = pm.pos.length(), slotnum = int(ctx.slotnum);
+  vector<int> mapping;
+  vector<vec3f> newpos, newnor;
+  mapping.setsize(slotnum, noinitialize);
+  newpos.setsize(slotnum, noinitialize);
+  newnor.setsize(slotnum, noinitialize);
+  loopi(vertnum) {
+    mapping[i] = i;
+    newpos[i] = pm.pos[i];
+    newnor[i] = ctx.nor[i];
+  }
+  auto next = vertnum;
+  loopi(vertnum) loopj(ctx.extranum[i]) {
+    const auto slot = ctx.extra[i]+j;
+    mapping[slot] = next;
+    newpos[next] = pm.pos[i];
+    newnor[next] = ctx.nor[slot];
+    ++next;
+  }
+  assert(next == slotnum);
 
-#if 1 //!defined(NDEBUG)
-  loopv(newnor) newnor[i] = vec3f(zero);
-#endif
+  // remap the corners and drop colinear triangles
+  vector<u32> newidx, newmat, newchunk;
+  newidx.reserve(pm.idx.length());
+  newmat.reserve(pm.trinum());
+  newchunk.reserve(pm.trinum());
+  loopi(pm.trinum()) {
+    const auto c = &ctx.corner[3*i];
+    if (c[0] == -1) continue;
+    loopj(3) newidx.add(mapping[c[j]]);
+    newmat.add(pm.mat[i]);
+    newchunk.add(pm.chunk[i]);
+  }
+  newpos.moveto(pm.pos);
+  newnor.moveto(pm.nor);
+  newidx.moveto(pm.idx);
+  newmat.moveto(pm.mat);
+  newchunk.moveto(pm.chunk);
+  pm.vidx.destroy();
+  pm.vtri.destroy();
+  ctx.nor.destroy();
+  ctx.corner.destroy();
+  ctx.extra.destroy();
+  ctx.extranum.destroy();
+}
 
-  // go over all triangles and initialize vertex normals
+/*-------------------------------------------------------------------------
+ - split segments in meshlets grown from a seed triangle through the shared
+ - vertices. triangles are reordered such that each meshlet is contiguous
+ -------------------------------------------------------------------------*/
+static void meshletbounds(const procmesh &pm, meshlet &ml) {
+  const auto idx = &pm.idx[ml.start];
+  const auto trinum = int(ml.num/3);
+
+  // bounding sphere centered on the box
+  auto box = aabb::empty();
+  loopi(3*trinum) box.compose(aabb(pm.pos[idx[i]], pm.pos[idx[i]]));
+  ml.center = 0.5f*(box.pmin+box.pmax);
+  ml.radius = 0.f;
+  loopi(3*trinum) ml.radius = max(ml.radius, distance(ml.center, pm.pos[idx[i]]));
+
+  // normal cone from the average normal
+  auto sum = vec3f(zero);
   loopi(trinum) {
-    const auto t = &pm.idx[3*i];
-    const auto edge0 = pm.pos[t[2]]-pm.pos[t[0]];
-    const auto edge1 = pm.pos[t[2]]-pm.pos[t[1]];
+    const auto &p0 = pm.pos[idx[3*i]], &p1 = pm.pos[idx[3*i+1]], &p2 = pm.pos[idx[3*i+2]];
+    const auto n = cross(p1-p0, p2-p0);
+    const auto len2 = length2(n);
+    if (len2 != 0.f) sum += n*rsqrt(len2);
+  }
+  const auto len2 = length2(sum);
+  ml.axis = len2 != 0.f ? sum*rsqrt(len2) : vec3f(zero);
+  ml.cutoff = 1.f;
+  if (len2 == 0.f) return;
+  auto mindot = 1.f;
+  loopi(trinum) {
+    const auto &p0 = pm.pos[idx[3*i]], &p1 = pm.pos[idx[3*i+1]], &p2 = pm.pos[idx[3*i+2]];
+    const auto n = cross(p1-p0, p2-p0);
+    const auto len2 = length2(n);
+    if (len2 != 0.f) mindot = min(mindot, dot(ml.axis, n*rsqrt(len2)));
+  }
+  if (mindot > 0.f) ml.cutoff = sqrt(1.f-mindot*mindot);
+}
 
-    // zero sized edge are not possible since we got rid of them...
-    assert(length(edge0) != 0.f && length(edge1) != 0.f);
+static void buildmeshlets(procmesh &pm, const vector<segment> &seg,
+                          vector<meshlet> &meshlets)
+{
+  vector<int> local(pm.pos.length()), global, remaining, first, adjacency, queue;
+  vector<bool> emitted;
+  vector<u32> tri;
+  loopv(local) local[i] = -1;
+  loopv(seg) {
+    const auto idx = &pm.idx[seg[i].start];
+    const auto trinum = int(seg[i].num/3);
+
+    // triangle lists per vertex of the segment
+    global.setsize(0);
+    loopj(3*trinum) {
+      auto &l = local[idx[j]];
+      if (l == -1) {
+        l = global.length();
+        global.add(idx[j]);
+      }
+    }
+    remaining.setsize(global.length());
+    first.setsize(global.length());
+    adjacency.setsize(3*trinum);
+    loopvj(remaining) remaining[j] = 0;
+    loopj(3*trinum) ++remaining[local[idx[j]]];
+    auto accum = 0;
+    loopvj(first) {
+      first[j] = accum;
+      accum += remaining[j];
+      remaining[j] = 0;
+    }
+    loopj(3*trinum) {
+      const auto v = local[idx[j]];
+      adjacency[first[v]+remaining[v]++] = j/3;
+    }
 
-    // ...but colinear edges are still possible
-    const auto dir = cross(edge0, edge1);
-    const auto len2 = length2(dir);
-    if (len2 == 0.f) continue;
-    const auto nor = dir*rsqrt(len2);
-    loopj(3) {
-      auto idx = int(t[j]);
-      if (vertlist[idx] == idx) {
-        vertlist[idx] = -1;
-        newnor[idx] = dir;
-      } else {
-        while (idx != -1) {
-          const auto cosangle = dot(nor, normalize(newnor[idx]));
-          if (cosangle > SHARP_EDGE_THRESHOLD) break;
-          idx = vertlist[idx];
+    // grow each meshlet breadth first from the first free triangle
+    emitted.setsize(trinum);
+    loopj(trinum) emitted[j] = false;
+    tri.setsize(0);
+    auto cursor = 0;
+    while (cursor < trinum) {
+      if (emitted[cursor]) {
+        ++cursor;
+        continue;
+      }
+      // the bounds are only computed once the indices are written back
+      meshlet ml = {vec3f(zero), 0.f, vec3f(zero), 0.f, 0u, 0u};
+      ml.start = seg[i].start+tri.length();
+      auto num = 0u;
+      queue.setsize(0);
+      queue.add(cursor);
+      emitted[cursor] = true;
+      for (int head = 0; head < queue.length() && num < MESHLET_TRINUM; ++head) {
+        const auto t = queue[head];
+        loopk(3) tri.add(idx[3*t+k]);
+        ++num;
+        loopk(3) {
+          const auto v = local[idx[3*t+k]];
+          range(l, first[v], first[v]+remaining[v]) {
+            const auto other = adjacency[l];
+            if (emitted[other]) continue;
+            emitted[other] = true;
+            queue.add(other);
+          }
         }
-        if (idx != -1)
-          newnor[idx] += dir;
-        else {
-          const auto old = vertlist[t[j]];
-          idx = newnor.length();
-          vertlist[t[j]] = newnor.length();
-          vertlist.add(old);
-          pm.pos.add(pm.pos[t[j]]);
-          newnor.add(dir);
+      }
+
+      // triangles queued but not taken go back to the pool
+      rangek(int(num), queue.length()) emitted[queue[k]] = false;
+      ml.num = 3*num;
+      meshlets.add(ml);
+    }
+    loopvj(tri) idx[j] = tri[j];
+    loopvj(global) local[global[j]] = -1;
+  }
+  loopv(meshlets) meshletbounds(pm, meshlets[i]);
+}
+
+/*-------------------------------------------------------------------------
+ - reorder triangles for the post-transform vertex cache (forsyth's linear
+ - speed vertex cache optimisation) and vertices for the fetches
+ -------------------------------------------------------------------------*/
+static const int VCACHE_SIZE = 32;
+static const float VCACHE_DECAY = 1.5f;
+static const float VCACHE_LAST_TRI = 0.75f;
+static const float VCACHE_VALENCE_SCALE = 2.f;
+static const float VCACHE_VALENCE_POWER = 0.5f;
+
+static float vertexscore(int cachepos, int remaining) {
+  if (remaining == 0) return -1.f;
+  auto score = 0.f;
+  if (cachepos >= 3)
+    score = pow(1.f-float(cachepos-3)/float(VCACHE_SIZE-3), VCACHE_DECAY);
+  else if (cachepos >= 0)
+    score = VCACHE_LAST_TRI;
+  return score + VCACHE_VALENCE_SCALE*pow(float(remaining), -VCACHE_VALENCE_POWER);
+}
+
+struct vcachecontext {
+  INLINE vcachecontext(int vertnum) : local(vertnum) {
+    loopv(local) local[i] = -1;
+  }
+  vector<int> local;     // vertex index in the segment being processed
+  vector<int> global;    // vertex index in the mesh
+  vector<int> remaining; // triangles not emitted yet per vertex
+  vector<int> first;     // first triangle in the adjacency list
+  vector<int> adjacency; // triangles per vertex
+  vector<int> cachepos;  // position in the simulated cache (-1 if not there)
+  vector<float> vscore, tscore;
+  vector<bool> emitted;
+  vector<u32> tri;
+};
+
+static void optimizesegment(vcachecontext &c, u32 *idx, int trinum) {
+  // map the vertices of the segment to a dense range
+  c.global.setsize(0);
+  c.tri.setsize(3*trinum);
+  loopi(3*trinum) {
+    auto &l = c.local[idx[i]];
+    if (l == -1) {
+      l = c.global.length();
+      c.global.add(idx[i]);
+    }
+    c.tri[i] = l;
+  }
+  const auto vertnum = c.global.length();
+
+  // build the triangle lists per vertex
+  c.remaining.setsize(vertnum);
+  c.first.setsize(vertnum);
+  c.cachepos.setsize(vertnum);
+  c.vscore.setsize(vertnum);
+  c.adjacency.setsize(3*trinum);
+  loopi(vertnum) c.remaining[i] = 0;
+  loopi(3*trinum) ++c.remaining[c.tri[i]];
+  auto accum = 0;
+  loopi(vertnum) {
+    c.first[i] = accum;
+    accum += c.remaining[i];
+    c.remaining[i] = 0;
+  }
+  loopi(3*trinum) {
+    const auto v = c.tri[i];
+    c.adjacency[c.first[v]+c.remaining[v]++] = i/3;
+  }
+
+  // initial scores
+  loopi(vertnum) {
+    c.cachepos[i] = -1;
+    c.vscore[i] = vertexscore(-1, c.remaining[i]);
+  }
+  c.tscore.setsize(trinum);
+  c.emitted.setsize(trinum);
+  loopi(trinum) {
+    c.emitted[i] = false;
+    c.tscore[i] = c.vscore[c.tri[3*i]]+c.vscore[c.tri[3*i+1]]+c.vscore[c.tri[3*i+2]];
+  }
+
+  // greedily emit the best triangle among the ones touching the cache
+  int cache[VCACHE_SIZE+3], cachenum = 0, cursor = 0, best = -1;
+  loopi(trinum) {
+    if (best == -1) {
+      while (c.emitted[cursor]) ++cursor;
+      best = cursor;
+    }
+    const auto t = &c.tri[3*best];
+    loopj(3) idx[3*i+j] = c.global[t[j]];
+    c.emitted[best] = true;
+
+    // remove the triangle from the lists of its vertices
+    loopj(3) {
+      const auto v = t[j];
+      const auto list = &c.adjacency[c.first[v]];
+      auto &n = c.remaining[v];
+      loopk(n) if (list[k] == best) {
+        list[k] = list[--n];
+        break;
+      }
+    }
+
+    // push the vertices in front of the cache
+    int newcache[VCACHE_SIZE+3], newnum = 0;
+    loopj(3) newcache[newnum++] = t[j];
+    loopj(cachenum)
+      if (cache[j] != int(t[0]) && cache[j] != int(t[1]) && cache[j] != int(t[2]))
+        newcache[newnum++] = cache[j];
+
+    // update the scores of the vertices that moved. the next triangle is
+    // taken among the ones of the vertices still in the cache
+    best = -1;
+    auto bestscore = -1.f;
+    loopj(newnum) {
+      const auto v = newcache[j];
+      c.cachepos[v] = j < VCACHE_SIZE ? j : -1;
+      c.vscore[v] = vertexscore(c.cachepos[v], c.remaining[v]);
+    }
+    cachenum = min(newnum, VCACHE_SIZE);
+    loopj(cachenum) {
+      const auto v = newcache[j];
+      const auto list = &c.adjacency[c.first[v]];
+      loopk(c.remaining[v]) {
+        const auto other = list[k];
+        const auto o = &c.tri[3*other];
+        const auto score = c.vscore[o[0]]+c.vscore[o[1]]+c.vscore[o[2]];
+        c.tscore[other] = score;
+        if (score > bestscore) {
+          bestscore = score;
+          best = other;
         }
       }
-      newidx.add(idx);
     }
-    newmat.add(pm.mat[i]);
+    loopj(cachenum) cache[j] = newcache[j];
+  }
+
+  loopv(c.global) c.local[c.global[i]] = -1;
+}
+
+// average number of cache misses per triangle with a fifo cache
+static float acmr(const procmesh &pm) {
+  if (pm.idx.length() == 0) return 0.f;
+  vector<int> stamp(pm.pos.length());
+  loopv(stamp) stamp[i] = -VCACHE_SIZE-1;
+  auto misses = 0;
+  loopv(pm.idx) {
+    auto &s = stamp[pm.idx[i]];
+    if (misses-s > VCACHE_SIZE) s = misses++;
+  }
+  return float(misses)/float(pm.trinum());
+}
+
+// misses of the indices with a fifo cache starting empty
+static int fifomisses(const u32 *idx, int num) {
+  u32 fifo[VCACHE_SIZE];
+  int n = 0, head = 0, misses = 0;
+  loopi(num) {
+    auto hit = false;
+    loopj(n) if (fifo[j] == idx[i]) {
+      hit = true;
+      break;
+    }
+    if (hit) continue;
+    fifo[head] = idx[i];
+    head = (head+1) % VCACHE_SIZE;
+    n = min(n+1, VCACHE_SIZE);
+    ++misses;
+  }
+  return misses;
+}
+
+static void optimizemesh(procmesh &pm, const vector<meshlet> &meshlets) {
+  if (pm.idx.length() == 0) return;
+  const auto before = acmr(pm);
+
+  // reorder triangles in each meshlet. material runs are preserved. the
+  // contouring order is kept when the new one does not miss less
+  vcachecontext c(pm.pos.length());
+  vector<u32> old;
+  loopv(meshlets) {
+    const auto idx = &pm.idx[meshlets[i].start];
+    const auto num = s32(meshlets[i].num);
+    if (num == 0) continue;
+    old.setsize(num);
+    loopj(num) old[j] = idx[j];
+    optimizesegment(c, idx, num/3);
+    if (fifomisses(idx, num) >= fifomisses(&old[0], num))
+      loopj(num) idx[j] = old[j];
   }
 
-  // renormalize all normals
-  loopv(newnor) {
-    const auto len2 = length2(newnor[i]);
-    if (len2 != 0.f) newnor[i] = newnor[i]*rsqrt(len2);
+  // reorder vertices in order of first use
+  vector<int> mapping(pm.pos.length());
+  loopv(mapping) mapping[i] = -1;
+  vector<vec3f> newpos, newnor;
+  newpos.setsize(pm.pos.length(), noinitialize);
+  newnor.setsize(pm.nor.length(), noinitialize);
+  auto vertnum = 0;
+  loopv(pm.idx) {
+    const auto idx = pm.idx[i];
+    if (mapping[idx] == -1) {
+      mapping[idx] = vertnum;
+      newpos[vertnum] = pm.pos[idx];
+      newnor[vertnum] = pm.nor[idx];
+      ++vertnum;
+    }
+    pm.idx[i] = mapping[idx];
   }
+  newpos.setsize(vertnum);
+  newnor.setsize(vertnum);
+  newpos.moveto(pm.pos);
   newnor.moveto(pm.nor);
-  newidx.moveto(pm.idx);
-  newmat.moveto(pm.mat);
+  con::out("iso: vertex cache: acmr %.3f -> %.3f", before, acmr(pm));
 }
 
 /*-------------------------------------------------------------------------
@@ -606,48 +1210,132 @@ static void sharpenmesh(procmesh &pm) {
 
 // build a first mesh from contoured octree
 struct isomeshtask : public task {
-  INLINE isomeshtask(iso::octree &o, procmesh &pm) :
-    task("isomeshtask"), o(o), pm(pm)
+  INLINE isomeshtask(iso::octree &o, procmesh &pm, u32 lod) :
+    task("isomeshtask"), o(o), pm(pm), lod(lod)
   {}
   virtual void run(u32) {
-    buildmesh(o, o.m_root, pm);
+    {
+      PROFILE(PHASE_BUILDMESH);
+      buildmesh(o, pm, lod);
+    }
     con::out("iso: procmesh: %d vertices", pm.pos.length());
     con::out("iso: procmesh: %d triangles", pm.idx.length()/3);
   }
   iso::octree &o;
   procmesh &pm;
+  u32 lod;
 };
 
-// decimate a procmesh using qem
-struct decimatetask : public task {
-  INLINE decimatetask(procmesh &pm, float cellsize) :
-    task("decimatetask"), pm(pm), cellsize(cellsize)
+// split the procmesh in partitions of consecutive chunks
+struct splittask : public task {
+  INLINE splittask(procmesh &pm, vector<procmesh> &parts, u32 pass) :
+    task("splittask"), pm(pm), parts(parts), pass(pass)
   {}
-  virtual void run(u32) { decimatemesh(pm, cellsize); }
+  virtual void run(u32) {
+    PROFILE(PHASE_DECIMATE[pass]);
+    splitmesh(pm, parts, pass);
+  }
   procmesh &pm;
+  vector<procmesh> &parts;
+  u32 pass;
+};
+
+// decimate each partition using qem. one element per partition
+struct decimatetask : public task {
+  INLINE decimatetask(vector<procmesh> &parts, float cellsize,
+                      bool lockborders, u32 pass) :
+    task("decimatetask", parts.length()), parts(parts), cellsize(cellsize),
+    lockborders(lockborders), pass(pass)
+  {}
+  virtual void run(u32 part) {
+    PROFILE(PHASE_DECIMATE[pass]);
+    decimatemesh(parts[part], cellsize, lockborders);
+  }
+  vector<procmesh> &parts;
   float cellsize;
+  bool lockborders;
+  u32 pass;
+};
+
+// stitch the partitions back together
+struct mergetask : public task {
+  INLINE mergetask(procmesh &pm, vector<procmesh> &parts, u32 pass) :
+    task("mergetask"), pm(pm), parts(parts), pass(pass)
+  {}
+  virtual void run(u32) {
+    PROFILE(PHASE_DECIMATE[pass]);
+    mergemesh(pm, parts);
+  }
+  procmesh &pm;
+  vector<procmesh> &parts;
+  u32 pass;
+};
+
+// prepare the parallel sharpening of the vertices
+struct sharpeninittask : public task {
+  INLINE sharpeninittask(sharpencontext &ctx, procmesh &pm) :
+    task("sharpeninittask"), ctx(ctx), pm(pm)
+  {}
+  virtual void run(u32) {
+    PROFILE(PHASE_SHARPEN);
+    sharpeninit(ctx, pm);
+  }
+  sharpencontext &ctx;
+  procmesh &pm;
+};
+
+// split vertices across sharp edges. one element per vertex range
+struct sharpentask : public task {
+  INLINE sharpentask(sharpencontext &ctx, procmesh &pm) :
+    task("sharpentask", SHARPEN_RANGE_NUM), ctx(ctx), pm(pm)
+  {}
+  virtual void run(u32 range) {
+    PROFILE(PHASE_SHARPEN);
+    sharpenrange(ctx, pm, range);
+  }
+  sharpencontext &ctx;
+  procmesh &pm;
 };
 
 // create proper (possible sharpened) normals and finish the mesh
 struct finishtask : public task {
-  INLINE finishtask(mesh &m, procmesh &pm) :
-    task("finishtask"), m(m), pm(pm)
+  INLINE finishtask(mesh &m, procmesh &pm, sharpencontext &ctx) :
+    task("finishtask"), m(m), pm(pm), ctx(ctx)
   {}
   virtual void run(u32) {
-    // handle sharp edges and create normals
-    sharpenmesh(pm);
+    // gather the split vertices and their normals
+    {
+      PROFILE(PHASE_SHARPEN);
+      sharpencompact(ctx, pm);
+    }
 
-    // build the segment list
+    // build the segment list. segments never straddle two chunks
     vector<segment> seg;
-    u32 currmat = ~0x0;
+    vector<chunk> chunks;
+    u32 currmat = ~0x0, currchunk = ~0x0;
     loopv(pm.mat) {
+      if (pm.chunk[i] != currchunk) {
+        chunks.add({aabb::empty(),u32(seg.length()),0u});
+        currchunk = pm.chunk[i];
+        currmat = ~0x0;
+      }
       if (pm.mat[i] != currmat) {
         seg.add({3u*i,0u,pm.mat[i]});
         currmat = pm.mat[i];
+        ++chunks.last().num;
       }
       seg.last().num += 3;
+      loopj(3) {
+        const auto &p = pm.pos[pm.idx[3*i+j]];
+        chunks.last().box.compose(aabb(p,p));
+      }
     }
 
+    // cluster the segments and improve vertex cache and fetch locality
+    vector<meshlet> meshlets;
+    buildmeshlets(pm, seg, meshlets);
+    optimizemesh(pm, meshlets);
+
 #if !defined(NDEBUG)
     loopv(pm.pos) assert(!isnan(pm.pos[i].x)&&!isnan(pm.pos[i].y)&&!isnan(pm.pos[i].z));
     loopv(pm.pos) assert(!isinf(pm.pos[i].x)&&!isinf(pm.pos[i].y)&&!isinf(pm.pos[i].z));
@@ -659,48 +1347,81 @@ struct finishtask : public task {
     const auto n = pm.nor.move();
     const auto idx = pm.idx.move();
     const auto s = seg.move();
+    const auto c = chunks.move();
+    const auto ml = meshlets.move();
     con::out("iso: final: %d vertices", p.second);
     con::out("iso: final: %d triangles", idx.second/3);
-    m.init(p.first, n.first, idx.first, s.first, p.second, idx.second, s.second);
+    con::out("iso: final: %d chunks", c.second);
+    con::out("iso: final: %d meshlets", ml.second);
+    m.init(p.first, n.first, idx.first, s.first, p.second, idx.second, s.second,
+           c.first, c.second, ml.first, ml.second);
   }
 
   mesh &m;
   procmesh &pm;
+  sharpencontext &ctx;
 };
 
 // task to build the mesh from a "contoured" octree
 struct meshbuildtask : public task {
-  INLINE meshbuildtask(mesh &m, iso::octree &o, float cellsize, int waiternum) :
-    task("meshbuildtask", 1, waiternum), m(m), o(o), cellsize(cellsize)
+  INLINE meshbuildtask(mesh &m, iso::octree &o, float cellsize, int waiternum,
+                       bool lockborders, u32 lod) :
+    task("meshbuildtask", 1, waiternum), m(m), o(o), cellsize(cellsize),
+    lockborders(lockborders), lod(lod), parts(max(sys::threadnumber(), 1u))
   {}
 
   virtual void run(u32) {
     // create all tasks needed for the mesh processing
-    ref<task> init = NEW(isomeshtask, o, pm);
-    ref<task> decimate[DECIMATION_NUM];
-    loopi(DECIMATION_NUM) decimate[i] = NEW(decimatetask, pm, cellsize);
-    ref<task> finish = NEW(finishtask, m, pm);
+    ref<task> init = NEWTASK(isomeshtask, o, pm, lod);
+    ref<task> split[DECIMATION_NUM], decimate[DECIMATION_NUM], merge[DECIMATION_NUM];
+    loopi(DECIMATION_NUM) {
+      split[i] = NEWTASK(splittask, pm, parts, i);
+      decimate[i] = NEWTASK(decimatetask, parts, cellsize, lockborders, i);
+      merge[i] = NEWTASK(mergetask, pm, parts, i);
+    }
+    ref<task> prepare = NEWTASK(sharpeninittask, sharpenctx, pm);
+    ref<task> sharpen = NEWTASK(sharpentask, sharpenctx, pm);
+    ref<task> finish = NEWTASK(finishtask, m, pm, sharpenctx);
 
     // handle dependencies and completion of parent task
-    init->starts(*decimate[0]);
-    rangei(1,DECIMATION_NUM) decimate[i-1]->starts(*decimate[i]);
-    decimate[DECIMATION_NUM-1]->starts(*finish);
+    init->starts(*split[0]);
+    loopi(DECIMATION_NUM) {
+      split[i]->starts(*decimate[i]);
+      decimate[i]->starts(*merge[i]);
+      if (i != DECIMATION_NUM-1) merge[i]->starts(*split[i+1]);
+    }
+    merge[DECIMATION_NUM-1]->starts(*prepare);
+    prepare->starts(*sharpen);
+    sharpen->starts(*finish);
     finish->ends(*this);
 
     // schedule everything
     finish->scheduled();
-    loopi(DECIMATION_NUM) decimate[i]->scheduled();
+    sharpen->scheduled();
+    prepare->scheduled();
+    loopi(DECIMATION_NUM) {
+      merge[i]->scheduled();
+      decimate[i]->scheduled();
+      split[i]->scheduled();
+    }
     init->scheduled();
   }
 
   mesh &m;
   iso::octree &o;
   float cellsize;
+  bool lockborders;
+  u32 lod;
   procmesh pm;
+  vector<procmesh> parts;
+  sharpencontext sharpenctx;
 };
 
-ref<task> buildmesh(mesh &m, iso::octree &o, float cellsize, int waiternum) {
-  return NEW(meshbuildtask, m, o, cellsize, waiternum);
+ref<task> buildmesh(mesh &m, iso::octree &o, float cellsize, int waiternum,
+                    bool lockborders, u32 lod) {
+  MEMORY_TAG(MEM_GEOM);
+  assert(lod < o.m_lodnum);
+  return NEWTASK(meshbuildtask, m, o, cellsize, waiternum, lockborders, lod);
 }
 
 /*-------------------------------------------------------------------------
@@ -709,45 +1430,293 @@ ref<task> buildmesh(mesh &m, iso::octree &o, float cellsize, int waiternum) {
 mesh::mesh() {ZERO(this);}
 
 void mesh::init(vec3f *pos, vec3f *nor, u32 *index,
-                segment *seg, u32 vn, u32 idxn, u32 segn) {
+                segment *seg, u32 vn, u32 idxn, u32 segn,
+                chunk *ch, u32 chn, meshlet *ml, u32 mln) {
   m_pos = pos;
   m_nor = nor;
   m_index = index;
   m_segment = seg;
+  m_chunk = ch;
   m_vertnum = vn;
   m_indexnum = idxn;
   m_segmentnum = segn;
+  m_chunknum = chn;
+  m_meshlet = ml;
+  m_meshletnum = mln;
+}
+
+/*-------------------------------------------------------------------------
+ - packed meshes for rendering
+ -------------------------------------------------------------------------*/
+packedmesh::packedmesh() {ZERO(this);}
+
+void packedmesh::destroy() {
+  if (m_vert) FREE(m_vert);
+  if (m_index) FREE(m_index);
+  if (m_segment) FREE(m_segment);
+  if (m_chunk) FREE(m_chunk);
+  ZERO(this);
+}
+
+static INLINE s16 packsnorm(float x) {
+  return s16(round(clamp(x,-1.f,1.f)*32767.f));
+}
+
+// octahedral encoding: project on the octahedron and fold the lower half
+static INLINE void packnormal(const vec3f &n, s16 *dst) {
+  const auto l1 = abs(n.x)+abs(n.y)+abs(n.z);
+  if (l1 == 0.f) {
+    dst[0] = dst[1] = 0;
+    return;
+  }
+  auto x = n.x/l1, y = n.y/l1;
+  if (n.z < 0.f) {
+    const auto fx = (1.f-abs(y))*(x >= 0.f ? 1.f : -1.f);
+    const auto fy = (1.f-abs(x))*(y >= 0.f ? 1.f : -1.f);
+    x = fx;
+    y = fy;
+  }
+  dst[0] = packsnorm(x);
+  dst[1] = packsnorm(y);
+}
+
+bool pack(packedmesh &pm, const mesh &m) {
+  pm.destroy();
+  if (m.m_chunknum == 0) return false;
+
+  // give each chunk its own vertices
+  vector<int> local(m.m_vertnum);
+  loopv(local) local[i] = -1;
+  vector<u32> idx, global;
+  idx.setsize(m.m_indexnum, noinitialize);
+  global.reserve(m.m_vertnum);
+  vector<packedchunk> chunks(m.m_chunknum);
+  auto maxvertnum = 0u;
+  loopi(int(m.m_chunknum)) {
+    const auto &c = m.m_chunk[i];
+    auto &pc = chunks[i];
+    pc.box = c.box;
+    pc.start = c.start;
+    pc.num = c.num;
+    pc.firstvert = global.length();
+    rangej(c.start, c.start+c.num) {
+      const auto &seg = m.m_segment[j];
+      rangek(seg.start, seg.start+seg.num) {
+        const auto v = m.m_index[k];
+        if (local[v] == -1) {
+          local[v] = global.length()-pc.firstvert;
+          global.add(v);
+        }
+        idx[k] = local[v];
+      }
+    }
+    pc.vertnum = global.length()-pc.firstvert;
+    maxvertnum = max(maxvertnum, pc.vertnum);
+    rangej(pc.firstvert, global.length()) local[global[j]] = -1;
+  }
+
+  // quantize the vertices in the box of their chunk
+  pm.m_vertnum = global.length();
+  pm.m_vert = (packedvertex*) MALLOC(sizeof(packedvertex)*pm.m_vertnum);
+  loopv(chunks) {
+    auto &pc = chunks[i];
+    pc.org = pc.box.pmin;
+    pc.scale = max(pc.box.pmax-pc.box.pmin, vec3f(FLT_MIN));
+    const auto inv = vec3f(65535.f)/pc.scale;
+    rangej(pc.firstvert, pc.firstvert+pc.vertnum) {
+      const auto v = global[j];
+      const auto q = clamp((m.m_pos[v]-pc.org)*inv, vec3f(zero), vec3f(65535.f));
+      auto &dst = pm.m_vert[j];
+      loopk(3) dst.pos[k] = u16(round(q[k]));
+      dst.pad = 0;
+      packnormal(m.m_nor[v], dst.nor);
+    }
+  }
+
+  // 16 bit indices when possible
+  pm.m_indexnum = m.m_indexnum;
+  pm.m_indexsize = maxvertnum <= 0x10000u ? sizeof(u16) : sizeof(u32);
+  pm.m_index = MALLOC(pm.m_indexsize*pm.m_indexnum);
+  if (pm.m_indexsize == sizeof(u16))
+    loopv(idx) ((u16*) pm.m_index)[i] = u16(idx[i]);
+  else
+    memcpy(pm.m_index, &idx[0], sizeof(u32)*pm.m_indexnum);
+
+  pm.m_segmentnum = m.m_segmentnum;
+  pm.m_segment = (segment*) MALLOC(sizeof(segment)*pm.m_segmentnum);
+  memcpy(pm.m_segment, m.m_segment, sizeof(segment)*pm.m_segmentnum);
+  const auto c = chunks.move();
+  pm.m_chunk = c.first;
+  pm.m_chunknum = c.second;
+  return true;
+}
+
+/*-------------------------------------------------------------------------
+ - mesh container: header followed by aligned sections. offsets are relative
+ - to the header and unknown sections are skipped
+ -------------------------------------------------------------------------*/
+static const u32 MESH_MAGIC = 0x534d514d; // "MQMS"
+static const u32 MESH_VERSION = 3;
+static const u32 MESH_ALIGN = 64;
+enum {
+  SECTION_POS, SECTION_NOR, SECTION_INDEX, SECTION_SEGMENT, SECTION_CHUNK,
+  SECTION_MESHLET,
+  SECTION_BVH,       // opaque prebuilt bvh
+  SECTION_OCCUPANCY, // opaque occupancy (see iso::serialize)
+  SECTION_NUM
+};
+struct meshsection { u64 offset, size; };
+struct meshheader {
+  u32 magic, version, headersize, sectionnum;
+  u64 size; // whole container including padding
+  meshsection section[SECTION_NUM];
+};
+
+INLINE u64 alignsection(u64 x) { return (x+MESH_ALIGN-1) & ~u64(MESH_ALIGN-1); }
+
+static meshheader makeheader(const mesh &m) {
+  meshheader h;
+  ZERO(&h);
+  h.magic = MESH_MAGIC;
+  h.version = MESH_VERSION;
+  h.headersize = sizeof(meshheader);
+  h.sectionnum = SECTION_NUM;
+  const u64 sizes[] = {
+    sizeof(vec3f)*m.m_vertnum, m.m_nor ? sizeof(vec3f)*m.m_vertnum : 0,
+    sizeof(u32)*m.m_indexnum, sizeof(segment)*m.m_segmentnum,
+    sizeof(chunk)*m.m_chunknum, sizeof(meshlet)*m.m_meshletnum, m.m_bvhsize,
+    m.m_occupancysize
+  };
+  auto offset = alignsection(sizeof(meshheader));
+  loopi(SECTION_NUM) {
+    h.section[i].offset = sizes[i] ? offset : 0;
+    h.section[i].size = sizes[i];
+    offset = alignsection(offset+sizes[i]);
+  }
+  h.size = offset;
+  return h;
+}
+
+static bool checkheader(const meshheader &h, u64 available) {
+  if (h.magic != MESH_MAGIC) {
+    con::out("geom: not a mesh file");
+    return false;
+  }
+  if (h.version != MESH_VERSION || h.headersize != sizeof(meshheader) ||
+      h.sectionnum != SECTION_NUM) {
+    con::out("geom: unsupported mesh version %d", h.version);
+    return false;
+  }
+  if (h.size > available) {
+    con::out("geom: truncated mesh file");
+    return false;
+  }
+  loopi(SECTION_NUM) {
+    const auto &s = h.section[i];
+    if (s.size == 0) continue;
+    if (s.offset % MESH_ALIGN != 0 || s.offset+s.size > h.size) {
+      con::out("geom: corrupted mesh section %d", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+// set the counts of the mesh from the section sizes
+static void setcounts(mesh &m, const meshheader &h) {
+  m.m_vertnum = h.section[SECTION_POS].size / sizeof(vec3f);
+  m.m_indexnum = h.section[SECTION_INDEX].size / sizeof(u32);
+  m.m_segmentnum = h.section[SECTION_SEGMENT].size / sizeof(segment);
+  m.m_chunknum = h.section[SECTION_CHUNK].size / sizeof(chunk);
+  m.m_meshletnum = h.section[SECTION_MESHLET].size / sizeof(meshlet);
+  m.m_bvhsize = u32(h.section[SECTION_BVH].size);
+  m.m_occupancysize = u32(h.section[SECTION_OCCUPANCY].size);
+}
+
+static void writepadding(FILE *f, u64 to) {
+  static const char zeros[MESH_ALIGN] = {0};
+  const auto pos = u64(ftell(f));
+  if (to > pos) fwrite(zeros, size_t(to-pos), 1, f);
 }
 
-void store(const char *filename, const mesh &m) {
+void store(FILE *f, const mesh &m) {
+  // start aligned such that every mesh of a mapped stream is usable in place
+  const auto start = alignsection(ftell(f));
+  writepadding(f, start);
+  const auto h = makeheader(m);
+  fwrite(&h, sizeof(h), 1, f);
+  const void *data[] = {
+    m.m_pos, m.m_nor, m.m_index, m.m_segment, m.m_chunk, m.m_meshlet, m.m_bvh,
+    m.m_occupancy
+  };
+  loopi(SECTION_NUM) {
+    if (h.section[i].size == 0) continue;
+    writepadding(f, start+h.section[i].offset);
+    fwrite(data[i], size_t(h.section[i].size), 1, f);
+  }
+  writepadding(f, start+h.size);
+}
+
+bool load(FILE *f, mesh &m) {
+  m.destroy();
+  const auto start = alignsection(ftell(f));
+  fseek(f, long(start), SEEK_SET);
+  meshheader h;
+  if (fread(&h, sizeof(h), 1, f) != 1 || !checkheader(h, ~u64(0)))
+    return false;
+  setcounts(m, h);
+  void **data[] = {
+    (void**)&m.m_pos, (void**)&m.m_nor, (void**)&m.m_index,
+    (void**)&m.m_segment, (void**)&m.m_chunk, (void**)&m.m_meshlet,
+    (void**)&m.m_bvh, (void**)&m.m_occupancy
+  };
+  loopi(SECTION_NUM) {
+    const auto size = size_t(h.section[i].size);
+    if (size == 0) continue;
+    *data[i] = MALLOC(size);
+    fseek(f, long(start+h.section[i].offset), SEEK_SET);
+    if (fread(*data[i], size, 1, f) != 1) {
+      con::out("geom: truncated mesh stream");
+      m.destroy();
+      return false;
+    }
+  }
+  fseek(f, long(start+h.size), SEEK_SET);
+  return true;
+}
+
+bool store(const char *filename, const mesh &m) {
   auto f = fopen(filename, "wb");
-  assert(f);
-  fwrite(&m.m_vertnum, sizeof(u32), 1, f);
-  fwrite(&m.m_indexnum, sizeof(u32), 1, f);
-  fwrite(&m.m_segmentnum, sizeof(u32), 1, f);
-  fwrite(m.m_pos, sizeof(vec3f) * m.m_vertnum, 1, f);
-  fwrite(m.m_nor, sizeof(vec3f) * m.m_vertnum, 1, f);
-  fwrite(m.m_index, sizeof(u32) * m.m_indexnum, 1, f);
-  fwrite(m.m_segment, sizeof(segment) * m.m_segmentnum, 1, f);
+  if (f == NULL) {
+    con::out("geom: unable to write %s", filename);
+    return false;
+  }
+  store(f, m);
   fclose(f);
+  return true;
 }
 
 bool load(const char *filename, mesh &m) {
-  auto f = fopen(filename, "rb");
-  if (f==NULL) return false;
   m.destroy();
-  fread(&m.m_vertnum, sizeof(u32), 1, f);
-  fread(&m.m_indexnum, sizeof(u32), 1, f);
-  fread(&m.m_segmentnum, sizeof(u32), 1, f);
-  m.m_pos = (vec3f*) MALLOC(sizeof(vec3f) * m.m_vertnum);
-  m.m_nor = (vec3f*) MALLOC(sizeof(vec3f) * m.m_vertnum);
-  m.m_index = (u32*) MALLOC(sizeof(u32) * m.m_indexnum);
-  m.m_segment = (segment*) MALLOC(sizeof(segment) * m.m_segmentnum);
-  fread(m.m_pos, sizeof(vec3f) * m.m_vertnum, 1, f);
-  fread(m.m_nor, sizeof(vec3f) * m.m_vertnum, 1, f);
-  fread(m.m_index, sizeof(u32) * m.m_indexnum, 1, f);
-  fread(m.m_segment, sizeof(segment) * m.m_segmentnum, 1, f);
-  fclose(f);
+  size_t size;
+  const auto mapping = (char*) sys::mapfile(filename, &size);
+  if (mapping == NULL) return false;
+  if (size < sizeof(meshheader) ||
+      !checkheader(*(const meshheader*) mapping, size)) {
+    sys::unmapfile(mapping, size);
+    return false;
+  }
+  const auto &h = *(const meshheader*) mapping;
+  setcounts(m, h);
+  void **data[] = {
+    (void**)&m.m_pos, (void**)&m.m_nor, (void**)&m.m_index,
+    (void**)&m.m_segment, (void**)&m.m_chunk, (void**)&m.m_meshlet,
+    (void**)&m.m_bvh, (void**)&m.m_occupancy
+  };
+  loopi(SECTION_NUM) if (h.section[i].size != 0)
+    *data[i] = mapping + h.section[i].offset;
+  m.m_mapping = mapping;
+  m.m_mappingsize = size;
   return true;
 }
 } /* namespace geom */
@@ -20,27 +20,92 @@ namespace geom {
 // describe a set of consecutive primitives with same material
 struct segment {u32 start, num, mat;};
 
+// set of consecutive segments spatially close to each other (i.e. from the
+// same octree node) with their bounding box. used to cull the mesh
+struct chunk {aabb box; u32 start, num;};
+
+// cluster of at most MESHLET_TRINUM triangles from one segment with its
+// bounding sphere and normal cone. all triangles face away from any point p
+// with dot(center-p,axis) >= cutoff*length(center-p)+radius. cutoff is one
+// when the normals are too spread to cull anything
+struct meshlet {
+  vec3f center; float radius;
+  vec3f axis; float cutoff;
+  u32 start, num;
+};
+static const u32 MESHLET_TRINUM = 128;
+
 // simple structure to describe meshes generated by marching cube or dual
-// contouring
+// contouring. loaded meshes may point directly into a mapped file. m_bvh is
+// an opaque serialized bvh (see rt::storebvh) and m_occupancy an opaque
+// occupancy (see iso::serialize) stored along with the mesh
 struct mesh {
   mesh();
   void init(vec3f *pos, vec3f *nor, u32 *index,
-            segment *seg, u32 vn, u32 idxn, u32 segn);
+            segment *seg, u32 vn, u32 idxn, u32 segn,
+            chunk *ch = NULL, u32 chn = 0, meshlet *ml = NULL, u32 mln = 0);
   void destroy();
   vec3f *m_pos, *m_nor;
   u32 *m_index;
   segment *m_segment;
+  chunk *m_chunk;
+  meshlet *m_meshlet;
+  u32 m_vertnum;
+  u32 m_indexnum;
+  u32 m_segmentnum;
+  u32 m_chunknum;
+  u32 m_meshletnum;
+  void *m_bvh;
+  u32 m_bvhsize;
+  void *m_occupancy;
+  u32 m_occupancysize;
+  void *m_mapping;
+  size_t m_mappingsize;
+};
+
+// compact vertex for rendering (12 bytes instead of 24). positions are
+// quantized in the box of their chunk and normals are octahedral encoded
+struct packedvertex { u16 pos[3], pad; s16 nor[2]; };
+
+// vertices of a packed chunk are a contiguous range and its indices are
+// relative to the first one. position is org+scale*normalized(pos)
+struct packedchunk { aabb box; vec3f org, scale; u32 start, num, firstvert, vertnum; };
+
+// packed version of a mesh. vertices shared by several chunks are duplicated
+// and indices use 16 bits when every chunk has less than 64k vertices
+struct packedmesh {
+  packedmesh();
+  void destroy();
+  packedvertex *m_vert;
+  void *m_index;
+  segment *m_segment;
+  packedchunk *m_chunk;
   u32 m_vertnum;
   u32 m_indexnum;
   u32 m_segmentnum;
+  u32 m_chunknum;
+  u32 m_indexsize;
 };
 
-// create a task to build a mesh from a "contoured" octree
-ref<task> buildmesh(mesh &m, iso::octree &o, float cellsize, int waitnum = 1);
+// fails if the mesh has no chunk
+bool pack(packedmesh &pm, const mesh &m);
+
+// octree nodes of this size (in cells) make one chunk
+static const u32 CHUNKCELLNUM = 64;
+
+// create a task to build a mesh from a "contoured" octree. with lockborders,
+// decimation never moves vertices of border edges such that meshes built
+// side by side stay watertight. lod selects the level of detail of the leaves
+ref<task> buildmesh(mesh &m, iso::octree &o, float cellsize, int waitnum = 1,
+                    bool lockborders = false, u32 lod = 0);
 
-// load/store the mesh in the given stream
-void store(const char *filename, const mesh &m);
+// load/store the mesh using a versioned container with aligned sections.
+// loading a file maps it and uses the sections in place without any copy.
+// streams may contain several consecutive meshes and are loaded with copies
+bool store(const char *filename, const mesh &m);
 bool load(const char *filename, mesh &m);
+void store(FILE *f, const mesh &m);
+bool load(FILE *f, mesh &m);
 } /* namespace geom */
 } /* namespace q */
 
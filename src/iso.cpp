@@ -6,34 +6,51 @@
 #include "csg.hpp"
 #include "qef.hpp"
 #include "csgscalar.hpp"
-#include "csgsse.hpp"
-#include "csgavx.hpp"
+#include "kernel.hpp"
 #include "geom.hpp"
 #include "base/vector.hpp"
+#include "base/algorithm.hpp"
 #include "base/task.hpp"
 #include "base/console.hpp"
+#include "base/script.hpp"
+#include "base/flat_map.hpp"
+#include "base/profiler.hpp"
 
 STATS(iso_num);
 STATS(iso_edgepos_num);
 STATS(iso_edge_num);
+STATS(iso_edge_cached_num);
 STATS(iso_gradient_num);
 STATS(iso_grid_num);
 STATS(iso_octree_num);
+STATS(iso_interval_culled_num);
 STATS(iso_qef_num);
+STATS(iso_qef_fallback_num);
 STATS(iso_edgepos);
+STATS(iso_skipped_num);
+STATS(iso_quad_num);
+STATS(iso_quad_dropped_num);
+STATS_HISTOGRAM(iso_edge_batch);
 
-#if !defined(RELEASE)
+#if STATS_ENABLED
 static void stats() {
   STATS_OUT(iso_num);
   STATS_OUT(iso_qef_num);
+  STATS_RATIO(iso_qef_fallback_num, iso_qef_num);
   STATS_OUT(iso_edge_num);
+  STATS_RATIO(iso_edge_cached_num, iso_edge_num);
   STATS_RATIO(iso_edgepos_num, iso_edge_num);
   STATS_RATIO(iso_edgepos_num, iso_num);
   STATS_RATIO(iso_gradient_num, iso_num);
   STATS_RATIO(iso_grid_num, iso_num);
   STATS_RATIO(iso_octree_num, iso_num);
+  STATS_RATIO(iso_interval_culled_num, iso_octree_num);
+  STATS_RATIO(iso_skipped_num, iso_grid_num);
+  STATS_OUT(iso_quad_num);
+  STATS_RATIO(iso_quad_dropped_num, iso_quad_num);
+  STATS_HISTOGRAM_OUT(iso_edge_batch);
 }
-#endif /* defined(RELEASE) */
+#endif /* STATS_ENABLED */
 
 #define DEBUGOCTREE 0
 #if DEBUGOCTREE
@@ -41,18 +58,30 @@ static const q::vec3f debugpos(19.f,3.0f,13.f);
 static const float debugsize = 0.8f;
 #endif /* DEBUGOCTREE */
 
-//#define CSGVER csg::avx
-//#define CSGVER csg::sse
-#define CSGVER csg
-
 namespace q {
 namespace iso {
+PROFILE_PHASE(PHASE_OCTREE, "octree");
+PROFILE_PHASE(PHASE_FIELD, "field");
+PROFILE_PHASE(PHASE_EDGES, "edges");
+PROFILE_PHASE(PHASE_QEF, "qef");
+PROFILE_PHASE(PHASE_TESSELATE, "tesselate");
+
+// we pick the kernel once per tesselation. neighbor grids must use the exact
+// same code to output the exact same points on their shared edges
+typedef void (*csgdistfn)(const csg::program*, const csg::array3f&,
+                          const csg::arrayf*, csg::arrayf&, csg::arrayi&,
+                          int, const aabb&, csg::array3f*);
+static csgdistfn csgdist = csg::dist;
+static void selectcsgkernel() { csgdist = kernel::get().csgdist; }
 
-static const u32 SUBGRIDDEPTH = ilog2(SUBGRID);
-static const auto DEFAULT_GRAD_STEP = 1e-3f;
 static const int MAX_STEPS = 8;
 static const double QEM_LEAF_MIN_ERROR = 1e-6;
 
+// largest distance in hundredths of a cell between the collapsed vertices
+// of a leaf and the planes of the vertices they replace. zero only merges
+// the flat parts
+VARP(isosimplify, 0, 0, 100);
+
 INLINE pair<vec3i,u32> edge(vec3i start, vec3i end) {
   const auto lower = select(lt(start,end), start, end);
   const auto delta = select(eq(start,end), vec3i(zero), vec3i(one));
@@ -67,6 +96,85 @@ struct fielditem {
 };
 typedef fielditem mcell[8];
 
+/*-------------------------------------------------------------------------
+ - storage of the field and of the edge and qef indices in the builders.
+ - the compact one keeps the whole working set of a builder in l2. its
+ - distances are 16 bit fixed point in 1/FIXEDSCALE cells clamped to +/-32
+ - cells. this is exact for the contouring: the field signs and materials
+ - which drive it are kept and the distances beyond the clamp are only
+ - smaller lower bounds
+ -------------------------------------------------------------------------*/
+static const u32 NEARBYCELLS = 2;
+
+struct fullfield {
+  typedef fielditem item;
+  typedef u32 qefindex;
+  template <bool FITS16> struct edgeindex { typedef u32 type; };
+  static INLINE item encode(const fielditem &f, float) { return f; }
+  static INLINE fielditem decode(const item &i, float) { return i; }
+
+  // bit x of sign is set when the field is negative and bit x of nearby
+  // when it is within NEARBYCELLS of the surface
+  template <typename R>
+  static INLINE void bits(const item *row, u32 num, float cellsize, R &s, R &n) {
+    const auto limit = float(NEARBYCELLS)*cellsize;
+    u32 x = 0;
+#if defined(__SSE2_INTRINSICS__)
+    const auto zero4 = _mm_setzero_ps(), limit4 = _mm_set1_ps(limit);
+    const auto absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    for (; x+4 <= num; x += 4) {
+      const auto f = (const float*) (row+x);
+      const auto d = _mm_shuffle_ps(_mm_loadu_ps(f), _mm_loadu_ps(f+4), _MM_SHUFFLE(2,0,2,0));
+      s |= R(_mm_movemask_ps(_mm_cmplt_ps(d, zero4))) << x;
+      n |= R(_mm_movemask_ps(_mm_cmple_ps(_mm_and_ps(d, absmask), limit4))) << x;
+    }
+#endif
+    for (; x < num; ++x) {
+      s |= R(row[x].d < 0.f) << x;
+      n |= R(abs(row[x].d) <= limit) << x;
+    }
+  }
+};
+
+struct compactfield {
+  static const s32 FIXEDSCALE = 1024;
+  struct item { s16 d; u16 m; };
+  typedef u16 qefindex;
+  template <bool FITS16> struct edgeindex { typedef u32 type; };
+  static INLINE item encode(const fielditem &f, float cellsize) {
+    assert(f.m < 0xffffu && "material index does not fit");
+    const auto x = min(max(f.d*float(FIXEDSCALE)/cellsize, -32767.f), 32767.f);
+    auto d = s32(x < 0.f ? x-0.5f : x+0.5f);
+    if (d == 0) d = f.d < 0.f ? -1 : 0; // we must keep the sign
+    const item i = {s16(d), u16(f.m)};
+    return i;
+  }
+  static INLINE fielditem decode(const item &i, float cellsize) {
+    return fielditem(float(i.d)*cellsize/float(FIXEDSCALE), i.m);
+  }
+  template <typename R>
+  static INLINE void bits(const item *row, u32 num, float, R &s, R &n) {
+    const auto ilimit = s32(NEARBYCELLS)*FIXEDSCALE;
+    u32 x = 0;
+#if defined(__SSE2_INTRINSICS__)
+    const auto lo4 = _mm_set1_epi32(-ilimit-1), hi4 = _mm_set1_epi32(ilimit+1);
+    for (; x+4 <= num; x += 4) {
+      const auto items = _mm_loadu_si128((const __m128i*) (row+x));
+      const auto d = _mm_srai_epi32(_mm_slli_epi32(items, 16), 16);
+      const auto inside = _mm_and_si128(_mm_cmpgt_epi32(d, lo4), _mm_cmplt_epi32(d, hi4));
+      s |= R(_mm_movemask_ps(_mm_castsi128_ps(d))) << x;
+      n |= R(_mm_movemask_ps(_mm_castsi128_ps(inside))) << x;
+    }
+#endif
+    for (; x < num; ++x) {
+      s |= R(row[x].d < 0) << x;
+      n |= R(abs(s32(row[x].d)) <= ilimit) << x;
+    }
+  }
+};
+// edge indices are 16 bits when all the edges of the field fit
+template <> struct compactfield::edgeindex<true> { typedef u16 type; };
+
 static const vec3i axis[] = {vec3i(1,0,0), vec3i(0,1,0), vec3i(0,0,1)};
 static const u32 quadorder[] = {0,1,2,3};
 static const u32 quadorder_cc[] = {3,2,1,0};
@@ -88,25 +196,23 @@ static const int interptable[12][2] = {
 };
 static const u32 octreechildmap[8] = {0, 4, 3, 7, 1, 5, 2, 6};
 static const pair<int,int> airmat = makepair(csg::MAT_AIR_INDEX, csg::MAT_AIR_INDEX);
-static const u32 FIELDDIM = SUBGRID+2;
-static const u32 FIELDNUM = FIELDDIM*FIELDDIM*FIELDDIM;
-static const u32 QEFNUM = SUBGRID*SUBGRID*SUBGRID;
-static const u32 NOINDEX = ~0x0u;
 
 /*-------------------------------------------------------------------------
  - leafoctree implementation
  -------------------------------------------------------------------------*/
-void leafoctreebase::init() {
+void leafoctreebase::init(u32 dim) {
+  assert(ispoweroftwo(dim));
+  depth = ilog2(dim);
   root.setsize(1);
   root[0].setemptyleaf();
 }
 
 void leafoctreebase::insert(vec3i xyz, int ptidx) {
   assert(all(ge(xyz,vec3i(zero))) && "out-of-bound vertex");
-  assert(all(lt(xyz,vec3i(SUBGRID))) && "out-of-bound vertex");
+  assert(all(lt(xyz,vec3i(dim()))) && "out-of-bound vertex");
   u32 level = 0, idx = 0;
   for (;;) {
-    if (level == SUBGRIDDEPTH) {
+    if (level == depth) {
       root[idx].idx = ptidx;
       root[idx].isleaf = 1;
       root[idx].empty = 0;
@@ -119,26 +225,27 @@ void leafoctreebase::insert(vec3i xyz, int ptidx) {
       root.setsize(childidx+8);
       loopi(8) root[childidx+i].setemptyleaf();
     }
-    idx = descend(xyz, level, idx);
+    idx = descend(root.getbuf(), xyz, level, idx, depth);
     ++level;
   }
 }
 
-int leafoctreebase::getidx(vec3i xyz) {
+int leafoctreebase::getidx(const node *root, vec3i xyz, u32 depth) {
   assert(all(ge(xyz,vec3i(zero))) && "out-of-bound vertex");
-  assert(all(lt(xyz,vec3i(SUBGRID))) && "out-of-bound vertex");
+  assert(all(lt(xyz,vec3i(1<<depth))) && "out-of-bound vertex");
   u32 level = 0, idx = 0;
   for (;;) {
     const auto node = &root[idx];
     if (node->empty) return -1;
     if (node->isleaf) return node->idx;
-    idx = descend(xyz, level, idx);
+    idx = descend(root, xyz, level, idx, depth);
     ++level;
   }
 }
 
-INLINE u32 leafoctreebase::descend(vec3i &xyz, u32 level, u32 idx) {
-  const auto logsize = vec3i(SUBGRIDDEPTH-level-1);
+INLINE u32 leafoctreebase::descend(const node *root, vec3i &xyz, u32 level,
+                                   u32 idx, u32 depth) {
+  const auto logsize = vec3i(depth-level-1);
   const auto bits = xyz >> logsize;
   const auto child = octreechildmap[bits.x | (bits.y<<1) | (bits.z<<2)];
   assert(all(ge(xyz, icubev[child] << logsize)));
@@ -150,30 +257,118 @@ INLINE u32 leafoctreebase::descend(vec3i &xyz, u32 level, u32 idx) {
 /*-------------------------------------------------------------------------
  - global octree implementation
  -------------------------------------------------------------------------*/
-octree::node::~node() {
-  if (isleaf)
-    SAFE_DEL(leaf);
-  else
-    SAFE_DELA(children);
+static atomic octreeid(0);
+static u32 currentconfigidx();
+octree::octree(u32 dim, u32 lodnum) :
+  m_dim(dim), m_logdim(ilog2(dim)), m_lodnum(lodnum),
+  m_config(currentconfigidx()),
+  m_leafdim(getconfig(m_config).leafdim),
+  m_logleafdim(ilog2(m_leafdim)),
+  m_packetsize(getconfig(m_config).packetsize),
+  m_id(octreeid++),
+  m_deadleaves(0),
+  m_mutex(SDL_CreateMutex())
+{
+  assert(lodnum >= 1 && lodnum <= MAXLODNUM);
+  assert(dim >= m_leafdim);
+}
+octree::~octree() {
+  loopv(m_arenas) DEL(m_arenas[i]);
+  SDL_DestroyMutex(m_mutex);
+}
+arena *octree::newarena() {
+  const auto a = NEWE(arena);
+  SDL_LockMutex(m_mutex);
+  m_arenas.add(a);
+  SDL_UnlockMutex(m_mutex);
+  return a;
 }
 
-const octree::node *octree::findleaf(vec3i xyz) const {
-  if (any(lt(xyz,vec3i(zero))) || any(ge(xyz,vec3i(m_dim)))) return NULL;
-  int level = 0;
-  const node *node = &m_root;
-  for (;;) {
-    if (node->isleaf) return node;
-    assert(m_logdim > u32(level));
-    const auto logsize = vec3i(m_logdim-level-1);
-    const auto bits = xyz >> logsize;
-    const auto child = octreechildmap[bits.x | (bits.y<<1) | (bits.z<<2)];
-    assert(all(ge(xyz, icubev[child] << logsize)));
-    xyz -= icubev[child] << logsize;
-    node = node->children + child;
-    ++level;
+// leaves live in the arenas of the octree
+octree::node::~node() { if (!isleaf) SAFE_DELA(children); }
+
+// all the levels of detail of a leaf in one arena. they share their quads
+static octree::leafdata *copyleaf(arena &a, const octree::leafdata *src, u32 lodnum) {
+  const auto dim = src[0].dim, quadnum = src[0].quadnum;
+  const auto leaf = a.alloc<octree::leafdata>(lodnum);
+  const auto quads = a.alloc<quad>(quadnum);
+  const auto solid = a.alloc<u32>(dim*dim);
+  loopi(s32(quadnum)) quads[i] = src[0].quads[i];
+  memcpy(solid, src[0].solid, dim*dim*sizeof(u32));
+  loopj(s32(lodnum)) {
+    leaf[j] = src[j];
+    leaf[j].index = a.alloc<s16>(dim*dim*dim);
+    leaf[j].pts = a.alloc<octree::qefpoint>(src[j].ptnum);
+    leaf[j].quads = quads;
+    leaf[j].solid = solid;
+    memcpy(leaf[j].index, src[j].index, dim*dim*dim*sizeof(s16));
+    loopi(s32(src[j].ptnum)) leaf[j].pts[i] = src[j].pts[i];
+  }
+  return leaf;
+}
+
+static void copyleaves(octree::node &node, arena &a, u32 lodnum) {
+  if (node.isleaf) {
+    if (node.leaf) node.leaf = copyleaf(a, node.leaf, lodnum);
+  } else if (node.children)
+    loopi(8) copyleaves(node.children[i], a, lodnum);
+}
+
+// the new id makes the builders drop the arenas they hold
+void octree::compact() {
+  const auto a = NEWE(arena);
+  copyleaves(m_root, *a, m_lodnum);
+  loopv(m_arenas) DEL(m_arenas[i]);
+  m_arenas.setsize(0);
+  m_arenas.add(a);
+  m_id = octreeid++;
+  m_deadleaves = 0;
+}
+
+// 21 bits per coordinate
+static INLINE u64 leafkey(const vec3i &xyz, u32 logleafdim) {
+  const auto l = xyz >> int(logleafdim);
+  return morton(u64(l.x), u64(l.y), u64(l.z));
+}
+
+struct leafkeyof {
+  INLINE u64 operator() (const octree::linearleaf &l) const { return l.key; }
+};
+
+static void gatherleaves(const octree::node &node, vector<octree::linearleaf> &leaves,
+                         u32 logleafdim) {
+  if (node.isleaf) {
+    if (node.leaf == NULL) return;
+    auto &l = leaves.add();
+    l.key = leafkey(node.org, logleafdim);
+    l.org = node.org;
+    l.leaf = node.leaf;
+  } else if (node.children)
+    loopi(8) gatherleaves(node.children[i], leaves, logleafdim);
+}
+
+void octree::linearize() {
+  m_leaves.setsize(0);
+  gatherleaves(m_root, m_leaves, m_logleafdim);
+  if (m_deadleaves > m_leaves.length()) {
+    compact();
+    m_leaves.setsize(0);
+    gatherleaves(m_root, m_leaves, m_logleafdim);
   }
-  assert("unreachable" && false);
-  return NULL;
+  if (m_leaves.length()) {
+    vector<linearleaf> tmp;
+    tmp.setsize(m_leaves.length(), noinitialize);
+    radixsort(&m_leaves[0], &tmp[0], m_leaves.length(), leafkeyof());
+  }
+  m_leafindex.clear();
+  m_leafindex.reserve(m_leaves.length());
+  loopv(m_leaves) m_leafindex[m_leaves[i].key] = i;
+}
+
+const octree::linearleaf *octree::findleaf(vec3i xyz) const {
+  if (any(lt(xyz,vec3i(zero))) || any(ge(xyz,vec3i(m_dim)))) return NULL;
+  const auto it = m_leafindex.find(leafkey(xyz, m_logleafdim));
+  return it == m_leafindex.end() ? NULL : &m_leaves[it->second];
 }
 
 struct edgeitem {
@@ -182,9 +377,12 @@ struct edgeitem {
   u32 m0, m1;
 };
 
+// bisection state of one packet. the csg kernels take up to MAXPOINTNUM
+template <u32 PACKET>
 struct CACHE_LINE_ALIGNED edgestack {
-  array<edgeitem,csg::MAXPOINTNUM> it;
-  csg::array3f p, pos;
+  static_assert(PACKET <= csg::MAXPOINTNUM, "packet too large for the kernels");
+  array<edgeitem,PACKET> it;
+  csg::array3f p, pos, grad;
   csg::arrayf d, nd;
   csg::arrayi m;
 };
@@ -196,11 +394,24 @@ INLINE pair<vec3i,int> getedge(const vec3i &start, const vec3i &end) {
   return makepair(lower, delta.y+2*delta.z);
 }
 
+// one bit per x of a field row. the largest leaves need 64 bit rows
+template <u32 FIELDDIM> struct fieldrow { typedef u32 type; };
+template <> struct fieldrow<34> { typedef u64 type; };
+static INLINE u32 lowestbit(u32 x) { return u32(__bsf(x)); }
+static INLINE u32 lowestbit(u64 x) {
+  return u32(x) ? u32(__bsf(u32(x))) : 32u+u32(__bsf(u32(x>>32)));
+}
+
 /*-------------------------------------------------------------------------
  - temporary structure to handle *leaf* mesh data before merging similar
- - vertices using qem
+ - vertices using qem. this is adaptive dual contouring: nodes are collapsed
+ - bottom-up when their merged qem error is small enough and the collapse
+ - keeps the topology of the surface. quads left degenerated are dropped
+ - here such that they never reach the mesh builder
  -------------------------------------------------------------------------*/
+template <u32 DIM>
 struct procleaf {
+  typedef typename fieldrow<DIM+2>::type rowbits;
   struct vertex {
     INLINE bool multimat() const {return mat==airmat;}
     vec3f world;       // position in world space
@@ -210,16 +421,83 @@ struct procleaf {
     pair<int,int> mat; // pair of material used to build the qef
   };
 
-  // merge similar qef points together
-  void merge(int idx = 0);
+  // merge similar qef points together. nodes not larger than forcesize which
+  // do not touch the leaf borders are collapsed whatever the error is
+  void merge(int idx = 0, u32 forcesize = 0, vec3i xyz = vec3i(zero),
+             u32 size = DIM);
 
   // removed degenerated quads
   void decimate();
 
+  // sign of the field at a corner of the field grid
+  INLINE bool negative(const vec3i &xyz) const {
+    return ((sign[xyz.y+xyz.z*(DIM+2)] >> xyz.x) & 1) != 0;
+  }
+
+  // the signs at the middle of the node edges and faces and at its center
+  // must match one of the corners of the edge, face or cube. otherwise, the
+  // collapse would change the topology of the surface inside the node
+  bool safetopology(const vec3i &org, u32 size) const;
+
   leafoctree<vertex> leaf;
+  const rowbits *sign; // sign rows of the field of the leaf
+  double maxerror;     // largest qem error of the collapsed nodes
 };
 
-void procleaf::merge(int idx) {
+template <u32 DIM>
+bool procleaf<DIM>::safetopology(const vec3i &org, u32 size) const {
+  const auto half = int(size/2);
+  bool corners[8];
+  loopi(8) corners[i] = negative(org+icubev[i]*int(size));
+  loopxyz(vec3i(zero), vec3i(3)) {
+    const auto mid = eq(xyz, vec3i(one));
+    if (!any(mid)) continue;
+    const auto s = negative(org+xyz*half);
+    auto match = false;
+    loopi(8) {
+      const auto c = icubev[i]*2;
+      if (all(eq(select(mid, vec3i(zero), c-xyz), vec3i(zero))) && corners[i] == s) {
+        match = true;
+        break;
+      }
+    }
+    if (!match) return false;
+  }
+  return true;
+}
+
+template <u32 DIM>
+void procleaf<DIM>::decimate() {
+  auto &quads = leaf.quads;
+  const auto quadnum = quads.length();
+  int num = 0;
+  loopi(quadnum) {
+    const auto &q = quads[i];
+    int idx[4], distinct = 0;
+    auto inside = true;
+    loopj(4) {
+      const auto xyz = vec3i(q.index[j]);
+      if (any(lt(xyz,vec3i(zero))) || any(ge(xyz,vec3i(DIM)))) {
+        inside = false;
+        break;
+      }
+      idx[j] = leaf.getidx(xyz);
+      auto found = false;
+      loopk(j) found = found || idx[k] == idx[j];
+      if (!found) ++distinct;
+    }
+
+    // corners in other leaves may be different points
+    if (inside && distinct < 3) continue;
+    quads[num++] = q;
+  }
+  STATS_ADD(iso_quad_num, quadnum);
+  STATS_ADD(iso_quad_dropped_num, quadnum-num);
+  quads.setsize(num);
+}
+
+template <u32 DIM>
+void procleaf<DIM>::merge(int idx, u32 forcesize, vec3i xyz, u32 size) {
   const auto node = leaf.getnode(idx);
   if (node->isleaf) return;
   assert(!node->empty && "node cannot be empty here");
@@ -228,11 +506,12 @@ void procleaf::merge(int idx) {
   auto mat = airmat;
 
   // first merge all children
+  const auto half = int(size/2);
   loopi(8) {
     const auto childidx = node->idx+i;
     const auto child = leaf.getnode(childidx);
     if (child->empty) continue;
-    merge(childidx);
+    merge(childidx, forcesize, xyz+icubev[i]*half, half);
   }
 
   // gather all points from the children nodes
@@ -277,50 +556,152 @@ void procleaf::merge(int idx) {
   }
 
   assert(best != -1 && "unable to find candidate");
-  if (bestcost > QEM_LEAF_MIN_ERROR) return;
+  const auto border = any(eq(xyz,vec3i(zero))) || any(eq(xyz+int(size),vec3i(DIM)));
+  const auto force = size <= forcesize && !border;
+  if (!force && (bestcost > maxerror || !safetopology(xyz, size))) return;
   node->isleaf = 1;
   node->idx = best;
 }
 
 /*-------------------------------------------------------------------------
- - iso surface extraction is done here
+ - edge intersections shared by all the leaves of one contouring pass.
+ - neighbor leaves bisect the same edges along their borders. only these
+ - edges go here. the cache is split into stripes with their own lock to
+ - limit contention between contouring tasks
  -------------------------------------------------------------------------*/
-struct gridbuilder {
-  gridbuilder() :
-    m_node(NULL),
-    m_field(FIELDNUM),
-    m_qef_index(QEFNUM),
-    m_edge_index(6*FIELDNUM),
-    stack((edgestack*)ALIGNEDMALLOC(sizeof(edgestack), CACHE_LINE_ALIGNMENT)),
-    m_octree(NULL),
-    m_iorg(zero),
-    maxlvl(0),
-    level(0)
-  {}
-  ~gridbuilder() { ALIGNEDFREE(stack); }
-
+struct edgecache : noncopyable {
   struct edge {
     vec3f p, n;
     vec2i mat;
   };
+  edgecache() { loopi(STRIPENUM) stripes[i].mutex = SDL_CreateMutex(); }
+  ~edgecache() { loopi(STRIPENUM) SDL_DestroyMutex(stripes[i].mutex); }
+
+  // edges are identified by their global lower corner, axis and lod
+  static INLINE u64 key(const vec3i &lower, int axis, u32 lod) {
+    const u64 mask = (1u<<19)-1;
+    return (u64(lower.x)&mask) | (u64(lower.y)&mask)<<19 |
+           (u64(lower.z)&mask)<<38 | u64(axis)<<57 | u64(lod)<<59;
+  }
+  bool find(u64 key, edge &e) {
+    auto &s = stripes[hashint(key) % STRIPENUM];
+    SDL_LockMutex(s.mutex);
+    const auto it = s.map.find(key);
+    const auto found = it != s.map.end();
+    if (found) e = it->second;
+    SDL_UnlockMutex(s.mutex);
+    return found;
+  }
+  void insert(u64 key, const edge &e) {
+    auto &s = stripes[hashint(key) % STRIPENUM];
+    SDL_LockMutex(s.mutex);
+    s.map.insert(makepair(key, e));
+    SDL_UnlockMutex(s.mutex);
+  }
+  static const u32 STRIPENUM = 64;
+  struct CACHE_LINE_ALIGNED stripe {
+    SDL_mutex *mutex;
+    flat_map<u64,edge> map;
+  } stripes[STRIPENUM];
+};
 
-  struct qef_output {
-    INLINE qef_output(vec3f p, vec3f n, bool valid):p(p),n(n),valid(valid){}
-    vec3f p, n;
-    bool valid;
-  };
+/*-------------------------------------------------------------------------
+ - iso surface extraction is done here. the builders are compiled for each
+ - leaf size and packet width. what does not depend on them lives in the
+ - base class
+ -------------------------------------------------------------------------*/
+struct gridbuilderbase {
+  gridbuilderbase() :
+    m_prog(NULL),
+    m_fullprog(NULL),
+    m_pruned(NULL),
+    m_octree(NULL),
+    m_arena(NULL),
+    m_arenaid(0),
+    m_cache(NULL),
+    m_iorg(zero),
+    maxlvl(0),
+    level(0)
+  {}
+  virtual ~gridbuilderbase() { csg::destroy(m_pruned); }
+  virtual void build(octree::node &node) = 0;
 
   INLINE vec3f vertex(const vec3i &p) {
     const vec3i ipos = m_iorg+(p<<(int(maxlvl-level)));
     return vec3f(ipos)*cellsize;
   }
-  INLINE void setoctree(const octree &o) { m_octree = &o; }
+  INLINE void setoctree(octree &o) { m_octree = &o; }
   INLINE void setorg(const vec3f &org) { m_org = org; }
   INLINE void setcellsize(float size) { cellsize = size; }
-  INLINE void setnode(const csg::node *node) { m_node = node; }
+  INLINE void setprogram(const csg::program *prog) { m_fullprog = prog; }
+  INLINE void setcache(edgecache *cache) { m_cache = cache; }
+  INLINE u64 edgekey(const vec3i &lower, int axis) const {
+    const auto lod = maxlvl-level;
+    return edgecache::key(m_iorg+(lower<<int(lod)), axis, lod);
+  }
+
+  // each thread has its own arena per octree such that no lock is needed
+  arena &getarena() {
+    if (m_arena == NULL || m_arenaid != m_octree->m_id) {
+      m_arena = m_octree->newarena();
+      m_arenaid = m_octree->m_id;
+    }
+    return *m_arena;
+  }
+
+  // all the queries of the leaf stay in its field grown by the culling
+  // margins. they only need the part of the csg tree this box reaches.
+  // baked scenes have no program to interpret and are used as they are
+  static const u32 PRUNEMARGIN = 5;
+  void pruneprogram(u32 fielddim) {
+    m_prog = m_fullprog;
+    if (csg::isbaked(m_fullprog)) return;
+    const auto margin = vec3f(float(PRUNEMARGIN)*cellsize);
+    const aabb box(vertex(vec3i(zero))-margin, vertex(vec3i(fielddim))+margin);
+    m_pruned = csg::prune(m_fullprog, box, m_pruned);
+    m_prog = m_pruned;
+  }
+
+  const csg::program *m_prog, *m_fullprog;
+  csg::program *m_pruned;
+  octree *m_octree;
+  arena *m_arena;
+  u32 m_arenaid;
+  edgecache *m_cache;
+  vec3f m_org;
+  vec3i m_iorg;
+  float cellsize;
+  u32 maxlvl, level;
+};
+
+template <u32 DIM, u32 PACKET, typename FIELD>
+struct gridbuilder : gridbuilderbase {
+  static const u32 FIELDDIM = DIM+2;
+  static const u32 FIELDNUM = FIELDDIM*FIELDDIM*FIELDDIM;
+  static const u32 QEFNUM = DIM*DIM*DIM;
+  typedef typename fieldrow<FIELDDIM>::type rowbits;
+  typedef edgestack<PACKET> stacktype;
+  typedef typename FIELD::item fieldtype;
+  typedef typename FIELD::qefindex qefindex;
+  typedef typename FIELD::template edgeindex<(3*FIELDNUM < 0xffffu)>::type edgeindex;
+  static const qefindex NOQEF = qefindex(~0u);
+  static const edgeindex NOEDGE = edgeindex(~0u);
+  static_assert(8*sizeof(rowbits) >= FIELDDIM, "field rows do not fit");
+  static_assert(QEFNUM <= u32(NOQEF), "qef indices do not fit");
+
+  gridbuilder() :
+    m_field(FIELDNUM),
+    m_qef_index(QEFNUM),
+    m_edge_index(3*FIELDNUM),
+    stack((stacktype*)ALIGNEDMALLOC(sizeof(stacktype), CACHE_LINE_ALIGNMENT))
+  {}
+  virtual ~gridbuilder() { ALIGNEDFREE(stack); }
+
+  typedef edgecache::edge edge;
+
   INLINE u32 qef_index(const vec3i &xyz) const {
-    assert(all(ge(xyz,vec3i(zero))) && all(lt(xyz,vec3i(SUBGRID))));
-    return xyz.x + (xyz.y + xyz.z * SUBGRID) * SUBGRID;
+    assert(all(ge(xyz,vec3i(zero))) && all(lt(xyz,vec3i(DIM))));
+    return xyz.x + (xyz.y + xyz.z * DIM) * DIM;
   }
   INLINE u32 field_index(const vec3i &xyz) {
     assert(all(ge(xyz,vec3i(zero))) && all(lt(xyz,vec3i(FIELDDIM))));
@@ -331,9 +712,57 @@ struct gridbuilder {
     const auto offset = start.x + (start.y + start.z * FIELDDIM) * FIELDDIM;
     return offset + edge * FIELDNUM;
   }
-  INLINE fielditem &field(const vec3i &xyz) {return m_field[field_index(xyz)];}
+  INLINE fielditem field(const vec3i &xyz) {
+    return FIELD::decode(m_field[field_index(xyz)], cellsize);
+  }
+  INLINE void setfield(const vec3i &xyz, const fieldtype &f) {
+    m_field[field_index(xyz)] = f;
+  }
+
+  // csg distances are lower bounds of the actual distance. if the center of
+  // the block is further from the surface than the block half diagonal, the
+  // whole block is in the air and we only store the bound. we cannot do the
+  // same for solid blocks since material changes inside matter
+  bool skipblock(const vec3i &start, const vec3i &end, float d) {
+    const auto pmin = vertex(start), pmax = vertex(end-1);
+    const auto radius = 0.5f*length(pmax-pmin);
+    if (d <= radius) return false;
+    const auto bound = FIELD::encode(fielditem(d-radius, csg::MAT_AIR_INDEX), cellsize);
+    loopxyz(start, end) setfield(xyz, bound);
+    STATS_ADD(iso_skipped_num, reducemul(end-start));
+    return true;
+  }
+
+  // distances at the centers of all the blocks, by packets of the simd
+  // kernels. a larger culling box only gives smaller lower bounds
+  static const u32 BLOCKDIM = (FIELDDIM+3)/4;
+  static const u32 BLOCKNUM = BLOCKDIM*BLOCKDIM*BLOCKDIM;
+  void blockdist(float *blockd) {
+    auto &pos = stack->p;
+    auto &d = stack->d;
+    auto &m = stack->m;
+    auto box = aabb::empty();
+    u32 first = 0, num = 0;
+    stepxyz(vec3i(zero), vec3i(FIELDDIM), vec3i(4)) {
+      const auto end = min(sxyz+4,vec3i(FIELDDIM));
+      const auto pmin = vertex(sxyz), pmax = vertex(end-1);
+      csg::set(pos, (pmin+pmax)*0.5f, num++);
+      box = sum(box, aabb(pmin-2.f*cellsize, pmin+6.f*cellsize));
+      if (num == PACKET || first+num == BLOCKNUM) {
+        csgdist(m_prog, pos, NULL, d, m, int(num), box, NULL);
+        loopi(int(num)) blockd[first+i] = d[i];
+        first += num;
+        num = 0;
+        box = aabb::empty();
+      }
+    }
+    STATS_ADD(iso_num, BLOCKNUM);
+  }
 
   void initfield() {
+    float blockd[BLOCKNUM];
+    blockdist(blockd);
+    u32 block = 0;
     stepxyz(vec3i(zero), vec3i(FIELDDIM), vec3i(4)) {
       auto &pos = stack->p;
       auto &d = stack->d;
@@ -342,17 +771,18 @@ struct gridbuilder {
       const auto box = aabb(p-2.f*cellsize, p+6.f*cellsize);
       int index = 0;
       const auto end = min(sxyz+4,vec3i(FIELDDIM));
+      STATS_ADD(iso_grid_num, reducemul(end-sxyz));
+      if (skipblock(sxyz, end, blockd[block++])) continue;
       loopxyz(sxyz, end) csg::set(pos, vertex(xyz), index++);
-      CSGVER::dist(m_node, pos, NULL, d, m, index, box);
+      csgdist(m_prog, pos, NULL, d, m, index, box, NULL);
 #if !defined(NDEBUG)
       loopi(index) assert(d[i] <= 0.f || m[i] == csg::MAT_AIR_INDEX);
       loopi(index) assert(d[i] >= 0.f || m[i] != csg::MAT_AIR_INDEX);
 #endif /* NDEBUG */
       STATS_ADD(iso_num, index);
-      STATS_ADD(iso_grid_num, index);
       index = 0;
       loopxyz(sxyz, end) {
-        field(xyz) = fielditem(d[index], m[index]);
+        setfield(xyz, FIELD::encode(fielditem(d[index], m[index]), cellsize));
         ++index;
       }
     }
@@ -378,8 +808,8 @@ struct gridbuilder {
       if (m0 == m1) continue;
       const auto e = getedge(icubev[idx0], icubev[idx1]);
       auto &idx = m_edge_index[edge_index(xyz+e.first, e.second)];
-      if (idx == NOINDEX) {
-        idx = delayed_edges.length();
+      if (idx == NOEDGE) {
+        idx = edgeindex(delayed_edges.length());
         delayed_edges.add(makepair(xyz, vec4i(idx0, idx1, m0, m1)));
       }
       edgemap |= 1<<i;
@@ -387,8 +817,8 @@ struct gridbuilder {
     return edgemap;
   }
 
-  void edgepos(const csg::node *node, edgestack &stack, int num) {
-    assert(num <= 64);
+  void edgepos(stacktype &stack, int num) {
+    assert(num <= int(PACKET));
     auto &it = stack.it;
     auto &pos = stack.pos, &p = stack.p;
     auto &d = stack.d;
@@ -406,7 +836,7 @@ struct gridbuilder {
       }
       box.pmin -= 3.f * cellsize;
       box.pmax += 3.f * cellsize;
-      CSGVER::dist(m_node, pos, NULL, d, m, num, box);
+      csgdist(m_prog, pos, NULL, d, m, num, box, NULL);
       if (k != MAX_STEPS-1) {
         loopi(num) {
           assert(!isnan(d[i]));
@@ -433,19 +863,43 @@ struct gridbuilder {
     STATS_ADD(iso_num, num*MAX_STEPS);
   }
 
+  // edges touching the leaf borders are also computed by the neighbors
+  INLINE bool sharededge(const vec3i &lower) const {
+    return any(eq(lower,vec3i(zero))) || any(eq(lower,vec3i(DIM)));
+  }
+
   void finishedges() {
     const auto len = delayed_edges.length();
     STATS_ADD(iso_edge_num, len);
-    for (int i = 0; i < len; i += 64) {
+    STATS_SAMPLE(iso_edge_batch, len);
+    m_edges.setsize(len);
+
+    // step 0 - look for the shared edges our neighbors already computed.
+    // everything else is computed below
+    m_missing.setsize(0);
+    loopi(len) {
+      const auto &e = delayed_edges[i];
+      const auto edge = getedge(icubev[e.second.x], icubev[e.second.y]);
+      const auto lower = e.first+edge.first;
+      if (m_cache && sharededge(lower) &&
+          m_cache->find(edgekey(lower, edge.second), m_edges[i])) {
+        STATS_INC(iso_edge_cached_num);
+        continue;
+      }
+      m_missing.add(i);
+    }
+
+    const auto missing = m_missing.length();
+    for (int i = 0; i < missing; i += PACKET) {
       auto &it = stack->it;
 
-      // step 1 - run bisection with packets of (up-to) 64 points. we need
+      // step 1 - run bisection with packets of (up-to) PACKET points. we need
       // to be careful FP wise. We ensure here that the position computation is
       // invariant from grids to grids such that neighbor grids will output the
       // exact same result
-      const int num = min(64, len-i);
+      const int num = min(int(PACKET), missing-i);
       loopj(num) {
-        const auto &e = delayed_edges[i+j];
+        const auto &e = delayed_edges[m_missing[i+j]];
         const auto idx0 = e.second.x, idx1 = e.second.y;
         const auto xyz = e.first;
         const auto edge = getedge(icubev[idx0], icubev[idx1]);
@@ -462,56 +916,60 @@ struct gridbuilder {
           swap(it[j].m0,it[j].m1);
         }
       }
-      edgepos(m_node, *stack, num);
-
-      // step 2 - compute normals for each point using packets of 16x4 points
-      const auto dx = vec3f(DEFAULT_GRAD_STEP, 0.f, 0.f);
-      const auto dy = vec3f(0.f, DEFAULT_GRAD_STEP, 0.f);
-      const auto dz = vec3f(0.f, 0.f, DEFAULT_GRAD_STEP);
-      for (int j = 0; j < num; j += 16) {
-        const int subnum = min(num-j, 16);
-        auto &p = stack->p;
-        auto &d = stack->d;
-        auto &m = stack->m;
-        auto &nd = stack->nd;
-        auto box = aabb::empty();
-        loopk(subnum) {
-          const auto center = it[j+k].org + it[j+k].p0 * cellsize;
-          csg::set(p, center,    4*k+0);
-          csg::set(p, center-dx, 4*k+1);
-          csg::set(p, center-dy, 4*k+2);
-          csg::set(p, center-dz, 4*k+3);
-          box.pmin = min(center, box.pmin);
-          box.pmax = max(center, box.pmax);
-        }
-        box.pmin -= 3.f * cellsize;
-        box.pmax += 3.f * cellsize;
-
-        loopk(4*subnum) {
-          const auto m0 = it[j+k/4].m0;
-          const auto m1 = it[j+k/4].m1;
-          bool const solidsolid = m0 != csg::MAT_AIR_INDEX && m1 != csg::MAT_AIR_INDEX;
-          nd[k] = solidsolid ? cellsize : 0.f;
-        }
-        CSGVER::dist(m_node, p, &nd, d, m, 4*subnum, box);
-        STATS_ADD(iso_num, 4*subnum);
-        STATS_ADD(iso_gradient_num, 4*subnum);
-
-        loopk(subnum) {
-          const auto c    = d[4*k+0];
-          const auto dfdx = d[4*k+1];
-          const auto dfdy = d[4*k+2];
-          const auto dfdz = d[4*k+3];
-          const auto grad = vec3f(c-dfdx, c-dfdy, c-dfdz);
-          const auto n = grad==vec3f(zero) ? vec3f(zero) : normalize(grad);
-          const auto p = it[j+k].p0;
-          m_edges.add({p,n,vec2i(it[j+k].m0,it[j+k].m1)});
-        }
+      edgepos(*stack, num);
+
+      // step 2 - compute normals for each point with the analytic gradient
+      auto &p = stack->p;
+      auto &d = stack->d;
+      auto &m = stack->m;
+      auto &nd = stack->nd;
+      auto &grad = stack->grad;
+      auto box = aabb::empty();
+      loopj(num) {
+        const auto center = it[j].org + it[j].p0 * cellsize;
+        csg::set(p, center, j);
+        box.pmin = min(center, box.pmin);
+        box.pmax = max(center, box.pmax);
+        const auto m0 = it[j].m0, m1 = it[j].m1;
+        bool const solidsolid = m0 != csg::MAT_AIR_INDEX && m1 != csg::MAT_AIR_INDEX;
+        nd[j] = solidsolid ? cellsize : 0.f;
+      }
+      box.pmin -= 3.f * cellsize;
+      box.pmax += 3.f * cellsize;
+      csgdist(m_prog, p, &nd, d, m, num, box, &grad);
+      STATS_ADD(iso_num, num);
+      STATS_ADD(iso_gradient_num, num);
+      loopj(num) {
+        const auto g = csg::get(grad, j);
+        const auto n = g==vec3f(zero) ? vec3f(zero) : normalize(g);
+        const auto p = it[j].p0;
+        m_edges[m_missing[i+j]] = {p,n,vec2i(it[j].m0,it[j].m1)};
       }
     }
+
+    // step 3 - publish our shared edges
+    if (m_cache == NULL) return;
+    loopv(m_missing) {
+      const auto idx = m_missing[i];
+      const auto &e = delayed_edges[idx];
+      const auto edge = getedge(icubev[e.second.x], icubev[e.second.y]);
+      const auto lower = e.first+edge.first;
+      if (sharededge(lower))
+        m_cache->insert(edgekey(lower, edge.second), m_edges[idx]);
+    }
   }
 
+  // vertex waiting for its qef to be solved
+  struct pendingvertex {
+    qef::qem q;
+    vec3f mass;
+    vec3i xyz;
+    pair<int,int> mat;
+  };
+
   void finishvertices() {
+    m_pending.setsize(0);
+    m_qefcells.setsize(0);
     loopv(delayed_qef) {
       const auto &item = delayed_qef[i];
       const auto xyz = item.first;
@@ -532,7 +990,7 @@ struct gridbuilder {
         const auto idx0 = interptable[i][0], idx1 = interptable[i][1];
         const auto e = getedge(icubev[idx0], icubev[idx1]);
         const auto idx = m_edge_index[edge_index(xyz+e.first, e.second)];
-        assert(idx != NOINDEX);
+        assert(idx != NOEDGE);
         const auto mat0 = min(m_edges[idx].mat.x, m_edges[idx].mat.y);
         const auto mat1 = max(m_edges[idx].mat.x, m_edges[idx].mat.y);
         const auto edgemat = makepair(mat0, mat1);
@@ -549,151 +1007,312 @@ struct gridbuilder {
       }
       mass /= float(num);
 
-      // compute the QEF minimizing point
-      double matrix[12][3];
-      double vector[12];
+      // setup the QEF. all of them are solved at once below
+      auto &cell = m_qefcells.add();
+      cell.rows = num;
       loopi(num) {
-        loopj(3) matrix[i][j] = double(n[i][j]);
-        const auto d = p[i] - mass;
-        vector[i] = double(dot(n[i],d));
+        cell.n[i] = n[i];
+        cell.d[i] = dot(n[i], p[i]-mass);
       }
-      const auto pos = mass + qef::evaluate(matrix, vector, num);
-      const auto worldpos = vertex(xyz) + pos*cellsize;
-      const auto localpos = (vec3f(xyz)+pos)*cellsize;
+      m_pending.add({q,mass,xyz,multimat?airmat:mat});
+    }
+
+    // compute the QEF minimizing points
+    const auto num = m_pending.length();
+    m_qefpos.setsize(num);
+    if (num == 0) return;
+    const auto fallback = qef::evaluate(&m_qefcells[0], &m_qefpos[0], num);
+    STATS_ADD(iso_qef_fallback_num, fallback);
+    (void) fallback; // only used for statistics
+    loopi(num) {
+      const auto &v = m_pending[i];
+      const auto pos = v.mass + m_qefpos[i];
+      const auto worldpos = vertex(v.xyz) + pos*cellsize;
+      const auto localpos = (vec3f(v.xyz)+pos)*cellsize;
 
       // insert the point in the leaf octree
-      pl.leaf.insert(xyz,pl.leaf.pts.length());
-      pl.leaf.pts.add({worldpos,localpos,q,xyz,multimat?airmat:mat});
+      pl.leaf.insert(v.xyz,pl.leaf.pts.length());
+      pl.leaf.pts.add({worldpos,localpos,v.q,v.xyz,v.mat});
+    }
+  }
+
+  // one row of bits per x row of the field. bit x of sign is set when the
+  // field is negative and bit x of nearby when it is within two cells of the
+  // surface
+  void fieldbits(rowbits *sign, rowbits *nearby) {
+    loopi(int(FIELDDIM*FIELDDIM)) {
+      rowbits s = 0, n = 0;
+      FIELD::bits(&m_field[i*FIELDDIM], FIELDDIM, cellsize, s, n);
+      sign[i] = s;
+      nearby[i] = n;
     }
   }
 
+  // crossing edges are the xors of the sign rows with their neighbor rows.
+  // only the cells starting such an edge close to the surface are visited
   void tesselate() {
-    loopxyz(vec3i(zero), vec3i(FIELDDIM)) {
-      const auto startfield = field(xyz);
-      const auto startsign = startfield.d < 0.f ? 1 : 0;
-      if (abs(field(xyz).d) > 2.f*cellsize) continue;
-
-      // some quads belong to our neighbor. we will not push them but we need to
-      // compute their vertices such that our neighbor can output these quads
-      const auto outside = any(eq(xyz,0));
-
-      // look at the three edges that start on xyz
-      loopi(3) {
-
-        // is it an actual edge?
-        const auto end = xyz+axis[i];
-        if (any(ge(end,vec3i(FIELDDIM)))) continue;
-        const auto endfield = field(end);
-        const int endsign = endfield.d < 0.f ? 1 : 0;
-        if (startsign == endsign) continue;
-
-        // we found one edge. we output one quad for it
-        const auto axis0 = axis[(i+1)%3];
-        const auto axis1 = axis[(i+2)%3];
-        const vec3i p[] = {xyz, xyz-axis0, xyz-axis0-axis1, xyz-axis1};
-        loopj(4) {
-          const auto np = p[j];
-          if (any(lt(np,vec3i(zero))) || any(ge(np,vec3i(SUBGRID))))
-            continue;
-          const auto idx = qef_index(np);
-          if (m_qef_index[idx] == NOINDEX) {
-            mcell cell;
-            loopk(8) cell[k] = field(np+icubev[k]);
-            m_qef_index[idx] = m_qefnum++;
-            delayed_qef.add(makepair(np, delayed_qef_vertex(cell, np)));
-            STATS_INC(iso_qef_num);
+    auto sign = m_sign;
+    rowbits nearby[FIELDDIM*FIELDDIM];
+    fieldbits(sign, nearby);
+    for (u32 row = 0; row < FIELDDIM*FIELDDIM; ++row) {
+      const auto y = row%FIELDDIM, z = row/FIELDDIM;
+      const auto s = sign[row];
+      const rowbits edges[] = {
+        rowbits((s ^ (s>>1)) & ((rowbits(1)<<(FIELDDIM-1))-1)),
+        y+1 < FIELDDIM ? rowbits(s ^ sign[row+1]) : rowbits(0),
+        z+1 < FIELDDIM ? rowbits(s ^ sign[row+FIELDDIM]) : rowbits(0)
+      };
+      auto active = rowbits((edges[0]|edges[1]|edges[2]) & nearby[row]);
+      for (; active != 0; active &= active-1) {
+        const auto x = lowestbit(active);
+        const vec3i xyz(x,y,z);
+        const auto startfield = field(xyz);
+        const auto startsign = startfield.d < 0.f ? 1 : 0;
+
+        // some quads belong to our neighbor. we will not push them but we need to
+        // compute their vertices such that our neighbor can output these quads
+        const auto outside = any(eq(xyz,0));
+
+        // look at the three edges that start on xyz
+        loopi(3) {
+
+          // is it an actual edge?
+          if (((edges[i]>>x)&1) == 0) continue;
+          const auto endfield = field(xyz+axis[i]);
+
+          // we found one edge. we output one quad for it
+          const auto axis0 = axis[(i+1)%3];
+          const auto axis1 = axis[(i+2)%3];
+          const vec3i p[] = {xyz, xyz-axis0, xyz-axis0-axis1, xyz-axis1};
+          loopj(4) {
+            const auto np = p[j];
+            if (any(lt(np,vec3i(zero))) || any(ge(np,vec3i(DIM))))
+              continue;
+            const auto idx = qef_index(np);
+            if (m_qef_index[idx] == NOQEF) {
+              mcell cell;
+              loopk(8) cell[k] = field(np+icubev[k]);
+              m_qef_index[idx] = qefindex(m_qefnum++);
+              delayed_qef.add(makepair(np, delayed_qef_vertex(cell, np)));
+              STATS_INC(iso_qef_num);
+            }
           }
-        }
 
-        // we must use a more compact storage for it
-        if (outside) continue;
-        const auto qor = startsign==1 ? quadorder : quadorder_cc;
-        const quad q = {{p[qor[0]],p[qor[1]],p[qor[2]],p[qor[3]]},
-          max(startfield.m, endfield.m)
-        };
-        pl.leaf.quads.add(q);
+          // we must use a more compact storage for it
+          if (outside) continue;
+          const auto qor = startsign==1 ? quadorder : quadorder_cc;
+          const quad q = {{p[qor[0]],p[qor[1]],p[qor[2]],p[qor[3]]},
+            max(startfield.m, endfield.m)
+          };
+          pl.leaf.quads.add(q);
+        }
       }
     }
   }
 
-  void outputoctree(octree::node &node, int src = 0, int dst = 0) {
+  // count the points of the merged leaf octree to allocate them at once
+  void countoctree(int src, u32 &ptnum) {
     const auto from = pl.leaf.getnode(src);
-    const auto to = node.leaf->getnode(dst);
-    to->isleaf = from->isleaf;
-    to->empty = from->empty;
+    if (from->isleaf) {
+      if (!from->empty) ++ptnum;
+      return;
+    }
+    loopi(8) countoctree(from->idx+i, ptnum);
+  }
 
-    // if this is a leaf we stop here
+  // the point of a merged node fills all the cells it covers
+  void outputoctree(octree::leafdata &leaf, int src = 0,
+                    const vec3i &org = vec3i(zero), int size = DIM) {
+    const auto from = pl.leaf.getnode(src);
     if (from->isleaf) {
-      if (!from->empty) {
-        to->idx = node.leaf->pts.length();
-        node.leaf->pts.add({pl.leaf.pts[from->idx].world,-1});
-      }
+      if (from->empty) return;
+      const auto idx = s16(leaf.ptnum);
+      leaf.pts[leaf.ptnum++] = {pl.leaf.pts[from->idx].world,-1};
+      loopxyz(org, org+size) leaf.index[(xyz.z*DIM+xyz.y)*DIM+xyz.x] = idx;
       return;
     }
+    const auto half = size/2;
+    loopi(8) outputoctree(leaf, from->idx+i, org+half*icubev[i], half);
+  }
+
+  void output(arena &a, octree::leafdata &leaf, quad *quads, u32 quadnum) {
+    u32 ptnum = 0;
+    countoctree(0, ptnum);
+    leaf.index = a.alloc<s16>(QEFNUM);
+    leaf.pts = a.alloc<octree::qefpoint>(ptnum);
+    leaf.quads = quads;
+    leaf.ptnum = 0;
+    leaf.quadnum = quadnum;
+    leaf.dim = DIM;
+    memset(leaf.index, 0xff, QEFNUM*sizeof(s16));
+    outputoctree(leaf);
+    assert(leaf.ptnum == ptnum);
+  }
 
-    // otherwise, we create all 8 children and recurse
-    const auto idx = node.leaf->root.length();
-    to->idx = idx;
-    node.leaf->root.setsize(idx+8);
-    loopi(8) outputoctree(node, from->idx+i, idx+i);
+  // a cell is solid for the occupancy once one of its corners is inside
+  void outputsolid(u32 *solid) {
+    const auto mask = rowbits((rowbits(1)<<DIM)-1);
+    loopi(int(DIM*DIM)) {
+      const auto row = u32(i)%DIM + (u32(i)/DIM)*FIELDDIM;
+      const auto s = m_sign[row]|m_sign[row+1]|m_sign[row+FIELDDIM]|m_sign[row+FIELDDIM+1];
+      solid[i] = u32((s|(s>>1)) & mask);
+    }
   }
 
   void output(octree::node &node) {
-    node.leaf->root.setsize(1);
-    outputoctree(node);
-    node.leaf->root.refit();
-    node.leaf->pts.refit();
-    pl.leaf.quads.moveto(node.leaf->quads);
+    auto &a = getarena();
+    const auto lodnum = m_octree->m_lodnum;
+    const auto quadnum = u32(pl.leaf.quads.length());
+    const auto leaf = a.alloc<octree::leafdata>(lodnum);
+    const auto quads = a.alloc<quad>(quadnum);
+    const auto solid = a.alloc<u32>(DIM*DIM);
+    loopi(s32(quadnum)) quads[i] = pl.leaf.quads[i];
+    outputsolid(solid);
+
+    // each level of detail collapses more of the previous one
+    loopi(lodnum) {
+      if (i != 0) pl.merge(0, 1u<<i);
+      output(a, leaf[i], quads, quadnum);
+      leaf[i].solid = solid;
+    }
+    node.leaf = leaf;
   }
 
-  void build(octree::node &node) {
-    pl.leaf.init();
+  virtual void build(octree::node &node) {
+    u64 start;
+    pl.leaf.init(DIM);
+    profiler::begin(PHASE_FIELD, start);
+    pruneprogram(FIELDDIM);
     initfield();
+    profiler::end(PHASE_FIELD, start);
+    profiler::begin(PHASE_EDGES, start);
     initedge();
+    profiler::end(PHASE_EDGES, start);
+    profiler::begin(PHASE_QEF, start);
     initqef();
+    profiler::end(PHASE_QEF, start);
+    profiler::begin(PHASE_TESSELATE, start);
     tesselate();
+    profiler::end(PHASE_TESSELATE, start);
+    profiler::begin(PHASE_EDGES, start);
     finishedges();
+    profiler::end(PHASE_EDGES, start);
+    profiler::begin(PHASE_QEF, start);
     finishvertices();
+    profiler::end(PHASE_QEF, start);
+    pl.sign = m_sign;
+    const auto maxdist = 0.01*double(isosimplify)*double(cellsize);
+    pl.maxerror = max(QEM_LEAF_MIN_ERROR, maxdist*maxdist);
     pl.merge();
+    pl.decimate();
     output(node);
   }
 
-  const csg::node *m_node;
-  vector<fielditem> m_field;
-  vector<u32> m_qef_index;
-  vector<u32> m_edge_index;
+  vector<fieldtype> m_field;
+  vector<qefindex> m_qef_index;
+  vector<edgeindex> m_edge_index;
   vector<edge> m_edges;
+  vector<pendingvertex> m_pending;
+  vector<qef::qefcell> m_qefcells;
+  vector<vec3f> m_qefpos;
   vector<pair<vec3i,vec4i>> delayed_edges;
   vector<pair<vec3i,int>> delayed_qef;
-  edgestack *stack;
-  const octree *m_octree;
-  procleaf pl;
-  vec3f m_org;
-  vec3i m_iorg;
-  float cellsize;
+  stacktype *stack;
+  vector<int> m_missing;
+  procleaf<DIM> pl;
+  rowbits m_sign[FIELDDIM*FIELDDIM]; // kept for the topology tests of pl
   u32 m_qefnum;
-  u32 maxlvl, level;
 };
 
+/*-------------------------------------------------------------------------
+ - all the compiled builder configurations
+ -------------------------------------------------------------------------*/
+template <u32 DIM, u32 PACKET, typename FIELD>
+static gridbuilderbase *newbuilder() {
+  typedef gridbuilder<DIM,PACKET,FIELD> builder;
+  return NEWE(builder);
+}
+struct builderconfig {
+  config cfg;
+  gridbuilderbase *(*make)();
+};
+static const builderconfig configs[] = {
+  {{8,16,0}, newbuilder<8,16,fullfield>},
+  {{8,32,0}, newbuilder<8,32,fullfield>},
+  {{8,64,0}, newbuilder<8,64,fullfield>},
+  {{16,16,0}, newbuilder<16,16,fullfield>},
+  {{16,32,0}, newbuilder<16,32,fullfield>},
+  {{16,64,0}, newbuilder<16,64,fullfield>},
+  {{32,16,0}, newbuilder<32,16,fullfield>},
+  {{32,32,0}, newbuilder<32,32,fullfield>},
+  {{32,64,0}, newbuilder<32,64,fullfield>},
+  {{8,16,1}, newbuilder<8,16,compactfield>},
+  {{8,32,1}, newbuilder<8,32,compactfield>},
+  {{8,64,1}, newbuilder<8,64,compactfield>},
+  {{16,16,1}, newbuilder<16,16,compactfield>},
+  {{16,32,1}, newbuilder<16,32,compactfield>},
+  {{16,64,1}, newbuilder<16,64,compactfield>},
+  {{32,16,1}, newbuilder<32,16,compactfield>},
+  {{32,32,1}, newbuilder<32,32,compactfield>},
+  {{32,64,1}, newbuilder<32,64,compactfield>}
+};
+static const u32 CONFIGNUM = ARRAY_ELEM_NUM(configs);
+static const u32 DEFAULTCONFIG = 5; // SUBGRID leaves and packets of 64 points
+
+VARP(isoleafdim, 8, SUBGRID, 32);
+VARP(isopacketsize, 16, 64, 64);
+VARP(isocompactfield, 0, 0, 1);
+
+static u32 findconfig(const config &cfg) {
+  loopi(s32(CONFIGNUM))
+    if (configs[i].cfg.leafdim == cfg.leafdim &&
+        configs[i].cfg.packetsize == cfg.packetsize &&
+        configs[i].cfg.compact == cfg.compact)
+      return i;
+  return CONFIGNUM;
+}
+
+// unknown configurations set from the scripts fall back to the default one
+static u32 currentconfigidx() {
+  const config cfg = {u32(isoleafdim), u32(isopacketsize), u32(isocompactfield)};
+  const auto idx = findconfig(cfg);
+  return idx == CONFIGNUM ? DEFAULTCONFIG : idx;
+}
+
+u32 confignum() { return CONFIGNUM; }
+config getconfig(u32 idx) { assert(idx < CONFIGNUM); return configs[idx].cfg; }
+config currentconfig() { return configs[currentconfigidx()].cfg; }
+bool setconfig(const config &cfg) {
+  if (findconfig(cfg) == CONFIGNUM) return false;
+  isoleafdim = int(cfg.leafdim);
+  isopacketsize = int(cfg.packetsize);
+  isocompactfield = int(cfg.compact);
+  return true;
+}
+
 /*-------------------------------------------------------------------------
  - multi-threaded implementation of the iso surface extraction
  -------------------------------------------------------------------------*/
-static THREAD gridbuilder *localbuilder = NULL;
+static THREAD gridbuilderbase *localbuilders[CONFIGNUM];
 struct context {
   INLINE context() : m_mutex(SDL_CreateMutex()) {}
   SDL_mutex *m_mutex;
-  vector<gridbuilder*> m_builders;
+  vector<gridbuilderbase*> m_builders;
 };
 static context *ctx = NULL;
 
+// leaves claimed at once by a thread. fewer when the last ones are left
+static const u32 CONTOURINGGRAIN = 8;
+
 // run the contouring part per leaf of octree using small grids
 struct contouringtask : public task {
 
   // what to run per task iteration
   struct workitem {
-    const csg::node *csgnode;
+    const csg::program *csgprog;
     struct octree::node *octnode;
     struct octree *oct;
+    edgecache *cache;
     vec3i iorg;
     vec3f org;
     int level;
@@ -702,144 +1321,548 @@ struct contouringtask : public task {
   };
 
   INLINE contouringtask(vector<workitem> &items) :
-    task("contouringtask", items.length()), items(items)
+    task("contouringtask", items.length(), 0, 0, FAIR, CONTOURINGGRAIN), items(items)
   {}
 
   virtual void run(u32 idx) {
+    // the builder is allocated and first touched by the worker itself. when
+    // workers are pinned, its buffers stay on the numa node of the worker
+    const auto &job = items[idx];
+    auto &localbuilder = localbuilders[job.oct->m_config];
     if (localbuilder == NULL) {
-      localbuilder = NEWE(gridbuilder);
+      localbuilder = configs[job.oct->m_config].make();
       SDL_LockMutex(ctx->m_mutex);
       ctx->m_builders.add(localbuilder);
       SDL_UnlockMutex(ctx->m_mutex);
     }
-    const auto &job = items[idx];
     localbuilder->m_octree = job.oct;
     localbuilder->m_iorg = job.iorg;
     localbuilder->level = job.octnode->level;
     localbuilder->maxlvl = job.maxlvl;
     localbuilder->setcellsize(job.cellsize);
-    localbuilder->setnode(job.csgnode);
+    localbuilder->setprogram(job.csgprog);
+    localbuilder->setcache(job.cache);
     localbuilder->setorg(job.org);
     localbuilder->build(*job.octnode);
   }
   vector<workitem> &items;
 };
 
-// build the octree topology needed to run contouring
+// octree nodes above this level are built by parallel tasks
+static const u32 PARALLEL_OCTREE_DEPTH = 3;
+
+// build in parallel the eight children of one octree node
+struct isotask;
+struct octreetask : public task {
+  typedef contouringtask::workitem workitem;
+  INLINE octreetask(isotask &iso, octree::node &node) :
+    task("octreetask", 8), iso(iso), node(node) {}
+  virtual void run(u32 idx);
+  isotask &iso;
+  octree::node &node;
+  vector<workitem> items[8];
+};
+
+// build the octree topology needed to run contouring. only the part of the
+// octree that overlaps the dirty box is (re-)built. everything else is kept.
+// top levels of the octree are split into tasks. each of them either spawns
+// the tasks for the next level or builds its subtree and spawns the
+// contouring of its leaves. a task therefore only ends its parent once
 struct isotask : public task {
   typedef contouringtask::workitem workitem;
-  INLINE isotask(octree &o, const csg::node &csgnode,
+  INLINE isotask(octree &o, const csg::program &csgprog,
                  const vec3f &org, float cellsize,
-                 u32 dim) :
+                 u32 dim, const aabb &dirty = aabb::all(),
+                 const vec3i &iorg = vec3i(zero)) :
     task("isotask", 1),
-    oct(&o), csgnode(&csgnode),
-    org(org), cellsize(cellsize),
-    dim(dim)
+    oct(&o), csgprog(&csgprog),
+    org(org), iorg(iorg), cellsize(cellsize),
+    dim(dim), leafdim(o.m_leafdim), dirty(dirty)
   {
-    assert(ispoweroftwo(dim) && dim % SUBGRID == 0);
-    maxlvl = ilog2(dim / SUBGRID);
+    assert(ispoweroftwo(dim) && dim % leafdim == 0);
+    maxlvl = ilog2(dim / leafdim);
   }
 
   virtual void run(u32) {
-    build(oct->m_root);
-    preparejobs(oct->m_root);
-    spawnnext();
+    {
+      PROFILE(PHASE_OCTREE);
+      build(oct->m_root, vec3i(zero), 0, items, *this);
+    }
+    contour(items, *this);
   }
 
   INLINE vec3f pos(const vec3i &xyz) {
-    return org+cellsize*vec3f(xyz);
+    return org+cellsize*vec3f(iorg+xyz);
+  }
+
+  // a leaf samples its field one cell beyond its border and its neighbors
+  // reference its vertices. we therefore use a two cell margin to be safe
+  INLINE bool isdirty(const vec3i &xyz, u32 level) {
+    const auto lod = maxlvl - level;
+    const auto cellnum = int(dim >> level);
+    const vec3f pmin = pos(xyz - int(2<<lod));
+    const vec3f pmax = pos(xyz + cellnum + int(2<<lod));
+    return intersect(aabb(pmin,pmax), dirty);
+  }
+
+  // the leaf data of a re-contoured leaf stays in the arenas until the
+  // octree compacts them
+  void clear(octree::node &node) {
+    if (node.isleaf && node.leaf) atomic_add(&oct->m_deadleaves, 1);
+    if (!node.isleaf) SAFE_DELA(node.children);
+    node.children = NULL;
+    node.isleaf = node.empty = node.solid = 0;
   }
 
-  void build(octree::node &node, const vec3i &xyz = vec3i(zero), u32 level = 0) {
+  // nodes split before keep their children and only the ones that overlap
+  // the dirty box are built again
+  void build(octree::node &node, const vec3i &xyz, u32 level,
+             vector<workitem> &jobs, task &owner) {
+    if (!isdirty(xyz, level)) {
+      // never built so far. there is nothing to contour here
+      if (!node.isleaf && node.children == NULL) node.isleaf = node.empty = 1;
+      return;
+    }
+    if ((node.isleaf || node.children == NULL) && !split(node, xyz, level, jobs))
+      return;
+    const auto cellnum = int(dim >> level);
+    if (level < PARALLEL_OCTREE_DEPTH) {
+      ref<task> children = NEWTASK(octreetask, *this, node);
+      children->ends(owner);
+      children->scheduled();
+    } else loopi(8) {
+      const auto childxyz = xyz+cellnum*icubev[i]/2;
+      build(node.children[i], childxyz, level+1, jobs, owner);
+    }
+  }
+
+  // build the node again from the field. false if it ends up as a leaf,
+  // either empty or waiting for its contouring
+  bool split(octree::node &node, const vec3i &xyz, u32 level, vector<workitem> &jobs) {
+    const auto wassolid = node.isleaf && node.empty && node.solid;
+    clear(node);
     node.level = level;
     node.org = xyz;
 
     // bounding box of this octree cell
     const auto lod = maxlvl - level;
     const vec3f pmin = pos(xyz - int(4<<lod));
-    const vec3f pmax = pos(xyz + int((SUBGRID+4)<<lod));
+    const vec3f pmax = pos(xyz + int((leafdim+4)<<lod));
 
     // center of the box where to evaluate the distance field
     const auto cellnum = int(dim >> level);
     const auto icenter = xyz + cellnum/2;
     const auto center = pos(icenter);
-    const auto dist = csg::dist(csgnode, center, aabb(pmin,pmax));
+    const aabb box(pmin,pmax);
+    const auto dist = csg::dist(csgprog, center, box);
     STATS_INC(iso_octree_num);
     STATS_INC(iso_num);
     if (abs(dist) > sqrt(3.f) * cellsize * float(cellnum/2+2)) {
       node.isleaf = node.empty = 1;
-      return;
+      node.solid = dist < 0.f ? 1 : 0;
+      return false;
     }
-    if (cellnum == SUBGRID) {
+
+    // the field keeps the same sign in the whole box: nothing to contour
+    const auto range = csg::distinterval(csgprog, box);
+    if (range.x > 0.f || range.y < 0.f) {
+      STATS_INC(iso_interval_culled_num);
+      node.isleaf = node.empty = 1;
+      node.solid = range.y < 0.f ? 1 : 0;
+      return false;
+    }
+    if (cellnum == int(leafdim)) {
 #if DEBUGOCTREE
       const vec3f minpos = pos(xyz) - vec3f(debugsize);
-      const vec3f maxpos = pos(xyz+vec3i(SUBGRID)) + vec3f(debugsize);
+      const vec3f maxpos = pos(xyz+vec3i(leafdim)) + vec3f(debugsize);
       if (any(lt(debugpos,minpos)) || any(gt(debugpos,maxpos))) {
         node.empty = node.isleaf = 1;
-        return;
+        return false;
       }
 #endif /* DEBUGOCTREE */
-      node.leaf = NEWE(octree::leaftype);
+      node.leaf = NULL; // filled by the contouring
       node.isleaf = 1;
-    } else {
-      node.children = NEWAE(octree::node, 8);
-      loopi(8) {
-        const auto childxyz = xyz+cellnum*icubev[i]/2;
-        build(node.children[i], childxyz, level+1);
-      }
+      preparejob(node, xyz, jobs);
+      return false;
     }
-  }
 
-  void preparejobs(octree::node &node, const vec3i &xyz = vec3i(zero)) {
-    if (node.isleaf && !node.empty) {
-      auto &job = items.add();
-      job.oct = oct;
-      job.octnode = &node;
-      job.csgnode = csgnode;
-      job.iorg = xyz;
-      job.maxlvl = maxlvl;
-      job.level = node.level;
-      job.cellsize = float(1<<(maxlvl-node.level)) * cellsize;
-      job.org = pos(xyz);
-    } else if (!node.isleaf) loopi(8) {
-      const auto cellnum = dim >> node.level;
-      const auto childxyz = xyz+int(cellnum/2)*icubev[i];
-      preparejobs(node.children[i], childxyz);
+    // children out of the dirty box are never built and keep the state of
+    // the empty leaf they come from
+    node.children = NEWAE(octree::node, 8);
+    loopi(8) {
+      auto &child = node.children[i];
+      child.org = xyz+cellnum*icubev[i]/2;
+      child.level = level+1;
+      child.isleaf = child.empty = 1;
+      child.solid = wassolid;
     }
+    return true;
+  }
+
+  void preparejob(octree::node &node, const vec3i &xyz, vector<workitem> &jobs) {
+    auto &job = jobs.add();
+    job.oct = oct;
+    job.cache = &cache;
+    job.octnode = &node;
+    job.csgprog = csgprog;
+    job.iorg = iorg+xyz;
+    job.maxlvl = maxlvl;
+    job.level = node.level;
+    job.cellsize = float(1<<(maxlvl-node.level)) * cellsize;
+    job.org = pos(xyz);
   }
 
-  void spawnnext() {
-    ref<task> contouring = NEW(contouringtask, items);
-    contouring->ends(*this);
+  void contour(vector<workitem> &jobs, task &owner) {
+    if (jobs.length() == 0) return;
+    ref<task> contouring = NEWTASK(contouringtask, jobs);
+    contouring->ends(owner);
     contouring->scheduled();
   }
 
   vector<workitem> items;
+  edgecache cache;
   octree *oct;
-  const csg::node *csgnode;
+  const csg::program *csgprog;
   vec3f org;
+  vec3i iorg;
   float cellsize;
-  u32 dim, maxlvl;
+  u32 dim, leafdim, maxlvl;
+  aabb dirty;
 };
 
-geom::mesh dc(const vec3f &org, u32 cellnum, float cellsize, const csg::node &csgnode) {
-  octree o(cellnum);
-  geom::mesh m;
+void octreetask::run(u32 idx) {
+  const auto cellnum = int(iso.dim >> node.level);
+  const auto xyz = node.org + cellnum*icubev[idx]/2;
+  {
+    PROFILE(PHASE_OCTREE);
+    iso.build(node.children[idx], xyz, node.level+1, items[idx], *this);
+  }
+  iso.contour(items[idx], *this);
+}
+
+// the mesh builder writes the vertex index of each point it visits. points
+// from untouched leaves need to be reset before we build a new mesh
+static void resetpoints(octree::node &node, u32 lodnum) {
+  if (node.isleaf) {
+    if (node.leaf == NULL) return;
+    loopj(lodnum) loopi(node.leaf[j].ptnum) node.leaf[j].pts[i].idx = -1;
+  } else if (node.children)
+    loopi(8) resetpoints(node.children[i], lodnum);
+}
+
+// the meshes read the leaves from the linear view of the octree
+struct linearizetask : public task {
+  INLINE linearizetask(octree &o) : task("linearizetask"), o(o) {}
+  virtual void run(u32) { o.linearize(); }
+  octree &o;
+};
 
-  ref<task> meshtask = geom::buildmesh(m, o, cellsize);
-  ref<task> contouringtask = NEW(isotask, o, csgnode, org, cellsize, cellnum);
-  contouringtask->starts(*meshtask);
-  meshtask->scheduled();
+// contour and build the first lodnum meshes. they are all built in parallel
+static void dc(dccontext &c, const csg::node &csgnode, geom::mesh *lods,
+               u32 lodnum, const aabb &dirty)
+{
+  MEMORY_TAG(MEM_ISO);
+  assert(lodnum <= c.m_octree.m_lodnum);
+  const auto box = c.m_built ? dirty : aabb::all();
+  selectcsgkernel();
+  if (c.m_built) resetpoints(c.m_octree.m_root, c.m_octree.m_lodnum);
+
+  ref<task> meshtask[MAXLODNUM];
+  const auto prog = csg::compile(csgnode);
+  ref<task> contouringtask = NEWTASK(isotask, c.m_octree, *prog, c.m_org,
+                                 c.m_cellsize, c.m_cellnum, box);
+  ref<task> linear = NEWTASK(linearizetask, c.m_octree);
+  contouringtask->starts(*linear);
+  loopi(lodnum) {
+    meshtask[i] = geom::buildmesh(lods[i], c.m_octree, c.m_cellsize, 1, false, i);
+    linear->starts(*meshtask[i]);
+    meshtask[i]->scheduled();
+  }
+  linear->scheduled();
   contouringtask->scheduled();
-  meshtask->wait();
+  loopi(lodnum) meshtask[i]->wait();
+  csg::destroy(prog);
+  c.m_built = true;
 
-#if !defined(RELEASE)
+#if STATS_ENABLED
   stats();
-#endif /* defined(RELEASE) */
+#endif /* STATS_ENABLED */
+}
+
+geom::mesh dc(dccontext &c, const csg::node &csgnode, const aabb &dirty) {
+  geom::mesh m;
+  dc(c, csgnode, &m, 1, dirty);
+  return m;
+}
+
+void dc(dccontext &c, const csg::node &csgnode, geom::mesh *lods, const aabb &dirty) {
+  dc(c, csgnode, lods, c.m_octree.m_lodnum, dirty);
+}
 
+geom::mesh dc(const vec3f &org, u32 cellnum, float cellsize, const csg::node &csgnode,
+              occupancy **occ) {
+  dccontext c(org, cellnum, cellsize);
+  const auto m = dc(c, csgnode);
+  if (occ) *occ = makeoccupancy(c);
   return m;
 }
 
+/*-------------------------------------------------------------------------
+ - occupancy
+ -------------------------------------------------------------------------*/
+struct occupancybuilder {
+  INLINE occupancybuilder(occupancy &o, const vec3i &first) : o(o), first(first) {}
+
+  // the blocks are filled by the nodes overlapping them. empty nodes out of
+  // the blocks give the state everywhere else
+  void fill(const octree::node &node, const vec3i &org, u32 cellnum) {
+    const auto ld = int(o.leafdim);
+    const auto bmin = org/ld-first, bmax = (org+int(cellnum))/ld-first;
+    const auto pmin = max(bmin, vec3i(zero)), pmax = min(bmax, o.dim);
+    const auto overlap = all(lt(pmin, pmax));
+    if (node.isleaf && node.empty) {
+      const auto state = node.solid ? u32(occupancy::SOLID) : u32(occupancy::AIR);
+      if (overlap) loopxyz(pmin, pmax) o.blocks[index(xyz)] = state;
+      if (any(ne(pmin, bmin)) || any(ne(pmax, bmax))) o.outside = state;
+    } else if (node.isleaf) {
+      if (!overlap || node.leaf == NULL) return;
+      const auto slot = o.mixednum++;
+      const auto rownum = o.leafdim*o.leafdim;
+      memcpy(o.bits+slot*rownum, node.leaf[0].solid, rownum*sizeof(u32));
+      o.blocks[index(pmin)] = slot+2;
+    } else if (node.children) {
+      const auto half = int(cellnum/2);
+      loopi(8) fill(node.children[i], org+half*icubev[i], cellnum/2);
+    }
+  }
+  INLINE u32 index(const vec3i &b) const { return (b.z*o.dim.y+b.y)*o.dim.x+b.x; }
+  occupancy &o;
+  vec3i first;
+};
+
+static INLINE u32 blocknum(const occupancy &o) { return u32(o.dim.x*o.dim.y*o.dim.z); }
+static INLINE u32 rownum(const occupancy &o) { return o.leafdim*o.leafdim; }
+
+static occupancy *newoccupancy(const vec3i &dim, u32 leafdim, u32 mixednum) {
+  const auto o = NEWE(occupancy);
+  o->dim = dim;
+  o->leafdim = leafdim;
+  o->mixednum = 0;
+  o->outside = occupancy::AIR;
+  o->blocks = (u32*) MALLOC(sizeof(u32)*max(blocknum(*o), 1u));
+  o->bits = (u32*) MALLOC(sizeof(u32)*max(mixednum*rownum(*o), 1u));
+  loopi(s32(blocknum(*o))) o->blocks[i] = occupancy::AIR;
+  return o;
+}
+
+occupancy *makeoccupancy(const dccontext &c) {
+  const auto &oct = c.m_octree;
+  const auto ld = int(oct.m_leafdim);
+
+  // leaves with a surface plus one leaf around them
+  const auto leafnum = int(c.m_cellnum)/ld;
+  auto pmin = vec3i(leafnum), pmax = vec3i(-1);
+  loopv(oct.m_leaves) {
+    pmin = min(pmin, oct.m_leaves[i].org/ld);
+    pmax = max(pmax, oct.m_leaves[i].org/ld);
+  }
+  auto dim = vec3i(zero);
+  if (oct.m_leaves.length() != 0) {
+    pmin = max(pmin-1, vec3i(zero));
+    pmax = min(pmax+2, vec3i(leafnum));
+    dim = pmax-pmin;
+  } else
+    pmin = vec3i(zero);
+  const auto o = newoccupancy(dim, oct.m_leafdim, u32(oct.m_leaves.length()));
+  o->org = c.m_org + c.m_cellsize*float(ld)*vec3f(pmin);
+  o->cellsize = c.m_cellsize;
+  occupancybuilder b(*o, pmin);
+  b.fill(oct.m_root, vec3i(zero), c.m_cellnum);
+  return o;
+}
+
+void destroy(occupancy *o) {
+  if (o == NULL) return;
+  FREE(o->blocks);
+  FREE(o->bits);
+  DEL(o);
+}
+
+// the header without its pointers followed by the blocks and the bits
+struct occupancyheader {
+  vec3f org;
+  float cellsize;
+  vec3i dim;
+  u32 leafdim, mixednum, outside;
+};
+
+void *serialize(const occupancy *o, u32 &size) {
+  size = 0;
+  if (o == NULL) return NULL;
+  const occupancyheader h = {o->org, o->cellsize, o->dim, o->leafdim, o->mixednum, o->outside};
+  const auto blocksize = sizeof(u32)*blocknum(*o);
+  const auto bitsize = sizeof(u32)*o->mixednum*rownum(*o);
+  size = u32(sizeof(h)+blocksize+bitsize);
+  const auto data = (u8*) MALLOC(size);
+  memcpy(data, &h, sizeof(h));
+  memcpy(data+sizeof(h), o->blocks, blocksize);
+  memcpy(data+sizeof(h)+blocksize, o->bits, bitsize);
+  return data;
+}
+
+occupancy *makeoccupancy(const void *data, u32 size) {
+  occupancyheader h;
+  if (data == NULL || size < sizeof(h)) return NULL;
+  memcpy((void*) &h, data, sizeof(h)); // data may not be aligned
+  if (any(lt(h.dim, vec3i(zero))) || h.leafdim == 0 || h.leafdim > 32)
+    return NULL;
+  const auto blocks = u64(h.dim.x)*u64(h.dim.y)*u64(h.dim.z);
+  const auto bits = u64(h.mixednum)*u64(h.leafdim*h.leafdim);
+  if (sizeof(h)+sizeof(u32)*(blocks+bits) != u64(size)) return NULL;
+  const auto o = newoccupancy(h.dim, h.leafdim, h.mixednum);
+  const auto src = (const u8*) data + sizeof(h);
+  memcpy(o->blocks, src, sizeof(u32)*blocks);
+  memcpy(o->bits, src+sizeof(u32)*blocks, sizeof(u32)*bits);
+  o->org = h.org;
+  o->cellsize = h.cellsize;
+  o->mixednum = h.mixednum;
+  o->outside = h.outside;
+  loopi(s32(blocks)) if (o->blocks[i] >= h.mixednum+2) {
+    destroy(o);
+    return NULL;
+  }
+  return o;
+}
+
+// state of a block or, for mixed ones, of a cell given in cells of the volume
+static INLINE bool solidcell(const occupancy &o, const vec3i &cell) {
+  const auto ld = int(o.leafdim);
+  const auto b = vec3i(floor(vec3f(cell)/float(ld)));
+  if (any(lt(b, vec3i(zero))) || any(ge(b, o.dim))) return o.outside == occupancy::SOLID;
+  const auto block = o.blocks[(b.z*o.dim.y+b.y)*o.dim.x+b.x];
+  if (block < 2) return block == occupancy::SOLID;
+  const auto l = cell-b*ld;
+  const auto row = o.bits[(block-2)*rownum(o) + u32(l.z*ld+l.y)];
+  return (row >> u32(l.x)) & 1;
+}
+
+static INLINE vec3i cellof(const occupancy &o, const vec3f &p) {
+  return vec3i(floor((p-o.org)/o.cellsize));
+}
+
+bool empty(const occupancy &o, const aabb &box) {
+  const auto pmin = cellof(o, box.pmin), pmax = cellof(o, box.pmax)+1;
+  loopxyz(pmin, pmax) if (solidcell(o, xyz)) return false;
+  return true;
+}
+
+// 3d dda over the cells the segment crosses
+bool visible(const occupancy &o, const vec3f &from, const vec3f &to) {
+  const auto org = (from-o.org)/o.cellsize, end = (to-o.org)/o.cellsize;
+  const auto dir = end-org;
+  auto cell = vec3i(floor(org));
+  const auto last = vec3i(floor(end));
+  vec3i step;
+  vec3f tmax, tdelta;
+  loopi(3) {
+    step[i] = dir[i] > 0.f ? 1 : (dir[i] < 0.f ? -1 : 0);
+    tdelta[i] = step[i] != 0 ? abs(1.f/dir[i]) : FLT_MAX;
+    const auto next = step[i] > 0 ? floor(org[i])+1.f : floor(org[i]);
+    tmax[i] = step[i] != 0 ? (next-org[i])/dir[i] : FLT_MAX;
+  }
+  const auto maxcell = abs(last.x-cell.x)+abs(last.y-cell.y)+abs(last.z-cell.z);
+  for (int n = 0; n <= maxcell; ++n) {
+    if (solidcell(o, cell)) return false;
+    const auto axis = tmax.x < tmax.y ? (tmax.x < tmax.z ? 0 : 2) : (tmax.y < tmax.z ? 1 : 2);
+    cell[axis] += step[axis];
+    tmax[axis] += tdelta[axis];
+  }
+  return true;
+}
+
+/*-------------------------------------------------------------------------
+ - streaming version of the contouring. the world is processed brick by
+ - brick. each brick octree also contours one layer of leaves of its upper
+ - neighbors (the halo) such that its quads can reference their points. the
+ - halo quads are dropped since the neighbors output them
+ -------------------------------------------------------------------------*/
+struct halotask : public task {
+  INLINE halotask(octree &o, u32 bricksize) :
+    task("halotask", 1, 1), o(o), bricksize(bricksize) {}
+  void trim(octree::node &node) {
+    if (node.isleaf) {
+      if (node.leaf && any(ge(node.org, vec3i(bricksize))))
+        loopi(o.m_lodnum) node.leaf[i].quadnum = 0;
+    } else
+      loopi(8) trim(node.children[i]);
+  }
+  virtual void run(u32) {
+    trim(o.m_root);
+    o.linearize();
+  }
+  octree &o;
+  u32 bricksize;
+};
+
+u32 dcstream(const char *filename, const vec3f &org, u32 cellnum,
+             float cellsize, const csg::node &csgnode, u32 bricksize)
+{
+  MEMORY_TAG(MEM_ISO);
+  const auto leafdim = currentconfig().leafdim;
+  assert(ispoweroftwo(bricksize) && bricksize >= leafdim);
+  assert(cellnum % bricksize == 0);
+  auto f = fopen(filename, "wb");
+  if (f == NULL) {
+    con::out("iso: unable to open %s", filename);
+    return 0;
+  }
+  u32 chunknum = 0;
+  fwrite(&chunknum, sizeof(u32), 1, f);
+  selectcsgkernel();
+  const auto prog = csg::compile(csgnode);
+
+  const auto bricknum = cellnum / bricksize;
+  loopxyz(vec3i(zero), vec3i(bricknum)) {
+    const auto iorg = xyz*int(bricksize);
+
+    // own cells plus the halo minus the margin taken by isotask::isdirty
+    const auto end = min(vec3i(bricksize+leafdim), vec3i(cellnum)-iorg);
+    const auto pmin = org+cellsize*vec3f(iorg);
+    const auto pmax = org+cellsize*vec3f(iorg+end-3);
+
+    // build the octree of the brick and mesh it
+    octree o(2*bricksize);
+    geom::mesh m;
+    ref<task> contouring = NEWTASK(isotask, o, *prog, org, cellsize,
+                               2*bricksize, aabb(pmin,pmax), iorg);
+    ref<task> halo = NEWTASK(halotask, o, bricksize);
+    contouring->starts(*halo);
+    halo->scheduled();
+    contouring->scheduled();
+    halo->wait();
+    ref<task> meshtask = geom::buildmesh(m, o, cellsize, 1, true);
+    meshtask->scheduled();
+    meshtask->wait();
+
+    // append it to the stream and free everything
+    if (m.m_indexnum != 0) {
+      geom::store(f, m);
+      ++chunknum;
+    }
+    m.destroy();
+  }
+  csg::destroy(prog);
+  fseek(f, 0, SEEK_SET);
+  fwrite(&chunknum, sizeof(u32), 1, f);
+  fclose(f);
+
+#if STATS_ENABLED
+  stats();
+#endif /* STATS_ENABLED */
+  con::out("iso: %d chunks written in %s", chunknum, filename);
+  return chunknum;
+}
+
 void start() { ctx = NEWE(context); }
 void finish() {
   if (ctx == NULL) return;
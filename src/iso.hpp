@@ -7,6 +7,8 @@
 #include "geom.hpp"
 #include "base/sys.hpp"
 #include "base/vector.hpp"
+#include "base/allocator.hpp"
+#include "base/flat_map.hpp"
 #include "base/math.hpp"
 
 namespace q {
@@ -34,17 +36,20 @@ struct leafoctreebase {
     u32 empty:1;
   };
   INLINE node *getnode(int idx) { return &root[idx]; }
-  INLINE u32 descend(vec3i &xyz, u32 level, u32 idx);
-  void init();
+  static INLINE u32 descend(const node *root, vec3i &xyz, u32 level, u32 idx, u32 depth);
+  static int getidx(const node *root, vec3i xyz, u32 depth);
+  void init(u32 dim);
   void insert(vec3i xyz, int ptidx);
-  int getidx(vec3i xyz);
+  INLINE int getidx(vec3i xyz) { return getidx(root.getbuf(), xyz, depth); }
+  INLINE u32 dim() const { return 1u<<depth; }
   vector<node> root; // root node of the leaf octree
+  u32 depth;         // log2 of the leaf size in cells
 };
 
 template <typename T>
 struct leafoctree : leafoctreebase {
-  void init() {
-    leafoctreebase::init();
+  void init(u32 dim) {
+    leafoctreebase::init(dim);
     quads.setsize(0);
     pts.setsize(0);
   }
@@ -59,34 +64,167 @@ struct leafoctree : leafoctreebase {
 /*-------------------------------------------------------------------------
  - spatial segmentation used for iso surface extraction
  -------------------------------------------------------------------------*/
-struct octree {
+/*-------------------------------------------------------------------------
+ - contouring is compiled for several leaf sizes, simd packet widths and
+ - field storages. each octree uses the configuration selected when it is
+ - created. the default one is SUBGRID^3 cells per leaf, packets of 64
+ - points and a full precision field. the compact field stores 16 bit
+ - distances, materials and indices to fit the builders in l2
+ -------------------------------------------------------------------------*/
+static const u32 SUBGRID = 16;
+struct config {
+  u32 leafdim, packetsize, compact;
+};
+u32 confignum();
+config getconfig(u32 idx);
+// false if it is not compiled in. isoleafdim, isopacketsize and
+// isocompactfield set it from the scripts
+bool setconfig(const config &cfg);
+config currentconfig();
+
+struct octree : noncopyable {
   struct qefpoint {
     vec3f pos;
     int idx;
   };
+
+  // compact leaf as output by contouring. storage lives in an arena. a leaf
+  // node points to m_lodnum of them, one per level of detail. they all share
+  // the same quads. index is a dense table with the point of every cell (-1
+  // if none). cells collapsed together share the same point. dim is the leaf
+  // size in cells
+  struct leafdata {
+    INLINE qefpoint *get(vec3i xyz) {
+      const auto idx = index[(xyz.z*dim+xyz.y)*dim+xyz.x];
+      return idx == -1 ? NULL : pts+idx;
+    }
+    s16 *index;
+    qefpoint *pts;
+    quad *quads;
+    u32 *solid; // dim*dim rows of dim bits, see occupancy
+    u32 ptnum, quadnum, dim;
+  };
   struct node {
-    INLINE node() : children(NULL), level(0), isleaf(0), empty(0) {}
+    INLINE node() : children(NULL), level(0), isleaf(0), empty(0), solid(0) {}
     ~node();
     union {
       node *children;
-      leafoctree<qefpoint> *leaf;
+      leafdata *leaf;
     };
     vec3i org;
-    u32 level:30;
+    u32 level:29;
     u32 isleaf:1;
     u32 empty:1;
+    u32 solid:1; // empty nodes on the inside of the surface
+  };
+  typedef leafdata leaftype;
+
+  // contoured leaf in the linear view of the octree. key is the morton code
+  // of its position counted in leaves
+  struct linearleaf {
+    u64 key;
+    vec3i org;
+    leafdata *leaf;
   };
-  typedef leafoctree<qefpoint> leaftype;
 
-  INLINE octree(u32 dim) : m_dim(dim), m_logdim(ilog2(dim)) {}
-  const node *findleaf(vec3i xyz) const;
+  octree(u32 dim, u32 lodnum = 1);
+  ~octree();
+
+  // sort the contoured leaves in morton order and hash them by key. this is
+  // done once the contouring is over such that meshing never walks the nodes.
+  // the arenas are compacted first when they hold more dead leaves than live
+  // ones
+  void linearize();
+  void compact();
+  const linearleaf *findleaf(vec3i xyz) const;
+
+  // get a new arena owned by the octree. this is thread safe
+  arena *newarena();
   node m_root;
+  vector<linearleaf> m_leaves;
+  flat_map<u64,u32> m_leafindex;
   u32 m_dim, m_logdim;
+  u32 m_lodnum;
+  u32 m_config, m_leafdim, m_logleafdim, m_packetsize;
+  u32 m_id; // unique id so that threads can tell octrees apart
+  vector<arena*> m_arenas;
+  volatile s32 m_deadleaves; // re-contoured since the last compaction
+  SDL_mutex *m_mutex;
 };
-static const u32 SUBGRID = 16;
 
-// tesselate along a grid the distance field with dual contouring algorithm
-geom::mesh dc(const vec3f &org, u32 cellnum, float cellsize, const csg::node &d);
+// level i collapses leaf vertices up to 2^i cells. coarser levels would only
+// find nodes touching the leaf borders which are never collapsed
+static const u32 MAXLODNUM = 3;
+
+/*-------------------------------------------------------------------------
+ - keep the contoured octree alive between two tesselations such that an
+ - edit only re-contours the leaves it touches
+ -------------------------------------------------------------------------*/
+struct dccontext {
+  INLINE dccontext(const vec3f &org, u32 cellnum, float cellsize, u32 lodnum = 1) :
+    m_octree(cellnum, lodnum), m_org(org), m_cellsize(cellsize),
+    m_cellnum(cellnum), m_built(false) {}
+  octree m_octree;
+  vec3f m_org;
+  float m_cellsize;
+  u32 m_cellnum;
+  bool m_built;
+};
+
+/*-------------------------------------------------------------------------
+ - coarse occupancy of the contoured volume for the gameplay queries. blocks
+ - of one leaf cover the leaves with a surface plus one more leaf around
+ - them. a block is air, solid or mixed and mixed blocks keep one bit per
+ - cell, set when a corner of the cell is inside. everything out of the
+ - blocks has the same state. lookups never touch the bvh or the csg
+ -------------------------------------------------------------------------*/
+struct occupancy {
+  enum { AIR = 0, SOLID = 1 }; // other blocks are their mixed block plus 2
+  vec3f org;      // corner of the first block
+  float cellsize;
+  vec3i dim;      // blocks along each axis
+  u32 leafdim;    // cells of a block along each axis
+  u32 mixednum;   // blocks with bits
+  u32 outside;    // AIR or SOLID out of the blocks
+  u32 *blocks;
+  u32 *bits;      // leafdim*leafdim rows of leafdim bits per mixed block
+};
+// the occupancy of the volume contoured by the context
+occupancy *makeoccupancy(const dccontext &ctx);
+// stored along with the baked meshes. makeoccupancy returns NULL if the data
+// is not a valid occupancy
+void *serialize(const occupancy *o, u32 &size);
+occupancy *makeoccupancy(const void *data, u32 size);
+void destroy(occupancy *o);
+// true when no cell touched by the box touches the inside
+bool empty(const occupancy &o, const aabb &box);
+// conservative line of sight: false as soon as the segment crosses a cell
+// touching the inside. walls are never seen through
+bool visible(const occupancy &o, const vec3f &from, const vec3f &to);
+
+// tesselate along a grid the distance field with dual contouring algorithm.
+// "occ" gets the occupancy of the contoured volume when not null
+geom::mesh dc(const vec3f &org, u32 cellnum, float cellsize, const csg::node &d,
+              occupancy **occ = NULL);
+
+// same as above but the octree is kept in the context. first call tesselates
+// everything. next calls only re-contour the leaves that overlap "dirty" (in
+// world space) and rebuild the mesh from the cached leaves
+geom::mesh dc(dccontext &ctx, const csg::node &d, const aabb &dirty = aabb::all());
+
+// same as above but output the complete chain of the context lodnum meshes.
+// lods[i] has its leaf vertices collapsed up to 2^i cells. vertices along the
+// leaf borders are shared by all levels such that neighbor leaves can use
+// different levels without cracks
+void dc(dccontext &ctx, const csg::node &d, geom::mesh *lods,
+        const aabb &dirty = aabb::all());
+
+// streaming version for worlds which do not fit in memory. the world is
+// tesselated brick by brick (bricksize^3 cells) and each non-empty brick mesh
+// is appended to the given file after a chunk count. only one brick lives in
+// memory at a time. return the number of chunks written
+u32 dcstream(const char *filename, const vec3f &org, u32 cellnum,
+             float cellsize, const csg::node &d, u32 bricksize = 512);
 
 void start();
 void finish();
@@ -0,0 +1,116 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - kernel.cpp -> runtime dispatch of the simd kernels (csg and ray tracing)
+ -------------------------------------------------------------------------*/
+#include "kernel.hpp"
+#include "rtscalar.hpp"
+#include "rtsse.hpp"
+#include "rtavx.hpp"
+#include "rtavx2.hpp"
+#include "csgscalar.hpp"
+#include "csgsse.hpp"
+#include "csgavx.hpp"
+#include "csgavx2.hpp"
+#include "base/console.hpp"
+#include "base/script.hpp"
+#include "base/sys.hpp"
+
+namespace q {
+namespace kernel {
+#define KERNELS(NAME, RT, CSG) {\
+  NAME,\
+  RT::closest,\
+  RT::occluded,\
+  RT::closest4,\
+  RT::occluded4,\
+  RT::closeststream,\
+  RT::occludedstream,\
+  RT::closest,\
+  RT::occluded,\
+  RT::occluded,\
+  RT::visibilitypacket,\
+  RT::shadowpacket,\
+  RT::primarypoint,\
+  RT::clearpackethit,\
+  RT::writenormal,\
+  RT::writecolor,\
+  RT::writendotl,\
+  RT::clear,\
+  CSG::dist\
+}
+static const table scalar = KERNELS("scalar", rt, csg);
+#if defined(__X86__) || defined(__X86_64__)
+static const table sse = KERNELS("sse", rt::sse, csg::sse);
+static const table avx = KERNELS("avx", rt::avx, csg::avx);
+static const table avx2 = KERNELS("avx2", rt::avx2, csg::avx2);
+#elif defined(__ARM_NEON) // the sse kernels over base/neon.hpp
+static const table sse = KERNELS("neon", rt::sse, csg::sse);
+#else // and over base/wasm.hpp
+static const table sse = KERNELS("simd128", rt::sse, csg::sse);
+#endif
+#undef KERNELS
+
+static const table *current = &scalar;
+static bool selected = false;
+
+static bool hassse() {
+  using namespace sys;
+  return hasfeature(CPU_SSE2) || hasfeature(CPU_NEON) || hasfeature(CPU_SIMD128);
+}
+
+static bool hasavx() {
+  return sys::hasfeature(sys::CPU_AVX) && sys::hasfeature(sys::CPU_YMM);
+}
+
+// avx2 kernels are also compiled with fma, bmi, lzcnt and f16c
+static bool hasavx2() {
+  using namespace sys;
+  return hasavx() && hasfeature(CPU_AVX2) && hasfeature(CPU_FMA) &&
+         hasfeature(CPU_BMI1) && hasfeature(CPU_LZCNT) && hasfeature(CPU_F16C);
+}
+
+const table *find(isa i) {
+  if (i == ISA_AUTO)
+    i = hasavx2() ? ISA_AVX2 :
+          hasavx() ? ISA_AVX :
+          hassse() ? ISA_SSE : ISA_SCALAR;
+  switch (i) {
+#if defined(__X86__) || defined(__X86_64__)
+    case ISA_AVX2: return hasavx2() ? &avx2 : NULL;
+    case ISA_AVX: return hasavx() ? &avx : NULL;
+#endif
+    case ISA_SSE: return hassse() ? &sse : NULL;
+    case ISA_SCALAR: return &scalar;
+    default: return NULL;
+  }
+}
+
+static void select(int isa) {
+  if (isa == ISA_AVX2 && !hasavx2()) {
+    con::out("kernel: avx2 is not supported, falling back to auto-detection");
+    isa = ISA_AUTO;
+  }
+  if (isa == ISA_AVX && !hasavx()) {
+    con::out("kernel: avx is not supported, falling back to auto-detection");
+    isa = ISA_AUTO;
+  }
+  if (isa == ISA_SSE && !hassse()) {
+    con::out("kernel: sse2, neon or simd128 is not supported, falling back to auto-detection");
+    isa = ISA_AUTO;
+  }
+  // the same kernels picked again (start, then a script setting the var)
+  // change nothing
+  const auto t = find(kernel::isa(isa));
+  if (selected && t == current) return;
+  current = t;
+  selected = true;
+  con::out("kernel: using %s kernels", current->name);
+}
+
+VARF(kernelisa, ISA_AUTO, ISA_AUTO, ISA_AVX2, select(kernelisa));
+
+void start() { select(kernelisa); }
+const table &get() { return *current; }
+} /* namespace kernel */
+} /* namespace q */
+
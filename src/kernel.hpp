@@ -0,0 +1,61 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - kernel.hpp -> runtime dispatch of the simd kernels (csg and ray tracing)
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "rt.hpp"
+#include "bvh.hpp"
+#include "csg.hpp"
+
+namespace q {
+namespace kernel {
+
+// kernels we compile. "kernelisa" forces one of them. ISA_SSE is neon on
+// arm and simd128 in webassembly
+enum isa { ISA_AUTO, ISA_SCALAR, ISA_SSE, ISA_AVX, ISA_AVX2 };
+
+// one entry per routine declared in rtdecl.hxx and csgdecl.hxx
+struct table {
+  const char *name;
+
+  // ray tracing
+  void (*closest)(const rt::intersector&, const rt::raypacket&, rt::packethit&);
+  void (*occluded)(const rt::intersector&, const rt::raypacket&, rt::packetshadow&);
+  void (*closest4)(const rt::intersector&, const rt::raypacket&, rt::packethit&);
+  void (*occluded4)(const rt::intersector&, const rt::raypacket&, rt::packetshadow&);
+  void (*closeststream)(const rt::intersector&, rt::raystream&, u32, u32);
+  void (*occludedstream)(const rt::intersector&, rt::raystream&, u32, u32);
+  void (*closestray)(const rt::intersector&, const rt::ray&, rt::hit&);
+  bool (*occludedray)(const rt::intersector&, const rt::ray&);
+  void (*occludedrays)(const rt::intersector&, const rt::ray*, u32, s32*);
+  void (*visibilitypacket)(const rt::camera&, rt::raypacket&,
+                           const vec2i&, const vec2i&);
+  void (*shadowpacket)(const rt::array3f&, const rt::arrayi&, const vec3f&,
+                       rt::raypacket&, rt::packetshadow&, int);
+  u32 (*primarypoint)(const rt::raypacket&, const rt::packethit&,
+                      rt::array3f&, rt::array3f&, rt::arrayi&);
+  void (*clearpackethit)(rt::packethit&);
+  void (*writenormal)(const rt::packethit&, const vec2i&, const vec2i&, int*);
+  void (*writecolor)(const rt::array3f&, const vec2i&, const vec2i&, int*);
+  void (*writendotl)(const rt::raypacket&, const rt::array3f&,
+                     const rt::packetshadow&, const vec2i&, const vec2i&, int*);
+  void (*clear)(const vec2i&, const vec2i&, int*);
+
+  // csg evaluation
+  void (*csgdist)(const csg::program*, const csg::array3f&,
+                  const csg::arrayf*, csg::arrayf&, csg::arrayi&,
+                  int, const aabb&, csg::array3f*);
+};
+
+// pick the widest kernels the cpu supports. until then, scalar ones are used
+void start();
+
+// kernels currently selected
+const table &get();
+
+// kernels of the given isa. null if they are not compiled or not supported
+// by the cpu. ISA_AUTO gives the ones start() would pick
+const table *find(isa i);
+} /* namespace kernel */
+} /* namespace q */
+
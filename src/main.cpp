@@ -4,6 +4,7 @@
  -------------------------------------------------------------------------*/
 #include "base/sys.hpp"
 #include "base/math.hpp"
+#include "base/profiler.hpp"
 #include "game.hpp"
 #include "mini.q.hpp"
 #include <time.h>
@@ -17,28 +18,52 @@ static void computetarget() {
   game::setworldpos(world.xyz()/world.w);
 }
 
-INLINE void mainloop() {
-  static int ignore = 5;
-  auto millis = sys::millis()*double(gamespeed)/100.0;
-  if (millis-game::lastmillis()>200.0) game::setlastmillis(millis-200.0);
-  else if (millis-game::lastmillis()<1) game::setlastmillis(millis-1.0);
-#if !defined(__JAVASCRIPT__)
-  if (millis-game::lastmillis()<double(minmillis))
-    SDL_Delay(minmillis-(int(millis)-int(game::lastmillis())));
-#endif // __JAVASCRIPT__
+// frames start every minmillis. sdl delays only have a millisecond resolution
+// and often oversleep so we sleep until spinmicros before the deadline and
+// spin the rest. a late frame moves the deadline instead of shortening the
+// next ones
+VARP(spinmicros, 0, 2000, 10000);
+static void pace() {
+  static u64 deadline = 0;
+  auto now = sys::micros();
+  if (now < deadline) {
+    const auto left = deadline-now;
+    if (left > u64(spinmicros)) SDL_Delay(u32((left-u64(spinmicros))/1000));
+    while ((now = sys::micros()) < deadline) {
+#if defined(__SSE2_INTRINSICS__)
+      _mm_pause();
+#endif
+    }
+  }
+  const auto frame = u64(minmillis)*1000;
+  deadline = deadline+frame > now ? deadline+frame : now+frame;
+}
+
+// the view of the next frame. the game shoots where the player looks
+static void setview() {
   const auto fovy = float(fov), ffar = float(farplane);
   game::setmatrices(fovy, ffar, float(sys::scrw), float(sys::scrh));
   computetarget();
-  game::updateworld(int(millis));
+}
+
+static double fps = 30.0;
+static void simulate() {
+  auto millis = demo::timing() ? demo::nextmillis() :
+                sys::millis()*double(gamespeed)/100.0;
+  if (millis-game::lastmillis()>200.0) game::setlastmillis(millis-200.0);
+  else if (millis-game::lastmillis()<1) game::setlastmillis(millis-1.0);
+  {
+    PROFILE_ZONE("updateworld");
+    game::updateworld(int(millis));
+  }
   if (!demo::playing())
     server::slice(int(time(NULL)), 0);
-  static double fps = 30.0;
   fps = (1000.0/game::curtime()+fps*50.0)/51.0;
-  swap();
-  ogl::beginframe();
   sound::updatevol();
-  rr::frame(sys::scrw, sys::scrh, int(fps));
-  ogl::endframe();
+}
+
+static void events() {
+  static int ignore = 5;
   SDL_Event event;
   int lasttype = 0, lastbut = 0;
   while (SDL_PollEvent(&event)) {
@@ -70,8 +95,76 @@ INLINE void mainloop() {
   }
 }
 
+INLINE void mainloop() {
+#if !defined(__JAVASCRIPT__)
+  if (!demo::timing()) pace();
+#endif // __JAVASCRIPT__
+  profiler::frame();
+  setview();
+  simulate();
+  swap();
+  ogl::beginframe();
+  {
+    PROFILE_ZONE("render");
+    rr::frame(sys::scrw, sys::scrh, int(fps));
+  }
+  ogl::endframe();
+  demo::endframe();
+  events();
+}
+
+#if !defined(__JAVASCRIPT__)
+// with renderthread, the main thread keeps the gl context and the events while
+// the game simulates the next frame on its own thread. both meet in between:
+// the hud goes over the last frame, the events are handled and the next frame
+// is recorded. the driver time then overlaps with the simulation. only read
+// when the main loop starts
+VARP(renderthread, 0, 0, 1);
+static SDL_sem *simstart = NULL, *simdone = NULL;
+
+static int gamethread(void*) {
+  profiler::setthreadname("game thread");
+  for (;;) {
+    SDL_SemWait(simstart);
+    if (!demo::timing()) pace();
+    simulate();
+    SDL_SemPost(simdone);
+  }
+  return 0;
+}
+
+static void pipelinedloop() {
+  simstart = SDL_CreateSemaphore(0);
+  simdone = SDL_CreateSemaphore(0);
+  rr::setgamethread(true);
+  setview();
+  SDL_CreateThread(gamethread, "game thread", NULL);
+  SDL_SemPost(simstart);
+  for (auto first = true;; first = false) {
+    SDL_SemWait(simdone);
+    profiler::frame();
+    if (!first) {
+      rr::hud(sys::scrw, sys::scrh, int(fps));
+      ogl::endframe();
+      demo::endframe();
+    }
+    events();
+    setview();
+    rr::record(sys::scrw, sys::scrh);
+    SDL_SemPost(simstart);
+    swap();
+    ogl::beginframe();
+    PROFILE_ZONE("render");
+    rr::submit();
+  }
+}
+#endif // __JAVASCRIPT__
+
 static int run() {
   game::setlastmillis(sys::millis() * double(gamespeed)/100.0);
+#if !defined(__JAVASCRIPT__)
+  if (renderthread) pipelinedloop();
+#endif // __JAVASCRIPT__
   for (;;) q::mainloop();
   return 0;
 }
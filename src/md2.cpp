@@ -5,12 +5,31 @@
 #include "mini.q.hpp"
 #include "base/vector.hpp"
 #include "base/hash_map.hpp"
+#include "base/task.hpp"
 
 namespace q {
+namespace md2 {
+// models are drawn instanced. every instance is a run of vec4 in a texture
+// buffer: its matrices, its two key frames and their decoding parameters
+struct instance {
+  mat4x4f mvp;
+  vec4f nor[3];
+  vec4f frame; // first vertex of both key frames and their blend factor
+  vec4f scale0, translate0, scale1, translate1;
+};
+static void rules(ogl::shaderrules &vert, ogl::shaderrules &frag, u32) {
+  fixedstring str(fmt, "#define INSTANCESZ %d\n", int(sizeof(instance)/sizeof(vec4f)));
+  vert.add(NEWSTRING(str.c_str()));
+  if (rr::packedgbuffer) frag.insert(0, NEWSTRING("#define PACKEDGBUFFER\n"));
+}
+} /* namespace md2 */
+
+#define RULES md2::rules
 #define SHADERNAME md2
 #define VERTEX_PROGRAM "data/shaders/md2_vp.decl"
 #define FRAGMENT_PROGRAM "data/shaders/md2_fp.decl"
 #include "shaderdecl.hxx"
+#undef RULES
 namespace md2 {
 
 struct header {
@@ -76,32 +95,98 @@ struct frame {
   md2vertex vertices[1];
 };
 
+// normals are shared by all models
+static u32 normalbo = 0u, normaltex = 0u;
+static void initnormals() {
+  if (normalbo) return;
+  vec4f normals[256];
+  loopi(256) normals[i] = vec4f(normaltable[i][0], normaltable[i][1], normaltable[i][2], 0.f);
+  ogl::genbuffers(1, &normalbo);
+  ogl::bindbuffer(ogl::TEXTURE_BUFFER, normalbo);
+  OGL(BufferData, GL_TEXTURE_BUFFER, sizeof(normals), normals, GL_STATIC_DRAW);
+  ogl::bindbuffer(ogl::TEXTURE_BUFFER, 0);
+  ogl::gentextures(1, &normaltex);
+  ogl::bindtexture(GL_TEXTURE_BUFFER, normaltex, 2);
+  OGL(TexBuffer, GL_TEXTURE_BUFFER, GL_RGBA32F, normalbo);
+}
+
+// key frames stay in their md2 format in a texture buffer and the vertex
+// shader decodes and interpolates them. the vertex buffer only has the
+// texture coordinates and the md2 vertex index of each unique vertex
+struct mdlload;
 struct mdl {
-  mdl(void) { memset(this,0,sizeof(mdl)); }
-  ~mdl(void) {
-    if (vbo) ogl::deletebuffers(1, &vbo);
-    if (tex) ogl::deletetextures(1, &tex);
-    FREE(loadname);
-  }
-  typedef array<float,8> vertextype;
+  mdl(void) :
+    vertices(NULL), vbo(0), ibo(0), vao(0), framebo(0), frametex(0), tex(0),
+    indexnum(0), vertexnum(0), framenum(0), scale(NULL), translate(NULL),
+    invscale(0.f), snap(0), mmi(), loadname(NULL), mdlnum(0), loaded(0) {}
+  ~mdl(void);
+  struct vertextype { float s, t; u16 idx, pad; };
   bool load(const char *filename, float scale, int snap);
+  bool loadmd2(const char *filename);
+  bool loadpacked(const pack::entry &e);
+  void upload(void);
   void render(int frame, int range,
               const mat4x4f &posxfm,
               const mat3x3f &norxfm,
               float speed, float basetime);
-  u32 vbo, tex;
-  u32 vboframesz;
+  void draw(u32 first);
+  vector<instance> instances; // queued for this frame
+  vector<vertextype> verts; // filled by load and released by upload
+  vector<u16> indices;
+  u8 *vertices;
+  ref<mdlload> job;
+  u32 vbo, ibo, vao, framebo, frametex, tex;
+  u32 indexnum, vertexnum, framenum;
+  vec3f *scale, *translate; // per key frame
+  float invscale;
+  int snap;
   game::mapmodelinfo mmi;
   char *loadname;
   u32 mdlnum:31;
   u32 loaded:1;
 };
 
-static INLINE float snap(int sn, float f) {
-  return sn ? (float)(((int)(f+sn*0.5f))&(~(sn-1))) : f;
+// the md2 file is read and parsed by a task. the render thread only creates
+// the buffers once it is done
+struct mdlload : public task {
+  INLINE mdlload(mdl *m, const char *path, float scale, int snap) :
+    task("mdlload", 1, 1), m(m), path(path), scale(scale), snap(snap),
+    done(0), ok(false) {}
+  virtual void run(u32) {
+    ok = m->load(path.c_str(), scale, snap);
+    storerelease(&done, 1);
+  }
+  mdl *m;
+  fixedstring path;
+  float scale;
+  int snap;
+  volatile s32 done;
+  bool ok;
+};
+
+mdl::~mdl(void) {
+  if (job) job->wait();
+  if (vao) ogl::deletevertexarrays(1, &vao);
+  if (vbo) ogl::deletebuffers(1, &vbo);
+  if (ibo) ogl::deletebuffers(1, &ibo);
+  if (framebo) ogl::deletebuffers(1, &framebo);
+  if (frametex) ogl::deletetextures(1, &frametex);
+  if (tex) ogl::deletetextures(1, &tex);
+  SAFE_DELA(vertices);
+  FREE(scale);
+  FREE(translate);
+  FREE(loadname);
+}
+
+bool mdl::load(const char *name, float sc, int sn) {
+  invscale = sc/16.f;
+  snap = sn;
+  pack::entry e;
+  if (pack::find(name, pack::MODEL, e) && loadpacked(e)) return true;
+  return loadmd2(name);
 }
 
-bool mdl::load(const char *name, float scale, int sn) {
+bool mdl::loadmd2(const char *name) {
   FILE *file;
   header header;
 
@@ -123,142 +208,309 @@ bool mdl::load(const char *name, float scale, int sn) {
   fread(glcommands, header.numglcommands*sizeof(int), 1, file);
   sys::endianswap(glcommands, sizeof(int), header.numglcommands);
 
-  con::out("md2: '%s' with %d frames of %d bytes", name, header.numframes, header.framesz);
   fclose(file);
 
-  // allocate one vbo for all key frames together
-  for (int *command=glcommands, i=0; (*command)!=0; ++i) {
-    const int n = abs(*command++);
-    vboframesz += 3*(n-2)*sizeof(vertextype);
-    command += 3*n; // +1 for index, +2 for u,v
+  // gl commands share md2 vertices with different texture coordinates. we
+  // keep one vertex per (md2 vertex, s, t) and triangulate strips and fans
+  vector<int> first(header.numvertices), next;
+  loopi(header.numvertices) first[i] = -1;
+  for (int *command = glcommands; (*command)!=0;) {
+    const int moden = *command++;
+    const int n = abs(moden);
+    vector<u16> cmdv;
+    loopi(n) {
+      const auto s = *((const float*)command++);
+      const auto t = *((const float*)command++);
+      const auto vn = *command++;
+      auto id = first[vn];
+      while (id != -1 && (verts[id].s != s || verts[id].t != t)) id = next[id];
+      if (id == -1) {
+        id = verts.length();
+        const vertextype v = {s, t, u16(vn), 0};
+        verts.add(v);
+        next.add(first[vn]);
+        first[vn] = id;
+      }
+      cmdv.add(u16(id));
+    }
+    loopi(n-2) { // just stolen from cube
+      if (moden <= 0) { // fan
+        indices.add(cmdv[0]);
+        indices.add(cmdv[i+1]);
+        indices.add(cmdv[i+2]);
+      } else // strip
+        loopk(3) indices.add(cmdv[i&1 && k ? i+(1-(k-1))+1 : i+k]);
+    }
   }
-  ogl::genbuffers(1, &vbo);
-  ogl::bindbuffer(ogl::ARRAY_BUFFER, vbo);
-  OGL(BufferData, GL_ARRAY_BUFFER, header.numframes*vboframesz, NULL, GL_STATIC_DRAW);
-
-  // put the model in the right position
-  const auto rot = mat3x3f::rotate(90.f, vec3f(0.f,1.f,0.f));
+  assert(verts.length() <= 0xffff);
+  indexnum = indices.length();
+  vertexnum = header.numvertices;
+  framenum = header.numframes;
 
-  // insert each frame in the vbo
-  loopj(header.numframes) {
+  // the 8 bits vertices of all key frames go back to back
+  const auto framesz = vertexnum*sizeof(md2vertex);
+  vertices = NEWAE(u8, framenum*framesz);
+  scale = (vec3f*) MALLOC(framenum*sizeof(vec3f));
+  translate = (vec3f*) MALLOC(framenum*sizeof(vec3f));
+  loopj(framenum) {
     const auto cf = (const md2::frame*) (frames+header.framesz*j);
-    const auto sc = 16.0f/scale;
-
-    vector<vertextype> tris;
-    for (int *command = glcommands, i=0; (*command)!=0; ++i) {
-      const int moden = *command++;
-      const int n = abs(moden);
-      vector<vertextype> trisv;
-      loopi(n) {
-        const auto s = *((const float*)command++);
-        const auto t = *((const float*)command++);
-        const auto vn = *command++;
-        const auto cv = (u8*) &cf->vertices[vn].vertex;
-        const vec3f v(+(snap(sn,cv[0]*cf->scale[0])+cf->translate[0])/sc,
-                      -(snap(sn,cv[1]*cf->scale[1])+cf->translate[1])/sc,
-                      +(snap(sn,cv[2]*cf->scale[2])+cf->translate[2])/sc);
-        const auto nptr = normaltable[cf->vertices[vn].normalidx];
-        const auto n = vec3f(nptr[0],-nptr[1],nptr[2]);
-        trisv.add(vertextype(s,t,rot*n.xzy(),rot*v.xzy()));
-      }
-      loopi(n-2) { // just stolen from cube. TODO use an index buffer
-        if (moden <= 0) { // fan
-          tris.add(trisv[0]);
-          tris.add(trisv[i+1]);
-          tris.add(trisv[i+2]);
-        } else // strip
-          loopk(3) tris.add(trisv[i&1 && k ? i+(1-(k-1))+1 : i+k]);
-      }
-    }
-    OGL(BufferSubData, GL_ARRAY_BUFFER, vboframesz*j, vboframesz, &tris[0][0]);
+    scale[j] = vec3f(cf->scale[0], cf->scale[1], cf->scale[2]);
+    translate[j] = vec3f(cf->translate[0], cf->translate[1], cf->translate[2]);
+    memcpy(vertices+j*framesz, cf->vertices, framesz);
   }
-  ogl::bindbuffer(ogl::ARRAY_BUFFER, 0);
   SAFE_DELA(frames);
   SAFE_DELA(glcommands);
   return true;
 }
 
+// the pack keeps what loadmd2 makes of the file: the vertex and index
+// buffers and the key frames, ready to be uploaded
+struct packedmodel { u32 vertnum, indexnum, vertexnum, framenum; };
+
+static u64 packedsize(const packedmodel &p) {
+  return sizeof(p) + u64(p.vertnum)*sizeof(mdl::vertextype) +
+         u64((p.indexnum+1)&~1u)*sizeof(u16) + 2*u64(p.framenum)*sizeof(vec3f) +
+         u64(p.framenum)*p.vertexnum*sizeof(md2vertex);
+}
+
+bool mdl::loadpacked(const pack::entry &e) {
+  const auto p = (const packedmodel*) e.data;
+  if (e.size < sizeof(packedmodel) || e.size != packedsize(*p)) return false;
+  indexnum = p->indexnum;
+  vertexnum = p->vertexnum;
+  framenum = p->framenum;
+  auto src = (const u8*) (p+1);
+  verts.setsize(p->vertnum, noinitialize);
+  memcpy(verts.getbuf(), src, p->vertnum*sizeof(vertextype));
+  src += p->vertnum*sizeof(vertextype);
+  indices.setsize(indexnum, noinitialize);
+  memcpy(indices.getbuf(), src, indexnum*sizeof(u16));
+  src += ((indexnum+1)&~1u)*sizeof(u16);
+  scale = (vec3f*) MALLOC(framenum*sizeof(vec3f));
+  loopi(s32(framenum)) scale[i] = ((const vec3f*) src)[i];
+  src += framenum*sizeof(vec3f);
+  translate = (vec3f*) MALLOC(framenum*sizeof(vec3f));
+  loopi(s32(framenum)) translate[i] = ((const vec3f*) src)[i];
+  src += framenum*sizeof(vec3f);
+  const auto framesz = vertexnum*sizeof(md2vertex);
+  vertices = NEWAE(u8, framenum*framesz);
+  memcpy(vertices, src, framenum*framesz);
+  return true;
+}
+
+bool packmodel(const char *name, pack::writer &w) {
+  mdl m;
+  if (!m.loadmd2(name)) return false;
+  const packedmodel p = {u32(m.verts.length()), m.indexnum, m.vertexnum, m.framenum};
+  // a pack entry stores its size in a u32 and our vectors count with an int
+  const auto size = packedsize(p);
+  if (size > u64(0x7fffffff)) {
+    con::out("md2: '%s' is too big to be packed", name);
+    return false;
+  }
+  vector<u8> data;
+  data.reserve(int(size));
+  loopi(int(size)) data.add(0);
+  auto dst = data.getbuf();
+  memcpy(dst, &p, sizeof(p));
+  dst += sizeof(p);
+  memcpy(dst, m.verts.getbuf(), p.vertnum*sizeof(mdl::vertextype));
+  dst += p.vertnum*sizeof(mdl::vertextype);
+  memcpy(dst, m.indices.getbuf(), p.indexnum*sizeof(u16));
+  dst += ((p.indexnum+1)&~1u)*sizeof(u16);
+  memcpy(dst, m.scale, p.framenum*sizeof(vec3f));
+  dst += p.framenum*sizeof(vec3f);
+  memcpy(dst, m.translate, p.framenum*sizeof(vec3f));
+  dst += p.framenum*sizeof(vec3f);
+  memcpy(dst, m.vertices, p.framenum*p.vertexnum*sizeof(md2vertex));
+  w.add(name, pack::MODEL, data.getbuf(), u32(data.length()));
+  return true;
+}
+
+void mdl::upload(void) {
+  con::out("md2: '%s' with %d frames of %d vertices", loadname, framenum, vertexnum);
+  ogl::genbuffers(1, &vbo);
+  ogl::bindbuffer(ogl::ARRAY_BUFFER, vbo);
+  OGL(BufferData, GL_ARRAY_BUFFER, verts.length()*sizeof(vertextype), &verts[0], GL_STATIC_DRAW);
+  ogl::bindbuffer(ogl::ARRAY_BUFFER, 0);
+  ogl::genbuffers(1, &ibo);
+  ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, ibo);
+  OGL(BufferData, GL_ELEMENT_ARRAY_BUFFER, indexnum*sizeof(u16), &indices[0], GL_STATIC_DRAW);
+  ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, 0);
+  const ogl::vertexattrib attribs[] = {
+    {ogl::ATTRIB_TEX0, 2, GL_FLOAT, 0, false},
+    {ogl::ATTRIB_POS0, 1, GL_UNSIGNED_SHORT, 2*sizeof(float), false}
+  };
+  vao = ogl::makevertexarray(attribs, ARRAY_ELEM_NUM(attribs), sizeof(vertextype), vbo, ibo);
+
+  ogl::genbuffers(1, &framebo);
+  ogl::bindbuffer(ogl::TEXTURE_BUFFER, framebo);
+  OGL(BufferData, GL_TEXTURE_BUFFER, framenum*vertexnum*sizeof(md2vertex), vertices, GL_STATIC_DRAW);
+  ogl::bindbuffer(ogl::TEXTURE_BUFFER, 0);
+  ogl::gentextures(1, &frametex);
+  ogl::bindtexture(GL_TEXTURE_BUFFER, frametex, 1);
+  OGL(TexBuffer, GL_TEXTURE_BUFFER, GL_RGBA8UI, framebo);
+  initnormals();
+
+  SAFE_DELA(vertices);
+  verts.destroy();
+  indices.destroy();
+}
+
+// md2 space to model space: mirrored y, swapped y and z and a quarter turn
+static mat3x3f md2xfm() {
+  const auto rot = mat3x3f::rotate(90.f, vec3f(0.f,1.f,0.f));
+  return mat3x3f(rot*vec3f(1.f,0.f,0.f), rot*vec3f(0.f,0.f,-1.f), rot*vec3f(0.f,1.f,0.f));
+}
+
+static vector<mdl*> queued;
+
 void mdl::render(int frame, int range,
                  const mat4x4f &posxfm,
                  const mat3x3f &norxfm,
                  float speed, float basetime)
 {
-  ogl::bindbuffer(ogl::ARRAY_BUFFER, vbo);
-  const auto mvp = ogl::matrix(ogl::PROJECTION) * posxfm;
-
-  const int n = vboframesz / sizeof(vertextype);
+  const auto xfm = md2xfm();
   const auto time = float(game::lastmillis()-basetime);
   auto fr1 = intptr_t(time/speed);
   const auto frac = (time-fr1*speed)/speed;
   fr1 = fr1%range+frame;
   auto fr2 = fr1+1;
   if (fr2>=frame+range) fr2 = frame;
-  const auto pos0 = (const float*)(fr1*vboframesz);
-  const auto pos1 = (const float*)(fr2*vboframesz);
-  OGL(CullFace, GL_FRONT);
-  OGL(VertexAttribPointer, ogl::ATTRIB_TEX0, 2, GL_FLOAT, 0, sizeof(vertextype), pos0);
-  OGL(VertexAttribPointer, ogl::ATTRIB_NOR0, 3, GL_FLOAT, 0, sizeof(vertextype), pos0+2);
-  OGL(VertexAttribPointer, ogl::ATTRIB_NOR1, 3, GL_FLOAT, 0, sizeof(vertextype), pos1+2);
-  OGL(VertexAttribPointer, ogl::ATTRIB_POS0, 3, GL_FLOAT, 0, sizeof(vertextype), pos0+5);
-  OGL(VertexAttribPointer, ogl::ATTRIB_POS1, 3, GL_FLOAT, 0, sizeof(vertextype), pos1+5);
-  ogl::setattribarray()(ogl::ATTRIB_POS0, ogl::ATTRIB_POS1,
-                        ogl::ATTRIB_TEX0, ogl::ATTRIB_NOR0,
-                        ogl::ATTRIB_NOR1);
+  if (instances.length() == 0) queued.add(this);
+  auto &i = instances.add();
+  i.mvp = ogl::matrix(ogl::PROJECTION) * posxfm * mat4x4f(invscale*xfm);
+  const auto nor = norxfm*xfm;
+  i.nor[0] = vec4f(nor.vx, 0.f);
+  i.nor[1] = vec4f(nor.vy, 0.f);
+  i.nor[2] = vec4f(nor.vz, 0.f);
+  i.frame = vec4f(float(fr1*vertexnum), float(fr2*vertexnum), frac, 0.f);
+  i.scale0 = vec4f(scale[fr1], 0.f);
+  i.translate0 = vec4f(translate[fr1], 0.f);
+  i.scale1 = vec4f(scale[fr2], 0.f);
+  i.translate1 = vec4f(translate[fr2], 0.f);
+}
+
+void mdl::draw(u32 first) {
+  ogl::bindvertexarray(vao);
   ogl::bindtexture(GL_TEXTURE_2D, tex, 0);
+  ogl::bindtexture(GL_TEXTURE_BUFFER, frametex, 1);
+  ogl::uniform1i(s.u_snap, snap);
+  ogl::uniform1i(s.u_firstinstance, int(first));
+  OGL(DrawElementsInstanced, GL_TRIANGLES, indexnum, GL_UNSIGNED_SHORT, NULL, instances.length());
+  instances.setsize(0);
+}
+
+// all instances of the frame go in one buffer orphaned at every flush
+static u32 instancebo = 0u, instancetex = 0u;
+
+void flush() {
+  if (queued.length() == 0) return;
+  if (instancebo == 0u) {
+    ogl::genbuffers(1, &instancebo);
+    ogl::gentextures(1, &instancetex);
+  }
+  u32 num = 0;
+  loopv(queued) num += queued[i]->instances.length();
+  ogl::bindbuffer(ogl::TEXTURE_BUFFER, instancebo);
+  OGL(BufferData, GL_TEXTURE_BUFFER, num*sizeof(instance), NULL, GL_STREAM_DRAW);
+  u32 first = 0;
+  loopv(queued) {
+    const auto &v = queued[i]->instances;
+    OGL(BufferSubData, GL_TEXTURE_BUFFER, first*sizeof(instance), v.length()*sizeof(instance), &v[0]);
+    first += v.length();
+  }
+  ogl::bindbuffer(ogl::TEXTURE_BUFFER, 0);
+  ogl::bindtexture(GL_TEXTURE_BUFFER, instancetex, 3);
+  OGL(TexBuffer, GL_TEXTURE_BUFFER, GL_RGBA32F, instancebo);
+  ogl::bindtexture(GL_TEXTURE_BUFFER, normaltex, 2);
+
+  ogl::cullface(GL_FRONT);
   ogl::bindshader(s);
-  OGL(Uniform1f, s.u_delta, frac);
-  OGL(UniformMatrix3fv, s.u_nortransform, 1, GL_FALSE, &norxfm.vx.x);
-  OGL(UniformMatrix4fv, s.u_mvp, 1, GL_FALSE, &mvp.vx.x);
-  ogl::drawarrays(GL_TRIANGLES, 0, n);
-  ogl::bindbuffer(ogl::ARRAY_BUFFER, 0);
-  OGL(CullFace, GL_BACK);
+  first = 0;
+  loopv(queued) {
+    const auto n = queued[i]->instances.length();
+    queued[i]->draw(first);
+    first += n;
+  }
+  ogl::bindvertexarray(0);
+  ogl::cullface(GL_BACK);
+  queued.setsize(0);
 }
 
-static vector<mdl*> mapmodels;
-static hash_map<string_ref,mdl*> mdllookup;
-static int modelnum = 0;
-
-static void delayedload(mdl *m, float scale, int snap) {
-  if (m->loaded) return;
-  fixedstring mdlpath(fmt, "data/models/%s/tris.md2", m->loadname);
-  if (!m->load(sys::path(mdlpath.c_str()), scale, snap))
-    sys::fatal("loadmodel: ", mdlpath.c_str());
-  fixedstring texpath(fmt, "data/models/%s/skin.jpg", m->loadname);
-  m->tex = ogl::installtex(texpath.c_str());
+// handles index models. the names are only hashed to resolve new handles
+static vector<mdl*> models, mapmodels;
+static hash_map<istring,handle> mdllookup;
+
+// the model is not drawn until its task is done. its skin is the checkboard
+// until the texture loader uploads it
+static bool delayedload(mdl *m, float scale, int snap) {
+  if (m->loaded) return true;
+  if (!m->job) {
+    fixedstring mdlpath(fmt, "data/models/%s/tris.md2", m->loadname);
+    m->job = NEWTASK(mdlload, m, sys::path(mdlpath.c_str()), scale, snap);
+    m->job->scheduled();
+    fixedstring texpath(fmt, "data/models/%s/skin.jpg", m->loadname);
+    m->tex = ogl::installtexasync(texpath.c_str());
+  }
+  if (!loadacquire(&m->job->done)) return false;
+  m->job->wait();
+  if (!m->job->ok) sys::fatal("loadmodel: ", m->job->path.c_str());
+  m->job = nil;
+  m->upload();
   m->loaded = 1;
+  return true;
 }
 
 void start() {}
 #if !defined(RELEASE)
 void finish() {
-  for (auto it = mdllookup.begin(); it != mdllookup.end(); ++it)
-    DEL(it->second);
+  loopv(models) DEL(models[i]);
+  models.destroy();
+  if (normalbo) ogl::deletebuffers(1, &normalbo);
+  if (normaltex) ogl::deletetextures(1, &normaltex);
+  if (instancebo) ogl::deletebuffers(1, &instancebo);
+  if (instancetex) ogl::deletetextures(1, &instancetex);
+  normalbo = normaltex = instancebo = instancetex = 0u;
+  queued.destroy();
 }
 #endif
 
-mdl *loadmodel(const char *name) {
-  const auto mm = mdllookup.find(name);
-  if (mm != mdllookup.end() && NULL != mm->first.c_str())
-    return mm->second;
+static mdl *newmodel(const char *name, handle h) {
   const auto m = NEWE(mdl);
-  m->mdlnum = modelnum++;
+  m->mdlnum = h;
   m->mmi = {2, 2, 0, 0, ""};
   m->loadname = NEWSTRING(name);
-  mdllookup.insert(makepair((const char*)(m->loadname), m));
   return m;
 }
 
+handle gethandle(const istring &name) {
+  const auto mm = mdllookup.find(name);
+  if (mm != mdllookup.end())
+    return mm->second;
+  const auto h = handle(models.length());
+  models.add(newmodel(name.c_str(), h));
+  mdllookup.insert(makepair(name, h));
+  return h;
+}
+
+static mdl *loadmodel(const istring &name) { return models[gethandle(name)]; }
+
 void mapmodel(const char *rad, const char *h, const char *zoff, const char *snap, const char *name) {
-  auto m = loadmodel(name);
+  auto m = loadmodel(istring(name));
   m->mmi = {atoi(rad), atoi(h), atoi(zoff), atoi(snap), m->loadname};
   mapmodels.add(m);
 }
 
+// fresh models take the slots of the old ones and load again when drawn
 void mapmodelreset(void) {
-  auto &map = mdllookup;
-  for (auto it = map.begin(); it != map.end(); ++it) SAFE_DEL(it->second);
+  queued.setsize(0);
+  loopv(models) {
+    const auto m = newmodel(models[i]->loadname, i);
+    DEL(models[i]);
+    models[i] = m;
+  }
   mapmodels.setsize(0);
-  modelnum = 0;
 }
 
 game::mapmodelinfo &getmminfo(int i) {
@@ -268,14 +520,13 @@ game::mapmodelinfo &getmminfo(int i) {
 CMD(mapmodel);
 CMD(mapmodelreset);
 
-void render(const char *name, int frame, int range,
+void render(handle h, int frame, int range,
             const mat4x4f &posxfm, const mat3x3f &norxfm,
             bool teammate, float scale, float speed, int snap, float basetime)
 {
-  auto m = loadmodel(name);
-  delayedload(m, scale, snap);
-  ogl::bindtexture(GL_TEXTURE_2D, m->tex);
-  m->render(frame, range, posxfm, norxfm, speed, basetime);
+  const auto m = models[h];
+  if (delayedload(m, scale, snap))
+    m->render(frame, range, posxfm, norxfm, speed, basetime);
 }
 } /* namespace md2 */
 } /* namespace q */
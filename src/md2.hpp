@@ -2,16 +2,27 @@
  - mini.q - a minimalistic multiplayer FPS
  - md2.cpp -> exposes quake md2 model routines
  -------------------------------------------------------------------------*/
+#pragma once
 #include "base/math.hpp"
+#include "base/string.hpp"
+#include "base/pack.hpp"
 
 namespace q {
 namespace md2 {
 void start();
 void finish();
-void render(const char *name, int frame, int range,
+// models are drawn through handles resolved once from their names. a handle
+// stays valid until the end, mapmodelreset only unloads the models
+typedef u32 handle;
+handle gethandle(const istring &name);
+void render(handle h, int frame, int range,
             const mat4x4f &posxfm, const mat3x3f &norxfm,
             bool teammate, float scale, float speed, int snap,
             float basetime);
+// models are only queued by render. flush draws all of them instanced
+void flush();
+// parse the md2 file once and store its buffers in the pack
+bool packmodel(const char *name, pack::writer &w);
 
 } /* namespace md2 */
 } /* namespace q */
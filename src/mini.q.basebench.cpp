@@ -0,0 +1,433 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - mini.q.basebench.cpp -> benchmarks the base containers and simd classes
+ -------------------------------------------------------------------------*/
+#include "mini.q.basebench.hpp"
+#include "base/algorithm.hpp"
+#include "base/bench.hpp"
+#include "base/hash.hpp"
+#include "base/hash_map.hpp"
+#include "base/intrusive_list.hpp"
+#include "base/map.hpp"
+#include "base/set.hpp"
+#include "base/sse.hpp"
+#include "base/string.hpp"
+#include <cstdio>
+#include <cstdlib>
+
+using namespace q;
+
+namespace q {
+namespace basebench {
+u32 runnum = 5, warmup = 1;
+static vector<result> results;
+
+void record(const char *group, const char *name, u32 size, vector<double> &times, u32 checksum) {
+  const auto s = bench::summarize(times);
+  result r;
+  r.group = group;
+  r.name = name;
+  r.size = size;
+  r.best = s.best;
+  r.median = s.median;
+  r.checksum = checksum;
+  results.add(r);
+  printf("basebench: %-10s %-28s %9u %10.3f %10.3f %08x\n", group, name, size,
+         r.median, r.best, checksum);
+  fflush(stdout);
+}
+
+/*-------------------------------------------------------------------------
+ - the data of every benchmark comes from the same seed: the work and the
+ - checksums are the same from one run (and one machine) to the other
+ -------------------------------------------------------------------------*/
+static const u32 SEED = 0x2545f491u;
+struct xorshift {
+  INLINE xorshift() : state(SEED) {}
+  INLINE u32 next() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+  u32 state;
+};
+
+template <typename T> static void copy(const vector<T> &src, vector<T> &dst) {
+  dst.setsize(0);
+  loopv(src) dst.add(src[i]);
+}
+
+// distinct keys with the top bit clear. the misses have it set
+static void makekeys(u32 n, vector<u32> &keys, vector<u32> &shuffled, vector<u32> &misses) {
+  xorshift rnd;
+  keys.setsize(0);
+  misses.setsize(0);
+  hash_map<u32,u32> seen;
+  while (u32(keys.length()) < n) {
+    const auto key = rnd.next() & 0x7fffffffu;
+    if (seen.find(key) != seen.end()) continue;
+    seen.insert(makepair(key, 1u));
+    keys.add(key);
+    misses.add(key | 0x80000000u);
+  }
+  copy(keys, shuffled);
+  for (u32 i = n-1; i > 0; --i) swap(shuffled[i], shuffled[rnd.next()%(i+1)]);
+}
+
+/*-------------------------------------------------------------------------
+ - vector
+ -------------------------------------------------------------------------*/
+struct vectoradd {
+  INLINE vectoradd(u32 n) : n(n) {}
+  INLINE void reset() { v.destroy(); }
+  INLINE u32 run() {
+    loopi(s32(n)) v.add(u32(i));
+    return u32(v.length());
+  }
+  vector<u32> v;
+  u32 n;
+};
+
+struct vectoriterate {
+  INLINE vectoriterate(const vector<u32> &v) : v(v) {}
+  INLINE void reset() {}
+  INLINE u32 run() {
+    u32 sum = 0;
+    loopv(v) sum += v[i];
+    return sum;
+  }
+  const vector<u32> &v;
+};
+
+struct vectorrandom {
+  INLINE vectorrandom(const vector<u32> &v, const vector<u32> &order) : v(v), order(order) {}
+  INLINE void reset() {}
+  INLINE u32 run() {
+    u32 sum = 0;
+    loopv(order) sum += v[order[i]];
+    return sum;
+  }
+  const vector<u32> &v, &order;
+};
+
+static void benchvector(u32 n) {
+  vectoradd add(n);
+  measure("vector", "add", n, n, add);
+  vector<u32> v, order;
+  xorshift rnd;
+  loopi(s32(n)) {
+    v.add(rnd.next());
+    order.add(rnd.next()%n);
+  }
+  vectoriterate iterate(v);
+  measure("vector", "iterate", n, n, iterate);
+  vectorrandom read(v, order);
+  measure("vector", "random read", n, n, read);
+}
+
+/*-------------------------------------------------------------------------
+ - hash_map, map and set share the same keys
+ -------------------------------------------------------------------------*/
+template <typename T> struct containerinsert {
+  INLINE containerinsert(const vector<u32> &keys) : keys(keys) {}
+  INLINE void reset() { c.clear(); }
+  INLINE u32 run() {
+    loopv(keys) c[keys[i]] = u32(i);
+    return u32(c.size());
+  }
+  T c;
+  const vector<u32> &keys;
+};
+
+template <typename T> struct containerfind {
+  INLINE containerfind(T &c, const vector<u32> &keys) : c(c), keys(keys) {}
+  INLINE void reset() {}
+  INLINE u32 run() {
+    u32 found = 0;
+    loopv(keys) if (c.find(keys[i]) != c.end()) ++found;
+    return found;
+  }
+  T &c;
+  const vector<u32> &keys;
+};
+
+template <typename T> struct containeriterate {
+  INLINE containeriterate(T &c) : c(c) {}
+  INLINE void reset() {}
+  INLINE u32 run() {
+    u32 sum = 0;
+    for (auto it = c.begin(); it != c.end(); ++it) sum += it->second;
+    return sum;
+  }
+  T &c;
+};
+
+template <typename T>
+static void benchcontainer(const char *group, u32 n, const vector<u32> &keys,
+                           const vector<u32> &shuffled, const vector<u32> &misses) {
+  containerinsert<T> insert(keys);
+  measure(group, "insert", n, n, insert);
+  insert.reset();
+  insert.run();
+  containerfind<T> hit(insert.c, shuffled), miss(insert.c, misses);
+  measure(group, "find hit", n, n, hit);
+  measure(group, "find miss", n, n, miss);
+  containeriterate<T> iterate(insert.c);
+  measure(group, "iterate", n, n, iterate);
+}
+
+// the set has no value to write and its iterator does not walk the tree
+struct setinsert {
+  INLINE setinsert(const vector<u32> &keys) : keys(keys) {}
+  INLINE void reset() { c.clear(); }
+  INLINE u32 run() {
+    loopv(keys) c.insert(keys[i]);
+    return u32(c.size());
+  }
+  set<u32> c;
+  const vector<u32> &keys;
+};
+
+static void benchset(u32 n, const vector<u32> &keys, const vector<u32> &shuffled,
+                     const vector<u32> &misses) {
+  setinsert insert(keys);
+  measure("set", "insert", n, n, insert);
+  insert.reset();
+  insert.run();
+  containerfind<set<u32>> hit(insert.c, shuffled), miss(insert.c, misses);
+  measure("set", "find hit", n, n, hit);
+  measure("set", "find miss", n, n, miss);
+}
+
+/*-------------------------------------------------------------------------
+ - intrusive_list over nodes allocated once
+ -------------------------------------------------------------------------*/
+struct listnode : intrusive_list_node { u32 value; };
+
+// drop all the links at once
+static void unlinkall(intrusive_list<listnode> &list, vector<listnode> &nodes) {
+  list.fastclear();
+  loopv(nodes) nodes[i].next = nodes[i].prev = &nodes[i];
+}
+
+struct listpush {
+  INLINE listpush(vector<listnode> &nodes) : nodes(nodes) {}
+  INLINE void reset() { unlinkall(list, nodes); }
+  INLINE u32 run() {
+    loopv(nodes) list.push_back(&nodes[i]);
+    return list.back()->value;
+  }
+  intrusive_list<listnode> list;
+  vector<listnode> &nodes;
+};
+
+struct listiterate {
+  INLINE listiterate(intrusive_list<listnode> &list) : list(list) {}
+  INLINE void reset() {}
+  INLINE u32 run() {
+    u32 sum = 0;
+    for (auto it = list.begin(); it != list.end(); ++it) sum += it->value;
+    return sum;
+  }
+  intrusive_list<listnode> &list;
+};
+
+// nodes are linked in a random order such that iterating jumps in memory
+static void benchlist(u32 n) {
+  vector<listnode> nodes(n);
+  xorshift rnd;
+  loopi(s32(n)) nodes[i].value = rnd.next();
+  listpush push(nodes);
+  measure("list", "push back", n, n, push);
+  push.reset();
+  vector<u32> order(n);
+  loopi(s32(n)) order[i] = u32(i);
+  for (u32 i = n-1; i > 0; --i) swap(order[i], order[rnd.next()%(i+1)]);
+  loopi(s32(n)) push.list.push_back(&nodes[order[i]]);
+  listiterate iterate(push.list);
+  measure("list", "iterate", n, n, iterate);
+  unlinkall(push.list, nodes);
+}
+
+/*-------------------------------------------------------------------------
+ - quicksort and murmurhash2
+ -------------------------------------------------------------------------*/
+template <typename T> struct sortrun {
+  INLINE sortrun(const vector<T> &input) : input(input) {}
+  INLINE void reset() { copy(input, data); }
+  INLINE u32 run() {
+    quicksort(&data[0], data.length());
+    return murmurhash2(&data[0], data.length()*sizeof(T));
+  }
+  const vector<T> &input;
+  vector<T> data;
+};
+
+struct hashrun {
+  INLINE hashrun(const vector<u8> &data) : data(data) {}
+  INLINE void reset() {}
+  INLINE u32 run() { return murmurhash2(&data[0], data.length()); }
+  const vector<u8> &data;
+};
+
+static void benchalgorithm(u32 n) {
+  xorshift rnd;
+  vector<u32> ints(n);
+  vector<float> floats(n);
+  loopi(s32(n)) {
+    ints[i] = rnd.next();
+    floats[i] = float(rnd.next()) * (1.f/4294967296.f) - 0.5f;
+  }
+  sortrun<u32> sortints(ints);
+  measure("sort", "quicksort u32", n, n, sortints);
+  sortrun<float> sortfloats(floats);
+  measure("sort", "quicksort float", n, n, sortfloats);
+
+  // sizes are in bytes for the hash
+  vector<u8> bytes(n);
+  loopi(s32(n)) bytes[i] = u8(rnd.next());
+  hashrun hash(bytes);
+  measure("hash", "murmurhash2 byte", n, n, hash);
+}
+
+/*-------------------------------------------------------------------------
+ - simd classes against the raw intrinsics they wrap
+ -------------------------------------------------------------------------*/
+BENCHSIMDOP(ssefadd, ssef, ssef, 0.5f, 0.999f, 0.001f, x+b)
+BENCHSIMDOP(ssefmul, ssef, ssef, 0.5f, 0.999f, 0.001f, x*a)
+BENCHSIMDOP(ssefmadd, ssef, ssef, 0.5f, 0.999f, 0.001f, madd(x,a,b))
+BENCHSIMDOP(ssefmin, ssef, ssef, 0.5f, 0.999f, 0.001f, min(x+b,a))
+BENCHSIMDOP(ssefdiv, ssef, ssef, 0.5f, 0.999f, 0.001f, a/x)
+BENCHSIMDOP(ssefsqrt, ssef, ssef, 2.f, 0.999f, 0.001f, sqrt(x+b))
+BENCHSIMDOP(ssefrcp, ssef, ssef, 2.f, 0.999f, 0.001f, rcp(x))
+BENCHSIMDOP(ssefrsqrt, ssef, ssef, 2.f, 0.999f, 0.001f, rsqrt(x+b))
+BENCHSIMDOP(sseiadd, ssei, ssei, 0x1234567, 0x5bd1e995, 7, x+b)
+BENCHSIMDOP(sseixor, ssei, ssei, 0x1234567, 0x5bd1e995, 7, (x^a)+b)
+BENCHSIMDOP(m128add, __m128, _mm_set1_ps, 0.5f, 0.999f, 0.001f, _mm_add_ps(x,b))
+BENCHSIMDOP(m128mul, __m128, _mm_set1_ps, 0.5f, 0.999f, 0.001f, _mm_mul_ps(x,a))
+BENCHSIMDOP(m128madd, __m128, _mm_set1_ps, 0.5f, 0.999f, 0.001f, _mm_add_ps(_mm_mul_ps(x,a),b))
+BENCHSIMDOP(m128min, __m128, _mm_set1_ps, 0.5f, 0.999f, 0.001f, _mm_min_ps(_mm_add_ps(x,b),a))
+BENCHSIMDOP(m128div, __m128, _mm_set1_ps, 0.5f, 0.999f, 0.001f, _mm_div_ps(a,x))
+BENCHSIMDOP(m128sqrt, __m128, _mm_set1_ps, 2.f, 0.999f, 0.001f, _mm_sqrt_ps(_mm_add_ps(x,b)))
+BENCHSIMDOP(m128rcp, __m128, _mm_set1_ps, 2.f, 0.999f, 0.001f, _mm_rcp_ps(x))
+BENCHSIMDOP(m128rsqrt, __m128, _mm_set1_ps, 2.f, 0.999f, 0.001f, _mm_rsqrt_ps(_mm_add_ps(x,b)))
+BENCHSIMDOP(m128iadd, __m128i, _mm_set1_epi32, 0x1234567, 0x5bd1e995, 7, _mm_add_epi32(x,b))
+BENCHSIMDOP(m128ixor, __m128i, _mm_set1_epi32, 0x1234567, 0x5bd1e995, 7, _mm_add_epi32(_mm_xor_si128(x,a),b))
+
+// rcp and rsqrt of ssef add a newton step to the raw estimates
+static void benchsse() {
+  measuresimd<ssefadd>("ssef", "add");
+  measuresimd<m128add>("__m128", "add");
+  measuresimd<ssefmul>("ssef", "mul");
+  measuresimd<m128mul>("__m128", "mul");
+  measuresimd<ssefmadd>("ssef", "madd");
+  measuresimd<m128madd>("__m128", "madd");
+  measuresimd<ssefmin>("ssef", "add min");
+  measuresimd<m128min>("__m128", "add min");
+  measuresimd<ssefdiv>("ssef", "div");
+  measuresimd<m128div>("__m128", "div");
+  measuresimd<ssefsqrt>("ssef", "add sqrt");
+  measuresimd<m128sqrt>("__m128", "add sqrt");
+  measuresimd<ssefrcp>("ssef", "rcp");
+  measuresimd<m128rcp>("__m128", "rcp");
+  measuresimd<ssefrsqrt>("ssef", "add rsqrt");
+  measuresimd<m128rsqrt>("__m128", "add rsqrt");
+  measuresimd<sseiadd>("ssei", "add");
+  measuresimd<m128iadd>("__m128i", "add");
+  measuresimd<sseixor>("ssei", "xor add");
+  measuresimd<m128ixor>("__m128i", "xor add");
+}
+
+static bool output(const char *filename) {
+  auto f = fopen(filename, "w");
+  if (f == NULL) {
+    printf("basebench: unable to write %s\n", filename);
+    return false;
+  }
+  bench::json out(f);
+  out.beginobject();
+  out.value("runs", runnum);
+  out.value("warmup", warmup);
+  out.value("seed", SEED);
+  out.beginarray("results");
+  loopv(results) {
+    const auto &r = results[i];
+    out.beginobject();
+    out.value("group", r.group);
+    out.value("name", r.name);
+    out.value("size", r.size);
+    out.value("median_ns", r.median, "%.4f");
+    out.value("min_ns", r.best, "%.4f");
+    out.value("checksum", r.checksum);
+    out.endobject();
+  }
+  out.endarray();
+  out.endobject();
+  fclose(f);
+  return true;
+}
+} /* namespace basebench */
+} /* namespace q */
+
+static const u32 MAXSIZENUM = 16;
+
+static void usage() {
+  printf("usage: mini.q.basebench [options]\n");
+  printf("  -n runs       timed runs per benchmark (default 5)\n");
+  printf("  -w warmup     untimed runs per benchmark (default 1)\n");
+  printf("  -s s0,s1,...  container and sort sizes (default 1024,65536,1048576)\n");
+  printf("  -o file       json output (default basebench.json)\n");
+  printf("times are the median and the minimum in nanoseconds per operation\n");
+}
+
+int main(int argc, const char **argv) {
+  u32 sizes[MAXSIZENUM] = {1024, 65536, 1048576}, sizenum = 3;
+  const char *outname = "basebench.json";
+  for (int i = 1; i < argc; ++i) {
+    const auto arg = argv[i];
+    const auto hasvalue = i+1 < argc;
+    if (!strcmp(arg, "-n") && hasvalue) basebench::runnum = max(atoi(argv[++i]), 1);
+    else if (!strcmp(arg, "-w") && hasvalue) basebench::warmup = max(atoi(argv[++i]), 0);
+    else if (!strcmp(arg, "-s") && hasvalue) sizenum = bench::parselist(argv[++i], sizes, MAXSIZENUM);
+    else if (!strcmp(arg, "-o") && hasvalue) outname = argv[++i];
+    else {
+      usage();
+      return 1;
+    }
+  }
+  if (sizenum == 0) {
+    usage();
+    return 1;
+  }
+
+  sys::memstart();
+#if defined(__X86__) || defined(__X86_64__) || defined(__ARM64__)
+  // flush to zero and no denormals
+  _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
+#endif
+  printf("basebench: %-10s %-28s %9s %10s %10s %8s\n", "group", "name", "size",
+         "median ns", "min ns", "checksum");
+  loopi(s32(sizenum)) {
+    const auto n = sizes[i];
+    vector<u32> keys, shuffled, misses;
+    basebench::makekeys(n, keys, shuffled, misses);
+    basebench::benchvector(n);
+    basebench::benchcontainer<hash_map<u32,u32>>("hash_map", n, keys, shuffled, misses);
+    basebench::benchcontainer<map<u32,u32>>("map", n, keys, shuffled, misses);
+    basebench::benchset(n, keys, shuffled, misses);
+    basebench::benchlist(n);
+    basebench::benchalgorithm(n);
+  }
+  basebench::benchsse();
+#if defined(__X86__) || defined(__X86_64__)
+  if (sys::hasfeature(sys::CPU_AVX) && sys::hasfeature(sys::CPU_YMM))
+    basebench::benchavx();
+#endif
+  const auto ok = basebench::output(outname);
+  basebench::results.destroy();
+#if !defined(NDEBUG)
+  destroyistrings();
+#endif
+  return ok ? 0 : 1;
+}
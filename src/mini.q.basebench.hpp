@@ -0,0 +1,107 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - mini.q.basebench.hpp -> exposes the timing of the base benchmarks
+ -------------------------------------------------------------------------*/
+#pragma once
+#include "base/sys.hpp"
+#include "base/vector.hpp"
+#include "base/string.hpp"
+#include "base/hash.hpp"
+
+namespace q {
+namespace basebench {
+
+// every run repeats the benchmark until it did MINOPS operations such that
+// small sizes are not lost in the clock resolution
+static const u32 MINOPS = 1u<<20;
+// simd operations done by each latency and throughput run
+static const u32 SIMDITERNUM = 1u<<20;
+// independent chains in the throughput runs
+static const u32 CHAINNUM = 8;
+
+extern u32 runnum, warmup;
+
+// one line of the report. times are in nanoseconds per operation. the
+// checksum only depends on the work done and must not change across runs
+struct result {
+  const char *group, *name;
+  u32 size;
+  double median, best;
+  u32 checksum;
+};
+void record(const char *group, const char *name, u32 size, vector<double> &times, u32 checksum);
+
+// f.reset() prepares the run and is not timed. f.run() does "opnum"
+// operations and returns a checksum of what it computed
+template <typename F>
+void measure(const char *group, const char *name, u32 size, u32 opnum, F &f) {
+  vector<double> times;
+  const auto repnum = max(MINOPS/max(opnum, 1u), 1u);
+  u32 checksum = 0;
+  loopi(s32(warmup+runnum)) {
+    u64 elapsed = 0;
+    loopj(s32(repnum)) {
+      f.reset();
+      const auto start = sys::nanos();
+      checksum = f.run();
+      elapsed += sys::nanos()-start;
+    }
+    if (u32(i) >= warmup)
+      times.add(double(elapsed) / (double(repnum)*double(opnum)));
+  }
+  record(group, name, size, times, checksum);
+}
+
+// "op" maps a value to the next one. latency chains all the operations
+// while throughput interleaves CHAINNUM independent chains
+template <typename OP> struct simdlatency {
+  INLINE void reset() {}
+  INLINE u32 run() {
+    const OP op;
+    auto x = op.first();
+    loopi(s32(SIMDITERNUM)) x = op(x);
+    return op.checksum(x);
+  }
+};
+template <typename OP> struct simdthroughput {
+  INLINE void reset() {}
+  INLINE u32 run() {
+    const OP op;
+    typename OP::type x[CHAINNUM];
+    loopi(s32(CHAINNUM)) x[i] = op.first();
+    for (u32 i = 0; i < SIMDITERNUM; i += CHAINNUM)
+      loopj(s32(CHAINNUM)) x[j] = op(x[j]);
+    return murmurhash2(x, sizeof(x));
+  }
+};
+template <typename OP> void measuresimd(const char *group, const char *name) {
+  simdlatency<OP> latency;
+  simdthroughput<OP> throughput;
+  const fixedstring latname(fmt, "%s latency", name);
+  const fixedstring thrname(fmt, "%s throughput", name);
+  measure(group, istring(latname.c_str()).c_str(), 0, SIMDITERNUM, latency);
+  measure(group, istring(thrname.c_str()).c_str(), 0, SIMDITERNUM, throughput);
+}
+
+// the compiler must not see the constants or it folds the chains
+template <typename T> INLINE T opaque(T x) {
+  volatile T v = x;
+  return v;
+}
+
+// an operation of the latency and throughput runs. "EXPR" computes the next
+// value from x with the constants a and b. x starts at "X0"
+#define BENCHSIMDOP(NAME, TYPE, SET1, X0, A, B, EXPR)\
+struct NAME {\
+  typedef TYPE type;\
+  INLINE NAME() : a(SET1(opaque(A))), b(SET1(opaque(B))) {}\
+  INLINE TYPE first() const { return SET1(opaque(X0)); }\
+  INLINE TYPE operator()(TYPE x) const { return EXPR; }\
+  INLINE u32 checksum(const TYPE &x) const { return murmurhash2(&x, sizeof(TYPE)); }\
+  TYPE a, b;\
+};
+
+// the avx benchmarks. they are compiled apart with avx enabled
+void benchavx();
+} /* namespace basebench */
+} /* namespace q */
@@ -0,0 +1,47 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - mini.q.basebenchavx.cpp -> benchmarks the avx classes
+ -------------------------------------------------------------------------*/
+#include "mini.q.basebench.hpp"
+#include "base/avx.hpp"
+
+namespace q {
+namespace basebench {
+BENCHSIMDOP(avxfadd, avxf, avxf, 0.5f, 0.999f, 0.001f, x+b)
+BENCHSIMDOP(avxfmul, avxf, avxf, 0.5f, 0.999f, 0.001f, x*a)
+BENCHSIMDOP(avxfmadd, avxf, avxf, 0.5f, 0.999f, 0.001f, madd(x,a,b))
+BENCHSIMDOP(avxfmin, avxf, avxf, 0.5f, 0.999f, 0.001f, min(x+b,a))
+BENCHSIMDOP(avxfdiv, avxf, avxf, 0.5f, 0.999f, 0.001f, a/x)
+BENCHSIMDOP(avxfsqrt, avxf, avxf, 2.f, 0.999f, 0.001f, sqrt(x+b))
+BENCHSIMDOP(avxfrcp, avxf, avxf, 2.f, 0.999f, 0.001f, rcp(x))
+BENCHSIMDOP(avxfrsqrt, avxf, avxf, 2.f, 0.999f, 0.001f, rsqrt(x+b))
+BENCHSIMDOP(m256add, __m256, _mm256_set1_ps, 0.5f, 0.999f, 0.001f, _mm256_add_ps(x,b))
+BENCHSIMDOP(m256mul, __m256, _mm256_set1_ps, 0.5f, 0.999f, 0.001f, _mm256_mul_ps(x,a))
+BENCHSIMDOP(m256madd, __m256, _mm256_set1_ps, 0.5f, 0.999f, 0.001f, _mm256_add_ps(_mm256_mul_ps(x,a),b))
+BENCHSIMDOP(m256min, __m256, _mm256_set1_ps, 0.5f, 0.999f, 0.001f, _mm256_min_ps(_mm256_add_ps(x,b),a))
+BENCHSIMDOP(m256div, __m256, _mm256_set1_ps, 0.5f, 0.999f, 0.001f, _mm256_div_ps(a,x))
+BENCHSIMDOP(m256sqrt, __m256, _mm256_set1_ps, 2.f, 0.999f, 0.001f, _mm256_sqrt_ps(_mm256_add_ps(x,b)))
+BENCHSIMDOP(m256rcp, __m256, _mm256_set1_ps, 2.f, 0.999f, 0.001f, _mm256_rcp_ps(x))
+BENCHSIMDOP(m256rsqrt, __m256, _mm256_set1_ps, 2.f, 0.999f, 0.001f, _mm256_rsqrt_ps(_mm256_add_ps(x,b)))
+
+// rcp of avxf is an exact division and rsqrt adds a newton step
+void benchavx() {
+  measuresimd<avxfadd>("avxf", "add");
+  measuresimd<m256add>("__m256", "add");
+  measuresimd<avxfmul>("avxf", "mul");
+  measuresimd<m256mul>("__m256", "mul");
+  measuresimd<avxfmadd>("avxf", "madd");
+  measuresimd<m256madd>("__m256", "madd");
+  measuresimd<avxfmin>("avxf", "add min");
+  measuresimd<m256min>("__m256", "add min");
+  measuresimd<avxfdiv>("avxf", "div");
+  measuresimd<m256div>("__m256", "div");
+  measuresimd<avxfsqrt>("avxf", "add sqrt");
+  measuresimd<m256sqrt>("__m256", "add sqrt");
+  measuresimd<avxfrcp>("avxf", "rcp");
+  measuresimd<m256rcp>("__m256", "rcp");
+  measuresimd<avxfrsqrt>("avxf", "add rsqrt");
+  measuresimd<m256rsqrt>("__m256", "add rsqrt");
+}
+} /* namespace basebench */
+} /* namespace q */
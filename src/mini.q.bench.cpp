@@ -0,0 +1,271 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - mini.q.bench.cpp -> benchmarks the meshing pipeline over csg scenes
+ -------------------------------------------------------------------------*/
+#include "base/console.hpp"
+#include "base/task.hpp"
+#include "base/string.hpp"
+#include "base/script.hpp"
+#include "base/sys.hpp"
+#include "base/bench.hpp"
+#include "csg.hpp"
+#include "iso.hpp"
+#include "kernel.hpp"
+#include "mini.q.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cfloat>
+
+using namespace q;
+
+// all resolutions mesh the same box: the cell size shrinks as cellnum grows
+static const float CELLSIZE = 0.1f;
+static const u32 CELLNUM = 4096;
+static const vec3f ORG(0.15f);
+static const u32 MAXVALUENUM = 16;
+// workers are pinned so that timings do not depend on thread migrations and
+// the per-thread builders stay on the numa node of their worker
+static const s32 WORKERNODE = task::ANYNODE;
+
+static void usage() {
+  con::out("usage: mini.q.bench [options] scene.lua...");
+  con::out("  -n runs       timed runs per configuration (default 5)");
+  con::out("  -w warmup     untimed runs per configuration (default 1)");
+  con::out("  -c c0,c1,...  cell numbers to mesh (default 1024,2048,4096)");
+  con::out("  -t t0,t1,...  worker thread numbers (default 1 and all cores)");
+  con::out("  -o file       json output (default bench.json)");
+  con::out("  -m allocator  pool or system (default pool)");
+  con::out("  -a            run every compiled leaf size, packet width and field");
+  con::out("                storage and report the fastest one for this machine");
+}
+
+struct config {
+  const char *scene;
+  u32 cellnum, threadnum, trinum;
+  iso::config iso;
+  double median, p95, best;
+};
+
+// restart the tasking system with the given number of worker threads. the
+// waiting thread only helps with the task it waits for so we need one worker
+static void setthreads(u32 threadnum) {
+  task::finish();
+  task::start(&threadnum, 1, &WORKERNODE);
+}
+
+static void run(const csg::node &node, config &cfg, u32 runnum, u32 warmup) {
+  vector<double> times;
+  const auto cellsize = CELLSIZE * float(CELLNUM) / float(cfg.cellnum);
+  iso::setconfig(cfg.iso);
+  loopi(s32(warmup+runnum)) {
+    const auto start = sys::micros();
+    auto m = iso::dc(ORG, cfg.cellnum, cellsize, node);
+    const auto end = sys::micros();
+    cfg.trinum = m.m_indexnum/3;
+    m.destroy();
+    if (u32(i) >= warmup) times.add(double(end-start)*1e-3);
+  }
+  const auto s = bench::summarize(times);
+  cfg.best = s.best;
+  cfg.median = s.median;
+  cfg.p95 = s.p95;
+}
+
+static INLINE bool sameiso(const iso::config &a, const iso::config &b) {
+  return a.leafdim == b.leafdim && a.packetsize == b.packetsize &&
+         a.compact == b.compact;
+}
+
+// efficiency is measured against the smallest thread number of the same
+// scene, resolution and contouring configuration: t0*time(t0) / (t*time(t))
+static double efficiency(const vector<config> &cfgs, const config &cfg) {
+  const config *base = &cfg;
+  loopv(cfgs) {
+    const auto &c = cfgs[i];
+    if (c.scene == cfg.scene && c.cellnum == cfg.cellnum &&
+        sameiso(c.iso, cfg.iso) && c.threadnum < base->threadnum)
+      base = &c;
+  }
+  return double(base->threadnum) * base->median /
+         (double(cfg.threadnum) * cfg.median);
+}
+
+static void poolreport() {
+  sys::mempoolstat stats[32];
+  const auto n = sys::mempoolstats(stats, ARRAY_ELEM_NUM(stats));
+  con::out("bench: %8s %8s %12s %12s", "class", "slabs", "allocs", "frees");
+  loopi(s32(n)) {
+    const auto &s = stats[i];
+    if (s.allocnum == 0 && s.slabnum == 0) continue;
+    con::out("bench: %8u %8u %12llu %12llu", s.size, s.slabnum,
+             (unsigned long long) s.allocnum, (unsigned long long) s.freenum);
+  }
+}
+
+static INLINE double trispersec(const config &cfg) {
+  return double(cfg.trinum) / (cfg.median * 1e-3);
+}
+
+// the fastest contouring configuration has the smallest geometric mean of
+// its medians over all the scenes, resolutions and thread numbers
+static iso::config fastest(const vector<config> &cfgs) {
+  auto best = iso::currentconfig();
+  auto bestscore = DBL_MAX;
+  loopi(s32(iso::confignum())) {
+    const auto iso = iso::getconfig(i);
+    double score = 0.0;
+    u32 n = 0;
+    loopvj(cfgs) if (sameiso(cfgs[j].iso, iso)) {
+      score += log(cfgs[j].median);
+      ++n;
+    }
+    if (n != 0 && score/double(n) < bestscore) {
+      bestscore = score/double(n);
+      best = iso;
+    }
+  }
+  return best;
+}
+
+static bool output(const char *filename, const vector<config> &cfgs,
+                   u32 runnum, u32 warmup, const iso::config &best) {
+  auto f = fopen(filename, "w");
+  if (f == NULL) {
+    con::out("bench: unable to write %s", filename);
+    return false;
+  }
+  bench::json out(f);
+  out.beginobject();
+  out.value("runs", runnum);
+  out.value("warmup", warmup);
+  out.value("kernels", kernel::get().name);
+  out.beginobject("fastest");
+  out.value("leaf", best.leafdim);
+  out.value("packet", best.packetsize);
+  out.value("compact", best.compact);
+  out.endobject();
+  out.beginarray("results");
+  loopv(cfgs) {
+    const auto &c = cfgs[i];
+    out.beginobject();
+    out.value("scene", c.scene);
+    out.value("cellnum", c.cellnum);
+    out.value("threads", c.threadnum);
+    out.value("leaf", c.iso.leafdim);
+    out.value("packet", c.iso.packetsize);
+    out.value("compact", c.iso.compact);
+    out.value("triangles", c.trinum);
+    out.value("median_ms", c.median);
+    out.value("p95_ms", c.p95);
+    out.value("min_ms", c.best);
+    out.value("triangles_per_sec", trispersec(c), "%.1f");
+    out.value("efficiency", efficiency(cfgs, c), "%.4f");
+    out.endobject();
+  }
+  out.endarray();
+  out.endobject();
+  fclose(f);
+  return true;
+}
+
+int main(int argc, const char **argv) {
+  u32 runnum = 5, warmup = 1;
+  u32 cellnums[MAXVALUENUM] = {1024, 2048, 4096}, cellnumnum = 3;
+  u32 threadnums[MAXVALUENUM] = {1, max(sys::threadnumber()-1, 1u)};
+  u32 threadnumnum = threadnums[1] == 1 ? 1 : 2;
+  const char *outname = "bench.json";
+  auto pooled = true, autotune = false;
+  vector<const char*> scenes;
+  for (int i = 1; i < argc; ++i) {
+    const auto arg = argv[i];
+    const auto hasvalue = i+1 < argc;
+    if (!strcmp(arg, "-n") && hasvalue) runnum = max(atoi(argv[++i]), 1);
+    else if (!strcmp(arg, "-w") && hasvalue) warmup = max(atoi(argv[++i]), 0);
+    else if (!strcmp(arg, "-c") && hasvalue) cellnumnum = bench::parselist(argv[++i], cellnums, MAXVALUENUM);
+    else if (!strcmp(arg, "-t") && hasvalue) threadnumnum = bench::parselist(argv[++i], threadnums, MAXVALUENUM);
+    else if (!strcmp(arg, "-o") && hasvalue) outname = argv[++i];
+    else if (!strcmp(arg, "-a")) autotune = true;
+    else if (!strcmp(arg, "-m") && hasvalue) {
+      const auto name = argv[++i];
+      if (strcmp(name, "pool") && strcmp(name, "system")) {
+        usage();
+        return 1;
+      }
+      pooled = !strcmp(name, "pool");
+    }
+    else if (arg[0] == '-') {
+      usage();
+      return 1;
+    } else
+      scenes.add(arg);
+  }
+  if (scenes.length() == 0) scenes.add("data/csg.lua");
+  if (cellnumnum == 0 || threadnumnum == 0) {
+    usage();
+    return 1;
+  }
+  loopi(s32(cellnumnum)) if (!ispoweroftwo(cellnums[i]) || cellnums[i] < 16) {
+    con::out("bench: cell number %u must be a power of two >= 16", cellnums[i]);
+    return 1;
+  }
+
+  kernel::start();
+  sys::memstart(pooled);
+#if defined(__X86__) || defined(__X86_64__) || defined(__ARM64__)
+  // flush to zero and no denormals
+  _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
+#endif
+  task::start(&threadnums[0], 1, &WORKERNODE);
+  iso::start();
+  csg::start();
+
+  // without autotuning, we only run the configuration set in the scripts
+  vector<iso::config> isocfgs;
+  if (autotune)
+    loopi(s32(iso::confignum())) isocfgs.add(iso::getconfig(i));
+  else
+    isocfgs.add(iso::currentconfig());
+
+  vector<config> cfgs;
+  loopv(scenes) {
+    csg::loadscene(scenes[i]);
+    const auto node = csg::makescene();
+    if (node == NULL) {
+      con::out("bench: %s does not define any scene", scenes[i]);
+      continue;
+    }
+    loopj(s32(threadnumnum)) {
+      setthreads(threadnums[j]);
+      loopk(s32(cellnumnum)) loopl(isocfgs.length()) {
+        auto &cfg = cfgs.add();
+        cfg.scene = scenes[i];
+        cfg.cellnum = cellnums[k];
+        cfg.threadnum = threadnums[j];
+        cfg.iso = isocfgs[l];
+        run(*node, cfg, runnum, warmup);
+      }
+    }
+    csg::destroyscene(node);
+  }
+
+  con::out("bench: %-24s %8s %8s %5s %6s %7s %10s %10s %10s %12s %6s", "scene",
+           "cells", "threads", "leaf", "packet", "compact", "triangles",
+           "median ms", "p95 ms", "tris/s", "eff");
+  loopv(cfgs) {
+    const auto &c = cfgs[i];
+    con::out("bench: %-24s %8u %8u %5u %6u %7u %10u %10.2f %10.2f %12.0f %6.2f",
+             c.scene, c.cellnum, c.threadnum, c.iso.leafdim, c.iso.packetsize,
+             c.iso.compact, c.trinum, c.median, c.p95, trispersec(c), efficiency(cfgs, c));
+  }
+  const auto best = fastest(cfgs);
+  if (autotune)
+    con::out("bench: fastest is isoleafdim %u, isopacketsize %u, isocompactfield %u",
+             best.leafdim, best.packetsize, best.compact);
+  if (pooled) poolreport();
+  const auto ok = output(outname, cfgs, runnum, warmup, best);
+#if !defined(NDEBUG)
+  finish();
+#endif
+  return ok ? 0 : 1;
+}
+
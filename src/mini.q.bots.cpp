@@ -0,0 +1,285 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - mini.q.bots.cpp -> headless bot clients to load and benchmark a server
+ -------------------------------------------------------------------------*/
+#include "base/sys.hpp"
+#include "base/vector.hpp"
+#include "base/string.hpp"
+#include "base/bench.hpp"
+#include "network.hpp"
+#include "enet/enet.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+namespace q { void finish() {} }
+using namespace q;
+
+// the rates of c2sinfo and of a player who shoots and chats a lot
+static const u32 UPDATEMILLIS = 40;
+static const u32 PINGMILLIS = 250;
+static const u32 SHOTMILLIS = 500;
+static const u32 CHATMILLIS = 5000;
+static const u32 REPORTMILLIS = 1000;
+static const float RADIUS = 16.f; // every bot runs on its own circle
+
+static void usage() {
+  printf("usage: mini.q.bots [options]\n");
+  printf("  -n clients    simulated clients (default 16)\n");
+  printf("  -s host       server (default localhost)\n");
+  printf("  -P port       server port (default %d)\n", int(CUBE_SERVER_PORT));
+  printf("  -d seconds    duration of the run (default 30)\n");
+  printf("  -p map        map asked if the server has none (default metl3)\n");
+  printf("  -o file       json output (default bots.json)\n");
+}
+
+struct bot {
+  ENetPeer *peer;
+  int cn; // -1 until the server welcomes us
+  u32 nextupdate, nextping, nextshot, nextchat;
+  vec3f center;
+};
+
+struct report {
+  u32 millis, clients;
+  double median, p95, max; // SV_PING/SV_PONG round trips in ms
+  double sentkb, recvkb;   // per second
+};
+
+static u64 sentbytes = 0, recvbytes = 0;
+static ENetPacket *newpacket(u8 *&p, u32 flags) {
+  const auto packet = enet_packet_create(NULL, MAXTRANS, flags);
+  p = packet->data+2;
+  return packet;
+}
+
+static void sendpacket(ENetPeer *peer, ENetPacket *packet, u8 *p, u8 channel) {
+  const auto start = packet->data;
+  *(u16 *)start = ENET_HOST_TO_NET_16(p-start);
+  enet_packet_resize(packet, p-start);
+  enet_peer_send(peer, channel, packet);
+  sentbytes += u64(p-start);
+}
+
+static void welcome(bot &b, u8 *p, int index, const char *mapname) {
+  const int cn = getint(p), prot = getint(p), hasmap = getint(p);
+  if (prot!=PROTOCOL_VERSION) {
+    printf("bots: server protocol %d, ours %d\n", prot, int(PROTOCOL_VERSION));
+    enet_peer_disconnect(b.peer);
+    return;
+  }
+  b.cn = cn;
+  u8 *q;
+  if (!hasmap) {
+    const auto packet = newpacket(q, ENET_PACKET_FLAG_RELIABLE);
+    putint(q, SV_MAPCHANGE);
+    sendstring(mapname, q);
+    putint(q, 0);
+    sendpacket(b.peer, packet, q, EVENTCHANNEL);
+  }
+  const auto packet = newpacket(q, ENET_PACKET_FLAG_RELIABLE);
+  putint(q, SV_CLIENT);
+  putint(q, cn);
+  putint(q, SV_INITC2S);
+  const fixedstring name(fmt, "bot%d", index);
+  sendstring(name.c_str(), q);
+  sendstring(index&1 ? "red" : "blue", q);
+  putint(q, 0);
+  sendpacket(b.peer, packet, q, EVENTCHANNEL);
+}
+
+// snapshots are never acknowledged so the server sends full ones, as it
+// does for a client which lost its base. that is the worst case for it
+static void update(bot &b, u32 now, int index) {
+  const auto t = float(now)*1e-3f + float(index);
+  const vec3f o = b.center + vec3f(cosf(t), sinf(t), 0.f)*RADIUS;
+  const vec3f vel(-sinf(t)*RADIUS, cosf(t)*RADIUS, 0.f);
+  const auto yaw = t*180.f/float(pi) + 90.f;
+  u8 *p;
+  const auto move = newpacket(p, 0);
+  putint(p, SV_POS);
+  putint(p, b.cn);
+  putint(p, int(o.x*DMF));
+  putint(p, int(o.y*DMF));
+  putint(p, int(o.z*DMF));
+  putint(p, int(yaw*DAF));
+  putint(p, 0);
+  putint(p, 0);
+  putint(p, int(vel.x*DVF));
+  putint(p, int(vel.y*DVF));
+  putint(p, int(vel.z*DVF));
+  putint(p, (1<<2) | (1<<4) | (CS_ALIVE<<5));
+  if (now>=b.nextping) {
+    putint(p, SV_PING);
+    putint(p, int(now));
+    b.nextping = now+PINGMILLIS;
+  }
+  sendpacket(b.peer, move, p, MOVECHANNEL);
+
+  if (now<b.nextshot && now<b.nextchat) return;
+  u8 *q;
+  const auto events = newpacket(q, ENET_PACKET_FLAG_RELIABLE);
+  putint(q, SV_CLIENT);
+  putint(q, b.cn);
+  if (now>=b.nextshot) {
+    const auto to = o + vec3f(cosf(t+1.f), sinf(t+1.f), 0.f)*64.f;
+    putint(q, SV_SHOT);
+    putint(q, 1);
+    loopi(3) putint(q, int(o[i]*DMF));
+    loopi(3) putint(q, int(to[i]*DMF));
+    b.nextshot = now+SHOTMILLIS;
+  }
+  if (now>=b.nextchat) {
+    putint(q, SV_TEXT);
+    sendstring("the quick brown fox jumps over the lazy dog", q);
+    b.nextchat = now+CHATMILLIS;
+  }
+  sendpacket(b.peer, events, q, EVENTCHANNEL);
+}
+
+static void summarize(vector<double> &rtts, report &r) {
+  const auto s = bench::summarize(rtts);
+  r.median = s.median;
+  r.p95 = s.p95;
+  r.max = s.worst;
+  rtts.setsize(0);
+}
+
+static bool output(const char *filename, const vector<report> &reports, int botnum) {
+  auto f = fopen(filename, "w");
+  if (f == NULL) {
+    printf("bots: unable to write %s\n", filename);
+    return false;
+  }
+  bench::json out(f);
+  out.beginobject();
+  out.value("bots", botnum);
+  out.beginarray("reports");
+  loopv(reports) {
+    const auto &r = reports[i];
+    out.beginobject();
+    out.value("millis", r.millis);
+    out.value("clients", r.clients);
+    out.value("rtt_median_ms", r.median, "%.1f");
+    out.value("rtt_p95_ms", r.p95, "%.1f");
+    out.value("rtt_max_ms", r.max, "%.1f");
+    out.value("sent_kbps", r.sentkb, "%.2f");
+    out.value("recv_kbps", r.recvkb, "%.2f");
+    out.endobject();
+  }
+  out.endarray();
+  out.endobject();
+  fclose(f);
+  return true;
+}
+
+int main(int argc, const char **argv) {
+  int botnum = 16, seconds = 30, port = CUBE_SERVER_PORT;
+  const char *hostname = "localhost", *mapname = "metl3", *outname = "bots.json";
+  for (int i = 1; i < argc; ++i) {
+    const auto arg = argv[i];
+    const auto hasvalue = i+1 < argc;
+    if (!strcmp(arg, "-n") && hasvalue) botnum = clamp(atoi(argv[++i]), 1, int(MAXCLIENTS));
+    else if (!strcmp(arg, "-s") && hasvalue) hostname = argv[++i];
+    else if (!strcmp(arg, "-P") && hasvalue) port = atoi(argv[++i]);
+    else if (!strcmp(arg, "-d") && hasvalue) seconds = max(atoi(argv[++i]), 1);
+    else if (!strcmp(arg, "-p") && hasvalue) mapname = argv[++i];
+    else if (!strcmp(arg, "-o") && hasvalue) outname = argv[++i];
+    else {
+      usage();
+      return 1;
+    }
+  }
+
+  sys::memstart();
+  if (enet_initialize()<0) {
+    printf("bots: unable to initialise network module\n");
+    return 1;
+  }
+  ENetAddress address = { ENET_HOST_ANY, enet_uint16(port) };
+  if (enet_address_set_host(&address, hostname)<0) {
+    printf("bots: could not resolve server %s\n", hostname);
+    return 1;
+  }
+  const auto host = enet_host_create(NULL, botnum, 0, 0);
+  if (host == NULL) {
+    printf("bots: could not create client host\n");
+    return 1;
+  }
+
+  // all the bots share one host. the server tells them apart by peer
+  vector<bot> bots;
+  loopi(botnum) {
+    auto &b = bots.add();
+    b.peer = enet_host_connect(host, &address, CHANNELNUM);
+    b.peer->data = (void*) intptr(i);
+    b.cn = -1;
+    b.nextupdate = b.nextping = 0;
+    b.nextshot = u32(i)*SHOTMILLIS/u32(botnum);
+    b.nextchat = u32(i)*CHATMILLIS/u32(botnum);
+    b.center = vec3f(64.f+float(i%16)*8.f, 64.f+float(i/16)*8.f, 4.f);
+  }
+
+  vector<double> rtts;
+  vector<report> reports;
+  const auto start = enet_time_get();
+  auto lastreport = start;
+  auto lastsent = sentbytes, lastrecv = recvbytes;
+  for (;;) {
+    ENetEvent event;
+    auto ret = enet_host_service(host, &event, 1);
+    for (; ret > 0; ret = enet_host_check_events(host, &event)) {
+      const auto index = int(intptr(event.peer->data));
+      auto &b = bots[index];
+      if (event.type == ENET_EVENT_TYPE_RECEIVE) {
+        recvbytes += event.packet->dataLength;
+        u8 *p = event.packet->data+2;
+        if (event.packet->dataLength>2) {
+          const auto type = getint(p);
+          if (type == SV_INITS2C && b.cn < 0)
+            welcome(b, p, index, mapname);
+          else if (type == SV_PONG)
+            rtts.add(double(enet_time_get()-u32(getint(p))));
+        }
+        enet_packet_destroy(event.packet);
+      } else if (event.type == ENET_EVENT_TYPE_DISCONNECT) {
+        printf("bots: bot%d disconnected\n", index);
+        b.cn = -1;
+        b.peer = NULL;
+      }
+    }
+
+    const auto now = enet_time_get();
+    loopv(bots) {
+      auto &b = bots[i];
+      if (b.peer == NULL || b.cn < 0 || now<b.nextupdate) continue;
+      update(b, now, i);
+      b.nextupdate = now+UPDATEMILLIS;
+    }
+    enet_host_flush(host);
+
+    if (now-lastreport >= REPORTMILLIS) {
+      auto &r = reports.add();
+      const auto dt = double(now-lastreport)*1e-3;
+      r.millis = now-start;
+      r.clients = 0;
+      loopv(bots) if (bots[i].cn >= 0) ++r.clients;
+      r.sentkb = double(sentbytes-lastsent)/1024.0/dt;
+      r.recvkb = double(recvbytes-lastrecv)/1024.0/dt;
+      summarize(rtts, r);
+      printf("bots: %5.1f s %3u clients rtt %6.1f ms (p95 %6.1f, max %6.1f) "
+             "sent %8.2f KB/s recv %8.2f KB/s\n", double(r.millis)*1e-3,
+             r.clients, r.median, r.p95, r.max, r.sentkb, r.recvkb);
+      lastreport = now;
+      lastsent = sentbytes;
+      lastrecv = recvbytes;
+    }
+    if (now-start >= u32(seconds)*1000u) break;
+  }
+
+  loopv(bots) if (bots[i].peer) enet_peer_disconnect(bots[i].peer);
+  enet_host_flush(host);
+  enet_host_destroy(host);
+  enet_deinitialize();
+  return output(outname, reports, botnum) ? 0 : 1;
+}
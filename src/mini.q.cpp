@@ -4,8 +4,11 @@
  -------------------------------------------------------------------------*/
 #include "mini.q.hpp"
 #include "rt.hpp"
+#include "capture.hpp"
 #include "iso.hpp"
 #include "csg.hpp"
+#include "base/pack.hpp"
+#include "kernel.hpp"
 #include "enet/enet.h"
 #include <time.h>
 #include <SDL2/SDL_image.h>
@@ -132,6 +135,13 @@ static void setupscreen() {
   renderh = min(sys::scrh, screenh);
 }
 
+// enet goes through our allocator to account its memory to the network
+static void *ENET_CALLBACK enetmalloc(size_t sz) {
+  MEMORY_TAG(MEM_NET);
+  return MALLOC(max(sz, size_t(1)));
+}
+static void ENET_CALLBACK enetfree(void *ptr) { FREE(ptr); }
+
 static void outputcpufeatures() {
   using namespace sys;
   fixedstring features("cpu: ");
@@ -145,6 +155,7 @@ static void outputcpufeatures() {
 }
 
 void swap() {
+  capture::frame(sys::scrw, sys::scrh);
   SDL_GL_SwapWindow(screen);
 }
 
@@ -153,7 +164,7 @@ void start(int argc, const char *argv[]) {
   bool dedicated = false;
   int uprate = 0, maxcl = 4;
   const char *master = NULL;
-  const char *sdesc = "", *ip = "", *passwd = "";
+  const char *sdesc = "", *ip = "", *passwd = "", *stats = NULL;
   rangei(1, argc) {
     const char *a = &argv[i][2];
     if (argv[i][0]=='-') switch (argv[i][1]) {
@@ -167,6 +178,7 @@ void start(int argc, const char *argv[]) {
       case 'm': master = a; break;
       case 'p': passwd = a; break;
       case 'c': maxcl  = atoi(a); break;
+      case 's': stats  = a; break;
       default:  con::out("unknown commandline option");
     } else
       con::out("unknown commandline argument");
@@ -186,6 +198,7 @@ void start(int argc, const char *argv[]) {
 #endif
 
  outputcpufeatures();
+ kernel::start();
 
   // load support for the JPG and PNG image formats
   con::out("init: sdl image");
@@ -200,8 +213,11 @@ void start(int argc, const char *argv[]) {
   con::out("init: memory debugger");
   sys::memstart();
 
+  if (pack::start("data.pack"))
+    con::out("init: asset pack: data.pack");
+
   con::out("init: tasking system");
-#if defined(__X86__) || defined(__X86_64__)
+#if defined(__X86__) || defined(__X86_64__) || defined(__ARM64__)
   // flush to zero and no denormals
   _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
 #endif
@@ -219,12 +235,13 @@ void start(int argc, const char *argv[]) {
   sys::initendiancheck();
 
   con::out("net: enet");
-  if (enet_initialize()<0)
+  const ENetCallbacks callbacks = {enetmalloc, enetfree, NULL};
+  if (enet_initialize_with_callbacks(ENET_VERSION, &callbacks)<0)
     sys::fatal("enet: unable to initialise network module");
   con::out("net: client");
   game::initclient();
   con::out("net: server");
-  server::init(dedicated, uprate, sdesc, ip, master, passwd, maxcl);  // never returns if dedicated
+  server::init(dedicated, uprate, sdesc, ip, master, passwd, maxcl, 1, stats);  // never returns if dedicated
 
   con::out("init: video: ogl");
   ogl::start(sys::scrw, sys::scrh);
@@ -245,7 +262,7 @@ void start(int argc, const char *argv[]) {
 
   con::out("init: csg module");
   csg::start();
-  script::execscript("data/csg.lua");
+  rr::loadscene("data/csg.lua");
   inputgrab(false);
 
   con::out("script");
@@ -254,6 +271,7 @@ void start(int argc, const char *argv[]) {
   script::execscript("data/keymap.lua");
   script::execscript("data/menus.lua");
   script::execscript("data/sounds.lua");
+  sound::preload();
   script::execscript("data/autoexec.lua");
 
   con::out("localconnect");
@@ -279,10 +297,15 @@ void finish() {
     fprintf(f, "playerypr(%d, %d, %d)\n", ypr.x, ypr.y, ypr.z);
     fclose(f);
   }
+  ogl::saveprogramcache();
+  shaders::saveused();
+  con::flush(); // release builds skip con::finish: lines of the workers go now
 #if !defined(RELEASE)
   game::zapdynent(game::player1);
   game::cleanmonsters();
+  capture::finish();
   rt::finish();
+  physics::finish();
   iso::finish();
   rr::finish();
   md2::finish();
@@ -294,6 +317,8 @@ void finish() {
   task::finish();
   con::finish();
   script::finish();
+  pack::finish();
+  destroyistrings();
 #endif
 }
 
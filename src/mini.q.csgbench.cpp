@@ -0,0 +1,281 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - mini.q.csgbench.cpp -> benchmarks the csg distance kernels per node type
+ -------------------------------------------------------------------------*/
+#include "base/console.hpp"
+#include "base/string.hpp"
+#include "base/sys.hpp"
+#include "base/bench.hpp"
+#include "csg.hpp"
+#include "csginternal.hpp"
+#include "csgscalar.hpp"
+#include "kernel.hpp"
+#include <cstdio>
+#include <cstdlib>
+
+using namespace q;
+using namespace q::csg;
+
+// packets are spread over the tree in cubes the size of an iso brick such
+// that culling in the unions behaves as it does while meshing
+static const u32 PACKETNUM = 64;
+static const float PACKETSIZE = 0.4f;
+// all the trees fit in this box. unbounded nodes are sampled inside it
+static const aabb SCENEBOX(vec3f(-4.f), vec3f(4.f));
+// each run evaluates all the packets until it did MINPOINTS points
+static const u32 MINPOINTS = 1u<<20;
+
+static void usage() {
+  con::out("usage: mini.q.csgbench [options]");
+  con::out("  -n runs   timed runs per tree and kernel (default 5)");
+  con::out("  -w warmup untimed runs per tree and kernel (default 1)");
+  con::out("  -g        also compute the gradients");
+  con::out("  -o file   json output (default csgbench.json)");
+}
+
+// fixed seed such that every run and every kernel sees the same points
+static u32 seed = 0x2545f491u;
+static INLINE float xorshift() {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return float(seed >> 8) * (1.f / float(1u<<24));
+}
+static INLINE vec3f xorshift3() {
+  const auto x = xorshift(), y = xorshift();
+  return vec3f(x, y, xorshift());
+}
+
+/*-------------------------------------------------------------------------
+ - synthetic trees. "n" is the number of nodes of the type we time
+ -------------------------------------------------------------------------*/
+static ref<node> unitsphere(u32) { return NEW(sphere, 1.f); }
+static ref<node> unitbox(u32) { return NEW(box, 1.f, 1.f, 1.f); }
+static ref<node> groundplane(u32) { return NEW(plane, 0.f, 1.f, 0.f, 0.f); }
+static ref<node> infinitecylinder(u32) { return NEW(cylinderxz, 0.f, 0.f, 1.f); }
+static ref<node> cappedcylinderxz(u32) {
+  const aabb bounds(vec3f(-1.f), vec3f(1.f));
+  return NEW(cappedcylinder, C_CAPPEDCYLINDERXZ, vec2f(zero), 1.f, vec2f(-1.f,1.f),
+             bounds, MAT_SIMPLE_INDEX);
+}
+
+// small spheres on a jittered grid covering the domain
+static ref<node> gridsphere(u32 i, u32 n, float r) {
+  const auto dim = u32(ceil(pow(float(n), 1.f/3.f)));
+  const vec3i xyz(i%dim, (i/dim)%dim, i/(dim*dim));
+  const auto cell = (SCENEBOX.pmax-SCENEBOX.pmin) / float(dim);
+  const auto p = SCENEBOX.pmin + (vec3f(xyz)+0.5f)*cell + (xorshift3()-0.5f)*0.2f*cell;
+  return NEW(translation, p, NEW(sphere, r*min(cell.x,min(cell.y,cell.z))));
+}
+
+// left-nested as the scripts build them. the compiler turns long ones into
+// n-ary unions with a bvh
+static ref<node> unions(u32 n) {
+  ref<node> root = gridsphere(0, n+1, 0.4f);
+  loopi(s32(n)) root = NEW(csg::U, root, gridsphere(i+1, n+1, 0.4f));
+  return root;
+}
+static ref<node> differences(u32 n) {
+  ref<node> root = NEW(box, SCENEBOX.pmax*0.9f);
+  loopi(s32(n)) root = NEW(csg::D, root, gridsphere(i, n, 0.3f));
+  return root;
+}
+static ref<node> intersections(u32 n) {
+  ref<node> root = NEW(box, SCENEBOX.pmax*0.9f);
+  loopi(s32(n)) {
+    const auto r = 4.f + 0.1f*float(i);
+    root = NEW(csg::I, root, NEW(translation, (xorshift3()-0.5f)*0.5f, NEW(sphere, r)));
+  }
+  return root;
+}
+static ref<node> translations(u32 n) {
+  ref<node> root = NEW(sphere, 2.f);
+  loopi(s32(n)) root = NEW(translation, (xorshift3()-0.5f)*0.1f, root);
+  return root;
+}
+static ref<node> rotations(u32 n) {
+  ref<node> root = NEW(box, 1.5f, 1.f, 0.5f);
+  loopi(s32(n)) {
+    const auto angles = xorshift3()*90.f;
+    root = NEW(rotation, angles.x, angles.y, angles.z, root);
+  }
+  return root;
+}
+static ref<node> displacements(u32 n) {
+  ref<node> root = NEW(sphere, 2.f);
+  loopi(s32(n)) root = NEW(displacement, 0.05f, 2.f*float(i+1), root);
+  return root;
+}
+
+struct tree {
+  const char *name;
+  ref<node> (*build)(u32);
+  u32 n;
+};
+static const tree trees[] = {
+  {"sphere", unitsphere, 1},
+  {"box", unitbox, 1},
+  {"plane", groundplane, 1},
+  {"cylinder", infinitecylinder, 1},
+  {"capped cylinder", cappedcylinderxz, 1},
+  {"union", unions, 4},
+  {"union", unions, 16},
+  {"union", unions, 64},
+  {"union", unions, 256},
+  {"difference", differences, 4},
+  {"difference", differences, 16},
+  {"difference", differences, 64},
+  {"intersection", intersections, 4},
+  {"translation", translations, 4},
+  {"rotation", rotations, 1},
+  {"rotation", rotations, 4},
+  {"displacement", displacements, 1},
+  {"displacement", displacements, 2}
+};
+
+/*-------------------------------------------------------------------------
+ - timing
+ -------------------------------------------------------------------------*/
+static struct packets {
+  csg::array3f pos[PACKETNUM];
+  aabb box[PACKETNUM];
+} pk;
+
+static void makepackets(packets &p, const aabb &treebox) {
+  // sample where the tree is, giving brick sized cubes some room around it
+  const auto box = intersection(SCENEBOX, aabb(treebox.pmin-PACKETSIZE, treebox.pmax+PACKETSIZE));
+  const auto extent = max(box.pmax-box.pmin-PACKETSIZE, vec3f(zero));
+  loopi(s32(PACKETNUM)) {
+    const auto pmin = box.pmin + xorshift3()*extent;
+    const auto pmax = pmin + PACKETSIZE;
+    loopj(s32(MAXPOINTNUM)) csg::set(p.pos[i], pmin + xorshift3()*PACKETSIZE, j);
+    p.box[i] = aabb(pmin, pmax);
+  }
+}
+
+struct result {
+  const char *tree, *kernel;
+  u32 n, insnum;
+  double median, best; // nanoseconds per point
+  float checksum;      // sum of the distances of the last run
+};
+
+static void run(const program *prog, const kernel::table &kernel, const packets &p,
+                bool gradient, u32 runnum, u32 warmup, result &r) {
+  vector<double> times;
+  CACHE_LINE_ALIGNED csg::arrayf d;
+  CACHE_LINE_ALIGNED csg::arrayi m;
+  CACHE_LINE_ALIGNED csg::array3f grad;
+  const auto repnum = max(MINPOINTS/(PACKETNUM*MAXPOINTNUM), 1u);
+  const auto g = gradient ? &grad : NULL;
+  loopi(s32(warmup+runnum)) {
+    auto checksum = 0.f;
+    const auto start = sys::nanos();
+    loopj(s32(repnum)) loopk(s32(PACKETNUM)) {
+      kernel.csgdist(prog, p.pos[k], NULL, d, m, MAXPOINTNUM, p.box[k], g);
+      // culled packets get FLT_MAX and only the real distances are compared
+      const auto dk = d[k % MAXPOINTNUM];
+      if (dk < FLT_MAX) checksum += dk;
+    }
+    const auto elapsed = sys::nanos()-start;
+    if (u32(i) >= warmup)
+      times.add(double(elapsed) / double(repnum*PACKETNUM*MAXPOINTNUM));
+    r.checksum = checksum;
+  }
+  const auto s = bench::summarize(times);
+  r.best = s.best;
+  r.median = s.median;
+}
+
+static bool output(const char *filename, const vector<result> &results,
+                   u32 runnum, u32 warmup, bool gradient) {
+  auto f = fopen(filename, "w");
+  if (f == NULL) {
+    con::out("csgbench: unable to write %s", filename);
+    return false;
+  }
+  bench::json out(f);
+  out.beginobject();
+  out.value("runs", runnum);
+  out.value("warmup", warmup);
+  out.value("points", MAXPOINTNUM);
+  out.value("gradient", gradient);
+  out.beginarray("results");
+  loopv(results) {
+    const auto &r = results[i];
+    out.beginobject();
+    out.value("tree", r.tree);
+    out.value("n", r.n);
+    out.value("instructions", r.insnum);
+    out.value("kernel", r.kernel);
+    out.value("median_ns_per_point", r.median);
+    out.value("min_ns_per_point", r.best);
+    out.value("median_ns_per_point_per_node", r.median/double(r.n));
+    out.value("checksum", r.checksum, "%.6g");
+    out.endobject();
+  }
+  out.endarray();
+  out.endobject();
+  fclose(f);
+  return true;
+}
+
+int main(int argc, const char **argv) {
+  u32 runnum = 5, warmup = 1;
+  auto gradient = false;
+  const char *outname = "csgbench.json";
+  for (int i = 1; i < argc; ++i) {
+    const auto arg = argv[i];
+    const auto hasvalue = i+1 < argc;
+    if (!strcmp(arg, "-n") && hasvalue) runnum = max(atoi(argv[++i]), 1);
+    else if (!strcmp(arg, "-w") && hasvalue) warmup = max(atoi(argv[++i]), 0);
+    else if (!strcmp(arg, "-o") && hasvalue) outname = argv[++i];
+    else if (!strcmp(arg, "-g")) gradient = true;
+    else {
+      usage();
+      return 1;
+    }
+  }
+
+  sys::memstart();
+#if defined(__X86__) || defined(__X86_64__) || defined(__ARM64__)
+  // flush to zero and no denormals
+  _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
+#endif
+
+  // every kernel compiled in and supported by this cpu
+  const kernel::table *kernels[4];
+  u32 kernelnum = 0;
+  const kernel::isa isas[] = {
+    kernel::ISA_SCALAR, kernel::ISA_SSE, kernel::ISA_AVX, kernel::ISA_AVX2
+  };
+  loopi(s32(ARRAY_ELEM_NUM(isas)))
+    if (const auto k = kernel::find(isas[i])) kernels[kernelnum++] = k;
+
+  vector<result> results;
+  loopi(s32(ARRAY_ELEM_NUM(trees))) {
+    const auto &t = trees[i];
+    const auto root = t.build(t.n);
+    const auto prog = compile(*root);
+    makepackets(pk, root->box);
+    loopj(s32(kernelnum)) {
+      auto &r = results.add();
+      r.tree = t.name;
+      r.kernel = kernels[j]->name;
+      r.n = t.n;
+      r.insnum = prog->code.length();
+      run(prog, *kernels[j], pk, gradient, runnum, warmup, r);
+    }
+    destroy(prog);
+  }
+
+  con::out("csgbench: %-16s %5s %5s %8s %10s %10s %12s %12s", "tree", "n",
+           "ins", "kernel", "median ns", "min ns", "ns per node", "checksum");
+  loopv(results) {
+    const auto &r = results[i];
+    con::out("csgbench: %-16s %5u %5u %8s %10.2f %10.2f %12.3f %12.6g",
+             r.tree, r.n, r.insnum, r.kernel, r.median, r.best,
+             r.median/double(r.n), r.checksum);
+  }
+  return output(outname, results, runnum, warmup, gradient) ? 0 : 1;
+}
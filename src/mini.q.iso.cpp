@@ -7,8 +7,10 @@
 #include "base/string.hpp"
 #include "base/script.hpp"
 #include "base/sys.hpp"
+#include "base/profiler.hpp"
 #include "csg.hpp"
 #include "iso.hpp"
+#include "kernel.hpp"
 #include "mini.q.hpp"
 
 using namespace q;
@@ -25,36 +27,98 @@ static void outputcpufeatures() {
 }
 
 static const float CELLSIZE = 0.1f;
+static const vec3f ORG(0.15f);
+static const u32 CELLNUM = 4096;
+
+static bool samemesh(const geom::mesh &a, const geom::mesh &b) {
+  if (a.m_vertnum != b.m_vertnum || a.m_indexnum != b.m_indexnum) return false;
+  loopi(s32(a.m_vertnum)) if (a.m_pos[i] != b.m_pos[i]) return false;
+  loopi(s32(a.m_indexnum)) if (a.m_index[i] != b.m_index[i]) return false;
+  return true;
+}
+
+// contour the first scene, only re-contour the box edited by the second one
+// and compare the result with a complete contouring of the second scene
+static int update(int argc, const char **argv) {
+  if (argc != 8) {
+    con::out("usage: mini.q.iso -update before.lua after.lua x0 y0 z0 x1 y1 z1");
+    return 1;
+  }
+  float b[6];
+  loopi(6) b[i] = float(atof(argv[i+2]));
+  const aabb dirty(vec3f(b[0],b[1],b[2]), vec3f(b[3],b[4],b[5]));
+  iso::dccontext ctx(ORG, CELLNUM, CELLSIZE);
+  geom::mesh m[3];
+  float ms[3];
+  loopi(3) {
+    const auto name = argv[i == 0 ? 0 : 1];
+    csg::loadscene(name);
+    const auto node = csg::makescene();
+    if (node == NULL) {
+      con::out("iso: %s does not define any scene", name);
+      loopj(i) m[j].destroy();
+      return 1;
+    }
+    const auto start = sys::millis();
+    if (i == 2)
+      m[i] = iso::dc(ORG, CELLNUM, CELLSIZE, *node);
+    else
+      m[i] = iso::dc(ctx, *node, i == 0 ? aabb::all() : dirty);
+    ms[i] = sys::millis()-start;
+  }
+  const auto same = samemesh(m[1], m[2]);
+  con::out("iso: first %.0f ms, update %.0f ms, full %.0f ms", ms[0], ms[1], ms[2]);
+  con::out("iso: update %u tris, full %u tris: %s", m[1].m_indexnum/3,
+           m[2].m_indexnum/3, same ? "same meshes" : "meshes differ");
+  loopi(3) m[i].destroy();
+  return same ? 0 : 1;
+}
+
 int main(int argc, const char **argv) {
   outputcpufeatures();
+  kernel::start();
 
   con::out("init: memory debugger");
   sys::memstart();
 
   con::out("init: tasking system");
-#if defined(__X86__) || defined(__X86_64__)
+#if defined(__X86__) || defined(__X86_64__) || defined(__ARM64__)
   // flush to zero and no denormals
   _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
 #endif
   const u32 threadnum = sys::threadnumber() - 1;
   con::out("init: tasking system: %d threads created", threadnum);
-  task::start(&threadnum, 1);
+  const s32 workernode = task::ANYNODE;
+  task::start(&threadnum, 1, &workernode);
 
   con::out("init: isosurface module");
   iso::start();
   con::out("init: csg module");
   csg::start();
+  if (argc > 1 && !strcmp(argv[1], "-update")) return update(argc-2, argv+2);
+
   // load the csg function
-  script::execscript(argv[1] ? argv[1] : "data/csg.lua");
+  csg::loadscene(argv[1] ? argv[1] : "data/csg.lua");
   const auto node = csg::makescene();
 
-  // build the mesh
-  assert(node != NULL);
+  if (node == NULL) {
+    con::out("iso: %s does not define any scene", argv[1] ? argv[1] : "data/csg.lua");
+    return 1;
+  }
+
+  // build the mesh. with a second argument, we stream it brick by brick
+  profiler::reset();
   const auto start = sys::millis();
-  const auto m = iso::dc(vec3f(0.15f), 4096, CELLSIZE, *node);
+  if (argc > 2)
+    iso::dcstream(argv[2], ORG, CELLNUM, CELLSIZE, *node);
+  else {
+    const auto m = iso::dc(ORG, CELLNUM, CELLSIZE, *node);
+    geom::store("simple.mesh", m);
+  }
   const auto end = sys::millis();
   printf("time %f ms\n", float(end-start));
-  geom::store("simple.mesh", m);
+  profiler::report();
+  profiler::reportjson("profile.json");
 #if !defined(NDEBUG)
   finish();
 #endif
@@ -0,0 +1,95 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - mini.q.pack.cpp -> builds the asset pack mapped at start up
+ -------------------------------------------------------------------------*/
+#include "base/console.hpp"
+#include "base/pack.hpp"
+#include "base/string.hpp"
+#include "base/sys.hpp"
+#include "mini.q.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+
+using namespace q;
+
+static void usage() {
+  con::out("usage: mini.q.pack [options] file...");
+  con::out("  -o file       output pack (default data.pack)");
+  con::out("md2 models, images and wav files are stored decoded, the rest as is");
+}
+
+static bool hasext(const char *fn, const char *ext) {
+  const auto len = strlen(fn), extlen = strlen(ext);
+  if (len < extlen) return false;
+  loopi(int(extlen)) if (tolower(fn[len-extlen+i]) != ext[i]) return false;
+  return true;
+}
+
+static bool packraw(const char *fn, pack::writer &w) {
+  int size = 0;
+  const auto buf = sys::loadfile(fn, &size);
+  if (buf == NULL) return false;
+  w.add(fn, pack::RAW, buf, u32(size));
+  FREE(buf);
+  return true;
+}
+
+int main(int argc, const char **argv) {
+  const char *outname = "data.pack";
+  vector<const char*> files;
+  for (int i = 1; i < argc; ++i) {
+    const auto arg = argv[i];
+    if (!strcmp(arg, "-o") && i+1 < argc) outname = argv[++i];
+    else if (arg[0] == '-') {
+      usage();
+      return 1;
+    } else
+      files.add(arg);
+  }
+  if (files.length() == 0) {
+    usage();
+    return 1;
+  }
+
+  sys::memstart();
+  pack::writer w;
+  u32 counts[pack::MODEL+1] = {0,0,0,0}, failed = 0;
+  loopv(files) {
+    const auto fn = files[i];
+    u32 kind = pack::RAW;
+    bool ok;
+    if (hasext(fn, ".md2")) {
+      kind = pack::MODEL;
+      ok = md2::packmodel(fn, w);
+    } else if (hasext(fn, ".jpg") || hasext(fn, ".png") ||
+               hasext(fn, ".tga") || hasext(fn, ".bmp")) {
+      kind = pack::TEXTURE;
+      ok = ogl::packtexture(fn, w);
+    } else if (hasext(fn, ".wav")) {
+      kind = pack::SOUND;
+      ok = sound::packsample(fn, w);
+    } else
+      ok = packraw(fn, w);
+    if (ok)
+      ++counts[kind];
+    else {
+      con::out("pack: unable to pack %s", fn);
+      ++failed;
+    }
+  }
+
+  const auto ok = w.write(outname);
+  if (ok)
+    con::out("pack: %s: %u files, %u textures, %u sounds, %u models, %.1f MB",
+             outname, counts[pack::RAW], counts[pack::TEXTURE],
+             counts[pack::SOUND], counts[pack::MODEL],
+             double(w.blob.length())/(1024.0*1024.0));
+  else
+    con::out("pack: unable to write %s", outname);
+#if !defined(NDEBUG)
+  finish();
+#endif
+  return ok && failed == 0 ? 0 : 1;
+}
+
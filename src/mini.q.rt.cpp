@@ -1,54 +1,87 @@
 /*-------------------------------------------------------------------------
  - mini.q - a minimalistic multiplayer FPS
- - mini.q.rt.cpp -> test ray tracing routines
+ - mini.q.rt.cpp -> test and benchmark ray tracing routines
  -------------------------------------------------------------------------*/
+#include "base/task.hpp"
+#include "base/bench.hpp"
 #include "mini.q.hpp"
 #include "bvh.hpp"
 #include "rt.hpp"
 #include "iso.hpp"
 #include "csg.hpp"
-#include <zlib.h>
+#include "kernel.hpp"
+#include "geom.hpp"
+#include <cstdio>
+#include <cstdlib>
 
 namespace q {
 static void playerpos(int x, int y, int z) {game::player1->o = vec3f(vec3i(x,y,z));}
 static void playerypr(int x, int y, int z) {game::player1->ypr = vec3f(vec3i(x,y,z));}
 CMD(playerpos);
 CMD(playerypr);
+// copies of the world placed by the script. loading a world removes them
+static const u32 MAXINSTANCENUM = 64;
+static rt::instance instances[MAXINSTANCENUM];
+static u32 instancenum = 0;
+
+// a world with the same triangles as the current one (another frame of the
+// same animated scene) only refits its bvh
 static void loadworld(const char *name) {
   geom::mesh m;
   con::out("init: loading %s", name);
   const auto start = sys::millis();
-  auto f = gzopen(name, "rb");
-  if (f==NULL) {
+  if (!geom::load(name, m)) {
     con::out("failed to open %s", name);
     exit(EXIT_FAILURE);
   }
-  gzread(f, &m.m_indexnum, sizeof(m.m_indexnum));
-  gzread(f, &m.m_vertnum, sizeof(m.m_vertnum));
-  gzread(f, &m.m_segmentnum, sizeof(m.m_segmentnum));
-  m.m_index = (u32*) MALLOC(sizeof(u32)*m.m_indexnum);
-  m.m_pos = (vec3f*) MALLOC(sizeof(vec3f)*m.m_vertnum);
-  m.m_nor = (vec3f*) MALLOC(sizeof(vec3f)*m.m_vertnum);
-  m.m_segment = (geom::segment*) MALLOC(sizeof(geom::segment)*m.m_segmentnum);
-  gzread(f, m.m_index, sizeof(u32) * m.m_indexnum);
-  gzread(f, m.m_pos, sizeof(vec3f) * m.m_vertnum);
-  gzread(f, m.m_nor, sizeof(vec3f) * m.m_vertnum);
-  gzread(f, m.m_segment, sizeof(geom::segment) * m.m_segmentnum);
-  gzclose(f);
   con::out("init: %s loaded in %.2f ms", name, float(sys::millis()-start));
-  rt::buildbvh(m.m_pos, m.m_index, m.m_indexnum);
+  rt::refitbvh(m.m_pos, m.m_index, m.m_indexnum);
+  instancenum = 0;
+  m.destroy();
 }
 CMD(loadworld);
 
-static void run(int argc, const char *argv[]) {
+static void worldinstance(int x, int y, int z, int yaw) {
+  const auto world = rt::getworld();
+  if (!world) {
+    con::out("worldinstance: no world loaded");
+    return;
+  }
+  if (instancenum == MAXINSTANCENUM) {
+    con::out("worldinstance: too many instances (max %u)", MAXINSTANCENUM);
+    return;
+  }
+  const auto m = mat3x3f::rotate(float(yaw), vec3f(0.f,1.f,0.f));
+  instances[instancenum++] = rt::instance(world->isec, m, vec3f(vec3i(x,y,z)));
+  rt::setinstances(instances, instancenum);
+}
+CMD(worldinstance);
+
+// camera keyframes of the benchmark. the script gives them in order
+struct benchview { vec3f pos, ypr; };
+static vector<benchview> benchviews;
+static void benchkeyframe(int x, int y, int z, int yaw, int pitch, int roll) {
+  const benchview view = {vec3f(vec3i(x,y,z)), vec3f(vec3i(yaw,pitch,roll))};
+  benchviews.add(view);
+}
+CMD(benchkeyframe);
+
+// workers are pinned to keep their tiles and caches on their own cpu
+static const s32 WORKERNODE = task::ANYNODE;
+
+static void init(u32 threadnum) {
   con::out("init: memory debugger");
   sys::memstart();
   con::out("init: tasking system");
-  const u32 threadnum = sys::threadnumber() - 1;
   con::out("init: tasking system: %d threads created", threadnum);
-  task::start(&threadnum, 1);
+  task::start(&threadnum, 1, &WORKERNODE);
+  kernel::start();
   con::out("init: isosurface module");
   iso::start();
+}
+
+static void run(int argc, const char *argv[]) {
+  init(sys::threadnumber() - 1);
 
   // load everything
   script::execscript(argv[1]);
@@ -56,11 +89,144 @@ static void run(int argc, const char *argv[]) {
   const auto ypr = game::player1->ypr;
   loopi(16) rt::raytrace(argv[2], pos, ypr, 1920, 1080, fov, 1.f);
 }
+
+/*-------------------------------------------------------------------------
+ - benchmark: every kernel, thread number and workload traces the frames of
+ - all keyframes and a csv line per view gives the mray/s
+ -------------------------------------------------------------------------*/
+static const u32 MAXVALUENUM = 16;
+static const char *isaname[] = {"auto", "scalar", "sse", "avx", "avx2"};
+static const char *workloadname[] = {"shadow", "primary"};
+
+static void benchusage() {
+  con::out("usage: mini.q.rt -bench [options] script");
+  con::out("  -n frames     timed frames per view (default 8)");
+  con::out("  -w warmup     untimed frames per view (default 2)");
+  con::out("  -k k0,k1,...  kernels among scalar,sse,avx,avx2 (default auto)");
+  con::out("  -t t0,t1,...  worker thread numbers (default all cores)");
+  con::out("  -l l0,l1,...  workloads among shadow,primary (default both)");
+  con::out("  -s wxh        frame size (default 1920x1080)");
+  con::out("  -o file       csv output (default rtbench.csv)");
+}
+
+// parse a comma separated list of names as indices in "names"
+static u32 parsenames(const char *str, const char **names, u32 namenum, u32 *values) {
+  u32 n = 0;
+  while (*str && n < MAXVALUENUM) {
+    const auto end = strchr(str, ',');
+    const auto len = end ? size_t(end-str) : strlen(str);
+    u32 i = 0;
+    while (i < namenum && (strlen(names[i]) != len || strncmp(str, names[i], len))) ++i;
+    if (i == namenum) return 0;
+    values[n++] = i;
+    str += end ? len+1 : len;
+  }
+  return n;
+}
+
+static int setvar(const char *name, int value) {
+  fixedstring str(fmt, "q.%s = %d", name, value);
+  return script::execstring(str.c_str());
+}
+
+// restart the tasking system with the given number of worker threads
+static void setthreads(u32 threadnum) {
+  task::finish();
+  task::start(&threadnum, 1, &WORKERNODE);
+}
+
+static int runbench(int argc, const char *argv[]) {
+  u32 framenum = 8, warmup = 2;
+  u32 isas[MAXVALUENUM] = {kernel::ISA_AUTO}, isanum = 1;
+  u32 threadnums[MAXVALUENUM] = {max(sys::threadnumber()-1, 1u)}, threadnumnum = 1;
+  u32 workloads[MAXVALUENUM] = {0, 1}, workloadnum = 2;
+  int w = 1920, h = 1080;
+  const char *outname = "rtbench.csv", *scriptname = NULL;
+  for (int i = 0; i < argc; ++i) {
+    const auto arg = argv[i];
+    const auto hasvalue = i+1 < argc;
+    if (!strcmp(arg, "-n") && hasvalue) framenum = max(atoi(argv[++i]), 1);
+    else if (!strcmp(arg, "-w") && hasvalue) warmup = max(atoi(argv[++i]), 0);
+    else if (!strcmp(arg, "-k") && hasvalue) isanum = parsenames(argv[++i], isaname, 5, isas);
+    else if (!strcmp(arg, "-t") && hasvalue) threadnumnum = bench::parselist(argv[++i], threadnums, MAXVALUENUM);
+    else if (!strcmp(arg, "-l") && hasvalue) workloadnum = parsenames(argv[++i], workloadname, 2, workloads);
+    else if (!strcmp(arg, "-s") && hasvalue) {
+      if (sscanf(argv[++i], "%dx%d", &w, &h) != 2) w = h = 0;
+    } else if (!strcmp(arg, "-o") && hasvalue) outname = argv[++i];
+    else if (arg[0] == '-' || scriptname != NULL) {
+      benchusage();
+      return 1;
+    } else
+      scriptname = arg;
+  }
+  if (scriptname == NULL || isanum == 0 || threadnumnum == 0 || workloadnum == 0 ||
+      w < int(rt::TILESIZE) || h < int(rt::TILESIZE)) {
+    benchusage();
+    return 1;
+  }
+
+  init(threadnums[0]);
+  script::execscript(scriptname);
+  if (benchviews.length() == 0) {
+    const benchview view = {game::player1->o, game::player1->ypr};
+    benchviews.add(view);
+  }
+  auto f = fopen(outname, "w");
+  if (f == NULL) {
+    con::out("bench: unable to write %s", outname);
+    benchviews.destroy();
+    return 1;
+  }
+
+  // frames of every view are always traced in the same order and with the
+  // same state: the numbers only depend on the kernels and the threads
+  fprintf(f, "kernel,threads,workload,view,width,height,frames,rays,ms,mrays_per_sec\n");
+  auto pixels = (int*) ALIGNEDMALLOC(w*h*sizeof(int), CACHE_LINE_ALIGNMENT);
+  loopi(s32(isanum)) {
+    setvar("kernelisa", isas[i]);
+    const auto name = kernel::get().name;
+    loopj(s32(threadnumnum)) {
+      setthreads(threadnums[j]);
+      loopk(s32(workloadnum)) {
+        setvar("rtnormalonly", workloads[k]);
+        loop(v, benchviews.length()) {
+          const auto &view = benchviews[v];
+          u64 rays = 0, us = 0;
+          loopl(s32(warmup+framenum)) {
+            const auto start = sys::micros();
+            rt::raytrace(pixels, view.pos, view.ypr, w, h, fov, float(w)/float(h));
+            const auto end = sys::micros();
+            if (u32(l) < warmup) continue;
+            rays += rt::raynum();
+            us += end-start;
+          }
+          const auto ms = double(us)*1e-3;
+          const auto mrays = double(rays)/max(double(us), 1.0);
+          fprintf(f, "%s,%u,%s,%d,%d,%d,%u,%llu,%.3f,%.3f\n", name, threadnums[j],
+                  workloadname[workloads[k]], v, w, h, framenum,
+                  (unsigned long long) rays, ms, mrays);
+          con::out("bench: %-6s %3u threads %-7s view %2d: %8.2f Mray/s",
+                   name, threadnums[j], workloadname[workloads[k]], v, mrays);
+        }
+      }
+    }
+  }
+  ALIGNEDFREE(pixels);
+  benchviews.destroy();
+  fclose(f);
+  return 0;
+}
 } /* namespace q */
 
 int main(int argc, const char *argv[]) {
+  if (argc >= 2 && !strcmp(argv[1], "-bench")) {
+    const auto ret = q::runbench(argc-2, argv+2);
+    q::finish();
+    return ret;
+  }
   if (argc != 3) {
     q::con::out("usage: %s script outname", argv[0]);
+    q::con::out("       %s -bench [options] script", argv[0]);
     q::finish();
     return 1;
   }
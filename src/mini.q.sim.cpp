@@ -0,0 +1,104 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - mini.q.sim.cpp -> runs the game logic headless as fast as possible
+ -------------------------------------------------------------------------*/
+#include "base/console.hpp"
+#include "base/task.hpp"
+#include "base/string.hpp"
+#include "base/script.hpp"
+#include "base/sys.hpp"
+#include "base/profiler.hpp"
+#include "enet/enet.h"
+#include "csg.hpp"
+#include "kernel.hpp"
+#include "mini.q.hpp"
+#include <cstdio>
+#include <cstdlib>
+
+using namespace q;
+
+PROFILE_PHASE(PHASE_WORLD, "updateworld");
+PROFILE_PHASE(PHASE_SERVER, "server");
+
+static void usage() {
+  con::out("usage: mini.q.sim [options] [demo]");
+  con::out("  -n ticks      simulated ticks (default 10000)");
+  con::out("  -m millis     game milliseconds per tick (default 16)");
+  con::out("  -p map        map of the bot match without demo (default metl3)");
+  con::out("  -o file       json profile output (default sim.json)");
+}
+
+// the clock only moves by tick so runs do not depend on the machine. a demo
+// is replayed until it ends, otherwise the monsters of a dmsp match hunt us
+int main(int argc, const char **argv) {
+  int ticknum = 10000, tickmillis = 16;
+  const char *outname = "sim.json", *mapname = "metl3", *demoname = NULL;
+  for (int i = 1; i < argc; ++i) {
+    const auto arg = argv[i];
+    const auto hasvalue = i+1 < argc;
+    if (!strcmp(arg, "-n") && hasvalue) ticknum = max(atoi(argv[++i]), 1);
+    else if (!strcmp(arg, "-m") && hasvalue) tickmillis = max(atoi(argv[++i]), 1);
+    else if (!strcmp(arg, "-p") && hasvalue) mapname = argv[++i];
+    else if (!strcmp(arg, "-o") && hasvalue) outname = argv[++i];
+    else if (arg[0] == '-') {
+      usage();
+      return 1;
+    } else
+      demoname = arg;
+  }
+
+  kernel::start();
+  sys::memstart();
+#if defined(__X86__) || defined(__X86_64__) || defined(__ARM64__)
+  // flush to zero and no denormals
+  _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
+#endif
+  const u32 threadnum = max(sys::threadnumber()-1, 1u);
+  task::start(&threadnum, 1);
+  if (enet_initialize()<0)
+    sys::fatal("enet: unable to initialise network module");
+  game::initclient();
+  server::init(false, 0, "", "", NULL, "", 4);
+  csg::start();
+  csg::loadscene("data/csg.lua");
+  script::execstring("q.soundvol = 0 q.savepos = 0");
+
+  server::localconnect();
+  const fixedstring cmd = demoname ?
+    fixedstring(fmt, "q.demo('%s')", demoname) :
+    fixedstring(fmt, "q.mode(%d) q.map('%s')", int(game::MODE_DMSP), mapname);
+  script::execstring(cmd.c_str());
+
+  double millis = 1.0;
+  game::setlastmillis(millis);
+  auto started = false;
+  int tick = 0;
+  profiler::reset();
+  const auto start = sys::millis();
+  for (; tick < ticknum; ++tick) {
+    millis += double(tickmillis);
+    {
+      PROFILE(PHASE_WORLD);
+      game::updateworld(int(millis));
+    }
+    if (demoname) {
+      if (demo::playing()) started = true;
+      else if (started) break;
+      continue;
+    }
+    PROFILE(PHASE_SERVER);
+    server::slice(int(millis/1000.0), 0);
+  }
+  const auto end = sys::millis();
+  const auto elapsed = max(double(end-start), 1e-3);
+  con::out("sim: %d ticks of %d ms in %.1f ms: %.1f ticks/s, %.1fx real time",
+           tick, tickmillis, elapsed, double(tick)*1000.0/elapsed,
+           double(tick)*double(tickmillis)/elapsed);
+  profiler::report();
+  const auto ok = profiler::reportjson(outname);
+#if !defined(NDEBUG)
+  finish();
+#endif
+  return ok ? 0 : 1;
+}
+
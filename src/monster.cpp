@@ -3,6 +3,7 @@
  - monster.hpp -> implements monster AI
  -------------------------------------------------------------------------*/
 #include "mini.q.hpp"
+#include "rt.hpp"
 
 namespace q {
 namespace game {
@@ -80,9 +81,63 @@ static void spawnmonster(void) {
   basicmonster(type, rnd(360), M_SEARCH, 1000, 1);
 }
 
+// line of sight queries of a frame are all traced together before the
+// monsters act. sleeping monsters look around in staggered groups and at most
+// MAXLOSNUM rays go out per frame: monsters over the budget just wait for a
+// later frame. segments the occupancy finds in the air need no ray at all
+static const u32 MAXLOSNUM = 64;
+static const u32 SLEEPGROUPS = 4;
+enum { LOS_UNKNOWN, LOS_VISIBLE, LOS_OCCLUDED };
+enum { SLOT_UNKNOWN = -1, SLOT_VISIBLE = -2 }; // losslot of monsters without ray
+static vector<rt::ray> losrays;
+static vector<s32> losoccluded, losslot;
+static u32 aiframe = 0;
+
+static bool wantslos(const dynent *m, u32 idx) {
+  if (m->monsterstate == M_SLEEP)
+    return !edit::mode() && (idx+aiframe)%SLEEPGROUPS == 0;
+  return m->monsterstate == M_HOME && m->trigger < lastmillis();
+}
+
+static void tracelos() {
+  losrays.setsize(0);
+  losslot.setsize(monsters.length());
+  loopv(monsters) {
+    const auto m = monsters[i];
+    losslot[i] = SLOT_UNKNOWN;
+    if (m->state != CS_ALIVE) continue;
+    if (m->enemy->state == CS_DEAD) {
+      m->enemy = player1;
+      m->anger = 0;
+    }
+    if (!wantslos(m, i)) continue;
+    if (physics::mapvisible(m->o, m->enemy->o)) {
+      losslot[i] = SLOT_VISIBLE;
+      continue;
+    }
+    if (u32(losrays.length()) == MAXLOSNUM) continue;
+    losslot[i] = losrays.length();
+    losrays.add(rt::ray(m->o, m->enemy->o-m->o, 0.f, 1.f));
+  }
+  losoccluded.setsize(losrays.length());
+  if (losrays.length() != 0)
+    rt::occluded(&losrays[0], losrays.length(), &losoccluded[0]);
+  ++aiframe;
+}
+
+static int enemylos(u32 idx) {
+  const auto slot = losslot[idx];
+  if (slot == SLOT_VISIBLE) return LOS_VISIBLE;
+  if (slot < 0) return LOS_UNKNOWN;
+  return losoccluded[slot] ? LOS_OCCLUDED : LOS_VISIBLE;
+}
+
 void cleanmonsters() {
-  loopv(monsters) FREE(monsters[i]);
+  loopv(monsters) zapdynent(monsters[i]);
   monsters.destroy();
+  losrays.destroy();
+  losoccluded.destroy();
+  losslot.destroy();
   numkilled = 0;
   monstertotal = 0;
   spawnremain = 0;
@@ -108,11 +163,6 @@ void monsterclear(void) {
   }
 }
 
-bool enemylos(dynent *m, vec3f &v) {
-  // no occlusion, return the target itself
-  v = m->enemy->o;
-  return true;
-}
 
 // monster AI is sequenced using transitions: they are in a particular state
 // where they execute a particular behaviour until the trigger time is hit, and
@@ -133,12 +183,9 @@ void normalise(dynent *m, float angle) {
   while (m->ypr.x>angle+180.0f) m->ypr.x -= 360.0f;
 }
 
-// main AI thinking routine, called every frame for every monster
-void monsteraction(dynent *m) {
-  if (m->enemy->state==CS_DEAD) {
-    m->enemy = player1;
-    m->anger = 0;
-  }
+// main AI thinking routine, called every frame for every monster. los is the
+// line of sight to the enemy traced for this frame
+static void monsteraction(dynent *m, int los) {
   normalise(m, m->targetyaw);
   if (m->targetyaw>m->ypr.x) { // slowly turn monster towards his target
     m->ypr.x += float(curtime())*0.5f;
@@ -174,9 +221,8 @@ void monsteraction(dynent *m) {
     break;
     // state classic sp monster start in, wait for visual contact
     case M_SLEEP: {
-      vec3f target;
       // skip running physics
-      if (edit::mode() || !enemylos(m, target)) return;
+      if (edit::mode() || los != LOS_VISIBLE) return;
       normalise(m, enemyyaw);
       const auto angle = abs(enemyyaw-m->ypr.x);
       if (disttoenemy<8.f ||  // the better the angle to the player
@@ -204,11 +250,12 @@ void monsteraction(dynent *m) {
     // shoot at any time
     case M_HOME:
       m->targetyaw = enemyyaw;
-      if (m->trigger<lastmillis()) {
-        vec3f target;
+      if (m->trigger<lastmillis() && los != LOS_UNKNOWN) {
+        // the target itself if no world geometry is in between
+        const auto target = m->enemy->o;
         // no visual contact anymore, let monster get as close as possible then
         // search for player
-        if (!enemylos(m, target))
+        if (los == LOS_OCCLUDED)
           transition(m, M_HOME, 1, 800, 500);
         else  { // the closer the monster is the more likely he wants to shoot
           if (!rnd((int)disttoenemy/3+1) && m->enemy->state==CS_ALIVE) { // get ready to fire
@@ -266,30 +313,44 @@ void monsterthink(void) {
     endsp(true);
 
   // equivalent of player entity touch, but only teleports are used
-  loopv(ents) {
-    entity &e = ents[i];
-    if (e.type!=TELEPORT) continue;
-    vec3f v(float(e.x), float(e.y), 0.f);
-    loopv(monsters) if (monsters[i]->state==CS_DEAD) {
-      if (lastmillis()-monsters[i]->lastaction<2000) {
-        monsters[i]->move = 0;
-        physics::moveplayer(monsters[i], 1, false);
+  loopv(monsters) {
+    const auto m = monsters[i];
+    if (m->state==CS_DEAD) {
+      if (lastmillis()-m->lastaction<2000) {
+        m->move = 0;
+        physics::moveplayer(m, 1, false);
       }
-    } else {
-      v.z += monsters[i]->eyeheight;
-      const float dist = distance(monsters[i]->o, v);
-      v.z -= monsters[i]->eyeheight;
-      if (dist<4) game::teleport((int)(&e-&ents[0]), monsters[i]);
+      continue;
+    }
+    u32 near[MAXNEARENTS];
+    const auto num = nearents(m->o, 4.f, near, MAXNEARENTS);
+    loopj(s32(num)) {
+      const auto &e = ents[near[j]];
+      if (e.type!=TELEPORT) continue;
+      const vec3f v(float(e.x), float(e.y), m->eyeheight);
+      if (distance(m->o, v)<4) game::teleport(int(near[j]), m);
     }
   }
+  tracelos();
   loopv(monsters) if (monsters[i]->state==CS_ALIVE)
-    monsteraction(monsters[i]);
+    monsteraction(monsters[i], enemylos(i));
 }
 
 void rendermonsters() {
-  loopv(monsters)
-    renderclient(monsters[i], false, monstertypes[monsters[i]->mtype].mdlname,
-      monsters[i]->mtype==5, monstertypes[monsters[i]->mtype].mscale/10.0f);
+  static md2::handle mdls[NUMMONSTERTYPES];
+  static bool resolved = false;
+  if (!resolved) {
+    loopi(NUMMONSTERTYPES) mdls[i] = md2::gethandle(istring(monstertypes[i].mdlname));
+    resolved = true;
+  }
+  // the hellpig model is far off its physics box and never culled
+  const auto visible = cullmodels(monsters);
+  loopv(monsters) {
+    const auto hellpig = monsters[i]->mtype==5;
+    if (visible[i] || hellpig)
+      renderclient(monsters[i], false, mdls[monsters[i]->mtype],
+        hellpig, monstertypes[monsters[i]->mtype].mscale/10.0f);
+  }
 }
 } /* namespace game */
 } /* namespace q */
@@ -8,22 +8,52 @@
 // all network traffic is in 32bit ints, which are then compressed using the
 // following simple scheme (assumes that most values are small).
 namespace q {
-// size inclusive message token, 0 for variable or not-checked sizes
-static const char msgsizesl[] = {
-  SV_INITS2C, 4, SV_INITC2S, 0, SV_POS, 12, SV_TEXT, 0, SV_SOUND, 2, SV_CDIS, 2,
-  SV_EDITH, 7, SV_EDITT, 7, SV_EDITS, 6, SV_EDITD, 6, SV_EDITE, 6,
-  SV_DIED, 2, SV_DAMAGE, 4, SV_SHOT, 8, SV_FRAGS, 2,
-  SV_MAPCHANGE, 0, SV_ITEMSPAWN, 2, SV_ITEMPICKUP, 3, SV_DENIED, 2,
-  SV_PING, 2, SV_PONG, 2, SV_CLIENTPING, 2, SV_GAMEMODE, 2,
-  SV_TIMEUP, 2, SV_EDITENT, 10, SV_MAPRELOAD, 2, SV_ITEMACC, 2,
-  SV_SENDMAP, 0, SV_RECVMAP, 1, SV_SERVMSG, 0, SV_ITEMLIST, 0,
-  SV_EXT, 0, SV_CUBE, 14,
-  -1
+// size inclusive message token, 0 for variable or not-checked sizes. indexed
+// by message code
+static const char msgsizes[] = {
+  4,  // SV_INITS2C
+  0,  // SV_INITC2S
+  12, // SV_POS
+  0,  // SV_TEXT
+  2,  // SV_SOUND
+  2,  // SV_CDIS
+  2,  // SV_DIED
+  4,  // SV_DAMAGE
+  8,  // SV_SHOT
+  2,  // SV_FRAGS
+  2,  // SV_TIMEUP
+  10, // SV_EDITENT
+  2,  // SV_MAPRELOAD
+  2,  // SV_ITEMACC
+  0,  // SV_MAPCHANGE
+  2,  // SV_ITEMSPAWN
+  3,  // SV_ITEMPICKUP
+  2,  // SV_DENIED
+  2,  // SV_PING
+  2,  // SV_PONG
+  2,  // SV_CLIENTPING
+  2,  // SV_GAMEMODE
+  7,  // SV_EDITH
+  7,  // SV_EDITT
+  6,  // SV_EDITS
+  6,  // SV_EDITD
+  6,  // SV_EDITE
+  0,  // SV_SENDMAP
+  3,  // SV_RECVMAP
+  0,  // SV_SERVMSG
+  0,  // SV_ITEMLIST
+  0,  // SV_EXT
+  14, // SV_CUBE
+  0,  // SV_SNAPSHOT
+  2,  // SV_SNAPACK
+  2,  // SV_CLIENT
+  0   // SV_MAPCHUNK
 };
+static_assert(sizeof(msgsizes) == SV_NUM, "one size per message");
+static_assert(MAXCLIENTS <= 1<<CNBITS, "client numbers do not fit");
 
 char msgsizelookup(int msg) {
-  for (const char *p = msgsizesl; *p>=0; p += 2) if (*p==msg) return p[1];
-  return -1;
+  return u32(msg) < u32(SV_NUM) ? msgsizes[msg] : -1;
 }
 
 void putint(u8 *&p, int n) {
@@ -44,5 +74,29 @@ void sendstring(const char *t, u8 *&p) {
   while (*t) putint(p, *t++);
   putint(p, 0);
 }
-} /* namespace q */
 
+// exp-golomb orders of the deltas between two snapshots. positions move by
+// a few 1/DMF per snapshot, angles by a few 1/DAF and velocities by a few
+// 1/DVF. the flags go as they are
+static const u32 posorder[POSNUM-1] = {3, 3, 2, 2, 1, 0, 3, 3, 3};
+static const u32 FLAGBITS = 8;
+
+void putposdelta(bitwriter &w, const int *from, const int *to) {
+  u32 mask = 0;
+  loopi(POSNUM) if (from[i]!=to[i]) mask |= 1u<<i;
+  w.put(0, 1);
+  w.put(mask, POSNUM);
+  loopi(POSNUM-1) if (mask&(1u<<i)) w.putsigned(to[i]-from[i], posorder[i]);
+  if (mask&(1u<<(POSNUM-1))) w.put(u32(to[POSNUM-1]), FLAGBITS);
+}
+
+void putposremoved(bitwriter &w) { w.put(1, 1); }
+
+bool getposdelta(bitreader &r, const int *from, int *to) {
+  if (r.get(1)) return false;
+  const u32 mask = r.get(POSNUM);
+  loopi(POSNUM-1) to[i] = mask&(1u<<i) ? from[i]+r.getsigned(posorder[i]) : from[i];
+  to[POSNUM-1] = mask&(1u<<(POSNUM-1)) ? int(r.get(FLAGBITS)) : from[POSNUM-1];
+  return true;
+}
+} /* namespace q */
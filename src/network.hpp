@@ -17,7 +17,8 @@ enum {
   SV_PING, SV_PONG, SV_CLIENTPING, SV_GAMEMODE,
   SV_EDITH, SV_EDITT, SV_EDITS, SV_EDITD, SV_EDITE,
   SV_SENDMAP, SV_RECVMAP, SV_SERVMSG, SV_ITEMLIST, SV_EXT,
-  SV_CUBE
+  SV_CUBE, SV_SNAPSHOT, SV_SNAPACK, SV_CLIENT, SV_MAPCHUNK,
+  SV_NUM
 };
 
 enum { CS_ALIVE, CS_DEAD, CS_LAGGED, CS_EDITING };
@@ -27,7 +28,32 @@ enum {
   MAXTRANS = 5000, // max amount of data to swallow in 1 go
   CUBE_SERVER_PORT = 28765,
   CUBE_SERVINFO_PORT = 28766,
-  PROTOCOL_VERSION = 122 // bump when protocol changes
+  PROTOCOL_VERSION = 125 // bump when protocol changes
+};
+
+// the server keeps the last SV_POS state of every client and sends each
+// client one snapshot of the others per tick, delta encoded against the last
+// snapshot the client acknowledged with SV_SNAPACK
+enum {
+  POSNUM = 10, // position, angles, velocity and packed flags
+  SNAPSHOTNUM = 32, // snapshots kept to be used as delta base
+  SNAPSHOTMILLIS = 40, // 25 snapshots per second
+  CNBITS = 8 // client numbers are below MAXCLIENTS
+};
+struct snapentry { int cn; int pos[POSNUM]; };
+
+// maps are downloaded as zlib compressed chunks on their own channel so they
+// do not hold back the game traffic. SV_RECVMAP gives the hash of the map
+// the client already partly has and the first chunk it misses. the client
+// movement is unreliable and sequenced on its own channel as well
+enum {
+  CHANNELNUM = 3,
+  EVENTCHANNEL = 0,
+  MAPCHANNEL = 1,
+  MOVECHANNEL = 2,
+  MAPCHUNKSIZE = 4096, // uncompressed bytes per chunk
+  MAPWINDOW = 8, // reliable commands a client may have in flight
+  MAXMAPSIZE = 16*1024*1024
 };
 
 char msgsizelookup(int msg);
@@ -35,6 +61,71 @@ void putint(u8 *&p, int n);
 int getint(u8 *&p);
 void sendstring(const char *t, u8 *&p);
 
+// bit streams, least significant bits first. a reader past the end reads
+// zeros and reports it with overflow()
+struct bitwriter {
+  INLINE bitwriter(u8 *p) : p(p), bits(0), num(0) {}
+  INLINE void put(u32 v, u32 n) {
+    assert(n <= 32);
+    bits |= (u64(v) & ((u64(1)<<n)-1)) << num;
+    num += n;
+    while (num >= 8) {
+      *p++ = u8(bits);
+      bits >>= 8;
+      num -= 8;
+    }
+  }
+  // exp-golomb code of order k of the zigzag value
+  INLINE void putsigned(int v, u32 k) {
+    const u32 x = ((u32(v)<<1)^u32(v>>31)) + (1u<<k);
+    const u32 m = u32(__bsr(int(x))) - k;
+    put(1u<<m, m+1);
+    put(x, m+k);
+  }
+  // pad the last byte and return the end of the stream
+  INLINE u8 *flush() {
+    if (num) *p++ = u8(bits);
+    bits = num = 0;
+    return p;
+  }
+  u8 *p;
+  u64 bits;
+  u32 num;
+};
+
+struct bitreader {
+  INLINE bitreader(const u8 *p, const u8 *end) : p(p), end(end), bits(0), num(0) {}
+  INLINE u32 get(u32 n) {
+    assert(n <= 32);
+    while (num < n) {
+      bits |= u64(p < end ? *p : 0) << num;
+      ++p;
+      num += 8;
+    }
+    const auto v = u32(bits & ((u64(1)<<n)-1));
+    bits >>= n;
+    num -= n;
+    return v;
+  }
+  INLINE int getsigned(u32 k) {
+    u32 m = 0;
+    while (get(1) == 0 && m < 32-k) ++m;
+    const u32 x = ((1u<<(m+k)) | get(m+k)) - (1u<<k);
+    return int(x>>1) ^ -int(x&1);
+  }
+  INLINE bool overflow() const { return p > end; }
+  const u8 *p, *end;
+  u64 bits;
+  u32 num;
+};
+
+// changed fields mask followed by the difference of each changed field
+void putposdelta(bitwriter &w, const int *from, const int *to);
+// a removed entry is a single bit
+void putposremoved(bitwriter &w);
+// false if the entry was removed from the snapshot
+bool getposdelta(bitreader &r, const int *from, int *to);
+
 template <typename T> INLINE T getvec(u8 *&p) {
   T v;
   loopi(T::channelnum) v[i] = (typename T::scalar)(getint(p));
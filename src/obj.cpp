@@ -4,13 +4,13 @@
  -------------------------------------------------------------------------*/
 #include "obj.hpp"
 #include "base/sys.hpp"
-#include "base/map.hpp"
-#include "base/set.hpp"
-#include "base/allocator.hpp"
+#include "base/algorithm.hpp"
+#include "base/flat_map.hpp"
 #include "base/string.hpp"
 #include "base/vector.hpp"
 #include "base/lua/bridge/luabridge.hpp"
 
+#include <SDL/SDL_thread.h>
 #include <zlib.h>
 #include <cstring>
 #include <cstdlib>
@@ -18,137 +18,258 @@
 
 namespace q {
 namespace {
-struct objloader {
-  static const int FILE_NAME_SZ = 1024;
-  static const int MAT_NAME_SZ = 1024;
-  static const int LINE_SZ = 4096;
-  static const int MAX_VERT_NUM = 4;
-  INLINE objloader(void) : objsaved(NULL), mtlsaved(NULL) {}
-  bool loadobj(const char *filename);
-  bool loadmtl(const char *mtlfilename, const char *objfilename);
-
-  // face as parsed by the OBJ loader
-  struct face {
-    int vertexindex[MAX_VERT_NUM];
-    int normalindex[MAX_VERT_NUM];
-    int textureindex[MAX_VERT_NUM];
-    int vertexnum;
-    int materialindex;
-  };
-
-  // material as parsed by the OBJ loader
-  struct mat {
-    void setdefault(void);
-    char name[MAT_NAME_SZ];
-    char mapka[FILE_NAME_SZ];
-    char mapkd[FILE_NAME_SZ];
-    char mapd[FILE_NAME_SZ];
-    char mapbump[FILE_NAME_SZ];
-    vec3d amb, diff, spec;
-    double km;
-    double reflect;
-    double refract;
-    double trans;
-    double shiny;
-    double glossy;
-    double refract_index;
-  };
-
-  int findmaterial(const char *name);
-  face *parseface(void);
-  vec3d *parsevector(void);
-  void parsevertexindex(objloader::face &face);
-  INLINE int getlistindex(int currMax, int index) {
-    if (index == 0) return -1;
-    if (index < 0)  return currMax + index;
-    return index - 1;
+/*-------------------------------------------------------------------------
+ - the obj file is mapped and cut at line ends in one chunk per thread.
+ - every chunk is parsed on its own into plain arrays: indices are resolved
+ - against the chunk counters and the negative (relative) ones are fixed
+ - once the number of elements of the previous chunks is known. usemtl and
+ - mtllib are only recorded and applied in file order afterwards. this is a
+ - standalone tool without the tasking system so chunks run in raw threads
+ -------------------------------------------------------------------------*/
+static const int MAX_VERT_NUM = 4;
+static const size_t MIN_CHUNK_SZ = 1<<20;
+
+static INLINE bool blankchar(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+static INLINE bool digitchar(char c) { return u32(c-'0') < 10u; }
+static INLINE const char *skipblank(const char *p, const char *end) {
+  while (p < end && blankchar(*p)) ++p;
+  return p;
+}
+static INLINE const char *skipline(const char *p, const char *end) {
+  while (p < end && *p != '\n') ++p;
+  return p < end ? p+1 : end;
+}
+static INLINE const char *skiptoken(const char *p, const char *end) {
+  while (p < end && !blankchar(*p) && *p != '\n') ++p;
+  return p;
+}
+static INLINE bool iskeyword(const char *p, const char *end, const char *kw) {
+  const auto len = strlen(kw);
+  if (size_t(end-p) < len || memcmp(p, kw, len)) return false;
+  return p+len == end || blankchar(p[len]) || p[len] == '\n';
+}
+
+// no locale, no errno and the end is explicit: the mapped file does not end
+// with a zero
+static const char *parseint(const char *p, const char *end, int &x) {
+  auto neg = false;
+  if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+  int v = 0;
+  while (p < end && digitchar(*p)) v = 10*v + (*p++-'0');
+  x = neg ? -v : v;
+  return p;
+}
+
+// 19 significant digits fit in the mantissa. this is exact enough for floats
+static const double POW10[] = {
+  1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,1e12,1e13,1e14,1e15,
+  1e16,1e17,1e18,1e19,1e20,1e21,1e22
+};
+static const int MAX_POW10 = ARRAY_ELEM_NUM(POW10)-1;
+static const char *parsefloat(const char *p, const char *end, float &x) {
+  auto neg = false;
+  if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+  u64 mantissa = 0;
+  int exponent = 0, digits = 0;
+  for (; p < end && digitchar(*p); ++p)
+    if (digits < 19) {
+      mantissa = 10*mantissa + u64(*p-'0');
+      digits += mantissa != 0;
+    } else
+      ++exponent;
+  if (p < end && *p == '.')
+    for (++p; p < end && digitchar(*p); ++p)
+      if (digits < 19) {
+        mantissa = 10*mantissa + u64(*p-'0');
+        digits += mantissa != 0;
+        --exponent;
+      }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    int e;
+    p = parseint(p+1, end, e);
+    exponent += e;
   }
-  void getlistindex(int current_max, int *indices) {
-    loopi(MAX_VERT_NUM) indices[i] = getlistindex(current_max, indices[i]);
+  auto v = double(mantissa);
+  for (; exponent > MAX_POW10; exponent -= MAX_POW10) v *= POW10[MAX_POW10];
+  for (; exponent < -MAX_POW10; exponent += MAX_POW10) v /= POW10[MAX_POW10];
+  v = exponent < 0 ? v / POW10[-exponent] : v * POW10[exponent];
+  x = float(neg ? -v : v);
+  return p;
+}
+
+// missing components are zero
+template <typename T>
+static const char *parsevector(const char *p, const char *end, T &v, int n) {
+  v = zero;
+  loopi(n) {
+    p = skipblank(p, end);
+    if (p == end || *p == '\n' || *p == '#') break;
+    p = parsefloat(p, end, v[i]);
   }
-  INLINE face *allocface(void) { return faceallocator.allocate(); }
-  INLINE vec3d *allocvec(void) { return vectorallocator.allocate(); }
-  INLINE mat *allocmat(void)   { return matallocator.allocate(); }
-  vector<vec3d*> vertexlist, normallist, texturelist;
-  vector<face*> facelist;
-  vector<mat*> materiallist;
-  growingpool<vec3d> vectorallocator;
-  growingpool<face> faceallocator;
-  growingpool<mat> matallocator;
-  char *objsaved, *mtlsaved; // for tokenize(...)
-  static const char *whitespace;
-};
-const char *objloader::whitespace = " \t\n\r";
+  return p;
+}
 
-void objloader::mat::setdefault(void) {
-  mapka[0] = mapkd[0] = mapd[0] = mapbump[0] = '\0';
-  amb = vec3d(0.2);
-  diff = vec3d(0.8);
-  spec = vec3d(1.0);
-  shiny = reflect = 0.0;
-  refract_index = trans = 1.;
-  glossy = 98.;
+// name as tokenized in the file (not zero terminated)
+struct name {
+  INLINE name(void) {}
+  INLINE name(const char *str, u32 len) : str(str), len(len) {}
+  INLINE bool operator== (const char *other) const {
+    return strlen(other) == len && !memcmp(str, other, len);
+  }
+  const char *str;
+  u32 len;
+};
+static INLINE name parsename(const char *p, const char *end) {
+  p = skipblank(p, end);
+  return name(p, u32(skiptoken(p, end)-p));
 }
 
-void objloader::parsevertexindex(objloader::face &face) {
-  auto saved = &objsaved;
-  char *temp_str = NULL, *token = NULL;
-  int vertexnum = 0;
-
-  while ((token = tokenize(NULL, whitespace, saved)) != NULL) {
-    if (face.textureindex != NULL) face.textureindex[vertexnum] = 0;
-    if (face.normalindex != NULL)  face.normalindex[vertexnum] = 0;
-    face.vertexindex[vertexnum] = atoi(token);
-
-    if (contains(token, "//")) {
-      temp_str = strchr(token, '/');
-      temp_str++;
-      face.normalindex[vertexnum] = atoi(++temp_str);
-    } else if (contains(token, "/")) {
-      temp_str = strchr(token, '/');
-      face.textureindex[vertexnum] = atoi(++temp_str);
-      if (contains(temp_str, "/")) {
-        temp_str = strchr(temp_str, '/');
-        face.normalindex[vertexnum] = atoi(++temp_str);
+// position, texture and normal index of each corner. -1 when missing
+struct face {
+  int idx[MAX_VERT_NUM][3];
+  u16 relative; // one bit per index to move by the counts of previous chunks
+  u16 num;
+};
+struct usemtl { u32 face; name mat; };
+
+struct chunk {
+  void parse(void);
+  const char *parseface(const char *p, face &f);
+  const char *begin, *end;
+  vector<vec3f> pos, nor;
+  vector<vec2f> tex;
+  vector<face> faces;
+  vector<usemtl> mtls;
+  vector<name> mtllibs;
+  const char *unknown; // first line we do not understand
+  u32 unknownnum;
+  bool toomanyvertices;
+};
+
+const char *chunk::parseface(const char *p, face &f) {
+  const int counts[] = {pos.length(), tex.length(), nor.length()};
+  f.relative = f.num = 0;
+  for (;;) {
+    p = skipblank(p, end);
+    if (p == end || *p == '\n' || *p == '#') break;
+    if (f.num == MAX_VERT_NUM) {
+      toomanyvertices = true;
+      break;
+    }
+    int raw[3] = {0,0,0};
+    p = parseint(p, end, raw[0]);
+    if (p < end && *p == '/') {
+      if (++p < end && *p != '/') p = parseint(p, end, raw[1]);
+      if (p < end && *p == '/') p = parseint(p+1, end, raw[2]);
+    }
+    p = skiptoken(p, end);
+    loopi(3) {
+      auto &dst = f.idx[f.num][i];
+      if (raw[i] == 0)
+        dst = -1;
+      else if (raw[i] > 0)
+        dst = raw[i]-1;
+      else {
+        dst = counts[i]+raw[i];
+        f.relative |= 1 << (3*f.num+i);
       }
     }
-    vertexnum++;
+    ++f.num;
   }
-  face.vertexnum = vertexnum;
+  return p;
 }
 
-int objloader::findmaterial(const char *name) {
-  loopv(materiallist) if (strequal(name, materiallist[i]->name)) return i;
-  return -1;
+void chunk::parse(void) {
+  unknown = NULL;
+  unknownnum = 0;
+  toomanyvertices = false;
+  for (auto p = begin; p < end; p = skipline(p, end)) {
+    p = skipblank(p, end);
+    if (p == end || *p == '\n' || *p == '#') continue;
+    if (iskeyword(p, end, "v")) {
+      vec3f v;
+      p = parsevector(p+1, end, v, 3);
+      pos.add(v);
+    } else if (iskeyword(p, end, "vn")) {
+      vec3f v;
+      p = parsevector(p+2, end, v, 3);
+      nor.add(v);
+    } else if (iskeyword(p, end, "vt")) {
+      vec2f v;
+      p = parsevector(p+2, end, v, 2);
+      tex.add(v);
+    } else if (iskeyword(p, end, "f")) {
+      auto &f = faces.add();
+      p = parseface(p+1, f);
+    } else if (iskeyword(p, end, "usemtl")) {
+      const usemtl u = {u32(faces.length()), parsename(p+6, end)};
+      mtls.add(u);
+    } else if (iskeyword(p, end, "mtllib"))
+      mtllibs.add(parsename(p+6, end));
+    else if (iskeyword(p, end, "p") || iskeyword(p, end, "o") ||
+             iskeyword(p, end, "s") || iskeyword(p, end, "g") ||
+             iskeyword(p, end, "l")) {}
+    else if (unknownnum++ == 0)
+      unknown = p;
+  }
 }
 
-objloader::face *objloader::parseface(void) {
-  auto face = allocface();
-  parsevertexindex(*face);
-  getlistindex(vertexlist.length(), face->vertexindex);
-  getlistindex(texturelist.length(), face->textureindex);
-  getlistindex(normallist.length(), face->normalindex);
-  return face;
+static int parsechunk(void *data) {
+  ((chunk*) data)->parse();
+  return 0;
 }
 
-vec3d *objloader::parsevector(void) {
-  auto v = allocvec();
-  *v = zero;
+static char *newstring(const char *str) {
+  if (str == NULL) return NULL;
+  const auto len = strlen(str);
+  const auto dst = NEWAE(char, len+1);
+  memcpy(dst, str, len+1);
+  return dst;
+}
+static INLINE void setstring(char *&dst, const char *str) {
+  SAFE_DELA(dst);
+  dst = newstring(str);
+}
+static void freestrings(obj::material &m) {
+  SAFE_DELA(m.name);
+  SAFE_DELA(m.mapka);
+  SAFE_DELA(m.mapkd);
+  SAFE_DELA(m.mapd);
+  SAFE_DELA(m.mapbump);
+}
+static void setdefault(obj::material &m) {
+  memset(&m, 0, sizeof(m));
   loopi(3) {
-    auto str = tokenize(NULL, whitespace, &objsaved);
-    if (str == NULL) break;
-    (*v)[i] = atof(str);
+    m.amb[i] = 0.2;
+    m.diff[i] = 0.8;
+    m.spec[i] = 1.0;
   }
-  return v;
+  m.shiny = m.reflect = 0.0;
+  m.refract_index = m.trans = 1.;
+  m.glossy = 98.;
 }
 
-bool objloader::loadmtl(const char *mtlfilename, const char *objfilename) {
+struct objloader {
+  static const int LINE_SZ = 4096;
+  INLINE objloader(void) : mtlsaved(NULL) {}
+  ~objloader(void) { loopv(materiallist) freestrings(materiallist[i]); }
+  bool loadmtl(const char *mtlfilename);
+  int findmaterial(name n) const {
+    loopv(materiallist) if (n == materiallist[i].name) return i;
+    return -1;
+  }
+  vector<obj::material> materiallist;
+  char *mtlsaved; // for tokenize(...)
+  static const char *whitespace;
+};
+const char *objloader::whitespace = " \t\n\r";
+
+bool objloader::loadmtl(const char *mtlfilename) {
   char *tok = NULL;
   FILE *mtlfile = NULL;
-  mat *currmat = NULL;
+  obj::material *currmat = NULL;
   char currline[LINE_SZ];
   int lineno = 0;
-  char material_open = 0;
 
   if ((mtlfile = fopen(mtlfilename, "r")) == NULL) return false;
   while (fgets(currline, LINE_SZ, mtlfile)) {
@@ -159,38 +280,36 @@ bool objloader::loadmtl(const char *mtlfilename, const char *objfilename) {
     if (tok == NULL || strequal(tok, "//") || strequal(tok, "#")) // skip comments
       continue;
     else if (strequal(tok, "newmtl")) { // start material
-      material_open = 1;
-      currmat = allocmat();
-      currmat->setdefault();
-      strncpy(currmat->name, tokenize(NULL, whitespace, saved), MAT_NAME_SZ);
-      materiallist.add(currmat);
-    } else if (strequal(tok, "Ka") && material_open) // ambient
+      currmat = &materiallist.add();
+      setdefault(*currmat);
+      currmat->name = newstring(tokenize(NULL, whitespace, saved));
+    } else if (strequal(tok, "Ka") && currmat) // ambient
       loopi(3) currmat->amb[i] = atof(tokenize(NULL, " \t", saved));
-    else if (strequal(tok, "Kd") && material_open) // diff
+    else if (strequal(tok, "Kd") && currmat) // diff
       loopi(3) currmat->diff[i] = atof(tokenize(NULL, " \t", saved));
-    else if (strequal(tok, "Ks") && material_open) // specular
+    else if (strequal(tok, "Ks") && currmat) // specular
       loopi(3) currmat->spec[i] = atof(tokenize(NULL, " \t", saved));
-    else if (strequal(tok, "Ns") && material_open) // shiny
+    else if (strequal(tok, "Ns") && currmat) // shiny
       currmat->shiny = atof(tokenize(NULL, " \t", saved));
-    else if (strequal(tok, "Km") && material_open) // mapKm
+    else if (strequal(tok, "Km") && currmat) // mapKm
       currmat->km = atof(tokenize(NULL, " \t", saved));
-    else if (strequal(tok, "d") && material_open) // transparent
+    else if (strequal(tok, "d") && currmat) // transparent
       currmat->trans = atof(tokenize(NULL, " \t", saved));
-    else if (strequal(tok, "r") && material_open) // reflection
+    else if (strequal(tok, "r") && currmat) // reflection
       currmat->reflect = atof(tokenize(NULL, " \t", saved));
-    else if (strequal(tok, "sharpness") && material_open) // glossy
+    else if (strequal(tok, "sharpness") && currmat) // glossy
       currmat->glossy = atof(tokenize(NULL, " \t", saved));
-    else if (strequal(tok, "Ni") && material_open) // refract index
+    else if (strequal(tok, "Ni") && currmat) // refract index
       currmat->refract_index = atof(tokenize(NULL, " \t", saved));
-    else if (strequal(tok, "map_Ka") && material_open) // mapka
-      strncpy(currmat->mapka, tokenize(NULL, " \"\t\r\n", saved), FILE_NAME_SZ);
-    else if (strequal(tok, "map_Kd") && material_open) // mapkd
-      strncpy(currmat->mapkd, tokenize(NULL, " \"\t\r\n", saved), FILE_NAME_SZ);
-    else if (strequal(tok, "map_D") && material_open) // mapd
-      strncpy(currmat->mapd, tokenize(NULL, " \"\t\r\n", saved), FILE_NAME_SZ);
-    else if (strequal(tok, "map_Bump") && material_open) // mapbump
-      strncpy(currmat->mapbump, tokenize(NULL, " \"\t\r\n", saved), FILE_NAME_SZ);
-    else if (strequal(tok, "illum") && material_open) {} // illumination type
+    else if (strequal(tok, "map_Ka") && currmat) // mapka
+      setstring(currmat->mapka, tokenize(NULL, " \"\t\r\n", saved));
+    else if (strequal(tok, "map_Kd") && currmat) // mapkd
+      setstring(currmat->mapkd, tokenize(NULL, " \"\t\r\n", saved));
+    else if (strequal(tok, "map_D") && currmat) // mapd
+      setstring(currmat->mapd, tokenize(NULL, " \"\t\r\n", saved));
+    else if (strequal(tok, "map_Bump") && currmat) // mapbump
+      setstring(currmat->mapbump, tokenize(NULL, " \"\t\r\n", saved));
+    else if (strequal(tok, "illum") && currmat) {} // illumination type
     else printf("obj: unknown command : %s in material file %s at line %i, \"%s\"\n",
                 tok, mtlfilename, lineno, currline);
   }
@@ -199,128 +318,156 @@ bool objloader::loadmtl(const char *mtlfilename, const char *objfilename) {
   return true;
 }
 
-bool objloader::loadobj(const char *filename) {
-  FILE *objfile = NULL;
-  int currmaterial = -1; 
-  char *tok = NULL;
-  char currline[LINE_SZ];
-  int lineno = 0;
-
-  // open scene
-  objfile = fopen(filename, "r");
-  if (objfile == NULL) {
-    printf("obj: error reading file: %s\n", filename);
-    return false;
-  }
-
-  // parser loop
-  while (fgets(currline, LINE_SZ, objfile)) {
-    auto saved = &objsaved;
-    tok = tokenize(currline, " \t\n\r", saved);
-    lineno++;
-
-    // skip comments
-    if (tok == NULL || tok[0] == '#') continue;
-    // parse objects
-    else if (strequal(tok, "v")) // vertex
-      vertexlist.add(parsevector());
-    else if (strequal(tok, "vn")) // vertex normal
-      normallist.add(parsevector());
-    else if (strequal(tok, "vt")) // vertex texture
-      texturelist.add(parsevector());
-    else if (strequal(tok, "f")) { // face
-      auto face = parseface();
-      face->materialindex = currmaterial;
-      facelist.add(face);
-    } else if (strequal(tok, "usemtl"))   // usemtl
-      currmaterial = findmaterial(tokenize(NULL, whitespace, saved));
-    else if (strequal(tok, "mtllib")) { //  mtllib
-      const char *mtlfilename = tokenize(NULL, whitespace, saved);
-      if (loadmtl(mtlfilename, filename) == 0) {
-        printf("obj: error loading %s\n", mtlfilename);
-        return false;
-      }
-      continue;
-    } else if (strequal(tok, "p")) {} // point
-    else if (strequal(tok, "o")) {} // object name
-    else if (strequal(tok, "s")) {} // smoothing
-    else if (strequal(tok, "g")) {} // group
-    else printf("obj: unknown command: %s in obj file %s at line %i, \"%s\"\n",
-                tok, filename, lineno, currline);
+// cut the file at line ends. chunks below MIN_CHUNK_SZ are not worth a thread
+static void makechunks(const char *data, size_t size, vector<chunk> &chunks) {
+  const auto n = max(min(size_t(sys::threadnumber()), size/MIN_CHUNK_SZ), size_t(1));
+  chunks.setsize(int(n));
+  auto begin = data;
+  loopi(int(n)) {
+    auto end = i == int(n)-1 ? data+size : data+size*(i+1)/n;
+    end = end > begin ? skipline(end-1, data+size) : begin;
+    chunks[i].begin = begin;
+    chunks[i].end = end;
+    begin = end;
   }
-
-  fclose(objfile);
-  return true;
 }
 
 static INLINE bool cmp(obj::triangle t0, obj::triangle t1) {return t0.m < t1.m;}
 
-// sort vertex faces
+// unique vertex of the mesh
 struct vertexkey {
   INLINE vertexkey(void) {}
-  INLINE vertexkey(int p, int n, int t) : p(p), n(n), t(t) {}
-  bool operator< (const vertexkey &other) const {
-    if (p != other.p) return p < other.p;
-    if (n != other.n) return n < other.n;
-    if (t != other.t) return t < other.t;
-    return false;
+  INLINE vertexkey(int p, int t, int n) : p(p), t(t), n(n) {}
+  INLINE bool operator== (const vertexkey &other) const {
+    return p == other.p && t == other.t && n == other.n;
   }
-  int p,n,t;
+  int p,t,n;
 };
-
-// store face connectivity
-struct poly { int v[4]; int mat; int n; };
 } // namespace
 
 bool obj::load(const char *filename) {
+  size_t size = 0;
+  const auto data = (const char*) sys::mapfile(filename, &size);
+  if (data == NULL) {
+    printf("obj: error reading file: %s\n", filename);
+    return false;
+  }
+
+  // parse all chunks at once. the first one is done by this thread
+  vector<chunk> chunks;
+  makechunks(data, size, chunks);
+  vector<SDL_Thread*> threads;
+  for (int i = 1; i < chunks.length(); ++i)
+    threads.add(SDL_CreateThread(parsechunk, "obj parser", &chunks[i]));
+  chunks[0].parse();
+  loopv(threads) SDL_WaitThread(threads[i], NULL);
+
+  // materials are all known before any face refers to them
   objloader loader;
-  map<vertexkey, int> map;
-  vector<poly> polys;
-  if (loader.loadobj(filename) == 0) return false;
-
-  int vert_n = 0;
-  loopv(loader.facelist) {
-    const auto face = loader.facelist[i];
-    if (face == NULL) {
-      printf("obj: null face for %s\n", filename);
-      return false;
+  auto ok = true;
+  loopv(chunks) {
+    const auto &c = chunks[i];
+    if (c.unknownnum) {
+      const auto line = c.unknown;
+      printf("obj: %u unknown commands in obj file %s, first one is \"%.*s\"\n",
+             c.unknownnum, filename, int(skipline(line, c.end)-line), line);
     }
-    if (face->vertexnum > 4) {
+    if (c.toomanyvertices) {
       printf("obj: too many vertices for %s\n", filename);
-      return false;
+      ok = false;
     }
-    int v[] = {0,0,0,0};
-    for (int j = 0; j < face->vertexnum; ++j) {
-      const int p = face->vertexindex[j];
-      const int n = face->normalindex[j];
-      const int t = face->textureindex[j];
-      const vertexkey key(p,n,t);
-      const auto it = map.find(key);
-      if (it == map.end())
-        v[j] = map[key] = vert_n++;
-      else
-        v[j] = it->second;
+    loopvj(c.mtllibs) {
+      const auto &lib = c.mtllibs[j];
+      fixedstring mtlfilename;
+      const auto len = min(lib.len, u32(MAXDEFSTR-1));
+      memcpy(mtlfilename.c_str(), lib.str, len);
+      mtlfilename[len] = 0;
+      if (!loader.loadmtl(mtlfilename.c_str())) {
+        printf("obj: error loading %s\n", mtlfilename.c_str());
+        ok = false;
+      }
     }
-    const poly p = {{v[0],v[1],v[2],v[3]},face->materialindex,face->vertexnum};
-    polys.add(p);
   }
 
-  // No face defined
-  if (polys.length() == 0) return true;
-
-  // create triangles now
+  // resolve indices, merge vertices and triangulate in file order
+  flat_map<vertexkey, int> map;
+  vector<vertexkey> keys;
   vector<triangle> tris;
-  for (auto poly = polys.begin(); poly != polys.end(); ++poly) {
-    if (poly->n == 3) {
-      const triangle tri(vec3i(poly->v[0], poly->v[1], poly->v[2]), poly->mat);
-      tris.add(tri);
-    } else {
-      const triangle tri0(vec3i(poly->v[0], poly->v[1], poly->v[2]), poly->mat);
-      const triangle tri1(vec3i(poly->v[0], poly->v[2], poly->v[3]), poly->mat);
-      tris.add(tri0);
-      tris.add(tri1);
+  int currmaterial = -1, base[3] = {0,0,0};
+  if (ok) loopv(chunks) {
+    const auto &c = chunks[i];
+    int usemtlidx = 0;
+    loopvj(c.faces) {
+      for (; usemtlidx < c.mtls.length() && c.mtls[usemtlidx].face == u32(j); ++usemtlidx)
+        currmaterial = loader.findmaterial(c.mtls[usemtlidx].mat);
+      const auto &f = c.faces[j];
+      int v[MAX_VERT_NUM];
+      loopk(int(f.num)) {
+        int idx[3];
+        loopl(3) {
+          const auto relative = (f.relative >> (3*k+l)) & 1;
+          idx[l] = f.idx[k][l] + (relative ? base[l] : 0);
+        }
+        const vertexkey key(idx[0], idx[1], idx[2]);
+        const auto it = map.insert(makepair(key, keys.length()));
+        if (it.second) keys.add(key);
+        v[k] = it.first->second;
+      }
+      for (int k = 2; k < int(f.num); ++k)
+        tris.add(triangle(vec3i(v[0], v[k-1], v[k]), currmaterial));
     }
+    for (; usemtlidx < c.mtls.length(); ++usemtlidx)
+      currmaterial = loader.findmaterial(c.mtls[usemtlidx].mat);
+    base[0] += c.pos.length();
+    base[1] += c.tex.length();
+    base[2] += c.nor.length();
   }
+  const auto posnum = base[0], texnum = base[1], nornum = base[2];
+
+  // gather the attributes of the merged vertices
+  vector<vertex> verts(keys.length());
+  bool allposset = true, allnorset = true, alltexset = true;
+  if (ok) {
+    vector<vec3f> pos, nor;
+    vector<vec2f> tex;
+    pos.reserve(posnum);
+    nor.reserve(nornum);
+    tex.reserve(texnum);
+    loopv(chunks) {
+      const auto &c = chunks[i];
+      loopvj(c.pos) pos.add(c.pos[j]);
+      loopvj(c.nor) nor.add(c.nor[j]);
+      loopvj(c.tex) tex.add(c.tex[j]);
+    }
+    loopv(keys) {
+      const auto &src = keys[i];
+      auto &v = verts[i];
+      if (src.p >= 0 && src.p < posnum)
+        v.p = pos[src.p];
+      else {
+        v.p = zero;
+        allposset = false;
+      }
+      if (src.n >= 0 && src.n < nornum)
+        v.n = nor[src.n];
+      else {
+        v.n = zero;
+        allnorset = false;
+      }
+      if (src.t >= 0 && src.t < texnum)
+        v.t = tex[src.t];
+      else {
+        v.t = zero;
+        alltexset = false;
+      }
+    }
+  }
+  chunks.destroy();
+  sys::unmapfile((void*) data, size);
+  if (!ok) return false;
+
+  // No face defined
+  if (tris.length() == 0) return true;
 
   // sort triangle by material and create the material groups
   quicksort(tris.begin(), tris.end(), cmp);
@@ -336,9 +483,7 @@ bool obj::load(const char *filename) {
 
   // we replace the undefined material by the default one if needed
   if (tris[0].m == -1) {
-    auto mat = loader.allocmat();
-    mat->setdefault();
-    loader.materiallist.add(mat);
+    setdefault(loader.materiallist.add());
     const auto matindex = loader.materiallist.length() - 1;
     loopv(tris)
       if (tris[i].m != -1)
@@ -349,66 +494,14 @@ bool obj::load(const char *filename) {
     matgrp[0].m = matindex;
   }
 
-  // create all the vertices and store them
-  vector<vertex> verts(map.size());
-  bool allposset = true, allnorset = true, alltexset = true;
-  for (auto it = map.begin(); it != map.end(); ++it) {
-    const auto src = it->first;
-    const auto dst = it->second;
-    vertex &v = verts[dst];
-
-    // get the position if specified
-    if (src.p != -1)
-      v.p = vec3f(*loader.vertexlist[src.p]);
-    else {
-      v.p = zero;
-      allposset = false;
-    }
-
-    // get the normal if specified
-    if (src.n != -1)
-      v.n = vec3f(*loader.normallist[src.n]);
-    else {
-      v.n = zero;
-      allnorset = false;
-    }
-
-    // get the texture coordinates if specified
-    if (src.t != -1) {
-      const auto t = loader.texturelist[src.t];
-      v.t[0] = float((*t)[0]);
-      v.t[1] = float((*t)[1]);
-    } else {
-      v.t = zero;
-      alltexset = false;
-    }
-  }
-
   if (!allposset) printf("obj: some positions are unspecified for %s\n", filename);
   if (!allnorset) printf("obj: some normals are unspecified for %s\n", filename);
   if (!alltexset) printf("obj: some texture coordinates are unspecified for %s\n", filename);
 
+  // the strings now belong to the obj
   auto matarray = NEWAE(material, loader.materiallist.length());
-  memset(matarray, 0, sizeof(material) * loader.materiallist.length());
-
-#define COPY_FIELD(NAME)\
-if (from.NAME) {\
-  const size_t len = strlen(from.NAME);\
-  to.NAME = NEWAE(char, len + 1);\
-  if (len) memcpy(to.NAME, from.NAME, len);\
-  to.NAME[len] = 0;\
-}
-  loopv(loader.materiallist) {
-    const auto &from = *loader.materiallist[i];
-    assert(loader.materiallist[i] != NULL);
-    auto &to = matarray[i];
-    COPY_FIELD(name);
-    COPY_FIELD(mapka);
-    COPY_FIELD(mapkd);
-    COPY_FIELD(mapd);
-    COPY_FIELD(mapbump);
-  }
-#undef COPY_FIELD
+  memcpy(matarray, loader.materiallist.getbuf(),
+         sizeof(material) * loader.materiallist.length());
 
   // now return the properly allocated obj
   memset(this, 0, sizeof(obj));
@@ -416,6 +509,7 @@ if (from.NAME) {\
   vertnum = verts.length();
   grpnum = matgrp.length();
   matnum = loader.materiallist.length();
+  loader.materiallist.setsize(0);
   if (trinum) {
     tri = NEWAE(triangle, trinum);
     memcpy(tri, &tris[0], sizeof(triangle) * trinum);
@@ -441,13 +535,7 @@ obj::~obj(void) {
   SAFE_DELA(tri);
   SAFE_DELA(vert);
   SAFE_DELA(grp);
-  loopi(int(matnum)) {
-    SAFE_DELA(mat[i].name);
-    SAFE_DELA(mat[i].mapka);
-    SAFE_DELA(mat[i].mapkd);
-    SAFE_DELA(mat[i].mapd);
-    SAFE_DELA(mat[i].mapbump);
-  }
+  loopi(int(matnum)) freestrings(mat[i]);
   SAFE_DELA(mat);
 }
 void finish() {}
@@ -10,7 +10,11 @@
 #include "base/script.hpp"
 #include "base/console.hpp"
 #include "base/set.hpp"
+#include "base/flat_map.hpp"
+#include "base/hash.hpp"
 #include "base/sys.hpp"
+#include "base/task.hpp"
+#include "base/profiler.hpp"
 
 #include "GL/glext.h"
 #include <SDL2/SDL_image.h>
@@ -27,6 +31,14 @@ namespace ogl {
 #include "ogl.hxx"
 #undef OGLPROC
 #undef OGLPROC110
+PFNGLBUFFERSTORAGEPROC BufferStorage = NULL;
+PFNGLMULTIDRAWELEMENTSINDIRECTPROC MultiDrawElementsIndirect = NULL;
+PFNGLVERTEXATTRIBDIVISORPROC VertexAttribDivisor = NULL;
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC) (GLuint count);
+static PFNGLGETPROGRAMBINARYPROC GetProgramBinary = NULL;
+static PFNGLPROGRAMBINARYPROC ProgramBinary = NULL;
+static PFNGLPROGRAMPARAMETERIPROC ProgramParameteri = NULL;
+static PFNGLMAXSHADERCOMPILERTHREADSKHRPROC MaxShaderCompilerThreads = NULL;
 #endif /* __WEBGL__ */
 static void *getfunction(const char *name) {
   void *ptr = SDL_GL_GetProcAddress(name);
@@ -39,10 +51,14 @@ static void *getfunction(const char *name) {
 u32 glversion = 100, glslversion = 100;
 static bool mesa = false, intel = false, nvidia = false, amd = false;
 static u32 hwtexunits = 0, hwvtexunits = 0, hwtexsize = 0, hwcubetexsize = 0;
-bool hasTQ = false, hasTB = false;
+bool hasTQ = false, hasTB = false, hasBS = false, hasMDI = false, hasIA = false;
+bool hasTA = false;
+bool hasPB = false, hasPSC = false;
+static u32 drivertag = 0;
 
 static PFNGLGETQUERYOBJECTI64VEXTPROC GetQueryObjecti64v = NULL;
 static PFNGLGETQUERYOBJECTUI64VEXTPROC GetQueryObjectui64v = NULL;
+static PFNGLQUERYCOUNTERPROC QueryCounter = NULL; // timestamps, NULL if none
 static PFNGLGETSTRINGIPROC GetStringi;
 static u32 vao = 0;
 
@@ -90,6 +106,9 @@ static void startgl() {
   const auto version = (const char *) ogl::GetString(GL_VERSION);
   con::out("ogl: renderer: %s (%s)", renderer, vendor);
   con::out("ogl: driver: %s", version);
+  drivertag = murmurhash2(vendor, int(strlen(vendor)));
+  drivertag = murmurhash2(renderer, int(strlen(renderer)), drivertag);
+  drivertag = murmurhash2(version, int(strlen(version)), drivertag);
 
   if (strstr(renderer, "Mesa") || strstr(version, "Mesa")) {
     mesa = true;
@@ -155,10 +174,50 @@ static void startgl() {
       GetQueryObjecti64v  = (PFNGLGETQUERYOBJECTI64VEXTPROC)  getfunction("glGetQueryObjecti64v");
       GetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VEXTPROC) getfunction("glGetQueryObjectui64v");
     }
+    if (glversion >= 330 || ext.has("GL_ARB_timer_query"))
+      QueryCounter = (PFNGLQUERYCOUNTERPROC) getfunction("glQueryCounter");
     hasTQ = true;
   }
   if (glversion >= 310 || ext.has("GL_ARB_texture_buffer_object"))
     hasTB = true;
+  if (glversion >= 300 || ext.has("GL_EXT_texture_array"))
+    hasTA = true;
+  if (glversion >= 440 || ext.has("GL_ARB_buffer_storage")) {
+    BufferStorage = (PFNGLBUFFERSTORAGEPROC) getfunction("glBufferStorage");
+    hasBS = true;
+  }
+  if (glversion >= 430 || ext.has("GL_ARB_multi_draw_indirect")) {
+    MultiDrawElementsIndirect = (PFNGLMULTIDRAWELEMENTSINDIRECTPROC) getfunction("glMultiDrawElementsIndirect");
+    hasMDI = true;
+  }
+  if (glversion >= 330) {
+    VertexAttribDivisor = (PFNGLVERTEXATTRIBDIVISORPROC) getfunction("glVertexAttribDivisor");
+    hasIA = true;
+  } else if (ext.has("GL_ARB_instanced_arrays")) {
+    VertexAttribDivisor = (PFNGLVERTEXATTRIBDIVISORPROC) getfunction("glVertexAttribDivisorARB");
+    hasIA = true;
+  }
+#if !defined(__WEBGL__)
+  if (glversion >= 410 || ext.has("GL_ARB_get_program_binary")) {
+    GLint formatnum = 0;
+    ogl::GetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatnum);
+    if (formatnum > 0) {
+      GetProgramBinary = (PFNGLGETPROGRAMBINARYPROC) getfunction("glGetProgramBinary");
+      ProgramBinary = (PFNGLPROGRAMBINARYPROC) getfunction("glProgramBinary");
+      ProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC) getfunction("glProgramParameteri");
+      hasPB = true;
+    }
+  }
+  if (ext.has("GL_KHR_parallel_shader_compile")) {
+    MaxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC) getfunction("glMaxShaderCompilerThreadsKHR");
+    hasPSC = true;
+  } else if (ext.has("GL_ARB_parallel_shader_compile")) {
+    MaxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC) getfunction("glMaxShaderCompilerThreadsARB");
+    hasPSC = true;
+  }
+  // let the driver pick the number of compiler threads
+  if (hasPSC) OGL(MaxShaderCompilerThreads, 0xffffffffu);
+#endif /* __WEBGL__ */
 
   // we need a vertex array for gl >= 3
   if (glversion >= 300) {
@@ -183,25 +242,144 @@ static const struct shadertype *bindedshader = NULL;
 
 static const u32 TEX_NUM = 8;
 static u32 bindedtexture[TEX_NUM];
+static u32 activetexture = 0;
+
+// gl calls issued by OGL and calls dropped by the state tracking
+u32 glcalls = 0;
+static u32 glskipped = 0, framecalls = 0, frameskipped = 0;
+
+// tracked capabilities. all of them are disabled by default in gl
+static const u32 glcaps[] = {
+  GL_DEPTH_TEST, GL_CULL_FACE, GL_BLEND, GL_SCISSOR_TEST, GL_STENCIL_TEST,
+  GL_POLYGON_OFFSET_FILL
+};
+static const u32 CAP_NUM = ARRAY_ELEM_NUM(glcaps);
+static bool enabledcap[CAP_NUM];
+
+static INLINE s32 capindex(u32 cap) {
+  loopi(s32(CAP_NUM)) if (glcaps[i] == cap) return i;
+  return -1;
+}
+void enable(u32 x) {
+  const auto idx = capindex(x);
+  if (idx >= 0) {
+    if (enabledcap[idx]) { ++glskipped; return; }
+    enabledcap[idx] = true;
+  }
+  OGL(Enable, x);
+}
+void disable(u32 x) {
+  const auto idx = capindex(x);
+  if (idx >= 0) {
+    if (!enabledcap[idx]) { ++glskipped; return; }
+    enabledcap[idx] = false;
+  }
+  OGL(Disable, x);
+}
+
+// initial values are the gl defaults
+static u32 cullfacemode = GL_BACK, depthfunction = GL_LESS;
+static u32 blendsrc = GL_ONE, blenddst = GL_ZERO;
+static bool depthwrite = true;
+
+void cullface(u32 mode) {
+  if (cullfacemode == mode) { ++glskipped; return; }
+  cullfacemode = mode;
+  OGL(CullFace, mode);
+}
+void depthfunc(u32 func) {
+  if (depthfunction == func) { ++glskipped; return; }
+  depthfunction = func;
+  OGL(DepthFunc, func);
+}
+void depthmask(bool write) {
+  if (depthwrite == write) { ++glskipped; return; }
+  depthwrite = write;
+  OGL(DepthMask, write ? GL_TRUE : GL_FALSE);
+}
+void blendfunc(u32 src, u32 dst) {
+  if (blendsrc == src && blenddst == dst) { ++glskipped; return; }
+  blendsrc = src;
+  blenddst = dst;
+  OGL(BlendFunc, src, dst);
+}
+
+// last values sent to every uniform of every program. programs are never
+// relinked in place so only their deletion drops their values
+static flat_map<u64,pair<u32,u32>> uniformslots; // offset and size in values
+static vector<char> uniformvalues;
+
+static bool uniformchanged(u32 loc, const void *data, u32 size) {
+  if (bindedshader == NULL || s32(loc) < 0) return true;
+  const auto key = (u64(bindedshader->program) << 32) | u64(loc);
+  const auto it = uniformslots.find(key);
+  if (it != uniformslots.end() && it->second.second == size) {
+    const auto dst = &uniformvalues[it->second.first];
+    if (memcmp(dst, data, size) == 0) {
+      ++glskipped;
+      return false;
+    }
+    memcpy(dst, data, size);
+    return true;
+  }
+  const auto offset = u32(uniformvalues.length());
+  loopi(s32(size)) uniformvalues.add(((const char*) data)[i]);
+  uniformslots[key] = makepair(offset, size);
+  return true;
+}
+
+static void dropuniforms(u32 program) {
+  vector<u64> keys;
+  for (auto it = uniformslots.begin(); it != uniformslots.end(); ++it)
+    if (u32(it->first >> 32) == program) keys.add(it->first);
+  loopv(keys) uniformslots.erase(keys[i]);
+}
+
+void uniform1i(u32 loc, s32 x) {
+  if (uniformchanged(loc, &x, sizeof(x))) OGL(Uniform1i, loc, x);
+}
+void uniform1f(u32 loc, float x) {
+  if (uniformchanged(loc, &x, sizeof(x))) OGL(Uniform1f, loc, x);
+}
+void uniform2f(u32 loc, float x, float y) {
+  const float v[] = {x, y};
+  if (uniformchanged(loc, v, sizeof(v))) OGL(Uniform2f, loc, x, y);
+}
+void uniform2fv(u32 loc, s32 n, const float *v) {
+  if (uniformchanged(loc, v, 2*n*sizeof(float))) OGL(Uniform2fv, loc, n, v);
+}
+void uniform3fv(u32 loc, s32 n, const float *v) {
+  if (uniformchanged(loc, v, 3*n*sizeof(float))) OGL(Uniform3fv, loc, n, v);
+}
+void uniform4fv(u32 loc, s32 n, const float *v) {
+  if (uniformchanged(loc, v, 4*n*sizeof(float))) OGL(Uniform4fv, loc, n, v);
+}
+void uniformmatrix4fv(u32 loc, s32 n, bool transpose, const float *v) {
+  if (uniformchanged(loc, v, 16*n*sizeof(float)))
+    OGL(UniformMatrix4fv, loc, n, transpose ? GL_TRUE : GL_FALSE, v);
+}
 
 void enableattribarray(u32 target) {
   if (!enabledattribarray[target]) {
     enabledattribarray[target] = 1;
     OGL(EnableVertexAttribArray, target);
-  }
+  } else
+    ++glskipped;
 }
 
 void disableattribarray(u32 target) {
   if (enabledattribarray[target]) {
     enabledattribarray[target] = 0;
     OGL(DisableVertexAttribArray, target);
-  }
+  } else
+    ++glskipped;
 }
 
 /*-------------------------------------------------------------------------
  - simple resource management
  -------------------------------------------------------------------------*/
 static s32 texturenum=0, buffernum=0, programnum=0, framebuffernum=0;
+static s32 vertexarraynum=0;
 
 void gentextures(s32 n, u32 *id) {
   texturenum += n;
@@ -210,6 +388,7 @@ void gentextures(s32 n, u32 *id) {
 void deletetextures(s32 n, u32 *id) {
   texturenum -= n;
   assert(texturenum >= 0);
+  loopi(n) loopj(s32(TEX_NUM)) if (bindedtexture[j] == id[i]) bindedtexture[j] = 0;
   OGL(DeleteTextures, n, id);
 }
 void genbuffers(s32 n, u32 *id) {
@@ -221,6 +400,11 @@ void deletebuffers(s32 n, u32 *id) {
   assert(buffernum >= 0);
   OGL(DeleteBuffers, n, id);
 }
+void deletevertexarrays(s32 n, u32 *id) {
+  vertexarraynum -= n;
+  assert(vertexarraynum >= 0);
+  OGL(DeleteVertexArrays, n, id);
+}
 void genframebuffers(s32 n, u32 *id) {
   framebuffernum += n;
   OGL(GenFramebuffers, n, id);
@@ -240,6 +424,7 @@ static u32 createprogram() {
 #endif // __WEBGL__
 }
 static void deleteprogram(u32 id) {
+  dropuniforms(id);
   programnum--;
   if (programnum < 0) sys::fatal("program already freed");
   OGL(DeleteProgram, id);
@@ -304,9 +489,15 @@ void popmatrix() {
  -------------------------------------------------------------------------*/
 static int glmaxtexsize = 256;
 void bindtexture(u32 target, u32 id, u32 texslot) {
-  if (bindedtexture[texslot] == id) return;
+  if (bindedtexture[texslot] == id) {
+    ++glskipped;
+    return;
+  }
   bindedtexture[texslot] = id;
-  OGL(ActiveTexture, GL_TEXTURE0 + texslot);
+  if (activetexture != texslot) {
+    activetexture = texslot;
+    OGL(ActiveTexture, GL_TEXTURE0 + texslot);
+  }
   OGL(BindTexture, target, id);
 }
 
@@ -332,6 +523,7 @@ u32 maketex(const char *fmt, ...) {
           case '1': target = GL_TEXTURE_1D; dimnum = 1; break;
           case '2': target = GL_TEXTURE_2D; dimnum = 2; break;
           case '3': target = GL_TEXTURE_3D; dimnum = 3; break;
+          case 'a': target = GL_TEXTURE_2D_ARRAY; dimnum = 3; break;
           case 'r': target = GL_TEXTURE_RECTANGLE; dimnum = 2; break;
         }
         ogl::bindtexture(target, id, 0);
@@ -345,7 +537,7 @@ u32 maketex(const char *fmt, ...) {
         else if (dimnum == 3)
           OGL(TexImage3D, target, 0, internalfmt, dim[0], dim[1], dim[2], 0, datafmt, type, data);
       break;
-      case 'G': OGL(GenerateMipmap, GL_TEXTURE_2D); break;
+      case 'G': OGL(GenerateMipmap, target); break;
       case 'T': PEEK { // type
         case 'b': type = GL_BYTE; break;
         case 'B': type = GL_UNSIGNED_BYTE; break;
@@ -361,7 +553,9 @@ u32 maketex(const char *fmt, ...) {
         case '4': datafmt = GL_RGBA; break;
         case 'r': datafmt = GL_RED; break;
         case 'a': datafmt = GL_ALPHA; break;
+        case 'g': datafmt = GL_RG; break;
         case 'd': datafmt = GL_DEPTH_COMPONENT; break;
+        case 'u': datafmt = GL_RED_INTEGER; break;
       }
       break;
       case 'I': PEEK { // internal data format
@@ -369,7 +563,12 @@ u32 maketex(const char *fmt, ...) {
         case '4': internalfmt = GL_RGBA; break;
         case 'r': internalfmt = GL_RED; break;
         case 'a': internalfmt = GL_ALPHA; break;
+        case 'g': internalfmt = GL_RG16; break;
         case 'd': internalfmt = GL_DEPTH_COMPONENT32; break;
+        case 'f': internalfmt = GL_R32F; break;
+        case 'F': internalfmt = GL_RGBA16F; break;
+        case 'h': internalfmt = GL_R16F; break;
+        case 'u': internalfmt = GL_R16UI; break;
       }
       break;
       case 'm': // minfilter
@@ -412,23 +611,66 @@ u32 maketex(const char *fmt, ...) {
   return id;
 }
 
-u32 installtex(const char *texname, bool clamp) {
-  auto s = IMG_Load(texname);
+static bool checksurface(SDL_Surface *s, const char *texname) {
   if (!s) {
     con::out("couldn't load texture %s", texname);
-    return 0;
+    return false;
   }
 #if !defined(__WEBGL__)
   else if (s->format->BitsPerPixel!=24) {
     con::out("texture must be 24bpp: %s (got %i bpp)", texname, s->format->BitsPerPixel);
-    return 0;
+    return false;
   }
 #endif // __WEBGL__
-
-  loopi(int(TEX_NUM)) bindedtexture[i] = 0;
   con::out("loading %s (%ix%i)", texname, s->w, s->h);
   if (s->w>glmaxtexsize || s->h>glmaxtexsize)
     sys::fatal("texture dimensions are too large");
+  return true;
+}
+
+// packed textures are already decoded: the surface points into the pack
+struct packedtexture { u32 w, h, bpp, rmask, gmask, bmask, amask, pad; };
+
+static SDL_Surface *loadsurface(const char *texname) {
+  pack::entry e;
+  if (!pack::find(texname, pack::TEXTURE, e) || e.size < sizeof(packedtexture))
+    return IMG_Load(texname);
+  const auto t = (const packedtexture*) e.data;
+  if (e.size != sizeof(packedtexture) + t->w*t->h*t->bpp) return IMG_Load(texname);
+  return SDL_CreateRGBSurfaceFrom((void*) (t+1), t->w, t->h, t->bpp*8, t->w*t->bpp,
+                                  t->rmask, t->gmask, t->bmask, t->amask);
+}
+
+bool packtexture(const char *texname, pack::writer &w) {
+  const auto s = IMG_Load(texname);
+  if (s == NULL) return false;
+  const auto bpp = u32(s->format->BytesPerPixel);
+  if (bpp != 3 && bpp != 4) {
+    SDL_FreeSurface(s);
+    return false;
+  }
+  const auto f = s->format;
+  const packedtexture t = {
+    u32(s->w), u32(s->h), bpp, f->Rmask, f->Gmask, f->Bmask, f->Amask, 0
+  };
+  const auto pitch = t.w*bpp;
+  vector<u8> data;
+  data.setsize(sizeof(t) + pitch*t.h, noinitialize);
+  memcpy(data.getbuf(), &t, sizeof(t));
+  loopi(s->h)
+    memcpy(data.getbuf()+sizeof(t)+i*pitch, (const u8*) s->pixels+i*s->pitch, pitch);
+  SDL_FreeSurface(s);
+  w.add(texname, pack::TEXTURE, data.getbuf(), u32(data.length()));
+  return true;
+}
+
+u32 installtex(const char *texname, bool clamp) {
+  auto s = loadsurface(texname);
+  if (!checksurface(s, texname)) {
+    if (s) SDL_FreeSurface(s);
+    return 0;
+  }
+  loopi(int(TEX_NUM)) bindedtexture[i] = 0;
   const auto ispowerof2 = ispoweroftwo(s->w) && ispoweroftwo(s->h);
   const auto minf = ispowerof2 ? 'M' : 'n';
   const auto mm = ispowerof2 ? 'G' : ' ';
@@ -439,6 +681,169 @@ u32 installtex(const char *texname, bool clamp) {
   return id;
 }
 
+// bilinear resampling of the surface into a tightly packed w*h image
+static INLINE u8 texel(const SDL_Surface *s, int x, int y, int c) {
+  return ((const u8*) s->pixels)[y*s->pitch + x*s->format->BytesPerPixel + c];
+}
+static void resample(const SDL_Surface *s, u8 *dst, int w, int h) {
+  const auto bpp = int(s->format->BytesPerPixel);
+  const auto sx = float(s->w)/float(w), sy = float(s->h)/float(h);
+  loopi(h) loopj(w) {
+    const auto fx = max((float(j)+0.5f)*sx-0.5f, 0.f);
+    const auto fy = max((float(i)+0.5f)*sy-0.5f, 0.f);
+    const auto x0 = min(int(fx), s->w-1), y0 = min(int(fy), s->h-1);
+    const auto x1 = min(x0+1, s->w-1), y1 = min(y0+1, s->h-1);
+    const auto tx = fx-float(x0), ty = fy-float(y0);
+    loopk(bpp) {
+      const auto t00 = float(texel(s,x0,y0,k)), t10 = float(texel(s,x1,y0,k));
+      const auto t01 = float(texel(s,x0,y1,k)), t11 = float(texel(s,x1,y1,k));
+      const auto top = t00+(t10-t00)*tx, bottom = t01+(t11-t01)*tx;
+      dst[(i*w+j)*bpp+k] = u8(top+(bottom-top)*ty+0.5f);
+    }
+  }
+}
+
+u32 installtexarray(const char **texnames, u32 n, bool clamp) {
+  if (!hasTA || n == 0) return 0;
+  vector<SDL_Surface*> surfaces;
+  auto w = 0, h = 0, bpp = 0;
+  auto ok = true;
+  loopi(s32(n)) {
+    const auto s = loadsurface(texnames[i]);
+    if (!checksurface(s, texnames[i])) {
+      if (s) SDL_FreeSurface(s);
+      ok = false;
+      break;
+    }
+    surfaces.add(s);
+    if (bpp != 0 && bpp != s->format->BytesPerPixel) {
+      con::out("texture array: %s has another format than %s", texnames[i], texnames[0]);
+      ok = false;
+      break;
+    }
+    bpp = s->format->BytesPerPixel;
+    w = max(w, s->w);
+    h = max(h, s->h);
+  }
+  u32 id = 0;
+  if (ok) {
+    const auto ispowerof2 = ispoweroftwo(w) && ispoweroftwo(h);
+    const auto minf = ispowerof2 ? 'M' : 'n';
+    const auto fmt = bpp == 3 ? '3' : '4';
+    const auto wrap = clamp ? 'e' : 'r';
+    id = maketex("TB I% D% Ba % Ws% Wt% Ml m%",fmt,fmt,(void*) NULL,w,h,n,wrap,wrap,minf);
+    vector<u8> pixels;
+    pixels.setsize(w*h*bpp, noinitialize);
+    bindtexture(GL_TEXTURE_2D_ARRAY, id, 0);
+    OGL(PixelStorei, GL_UNPACK_ALIGNMENT, 1);
+    loopv(surfaces) {
+      const auto s = surfaces[i];
+      const void *data = s->pixels;
+      if (s->w != w || s->h != h || s->pitch != w*bpp) {
+        resample(s, pixels.getbuf(), w, h);
+        data = pixels.getbuf();
+      }
+      const auto datafmt = bpp == 3 ? GL_RGB : GL_RGBA;
+      OGL(TexSubImage3D, GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, w, h, 1, datafmt, GL_UNSIGNED_BYTE, data);
+    }
+    if (ispowerof2) OGL(GenerateMipmap, GL_TEXTURE_2D_ARRAY);
+    bindtexture(GL_TEXTURE_2D_ARRAY, 0, 0);
+  }
+  loopv(surfaces) SDL_FreeSurface(surfaces[i]);
+  return id;
+}
+
+/*-------------------------------------------------------------------------
+ - asynchronous texture loading. a task reads and decodes the image while
+ - the texture shows the checkboard. the render thread then uploads the
+ - decoded images through a pixel buffer, not more than texuploadbudget ms
+ - per frame
+ -------------------------------------------------------------------------*/
+VARP(texuploadbudget, 0, 2, 100);
+
+struct textureload : public task {
+  INLINE textureload(const char *name, u32 id, bool clamp) :
+    task("textureload", 1, 1), name(name), id(id), clamp(clamp),
+    surface(NULL), done(0) {}
+  virtual void run(u32) {
+    surface = loadsurface(name.c_str());
+    storerelease(&done, 1);
+  }
+  fixedstring name;
+  u32 id;
+  bool clamp;
+  SDL_Surface *surface;
+  volatile s32 done;
+};
+static vector<ref<textureload>> textureloads;
+static u32 texturepbo = 0u;
+
+static u32 buildcheckboard();
+u32 installtexasync(const char *texname, bool clamp) {
+  const auto id = buildcheckboard();
+  ref<textureload> job = NEWTASK(textureload, texname, id, clamp);
+  job->scheduled();
+  textureloads.add(job);
+  return id;
+}
+
+static void uploadtex(const textureload &job) {
+  const auto s = job.surface;
+  if (!checksurface(s, job.name.c_str())) return;
+  if (texturepbo == 0u) genbuffers(1, &texturepbo);
+  const auto bpp = s->format->BytesPerPixel;
+  const auto pitch = s->w*bpp, size = pitch*s->h;
+  const auto fmt = bpp == 3 ? GL_RGB : GL_RGBA;
+  void *mapped;
+  bindbuffer(PIXEL_UNPACK_BUFFER, texturepbo);
+  OGL(BufferData, GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+  OGLR(mapped, MapBufferRange, GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT);
+  loopi(s->h) memcpy((u8*) mapped + i*pitch, (const u8*) s->pixels + i*s->pitch, pitch);
+  OGL(UnmapBuffer, GL_PIXEL_UNPACK_BUFFER);
+  bindtexture(GL_TEXTURE_2D, job.id, 0);
+  OGL(PixelStorei, GL_UNPACK_ALIGNMENT, 1);
+  OGL(TexImage2D, GL_TEXTURE_2D, 0, fmt, s->w, s->h, 0, fmt, GL_UNSIGNED_BYTE, NULL);
+  bindbuffer(PIXEL_UNPACK_BUFFER, 0);
+  const auto ispowerof2 = ispoweroftwo(s->w) && ispoweroftwo(s->h);
+  const auto wrap = job.clamp ? GL_CLAMP_TO_EDGE : GL_REPEAT;
+  if (ispowerof2) OGL(GenerateMipmap, GL_TEXTURE_2D);
+  OGL(TexParameteri, GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+  OGL(TexParameteri, GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
+  OGL(TexParameteri, GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  OGL(TexParameteri, GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, ispowerof2 ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST);
+  bindtexture(GL_TEXTURE_2D, 0, 0);
+}
+
+// at least one texture is uploaded per frame such that we always progress
+static void uploadtextures() {
+  const auto start = sys::millis();
+  for (int i = 0; i < textureloads.length();) {
+    auto &job = *textureloads[i];
+    if (!loadacquire(&job.done)) {
+      ++i;
+      continue;
+    }
+    job.wait();
+    uploadtex(job);
+    if (job.surface) SDL_FreeSurface(job.surface);
+    textureloads[i] = textureloads.last();
+    textureloads.setsize(textureloads.length()-1);
+    if (sys::millis()-start >= float(texuploadbudget)) break;
+  }
+}
+
+#if !defined(RELEASE)
+static void cleantextureloads() {
+  loopv(textureloads) {
+    textureloads[i]->wait();
+    if (textureloads[i]->surface) SDL_FreeSurface(textureloads[i]->surface);
+  }
+  textureloads.destroy();
+  if (texturepbo) deletebuffers(1, &texturepbo);
+  texturepbo = 0u;
+}
+#endif
+
 /*-------------------------------------------------------------------------
  - immediate mode and buffer support
  -------------------------------------------------------------------------*/
@@ -446,42 +851,113 @@ static const u32 glbufferbinding[BUFFER_NUM] = {
   GL_ARRAY_BUFFER,
   GL_ELEMENT_ARRAY_BUFFER,
   GL_TEXTURE_BUFFER,
-  GL_PIXEL_UNPACK_BUFFER
+  GL_PIXEL_UNPACK_BUFFER,
+  GL_PIXEL_PACK_BUFFER,
+  GL_DRAW_INDIRECT_BUFFER
 };
 void bindbuffer(u32 target, u32 buffer) {
   if (bindedbuffer[target] != buffer) {
     OGL(BindBuffer, glbufferbinding[target], buffer);
     bindedbuffer[target] = buffer;
+  } else
+    ++glskipped;
+}
+
+static u32 bindedvertexarray = 0;
+void bindvertexarray(u32 id) {
+  if (bindedvertexarray == id) return;
+  OGL(BindVertexArray, id ? id : vao);
+  bindedvertexarray = id;
+}
+
+// the index buffer and the enabled attributes belong to the vertex array so
+// they are set directly and not tracked
+u32 makevertexarray(const vertexattrib *attribs, u32 n, u32 stride,
+                    u32 vbo, u32 ibo, u32 offset) {
+  u32 id;
+  OGL(GenVertexArrays, 1, &id);
+  ++vertexarraynum;
+  OGL(BindVertexArray, id);
+  bindbuffer(ARRAY_BUFFER, vbo);
+  if (ibo) OGL(BindBuffer, GL_ELEMENT_ARRAY_BUFFER, ibo);
+  loopi(s32(n)) {
+    const auto &a = attribs[i];
+    const auto ptr = (const void*) intptr_t(offset+a.offset);
+    OGL(EnableVertexAttribArray, a.attrib);
+    OGL(VertexAttribPointer, a.attrib, a.n, a.type, a.normalized, stride, ptr);
   }
+  bindbuffer(ARRAY_BUFFER, 0);
+  OGL(BindVertexArray, bindedvertexarray ? bindedvertexarray : vao);
+  return id;
 }
 
 // attributes in the vertex buffer
 static struct {int n, type, offset;} immattribs[ATTRIB_NUM];
 static int immvertexsz = 0;
 
-// we use two big circular buffers to handle immediate mode
-static int immbuffersize = 16*1024*1024;
+// we use two big buffers to handle immediate mode. each one is split in one
+// region per frame in flight and a region is written again once the fence
+// of its last frame is signaled. with buffer storage, they stay persistently
+// mapped. otherwise, data go through BufferSubData
+static const int IMMFRAMENUM = 3;
+static const int immbuffersize = 16*1024*1024;
+static const int immregionsize = (immbuffersize/IMMFRAMENUM) & ~255;
 static int bigvbooffset=0, bigibooffset=0;
 static int drawibooffset=0, drawvbooffset=0;
 static u32 bigvbo=0u, bigibo=0u;
-
-static void initbuffer(u32 &bo, int target, int size) {
+static char *bigvboptr=NULL, *bigiboptr=NULL;
+static GLsync immfence[IMMFRAMENUM];
+static int immframe = 0;
+static bool immpersistent = false;
+
+static void initbuffer(u32 &bo, char *&ptr, int target, int size) {
+  const auto gltarget = glbufferbinding[target];
+  const GLbitfield flags = GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
   if (bo == 0u) genbuffers(1, &bo);
   bindbuffer(target, bo);
-  OGL(BufferData, glbufferbinding[target], size, NULL, GL_DYNAMIC_DRAW);
+  if (immpersistent) {
+    OGL(BufferStorage, gltarget, size, NULL, flags);
+    void *mapped;
+    OGLR(mapped, MapBufferRange, gltarget, 0, size, flags);
+    assert(mapped != NULL);
+    ptr = (char*) mapped;
+  } else
+    OGL(BufferData, gltarget, size, NULL, GL_DYNAMIC_DRAW);
   bindbuffer(target, 0);
 }
 
 static void imminit() {
-  initbuffer(bigvbo, ARRAY_BUFFER, immbuffersize);
-  initbuffer(bigibo, ELEMENT_ARRAY_BUFFER, immbuffersize);
+  immpersistent = hasBS;
+  initbuffer(bigvbo, bigvboptr, ARRAY_BUFFER, immbuffersize);
+  initbuffer(bigibo, bigiboptr, ELEMENT_ARRAY_BUFFER, immbuffersize);
   memset(immattribs, 0, sizeof(immattribs));
+  loopi(IMMFRAMENUM) immfence[i] = NULL;
+}
+
+// wait for the gpu to release the region of the frame
+static void immbeginframe() {
+  auto &fence = immfence[immframe];
+  if (fence == NULL) return;
+  GLenum res;
+  do OGLR(res, ClientWaitSync, fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+  while (res == GL_TIMEOUT_EXPIRED);
+  OGL(DeleteSync, fence);
+  fence = NULL;
+}
+
+static void immendframe() {
+  if (immpersistent) OGLR(immfence[immframe], FenceSync, GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  immframe = (immframe+1) % IMMFRAMENUM;
+  bigvbooffset = bigibooffset = 0;
 }
 
 #if !defined(RELEASE)
+// deleting the buffers also unmaps them
 static void immdestroy() {
+  loopi(IMMFRAMENUM) if (immfence[i]) OGL(DeleteSync, immfence[i]);
   if (bigibo) ogl::deletebuffers(1, &bigibo);
   if (bigvbo) ogl::deletebuffers(1, &bigvbo);
+  bigvboptr = bigiboptr = NULL;
 }
 #endif
 
@@ -502,23 +978,32 @@ static void immsetallattribs() {
 }
 
 static bool immsetdata(int target, int sz, const void *data) {
-  if (sz >= immbuffersize) {
+  if (sz > immregionsize) {
     con::out("too many immediate items to render");
     return false;
   }
   u32 &bo = target==ARRAY_BUFFER ? bigvbo : bigibo;
+  char *ptr = target==ARRAY_BUFFER ? bigvboptr : bigiboptr;
   int &offset = target==ARRAY_BUFFER ? bigvbooffset : bigibooffset;
   int &drawoffset = target==ARRAY_BUFFER ? drawvbooffset : drawibooffset;
-  if (offset+sz > immbuffersize) {
-    OGL(Flush);
-    bindbuffer(target, 0);
-    offset = 0u;
-    bindbuffer(target, bo);
-  }
   bindbuffer(target, bo);
-  OGL(BufferSubData, glbufferbinding[target], offset, sz, data);
-  drawoffset = offset;
-  offset += sz;
+
+  // the frame filled its region. a mapped region can only be reused when the
+  // gpu has consumed it while unmapped ones are simply orphaned
+  if (offset+sz > immregionsize) {
+    if (immpersistent)
+      OGL(Finish);
+    else
+      OGL(BufferData, glbufferbinding[target], immbuffersize, NULL, GL_DYNAMIC_DRAW);
+    offset = 0;
+  }
+  const auto base = immframe*immregionsize + offset;
+  if (immpersistent)
+    memcpy(ptr+base, data, sz);
+  else
+    OGL(BufferSubData, glbufferbinding[target], base, sz, data);
+  drawoffset = base;
+  offset = ALIGN(offset+sz, 16);
   return true;
 }
 
@@ -531,25 +1016,16 @@ void immdrawarrays(int mode, int first, int count) {
   drawarrays(mode,first,count);
 }
 
-void immdrawelements(int mode, int count, int type, const void *indices, const void *vertices) {
+void immdrawelements(int mode, int count, int type, const void *indices,
+                     const void *vertices, int vertnum) {
   int indexsz = count;
-  int maxindex = 0;
   switch (type) {
-    case GL_UNSIGNED_INT:
-      indexsz*=sizeof(u32);
-      loopi(count) maxindex = max(maxindex,int(((u32*)indices)[i]));
-    break;
-    case GL_UNSIGNED_SHORT:
-      indexsz*=sizeof(u16);
-      loopi(count) maxindex = max(maxindex,int(((u16*)indices)[i]));
-    break;
-    case GL_UNSIGNED_BYTE:
-      indexsz*=sizeof(u8);
-      loopi(count) maxindex = max(maxindex,int(((u8*)indices)[i]));
-    break;
+    case GL_UNSIGNED_INT: indexsz*=sizeof(u32); break;
+    case GL_UNSIGNED_SHORT: indexsz*=sizeof(u16); break;
+    case GL_UNSIGNED_BYTE: indexsz*=sizeof(u8); break;
   };
   if (!immsetdata(ELEMENT_ARRAY_BUFFER, indexsz, indices)) return;
-  if (!immvertices((maxindex+1)*immvertexsz, vertices)) return;
+  if (!immvertices(vertnum*immvertexsz, vertices)) return;
   immsetallattribs();
   if (bindedshader->fixedfunction) fixedflush();
   const void *fake = (const void *) intptr_t(drawibooffset);
@@ -586,10 +1062,11 @@ static vec3i parseformat(const char *fmt) {
   return vec3i(offset, mode, type);
 }
 
-void immdrawelememts(const char *fmt, int count, const void *indices, const void *vertices) {
+void immdrawelememts(const char *fmt, int count, const void *indices,
+                     const void *vertices, int vertnum) {
   const auto parsed = parseformat(fmt);
   immvertexsize(parsed.x);
-  immdrawelements(parsed.y, count, parsed.z, indices, vertices);
+  immdrawelements(parsed.y, count, parsed.z, indices, vertices, vertnum);
 }
 
 void immdraw(const char *fmt, int count, const void *data) {
@@ -601,89 +1078,137 @@ void immdraw(const char *fmt, int count, const void *data) {
 }
 
 /*-------------------------------------------------------------------------
- - GPU timer (taken from Tesseract)
+ - GPU timer (taken from Tesseract). with timestamp queries, gpu timers use
+ - one query at each end and nest freely. elapsed time queries cannot nest.
+ - results are read once available and never waited for. a timer whose
+ - query is still pending skips the frame. cpu timers are profiler zones too
  -------------------------------------------------------------------------*/
 struct timer {
-  enum { MAXQUERY = 4 };
-  const char *name;
+  enum { MAXQUERY = 4, HISTORYNUM = 64 };
+  istring name;
   bool gpu;
-  u32 query[MAXQUERY];
+  u32 query[2*MAXQUERY];
   int waiting;
-  float starttime;
+  u64 starttime;
   float result, print;
+  float history[HISTORYNUM]; // last results for min, average and max
+  u32 historynum;
 };
 static vector<timer> timers;
 static vector<int> timerorder;
+static vector<int> timerindex; // per interned name id, cpu then gpu. -1 if none
 static int timercycle = 0;
 
 extern int gputimers;
 static int deferquery=0;
-
-static timer *findtimer(const char *name, bool gpu) {
-  loopv(timers) if (!strcmp(timers[i].name, name) && timers[i].gpu == gpu) {
-    timerorder.removeobj(i);
-    timerorder.add(i);
-    return &timers[i];
+static bool measuring = false;
+static timercallback callback = NULL;
+
+static timer *findtimer(const istring &name, bool gpu) {
+  const auto slot = 2*int(name.id()) + (gpu ? 1 : 0);
+  while (timerindex.length() <= slot) timerindex.add(-1);
+  const auto idx = timerindex[slot];
+  if (idx != -1) {
+    timerorder.removeobj(idx);
+    timerorder.add(idx);
+    return &timers[idx];
   }
+  timerindex[slot] = timers.length();
   timerorder.add(timers.length());
   auto &t = timers.add();
   t.name = name;
   t.gpu = gpu;
   memset(t.query, 0, sizeof(t.query));
-  if (gpu) OGL(GenQueries, timer::MAXQUERY, t.query);
+  if (gpu) OGL(GenQueries, 2*timer::MAXQUERY, t.query);
   t.waiting = 0;
-  t.starttime = 0.f;
+  t.starttime = 0;
   t.result = -1;
   t.print = -1;
+  t.historynum = 0;
   return &t;
 }
 
-timer *begintimer(const char *name, bool gpu) {
-  if (!gputimers || (gpu && (!hasTQ || deferquery)))
+static void setresult(timer &t, float ms) {
+  t.result = ms;
+  t.history[t.historynum++ % timer::HISTORYNUM] = ms;
+  if (callback) callback(t.name.c_str(), t.gpu, ms);
+}
+
+timer *begintimer(const istring &name, bool gpu) {
+  if (!gpu && profiler::zoneson()) profiler::zonebegin(name.c_str());
+  if ((!gputimers && !measuring && !callback && !profiler::zoneson()) ||
+      (gpu && (!hasTQ || (deferquery && QueryCounter == NULL))))
     return NULL;
   const auto t = findtimer(name, gpu);
   if (t->gpu) {
+    if (t->waiting & (1<<timercycle)) return NULL;
     deferquery++;
-    OGL(BeginQuery, GL_TIME_ELAPSED_EXT, t->query[timercycle]);
+    if (QueryCounter)
+      OGL(QueryCounter, t->query[2*timercycle], GL_TIMESTAMP);
+    else
+      OGL(BeginQuery, GL_TIME_ELAPSED_EXT, t->query[2*timercycle]);
     t->waiting |= 1<<timercycle;
   } else
-    t->starttime = sys::millis();
+    t->starttime = sys::nanos();
   return t;
 }
 
 void endtimer(timer *t) {
   if (!t) return;
   if (t->gpu) {
-    OGL(EndQuery, GL_TIME_ELAPSED_EXT);
+    if (QueryCounter)
+      OGL(QueryCounter, t->query[2*timercycle+1], GL_TIMESTAMP);
+    else
+      OGL(EndQuery, GL_TIME_ELAPSED_EXT);
     deferquery--;
-  } else
-    t->result = max(sys::millis() - t->starttime, 0.0f);
+  } else {
+    setresult(*t, float(double(sys::nanos()-t->starttime)*1e-6));
+    profiler::zoneend(t->name.c_str());
+  }
 }
 
+// the oldest queries are read first such that the newest result wins
 static void synctimers() {
   timercycle = (timercycle + 1) % timer::MAXQUERY;
   loopv(timers) {
     auto &t = timers[i];
-    if (t.waiting&(1<<timercycle)) {
+    loopj(timer::MAXQUERY) {
+      const auto slot = (timercycle + j) % timer::MAXQUERY;
+      if ((t.waiting & (1<<slot)) == 0) continue;
+      const auto last = QueryCounter ? 2*slot+1 : 2*slot;
       GLint available = 0;
-      while (!available)
-        OGL(GetQueryObjectiv, t.query[timercycle], GL_QUERY_RESULT_AVAILABLE, &available);
-      GLuint64EXT result = 0;
-      OGL(GetQueryObjectui64v, t.query[timercycle], GL_QUERY_RESULT, &result);
-      t.result = max(float(result) * 1e-6f, 0.0f);
-      t.waiting &= ~(1<<timercycle);
-    } else
-      t.result = -1;
+      OGL(GetQueryObjectiv, t.query[last], GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available) continue;
+      GLuint64EXT result = 0, start = 0;
+      OGL(GetQueryObjectui64v, t.query[last], GL_QUERY_RESULT, &result);
+      if (QueryCounter) {
+        OGL(GetQueryObjectui64v, t.query[2*slot], GL_QUERY_RESULT, &start);
+        result = result > start ? result-start : 0;
+      }
+      setresult(t, float(double(result) * 1e-6));
+      t.waiting &= ~(1<<slot);
+    }
   }
 }
 
+float gpumillis() {
+  auto ms = -1.f;
+  loopv(timers) if (timers[i].gpu && timers[i].result >= 0.f)
+    ms = max(ms, 0.f) + timers[i].result;
+  return ms;
+}
+
+void measuregpu(bool enable) { measuring = enable; }
+void settimercallback(timercallback cb) { callback = cb; }
+
 static void cleanuptimers() {
   loopv(timers) {
     timer &t = timers[i];
-    if (t.gpu) OGL(DeleteQueries, timer::MAXQUERY, t.query);
+    if (t.gpu) OGL(DeleteQueries, 2*timer::MAXQUERY, t.query);
   }
   timers.destroy();
   timerorder.destroy();
+  timerindex.destroy();
 }
 
 VARF(gputimers, 0, 0, 1, cleanuptimers());
@@ -703,27 +1228,46 @@ void printtimers(float conw, float conh) {
     const vec2f tp(conw-20.f*dim.y, conh-dim.y*3.f/2.f-float(offset)*9.f*dim.y/8.f);
     text::drawf("frame time %5.2 ms", tp, printmillis);
     offset++;
+    const vec2f cp(conw-20.f*dim.y, conh-dim.y*3.f/2.f-float(offset)*9.f*dim.y/8.f);
+    text::drawf("gl calls %d (%d dropped)", cp, int(framecalls), int(frameskipped));
+    offset++;
   }
   if (gputimers) loopv(timerorder) {
     auto &t = timers[timerorder[i]];
     if (t.print < 0.f ? t.result >= 0.f : totalmillis - lastprint >= 200.f)
       t.print = t.result;
-    if (t.print < 0 || (t.gpu && !(t.waiting&(1<<timercycle))))
-      continue;
+    if (t.print < 0) continue;
+    const auto n = min(t.historynum, u32(timer::HISTORYNUM));
+    auto minms = FLT_MAX, maxms = 0.f, sum = 0.f;
+    loopj(s32(n)) {
+      minms = min(minms, t.history[j]);
+      maxms = max(maxms, t.history[j]);
+      sum += t.history[j];
+    }
     const vec2f tp(conw, conh-(offset+1)*9.f*dim.y/8.f);
-    text::drawf("%s%s %5.2f ms", tp, t.name, t.gpu ? "" : " (cpu)", t.print);
+    text::drawf("%s%s %5.2f ms (min %5.2f avg %5.2f max %5.2f)", tp,
+                t.name.c_str(), t.gpu ? "" : " (cpu)", t.print,
+                minms, sum/float(max(n,1u)), maxms);
     ++offset;
   }
   if (totalmillis - lastprint >= 200.f)
     lastprint = totalmillis;
 }
 
+static void pollpending();
 void beginframe() {
+  framecalls = glcalls;
+  frameskipped = glskipped;
+  glcalls = glskipped = 0;
+  pollpending();
+  uploadtextures();
+  immbeginframe();
   synctimers();
   totalmillis = sys::millis();
 }
 
 void endframe() {
+  immendframe();
   if (frametimer) {
     OGL(Finish);
     framemillis = sys::millis() - totalmillis;
@@ -733,23 +1277,43 @@ void endframe() {
 /*-------------------------------------------------------------------------
  - shader management
  -------------------------------------------------------------------------*/
-static bool checkshader(const vector<const char*> &sources, u32 shadernumame) {
-  GLint result = GL_FALSE;
-  int infologlength;
+// asking for the compile status waits for the compiler threads so we only
+// look at the shaders once the link of their program failed
+static void checkshader(u32 name) {
+  GLint result = GL_FALSE, infologlength = 0, sourcelength = 0;
+  OGL(GetShaderiv, name, GL_COMPILE_STATUS, &result);
+  OGL(GetShaderiv, name, GL_INFO_LOG_LENGTH, &infologlength);
+  if (infologlength > 1) {
+    auto buffer = (char*) MALLOC(infologlength+1);
+    buffer[infologlength] = 0;
+    OGL(GetShaderInfoLog, name, infologlength, NULL, buffer);
+    con::out("%s", buffer);
+    FREE(buffer);
+  }
+  if (result == GL_TRUE) return;
+  OGL(GetShaderiv, name, GL_SHADER_SOURCE_LENGTH, &sourcelength);
+  if (sourcelength > 1) {
+    auto source = (char*) MALLOC(sourcelength+1);
+    source[sourcelength] = 0;
+    OGL(GetShaderSource, name, sourcelength, NULL, source);
+    printf("in\n%s", source);
+    FREE(source);
+  }
+}
 
-  if (!shadernumame) return false;
-  OGL(GetShaderiv, shadernumame, GL_COMPILE_STATUS, &result);
-  OGL(GetShaderiv, shadernumame, GL_INFO_LOG_LENGTH, &infologlength);
+static void checkprogram(u32 program) {
+  GLint infologlength = 0, shadernum = 0;
+  u32 shaders[2];
+  OGL(GetAttachedShaders, program, 2, &shadernum, shaders);
+  loopi(shadernum) checkshader(shaders[i]);
+  OGL(GetProgramiv, program, GL_INFO_LOG_LENGTH, &infologlength);
   if (infologlength > 1) {
     auto buffer = (char*) MALLOC(infologlength+1);
     buffer[infologlength] = 0;
-    OGL(GetShaderInfoLog, shadernumame, infologlength, NULL, buffer);
+    OGL(GetProgramInfoLog, program, infologlength, NULL, buffer);
     con::out("%s", buffer);
-    printf("in\n");
-    loopv(sources) printf("%s", sources[i]);
     FREE(buffer);
   }
-  return result == GL_TRUE;
 }
 
 static const pair<u32,const char*> glglslversion[] = {
@@ -798,24 +1362,17 @@ static u32 loadshader(GLenum type, const char *source, const shaderrules &rules)
   sources.add(source);
   OGL(ShaderSource, name, sources.length(), &sources[0], NULL);
   OGL(CompileShader, name);
-  if (!checkshader(sources, name)) return 0;
   return name;
 }
 
-static void linkshader(shadertype &shader) {
-  OGL(LinkProgram, shader.program);
-  OGL(ValidateProgram, shader.program);
-}
-
 static u32 loadprogram(const char *vertstr, const char *fragstr,
                        const shaderrules &vertrules,
                        const shaderrules &fragrules)
 {
-  u32 program = 0;
   const u32 vert = loadshader(GL_VERTEX_SHADER, vertstr, vertrules);
   const u32 frag = loadshader(GL_FRAGMENT_SHADER, fragstr, fragrules);
   if (vert == 0 || frag == 0) return 0;
-  program = createprogram();
+  const u32 program = createprogram();
   OGL(AttachShader, program, vert);
   OGL(AttachShader, program, frag);
   OGL(DeleteShader, vert);
@@ -824,33 +1381,244 @@ static u32 loadprogram(const char *vertstr, const char *fragstr,
 }
 #undef OGL_PROGRAM_HEADER
 
-u32 shaderbuilder::compile(const char *vert, const char *frag) {
-  u32 program;
-  vector<char*> fragrules, vertrules;
-  setrules(fragrules, vertrules);
-  if ((program = loadprogram(vert, frag, fragrules, vertrules))==0) return 0;
-  loopv(vertrules) FREE(vertrules[i]);
-  loopv(fragrules) FREE(fragrules[i]);
-  return program;
+/*-------------------------------------------------------------------------
+ - program binary cache. binaries are keyed by the hash of everything given
+ - to the compiler and the whole file is dropped when the driver changes
+ -------------------------------------------------------------------------*/
+VARP(shadercache, 0, 1, 1);
+static const char programcachename[] = "shaders.cache";
+static const u32 PROGRAMCACHEMAGIC = 0x6270716d; // "mqpb"
+static const u32 PROGRAMCACHEVERSION = 1;
+struct programbinary {
+  u32 format, length;
+  char *data;
+};
+static flat_map<u64,programbinary> programcache;
+static bool programcachedirty = false;
+
+// the version line only depends on glversion which seeds the hash
+static u32 hashsources(const char *source, const shaderrules &rules, u32 seed) {
+  auto h = murmurhash2(header, int(sizeof(header)-1), seed);
+  loopv(rules) h = murmurhash2(rules[i], int(strlen(rules[i])), h);
+  return murmurhash2(source, int(strlen(source)), h);
+}
+static u64 programkey(const char *vert, const char *frag,
+                      const shaderrules &vertrules,
+                      const shaderrules &fragrules)
+{
+  const auto vh = hashsources(vert, vertrules, glversion);
+  const auto fh = hashsources(frag, fragrules, ~glversion);
+  return (u64(vh) << 32) | u64(fh);
+}
+
+static void loadprogramcache() {
+  if (!hasPB) return;
+  int size = 0;
+  const auto file = sys::loadfile(programcachename, &size);
+  if (file == NULL) return;
+  u32 h[3];
+  if (size >= int(sizeof(h))) memcpy(h, file, sizeof(h));
+  if (size < int(sizeof(h)) || h[0] != PROGRAMCACHEMAGIC ||
+      h[1] != PROGRAMCACHEVERSION || h[2] != drivertag) {
+    con::out("ogl: discarding outdated %s", programcachename);
+    FREE(file);
+    programcachedirty = true;
+    return;
+  }
+  const auto entrysize = int(sizeof(u64)+2*sizeof(u32));
+  auto offset = int(sizeof(h));
+  while (offset + entrysize <= size) {
+    u64 key;
+    programbinary b;
+    memcpy(&key, file+offset, sizeof(u64));
+    memcpy(&b.format, file+offset+sizeof(u64), sizeof(u32));
+    memcpy(&b.length, file+offset+sizeof(u64)+sizeof(u32), sizeof(u32));
+    offset += entrysize;
+    if (b.length > u32(size-offset)) break;
+    b.data = (char*) MALLOC(b.length);
+    memcpy(b.data, file+offset, b.length);
+    offset += int(b.length);
+    if (!programcache.insert(makepair(key, b)).second) FREE(b.data);
+  }
+  FREE(file);
+  con::out("ogl: %u program binaries in %s", programcache.size(), programcachename);
+}
+
+void saveprogramcache() {
+  if (!hasPB || !programcachedirty) return;
+  auto f = fopen(programcachename, "wb");
+  if (f == NULL) {
+    con::out("ogl: unable to write %s", programcachename);
+    return;
+  }
+  const u32 h[] = {PROGRAMCACHEMAGIC, PROGRAMCACHEVERSION, drivertag};
+  fwrite(h, sizeof(h), 1, f);
+  for (auto it = programcache.begin(); it != programcache.end(); ++it) {
+    const auto &b = it->second;
+    fwrite(&it->first, sizeof(u64), 1, f);
+    fwrite(&b.format, sizeof(u32), 1, f);
+    fwrite(&b.length, sizeof(u32), 1, f);
+    fwrite(b.data, b.length, 1, f);
+  }
+  fclose(f);
+  programcachedirty = false;
+}
+
+#if !defined(RELEASE)
+static void destroyprogramcache() {
+  for (auto it = programcache.begin(); it != programcache.end(); ++it)
+    FREE(it->second.data);
+  programcache.destroy();
+}
+#endif
+
+// a binary rejected by the driver is dropped and compiled again
+static u32 loadprogrambinary(u64 key) {
+#if !defined(__WEBGL__)
+  if (!hasPB || !shadercache) return 0;
+  const auto it = programcache.find(key);
+  if (it == programcache.end()) return 0;
+  const auto program = createprogram();
+  GLint linked = GL_FALSE;
+  ogl::ProgramBinary(program, it->second.format, it->second.data, it->second.length);
+  ogl::GetError();
+  OGL(GetProgramiv, program, GL_LINK_STATUS, &linked);
+  if (linked == GL_TRUE) return program;
+  deleteprogram(program);
+  FREE(it->second.data);
+  programcache.erase(key);
+  programcachedirty = true;
+#endif // __WEBGL__
+  return 0;
+}
+
+static void saveprogrambinary(u32 program, u64 key) {
+#if !defined(__WEBGL__)
+  if (!hasPB || !shadercache) return;
+  if (programcache.find(key) != programcache.end()) return;
+  GLint length = 0;
+  OGL(GetProgramiv, program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0) return;
+  programbinary b;
+  b.length = u32(length);
+  b.data = (char*) MALLOC(b.length);
+  GLenum format;
+  OGL(GetProgramBinary, program, length, NULL, &format, b.data);
+  b.format = format;
+  programcache.insert(makepair(key, b));
+  programcachedirty = true;
+#endif // __WEBGL__
+}
+
+/*-------------------------------------------------------------------------
+ - programs are linked in the background by the driver threads when
+ - parallel shader compile is there. nothing asks for their status before
+ - their first bind so the startup never waits for a given program
+ -------------------------------------------------------------------------*/
+VAR(shaderfromfile, 0, 1, 1);
+bool loadfromfile() { return shaderfromfile!=0; }
+
+struct pendingprogram {
+  shaderbuilder *builder;
+  shadertype *s;
+  u64 key;
+};
+static vector<pendingprogram> pendingprograms;
+// permutations nobody asked for yet
+static vector<pair<shaderbuilder*,shadertype*>> lazyprograms;
+#if !defined(GL_COMPLETION_STATUS_KHR)
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+static void removepending(const shadertype &s) {
+  loopv(pendingprograms) if (pendingprograms[i].s == &s) {
+    pendingprograms.removeunordered(i);
+    break;
+  }
+  loopv(lazyprograms) if (lazyprograms[i].second == &s) {
+    lazyprograms.removeunordered(i);
+    break;
+  }
+}
+
+static bool finishpending(const shadertype &s) {
+  loopv(pendingprograms) if (pendingprograms[i].s == &s) {
+    const auto p = pendingprograms.removeunordered(i);
+    return p.builder->finish(*p.s, p.key);
+  }
+  loopv(lazyprograms) if (lazyprograms[i].second == &s) {
+    const auto p = lazyprograms.removeunordered(i);
+    if (!p.first->build(*p.second, loadfromfile(), false)) return false;
+    return !p.second->pending || finishpending(*p.second);
+  }
+  return false;
+}
+
+// done in the frame so the programs are mostly ready before their first bind
+static void pollpending() {
+#if !defined(__WEBGL__)
+  if (!hasPSC) return;
+  loopvrev(pendingprograms) {
+    const auto p = pendingprograms[i];
+    GLint done = GL_FALSE;
+    OGL(GetProgramiv, p.s->program, GL_COMPLETION_STATUS_KHR, &done);
+    if (done == GL_FALSE) continue;
+    pendingprograms.removeunordered(i);
+    if (!p.builder->finish(*p.s, p.key))
+      shadererror(true, "(link failed)");
+  }
+#endif // __WEBGL__
 }
 
 bool shaderbuilder::buildprogram(shadertype &s, const char *vert, const char *frag) {
-  const auto program = compile(vert, frag);
+  shaderrules vertrules, fragrules;
+  setrules(vertrules, fragrules);
+  const auto key = programkey(vert, frag, vertrules, fragrules);
+  auto program = loadprogrambinary(key);
+  const auto cached = program != 0;
+  if (!cached) program = loadprogram(vert, frag, vertrules, fragrules);
+  loopv(vertrules) FREE(vertrules[i]);
+  loopv(fragrules) FREE(fragrules[i]);
   if (program == 0) return false;
+  removepending(s);
   if (s.program) deleteprogram(s.program);
   s.program = program;
+  s.pending = true;
+  if (cached) return finish(s, key);
   setattrib(s);
   setfragdata(s);
-  linkshader(s);
+#if !defined(__WEBGL__)
+  if (hasPB) OGL(ProgramParameteri, program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#endif // __WEBGL__
+  OGL(LinkProgram, program);
+  pendingprograms.add({this, &s, key});
+  return true;
+}
+
+bool shaderbuilder::finish(shadertype &s, u64 key) {
+  GLint linked = GL_FALSE;
+  s.pending = false;
+  OGL(GetProgramiv, s.program, GL_LINK_STATUS, &linked);
+  if (linked != GL_TRUE) {
+    checkprogram(s.program);
+    deleteprogram(s.program);
+    s.program = 0;
+    return false;
+  }
+  saveprogrambinary(s.program, key);
+#if !defined(NDEBUG)
+  // only meaningful with the states of a draw call: debug builds only
+  OGL(ValidateProgram, s.program);
+#endif
   OGL(UseProgram, s.program);
   setuniform(s);
-  OGL(UseProgram, 0);
+  OGL(UseProgram, bindedshader ? bindedshader->program : 0);
   dirty.any = ~0x0;
   return true;
 }
 
 static char *loadshaderfile(const char *path) {
-  auto s = sys::loadfile(path);
+  auto s = pack::loadfile(path);
   if (s == NULL) con::out("unable to load shader %s", path);
   return s;
 }
@@ -876,23 +1644,32 @@ bool shaderbuilder::build(shadertype &s, int fromfile, bool save) {
     return buildprogram(s, vp, fp);
 }
 
+void shaderbuilder::defer(shadertype &s) {
+  allshaders.add(makepair(this, &s));
+  lazyprograms.add(makepair(this, &s));
+  s.pending = true;
+}
+
 void bindshader(const shadertype &shader) {
+  if (shader.pending && !finishpending(shader))
+    shadererror(true, "(link failed)");
   if (bindedshader != &shader) {
     bindedshader = &shader;
     dirty.any = ~0x0;
     OGL(UseProgram, bindedshader->program);
-  }
+  } else
+    ++glskipped;
 }
 
 void destroyshader(shadertype &s) {
+  removepending(s);
+  s.pending = false;
   if (s.program) {
     deleteprogram(s.program);
     s.program = 0;
   }
 }
 
-VAR(shaderfromfile, 0, 1, 1);
-bool loadfromfile() { return shaderfromfile!=0; }
 
 void shadererror(bool fatalerr, const char *msg) {
   if (fatalerr)
@@ -902,10 +1679,15 @@ void shadererror(bool fatalerr, const char *msg) {
 }
 
 #if !defined(RELEASE)
+// a broken shader only reports its errors instead of stopping the game.
+// permutations never bound are still left for later
 static void reloadshaders() {
   loopv(allshaders) {
     auto &s = allshaders[i];
-    s.first->build(*s.second, shaderfromfile, false);
+    if (s.second->pending && s.second->program == 0) continue;
+    if (s.first->build(*s.second, shaderfromfile, false) && s.second->pending)
+      if (!finishpending(*s.second))
+        shadererror(false, "(link failed)");
   }
 }
 CMD(reloadshaders);
@@ -939,7 +1721,7 @@ void fixedflush() {
   if (dirty.flags.mvp) {
     const auto s = static_cast<const fixed::shadertype*>(bindedshader);
     viewproj = vp[PROJECTION]*vp[MODELVIEW];
-    OGL(UniformMatrix4fv, s->u_mvp, 1, GL_FALSE, &viewproj.vx.x);
+    uniformmatrix4fv(s->u_mvp, 1, false, &viewproj.vx.x);
     dirty.flags.mvp = 0;
   }
 }
@@ -947,7 +1729,7 @@ void fixedflush() {
 void bindfixedshader(u32 flags) {bindshader(fixed::s[flags]);}
 void bindfixedshader(u32 flags, float delta) {
   bindfixedshader(flags);
-  OGL(Uniform1f, static_cast<const fixed::shadertype*>(bindedshader)->u_delta, delta);
+  uniform1f(static_cast<const fixed::shadertype*>(bindedshader)->u_delta, delta);
 }
 
 /*-------------------------------------------------------------------------
@@ -973,6 +1755,7 @@ static u32 buildcheckboard() {
 
 void start(int w, int h) {
   startgl();
+  loadprogramcache();
   OGL(Viewport, 0, 0, w, h);
 
 #if defined (__WEBGL__)
@@ -981,8 +1764,8 @@ void start(int w, int h) {
   OGL(ClearDepth,1.f);
 #endif // __WEBGL__
   enablev(GL_DEPTH_TEST, GL_CULL_FACE);
-  OGL(DepthFunc, GL_LESS);
-  OGL(CullFace, GL_BACK);
+  depthfunc(GL_LESS);
+  cullface(GL_BACK);
   OGL(GetIntegerv, GL_MAX_TEXTURE_SIZE, &glmaxtexsize);
   dirty.any = ~0x0;
   loopi(fixedshadernum) fixed::s[i].fixedfunction = true;
@@ -1013,13 +1796,18 @@ void finish() {
   if (glversion >= 300) ogl::DeleteVertexArrays(1, &vao);
   loopv(allshaders) DEL(allshaders[i].first);
   allshaders.destroy();
+  pendingprograms.destroy();
+  lazyprograms.destroy();
+  destroyprogramcache();
   rangei(TEX_CROSSHAIR, TEX_PREALLOCATED_NUM)
     if (coretexarray[i]) ogl::deletetextures(1, coretexarray+i);
+  cleantextureloads();
   immdestroy();
   if (programnum) printf("ogl: %d shaders are still allocated\n", programnum);
   if (texturenum) printf("ogl: %d textures are still allocated\n", texturenum);
   if (buffernum) printf("ogl: %d buffers are still allocated\n", buffernum);
   if (framebuffernum) printf("ogl: %d frame buffers are still allocated\n", framebuffernum);
+  if (vertexarraynum) printf("ogl: %d vertex arrays are still allocated\n", vertexarraynum);
   cleanuptimers();
 }
 #endif
@@ -5,8 +5,20 @@
 #pragma once
 #include "base/sys.hpp"
 #include "base/vector.hpp"
+#include "base/string.hpp"
+#include "base/pack.hpp"
 #include <GL/gl3.h>
 
+// gl3.h stops before gl 4.4. buffer storage is loaded at run time when present
+#if !defined(GL_ARB_buffer_storage)
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC) (GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+#endif
+#if !defined(GL_ARB_multi_draw_indirect)
+typedef void (APIENTRYP PFNGLMULTIDRAWELEMENTSINDIRECTPROC) (GLenum mode, GLenum type, const void *indirect, GLsizei drawcount, GLsizei stride);
+#endif
+
 namespace q {
 template<typename T> struct vec3;
 template<typename T> struct mat4x4;
@@ -25,6 +37,9 @@ void finish();
 #include "ogl.hxx"
 #undef OGLPROC
 #undef OGLPROC110
+extern PFNGLBUFFERSTORAGEPROC BufferStorage; // NULL if not supported
+extern PFNGLMULTIDRAWELEMENTSINDIRECTPROC MultiDrawElementsIndirect; // idem
+extern PFNGLVERTEXATTRIBDIVISORPROC VertexAttribDivisor; // idem
 #endif /* __WEBGL__ */
 
 // vertex attributes
@@ -55,10 +70,43 @@ enum {
   ELEMENT_ARRAY_BUFFER,
   TEXTURE_BUFFER,
   PIXEL_UNPACK_BUFFER,
+  PIXEL_PACK_BUFFER,
+  DRAW_INDIRECT_BUFFER,
   BUFFER_NUM
 };
 void bindbuffer(u32 target, u32 buffer);
 void bindtexture(u32 target, u32 id, u32 slot=0);
+void cullface(u32 mode);
+void depthfunc(u32 func);
+void depthmask(bool write);
+void blendfunc(u32 src, u32 dst);
+
+// uniforms of the bound program. values already sent to it are dropped
+void uniform1i(u32 loc, s32 x);
+void uniform1f(u32 loc, float x);
+void uniform2f(u32 loc, float x, float y);
+void uniform2fv(u32 loc, s32 n, const float *v);
+void uniform3fv(u32 loc, s32 n, const float *v);
+void uniform4fv(u32 loc, s32 n, const float *v);
+void uniformmatrix4fv(u32 loc, s32 n, bool transpose, const float *v);
+
+// one attribute of an interleaved vertex buffer. offset is in bytes
+struct vertexattrib {
+  u32 attrib, n, type, offset;
+  bool normalized;
+};
+
+// vertex arrays capture the attribute setup and the index buffer of a static
+// mesh such that drawing it only needs one bind. attribute offsets are
+// relative to the given base offset in the vertex buffer
+u32 makevertexarray(const vertexattrib *attribs, u32 n, u32 stride,
+                    u32 vbo, u32 ibo=0, u32 offset=0);
+void deletevertexarrays(s32 n, u32 *id);
+
+// 0 goes back to the default vertex array. tracked enabled attributes and
+// index buffer only describe the default one: do not change them while
+// another vertex array is bound
+void bindvertexarray(u32 id);
 void enableattribarray(u32 target);
 void disableattribarray(u32 target);
 
@@ -86,27 +134,33 @@ struct setattribarray {
   bool enabled[ATTRIB_NUM];
 };
 
+// gl calls of the current frame
+extern u32 glcalls;
+
 // OGL debug macros
 #if !defined(__EMSCRIPTEN__)
 #if !defined(NDEBUG)
 #define OGL(NAME, ...) \
   do { \
+    ++q::ogl::glcalls; \
     ogl::NAME(__VA_ARGS__); \
     if (q::ogl::GetError()) sys::fatal("gl" #NAME " failed"); \
   } while (0)
 #define OGLR(RET, NAME, ...) \
   do { \
+    ++q::ogl::glcalls; \
     RET = q::ogl::NAME(__VA_ARGS__); \
     if (q::ogl::GetError()) sys::fatal("gl" #NAME " failed"); \
   } while (0)
 #else
-  #define OGL(NAME, ...) do {q::ogl::NAME(__VA_ARGS__);} while(0)
-  #define OGLR(RET, NAME, ...) do {RET=q::ogl::NAME(__VA_ARGS__);} while(0)
+  #define OGL(NAME, ...) do {++q::ogl::glcalls; q::ogl::NAME(__VA_ARGS__);} while(0)
+  #define OGLR(RET, NAME, ...) do {++q::ogl::glcalls; RET=q::ogl::NAME(__VA_ARGS__);} while(0)
 #endif /* NDEBUG */
 #else /* __EMSCRIPTEN__ */
 #if !defined(NDEBUG)
 #define OGL(NAME, ...) \
   do { \
+    ++q::ogl::glcalls; \
     gl##NAME(__VA_ARGS__); \
     if (gl##GetError()) { \
       fixedstring err(fmt, "gl" #NAME " failed at line %i and file %s",__LINE__, __FILE__);\
@@ -115,18 +169,20 @@ struct setattribarray {
   } while (0)
 #define OGLR(RET, NAME, ...) \
   do { \
+    ++q::ogl::glcalls; \
     RET = gl##NAME(__VA_ARGS__); \
     if (gl##GetError()) sys::fatal("gl" #NAME " failed"); \
   } while (0)
 #else
-  #define OGL(NAME, ...) do {gl##NAME(__VA_ARGS__);} while(0)
-  #define OGLR(RET, NAME, ...) do {RET=gl##NAME(__VA_ARGS__);} while(0)
+  #define OGL(NAME, ...) do {++q::ogl::glcalls; gl##NAME(__VA_ARGS__);} while(0)
+  #define OGLR(RET, NAME, ...) do {++q::ogl::glcalls; RET=gl##NAME(__VA_ARGS__);} while(0)
 #endif /* NDEBUG */
 #endif /* __EMSCRIPTEN__ */
 
-// useful to enable / disable many things in one-liners
-INLINE void enable(u32 x) { OGL(Enable,x); }
-INLINE void disable(u32 x) { OGL(Disable,x); }
+// useful to enable / disable many things in one-liners. depth test, culling,
+// blending, scissor, stencil and polygon offset are tracked
+void enable(u32 x);
+void disable(u32 x);
 MAKE_VARIADIC(enable);
 MAKE_VARIADIC(disable);
 
@@ -150,13 +206,23 @@ enum {
 };
 u32 coretex(u32 index);
 u32 installtex(const char *texname, bool clamp=false);
+// the texture is the checkboard until the image is loaded in the background
+u32 installtexasync(const char *texname, bool clamp=false);
+// one GL_TEXTURE_2D_ARRAY with a layer per image. the images need the same
+// format and are resampled to the largest of them. 0 if any of them fails
+u32 installtexarray(const char **texnames, u32 n, bool clamp=false);
+// decode the image once and store its pixels in the pack
+bool packtexture(const char *texname, pack::writer &w);
 u32 maketex(const char *fmt, ...);
 
 /*--------------------------------------------------------------------------
  - immediate mode rendering
  -------------------------------------------------------------------------*/
-void immdrawelements(int mode, int count, int type, const void *indices, const void *vertices);
-void immdrawelememts(const char *fmt, int count, const void *indices, const void *vertices);
+// vertnum is the number of vertices referenced by the indices
+void immdrawelements(int mode, int count, int type, const void *indices,
+                     const void *vertices, int vertnum);
+void immdrawelememts(const char *fmt, int count, const void *indices,
+                     const void *vertices, int vertnum);
 void immdrawarrays(int mode, int first, int count);
 void immdraw(const char *fmt, int count, const void *data);
 
@@ -190,9 +256,10 @@ INLINE void popmode(int mode) {
  -------------------------------------------------------------------------*/
 struct shadertype {
   INLINE shadertype(bool fixedfunction=false) :
-    program(0), fixedfunction(fixedfunction) {}
+    program(0), fixedfunction(fixedfunction), pending(false) {}
   u32 program;
   bool fixedfunction;
+  bool pending; // built or linked in the background, waited for at first bind
 #if !defined(__MSVC__)
   u32 internal[0];
 #endif
@@ -209,6 +276,10 @@ struct shaderbuilder {
                 const char *vp, const char *fp) :
     vppath(vppath), fppath(fppath), vp(vp), fp(fp) {}
   bool build(shadertype &s, int fromfile, bool save = true);
+  // s is only built at its first bind
+  void defer(shadertype &s);
+  // waits for the link started by build and gets the uniform locations
+  bool finish(shadertype &s, u64 key);
 private:
   const char *vppath, *fppath;
   const char *vp, *fp;
@@ -216,7 +287,6 @@ private:
   virtual void setuniform(shadertype &s) = 0;
   virtual void setattrib(shadertype &s) = 0;
   virtual void setfragdata(shadertype &s) = 0;
-  u32 compile(const char *vertsrc, const char *fragsrc);
   bool buildprogram(shadertype &s, const char *vert, const char *frag);
   bool buildprogramfromfile(shadertype &s);
 };
@@ -234,9 +304,17 @@ bool loadfromfile();
  -------------------------------------------------------------------------*/
 void beginframe();
 void endframe();
-struct timer *begintimer(const char *name, bool gpu);
+struct timer *begintimer(const istring &name, bool gpu);
 void endtimer(struct timer *t);
 void printtimers(float conw, float conh);
+// sum of the gpu timers of the last frame whose queries are back or -1 if
+// none. measuring runs the timers even when they are not displayed
+float gpumillis();
+void measuregpu(bool enable);
+// with a callback, every timer runs and gives it each of its results once
+// known. gpu results come back a few frames after their queries
+typedef void (*timercallback)(const char *name, bool gpu, float ms);
+void settimercallback(timercallback cb);
 
 /*--------------------------------------------------------------------------
  - simple shader system to replace fixed pipeline
@@ -258,6 +336,15 @@ extern u32 glversion;   // opengl version
 extern u32 glslversion; // glsl version
 extern bool hasTQ;      // timer query
 extern bool hasTB;      // texture buffer
+extern bool hasBS;      // buffer storage
+extern bool hasMDI;     // multi draw indirect
+extern bool hasIA;      // instanced arrays
+extern bool hasTA;      // texture arrays
+extern bool hasPB;      // program binary
+extern bool hasPSC;     // parallel shader compile
+
+// write the linked programs to the binary cache if new ones were built
+void saveprogramcache();
 
 } /* namespace ogl */
 } /* namespace q */
@@ -242,4 +242,7 @@ OGLPROC(UniformBlockBinding, glUniformBlockBinding, PFNGLUNIFORMBLOCKBINDINGPROC
 OGLPROC(GetInteger64i_v, glGetInteger64i_v, PFNGLGETINTEGER64I_VPROC)
 OGLPROC(GetBufferParameteri64v, glGetBufferParameteri64v, PFNGLGETBUFFERPARAMETERI64VPROC)
 OGLPROC(FramebufferTexture, glFramebufferTexture, PFNGLFRAMEBUFFERTEXTUREPROC)
+OGLPROC(FenceSync, glFenceSync, PFNGLFENCESYNCPROC)
+OGLPROC(DeleteSync, glDeleteSync, PFNGLDELETESYNCPROC)
+OGLPROC(ClientWaitSync, glClientWaitSync, PFNGLCLIENTWAITSYNCPROC)
 
@@ -7,6 +7,8 @@
 // tweaked until they "felt right", and have no basis in reality.  Collision
 // detection is simplistic but very robust (uses discrete steps at fixed fps).
 #include "mini.q.hpp"
+#include "csg.hpp"
+#include "base/flat_map.hpp"
 
 namespace q {
 namespace physics {
@@ -48,9 +50,183 @@ INLINE aabb getaabb(vec3i xyz) {
 }
 #endif
 
-// collide with the map
+// the world is the csg scene. its distance field is sampled around the
+// players by the distance cache (negative inside the solids) and a box is
+// tested as the vertical capsule it contains: spheres along its axis spaced
+// by less than their radius
+static const float DISTCELLSIZE = 0.1f;
+static csg::distcache *world = NULL;
+static iso::occupancy *occupancy = NULL;
+
+static csg::distcache *getworld(void) {
+  if (world) return world;
+  const auto node = csg::makescene();
+  if (node) world = csg::makedistcache(*node, DISTCELLSIZE);
+  return world;
+}
+
+void resetworld(void) {
+  csg::destroy(world);
+  world = NULL;
+}
+
+void setoccupancy(iso::occupancy *o) {
+  iso::destroy(occupancy);
+  occupancy = o;
+}
+bool hasoccupancy() { return occupancy != NULL; }
+bool mapempty(const aabb &box) { return occupancy && iso::empty(*occupancy, box); }
+bool mapvisible(const vec3f &from, const vec3f &to) {
+  return occupancy && iso::visible(*occupancy, from, to);
+}
+
+void finish(void) {
+  resetworld();
+  setoccupancy(NULL);
+}
+
+struct capsule { vec3f org; float r, h; int num; };
+static INLINE capsule getcapsule(const aabb &box) {
+  const auto ext = box.pmax-box.pmin;
+  const auto r = 0.5f*min(ext.x, ext.z);
+  const auto h = max(ext.y-2.f*r, 0.f);
+  const auto org = vec3f(0.5f*(box.pmin.x+box.pmax.x), box.pmin.y+r, 0.5f*(box.pmin.z+box.pmax.z));
+  return capsule({org, r, h, int(ceil(h/r))+1});
+}
+static INLINE vec3f sphereorg(const capsule &c, int i) {
+  return c.org+vec3f(0.f, c.num>1 ? c.h*float(i)/float(c.num-1) : 0.f, 0.f);
+}
+
+// collide with the map. boxes the occupancy finds in the air skip the field
 static bool mapcollide(const aabb &box) {
-  return box.pmin.y >= 0.f;
+  if (mapempty(box)) return true;
+  const auto w = getworld();
+  if (w == NULL) return box.pmin.y >= 0.f;
+  const auto c = getcapsule(box);
+  loopi(c.num) if (csg::dist(w, sphereorg(c, i)) < c.r) return false;
+  return true;
+}
+
+// push a player stuck in the world (spawned or teleported inside a solid)
+// out along the gradient of the field
+static void unstick(game::dynent *d) {
+  const auto w = getworld();
+  if (w == NULL) return;
+  loopk(8) {
+    const auto c = getcapsule(getaabb(d));
+    auto depth = 0.f;
+    vec3f deepest(zero);
+    loopi(c.num) {
+      const auto p = sphereorg(c, i);
+      const auto dp = c.r-csg::dist(w, p);
+      if (dp > depth) {
+        depth = dp;
+        deepest = p;
+      }
+    }
+    if (depth <= 0.f) return;
+    vec3f g;
+    loopi(3) {
+      auto dx = vec3f(zero);
+      dx[i] = DISTCELLSIZE;
+      g[i] = csg::dist(w, deepest+dx)-csg::dist(w, deepest-dx);
+    }
+    const auto len = length(g);
+    d->o += (len > 0.f ? g/len : vec3f(0.f,1.f,0.f))*(depth+0.01f);
+  }
+}
+
+static const int MINFRAMETIME = 20; // physics simulated at 50fps or better
+
+// broadphase: a hashed uniform grid of all the dynents rebuilt once per
+// physics frame. every dynent goes in all the cells its bounding cube
+// touches. entities move during the frame so queries are grown by the
+// largest distance any of them may travel. the grid only keeps handles since
+// players and monsters may go away before the next rebuild
+static const float GRIDCELLSIZE = 8.f;
+struct gridnode { u32 ent, next; };
+static flat_map<u64,u32> gridcells; // first node of the cell
+static vector<gridnode> gridnodes;
+static vector<entref> gridents;
+static vector<game::dynhandle> gridhandles;
+static vector<u32> gridstamps;
+static u32 gridstamp = 0;
+static float gridmargin = 0.f;
+
+static INLINE float extent(const game::dynent *d) {
+  return max(d->radius, max(d->eyeheight, d->aboveeye));
+}
+static INLINE vec3i gridcell(const vec3f &p) {
+  return vec3i(floor(p/GRIDCELLSIZE));
+}
+static INLINE u64 gridkey(const vec3i &xyz) {
+  const u64 mask = (1u<<21)-1;
+  return (u64(xyz.x)&mask) | (u64(xyz.y)&mask)<<21 | (u64(xyz.z)&mask)<<42;
+}
+
+static void gridinsert(game::dynent *d, int cn, int monster, float curtime) {
+  if (d == NULL) return;
+  const u32 ent = gridents.length();
+  auto &e = gridents.add();
+  e.d = NULL;
+  e.cn = cn;
+  e.monster = monster;
+  gridhandles.add(game::gethandle(d));
+  const auto ext = vec3f(extent(d));
+  const auto pmin = gridcell(d->o-ext), pmax = gridcell(d->o+ext);
+  for (int z = pmin.z; z <= pmax.z; ++z)
+  for (int y = pmin.y; y <= pmax.y; ++y)
+  for (int x = pmin.x; x <= pmax.x; ++x) {
+    const auto key = gridkey(vec3i(x,y,z));
+    const auto it = gridcells.find(key);
+    const gridnode node = {ent, it != gridcells.end() ? it->second : ~0u};
+    gridcells[key] = gridnodes.length();
+    gridnodes.add(node);
+  }
+  // vel is scaled by maxspeed per second when moving. kicks, pushes and
+  // jumps may still speed it up during the frame, hence the slack
+  const auto travel = (length(d->vel)+1.f)*d->maxspeed*curtime/1000.f;
+  gridmargin = max(gridmargin, 2.f*travel);
+}
+
+static void buildgrid(void) {
+  gridcells.clear();
+  gridnodes.setsize(0);
+  gridents.setsize(0);
+  gridhandles.setsize(0);
+  gridmargin = 0.f;
+  const auto curtime = float(max(int(game::curtime()), MINFRAMETIME));
+  gridinsert(game::player1, -1, -1, curtime);
+  loopv(game::players) gridinsert(game::players[i], i, -1, curtime);
+  auto &v = game::getmonsters();
+  loopv(v) gridinsert(v[i], -2, i, curtime);
+  gridstamps.setsize(gridents.length());
+}
+
+u32 gather(const aabb &box, entref *out, u32 maxnum) {
+  if (++gridstamp == 0) {
+    loopv(gridstamps) gridstamps[i] = 0;
+    gridstamp = 1;
+  }
+  const auto margin = vec3f(gridmargin);
+  const auto pmin = gridcell(box.pmin-margin), pmax = gridcell(box.pmax+margin);
+  u32 num = 0;
+  for (int z = pmin.z; z <= pmax.z; ++z)
+  for (int y = pmin.y; y <= pmax.y; ++y)
+  for (int x = pmin.x; x <= pmax.x; ++x) {
+    const auto it = gridcells.find(gridkey(vec3i(x,y,z)));
+    if (it == gridcells.end()) continue;
+    for (auto n = it->second; n != ~0u; n = gridnodes[n].next) {
+      const auto ent = gridnodes[n].ent;
+      if (gridstamps[ent] == gridstamp) continue;
+      gridstamps[ent] = gridstamp;
+      auto e = gridents[ent];
+      if ((e.d = game::getdynent(gridhandles[ent])) == NULL) continue;
+      if (num == maxnum) return num;
+      out[num++] = e;
+    }
+  }
+  return num;
 }
 
 // all collision happens here. spawn is a dirty side effect used in
@@ -62,16 +238,10 @@ bool collide(game::dynent *d, bool spawn) {
   // collide with map
   if (!mapcollide(box)) return false;
 
-  // collide with other players
-  loopv(game::players) {
-    game::dynent *o = game::players[i];
-    if (!o || o==d) continue;
-    if (!plcollide(box, o)) return false;
-  }
-  if (d!=game::player1)
-    if (!plcollide(box, game::player1)) return false;
-  auto &v = game::getmonsters();
-  loopv(v) if (v[i]!=d && !plcollide(box, v[i])) return false;
+  // collide with other players and monsters
+  entref near[MAXNEAR];
+  const auto num = gather(box, near, MAXNEAR);
+  loopi(s32(num)) if (near[i].d!=d && !plcollide(box, near[i].d)) return false;
 
   // collide with map models
   if (!mmcollide(box)) return false;
@@ -81,10 +251,10 @@ bool collide(game::dynent *d, bool spawn) {
 VARP(maxroll, 0, 3, 20);
 
 static int physicsfraction = 0, physicsrepeat = 0;
-static const int MINFRAMETIME = 20; // physics simulated at 50fps or better
 
 // optimally schedule physics frames inside the graphics frames
 void frame(void) {
+  buildgrid();
   if (game::curtime()>=MINFRAMETIME) {
     int faketime = int(game::curtime())+physicsfraction;
     physicsrepeat = faketime/MINFRAMETIME;
@@ -99,7 +269,7 @@ void frame(void) {
 // local is false for client::multiplayer prediction
 void moveplayer(game::dynent *pl, int moveres, bool local, int curtime) {
   const bool water = false;//world::waterlevel() > pl->o.z-0.5f;
-  const bool floating = true;//(edit::mode() && local) || pl->state==CS_EDITING;
+  const bool floating = (edit::mode() && local) || pl->state==CS_EDITING;
 
   vec3f d; // vector of direction we ideally want to move in
   d.x = float(pl->move*cos(deg2rad(pl->ypr.x-90.f)));
@@ -128,6 +298,7 @@ void moveplayer(game::dynent *pl, int moveres, bool local, int curtime) {
 
   pl->blocked = false;
   pl->moving = true;
+  if (!floating) unstick(pl);
 
   if (floating) { // just apply velocity
     pl->o += d;
@@ -4,14 +4,35 @@
  -------------------------------------------------------------------------*/
 #pragma once
 #include "entities.hpp"
+#include "iso.hpp"
 
 namespace q {
 namespace physics {
 
+// the dynents near a box found by the broadphase. cn is the client number
+// for the players, -1 for player1 and -2 for the monsters. monster is the
+// index in the monster list or -1
+struct entref { game::dynent *d; int cn, monster; };
+static const u32 MAXNEAR = 64;
+// at most maxnum dynents whose box may overlap the given one during the
+// current physics frame
+u32 gather(const aabb &box, entref *out, u32 maxnum);
+
 void moveplayer(game::dynent *pl, int moveres, bool local);
 bool collide(game::dynent *d, bool spawn);
 void setentphysics(int mml, int mmr);
 void frame(void);
+// drop the cached distance field of the world when the scene changes
+void resetworld(void);
+// occupancy of the current scene (owned by the physics from now on). null
+// when the scene has none and only the distance field answers
+void setoccupancy(iso::occupancy *o);
+// o(1) queries of the occupancy. without one, mapempty and mapvisible are
+// always false such that callers fall back to collide and the rays
+bool hasoccupancy();
+bool mapempty(const aabb &box);
+bool mapvisible(const vec3f &from, const vec3f &to);
+void finish(void);
 
 } /* namespace physics */
 } /* namespace q */
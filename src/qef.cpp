@@ -4,6 +4,7 @@
  - original code by Ronen Tzur (rtzur@shani.net)
 -------------------------------------------------------------------------*/
 #include "qef.hpp"
+#include "soa.hpp"
 
 namespace q {
 namespace qef {
@@ -690,11 +691,10 @@ static void solveSVD(
   for (i = 0; i < rows; ++i)
     if (b[i] != 0.0) for (j = 0; j < 3; ++j) w[j] += b[i] * u[i][j];
 
-  // introduce non-zero singular values in d into w
-  for (i = 0; i < 3; ++i) {
-    if (d[i] != 0.0)
-      w[i] /= d[i];
-  }
+  // introduce non-zero singular values in d into w. truncated ones are
+  // dropped such that we get the minimizer closest to the mass point
+  for (i = 0; i < 3; ++i)
+    w[i] = d[i] != 0.0 ? w[i] / d[i] : 0.0;
 
   // compute result vector x = V * w
   for (i = 0; i < 3; ++i) {
@@ -724,6 +724,184 @@ vec3f evaluate(double mat[][3], double *vec, int rows) {
   solveSVD(u, v, d, vec, x, rows);
   return vec3f(float(x[0]), float(x[1]), float(x[2]));
 }
+
+/*-------------------------------------------------------------------------
+ - batched solver. we solve the normal equations A^T.A.x = A^T.b for
+ - soaf::size cells at once with a jacobi eigen decomposition in single
+ - precision. a singular value of A below 0.1 is an eigen value of A^T.A
+ - below 0.01 and is discarded as done above
+ -------------------------------------------------------------------------*/
+static const u32 JACOBI_SWEEPS = 5;
+static const float EIGEN_EPSILON = 0.01f;
+
+// float is not trusted to truncate eigen values close to the threshold nor
+// when jacobi did not converge
+static const float EIGEN_BAND_MIN = 0.005f, EIGEN_BAND_MAX = 0.02f;
+static const float JACOBI_RESIDUAL = 1e-10f;
+
+// jacobi rotation zeroing a[p][q]. r is the remaining index
+template <int p, int q, int r>
+INLINE void jacobi(soaf a[3][3], soaf v[3][3]) {
+  const auto apq = a[p][q];
+  const auto tau = a[q][q] - a[p][p];
+  const auto den = abs(tau) + sqrt(tau*tau + 4.f*apq*apq);
+  const auto sgn = select(tau >= soaf(zero), soaf(one), soaf(-1.f));
+  const auto t = select(den == soaf(zero), soaf(zero), sgn*2.f*apq/den);
+  const auto c = soaf(one) / sqrt(t*t + 1.f);
+  const auto s = t*c;
+  a[p][p] = a[p][p] - t*apq;
+  a[q][q] = a[q][q] + t*apq;
+  a[p][q] = a[q][p] = soaf(zero);
+  const auto arp = a[r][p], arq = a[r][q];
+  a[r][p] = a[p][r] = c*arp - s*arq;
+  a[r][q] = a[q][r] = s*arp + c*arq;
+  loopi(3) {
+    const auto vip = v[i][p], viq = v[i][q];
+    v[i][p] = c*vip - s*viq;
+    v[i][q] = s*vip + c*viq;
+  }
+}
+
+u32 evaluate(const qefcell *cells, vec3f *x, u32 num) {
+  const u32 lanes = soaf::size;
+  u32 fallback = 0;
+  for (u32 first = 0; first < num; first += lanes) {
+    const auto n = min(lanes, num-first);
+
+    // build the normal equations. the batch is padded with its last cell
+    DEFAULT_ALIGNED float m[9][lanes];
+    loopi(lanes) {
+      const auto &cell = cells[first + min(u32(i), n-1)];
+      loopj(9) m[j][i] = 0.f;
+      loopj(cell.rows) {
+        const auto nn = cell.n[j];
+        const auto d = cell.d[j];
+        m[0][i] += nn.x*nn.x; m[1][i] += nn.x*nn.y; m[2][i] += nn.x*nn.z;
+        m[3][i] += nn.y*nn.y; m[4][i] += nn.y*nn.z; m[5][i] += nn.z*nn.z;
+        m[6][i] += nn.x*d; m[7][i] += nn.y*d; m[8][i] += nn.z*d;
+      }
+    }
+    soaf a[3][3], v[3][3];
+    a[0][0] = soaf::load(m[0]);
+    a[0][1] = a[1][0] = soaf::load(m[1]);
+    a[0][2] = a[2][0] = soaf::load(m[2]);
+    a[1][1] = soaf::load(m[3]);
+    a[1][2] = a[2][1] = soaf::load(m[4]);
+    a[2][2] = soaf::load(m[5]);
+    const soaf b[] = {soaf::load(m[6]), soaf::load(m[7]), soaf::load(m[8])};
+    loopi(3) loopj(3) v[i][j] = i==j ? soaf(one) : soaf(zero);
+
+    // diagonalize
+    loopi(JACOBI_SWEEPS) {
+      jacobi<0,1,2>(a,v);
+      jacobi<0,2,1>(a,v);
+      jacobi<1,2,0>(a,v);
+    }
+    const auto off = a[0][1]*a[0][1] + a[0][2]*a[0][2] + a[1][2]*a[1][2];
+    const auto diag = a[0][0]*a[0][0] + a[1][1]*a[1][1] + a[2][2]*a[2][2];
+    auto bad = off > JACOBI_RESIDUAL*diag;
+
+    // x = V.D^-1.V^T.A^T.b with small eigen values truncated
+    soaf w[3];
+    loopi(3) {
+      const auto d = a[i][i];
+      bad = bad | ((d > EIGEN_BAND_MIN) & (d < EIGEN_BAND_MAX));
+      const auto inv = select(d >= EIGEN_EPSILON, soaf(one)/d, soaf(zero));
+      w[i] = inv * (v[0][i]*b[0] + v[1][i]*b[1] + v[2][i]*b[2]);
+    }
+    DEFAULT_ALIGNED float out[3][lanes];
+    loopi(3) store(out[i], v[i][0]*w[0] + v[i][1]*w[1] + v[i][2]*w[2]);
+
+    // output the results and go through the slow path when needed
+    const auto badmask = movemask(bad);
+    loopi(int(n)) {
+      if ((badmask & (1<<i)) == 0) {
+        x[first+i] = vec3f(out[0][i], out[1][i], out[2][i]);
+        continue;
+      }
+      const auto &cell = cells[first+i];
+      double matrix[MAXROWS][3], vector[MAXROWS];
+      loopj(cell.rows) {
+        loopk(3) matrix[j][k] = double(cell.n[j][k]);
+        vector[j] = double(cell.d[j]);
+      }
+      x[first+i] = evaluate(matrix, vector, cell.rows);
+      ++fallback;
+    }
+  }
+  return fallback;
+}
+
+/*-------------------------------------------------------------------------
+ - batched qem evaluation. the ten coefficients are summed in double and
+ - evaluated in single precision for soaf::size edges at once. the error of
+ - the float evaluation is bounded by QEM_FLOAT_BOUND times the sum of the
+ - absolute values of the terms
+ -------------------------------------------------------------------------*/
+static const float QEM_FLOAT_BOUND = 4e-6f;
+
+INLINE soaf error(const soaf q[10], const soaf &x, const soaf &y, const soaf &z,
+                  soaf &bound) {
+  const soaf t[] = {
+    x*x*q[0], 2.f*x*y*q[4], 2.f*x*z*q[5], 2.f*x*q[6],
+    y*y*q[1], 2.f*y*z*q[7], 2.f*y*q[8],
+    z*z*q[2], 2.f*z*q[9], q[3]
+  };
+  auto err = t[0];
+  bound = abs(t[0]);
+  rangei(1,10) {
+    err = err + t[i];
+    bound = bound + abs(t[i]);
+  }
+  bound = bound * QEM_FLOAT_BOUND;
+  return err;
+}
+
+u32 findbest(const qem *q, const vec3f *p, const int *v0, const int *v1,
+             u32 num, double minerror, double maxerror, pair<double,int> *best) {
+  const u32 lanes = soaf::size;
+  const auto maxf = soaf(float(maxerror));
+  u32 fallback = 0;
+  for (u32 first = 0; first < num; first += lanes) {
+    const auto n = min(lanes, num-first);
+
+    // gather the summed qems and both positions. the batch is padded with its
+    // last edge
+    DEFAULT_ALIGNED float m[10][lanes], pos[6][lanes];
+    loopi(lanes) {
+      const auto e = first + min(u32(i), n-1);
+      const auto qq = q[v0[e]] + q[v1[e]];
+      const double c[] = {qq.aa,qq.bb,qq.cc,qq.dd,qq.ab,qq.ac,qq.ad,qq.bc,qq.bd,qq.cd};
+      loopj(10) m[j][i] = float(c[j]);
+      loopj(3) {
+        pos[j][i] = p[v0[e]][j];
+        pos[3+j][i] = p[v1[e]][j];
+      }
+    }
+    soaf c[10], b0, b1;
+    loopi(10) c[i] = soaf::load(m[i]);
+    const auto e0 = error(c, soaf::load(pos[0]), soaf::load(pos[1]), soaf::load(pos[2]), b0);
+    const auto e1 = error(c, soaf::load(pos[3]), soaf::load(pos[4]), soaf::load(pos[5]), b1);
+
+    // nan and inf lanes fail all tests and go through the exact path
+    const auto fast = (e0-b0 > maxf) & (e1-b1 > maxf) & (abs(e0-e1) > b0+b1);
+    const auto fastmask = movemask(fast);
+    DEFAULT_ALIGNED float out[2][lanes];
+    store(out[0], e0);
+    store(out[1], e1);
+    loopi(int(n)) {
+      const auto e = first+i;
+      if ((fastmask & (1<<i)) != 0) {
+        best[e] = out[0][i] < out[1][i] ?
+          makepair(double(out[0][i]), 0) : makepair(double(out[1][i]), 1);
+        continue;
+      }
+      best[e] = findbest(q[v0[e]], q[v1[e]], p[v0[e]], p[v1[e]], minerror);
+      ++fallback;
+    }
+  }
+  return fallback;
+}
 } /* namespace qef */
 } /* namespace q */
 
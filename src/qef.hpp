@@ -15,15 +15,26 @@ namespace qef {
 // that describe at least two planes, the QEF evalulates to the point x.
 vec3f evaluate(double mat[][3], double *vec, int rows);
 
+// batched version of the above. each row of a cell is given by its normal n
+// and its distance d to the mass point. results go to x. cells badly
+// conditioned in single precision go through the double path above. the
+// number of such cells is returned
+struct qefcell {
+  vec3f n[12];
+  float d[12];
+  int rows;
+};
+u32 evaluate(const qefcell *cells, vec3f *x, u32 num);
+
 /*-------------------------------------------------------------------------
  - quadratic error matrix (as proposed by Garland et al.)
  -------------------------------------------------------------------------*/
 struct qem {
-  INLINE qem() {ZERO(this); next=-1;}
-  INLINE qem(vec3f v0, vec3f v1, vec3f v2) : timestamp(0), next(-1) {
+  INLINE qem() {ZERO(this);}
+  INLINE qem(vec3f v0, vec3f v1, vec3f v2) {
     init(cross(v0-v1,v0-v2), v0);
   }
-  INLINE qem(vec3f d, vec3f p) : timestamp(0), next(-1) { init(d,p); }
+  INLINE qem(vec3f d, vec3f p) { init(d,p); }
   INLINE void init(const vec3f &d, const vec3f &p) {
     const auto len = double(length(d));
     if (len != 0.) {
@@ -69,7 +80,6 @@ struct qem {
   double ab, ac, ad;
   double bc, bd;
   double cd;
-  int timestamp, next;
 };
 
 INLINE qem operator+ (const qem &q0, const qem &q1) {
@@ -85,6 +95,13 @@ findbest(const qem &q0, const qem &q1, const vec3f &p0, const vec3f &p1, double
   const auto error1 = q.error(p1, minerror);
   return error0 < error1 ? makepair(error0, 0) : makepair(error1, 1);
 }
+
+// batched findbest over the edges (v0[i],v1[i]) of vertices with qems q and
+// positions p. edges are first scored in single precision. the ones which are
+// clearly above maxerror with a clear best vertex keep this approximate cost.
+// others go through the exact scalar path. returns the number of fallbacks
+u32 findbest(const qem *q, const vec3f *p, const int *v0, const int *v1,
+             u32 num, double minerror, double maxerror, pair<double,int> *best);
 } /* namespace qef */
 } /* namespace q */
 
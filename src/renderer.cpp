@@ -8,71 +8,197 @@
 #include "iso.hpp"
 #include "geom.hpp"
 #include "rt.hpp"
+#include "bvh.hpp"
 #include "shaders.hpp"
+#include "ui.hpp"
+#include "soa.hpp"
+#include "base/profiler.hpp"
+#include "base/hash.hpp"
+#include "base/string.hpp"
 
 namespace q {
 namespace rr {
 
+/*--------------------------------------------------------------------------
+ - a frame is recorded then submitted. the record copies what the submission
+ - reads of the game such that the next frame may simulate while it runs
+ -------------------------------------------------------------------------*/
+enum { FRAME_LOADING, FRAME_SHADERTOY, FRAME_RAYTRACE, FRAME_DEFERRED };
+static struct frameview {
+  mat4x4f mvmat, mvpmat, invmvpmat, dirinvmvpmat;
+  vec3f eye, ypr;
+  double lastmillis, curtime;
+  int w, h, mode;
+} view;
+
+// with a game thread, what the game asks the renderer waits for the next
+// record where both threads are in sync
+static bool gamethread = false;
+
 /*--------------------------------------------------------------------------
  - particle rendering
  -------------------------------------------------------------------------*/
-static const int MAXPARTICLES = 10500;
-// static const int NUMPARTCUTOFF = 20;
-struct particle { vec3f o, d; int fade, type; int millis; particle *next; };
-static particle particles[MAXPARTICLES], *parlist = NULL, *parempty = NULL;
-static bool parinit = false;
+static const int MAXPARTICLES = 128*1024;
+static const int PARTICLECHUNK = 4096; // particles simulated by one task element
 
-VARP(maxparticles, 100, 2000, MAXPARTICLES-500);
+VARP(maxparticles, 100, 32768, MAXPARTICLES);
 VAR(demotracking, 0, 0, 1);
 VARP(particlesize, 20, 100, 500);
 
-static void newparticle(const vec3f &o, const vec3f &d, int fade, int type) {
-  if (!parinit) {
-    loopi(MAXPARTICLES) {
-      particles[i].next = parempty;
-      parempty = &particles[i];
-    }
-    parinit = true;
-  }
-  if (parempty) {
-    particle *p = parempty;
-    parempty = p->next;
-    p->o = o;
-    p->d = d;
-    p->fade = fade;
-    p->type = type;
-    p->millis = int(game::lastmillis());
-    p->next = parlist;
-    parlist = p;
-  }
-}
-
-static const struct parttype {vec3f rgb; int gr, tex; float sz;} parttypes[] = {
-  {vec3f(0.7f, 0.6f, 0.3f), 2,  ogl::TEX_MARTIN_BASE,  0.06f}, // yellow: sparks
-  {vec3f(0.5f, 0.5f, 0.5f), 20, ogl::TEX_MARTIN_SMOKE, 0.15f}, // grey:   small smoke
-  {vec3f(0.2f, 0.2f, 1.0f), 20, ogl::TEX_MARTIN_BASE,  0.08f}, // blue:   edit mode entities
-  {vec3f(1.0f, 0.1f, 0.1f), 1,  ogl::TEX_MARTIN_SMOKE, 0.06f}, // red:    blood spats
-  {vec3f(1.0f, 0.8f, 0.8f), 20, ogl::TEX_MARTIN_BALL1, 1.2f }, // yellow: fireball1
-  {vec3f(0.5f, 0.5f, 0.5f), 20, ogl::TEX_MARTIN_SMOKE, 0.6f }, // grey:   big smoke
-  {vec3f(1.0f, 1.0f, 1.0f), 20, ogl::TEX_MARTIN_BALL2, 1.2f }, // blue:   fireball2
-  {vec3f(1.0f, 1.0f, 1.0f), 20, ogl::TEX_MARTIN_BALL3, 1.2f }, // green:  fireball3
-  {vec3f(1.0f, 0.1f, 0.1f), 0,  ogl::TEX_MARTIN_SMOKE, 0.2f }, // red:    demotrack
+// with texture arrays, the sprites are the layers of one texture and all the
+// particles go in one draw call. the layer is also per particle
+enum {SPRITE_BASE, SPRITE_SMOKE, SPRITE_BALL1, SPRITE_BALL2, SPRITE_BALL3, SPRITENUM};
+static const char *spritenames[SPRITENUM] = {
+  "data/martin/base.png",
+  "data/martin/smoke.png",
+  "data/martin/ball1.png",
+  "data/martin/ball2.png",
+  "data/martin/ball3.png"
+};
+
+static const struct parttype {vec3f rgb; int gr, tex, layer; float sz;} parttypes[] = {
+  {vec3f(0.7f, 0.6f, 0.3f), 2,  ogl::TEX_MARTIN_BASE,  SPRITE_BASE,  0.06f}, // yellow: sparks
+  {vec3f(0.5f, 0.5f, 0.5f), 20, ogl::TEX_MARTIN_SMOKE, SPRITE_SMOKE, 0.15f}, // grey:   small smoke
+  {vec3f(0.2f, 0.2f, 1.0f), 20, ogl::TEX_MARTIN_BASE,  SPRITE_BASE,  0.08f}, // blue:   edit mode entities
+  {vec3f(1.0f, 0.1f, 0.1f), 1,  ogl::TEX_MARTIN_SMOKE, SPRITE_SMOKE, 0.06f}, // red:    blood spats
+  {vec3f(1.0f, 0.8f, 0.8f), 20, ogl::TEX_MARTIN_BALL1, SPRITE_BALL1, 1.2f }, // yellow: fireball1
+  {vec3f(0.5f, 0.5f, 0.5f), 20, ogl::TEX_MARTIN_SMOKE, SPRITE_SMOKE, 0.6f }, // grey:   big smoke
+  {vec3f(1.0f, 1.0f, 1.0f), 20, ogl::TEX_MARTIN_BALL2, SPRITE_BALL2, 1.2f }, // blue:   fireball2
+  {vec3f(1.0f, 1.0f, 1.0f), 20, ogl::TEX_MARTIN_BALL3, SPRITE_BALL3, 1.2f }, // green:  fireball3
+  {vec3f(1.0f, 0.1f, 0.1f), 0,  ogl::TEX_MARTIN_SMOKE, SPRITE_SMOKE, 0.2f }, // red:    demotrack
 };
 static const int parttypen = ARRAY_ELEM_NUM(parttypes);
 
+// particles are stored by type as structures of arrays. dead particles are
+// swapped with the last one of their pool so the pools stay packed
+struct particlepool { vector<vec3f> o, d; vector<int> fade, millis; };
+static particlepool pools[parttypen];
+static int particlenum = 0;
+
+/*--------------------------------------------------------------------------
+ - with adaptivequality, the effects follow the gpu time of the frames. the
+ - quality drops when a few frames in a row are over budget and goes back up
+ - after a second well under it. fxaa goes first, then the dynamic lights and
+ - then most of the particles
+ -------------------------------------------------------------------------*/
+VARP(adaptivequality, 0, 0, 1);
+VARP(gpubudget, 1, 12, 100);
+enum { QUALITY_NOPARTICLES, QUALITY_NOLIGHTS, QUALITY_NOFXAA, QUALITY_ALL };
+static const int LOWQUALITYLIGHTS = 8;
+static int quality = QUALITY_ALL;
+
+static void adaptquality() {
+  static int over = 0, under = 0;
+  ogl::measuregpu(adaptivequality != 0);
+  if (!adaptivequality) {
+    quality = QUALITY_ALL;
+    return;
+  }
+  const auto ms = ogl::gpumillis();
+  if (ms < 0.f) return;
+  const auto budget = float(gpubudget);
+  if (ms > budget) {
+    under = 0;
+    if (++over >= 8 && quality > QUALITY_NOPARTICLES) {
+      --quality;
+      over = 0;
+    }
+  } else if (ms < 0.7f*budget) {
+    over = 0;
+    if (++under >= 60 && quality < QUALITY_ALL) {
+      ++quality;
+      under = 0;
+    }
+  } else
+    over = under = 0;
+}
+
+static void addparticle(const vec3f &o, const vec3f &d, int fade, int type, int millis) {
+  const auto limit = quality > QUALITY_NOPARTICLES ? maxparticles : maxparticles/8;
+  if (particlenum >= limit) return;
+  auto &p = pools[type];
+  p.o.add(o);
+  p.d.add(d);
+  p.fade.add(fade);
+  p.millis.add(millis);
+  ++particlenum;
+}
+
+// the pools belong to the frame being submitted. a game thread queues its
+// particles until the next record
+struct particlespawn { vec3f o, d; int fade, type, millis; };
+static vector<particlespawn> spawns;
+
+static void newparticle(const vec3f &o, const vec3f &d, int fade, int type) {
+  const auto millis = int(game::lastmillis());
+  if (!gamethread)
+    addparticle(o, d, fade, type, millis);
+  else if (spawns.length() < maxparticles) {
+    const particlespawn s = {o, d, fade, type, millis};
+    spawns.add(s);
+  }
+}
+
+static void flushspawns() {
+  loopv(spawns) {
+    const auto &s = spawns[i];
+    addparticle(s.o, s.d, s.fade, s.type, s.millis);
+  }
+  spawns.setsize(0);
+}
+
+static void removeparticle(particlepool &p, int i) {
+  p.o[i] = p.o.pop();
+  p.d[i] = p.d.pop();
+  p.fade[i] = p.fade.pop();
+  p.millis[i] = p.millis.pop();
+  --particlenum;
+}
+
+// with instanced arrays and texture arrays, we upload one instance per
+// particle and the vertex shader expands it into a quad. otherwise, the quads
+// are built on the cpu and drawn by type
+#define SHADERNAME particle
+#define VERTEX_PROGRAM "data/shaders/particle_vp.decl"
+#define FRAGMENT_PROGRAM "data/shaders/particle_fp.decl"
+#include "shaderdecl.hxx"
+
 typedef array<float,8> glparticle; // TODO use a more compressed format than that
-static u32 particleibo = 0u, particlevbo = 0u;
+struct glinstance { vec3f pos; float sz; vec3f rgb; float layer; };
+static u32 particleibo = 0u, particlevbo = 0u, particlevao = 0u, particletex = 0u;
 static const int glindexn = 6*MAXPARTICLES, glvertexn = 4*MAXPARTICLES;
 static glparticle *glparts = NULL;
+static glinstance *glpartinst = NULL;
+static bool instancedparticles = false;
 
 static void initparticles(void) {
+  if (ogl::hasIA) particletex = ogl::installtexarray(spritenames, SPRITENUM);
+  instancedparticles = particletex != 0u;
+  if (instancedparticles) {
+    ogl::genbuffers(1, &particlevbo);
+    ogl::bindbuffer(ogl::ARRAY_BUFFER, particlevbo);
+    OGL(BufferData, GL_ARRAY_BUFFER, MAXPARTICLES*sizeof(glinstance), NULL, GL_STREAM_DRAW);
+    ogl::bindbuffer(ogl::ARRAY_BUFFER, 0);
+    const ogl::vertexattrib attribs[] = {
+      {ogl::ATTRIB_POS0, 4, GL_FLOAT, 0, false},
+      {ogl::ATTRIB_COL, 4, GL_FLOAT, sizeof(float[4]), false}
+    };
+    particlevao = ogl::makevertexarray(attribs, 2, sizeof(glinstance), particlevbo);
+    ogl::bindvertexarray(particlevao);
+    OGL(VertexAttribDivisor, ogl::ATTRIB_POS0, 1);
+    OGL(VertexAttribDivisor, ogl::ATTRIB_COL, 1);
+    ogl::bindvertexarray(0);
+    glpartinst = NEWAE(glinstance, MAXPARTICLES);
+    return;
+  }
+
   // indices never change we set them once here
-  const u16 twotriangles[] = {0,1,2,2,3,1};
-  u16 *indices = NEWAE(u16, glindexn);
+  const u32 twotriangles[] = {0,1,2,2,3,1};
+  u32 *indices = NEWAE(u32, glindexn);
   ogl::genbuffers(1, &particleibo);
   ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, particleibo);
   loopi(MAXPARTICLES) loopj(6) indices[6*i+j]=4*i+twotriangles[j];
-  OGL(BufferData, GL_ELEMENT_ARRAY_BUFFER, glindexn*sizeof(u16), indices, GL_STATIC_DRAW);
+  OGL(BufferData, GL_ELEMENT_ARRAY_BUFFER, glindexn*sizeof(u32), indices, GL_STATIC_DRAW);
   ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, 0);
 
   // vertices will be created at each drawing call
@@ -81,98 +207,181 @@ static void initparticles(void) {
   OGL(BufferData, GL_ARRAY_BUFFER, glvertexn*sizeof(glparticle), NULL, GL_DYNAMIC_DRAW);
   ogl::bindbuffer(ogl::ARRAY_BUFFER, 0);
   SAFE_DELA(indices);
+  const ogl::vertexattrib attribs[] = {
+    {ogl::ATTRIB_COL, 3, GL_FLOAT, 0, false},
+    {ogl::ATTRIB_TEX0, 2, GL_FLOAT, sizeof(float[3]), false},
+    {ogl::ATTRIB_POS0, 3, GL_FLOAT, sizeof(float[5]), false}
+  };
+  particlevao = ogl::makevertexarray(attribs, 3, sizeof(glparticle), particlevbo, particleibo);
 
   // Init the array dynamically since VS2012 crashes with a static declaration
   glparts = NEWAE(glparticle, glvertexn);
 }
 
-#if !defined(RELEASE)
-static void cleanparticles(void) {
-  if (particleibo) {
-    ogl::deletebuffers(1, &particleibo);
-    particleibo = 0;
+// pools are split in chunks simulated in parallel. each chunk writes the
+// indices of its dead particles in its own range of partdead
+struct particlechunk { int type, first, num, deadnum; };
+static vector<particlechunk> partchunks;
+static vector<int> partdead;
+static int partbase[parttypen], partnum[parttypen];
+
+// the particles are simulated and copied into the vertex buffer by a task
+// started with the frame. this overlaps with the submission of the g-buffer
+// and we only wait for it right before drawing the particles
+struct particletask : public task {
+  INLINE particletask(int time, u32 chunknum) :
+    task("particletask", chunknum, 1), time(time)
+  {
+    right = vec3f(view.mvmat.vx.x,view.mvmat.vy.x,view.mvmat.vz.x);
+    up = vec3f(view.mvmat.vx.y,view.mvmat.vy.y,view.mvmat.vz.y);
   }
-  if (particlevbo) {
-    ogl::deletebuffers(1, &particlevbo);
-    particlevbo = 0;
-  }
-  SAFE_DELA(glparts);
-}
-#endif
-
-static void render_particles(int time) {
-  if (demo::playing() && demotracking) {
-    const vec3f nom(0, 0, 0);
-    newparticle(game::player1->o, nom, 100000000, 8);
-  }
-
-  // bucket sort the particles
-  u32 partbucket[parttypen], partbucketsize[parttypen];
-  loopi(parttypen) partbucketsize[i] = 0;
-  for (particle *p, **pp = &parlist; (p = *pp);) {
-    pp = &p->next;
-    partbucketsize[p->type]++;
-  }
-  partbucket[0] = 0;
-  loopi(parttypen-1) partbucket[i+1] = partbucket[i]+partbucketsize[i];
-
-  // copy the particles to the vertex buffer
-  int numrender = 0;
-  const vec3f right(game::mvmat.vx.x,game::mvmat.vy.x,game::mvmat.vz.x);
-  const vec3f up(game::mvmat.vx.y,game::mvmat.vy.y,game::mvmat.vz.y);
-  for (particle *p, **pp = &parlist; (p = *pp);) {
-    const u32 index = 4*partbucket[p->type]++;
-    const auto *pt = &parttypes[p->type];
+  virtual void run(u32 idx) {
+    auto &c = partchunks[idx];
+    auto &p = pools[c.type];
+    const auto pt = &parttypes[c.type];
     const auto sz = pt->sz*particlesize/100.0f;
-    glparts[index+0] = glparticle(pt->rgb, 0.f, 1.f, p->o-(right-up)*sz);
-    glparts[index+1] = glparticle(pt->rgb, 1.f, 1.f, p->o+(right+up)*sz);
-    glparts[index+2] = glparticle(pt->rgb, 0.f, 0.f, p->o-(right+up)*sz);
-    glparts[index+3] = glparticle(pt->rgb, 1.f, 0.f, p->o-(up-right)*sz);
-    if (numrender++>maxparticles || (p->fade -= time)<0) {
-      *pp = p->next;
-      p->next = parempty;
-      parempty = p;
-    } else {
+    const auto base = partbase[c.type];
+    const auto dead = &partdead[base+c.first];
+    c.deadnum = 0;
+    range(i, c.first, c.first+c.num) {
+      auto &o = p.o[i];
+      if (instancedparticles) {
+        const glinstance inst = {o, sz, pt->rgb, float(pt->layer)};
+        glpartinst[base+i] = inst;
+      } else {
+        const auto index = 4*(base+i);
+        glparts[index+0] = glparticle(pt->rgb, 0.f, 1.f, o-(right-up)*sz);
+        glparts[index+1] = glparticle(pt->rgb, 1.f, 1.f, o+(right+up)*sz);
+        glparts[index+2] = glparticle(pt->rgb, 0.f, 0.f, o-(right+up)*sz);
+        glparts[index+3] = glparticle(pt->rgb, 1.f, 0.f, o-(up-right)*sz);
+      }
+      if ((p.fade[i] -= time) < 0) {
+        dead[c.deadnum++] = i;
+        continue;
+      }
       if (pt->gr)
-        p->o.z -= float(((game::lastmillis()-p->millis)/3.0)*game::curtime()/(double(pt->gr)*10000));
-      vec3f a = p->d;
+        o.z -= float(((view.lastmillis-p.millis[i])/3.0)*view.curtime/(double(pt->gr)*10000));
+      vec3f a = p.d[i];
       a *= float(time);
       a /= 20000.f;
-      p->o += a;
-      pp = &p->next;
+      o += a;
     }
   }
+  vec3f right, up;
+  int time;
+};
+static ref<particletask> particlejob;
+
+// indices are removed in decreasing order in each pool such that the last
+// particle swapped into a dead slot is always alive
+static void finishparticles(void) {
+  particlejob->wait();
+  loopvrev(partchunks) {
+    const auto &c = partchunks[i];
+    const auto dead = &partdead[partbase[c.type]+c.first];
+    for (int j = c.deadnum-1; j >= 0; --j) removeparticle(pools[c.type], dead[j]);
+  }
+}
+
+static void startparticles(int time) {
+  if (particlejob) finishparticles();
+  partchunks.setsize(0);
+  partdead.setsize(particlenum, noinitialize);
+  int base = 0;
+  loopi(parttypen) {
+    const auto n = pools[i].o.length();
+    partbase[i] = base;
+    partnum[i] = n;
+    for (int first = 0; first < n; first += PARTICLECHUNK) {
+      const particlechunk c = {i, first, min(n-first, PARTICLECHUNK), 0};
+      partchunks.add(c);
+    }
+    base += n;
+  }
+  if (partchunks.length() == 0) {
+    particlejob = nil;
+    return;
+  }
+  particlejob = NEWTASK(particletask, time, partchunks.length());
+  particlejob->scheduled();
+}
+
+static void render_particles(void) {
+  if (!particlejob) return;
+  finishparticles();
+  const auto right = particlejob->right, up = particlejob->up;
+  const auto num = partbase[parttypen-1]+partnum[parttypen-1];
+  particlejob = nil;
 
   // render all of them now
-  ogl::bindfixedshader(ogl::FIXED_DIFFUSETEX|ogl::FIXED_COLOR);
-  partbucket[0] = 0;
-  loopi(parttypen-1) partbucket[i+1] = partbucket[i]+partbucketsize[i];
-  OGL(DepthMask, GL_FALSE);
+  ogl::depthmask(false);
   ogl::enable(GL_BLEND);
-  OGL(BlendFunc, GL_SRC_ALPHA, GL_SRC_ALPHA);
-  ogl::setattribarray()(ogl::ATTRIB_POS0, ogl::ATTRIB_COL, ogl::ATTRIB_TEX0);
+  ogl::blendfunc(GL_SRC_ALPHA, GL_SRC_ALPHA);
   ogl::bindbuffer(ogl::ARRAY_BUFFER, particlevbo);
-  ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, particleibo);
-  OGL(BufferSubData, GL_ARRAY_BUFFER, 0, numrender*sizeof(glparticle[4]), glparts);
-  OGL(VertexAttribPointer, ogl::ATTRIB_COL, 3, GL_FLOAT, 0, sizeof(glparticle), (const void*)0);
-  OGL(VertexAttribPointer, ogl::ATTRIB_TEX0, 2, GL_FLOAT, 0, sizeof(glparticle), (const void*)sizeof(float[3]));
-  OGL(VertexAttribPointer, ogl::ATTRIB_POS0, 3, GL_FLOAT, 0, sizeof(glparticle), (const void*)sizeof(float[5]));
-  loopi(parttypen) {
-    if (partbucketsize[i] == 0) continue;
-    const auto pt = &parttypes[i];
-    const int n = partbucketsize[i]*6;
-    ogl::bindtexture(GL_TEXTURE_2D, ogl::coretex(pt->tex));
-    const auto offset = (const void *) (partbucket[i] * sizeof(u16[6]));
-    ogl::fixedflush();
-    ogl::drawelements(GL_TRIANGLES, n, GL_UNSIGNED_SHORT, offset);
+  if (instancedparticles) {
+    OGL(BufferData, GL_ARRAY_BUFFER, MAXPARTICLES*sizeof(glinstance), NULL, GL_STREAM_DRAW);
+    OGL(BufferSubData, GL_ARRAY_BUFFER, 0, num*sizeof(glinstance), glpartinst);
+    ogl::bindshader(particle::s);
+    ogl::uniformmatrix4fv(particle::s.u_mvp, 1, false, &view.mvpmat.vx.x);
+    ogl::uniform3fv(particle::s.u_right, 1, &right.x);
+    ogl::uniform3fv(particle::s.u_up, 1, &up.x);
+    ogl::bindtexture(GL_TEXTURE_2D_ARRAY, particletex);
+    ogl::bindvertexarray(particlevao);
+    OGL(DrawArraysInstanced, GL_TRIANGLE_STRIP, 0, 4, num);
+  } else {
+    OGL(BufferSubData, GL_ARRAY_BUFFER, 0, num*sizeof(glparticle[4]), glparts);
+    ogl::bindfixedshader(ogl::FIXED_DIFFUSETEX|ogl::FIXED_COLOR);
+    ogl::bindvertexarray(particlevao);
+    loopi(parttypen) {
+      if (partnum[i] == 0) continue;
+      const auto offset = (const void *) (partbase[i] * sizeof(u32[6]));
+      ogl::bindtexture(GL_TEXTURE_2D, ogl::coretex(parttypes[i].tex));
+      ogl::fixedflush();
+      ogl::drawelements(GL_TRIANGLES, partnum[i]*6, GL_UNSIGNED_INT, offset);
+    }
   }
 
+  ogl::bindvertexarray(0);
   ogl::bindbuffer(ogl::ARRAY_BUFFER, 0);
-  ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, 0);
   ogl::disable(GL_BLEND);
-  OGL(DepthMask, GL_TRUE);
+  ogl::depthmask(true);
 }
 
+#if !defined(RELEASE)
+static void cleanparticles(void) {
+  if (particlejob) finishparticles();
+  particlejob = nil;
+  if (particleibo) {
+    ogl::deletebuffers(1, &particleibo);
+    particleibo = 0;
+  }
+  if (particlevbo) {
+    ogl::deletebuffers(1, &particlevbo);
+    particlevbo = 0;
+  }
+  if (particlevao) {
+    ogl::deletevertexarrays(1, &particlevao);
+    particlevao = 0;
+  }
+  if (particletex) {
+    ogl::deletetextures(1, &particletex);
+    particletex = 0;
+  }
+  SAFE_DELA(glparts);
+  SAFE_DELA(glpartinst);
+  loopi(parttypen) {
+    pools[i].o.destroy();
+    pools[i].d.destroy();
+    pools[i].fade.destroy();
+    pools[i].millis.destroy();
+  }
+  partchunks.destroy();
+  partdead.destroy();
+  spawns.destroy();
+  particlenum = 0;
+}
+#endif
+
 void particle_splash(int type, int num, int fade, const vec3f &p) {
   loopi(num) {
     const int radius = type==5 ? 50 : 150;
@@ -237,9 +446,10 @@ void drawicon(float tx, float ty, float x, float y) {
 }
 
 void blendbox(float x1, float y1, float x2, float y2, bool border) {
+  text::flush();
   ogl::enablev(GL_BLEND);
-  OGL(DepthMask, GL_FALSE);
-  OGL(BlendFunc, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+  ogl::depthmask(false);
+  ogl::blendfunc(GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
   ogl::setattribarray()(ogl::ATTRIB_POS0);
   ogl::bindfixedshader(ogl::FIXED_COLOR);
   if (border)
@@ -254,9 +464,138 @@ void blendbox(float x1, float y1, float x2, float y2, bool border) {
   const float verts1[] = {x1, y1, x2, y1, x2, y2, x1, y2};
   ogl::immdraw("Lp2", 4, verts1);
 
-  OGL(DepthMask, GL_TRUE);
+  ogl::depthmask(true);
   ogl::enablev(GL_BLEND);
-  OGL(BlendFunc, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  ogl::blendfunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+/*--------------------------------------------------------------------------
+ - timeline of the profiler zones of the last frame. one band per thread
+ - with one row per zone depth. zones are colored by name. the allocations
+ - of the frame and their busiest sites (with q.profallocs) are above it
+ -------------------------------------------------------------------------*/
+VAR(profoverlay, 0, 0, 1);
+static const u32 OVERLAYZONENUM = 2048;
+static u32 zonecolor(const char *name) {
+  u32 h = 0;
+  for (auto c = name; *c; ++c) h = h*31u + u32(*c);
+  return ui::rgba(u8(64+(h&127)), u8(64+((h>>8)&127)), u8(64+((h>>16)&127)), 200);
+}
+
+static void drawallocsites(const vec2f &scr) {
+  const sys::memsite *sites;
+  const auto n = profiler::lastframesites(sites);
+  const auto rowh = text::fontdim().y;
+  const auto x = int(0.5f*scr.x);
+  auto y = 0.1f*scr.y;
+  loopi(s32(n)) {
+    const fixedstring line(fmt, "%5u allocs %8llu bytes %s:%d", sites[i].num,
+                           (unsigned long long) sites[i].bytes,
+                           sites[i].file, sites[i].linenum);
+    ui::drawtext(x, int(y), ui::ALIGN_LEFT, line.c_str(), ui::rgba(255,255,255));
+    y += rowh;
+  }
+}
+
+static void drawprofiler(const vec2f &scr) {
+  if (!profoverlay) return;
+  u64 begin, end;
+  profiler::lastframe(begin, end);
+  if (end <= begin) return;
+  static profiler::zone zones[OVERLAYZONENUM];
+  const auto rowh = text::fontdim().y;
+  const auto x0 = 0.05f*scr.x, w = 0.9f*scr.x;
+  const auto scale = w/float(end-begin);
+  const auto white = ui::rgba(255,255,255);
+  auto y = 0.9f*scr.y;
+  ui::beginframe(0, 0, 0, 0);
+  const fixedstring frametext(fmt, "frame %.2f ms %llu allocs", double(end-begin)*1e-6,
+                              (unsigned long long) profiler::lastframeallocs());
+  ui::drawtext(int(x0), int(y), ui::ALIGN_LEFT, frametext.c_str(), white);
+  drawallocsites(scr);
+  const auto threadnum = profiler::zoneson() ? profiler::zonethreadnum() : 0;
+  loopi(s32(threadnum)) {
+    const auto n = profiler::getzones(i, begin, end, zones, OVERLAYZONENUM);
+    if (n == 0) continue;
+    y -= rowh;
+    ui::drawtext(int(x0), int(y), ui::ALIGN_LEFT, profiler::zonethreadname(i), white);
+    u32 depth = 0;
+    loopj(s32(n)) {
+      const auto &z = zones[j];
+      depth = max(depth, z.depth+1);
+      const auto zbegin = max(z.begin, begin);
+      const auto zx = x0 + float(zbegin-begin)*scale;
+      const auto zw = float(z.end-zbegin)*scale;
+      if (zw < 1.f) continue;
+      const auto zy = y - float(z.depth+1)*rowh;
+      ui::drawrect(zx, zy, zw, rowh-1.f, zonecolor(z.name));
+      if (zw > text::width(z.name)+4.f)
+        ui::drawtext(int(zx+2.f), int(zy), ui::ALIGN_LEFT, z.name, white);
+    }
+    y -= float(depth)*rowh + 0.5f*rowh;
+  }
+  ui::draw(int(scr.x), int(scr.y));
+  ui::endframe();
+}
+
+/*--------------------------------------------------------------------------
+ - live memory use of each tag. tags above their budget are shown in red
+ -------------------------------------------------------------------------*/
+VAR(memoverlay, 0, 0, 1);
+static void memreport() {
+  loopi(s32(sys::MEM_TAGNUM)) {
+    const auto stat = sys::memtagstats(i);
+    const auto over = stat.budget != 0 && stat.used > stat.budget;
+    con::out("mem: %-8s %9.2f MB peak %9.2f MB budget %9.2f MB huge pages %9.2f MB%s",
+             sys::memtagname(i), double(stat.used)/(1024.0*1024.0),
+             double(stat.peak)/(1024.0*1024.0),
+             double(stat.budget)/(1024.0*1024.0),
+             double(stat.huge)/(1024.0*1024.0), over ? " (over)" : "");
+  }
+  con::out("mem: total    %9.2f MB peak %9.2f MB huge pages backed %9.2f MB",
+           double(sys::memused())/(1024.0*1024.0),
+           double(sys::mempeak())/(1024.0*1024.0),
+           double(sys::memhugeresident())/(1024.0*1024.0));
+}
+CMD(memreport);
+
+// budget in megabytes of the given tag. 0 removes it
+static void membudget(const char *name, int mb) {
+  loopi(s32(sys::MEM_TAGNUM)) if (!strcmp(name, sys::memtagname(i))) {
+    sys::memsetbudget(i, u64(max(mb,0))*1024*1024);
+    return;
+  }
+  con::out("mem: unknown memory tag %s", name);
+}
+CMD(membudget);
+
+// the big arrays of the bvh, the meshes and the iso fields on huge pages.
+// blocks already allocated keep their pages
+static void sethugepages(bool on) {
+  sys::memsethugepages(sys::MEM_BVH, on);
+  sys::memsethugepages(sys::MEM_GEOM, on);
+  sys::memsethugepages(sys::MEM_ISO, on);
+}
+VARF(hugepages, 0, 1, 1, sethugepages(hugepages != 0));
+
+static void drawmemory(const vec2f &scr) {
+  if (!memoverlay) return;
+  const auto rowh = text::fontdim().y;
+  const auto x = int(0.05f*scr.x);
+  auto y = 0.1f*scr.y;
+  ui::beginframe(0, 0, 0, 0);
+  loopi(s32(sys::MEM_TAGNUM)) {
+    const auto stat = sys::memtagstats(i);
+    const auto over = stat.budget != 0 && stat.used > stat.budget;
+    const fixedstring line(fmt, "%-8s %8.2f MB (peak %8.2f MB)",
+                           sys::memtagname(i), double(stat.used)/(1024.0*1024.0),
+                           double(stat.peak)/(1024.0*1024.0));
+    ui::drawtext(x, int(y), ui::ALIGN_LEFT, line.c_str(),
+                 over ? ui::rgba(255,64,64) : ui::rgba(255,255,255));
+    y += rowh;
+  }
+  ui::draw(int(scr.x), int(scr.y));
+  ui::endframe();
 }
 
 /*--------------------------------------------------------------------------
@@ -268,7 +607,7 @@ static void drawhud(int w, int h, int curfps) {
   const auto fontdim = text::fontdim();
   ogl::enablev(GL_BLEND);
   ogl::disable(GL_DEPTH_TEST);
-  OGL(BlendFunc, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  ogl::blendfunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
   pushscreentransform();
   text::displaywidth(text::fontdim().x);
   OGL(VertexAttrib4f,ogl::ATTRIB_COL,1.f,1.f,1.f,1.f);
@@ -284,6 +623,8 @@ static void drawhud(int w, int h, int curfps) {
     text::drawf("%i f/s", textpos, curfps);
     ogl::printtimers(text::fontdim().x, con::height());
   }
+  drawprofiler(scr);
+  drawmemory(scr);
   menu::render();
 
   if (game::player1->state==CS_ALIVE) {
@@ -299,6 +640,7 @@ static void drawhud(int w, int h, int curfps) {
     text::drawf("%d", lifepos+textpos, pl->health);
     if (pl->armour) text::drawf("%d", armorpos+textpos, pl->armour);
     text::drawf("%d", ammopos+textpos, pl->ammo[pl->gunselect]);
+    text::flush();
     ogl::disablev(GL_BLEND);
     drawicon(128, 128, lifepos.x, lifepos.y);
     if (pl->armour)
@@ -314,6 +656,7 @@ static void drawhud(int w, int h, int curfps) {
     text::resetdefaultwidth();
   }
 
+  text::flush();
   ogl::disablev(GL_BLEND);
   popscreentransform();
   ogl::enable(GL_DEPTH_TEST);
@@ -323,24 +666,26 @@ static void drawhud(int w, int h, int curfps) {
  - handle the HUD gun
  -------------------------------------------------------------------------*/
 static const char *hudgunnames[] = {
-  "hudguns/fist",
-  "hudguns/shotg",
-  "hudguns/chaing",
-  "hudguns/rocket",
-  "hudguns/rifle"
+  "hudguns/fist", "hudguns/shotg", "hudguns/chaing", "hudguns/rocket", "hudguns/rifle"
 };
+static md2::handle hudguns[ARRAY_ELEM_NUM(hudgunnames)];
+static bool hudgunsresolved = false;
 VARP(showhudgun, 0, 1, 1);
 
 static void drawhudmodel(int start, int end, float speed, int base) {
+  if (!hudgunsresolved) {
+    loopi(s32(ARRAY_ELEM_NUM(hudgunnames))) hudguns[i] = md2::gethandle(istring(hudgunnames[i]));
+    hudgunsresolved = true;
+  }
   const auto pl = game::player1;
   const auto norxfm = mat3x3f::rotate(-pl->ypr.x, vec3f(0.f,1.f,0.f))
                     * mat3x3f::rotate(-pl->ypr.y, vec3f(1.f,0.f,0.f))
                     * mat3x3f::rotate(-pl->ypr.z, vec3f(0.f,0.f,1.f));
-  md2::render(hudgunnames[pl->gunselect], start, end,
+  md2::render(hudguns[pl->gunselect], start, end,
               mat4x4f(one), norxfm, false, 1.0f, speed, 0, float(base));
 }
 
-static void drawhudgun(float fovy, float aspect, float farplane) {
+static void drawhudgun() {
   if (!showhudgun) return;
   const int rtime = game::reloadtime(game::player1->gunselect);
   if (game::player1->lastaction &&
@@ -356,9 +701,16 @@ static void drawhudgun(float fovy, float aspect, float farplane) {
  -------------------------------------------------------------------------*/
 #define SPLITNUM 4
 
+// the encoding has to be known before gbuffer.glsl is included
+VAR(packedgbuffer, 0, 1, 1);
+static void gbufferrules(ogl::shaderrules &frag) {
+  if (packedgbuffer) frag.insert(0, NEWSTRING("#define PACKEDGBUFFER\n"));
+}
+
 static void deferredrules(ogl::shaderrules &vert, ogl::shaderrules &frag, u32 rule) {
   fixedstring str(fmt, "#define LIGHTNUM %d\n", rule+1);
   frag.insert(0, NEWSTRING(str.c_str()));
+  gbufferrules(frag);
   frag.add(NEWSTRING("vec3 shade(vec3 pos, vec3 nor) {\n"));
   frag.add(NEWSTRING("  vec3 outcol = diffuse(pos,nor,u_lightpos[0],u_lightpow[0]);\n"));
   loopi(int(rule)) {
@@ -380,8 +732,38 @@ static void rules(ogl::shaderrules &vert, ogl::shaderrules &frag, u32 rule) {
   fixedstring str(fmt, "#define SPLITNUM %f\n", float(SPLITNUM));
   vert.add(NEWSTRING(str.c_str()));
   frag.add(NEWSTRING(str.c_str()));
+  gbufferrules(frag);
+}
+
+// lights are binned in screen tiles
+static const int TILESIZE = 16;
+static void tiledrules(ogl::shaderrules &vert, ogl::shaderrules &frag, u32 rule) {
+  fixedstring str(fmt, "#define TILESIZE %d\n", TILESIZE);
+  frag.add(NEWSTRING(str.c_str()));
+  gbufferrules(frag);
+}
+
+#define RULES tiledrules
+#define SHADERNAME tiled_deferred
+#define VERTEX_PROGRAM "data/shaders/deferred_vp.decl"
+#define FRAGMENT_PROGRAM "data/shaders/tiled_deferred_fp.decl"
+#include "shaderdecl.hxx"
+#undef RULES
+
+// the depth buffer is reduced in blocks of pixels for occlusion culling
+static const int HIZSIZE = 8;
+static void hizrules(ogl::shaderrules &vert, ogl::shaderrules &frag, u32 rule) {
+  fixedstring str(fmt, "#define HIZSIZE %d\n", HIZSIZE);
+  frag.add(NEWSTRING(str.c_str()));
 }
 
+#define RULES hizrules
+#define SHADERNAME hiz
+#define VERTEX_PROGRAM "data/shaders/deferred_vp.decl"
+#define FRAGMENT_PROGRAM "data/shaders/hiz_fp.decl"
+#include "shaderdecl.hxx"
+#undef RULES
+
 #define RULES rules
 #define SHADERNAME split_deferred
 #define VERTEX_PROGRAM "data/shaders/split_deferred_vp.decl"
@@ -408,6 +790,16 @@ static void rules(ogl::shaderrules &vert, ogl::shaderrules &frag, u32 rule) {
 #define FRAGMENT_PROGRAM "data/shaders/noise_material_fp.decl"
 #include "shaderdecl.hxx"
 
+#define SHADERNAME packed_simple_material
+#define VERTEX_PROGRAM "data/shaders/packed_material_vp.decl"
+#define FRAGMENT_PROGRAM "data/shaders/simple_material_fp.decl"
+#include "shaderdecl.hxx"
+
+#define SHADERNAME packed_noise_material
+#define VERTEX_PROGRAM "data/shaders/packed_material_vp.decl"
+#define FRAGMENT_PROGRAM "data/shaders/noise_material_fp.decl"
+#include "shaderdecl.hxx"
+
 #define SHADERNAME fxaa
 #define VERTEX_PROGRAM "data/shaders/fxaa_vp.decl"
 #define FRAGMENT_PROGRAM "data/shaders/fxaa_fp.decl"
@@ -426,7 +818,7 @@ static void texbufrules(ogl::shaderrules &vert, ogl::shaderrules &frag, u32) {
 
 static void shadertoyrules(ogl::shaderrules &vert, ogl::shaderrules &frag, u32) {
   if (ogl::loadfromfile()) {
-    auto s = sys::loadfile("data/shaders/hell.glsl");
+    auto s = pack::loadfile("data/shaders/hell.glsl");
     assert(s);
     frag.add(s);
   } else
@@ -440,13 +832,35 @@ static void shadertoyrules(ogl::shaderrules &vert, ogl::shaderrules &frag, u32)
 #include "shaderdecl.hxx"
 #undef RULES
 
+// timer names are interned once and looked up by id every frame
+static const istring gbuffertimername("gbuffer"), deferredtimername("deferred");
+static const istring fxaatimername("fxaa"), shadertoytimername("shadertoy");
+static const istring rttimername("rt"), hudtimername("hud");
+
 static u32 gdepthtex, gnortex, gdiffusetex, finaltex;
 static u32 gbuffer, shadedbuffer;
 
+// reduced depth of the world read back in a ring of pixel buffers. each one
+// keeps the matrix its depth was rendered with
+static const int HIZBUFNUM = 3;
+static struct hizreadback {
+  u32 pbo;
+  GLsync fence;
+  mat4x4f mvp;
+} hizbuf[HIZBUFNUM];
+static u32 hiztex, hizbuffer;
+static int hizw, hizh, hizcurr;
+
 static void initdeferred() {
-  // all textures
-  gnortex = ogl::maketex("TB I3 D3 Br Wse Wte mn Mn", NULL, sys::scrw, sys::scrh);
-  gdiffusetex = ogl::maketex("TB I3 D3 Br Wse Wte mn Mn", NULL, sys::scrw, sys::scrh);
+  // all textures. the packed gbuffer has rg16 normals and rgba8 diffuse with
+  // the material. positions are always rebuilt from the depth
+  if (packedgbuffer) {
+    gnortex = ogl::maketex("TS Ig Dg Br Wse Wte mn Mn", NULL, sys::scrw, sys::scrh);
+    gdiffusetex = ogl::maketex("TB I4 D4 Br Wse Wte mn Mn", NULL, sys::scrw, sys::scrh);
+  } else {
+    gnortex = ogl::maketex("TB I3 D3 Br Wse Wte mn Mn", NULL, sys::scrw, sys::scrh);
+    gdiffusetex = ogl::maketex("TB I3 D3 Br Wse Wte mn Mn", NULL, sys::scrw, sys::scrh);
+  }
   finaltex = ogl::maketex("TB I3 D3 B2 Wse Wte ml Ml", NULL, sys::scrw, sys::scrh);
   gdepthtex = ogl::maketex("Tf Id Dd Br Wse Wte mn Mn", NULL, sys::scrw, sys::scrh);
 
@@ -466,6 +880,26 @@ static void initdeferred() {
   if (GL_FRAMEBUFFER_COMPLETE != ogl::CheckFramebufferStatus(GL_FRAMEBUFFER))
     sys::fatal("renderer: unable to init debug unsplit framebuffer");
   OGL(BindFramebuffer, GL_FRAMEBUFFER, 0);
+
+  // farthest depth of each block of pixels and its readback buffers
+  hizw = (sys::scrw+HIZSIZE-1)/HIZSIZE;
+  hizh = (sys::scrh+HIZSIZE-1)/HIZSIZE;
+  hiztex = ogl::maketex("Tf If Dr B2 Wse Wte mn Mn", NULL, hizw, hizh);
+  ogl::genframebuffers(1, &hizbuffer);
+  OGL(BindFramebuffer, GL_FRAMEBUFFER, hizbuffer);
+  OGL(FramebufferTexture2D, GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hiztex, 0);
+  if (GL_FRAMEBUFFER_COMPLETE != ogl::CheckFramebufferStatus(GL_FRAMEBUFFER))
+    sys::fatal("renderer: unable to init hiz framebuffer");
+  OGL(BindFramebuffer, GL_FRAMEBUFFER, 0);
+  loopi(HIZBUFNUM) {
+    auto &b = hizbuf[i];
+    ogl::genbuffers(1, &b.pbo);
+    ogl::bindbuffer(ogl::PIXEL_PACK_BUFFER, b.pbo);
+    OGL(BufferData, GL_PIXEL_PACK_BUFFER, hizw*hizh*sizeof(float), NULL, GL_STREAM_READ);
+    b.fence = NULL;
+  }
+  ogl::bindbuffer(ogl::PIXEL_PACK_BUFFER, 0);
+  hizcurr = 0;
 }
 
 #if !defined(RELEASE)
@@ -476,19 +910,78 @@ static void cleandeferred() {
   if (finaltex) ogl::deletetextures(1, &finaltex);
   if (gbuffer) ogl::deleteframebuffers(1, &gbuffer);
   if (shadedbuffer) ogl::deleteframebuffers(1, &shadedbuffer);
+  if (hiztex) ogl::deletetextures(1, &hiztex);
+  if (hizbuffer) ogl::deleteframebuffers(1, &hizbuffer);
+  loopi(HIZBUFNUM) {
+    auto &b = hizbuf[i];
+    if (b.fence) OGL(DeleteSync, b.fence);
+    if (b.pbo) ogl::deletebuffers(1, &b.pbo);
+    b.fence = NULL;
+    b.pbo = 0;
+  }
 }
 #endif
 
-static u32 rttex, rtpbo;
+// ring of buffers for the ray traced frames: frame n+1 is traced while the
+// gpu still reads frame n. with buffer storage, they stay persistently
+// mapped. otherwise, they are orphaned and mapped every frame
+static const u32 RTBUFNUM = 3;
+static struct rtbuffer {
+  u32 pbo;
+  GLsync fence;
+  void *ptr;
+} rtbuf[RTBUFNUM];
+static u32 rttex, rtcurr, rtbufsize;
+static bool rtpersistent = false;
+
+static INLINE u32 rttarget() {
+  return ogl::hasTB ? ogl::TEXTURE_BUFFER : ogl::PIXEL_UNPACK_BUFFER;
+}
+static INLINE GLenum rtgltarget() {
+  return ogl::hasTB ? GL_TEXTURE_BUFFER : GL_PIXEL_UNPACK_BUFFER;
+}
+
+static void creatertbuffers(u32 size) {
+  const auto target = rttarget(), gltarget = rtgltarget();
+  const GLbitfield flags = GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+  rtpersistent = ogl::hasBS;
+  loopi(RTBUFNUM) {
+    auto &b = rtbuf[i];
+    ogl::genbuffers(1, &b.pbo);
+    ogl::bindbuffer(target, b.pbo);
+    b.fence = NULL;
+    b.ptr = NULL;
+    if (rtpersistent) {
+      OGL(BufferStorage, gltarget, size, NULL, flags);
+      OGLR(b.ptr, MapBufferRange, gltarget, 0, size, flags);
+      assert(b.ptr != NULL);
+    } else
+      OGL(BufferData, gltarget, size, NULL, GL_STREAM_DRAW);
+  }
+  ogl::bindbuffer(target, 0);
+  rtbufsize = size;
+  rtcurr = 0;
+}
+
+// deleting the buffers also unmaps them
+static void destroyrtbuffers() {
+  loopi(RTBUFNUM) {
+    auto &b = rtbuf[i];
+    if (b.fence) OGL(DeleteSync, b.fence);
+    if (b.pbo) ogl::deletebuffers(1, &b.pbo);
+    b.pbo = 0;
+    b.fence = NULL;
+    b.ptr = NULL;
+  }
+  rtbufsize = 0;
+}
+
 static void initrt() {
   const auto dim = scrdim();
   auto w = dim.x, h = dim.y;
-  // no texture buffer here
+  // no texture buffer here. buffers are uploaded into a texture
   if (!ogl::hasTB) {
-    ogl::genbuffers(1, &rtpbo);
     ogl::gentextures(1, &rttex);
-    ogl::bindbuffer(ogl::PIXEL_UNPACK_BUFFER, rtpbo);
-    OGL(BufferData,GL_PIXEL_UNPACK_BUFFER, w * h * sizeof(u32), NULL, GL_STATIC_DRAW);
     ogl::bindtexture(GL_TEXTURE_2D, rttex, 0);
     OGL(TexImage2D,GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_BGRA, GL_UNSIGNED_BYTE, 0);
     OGL(PixelStorei,GL_UNPACK_ALIGNMENT, 1);
@@ -497,62 +990,71 @@ static void initrt() {
     OGL(TexParameteri,GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     OGL(TexParameteri,GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     ogl::bindtexture(GL_TEXTURE_2D, 0, 0);
-    ogl::bindbuffer(ogl::PIXEL_UNPACK_BUFFER, 0);
   }
   // faster path. we use a texture buffer for the raytracing output
-  else {
+  else
     ogl::gentextures(1, &rttex);
-    ogl::genbuffers(1, &rtpbo);
-    ogl::bindbuffer(ogl::TEXTURE_BUFFER, rtpbo);
-    OGL(BufferData, GL_TEXTURE_BUFFER, w * h * sizeof(u32), NULL, GL_STATIC_DRAW);
-    ogl::bindbuffer(ogl::TEXTURE_BUFFER, 0);
-  }
+  creatertbuffers(w * h * sizeof(u32));
 }
 
 #if !defined(RELEASE)
 static void cleanrt() {
+  destroyrtbuffers();
   if (rttex) ogl::deletetextures(1, &rttex);
-  if (rtpbo) ogl::deletebuffers(1, &rtpbo);
 }
 #endif
 
-static void *pbomap(u32 pbo) {
+// next buffer of the ring, once the gpu is done with it
+static int *rtmap() {
   const auto dim = scrdim();
+  const u32 size = dim.x * dim.y * sizeof(u32);
+  if (size != rtbufsize) {
+    destroyrtbuffers();
+    creatertbuffers(size);
+  }
+  auto &b = rtbuf[rtcurr];
+  if (b.fence) {
+    GLenum res;
+    do OGLR(res, ClientWaitSync, b.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+    while (res == GL_TIMEOUT_EXPIRED);
+    OGL(DeleteSync, b.fence);
+    b.fence = NULL;
+  }
+  if (rtpersistent) return (int*) b.ptr;
+
+  // orphan the storage such that the driver does not wait for the gpu
+  const auto gltarget = rtgltarget();
   void *ptr;
-  ogl::bindbuffer(ogl::PIXEL_UNPACK_BUFFER, pbo);
-  OGL(BufferData,GL_PIXEL_UNPACK_BUFFER, dim.x * dim.y * 4, NULL, GL_STATIC_DRAW);
-  OGLR(ptr, MapBuffer, GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+  ogl::bindbuffer(rttarget(), b.pbo);
+  OGL(BufferData, gltarget, size, NULL, GL_STREAM_DRAW);
+  OGLR(ptr, MapBufferRange, gltarget, 0, size, GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT);
   assert(ptr != NULL);
-  ogl::bindbuffer(ogl::PIXEL_UNPACK_BUFFER, 0);
-  return ptr;
+  ogl::bindbuffer(rttarget(), 0);
+  return (int*) ptr;
 }
 
-static void pbounmap(u32 pbo, u32 tex) {
+static void rtunmap() {
+  if (rtpersistent) return;
+  ogl::bindbuffer(rttarget(), rtbuf[rtcurr].pbo);
+  OGL(UnmapBuffer, rtgltarget());
+  ogl::bindbuffer(rttarget(), 0);
+}
+
+// the gpu commands reading the current buffer are issued: go to the next one
+static void rtnext() {
+  if (rtpersistent) OGLR(rtbuf[rtcurr].fence, FenceSync, GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  rtcurr = (rtcurr+1) % RTBUFNUM;
+}
+
+static void rtupload(u32 pbo, u32 tex) {
   const auto dim = scrdim();
   ogl::bindbuffer(ogl::PIXEL_UNPACK_BUFFER, pbo);
-  OGL(UnmapBuffer, GL_PIXEL_UNPACK_BUFFER);
   ogl::bindtexture(GL_TEXTURE_2D, tex, 0);
   OGL(TexSubImage2D, GL_TEXTURE_2D, 0, 0, 0, dim.x, dim.y, GL_BGRA, GL_UNSIGNED_BYTE, 0);
   ogl::bindbuffer(ogl::PIXEL_UNPACK_BUFFER, 0);
   ogl::bindtexture(GL_TEXTURE_2D, 0, 0);
 }
 
-static void *texbufmap(u32 texbuf) {
-  const auto dim = scrdim();
-  void *ptr;
-  ogl::bindbuffer(ogl::TEXTURE_BUFFER, texbuf);
-  OGL(BufferData,GL_TEXTURE_BUFFER, dim.x * dim.y * sizeof(u32), NULL, GL_DYNAMIC_DRAW);
-  OGLR(ptr, MapBuffer, GL_TEXTURE_BUFFER, GL_WRITE_ONLY);
-  assert(ptr!=NULL);
-  ogl::bindbuffer(ogl::TEXTURE_BUFFER, 0);
-  return ptr;
-}
-
-static void texbufunmap(u32 texbuf) {
-  ogl::bindbuffer(ogl::TEXTURE_BUFFER, texbuf);
-  OGL(UnmapBuffer, GL_TEXTURE_BUFFER);
-}
-
 /*--------------------------------------------------------------------------
  - sky parameters
  -------------------------------------------------------------------------*/
@@ -568,29 +1070,401 @@ static vec3f getsundir() {
 }
 
 /*--------------------------------------------------------------------------
- - render the complete frame
+ - indirect draws of the world
  -------------------------------------------------------------------------*/
-static u32 scenenorbo = 0u, sceneposbo = 0u, sceneibo = 0u;
-static u32 indexnum = 0u;
-static bool initialized_m = false;
-static geom::segment *segment = NULL;
+// layout expected by glMultiDrawElementsIndirect
+struct drawcommand {
+  u32 count, instancecount, firstindex, basevertex, baseinstance;
+};
+
+// runs of commands sharing the shader and its uniforms. packed vertices are
+// decoded with the chunk box so they need one batch per chunk and material
+struct drawbatch {
+  u32 chunk, first, num;
+  bool simple;
+};
+struct drawlist {
+  vector<drawcommand> cmds;
+  vector<drawbatch> batches;
+};
+static drawlist drawn;
+
+// groups of CULLGRAIN chunks are culled by tasks, each in its own list. the
+// lists are joined in chunk order so the draws do not depend on the
+// scheduling
+static const u32 CULLGRAIN = 16;
+static vector<drawlist> drawlists;
+
+// ring of indirect buffers handled like the ray traced ones: the commands of
+// frame n+1 are written while the gpu still reads the ones of frame n
+static const u32 INDIRECTBUFNUM = 3;
+static struct indirectbuffer {
+  u32 bo;
+  GLsync fence;
+  void *ptr;
+} indirectbuf[INDIRECTBUFNUM];
+static u32 indirectcurr, indirectcap;
+static bool indirectpersistent = false;
+
+static void createindirectbuffers(u32 cap) {
+  const auto size = cap*sizeof(drawcommand);
+  const GLbitfield flags = GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+  indirectpersistent = ogl::hasBS;
+  loopi(INDIRECTBUFNUM) {
+    auto &b = indirectbuf[i];
+    ogl::genbuffers(1, &b.bo);
+    ogl::bindbuffer(ogl::DRAW_INDIRECT_BUFFER, b.bo);
+    b.fence = NULL;
+    b.ptr = NULL;
+    if (indirectpersistent) {
+      OGL(BufferStorage, GL_DRAW_INDIRECT_BUFFER, size, NULL, flags);
+      OGLR(b.ptr, MapBufferRange, GL_DRAW_INDIRECT_BUFFER, 0, size, flags);
+      assert(b.ptr != NULL);
+    } else
+      OGL(BufferData, GL_DRAW_INDIRECT_BUFFER, size, NULL, GL_STREAM_DRAW);
+  }
+  ogl::bindbuffer(ogl::DRAW_INDIRECT_BUFFER, 0);
+  indirectcap = cap;
+  indirectcurr = 0;
+}
+
+static void destroyindirectbuffers() {
+  loopi(INDIRECTBUFNUM) {
+    auto &b = indirectbuf[i];
+    if (b.fence) OGL(DeleteSync, b.fence);
+    if (b.bo) ogl::deletebuffers(1, &b.bo);
+    b.bo = 0;
+    b.fence = NULL;
+    b.ptr = NULL;
+  }
+  indirectcap = 0;
+}
 
-static u32 segmentnum = 0;
+// copy the commands in the next buffer of the ring and leave it bound
+static void uploadindirect(const vector<drawcommand> &cmds) {
+  const u32 num = cmds.length();
+  if (num > indirectcap) {
+    destroyindirectbuffers();
+    createindirectbuffers(max(num, 2*indirectcap));
+  }
+  auto &b = indirectbuf[indirectcurr];
+  if (b.fence) {
+    GLenum res;
+    do OGLR(res, ClientWaitSync, b.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+    while (res == GL_TIMEOUT_EXPIRED);
+    OGL(DeleteSync, b.fence);
+    b.fence = NULL;
+  }
+  const auto size = num*sizeof(drawcommand);
+  ogl::bindbuffer(ogl::DRAW_INDIRECT_BUFFER, b.bo);
+  if (indirectpersistent)
+    memcpy(b.ptr, &cmds[0], size);
+  else {
+    // orphan the storage such that the driver does not wait for the gpu
+    OGL(BufferData, GL_DRAW_INDIRECT_BUFFER, indirectcap*sizeof(drawcommand), NULL, GL_STREAM_DRAW);
+    OGL(BufferSubData, GL_DRAW_INDIRECT_BUFFER, 0, size, &cmds[0]);
+  }
+}
+
+// the draws reading the current buffer are issued: go to the next one
+static void nextindirect() {
+  ogl::bindbuffer(ogl::DRAW_INDIRECT_BUFFER, 0);
+  auto &b = indirectbuf[indirectcurr];
+  if (indirectpersistent) OGLR(b.fence, FenceSync, GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  indirectcurr = (indirectcurr+1) % INDIRECTBUFNUM;
+}
+
+/*--------------------------------------------------------------------------
+ - tiled lighting
+ -------------------------------------------------------------------------*/
+// lights are binned in screen tiles such that the deferred pass only shades
+// a pixel with the lights overlapping its tile. a light stops where its power
+// falls below LIGHTEPS. lights and the grid are read from texture buffers:
+// two texels per light and, for the grid, the offset and number of lights of
+// every tile followed by the light indices
+static const float LIGHTEPS = 1.f/256.f;
+VAR(tiledlighting, 0, 1, 1);
+VAR(indirect, 0, 100, 400); // percent of the baked irradiance
+VAR(distao, 0, 100, 100);   // percent of the distance field occlusion on it
+struct lightsource { vec3f pos, pow; int shadow; };
+static vector<lightsource> lights;
+static vector<vec4f> lightdata;
+static vector<vec4i> lightrects;
+static vector<u32> lightgrid;
+static u32 lightbo = 0u, lightgridbo = 0u, lighttex = 0u, lightgridtex = 0u;
+static int tilew = 0, tileh = 0;
+
+void addlight(const vec3f &pos, const vec3f &pow) {
+  auto &l = lights.add();
+  l.pos = pos;
+  l.pow = pow;
+  l.shadow = 0;
+}
+
+// same but the light is masked by the given bit of the shadow mask
+static void addlight(const vec3f &pos, const vec3f &pow, int shadowbit) {
+  addlight(pos, pow);
+  lights.last().shadow = shadowbit+1;
+}
+
+// the diffuse term decreases like pow/d^3
+static INLINE float lightradius(const vec3f &pow) {
+  return cbrtf(reducemax(pow)/LIGHTEPS);
+}
+
+// the eight corners of the box go through mvp in one batch. false if one of
+// them is behind the near plane. otherwise ndc bounds them after the divide
+static bool projectbox(const mat4x4f &mvp, const aabb &box, aabb &ndc) {
+  vec3f c[8];
+  vec4f p[8];
+  loopi(8) {
+    const auto &p0 = box.pmin, &p1 = box.pmax;
+    c[i] = vec3f(i&1?p1.x:p0.x, i&2?p1.y:p0.y, i&4?p1.z:p0.z);
+  }
+  xfmpoints(mvp, c, p, 8);
+  ndc = aabb::empty();
+  loopi(8) {
+    if (p[i].w <= 1e-3f) return false;
+    const auto q = p[i].xyz()/p[i].w;
+    ndc.pmin = min(ndc.pmin, q);
+    ndc.pmax = max(ndc.pmax, q);
+  }
+  return true;
+}
+
+// tiles covered by the projected bounding box of the light sphere. lights
+// crossing the near plane cover the whole screen
+static bool lighttiles(const mat4x4f &mvp, const vec3f &pos, float r,
+                       int w, int h, vec4i &rect) {
+  aabb ndc;
+  if (!projectbox(mvp, aabb(pos-vec3f(r), pos+vec3f(r)), ndc)) {
+    rect = vec4i(0, 0, tilew-1, tileh-1);
+    return true;
+  }
+  const auto xmin = ndc.pmin.x, ymin = ndc.pmin.y;
+  const auto xmax = ndc.pmax.x, ymax = ndc.pmax.y;
+  if (xmax < -1.f || ymax < -1.f || xmin > 1.f || ymin > 1.f) return false;
+  const auto sx = 0.5f*float(w), sy = 0.5f*float(h);
+  const auto x0 = int((clamp(xmin,-1.f,1.f)+1.f)*sx), x1 = int((clamp(xmax,-1.f,1.f)+1.f)*sx);
+  const auto y0 = int((clamp(ymin,-1.f,1.f)+1.f)*sy), y1 = int((clamp(ymax,-1.f,1.f)+1.f)*sy);
+  rect = vec4i(x0/TILESIZE, y0/TILESIZE,
+               min(x1/TILESIZE, tilew-1), min(y1/TILESIZE, tileh-1));
+  return true;
+}
+
+// count the lights of each tile, turn the counts into offsets and scatter
+// the light indices
+static void binlights(const mat4x4f &mvp, int w, int h) {
+  tilew = (w+TILESIZE-1)/TILESIZE;
+  tileh = (h+TILESIZE-1)/TILESIZE;
+  const auto tilenum = tilew*tileh;
+  lightdata.setsize(0);
+  lightrects.setsize(0);
+  lightgrid.setsize(0);
+  lightgrid.setsize(2*tilenum);
+  loopv(lights) {
+    const auto &l = lights[i];
+    const auto r = lightradius(l.pow);
+    vec4i rect;
+    if (!lighttiles(mvp, l.pos, r, w, h, rect)) continue;
+    lightdata.add(vec4f(l.pos, r));
+    lightdata.add(vec4f(l.pow, float(l.shadow)));
+    lightrects.add(rect);
+    rangej(rect.y, rect.w+1) rangek(rect.x, rect.z+1) ++lightgrid[2*(k+j*tilew)+1];
+  }
+  u32 offset = 2*tilenum;
+  loopi(tilenum) {
+    lightgrid[2*i] = offset;
+    offset += lightgrid[2*i+1];
+    lightgrid[2*i+1] = 0;
+  }
+  lightgrid.setsize(offset, noinitialize);
+  loopv(lightrects) {
+    const auto &rect = lightrects[i];
+    rangej(rect.y, rect.w+1) rangek(rect.x, rect.z+1) {
+      auto tile = &lightgrid[2*(k+j*tilew)];
+      lightgrid[tile[0]+tile[1]++] = i;
+    }
+  }
+}
+
+// both buffers are orphaned every frame
+static void uploadlights() {
+  if (lightbo == 0u) {
+    ogl::genbuffers(1, &lightbo);
+    ogl::genbuffers(1, &lightgridbo);
+    ogl::gentextures(1, &lighttex);
+    ogl::gentextures(1, &lightgridtex);
+  }
+  const auto datanum = lightdata.length(), gridnum = lightgrid.length();
+  ogl::bindbuffer(ogl::TEXTURE_BUFFER, lightbo);
+  OGL(BufferData, GL_TEXTURE_BUFFER, max(datanum,1)*sizeof(vec4f), datanum ? &lightdata[0] : NULL, GL_STREAM_DRAW);
+  ogl::bindbuffer(ogl::TEXTURE_BUFFER, lightgridbo);
+  OGL(BufferData, GL_TEXTURE_BUFFER, gridnum*sizeof(u32), &lightgrid[0], GL_STREAM_DRAW);
+  ogl::bindbuffer(ogl::TEXTURE_BUFFER, 0);
+}
+
+#if !defined(RELEASE)
+static void cleanlights() {
+  if (lightbo) ogl::deletebuffers(1, &lightbo);
+  if (lightgridbo) ogl::deletebuffers(1, &lightgridbo);
+  if (lighttex) ogl::deletetextures(1, &lighttex);
+  if (lightgridtex) ogl::deletetextures(1, &lightgridtex);
+  lightbo = lightgridbo = lighttex = lightgridtex = 0u;
+  lights.destroy();
+  lightdata.destroy();
+  lightrects.destroy();
+  lightgrid.destroy();
+}
+#endif
+
+/*--------------------------------------------------------------------------
+ - ray traced shadows
+ -------------------------------------------------------------------------*/
+// the static lights of the tiled path are shadowed by a mask with one bit per
+// light. the workers trace it in the bvh while the gpu draws the gbuffer and
+// it is uploaded right before the deferred pass. it is "rtshadowscale" times
+// smaller than the screen. models are not in the bvh and cast no shadow
+VAR(rtshadows, 0, 0, 1);
+VAR(rtshadowscale, 1, 2, 8);
+static ref<task> shadowjob;
+static vector<u16> shadowmask;
+static u32 shadowtex = 0u;
+static int shadowscale = 0, shadoww = 0, shadowh = 0, shadowtexw = 0, shadowtexh = 0;
+
+static void startshadows(const vec3f *lpos, const vec3f *lpow, u32 lightnum) {
+  shadowscale = 0;
+  if (!rtshadows || !tiledlighting || !ogl::hasTB || tiled_deferred::s.program == 0)
+    return;
+  shadowscale = rtshadowscale;
+  shadoww = (sys::scrw+shadowscale-1)/shadowscale;
+  shadowh = (sys::scrh+shadowscale-1)/shadowscale;
+  shadowmask.setsize(shadoww*shadowh, noinitialize);
+  float lradius[rt::MAXMASKLIGHTNUM];
+  lightnum = min(lightnum, rt::MAXMASKLIGHTNUM);
+  loopi(s32(lightnum)) lradius[i] = lightradius(lpow[i]);
+  shadowjob = rt::shadowmask(&shadowmask[0], shadoww, shadowh, shadowscale,
+                             view.eye, view.invmvpmat, lpos, lradius,
+                             lightnum);
+}
+
+static void uploadshadows() {
+  if (!shadowjob) return;
+  shadowjob->wait();
+  shadowjob = NULL;
+  if (shadowtex == 0u) ogl::gentextures(1, &shadowtex);
+  ogl::bindtexture(GL_TEXTURE_2D, shadowtex, 5);
+  OGL(PixelStorei, GL_UNPACK_ALIGNMENT, 2);
+  if (shadowtexw != shadoww || shadowtexh != shadowh) {
+    OGL(TexParameteri, GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    OGL(TexParameteri, GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    OGL(TexImage2D, GL_TEXTURE_2D, 0, GL_R16UI, shadoww, shadowh, 0,
+        GL_RED_INTEGER, GL_UNSIGNED_SHORT, &shadowmask[0]);
+    shadowtexw = shadoww;
+    shadowtexh = shadowh;
+  } else
+    OGL(TexSubImage2D, GL_TEXTURE_2D, 0, 0, 0, shadoww, shadowh,
+        GL_RED_INTEGER, GL_UNSIGNED_SHORT, &shadowmask[0]);
+  OGL(PixelStorei, GL_UNPACK_ALIGNMENT, 4);
+}
+
+#if !defined(RELEASE)
+static void cleanshadows() {
+  if (shadowjob) shadowjob->wait();
+  shadowjob = NULL;
+  if (shadowtex) ogl::deletetextures(1, &shadowtex);
+  shadowtex = 0u;
+  shadowtexw = shadowtexh = 0;
+  shadowmask.destroy();
+}
+#endif
+
+/*--------------------------------------------------------------------------
+ - render the complete frame
+ -------------------------------------------------------------------------*/
+// a scene on the gpu. the next one is built and uploaded in the back while
+// the front one is drawn and they swap once its upload is done
+struct gpuscene {
+  u32 vbo, ibo, vao;
+  u32 *chunkvao; // one vertex array per packed chunk
+  u32 indexnum, indexsize;
+  geom::segment *segment;
+  geom::chunk *chunk;
+  geom::packedchunk *packedchunk;
+  geom::meshlet *meshlet;
+  u32 *segmentmeshlet; // first meshlet of each segment
+  u32 segmentnum, chunknum;
+  u32 probetex[3];            // red, green and blue sh of the probes if any
+  vec3f probeorg, probeextent; // box of the probe textures
+  u32 distindextex, distatlastex; // sparse distance volume if any
+  vec3f distorg;
+  float distcellsize;
+};
+static gpuscene scenes[2];
+static gpuscene *front = scenes, *back = scenes+1;
+static bool initialized_m = false; // a scene is in front
+static bool backready = false;     // the back scene waits for its upload
+static ref<rt::world> backworld;   // and its world
+static iso::occupancy *backoccupancy = NULL; // and the occupancy of its volume
 void start() {
+  MEMORY_TAG(MEM_RENDER);
   initdeferred();
   initparticles();
   initrt();
   texbuf::s.fixedfunction = true;
 }
 
+// the gpu objects go at once and the arrays (with the bvh of the old world
+// if nobody else uses it) in a task since the frame does not need them
+struct scenerelease : public task {
+  INLINE scenerelease(const gpuscene &s, const ref<rt::world> &world) :
+    task("scenerelease", 1, 1, 0, BACKGROUND), s(s), world(world) {}
+  virtual void run(u32) {
+    if (s.chunkvao) FREE(s.chunkvao);
+    if (s.segment) FREE(s.segment);
+    if (s.chunk) FREE(s.chunk);
+    if (s.packedchunk) FREE(s.packedchunk);
+    if (s.meshlet) FREE(s.meshlet);
+    if (s.segmentmeshlet) FREE(s.segmentmeshlet);
+    world = nil;
+    rt::purgeworlds();
+  }
+  gpuscene s;
+  ref<rt::world> world;
+};
+
+static void releasescene(gpuscene &s, const ref<rt::world> &world, bool wait) {
+  if (s.vbo) ogl::deletebuffers(1, &s.vbo);
+  if (s.ibo) ogl::deletebuffers(1, &s.ibo);
+  if (s.vao) ogl::deletevertexarrays(1, &s.vao);
+  if (s.chunkvao) ogl::deletevertexarrays(s.chunknum, s.chunkvao);
+  if (s.probetex[0]) ogl::deletetextures(3, s.probetex);
+  if (s.distindextex) ogl::deletetextures(1, &s.distindextex);
+  if (s.distatlastex) ogl::deletetextures(1, &s.distatlastex);
+  ref<task> job = NEWTASK(scenerelease, s, world);
+  job->scheduled();
+  if (wait) job->wait();
+  s = gpuscene();
+}
+
 #if !defined(RELEASE)
+static void destroybake();
+static void finishupload();
 void finish() {
-  if (initialized_m) {
-    ogl::deletebuffers(1, &sceneposbo);
-    ogl::deletebuffers(1, &scenenorbo);
-    ogl::deletebuffers(1, &sceneibo);
-    SAFE_DEL(segment);
-  }
+  destroybake();
+  finishupload();
+  releasescene(*back, ref<rt::world>(), true);
+  releasescene(*front, ref<rt::world>(), true);
+  initialized_m = false;
+  backworld = nil;
+  iso::destroy(backoccupancy);
+  backoccupancy = NULL;
+  destroyindirectbuffers();
+  drawn.cmds.destroy();
+  drawn.batches.destroy();
+  drawlists.destroy();
+  cleanlights();
+  cleanshadows();
   cleanrt();
   cleanparticles();
   cleandeferred();
@@ -598,43 +1472,383 @@ void finish() {
 #endif
 
 VAR(isofromfile, 0, 0, 1);
+VAR(packvertices, 0, 1, 1);
+VAR(bakecache, 0, 1, 1);
+VAR(probes, 0, 1, 1);
+VAR(probespacing, 1, 10, 100); // in cells
+VAR(distfield, 0, 1, 1);
+VAR(distfieldcell, 1, 2, 16); // in cells
 static const float CELLSIZE = 0.1f;
-static void makescene() {
-  if (initialized_m) return;
+static const u32 CELLNUM = 4096;
+static const vec3f SCENEORG(0.15f);
+
+// bump it when the meshing or the bvh change such that old bakes are ignored
+static const u32 BAKE_VERSION = 2;
+
+// baked scenes are keyed by the csg program and the meshing parameters
+// the content hash of the scene names its bake and keys its shared world
+static u64 scenekey(const csg::node &n) {
+  const auto p = csg::compile(n);
+  const auto key = csg::hash(p);
+  csg::destroy(p);
+  const struct {
+    vec3f org;
+    float cellsize;
+    u32 cellnum, version;
+  } params = {SCENEORG, CELLSIZE, CELLNUM, BAKE_VERSION};
+  return key ^ u64(murmurhash2(params));
+}
 
-  // create the indexed mesh from the scene description
-  geom::mesh m;
-  if (!isofromfile || !geom::load("simple.mesh", m)) {
-    const auto start = sys::millis();
-    const auto node = csg::makescene();
-    assert(node != NULL);
-    m = iso::dc(vec3f(0.15f), 4096, CELLSIZE, *node);
-    const auto duration = sys::millis() - start;
-    con::out("csg: elapsed %f ms ", float(duration));
-  }
-  ogl::genbuffers(1, &sceneposbo);
-  ogl::bindbuffer(ogl::ARRAY_BUFFER, sceneposbo);
-  OGL(BufferData, GL_ARRAY_BUFFER, m.m_vertnum*sizeof(vec3f), &m.m_pos[0].x, GL_STATIC_DRAW);
-  ogl::genbuffers(1, &scenenorbo);
-  ogl::bindbuffer(ogl::ARRAY_BUFFER, scenenorbo);
-  OGL(BufferData, GL_ARRAY_BUFFER, m.m_vertnum*sizeof(vec3f), &m.m_nor[0].x, GL_STATIC_DRAW);
+static fixedstring bakename(u64 key) {
+  return fixedstring(fmt, "scene-%016llx.mesh", (unsigned long long) key);
+}
+
+// upload the mesh with quantized vertices. vertices of each chunk start at
+// their own offset so each chunk gets its vertex array
+/*--------------------------------------------------------------------------
+ - progressive upload of the scene. the buffers are allocated at once and
+ - filled chunk by chunk under a per frame budget. only the chunks whose
+ - vertices and indices are all uploaded are drawn
+ -------------------------------------------------------------------------*/
+VARP(uploadbudget, 0, 4096, 1<<20); // in KB per frame. 0 uploads everything
+static struct sceneupload {
+  gpuscene *target;         // front or back scene
+  u8 *vert, *index;         // owned copies of the data
+  vector<u32> vertend;      // bytes of both buffers each chunk needs.
+  vector<u32> indexend;     // chunks are ready in order
+  u32 vertdone, indexdone;  // bytes already uploaded
+  u32 readynum;             // chunks ready to draw
+  bool pending;
+} upload;
+
+static void startupload(gpuscene &s, u8 *vert, u32 vertsize,
+                        u8 *index, u32 indexsize) {
+  ogl::bindvertexarray(0);
+  ogl::bindbuffer(ogl::ARRAY_BUFFER, s.vbo);
+  OGL(BufferData, GL_ARRAY_BUFFER, vertsize, NULL, GL_STATIC_DRAW);
   ogl::bindbuffer(ogl::ARRAY_BUFFER, 0);
-  ogl::genbuffers(1, &sceneibo);
-  ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, sceneibo);
-  OGL(BufferData, GL_ELEMENT_ARRAY_BUFFER, m.m_indexnum*sizeof(u32), &m.m_index[0], GL_STATIC_DRAW);
+  ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, s.ibo);
+  OGL(BufferData, GL_ELEMENT_ARRAY_BUFFER, indexsize, NULL, GL_STATIC_DRAW);
   ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, 0);
-  indexnum = m.m_indexnum;
+  upload.target = &s;
+  upload.vert = vert;
+  upload.index = index;
+  upload.vertdone = upload.indexdone = upload.readynum = 0;
+  upload.pending = true;
+}
+
+static void finishupload() {
+  if (upload.vert) FREE(upload.vert);
+  if (upload.index) FREE(upload.index);
+  upload.vert = upload.index = NULL;
+  upload.target = NULL;
+  upload.vertend.destroy();
+  upload.indexend.destroy();
+  upload.pending = false;
+}
+
+static void sendrange(GLenum target, u32 type, u32 bo, const u8 *data,
+                      u32 &done, u32 end) {
+  if (end <= done) return;
+  ogl::bindbuffer(type, bo);
+  OGL(BufferSubData, target, done, end-done, data+done);
+  ogl::bindbuffer(type, 0);
+  done = end;
+}
+
+static void uploadscene() {
+  if (!upload.pending) return;
+  const auto &s = *upload.target;
+  ogl::bindvertexarray(0);
+  const auto budget = uploadbudget ? u32(uploadbudget)*1024u : ~0u;
+  const auto start = upload.vertdone + upload.indexdone;
+  const auto num = u32(upload.vertend.length());
+  while (upload.readynum < num && upload.vertdone+upload.indexdone-start < budget) {
+    const auto c = upload.readynum++;
+    sendrange(GL_ARRAY_BUFFER, ogl::ARRAY_BUFFER, s.vbo, upload.vert,
+              upload.vertdone, upload.vertend[c]);
+    sendrange(GL_ELEMENT_ARRAY_BUFFER, ogl::ELEMENT_ARRAY_BUFFER, s.ibo,
+              upload.index, upload.indexdone, upload.indexend[c]);
+  }
+  if (upload.readynum == num) finishupload();
+}
+
+// without chunks, the whole mesh is one chunk. only the first scene is drawn
+// while it uploads
+static INLINE bool frontpending() { return upload.pending && upload.target == front; }
+static INLINE u32 readychunknum() {
+  return frontpending() ? upload.readynum : front->chunknum;
+}
+
+static bool makepackedscene(gpuscene &s, const geom::mesh &m) {
+  geom::packedmesh pm;
+  if (!packvertices || !geom::pack(pm, m)) return false;
+  const auto stride = sizeof(geom::packedvertex);
+  ogl::genbuffers(1, &s.vbo);
+  ogl::genbuffers(1, &s.ibo);
+  upload.vertend.setsize(0);
+  upload.indexend.setsize(0);
+  u32 vertend = 0, indexend = 0;
+  loopi(s32(pm.m_chunknum)) {
+    const auto &c = pm.m_chunk[i];
+    vertend = max(vertend, u32((c.firstvert+c.vertnum)*stride));
+    if (c.num != 0) {
+      const auto &last = pm.m_segment[c.start+c.num-1];
+      indexend = max(indexend, (last.start+last.num)*pm.m_indexsize);
+    }
+    upload.vertend.add(vertend);
+    upload.indexend.add(indexend);
+  }
+  startupload(s, (u8*) pm.m_vert, pm.m_vertnum*stride,
+              (u8*) pm.m_index, pm.m_indexnum*pm.m_indexsize);
+  pm.m_vert = NULL;
+  pm.m_index = NULL;
+  s.indexnum = pm.m_indexnum;
+  s.indexsize = pm.m_indexsize;
+  s.chunknum = pm.m_chunknum;
+  s.packedchunk = pm.m_chunk;
+  pm.m_chunk = NULL;
+  const ogl::vertexattrib attribs[] = {
+    {ogl::ATTRIB_POS0, 3, GL_UNSIGNED_SHORT, 0, true},
+    {ogl::ATTRIB_COL, 2, GL_SHORT, offsetof(geom::packedvertex,nor), true}
+  };
+  s.chunkvao = (u32*) MALLOC(sizeof(u32) * s.chunknum);
+  loopi(s32(s.chunknum)) {
+    const auto offset = s.packedchunk[i].firstvert*stride;
+    s.chunkvao[i] = ogl::makevertexarray(attribs, 2, stride, s.vbo, s.ibo, offset);
+  }
+  con::out("csg: packed %i verts with %i bits indices", pm.m_vertnum, 8*s.indexsize);
+  pm.destroy();
+  return true;
+}
+
+// meshlets are sorted like the segments they belong to
+static void makemeshlets(gpuscene &s, const geom::mesh &m) {
+  if (m.m_meshletnum == 0) return;
+  s.meshlet = (geom::meshlet*) MALLOC(sizeof(geom::meshlet) * m.m_meshletnum);
+  loopi(s32(m.m_meshletnum)) s.meshlet[i] = m.m_meshlet[i];
+  s.segmentmeshlet = (u32*) MALLOC(sizeof(u32) * (s.segmentnum+1));
+  u32 j = 0;
+  loopi(s32(s.segmentnum)) {
+    s.segmentmeshlet[i] = j;
+    const auto end = s.segment[i].start+s.segment[i].num;
+    while (j < m.m_meshletnum && s.meshlet[j].start < end) ++j;
+  }
+  s.segmentmeshlet[s.segmentnum] = j;
+}
+
+// the scene is meshed (or its bake loaded) and its bvh built by a task that
+// starts once the scene script is done. the render thread only uploads it.
+// the bvh of a scene already loaded is shared instead of built again
+static void bakeirradiance(struct scenebake &b);
+static void bakedistfield(struct scenebake &b);
+struct scenebake : public task {
+  INLINE scenebake() :
+    task("scenebake", 1, 1, 0, BACKGROUND), isec(NULL), occupancy(NULL),
+    probes(NULL), distfield(NULL), withprobes(false), withdistfield(false),
+    done(0) {}
+  virtual void run(u32) {
+    // baked meshes come with their bvh
+    fixedstring baked;
+    u64 key = 0;
+    if (!isofromfile || !geom::load("simple.mesh", m)) {
+      const auto start = sys::millis();
+      // a script without root leaves the scene empty. buildscene reports
+      // its errors
+      const auto node = csg::scene();
+      if (node == NULL) {
+        storerelease(&done, 1);
+        return;
+      }
+      key = scenekey(*node);
+      world = rt::findworld(key);
+      if (bakecache) baked = bakename(key);
+      if (bakecache && geom::load(baked.c_str(), m)) {
+        if (m.m_bvh && !world) isec = rt::makebvh(m.m_bvh, m.m_bvhsize);
+        occupancy = iso::makeoccupancy(m.m_occupancy, m.m_occupancysize);
+        con::out("csg: loaded baked scene %s", baked.c_str());
+        baked[0] = '\0';
+      } else
+        m = iso::dc(SCENEORG, CELLNUM, CELLSIZE, *node, &occupancy);
+      const auto duration = sys::millis() - start;
+      con::out("csg: elapsed %f ms ", float(duration));
+    }
+
+    // create the bvh out of the mesh data and bake the result if asked
+    if (world) isec = world->isec;
+    else if (isec == NULL) isec = rt::makebvh(m.m_pos, m.m_index, m.m_indexnum);
+    if (baked[0] != '\0') {
+      m.m_bvh = rt::serialize(isec, m.m_bvhsize);
+      m.m_occupancy = iso::serialize(occupancy, m.m_occupancysize);
+      geom::store(baked.c_str(), m);
+    }
+    if (!world) world = key ? rt::makeworld(key, isec) : ref<rt::world>(NEW(rt::world, 0, isec));
+    if (withprobes) bakeirradiance(*this);
+    if (withdistfield) bakedistfield(*this);
+    storerelease(&done, 1);
+  }
+  geom::mesh m;
+  rt::intersector *isec;
+  ref<rt::world> world;
+  iso::occupancy *occupancy; // for the physics
+  vec4f *probes; // see rt::bakeprobes
+  vec3f probeorg;
+  vec3i probedim;
+  float probespacing;
+  csg::distvolume *distfield;
+  bool withprobes, withdistfield;
+  volatile s32 done;
+};
+static ref<scenebake> bakejob;
+
+#if !defined(RELEASE)
+// the game may quit before the scene is uploaded
+static void destroybake() {
+  if (!bakejob) return;
+  bakejob->wait();
+  bakejob->m.destroy();
+  if (bakejob->probes) FREE(bakejob->probes);
+  csg::destroy(bakejob->distfield);
+  iso::destroy(bakejob->occupancy);
+  bakejob = nil;
+}
+#endif
+
+static void startbake(const char *filename) {
+  if (bakejob) bakejob->wait();
+  bakejob = NEWTASKE(scenebake);
+  bakejob->withprobes = probes != 0;
+  bakejob->withdistfield = distfield != 0;
+  csg::loadscene(filename, bakejob.ptr);
+  bakejob->scheduled();
+}
+
+// the bake job is also read by the submission. the last scene a game thread
+// asks for is started by the next record
+static fixedstring pendingscene;
+void loadscene(const char *filename) {
+  if (gamethread)
+    strcpy_s(pendingscene, filename);
+  else
+    startbake(filename);
+}
+
+// build the gpu scene of a finished bake in the back and start its upload
+static void buildscene() {
+  bakejob->wait();
+  csg::makescene(); // reports the script errors
+
+  auto &s = *back;
+  auto &m = bakejob->m;
+  if (!makepackedscene(s, m)) {
+    // positions and normals are interleaved
+    const auto vert = (vec3f*) MALLOC(2*sizeof(vec3f) * m.m_vertnum);
+    loopi(s32(m.m_vertnum)) {
+      vert[2*i+0] = m.m_pos[i];
+      vert[2*i+1] = m.m_nor[i];
+    }
+    const auto index = (u32*) MALLOC(sizeof(u32) * m.m_indexnum);
+    memcpy(index, m.m_index, m.m_indexnum*sizeof(u32));
+
+    // chunks need all the vertices their indices reference
+    upload.vertend.setsize(0);
+    upload.indexend.setsize(0);
+    u32 maxvert = 0, indexend = 0;
+    loopi(s32(max(m.m_chunknum, 1u))) {
+      const auto start = m.m_chunknum ? m.m_chunk[i].start : 0u;
+      const auto num = m.m_chunknum ? m.m_chunk[i].num : m.m_segmentnum;
+      if (num != 0) {
+        const auto &last = m.m_segment[start+num-1];
+        rangej(indexend, last.start+last.num) maxvert = max(maxvert, index[j]+1);
+        indexend = max(indexend, last.start+last.num);
+      }
+      upload.vertend.add(maxvert*2*u32(sizeof(vec3f)));
+      upload.indexend.add(indexend*u32(sizeof(u32)));
+    }
+    ogl::genbuffers(1, &s.vbo);
+    ogl::genbuffers(1, &s.ibo);
+    startupload(s, (u8*) vert, m.m_vertnum*2*sizeof(vec3f),
+                (u8*) index, m.m_indexnum*sizeof(u32));
+    const ogl::vertexattrib attribs[] = {
+      {ogl::ATTRIB_POS0, 3, GL_FLOAT, 0, false},
+      {ogl::ATTRIB_COL, 3, GL_FLOAT, sizeof(vec3f), false}
+    };
+    s.vao = ogl::makevertexarray(attribs, 2, 2*sizeof(vec3f), s.vbo, s.ibo);
+    s.indexnum = m.m_indexnum;
+    s.indexsize = sizeof(u32);
+    s.chunknum = m.m_chunknum;
+    s.chunk = (geom::chunk*) MALLOC(sizeof(geom::chunk) * s.chunknum);
+    loopi(s32(s.chunknum)) s.chunk[i] = m.m_chunk[i];
+  }
   con::out("csg: tris %i verts %i", m.m_indexnum/3, m.m_vertnum);
 
-  // create the bvh out of the mesh data
-  rt::buildbvh(m.m_pos, m.m_index, m.m_indexnum);
-  segmentnum = m.m_segmentnum;
-  segment = (geom::segment*) MALLOC(sizeof(geom::segment) * segmentnum);
-  memcpy(segment, m.m_segment, segmentnum*sizeof(geom::segment));
+  s.segmentnum = m.m_segmentnum;
+  s.segment = (geom::segment*) MALLOC(sizeof(geom::segment) * s.segmentnum);
+  memcpy(s.segment, m.m_segment, s.segmentnum*sizeof(geom::segment));
+  makemeshlets(s, m);
   m.destroy();
+  if (bakejob->probes) {
+    // a texel per probe whose center is the probe itself
+    const auto &dim = bakejob->probedim;
+    const auto size = bakejob->probespacing * vec3f(dim);
+    const auto n = dim.x*dim.y*dim.z;
+    loopi(3) s.probetex[i] = ogl::maketex("Tf IF D4 B3 Wse Wte Wre ml Ml",
+      bakejob->probes+i*n, dim.x, dim.y, dim.z);
+    s.probeorg = bakejob->probeorg - 0.5f*bakejob->probespacing;
+    s.probeextent = size;
+    FREE(bakejob->probes);
+    bakejob->probes = NULL;
+  }
+  if (const auto v = bakejob->distfield) {
+    const auto atlas = v->atlasdim*int(csg::BRICKSAMPLEDIM);
+    s.distindextex = ogl::maketex("TS Iu Du B3 Wse Wte Wre mn Mn",
+      v->index, v->dim.x, v->dim.y, v->dim.z);
+    s.distatlastex = ogl::maketex("Tf Ih Dr B3 Wse Wte Wre ml Ml",
+      v->atlas, atlas.x, atlas.y, atlas.z);
+    s.distorg = v->org;
+    s.distcellsize = v->cellsize;
+    csg::destroy(v);
+    bakejob->distfield = NULL;
+  }
+  backworld = bakejob->world;
+  iso::destroy(backoccupancy);
+  backoccupancy = bakejob->occupancy;
+  bakejob->occupancy = NULL;
+  bakejob = nil;
+  backready = true;
+}
+
+// the back scene goes in front with its world. the physics follows the new
+// scene and the old one is released in the background
+static void swapscene() {
+  swap(front, back);
+  const auto old = rt::getworld();
+  rt::setworld(backworld);
+  backworld = nil;
+  if (initialized_m) physics::resetworld();
+  physics::setoccupancy(backoccupancy);
+  backoccupancy = NULL;
+  releasescene(*back, old, false);
+  backready = false;
   initialized_m = true;
 }
 
+// false until the first scene is in front. the frames before draw the loading
+// screen. later scenes are built while the current one is drawn. the swap
+// changes the world of the physics so this is part of the record while the
+// upload is submitted with the frame
+static bool makescene() {
+  if (pendingscene[0] != '\0') {
+    startbake(pendingscene.c_str());
+    pendingscene[0] = '\0';
+  }
+  if (!bakejob && !initialized_m) startbake("data/csg.lua");
+  if (bakejob && !backready && !upload.pending && loadacquire(&bakejob->done))
+    buildscene();
+  if (backready && (!initialized_m || !upload.pending)) swapscene();
+  return initialized_m;
+}
+
 struct screenquad {
   static INLINE screenquad get() {
     const auto w = float(sys::scrw), h = float(sys::scrh);
@@ -678,7 +1892,231 @@ static const vec3f lightpow[LIGHTNUM] = {
   vec3f(0.f,1.f,1.f), vec3f(1.f,1.f,0.f),
 };
 
+static aabb meshbox(const geom::mesh &m) {
+  auto box = aabb::empty();
+  loopi(s32(m.m_vertnum)) {
+    box.pmin = min(box.pmin, m.m_pos[i]);
+    box.pmax = max(box.pmax, m.m_pos[i]);
+  }
+  return box;
+}
+
+// the probes cover the mesh with one more probe on the far sides. a coarser
+// grid is used when the scene is too large for the finer one
+static const u32 MAXPROBENUM = 32768;
+static void bakeirradiance(scenebake &b) {
+  if (b.m.m_vertnum == 0) return;
+  const auto box = meshbox(b.m);
+  auto spacing = float(probespacing) * CELLSIZE;
+  vec3i dim;
+  for (;;) {
+    dim = vec3i((box.pmax-box.pmin) / spacing) + 2;
+    if (u32(dim.x*dim.y*dim.z) <= MAXPROBENUM) break;
+    spacing *= 1.25f;
+  }
+  vec3f lpow[LIGHTNUM];
+  loopi(LIGHTNUM) lpow[i] = float(lightscale) * lightpow[i];
+  b.probes = (vec4f*) MALLOC(3*sizeof(vec4f)*dim.x*dim.y*dim.z);
+  b.probeorg = box.pmin;
+  b.probedim = dim;
+  b.probespacing = spacing;
+  rt::bakeprobes(b.isec, box.pmin, spacing, dim, lightpos, lpow, LIGHTNUM, b.probes);
+}
+
+// the distance volume goes one brick beyond the mesh such that the queries
+// around it still see the surface
+static void bakedistfield(scenebake &b) {
+  const auto node = csg::scene();
+  if (node == NULL || b.m.m_vertnum == 0) return;
+  const auto cellsize = float(distfieldcell) * CELLSIZE;
+  const auto margin = vec3f(cellsize*float(csg::BRICKDIM));
+  const auto box = meshbox(b.m);
+  const auto prog = csg::compile(*node);
+  b.distfield = csg::makedistvolume(prog, aabb(box.pmin-margin, box.pmax+margin), cellsize);
+  csg::destroy(prog);
+}
+
 VAR(linemode, 0, 0, 1);
+VAR(frustumcull, 0, 1, 1);
+VAR(meshletcull, 0, 1, 1);
+VAR(multidraw, 0, 1, 1);
+VAR(parallelcull, 0, 1, 1);
+
+// planes of the view frustum extracted from the mvp matrix. they point inward
+struct frustum {
+  frustum(const mat4x4f &m) {
+    const vec4f r0(m.vx.x,m.vy.x,m.vz.x,m.vw.x);
+    const vec4f r1(m.vx.y,m.vy.y,m.vz.y,m.vw.y);
+    const vec4f r2(m.vx.z,m.vy.z,m.vz.z,m.vw.z);
+    const vec4f r3(m.vx.w,m.vy.w,m.vz.w,m.vw.w);
+    p[0] = r3+r0; p[1] = r3-r0;
+    p[2] = r3+r1; p[3] = r3-r1;
+    p[4] = r3+r2; p[5] = r3-r2;
+  }
+  // test the box corner which goes the farthest along each plane normal
+  bool visible(const aabb &box) const {
+    loopi(6) {
+      const auto n = p[i].xyz();
+      const auto c = select(ge(n,vec3f(zero)), box.pmax, box.pmin);
+      if (dot(n,c) + p[i].w < 0.f) return false;
+    }
+    return true;
+  }
+  // planes are not normalized so the radius is scaled by the normal length
+  bool visible(const vec3f &center, float radius) const {
+    loopi(6) {
+      const auto n = p[i].xyz();
+      if (dot(n,center) + p[i].w < -radius*length(n)) return false;
+    }
+    return true;
+  }
+  vec4f p[6];
+};
+
+// the boxes go in soa registers soaf::size at a time. the sign of a plane
+// normal is the same for all the lanes so the farthest corner is picked once
+// per plane for the whole batch
+void cullboxes(const aabb *box, u32 n, bool *visible) {
+  if (!frustumcull) {
+    loopi(s32(n)) visible[i] = true;
+    return;
+  }
+  const frustum f(view.mvpmat);
+  const soaf zero4(zero);
+  for (u32 first = 0; first < n; first += soaf::size) {
+    const auto num = min(n-first, u32(soaf::size));
+    float DEFAULT_ALIGNED lo[3][soaf::size], hi[3][soaf::size];
+    loopj(s32(soaf::size)) {
+      const auto &b = box[first+min(u32(j), num-1)];
+      loopk(3) {
+        lo[k][j] = b.pmin[k];
+        hi[k][j] = b.pmax[k];
+      }
+    }
+    const soa3f pmin(soaf::load(lo[0]), soaf::load(lo[1]), soaf::load(lo[2]));
+    const soa3f pmax(soaf::load(hi[0]), soaf::load(hi[1]), soaf::load(hi[2]));
+    soab in(truev);
+    loopi(6) {
+      const auto &p = f.p[i];
+      const auto x = p.x >= 0.f ? pmax.x : pmin.x;
+      const auto y = p.y >= 0.f ? pmax.y : pmin.y;
+      const auto z = p.z >= 0.f ? pmax.z : pmin.z;
+      const auto d = madd(x, soaf(p.x), madd(y, soaf(p.y), madd(z, soaf(p.z), soaf(p.w))));
+      in &= d >= zero4;
+      if (none(in)) break;
+    }
+    const auto mask = movemask(in);
+    loopj(s32(num)) visible[first+j] = (mask>>j)&1;
+  }
+}
+
+/*--------------------------------------------------------------------------
+ - occlusion culling
+ -------------------------------------------------------------------------*/
+// the world depth is reduced on the gpu to the farthest depth of each block
+// of HIZSIZE^2 pixels and read back asynchronously. the cpu builds coarser
+// levels from the oldest readback and tests boxes projected with the matrix
+// of the frame this depth comes from. objects hidden a few frames ago and
+// visible now pop in late
+static const int HIZLEVELNUM = 12;
+VAR(occlusioncull, 0, 1, 1);
+static vector<float> hizlevel[HIZLEVELNUM];
+static vec2i hizdim[HIZLEVELNUM];
+static int hizlevelnum = 0;
+static mat4x4f hizmvp;
+static bool hizvalid = false;
+
+static void buildhiz(const float *depth) {
+  hizdim[0] = vec2i(hizw, hizh);
+  hizlevel[0].setsize(hizw*hizh, noinitialize);
+  memcpy(&hizlevel[0][0], depth, hizw*hizh*sizeof(float));
+  hizlevelnum = 1;
+  while (hizlevelnum < HIZLEVELNUM) {
+    const auto src = hizdim[hizlevelnum-1];
+    if (src.x == 1 && src.y == 1) break;
+    const vec2i dst((src.x+1)/2, (src.y+1)/2);
+    const auto &from = hizlevel[hizlevelnum-1];
+    auto &to = hizlevel[hizlevelnum];
+    to.setsize(dst.x*dst.y, noinitialize);
+    loopi(dst.y) loopj(dst.x) {
+      const auto x0 = 2*j, x1 = min(x0+1, src.x-1);
+      const auto y0 = 2*i*src.x, y1 = min(2*i+1, src.y-1)*src.x;
+      const auto d0 = max(from[x0+y0], from[x1+y0]);
+      const auto d1 = max(from[x0+y1], from[x1+y1]);
+      to[j+i*dst.x] = max(d0, d1);
+    }
+    hizdim[hizlevelnum++] = dst;
+  }
+}
+
+// the buffer of the current slot holds the oldest readback. we wait for it
+// since the gpu is most likely done with it
+static void fetchhiz() {
+  auto &b = hizbuf[hizcurr];
+  if (b.fence == NULL) return;
+  GLenum res;
+  do OGLR(res, ClientWaitSync, b.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+  while (res == GL_TIMEOUT_EXPIRED);
+  OGL(DeleteSync, b.fence);
+  b.fence = NULL;
+  void *ptr;
+  ogl::bindbuffer(ogl::PIXEL_PACK_BUFFER, b.pbo);
+  OGLR(ptr, MapBufferRange, GL_PIXEL_PACK_BUFFER, 0, hizw*hizh*sizeof(float), GL_MAP_READ_BIT);
+  if (ptr != NULL) {
+    buildhiz((const float*) ptr);
+    hizmvp = b.mvp;
+    hizvalid = true;
+    OGL(UnmapBuffer, GL_PIXEL_PACK_BUFFER);
+  }
+  ogl::bindbuffer(ogl::PIXEL_PACK_BUFFER, 0);
+}
+
+static void readbackhiz() {
+  OGL(BindFramebuffer, GL_FRAMEBUFFER, hizbuffer);
+  OGL(Viewport, 0, 0, hizw, hizh);
+  ogl::disablev(GL_CULL_FACE, GL_DEPTH_TEST);
+  ogl::bindshader(hiz::s);
+  ogl::bindtexture(GL_TEXTURE_RECTANGLE, gdepthtex, 0);
+  ogl::uniform2f(hiz::s.u_depthdim, float(sys::scrw), float(sys::scrh));
+  ogl::immdraw("Sp2", 4, screenquad::getnormalized().v);
+  auto &b = hizbuf[hizcurr];
+  ogl::bindbuffer(ogl::PIXEL_PACK_BUFFER, b.pbo);
+  OGL(ReadPixels, 0, 0, hizw, hizh, GL_RED, GL_FLOAT, NULL);
+  ogl::bindbuffer(ogl::PIXEL_PACK_BUFFER, 0);
+  OGLR(b.fence, FenceSync, GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  b.mvp = view.mvpmat;
+  hizcurr = (hizcurr+1) % HIZBUFNUM;
+  OGL(Viewport, 0, 0, sys::scrw, sys::scrh);
+  ogl::enablev(GL_CULL_FACE, GL_DEPTH_TEST);
+}
+
+// the box is tested on the coarsest level where it covers at most 2x2 texels
+bool occluded(const aabb &box) {
+  if (!occlusioncull || !hizvalid) return false;
+  aabb ndc;
+  if (!projectbox(hizmvp, box, ndc)) return false;
+  const auto xmin = ndc.pmin.x, ymin = ndc.pmin.y, zmin = ndc.pmin.z;
+  const auto xmax = ndc.pmax.x, ymax = ndc.pmax.y;
+  if (xmax < -1.f || ymax < -1.f || xmin > 1.f || ymin > 1.f) return false;
+  const auto depth = zmin*0.5f+0.5f;
+  const auto sx = 0.5f*float(sys::scrw)/float(HIZSIZE);
+  const auto sy = 0.5f*float(sys::scrh)/float(HIZSIZE);
+  auto x0 = min(int((clamp(xmin,-1.f,1.f)+1.f)*sx), hizw-1);
+  auto x1 = min(int((clamp(xmax,-1.f,1.f)+1.f)*sx), hizw-1);
+  auto y0 = min(int((clamp(ymin,-1.f,1.f)+1.f)*sy), hizh-1);
+  auto y1 = min(int((clamp(ymax,-1.f,1.f)+1.f)*sy), hizh-1);
+  auto level = 0;
+  while (level+1 < hizlevelnum && (x1-x0 > 1 || y1-y0 > 1)) {
+    x0 >>= 1; x1 >>= 1;
+    y0 >>= 1; y1 >>= 1;
+    ++level;
+  }
+  const auto &hiz = hizlevel[level];
+  const auto w = hizdim[level].x;
+  range(y, y0, y1+1) range(x, x0, x1+1)
+    if (hiz[x+y*w] >= depth) return false;
+  return true;
+}
 
 struct context {
   context(float w, float h, float fovy, float aspect, float farplane)
@@ -686,85 +2124,300 @@ struct context {
   {}
 
   INLINE void begin() {
-    makescene();
     OGL(Clear, GL_DEPTH_BUFFER_BIT);
   }
   INLINE void end() {}
 
+  static INLINE void addcommand(drawlist &l, u32 start, u32 num) {
+    const drawcommand cmd = {num, 1, start, 0, 0};
+    l.cmds.add(cmd);
+  }
+
+  // add the meshlets of the segment that pass the frustum and normal cone
+  // tests. consecutive visible meshlets are merged in one command
+  void cullsegment(drawlist &l, const frustum &f, u32 idx) {
+    const auto &seg = front->segment[idx];
+    if (!meshletcull || front->meshlet == NULL) {
+      addcommand(l, seg.start, seg.num);
+      return;
+    }
+    const auto eye = view.eye;
+    u32 start = 0, num = 0;
+    range(i, front->segmentmeshlet[idx], front->segmentmeshlet[idx+1]) {
+      const auto &ml = front->meshlet[i];
+      const auto d = ml.center-eye;
+      if (dot(d,ml.axis) >= ml.cutoff*length(d)+ml.radius) continue;
+      if (frustumcull && !f.visible(ml.center, ml.radius)) continue;
+      if (num != 0 && start+num == ml.start) {
+        num += ml.num;
+        continue;
+      }
+      if (num != 0) addcommand(l, start, num);
+      start = ml.start;
+      num = ml.num;
+    }
+    if (num != 0) addcommand(l, start, num);
+  }
+
+  void cullsegments(drawlist &l, const frustum &f, u32 first, u32 num, bool simple) {
+    rangei(first, first+num)
+      if ((front->segment[i].mat == csg::MAT_SIMPLE_INDEX) == simple)
+        cullsegment(l, f, i);
+  }
+
+  // close the batch of the commands added since first
+  static void addbatch(drawlist &l, u32 chunk, u32 first, bool simple) {
+    const u32 num = l.cmds.length()-first;
+    if (num == 0) return;
+    const drawbatch b = {chunk, first, num, simple};
+    l.batches.add(b);
+  }
+
+  // unpacked vertices all share the same attributes so there is one batch
+  // per material. packed ones need one batch per material and chunk
+  void cullchunks(drawlist &l, const frustum &f, u32 first, u32 last) {
+    if (front->packedchunk) {
+      range(i, first, last) {
+        const auto &c = front->packedchunk[i];
+        if (frustumcull && !f.visible(c.box)) continue;
+        if (occluded(c.box)) continue;
+        loopk(2) {
+          const u32 cmdfirst = l.cmds.length();
+          cullsegments(l, f, c.start, c.num, k == 0);
+          addbatch(l, i, cmdfirst, k == 0);
+        }
+      }
+    } else loopk(2) {
+      const u32 cmdfirst = l.cmds.length();
+      range(i, first, last)
+        if ((!frustumcull || f.visible(front->chunk[i].box)) && !occluded(front->chunk[i].box))
+          cullsegments(l, f, front->chunk[i].start, front->chunk[i].num, k == 0);
+      addbatch(l, 0, cmdfirst, k == 0);
+    }
+  }
+
+  // the batches of the unpacked lists are joined per material
+  static void joinlists(u32 n, bool packed) {
+    if (packed) loopi(s32(n)) {
+      const auto &l = drawlists[i];
+      const u32 base = drawn.cmds.length();
+      loopvj(l.cmds) drawn.cmds.add(l.cmds[j]);
+      loopvj(l.batches) {
+        auto b = l.batches[j];
+        b.first += base;
+        drawn.batches.add(b);
+      }
+    } else loopk(2) {
+      const u32 first = drawn.cmds.length();
+      loopi(s32(n)) {
+        const auto &l = drawlists[i];
+        loopvj(l.batches) {
+          const auto &b = l.batches[j];
+          if (b.simple != (k == 0)) continue;
+          rangej(b.first, b.first+b.num) drawn.cmds.add(l.cmds[j]);
+        }
+      }
+      addbatch(drawn, 0, first, k == 0);
+    }
+  }
+
+  void cullscene(const frustum &f) {
+    drawn.cmds.setsize(0);
+    drawn.batches.setsize(0);
+    if (front->packedchunk == NULL && front->chunknum == 0) {
+      loopk(2) {
+        const u32 first = drawn.cmds.length();
+        if (!frontpending()) cullsegments(drawn, f, 0, front->segmentnum, k == 0);
+        addbatch(drawn, 0, first, k == 0);
+      }
+      return;
+    }
+    const auto readynum = readychunknum();
+    const auto groupnum = (readynum+CULLGRAIN-1)/CULLGRAIN;
+    if (!parallelcull || groupnum <= 1) {
+      cullchunks(drawn, f, 0, readynum);
+      return;
+    }
+    if (u32(drawlists.length()) < groupnum) drawlists.setsize(groupnum);
+    parallelfor("cullscene", groupnum, 1, [&](u32 group) {
+      auto &l = drawlists[group];
+      l.cmds.setsize(0);
+      l.batches.setsize(0);
+      cullchunks(l, f, group*CULLGRAIN, min((group+1)*CULLGRAIN, readynum));
+    });
+    joinlists(groupnum, front->packedchunk != NULL);
+  }
+
+  template <typename T>
+  INLINE void bindmvpshader(const T &s) {
+    ogl::bindshader(s);
+    ogl::uniformmatrix4fv(s.u_mvp, 1, false, &view.mvpmat.vx.x);
+  }
+
+  template <typename T>
+  INLINE void bindpackedshader(const T &s, const geom::packedchunk &c) {
+    bindmvpshader(s);
+    ogl::uniform3fv(s.u_chunkorg, 1, &c.org.x);
+    ogl::uniform3fv(s.u_chunkscale, 1, &c.scale.x);
+  }
+
+  // one multi draw per batch from the indirect buffer or, without it, one
+  // draw per command
+  void submitbatch(const drawbatch &b, int type, bool indirect) {
+    if (indirect) {
+      const auto offset = b.first*sizeof(drawcommand);
+      OGL(MultiDrawElementsIndirect, GL_TRIANGLES, type, (const void*)offset, b.num, 0);
+      return;
+    }
+    rangei(b.first, b.first+b.num) {
+      const auto &cmd = drawn.cmds[i];
+      ogl::drawelements(GL_TRIANGLES, cmd.count, type, (const void*)uintptr_t(cmd.firstindex*front->indexsize));
+    }
+  }
+
+  void drawscene(bool indirect) {
+    const auto packed = front->packedchunk != NULL;
+    const auto type = packed && front->indexsize == sizeof(u16) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    auto last = ~0u;
+    if (!packed) ogl::bindvertexarray(front->vao);
+    loopv(drawn.batches) {
+      const auto &b = drawn.batches[i];
+      if (packed) {
+        const auto &c = front->packedchunk[b.chunk];
+        if (b.chunk != last) ogl::bindvertexarray(front->chunkvao[b.chunk]);
+        if (b.simple)
+          bindpackedshader(packed_simple_material::s, c);
+        else
+          bindpackedshader(packed_noise_material::s, c);
+        last = b.chunk;
+      } else if (b.simple)
+        bindmvpshader(simple_material::s);
+      else
+        bindmvpshader(noise_material::s);
+      submitbatch(b, type, indirect);
+    }
+  }
+
   void dogbuffer() {
-    const auto gbuffertimer = ogl::begintimer("gbuffer", true);
+    const auto gbuffertimer = ogl::begintimer(gbuffertimername, true);
     const GLenum buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+    vec3f lpow[LIGHTNUM];
+    loopi(LIGHTNUM) lpow[i] = float(lightscale) * lightpow[i];
+    startshadows(lightpos, lpow, LIGHTNUM);
     OGL(BindFramebuffer, GL_FRAMEBUFFER, gbuffer);
     OGL(DrawBuffers, 2, buffers);
     OGL(Clear, GL_DEPTH_BUFFER_BIT);
-    if (indexnum != 0) {
+    if (front->indexnum != 0) {
       if (linemode) OGL(PolygonMode, GL_FRONT_AND_BACK, GL_LINE);
-      ogl::bindbuffer(ogl::ARRAY_BUFFER, sceneposbo);
-      ogl::setattribarray()(ogl::ATTRIB_POS0, ogl::ATTRIB_COL);
-      OGL(VertexAttribPointer, ogl::ATTRIB_POS0, 3, GL_FLOAT, 0, sizeof(vec3f), NULL);
-      ogl::bindbuffer(ogl::ARRAY_BUFFER, scenenorbo);
-      OGL(VertexAttribPointer, ogl::ATTRIB_COL, 3, GL_FLOAT, 0, sizeof(vec3f), NULL);
-      ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, sceneibo);
-      loopi(segmentnum) {
-        const auto seg = segment[i];
-        const ogl::shadertype simpleshader = simple_material::s;
-        const ogl::shadertype noiseshader = noise_material::s;
-        const auto simplemvp = simple_material::s.u_mvp;
-        const auto noisemvp = noise_material::s.u_mvp;
-        const auto simple = seg.mat == csg::MAT_SIMPLE_INDEX;
-        const auto u_mvp = simple ? simplemvp : noisemvp;
-        ogl::bindshader(simple ? simpleshader : noiseshader);
-        OGL(UniformMatrix4fv, u_mvp, 1, GL_FALSE, &game::mvpmat.vx.x);
-        ogl::drawelements(GL_TRIANGLES, seg.num, GL_UNSIGNED_INT, (const void*)(seg.start*sizeof(u32)));
-      }
-      ogl::bindbuffer(ogl::ELEMENT_ARRAY_BUFFER, 0);
-      ogl::bindbuffer(ogl::ARRAY_BUFFER, 0);
+      const frustum f(view.mvpmat);
+      if (occlusioncull) fetchhiz(); else hizvalid = false;
+      cullscene(f);
+      const auto indirect = ogl::hasMDI && multidraw && drawn.cmds.length() != 0;
+      if (indirect) uploadindirect(drawn.cmds);
+      drawscene(indirect);
+      if (indirect) nextindirect();
+      ogl::bindvertexarray(0);
       if (linemode) OGL(PolygonMode, GL_FRONT_AND_BACK, GL_FILL);
+
+      // only the world occludes. models are tested against it
+      if (occlusioncull) {
+        readbackhiz();
+        OGL(BindFramebuffer, GL_FRAMEBUFFER, gbuffer);
+        OGL(DrawBuffers, 2, buffers);
+      }
     }
-    game::renderclients();
-    game::rendermonsters();
-    drawhudgun(fovy, aspect, farplane);
+    md2::flush();
     OGL(BindFramebuffer, GL_FRAMEBUFFER, 0);
     ogl::endtimer(gbuffertimer);
   }
 
   void dodeferred() {
-    const auto deferredtimer = ogl::begintimer("deferred", true);
+    const auto deferredtimer = ogl::begintimer(deferredtimername, true);
     OGL(BindFramebuffer, GL_FRAMEBUFFER, shadedbuffer);
     ogl::disablev(GL_CULL_FACE, GL_DEPTH_TEST);
-    auto &s = deferred::s[LIGHTNUM-1];
-    ogl::bindshader(s);
     ogl::bindtexture(GL_TEXTURE_RECTANGLE, gnortex, 0);
     ogl::bindtexture(GL_TEXTURE_RECTANGLE, gdiffusetex, 1);
     ogl::bindtexture(GL_TEXTURE_RECTANGLE, gdepthtex, 2);
-    OGL(UniformMatrix4fv, s.u_invmvp, 1, GL_FALSE, &game::invmvpmat.vx.x);
-    OGL(UniformMatrix4fv, s.u_dirinvmvp, 1, GL_FALSE, &game::dirinvmvpmat.vx.x);
-
     const auto sundir = getsundir();
     vec3f lpow[LIGHTNUM];
     loopi(LIGHTNUM) lpow[i] = float(lightscale) * lightpow[i];
-    OGL(Uniform3fv, s.u_sundir, 1, &sundir.x);
-    OGL(Uniform3fv, s.u_lightpos, LIGHTNUM, &lightpos[0].x);
-    OGL(Uniform3fv, s.u_lightpow, LIGHTNUM, &lpow[0].x);
+    if (tiledlighting && ogl::hasTB && tiled_deferred::s.program != 0) {
+      if (quality <= QUALITY_NOLIGHTS && lights.length() > LOWQUALITYLIGHTS)
+        lights.setsize(LOWQUALITYLIGHTS);
+      loopi(LIGHTNUM) addlight(lightpos[i], lpow[i], shadowscale ? i : -1);
+      binlights(view.mvpmat, sys::scrw, sys::scrh);
+      uploadlights();
+      uploadshadows();
+      auto &s = tiled_deferred::s;
+      ogl::bindshader(s);
+      ogl::bindtexture(GL_TEXTURE_BUFFER, lighttex, 3);
+      OGL(TexBuffer, GL_TEXTURE_BUFFER, GL_RGBA32F, lightbo);
+      ogl::bindtexture(GL_TEXTURE_BUFFER, lightgridtex, 4);
+      OGL(TexBuffer, GL_TEXTURE_BUFFER, GL_R32UI, lightgridbo);
+      ogl::uniformmatrix4fv(s.u_invmvp, 1, false, &view.invmvpmat.vx.x);
+      ogl::uniformmatrix4fv(s.u_dirinvmvp, 1, false, &view.dirinvmvpmat.vx.x);
+      ogl::uniform3fv(s.u_sundir, 1, &sundir.x);
+      ogl::uniform1i(s.u_tilew, tilew);
+      ogl::uniform1i(s.u_shadowscale, shadowscale);
+      const auto probescale = front->probetex[0] ? float(indirect)/100.f : 0.f;
+      loopi(3) ogl::bindtexture(GL_TEXTURE_3D, front->probetex[i], 6+i);
+      ogl::uniform3fv(s.u_probeorg, 1, &front->probeorg.x);
+      const auto rcpextent = vec3f(one) / (front->probetex[0] ? front->probeextent : vec3f(one));
+      ogl::uniform3fv(s.u_rcpprobeextent, 1, &rcpextent.x);
+      ogl::uniform1f(s.u_probescale, probescale);
+      const auto hasdist = front->distindextex != 0;
+      const auto cellsize = hasdist ? front->distcellsize : 1.f;
+      ogl::bindtexture(GL_TEXTURE_3D, front->distindextex, 9);
+      ogl::bindtexture(GL_TEXTURE_3D, front->distatlastex, 10);
+      ogl::uniform3fv(s.u_distorg, 1, &front->distorg.x);
+      ogl::uniform1f(s.u_rcpdistcell, 1.f/cellsize);
+      ogl::uniform1f(s.u_distbrickdim, float(csg::BRICKDIM));
+      ogl::uniform1f(s.u_distmax, cellsize*float(csg::BRICKDIM));
+      ogl::uniform1f(s.u_distao, hasdist ? float(distao)/100.f : 0.f);
+    } else {
+      auto &s = deferred::s[LIGHTNUM-1];
+      ogl::bindshader(s);
+      ogl::uniformmatrix4fv(s.u_invmvp, 1, false, &view.invmvpmat.vx.x);
+      ogl::uniformmatrix4fv(s.u_dirinvmvp, 1, false, &view.dirinvmvpmat.vx.x);
+      ogl::uniform3fv(s.u_sundir, 1, &sundir.x);
+      ogl::uniform3fv(s.u_lightpos, LIGHTNUM, &lightpos[0].x);
+      ogl::uniform3fv(s.u_lightpow, LIGHTNUM, &lpow[0].x);
+    }
+    lights.setsize(0);
     ogl::immdraw("Sp2", 4, screenquad::getnormalized().v);
     ogl::enable(GL_DEPTH_TEST);
 
-    render_particles(int(game::curtime()));
+    render_particles();
     OGL(BindFramebuffer, GL_FRAMEBUFFER, 0);
     ogl::enable(GL_CULL_FACE);
     ogl::endtimer(deferredtimer);
   }
 
+  // without fxaa, the shaded image is only copied to the screen
   void dofxaa() {
-    const auto fxaatimer = ogl::begintimer("fxaa", true);
-    ogl::bindshader(fxaa::s);
+    const auto fxaatimer = ogl::begintimer(fxaatimername, true);
     ogl::disable(GL_CULL_FACE);
-    OGL(DepthMask, GL_FALSE);
-    const vec2f rcptexsize(1.f/float(sys::scrw), 1.f/float(sys::scrh));
-    OGL(Uniform2fv, fxaa::s.u_rcptexsize, 1, &rcptexsize.x);
+    ogl::depthmask(false);
     ogl::bindtexture(GL_TEXTURE_2D, finaltex, 0);
-    ogl::immdraw("Sp2", 4, screenquad::getnormalized().v);
-    OGL(DepthMask, GL_TRUE);
+    if (quality > QUALITY_NOFXAA) {
+      ogl::bindshader(fxaa::s);
+      const vec2f rcptexsize(1.f/float(sys::scrw), 1.f/float(sys::scrh));
+      ogl::uniform2fv(fxaa::s.u_rcptexsize, 1, &rcptexsize.x);
+      ogl::immdraw("Sp2", 4, screenquad::getnormalized().v);
+    } else {
+      const float coords[] = {
+        1.f,1.f,1.f,1.f, 1.f,-1.f,1.f,0.f, -1.f,1.f,0.f,1.f, -1.f,-1.f,0.f,0.f
+      };
+      ogl::pushmode(ogl::MODELVIEW);
+      ogl::identity();
+      ogl::pushmode(ogl::PROJECTION);
+      ogl::identity();
+      ogl::bindfixedshader(ogl::FIXED_DIFFUSETEX);
+      ogl::immdraw("Sp2t2", 4, coords);
+      ogl::popmode(ogl::PROJECTION);
+      ogl::popmode(ogl::MODELVIEW);
+    }
+    ogl::depthmask(true);
     ogl::enable(GL_CULL_FACE);
     ogl::endtimer(fxaatimer);
   }
@@ -775,32 +2428,69 @@ struct context {
 VAR(shadertoy, 0, 0, 1);
 
 static void doshadertoy(float fovy, float aspect, float farplane) {
-  const auto shadertoytimer = ogl::begintimer("shadertoy", true);
+  const auto shadertoytimer = ogl::begintimer(shadertoytimername, true);
   const auto w = float(sys::scrw), h = float(sys::scrh);
   ogl::bindshader(hell::s);
   ogl::disablev(GL_CULL_FACE, GL_DEPTH_TEST);
-  OGL(DepthMask, GL_FALSE);
+  ogl::depthmask(false);
   const vec2f iResolution(w, h);
   const float sec = 1e-3f * sys::millis();
-  OGL(Uniform3fv, hell::s.iResolution, 1, &iResolution.x);
-  OGL(Uniform1f, hell::s.iGlobalTime, sec);
+  ogl::uniform3fv(hell::s.iResolution, 1, &iResolution.x);
+  ogl::uniform1f(hell::s.iGlobalTime, sec);
   ogl::immdraw("Sp2", 4, screenquad::getnormalized().v);
-  OGL(DepthMask, GL_TRUE);
+  ogl::depthmask(true);
   ogl::enablev(GL_CULL_FACE, GL_DEPTH_TEST);
   ogl::endtimer(shadertoytimer);
 }
 
 VAR(raytrace, 0, 0, 1);
+// tiles traced per frame in the background and accumulated. 0 traces the
+// whole screen and waits for it
+VAR(rtprogressive, 0, 0, 1<<16);
+// sphere trace the csg scene instead of the bvh. the scene is compiled every
+// frame such that its edits show up without meshing it again
+VAR(csgpreview, 0, 0, 1);
+
+static void spheretrace(int *pixels, int w, int h) {
+  const auto n = csg::scene();
+  if (n == NULL) {
+    memset(pixels, 0, w*h*sizeof(int));
+    return;
+  }
+  // the display of the traced pixels mirrors x (see texbuf_fp.glsl)
+  const mat4x4f mirror(vec4f(-1.f,0.f,0.f,0.f),
+                       vec4f(0.f, 1.f,0.f,0.f),
+                       vec4f(0.f, 0.f,1.f,0.f),
+                       vec4f(float(w),0.f,0.f,1.f));
+  const auto p = csg::compile(*n);
+  csg::spheretrace(p, pixels, w, h, view.eye, view.invmvpmat*mirror,
+                   getsundir(), 100.f);
+  csg::destroy(p);
+}
+
+static void tracescreen(int *pixels, const vec3f &pos, const vec3f &ypr,
+                        int w, int h, float fov, float aspect) {
+  if (csgpreview)
+    spheretrace(pixels,w,h);
+  else if (rtprogressive)
+    rt::raytraceprogressive(pixels,pos,ypr,w,h,fov,aspect,rtprogressive);
+  else
+    rt::raytrace(pixels,pos,ypr,w,h,fov,aspect);
+}
 
 static void ogl2raytrace(int w, int h, float fov, float aspect) {
-  const auto pos = game::player1->o;
-  const auto ypr = game::player1->ypr;
+  const auto pos = view.eye;
+  const auto ypr = view.ypr;
   const auto starttotal = sys::millis();
-  const auto pixels = (int*) pbomap(rtpbo);
+  const auto pixels = rtmap();
+  vec3f lpow[LIGHTNUM];
+  loopi(LIGHTNUM) lpow[i] = float(lightscale) * lightpow[i];
+  rt::setlights(lightpos, lpow, LIGHTNUM);
   const auto start = sys::millis();
-  rt::raytrace(pixels,pos,ypr,w,h,fov,aspect);
+  tracescreen(pixels,pos,ypr,w,h,fov,aspect);
   const auto end = sys::millis();
-  pbounmap(rtpbo, rttex);
+  rtunmap();
+  rtupload(rtbuf[rtcurr].pbo, rttex);
   const auto endtotal = sys::millis();
   printf("\rrt %f total %f              ", float(end-start), float(endtotal-starttotal));
   ogl::bindfixedshader(ogl::FIXED_DIFFUSETEX);
@@ -814,60 +2504,137 @@ static void ogl2raytrace(int w, int h, float fov, float aspect) {
   };
   ogl::immdraw("Sp2t2", 4, coords);
   popscreentransform();
+  rtnext();
 }
 
 static void ogl3raytrace(int w, int h, float fov, float aspect) {
-  const auto pos = game::player1->o;
-  const auto ypr = game::player1->ypr;
+  const auto pos = view.eye;
+  const auto ypr = view.ypr;
   const auto starttotal = sys::millis();
-  const auto pixels = (int*) texbufmap(rtpbo);
+  const auto pixels = rtmap();
+  vec3f lpow[LIGHTNUM];
+  loopi(LIGHTNUM) lpow[i] = float(lightscale) * lightpow[i];
+  rt::setlights(lightpos, lpow, LIGHTNUM);
   const auto start = sys::millis();
-  rt::raytrace(pixels,pos,ypr,w,h,fov,aspect);
+  tracescreen(pixels,pos,ypr,w,h,fov,aspect);
   const auto end = sys::millis();
-  texbufunmap(rtpbo);
+  rtunmap();
   const auto endtotal = sys::millis();
   printf("\rrt %f total %f              ", float(end-start), float(endtotal-starttotal));
   ogl::bindshader(texbuf::s);
   ogl::bindtexture(GL_TEXTURE_BUFFER, rttex, 0);
-  OGL(TexBuffer, GL_TEXTURE_BUFFER, GL_RGBA8, rtpbo);
-  OGL(Uniform1i, texbuf::s.u_width, w);
+  OGL(TexBuffer, GL_TEXTURE_BUFFER, GL_RGBA8, rtbuf[rtcurr].pbo);
+  ogl::uniform1i(texbuf::s.u_width, w);
   pushscreentransform();
   ogl::immdraw("Sp2", 4, screenquad::get().v);
   popscreentransform();
+  rtnext();
 }
 
-void frame(int w, int h, int curfps) {
+// the console shows what the startup tasks are doing under it
+static void drawloading() {
+  const auto scr = scrdim();
+  OGL(ClearColor, 0.f, 0.f, 0.f, 1.f);
+  OGL(Clear, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  ogl::enablev(GL_BLEND);
+  ogl::blendfunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  pushscreentransform();
+  text::displaywidth(text::fontdim().x);
+  OGL(VertexAttrib4f,ogl::ATTRIB_COL,1.f,1.f,1.f,1.f);
+  const auto msg = "loading scene...";
+  const auto pos = vec2f(0.5f*(scr.x-text::width(msg)), 0.5f*scr.y);
+  text::draw(msg, pos.x, pos.y);
+  text::flush();
+  ogl::disablev(GL_BLEND);
+  popscreentransform();
+}
+
+void setgamethread(bool on) {
+  gamethread = on;
+  if (!on) flushspawns();
+}
+
+void record(int w, int h) {
+  MEMORY_TAG(MEM_RENDER);
+  view.mvmat = game::mvmat;
+  view.mvpmat = game::mvpmat;
+  view.invmvpmat = game::invmvpmat;
+  view.dirinvmvpmat = game::dirinvmvpmat;
+  view.eye = game::player1->o;
+  view.ypr = game::player1->ypr;
+  view.lastmillis = game::lastmillis();
+  view.curtime = game::curtime();
+  view.w = w;
+  view.h = h;
+  if (!makescene())
+    view.mode = FRAME_LOADING;
+  else if (shadertoy)
+    view.mode = FRAME_SHADERTOY;
+  else if (raytrace || csgpreview)
+    view.mode = FRAME_RAYTRACE;
+  else
+    view.mode = FRAME_DEFERRED;
+  flushspawns();
+  if (view.mode != FRAME_DEFERRED) return;
+
+  // models are only queued here. md2::flush draws them with the g-buffer
+  if (demo::playing() && demotracking) {
+    const vec3f nom(0, 0, 0);
+    addparticle(view.eye, nom, 100000000, 8, int(view.lastmillis));
+  }
+  game::renderclients();
+  game::rendermonsters();
+  drawhudgun();
+}
+
+void submit() {
+  MEMORY_TAG(MEM_RENDER);
+  adaptquality();
+  uploadscene();
+  const auto w = view.w, h = view.h;
   const auto farplane = 100.f;
   const auto aspect = float(w) / float(h);
   const auto fovy = float(fov) / aspect;
-  if (shadertoy)
+  if (view.mode == FRAME_LOADING)
+    drawloading();
+  else if (view.mode == FRAME_SHADERTOY)
     doshadertoy(fovy,aspect,farplane);
-  else if (raytrace) {
-    const auto rttimer = ogl::begintimer("rt", true);
+  else if (view.mode == FRAME_RAYTRACE) {
+    const auto rttimer = ogl::begintimer(rttimername, true);
     ogl::disable(GL_CULL_FACE);
-    OGL(DepthMask, GL_FALSE);
+    ogl::depthmask(false);
     if (ogl::hasTB)
       ogl3raytrace(w,h,fov,aspect);
     else
       ogl2raytrace(w,h,fov,aspect);
     ogl::enable(GL_CULL_FACE);
-    OGL(DepthMask, GL_TRUE);
+    ogl::depthmask(true);
     ogl::endtimer(rttimer);
   } else {
     context ctx(float(w),float(h),float(fov),aspect,farplane);
+    startparticles(int(view.curtime));
     ctx.begin();
     ctx.dogbuffer();
     ctx.dodeferred();
     ctx.dofxaa();
     ctx.end();
   }
+}
 
-  const auto hudtimer = ogl::begintimer("hud", true);
+void hud(int w, int h, int curfps) {
+  MEMORY_TAG(MEM_RENDER);
+  const auto hudtimer = ogl::begintimer(hudtimername, true);
   ogl::disable(GL_CULL_FACE);
   drawhud(w,h,curfps);
   ogl::enable(GL_CULL_FACE);
   ogl::endtimer(hudtimer);
 }
+
+void frame(int w, int h, int curfps) {
+  record(w,h);
+  submit();
+  hud(w,h,curfps);
+}
 } /* namespace rr */
 } /* namespace q */
 
@@ -10,6 +10,9 @@ namespace rr {
 static const float VIRTW = 1024.f; // for scalable UI
 static const float PIXELTAB = 1.f; // tabulation size
 extern float VIRTH;                // depends on aspect ratio
+// octahedron encoded rg16 normals and the material in the alpha of the
+// diffuse target. only read when the renderer and the shaders start
+extern int packedgbuffer;
 
 // particle types
 enum {
@@ -28,6 +31,11 @@ enum {
 void start();
 void finish();
 
+// mesh the scene of the script and build its bvh in tasks. the frames show a
+// loading screen until the first scene is uploaded. a later one is uploaded
+// while the current one is drawn and swapped in when complete
+void loadscene(const char *filename);
+
 // simple primitives
 void line(int x1, int y1, float z1, int x2, int y2, float z2);
 void box(const vec3i &start, const vec3i &size, const vec3f &col);
@@ -38,8 +46,26 @@ void blendbox(float x1, float y1, float x2, float y2, bool border);
 void particle_splash(int type, int num, int fade, const vec3f &p);
 void particle_trail(int type, int fade, const vec3f &s, const vec3f &e);
 
+// dynamic point lights only live until the end of the frame
+void addlight(const vec3f &pos, const vec3f &pow);
+
+// true if the world hid the box a few frames ago
+bool occluded(const aabb &box);
+
+// visible[i] is false if box[i] is out of the frustum of the recorded view
+void cullboxes(const aabb *box, u32 n, bool *visible);
+
+// a frame is recorded then submitted. record reads all the game state the
+// frame needs: the view, the models and the particles. submit only issues the
+// gl calls of what was recorded. the hud reads the game as it is and goes
+// last. frame() does the three of them
+void record(int w, int h);
+void submit();
 void hud(int w, int h, int curfps);
 void frame(int w, int h, int curfps);
+// with a game thread simulating while the frame is submitted, the particles
+// and the scenes it asks for wait for the next record
+void setgamethread(bool on);
 vec2f scrdim();
 } /* namespace rr */
 } /* namespace q */
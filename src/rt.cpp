@@ -4,19 +4,39 @@
  -------------------------------------------------------------------------*/
 #include "bvh.hpp"
 #include "rt.hpp"
-#include "rtscalar.hpp"
-#include "rtsse.hpp"
-#include "rtavx.hpp"
+#include "capture.hpp"
+#include "kernel.hpp"
 #include "base/math.hpp"
+#include "base/algorithm.hpp"
 #include "base/console.hpp"
 #include "base/task.hpp"
+#include "base/script.hpp"
 
 namespace q {
 namespace rt {
-static intersector *world = NULL;
+static ref<world> current;
+static intersector *scene = NULL; // world and instances on top of it
+
+// the bvh traced by the calls without intersector
+static INLINE intersector *traced() {
+  return scene ? scene : (current ? current->isec : NULL);
+}
+
+// the top level tree points to the world bvh and must go with it
+static void waitprogressive();
+static void restartprogressive();
+static void destroyscene(void) {
+  waitprogressive();
+  destroy(scene);
+  scene = NULL;
+}
+
+// 0: binary bvh only, 1: 4-wide bvh for shadow rays, 2: for all rays
+VARF(widebvh, 0, 0, 2, if (current) widen(current->isec, widebvh != 0));
+VAR(linearbvh, 0, 0, 1); // linear build of the world (the instances always are)
 
 // create a triangle soup and make a mesh out of it
-void buildbvh(vec3f *v, u32 *idx, u32 idxnum) {
+intersector *makebvh(const vec3f *v, const u32 *idx, u32 idxnum) {
   const auto start = sys::millis();
   const auto trinum = idxnum/3;
   auto prim = NEWAE(primitive, trinum);
@@ -24,14 +44,133 @@ void buildbvh(vec3f *v, u32 *idx, u32 idxnum) {
     loopj(3) prim[i].v[j] = v[idx[3*i+j]];
     prim[i].type = primitive::TRI;
   }
-  world = create(prim, trinum);
+  const auto isec = create(prim, trinum, linearbvh ? LINEARBVH : SAHBVH);
+  widen(isec, widebvh != 0);
   const auto ms = sys::millis() - start;
   SAFE_DELA(prim);
   con::out("bvh: elapsed %f ms", float(ms));
+  return isec;
+}
+
+intersector *makebvh(const void *data, u32 size) {
+  const auto isec = deserialize(data, size);
+  if (isec != NULL) widen(isec, widebvh != 0);
+  return isec;
+}
+
+/*-------------------------------------------------------------------------
+ - worlds shared by key. the registry holds a reference on each of them so a
+ - lookup never races with the last release
+ -------------------------------------------------------------------------*/
+static vector<ref<world>> worlds;
+static volatile s32 worldlock = 0;
+static INLINE void lockworlds() { while (atomic_cmpxchg(&worldlock, 1, 0) != 0); }
+static INLINE void unlockworlds() { storerelease(&worldlock, 0); }
+static world *lookup(u64 key) {
+  loopv(worlds) if (worlds[i]->key == key) return worlds[i];
+  return NULL;
+}
+
+world::~world() { destroy(isec); }
+
+ref<world> findworld(u64 key) {
+  lockworlds();
+  const ref<world> w = lookup(key);
+  unlockworlds();
+  return w;
+}
+
+ref<world> makeworld(u64 key, intersector *isec) {
+  lockworlds();
+  ref<world> w = lookup(key);
+  const bool registered = w;
+  if (!registered) {
+    w = NEW(world, key, isec);
+    worlds.add(w);
+  }
+  unlockworlds();
+  if (registered && w->isec != isec) destroy(isec);
+  return w;
+}
+
+void purgeworlds() {
+  lockworlds();
+  for (int i = 0; i < worlds.length();) {
+    if (worlds[i]->refcounter == 1) {
+      worlds[i] = worlds.last();
+      worlds.setsize(worlds.length()-1);
+    } else
+      ++i;
+  }
+  unlockworlds();
+}
+
+void setworld(const ref<world> &w) {
+  destroyscene();
+  current = w;
+  purgeworlds();
+}
+
+ref<world> getworld() { return current; }
+
+void setbvh(intersector *isec) {
+  if (current && current->isec == isec) {
+    destroyscene();
+    return;
+  }
+  setworld(isec ? ref<world>(NEW(world, 0, isec)) : ref<world>());
+}
+
+void buildbvh(vec3f *v, u32 *idx, u32 idxnum) { setbvh(makebvh(v, idx, idxnum)); }
+
+void refitbvh(vec3f *v, u32 *idx, u32 idxnum) {
+  const auto start = sys::millis();
+  const auto trinum = idxnum/3;
+  auto pos = NEWAE(vec3f, idxnum);
+  loopi(s32(idxnum)) pos[i] = v[idx[i]];
+  destroyscene();
+  // a shared world stays as it is for the others
+  const auto refitted = current && current->key == 0 && refit(current->isec, pos, trinum);
+  SAFE_DELA(pos);
+  if (!refitted) {
+    buildbvh(v, idx, idxnum);
+    return;
+  }
+  con::out("bvh: refitted in %f ms", float(sys::millis() - start));
+}
+
+void *storebvh(u32 &size) {
+  if (!current) return NULL;
+  return serialize(current->isec, size);
+}
+
+bool loadbvh(const void *data, u32 size) {
+  const auto isec = makebvh(data, size);
+  if (isec == NULL) return false;
+  setbvh(isec);
+  return true;
+}
+
+void setinstances(const instance *inst, u32 num) {
+  destroyscene();
+  if (!current || num == 0) return;
+  auto prim = NEWAE(primitive, num+1);
+  prim[0] = primitive(current->isec);
+  loopi(s32(num)) prim[i+1] = primitive(inst+i);
+  scene = create(prim, num+1, LINEARBVH);
+  SAFE_DELA(prim);
 }
 
 // void start() {}
-void finish() {destroy(world);}
+static void destroyprogressive();
+static void destroyscheduler();
+void finish() {
+  destroyscene();
+  current = nil;
+  worlds.destroy();
+  destroyprogressive();
+  destroyscheduler();
+}
 
 camera::camera(vec3f org, vec3f up, vec3f view, float fov, float ratio) :
   org(org), up(up), view(view), fov(fov), ratio(ratio)
@@ -49,40 +188,357 @@ camera::camera(vec3f org, vec3f up, vec3f view, float fov, float ratio) :
   xaxis *= ratio;
 }
 
-#define NORMAL_ONLY 0
-#define RTVER avx
+/*-------------------------------------------------------------------------
+ - ray streams
+ -------------------------------------------------------------------------*/
+static const u32 STREAMCHUNK = 16384; // rays traced by one task
+static const u32 MORTONBITS = 9;     // per axis below the 3 octant bits
+
+// spread the 9 low bits such that there are two zeros between them
+static INLINE u32 spreadbits(u32 x) {
+  x &= 0x1ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8))  & 0x0300f00f;
+  x = (x | (x << 4))  & 0x030c30c3;
+  x = (x | (x << 2))  & 0x09249249;
+  return x;
+}
+
+void sortstream(raystream &s) {
+  const auto n = s.length();
+  s.order.setsize(n);
+  if (n == 0) return;
+  vec3f pmin(FLT_MAX), pmax(-FLT_MAX);
+  loopi(s32(n)) loopk(3) {
+    pmin[k] = min(pmin[k], s.org[k][i]);
+    pmax[k] = max(pmax[k], s.org[k][i]);
+  }
+  const auto extent = pmax - pmin;
+  const auto scale = float(1u<<MORTONBITS) / max(max(extent.x,extent.y),max(extent.z,FLT_MIN));
+  vector<u32> keys(n), tmpkeys(n), tmporder(n);
+  loopi(s32(n)) {
+    u32 key = 0;
+    loopk(3) {
+      const auto q = u32(min((s.org[k][i]-pmin[k])*scale, float((1u<<MORTONBITS)-1)));
+      key |= spreadbits(q) << k;
+      key |= (s.dir[k][i] < 0.f ? 1u : 0u) << (3*MORTONBITS+k);
+    }
+    keys[i] = key;
+    s.order[i] = i;
+  }
+
+  // lsd radix sort on 3 passes of 10 bits
+  u32 *srckey = &keys[0], *dstkey = &tmpkeys[0];
+  u32 *srcorder = &s.order[0], *dstorder = &tmporder[0];
+  loopj(3) {
+    const auto shift = 10*j;
+    u32 count[1024];
+    memset(count, 0, sizeof(count));
+    loopi(s32(n)) ++count[(srckey[i]>>shift)&1023];
+    u32 sum = 0;
+    loopi(1024) {
+      const auto c = count[i];
+      count[i] = sum;
+      sum += c;
+    }
+    loopi(s32(n)) {
+      const auto dst = count[(srckey[i]>>shift)&1023]++;
+      dstkey[dst] = srckey[i];
+      dstorder[dst] = srcorder[i];
+    }
+    swap(srckey, dstkey);
+    swap(srcorder, dstorder);
+  }
+  // odd number of passes: the sorted order is in the temporary buffer
+  memcpy(&s.order[0], srcorder, sizeof(u32)*n);
+}
+
+struct streamtask : public task {
+  streamtask(const intersector *bvhisec, raystream &s, bool shadow) :
+    task("streamtask", (s.length()+STREAMCHUNK-1)/STREAMCHUNK, 1, 0, UNFAIR),
+    bvhisec(bvhisec), s(s), shadow(shadow)
+  {}
+  virtual void run(u32 chunk) {
+    const auto &k = kernel::get();
+    const auto first = chunk*STREAMCHUNK;
+    const auto num = min(STREAMCHUNK, s.length()-first);
+    if (shadow)
+      k.occludedstream(*bvhisec, s, first, num);
+    else
+      k.closeststream(*bvhisec, s, first, num);
+  }
+  const intersector *bvhisec;
+  raystream &s;
+  bool shadow;
+};
+
+static void trace(raystream &s, bool shadow) {
+  const auto isec = traced();
+  if (isec == NULL || s.length() == 0) return;
+  if (u32(s.order.length()) != s.length()) sortstream(s);
+  ref<task> job = NEWTASK(streamtask, isec, s, shadow);
+  job->scheduled();
+  job->wait();
+}
+
+void closest(raystream &s) {
+  const auto n = s.length();
+  s.t.setsize(n);
+  s.u.setsize(n);
+  s.v.setsize(n);
+  s.id.setsize(n);
+  loopk(3) s.n[k].setsize(n);
+  loopi(s32(n)) {
+    s.t[i] = s.tfar[i];
+    s.id[i] = -1;
+  }
+  trace(s, false);
+}
+
+void occluded(raystream &s) {
+  s.occluded.setsize(s.length());
+  s.occluded.memset(0);
+  trace(s, true);
+}
+
+/*-------------------------------------------------------------------------
+ - single ray queries
+ -------------------------------------------------------------------------*/
+bool closest(const intersector *isec, const ray &r, hit &h) {
+  if (isec == NULL) return false;
+  h = hit(r.tfar);
+  kernel::get().closestray(*isec, r, h);
+  return h.is_hit();
+}
+
+void closest(const intersector *isec, const ray *r, u32 n, hit *h) {
+  loopi(s32(n)) h[i] = hit(r[i].tfar);
+  if (isec == NULL) return;
+  const auto &k = kernel::get();
+  loopi(s32(n)) k.closestray(*isec, r[i], h[i]);
+}
+
+bool occluded(const intersector *isec, const ray &r) {
+  return isec != NULL && kernel::get().occludedray(*isec, r);
+}
+
+void occluded(const intersector *isec, const ray *r, u32 n, s32 *occluded) {
+  if (isec == NULL)
+    memset(occluded, 0, sizeof(s32)*n);
+  else
+    kernel::get().occludedrays(*isec, r, n, occluded);
+}
+
+bool closest(const ray &r, hit &h) { return closest(traced(), r, h); }
+void closest(const ray *r, u32 n, hit *h) { closest(traced(), r, n, h); }
+bool occluded(const ray &r) { return occluded(traced(), r); }
+void occluded(const ray *r, u32 n, s32 *occluded) { rt::occluded(traced(), r, n, occluded); }
+
+// 1: primary rays only and the normals are written
+VAR(rtnormalonly, 0, 0, 1);
 
 //static const vec3f lpos(0.f, -4.f, 2.f);
 static const vec3f lpos(35.f, 10.f, 11.f);
 //static const vec3f lpos(0.f, 4.f, 0.f);
 static atomic totalraynum;
+
+// lights set by the renderer. without any, we only shade with "lpos"
+static const u32 MAXLIGHTNUM = 16;
+static vec3f lightpos[MAXLIGHTNUM], lightpow[MAXLIGHTNUM];
+static u32 lightnum = 0;
+static const u32 MAXAOSAMPLES = 64;
+VAR(rtaosamples, 0, 0, MAXAOSAMPLES); // ambient occlusion rays per pixel
+VAR(rtaodist, 1, 4, 64);    // length of ambient occlusion rays
+VAR(rtambient, 0, 20, 100); // ambient light in percent
+
+void setlights(const vec3f *pos, const vec3f *pow, u32 num) {
+  num = min(num, MAXLIGHTNUM);
+  auto same = num == lightnum;
+  loopi(s32(num)) same = same && all(pos[i]==lightpos[i]) && all(pow[i]==lightpow[i]);
+  if (same) return;
+  restartprogressive();
+  lightnum = num;
+  loopi(s32(lightnum)) {
+    lightpos[i] = pos[i];
+    lightpow[i] = pow[i];
+  }
+}
+
+static INLINE u32 hashu32(u32 x) {
+  x ^= x >> 16; x *= 0x7feb352du;
+  x ^= x >> 15; x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+static INLINE float hashfloat(u32 x) { return float(hashu32(x)>>8) * (1.f/float(1u<<24)); }
+
+// cosine weighted direction of the hemisphere around z. samples are
+// stratified along u and rotated by a random offset per pixel
+static INLINE vec3f aodir(u32 sample, u32 samplenum, u32 seed) {
+  const auto u = (float(sample) + hashfloat(seed)) / float(samplenum);
+  const auto v = fmod(float(sample) * 0.618034f + hashfloat(seed^0x9e3779b9u), 1.f);
+  const auto r = sqrt(u), phi = 2.f * float(pi) * v;
+  return vec3f(r*cos(phi), r*sin(phi), sqrt(max(1.f-u, 0.f)));
+}
+
+// shadow rays of one tile, the pixels they come from and what they bring
+struct shadowbatch {
+  raypacket p;
+  packetshadow s;
+  u32 pixel[MAXRAYNUM];
+  vec3f contrib[MAXRAYNUM];
+  array3f rgb;
+};
+
+// progressive rendering: passes over all tiles are averaged per pixel
+struct accumulation {
+  INLINE void blend(u32 tileID, vec2i tileorg, vec2i dim, const int *pixels) {
+    const auto n = float(++samples[tileID]);
+    const auto w = 1.f/n;
+    for (auto y = tileorg.y; y < tileorg.y+TILESIZE; ++y)
+    for (auto x = tileorg.x; x < tileorg.x+TILESIZE; ++x) {
+      const auto offset = x+y*dim.x;
+      const auto c = pixels[offset];
+      u32 rgb = 0xff000000;
+      loopk(3) {
+        auto &acc = sum[3*offset+k];
+        acc += float((c>>(8*k))&0xff);
+        rgb |= u32(min(acc*w+0.5f, 255.f)) << (8*k);
+      }
+      display[offset] = rgb;
+    }
+  }
+  vector<float> sum;   // rgb sums per pixel
+  vector<u32> samples; // passes per tile
+  vector<int> display; // current average
+  vector<int> scratch; // tiles of the current pass
+};
+
+// tiles with no primary hit in the last frame. they drive the batch size
+static atomic emptytilenum;
+
+/*-------------------------------------------------------------------------
+ - traversal statistics. the counters of the threads are reset before every
+ - tile and kept per tile by raytrace
+ -------------------------------------------------------------------------*/
+// 0: off. heat map of 1: nodes, 2: boxes, 3: triangles, 4: lane occupancy,
+// 5: rays traced alone
+VAR(rtstats, 0, 0, 5);
+static THREAD raystats localstats;
+static vector<raystats> tilestats; // last raytrace call
+static vec2i statsdim;
+
+raystats *threadstats() { return rtstats ? &localstats : NULL; }
+
+static INLINE float statsvalue(const raystats &st, int which) {
+  switch (which) {
+    case 1: return float(st.nodes);
+    case 2: return float(st.boxes);
+    case 3: return float(st.tris);
+    case 4: return st.lanes ? float(st.active)/float(st.lanes) : 0.f;
+    default: return float(st.single);
+  }
+}
+
+// blue (cold) to green to red (hot)
+static INLINE int heatcolor(float x) {
+  const auto r = clamp(2.f*x-1.f), g = 1.f-abs(2.f*x-1.f), b = clamp(1.f-2.f*x);
+  return int(0xff000000u | u32(255.f*r) | u32(255.f*g)<<8 | u32(255.f*b)<<16);
+}
+
+static void rtheatmap(const char *name) {
+  const auto tile = statsdim/int(TILESIZE);
+  if (tilestats.length() != tile.x*tile.y || tilestats.length() == 0) {
+    con::out("rt: no statistics. set rtstats and trace a frame");
+    return;
+  }
+  const auto which = rtstats ? rtstats : 1;
+  raystats sum;
+  ZERO(&sum);
+  auto maxvalue = 0.f;
+  loopv(tilestats) {
+    const auto &st = tilestats[i];
+    sum.nodes += st.nodes;
+    sum.boxes += st.boxes;
+    sum.tris += st.tris;
+    sum.lanes += st.lanes;
+    sum.active += st.active;
+    sum.single += st.single;
+    maxvalue = max(maxvalue, statsvalue(st, which));
+  }
+  const auto scale = which == 4 ? 1.f : (maxvalue > 0.f ? 1.f/maxvalue : 0.f);
+  vector<int> pixels(statsdim.x*statsdim.y);
+  loopi(statsdim.y) loopj(statsdim.x) {
+    const auto &st = tilestats[(i/TILESIZE)*tile.x + j/TILESIZE];
+    pixels[i*statsdim.x+j] = heatcolor(statsvalue(st, which)*scale);
+  }
+  capture::writeimage(&pixels[0], statsdim.x, statsdim.y, name);
+  const auto n = double(statsdim.x*statsdim.y);
+  con::out("rt: per pixel %.1f nodes %.1f boxes %.1f triangles, %.1f%% lanes active, %llu single rays",
+           double(sum.nodes)/n, double(sum.boxes)/n, double(sum.tris)/n,
+           sum.lanes ? 100.0*double(sum.active)/double(sum.lanes) : 0.0,
+           (unsigned long long) sum.single);
+  con::out("rt: heat map written to %s", name);
+}
+CMD(rtheatmap);
+
+// 0: adaptive, n: number of tiles every task element traces
+VAR(rtbatch, 0, 0, 64);
+
+// one task element traces a batch of consecutive tiles of the given order
 struct raycasttask : public task {
-  raycasttask(intersector *bvhisec, const camera &cam, int *pixels, vec2i dim, vec2i tile) :
-    task("raycasttask", tile.x*tile.y, 1, 0, UNFAIR),
-    bvhisec(bvhisec), cam(cam), pixels(pixels), dim(dim), tile(tile)
+  raycasttask(intersector *bvhisec, const camera &cam, int *pixels, vec2i dim, vec2i tile,
+              u32 tilenum, const u32 *tiles, u32 batch = 1, accumulation *acc = NULL,
+              atomic *pending = NULL, u32 pass = 0) :
+    task("raycasttask", (tilenum+batch-1)/batch, 1, 0, UNFAIR),
+    bvhisec(bvhisec), cam(cam), pixels(pixels), dim(dim), tile(tile),
+    tilenum(tilenum), tiles(tiles), batch(batch), acc(acc), pending(pending), pass(pass)
   {}
   INLINE u32 primarypoint(vec2i tileorg, array3f &pos, array3f &nor, arrayi &mask) {
+    const auto &k = kernel::get();
     raypacket p;
     packethit hit;
-    RTVER::visibilitypacket(cam, p, tileorg, dim);
-    RTVER::clearpackethit(hit);
-    RTVER::closest(*bvhisec, p, hit);
-    return RTVER::primarypoint(p, hit, pos, nor, mask);
+    k.visibilitypacket(cam, p, tileorg, dim);
+    k.clearpackethit(hit);
+    if (widebvh == 2)
+      k.closest4(*bvhisec, p, hit);
+    else
+      k.closest(*bvhisec, p, hit);
+    return k.primarypoint(p, hit, pos, nor, mask);
   }
-  virtual void run(u32 tileID) {
+  virtual void run(u32 idx) {
+    const auto first = idx*batch, last = min(first+batch, tilenum);
+    for (auto i = first; i < last; ++i) {
+      const auto tileID = tiles[i];
+      const auto stats = acc == NULL && u32(tilestats.length()) > tileID;
+      if (stats) ZERO(&localstats);
+      trace(tileID);
+      if (stats) tilestats[tileID] = localstats;
+      if (acc) {
+        const vec2i tilexy(tileID%tile.x, tileID/tile.x);
+        acc->blend(tileID, int(TILESIZE) * tilexy, dim, pixels);
+      }
+      if (pending) --*pending;
+    }
+  }
+  void trace(u32 tileID) {
     const vec2i tilexy(tileID%tile.x, tileID/tile.x);
     const vec2i tileorg = int(TILESIZE) * tilexy;
+    const auto &k = kernel::get();
 
-#if NORMAL_ONLY
     // primary intersections
-    raypacket p;
-    packethit hit;
-    RTVER::visibilitypacket(cam, p, tileorg, dim);
-    RTVER::clearpackethit(hit);
-    RTVER::closest(*bvhisec, p, hit);
-    RTVER::writenormal(hit, tileorg, dim, pixels);
-    totalraynum += TILESIZE*TILESIZE;
-#else
+    if (rtnormalonly) {
+      raypacket p;
+      packethit hit;
+      k.visibilitypacket(cam, p, tileorg, dim);
+      k.clearpackethit(hit);
+      k.closest(*bvhisec, p, hit);
+      k.writenormal(hit, tileorg, dim, pixels);
+      totalraynum += TILESIZE*TILESIZE;
+      return;
+    }
+
     // shadow rays toward the light source
     array3f pos, nor;
     arrayi mask;
@@ -90,39 +546,528 @@ struct raycasttask : public task {
     packetshadow occluded;
     const auto validnum = primarypoint(tileorg, pos, nor, mask);
     if (validnum == 0) {
-      RTVER::clear(tileorg, dim, pixels);
+      k.clear(tileorg, dim, pixels);
+      totalraynum += TILESIZE*TILESIZE;
+      ++emptytilenum;
+    } else if (lightnum != 0 || rtaosamples != 0) {
+      shadowbatch b;
+      shadelights(b, tileID, pos, nor, mask);
+      k.writecolor(b.rgb, tileorg, dim, pixels);
       totalraynum += TILESIZE*TILESIZE;
     } else {
       //const auto sec = game::lastmillis()/1000.f;
       const auto newpos = lpos;// + vec3f(10.f*sin(sec),0.f, 10.f*cos(sec));
-      RTVER::shadowpacket(pos, mask, newpos, shadow, occluded, TILESIZE*TILESIZE);
-      RTVER::occluded(*bvhisec, shadow, occluded);
-      RTVER::writendotl(shadow, nor, occluded, tileorg, dim, pixels);
+      k.shadowpacket(pos, mask, newpos, shadow, occluded, TILESIZE*TILESIZE);
+      if (widebvh != 0)
+        k.occluded4(*bvhisec, shadow, occluded);
+      else
+        k.occluded(*bvhisec, shadow, occluded);
+      k.writendotl(shadow, nor, occluded, tileorg, dim, pixels);
       totalraynum += shadow.raynum+TILESIZE*TILESIZE;
     }
-#endif
+  }
+  // trace the packed shadow rays and accumulate the visible contributions
+  void flush(shadowbatch &b) {
+    if (b.p.raynum == 0) return;
+    const auto &k = kernel::get();
+    if (widebvh != 0)
+      k.occluded4(*bvhisec, b.p, b.s);
+    else
+      k.occluded(*bvhisec, b.p, b.s);
+    loopi(s32(b.p.raynum)) if (!b.s.occluded[i]) {
+      const auto idx = b.pixel[i];
+      loopk(3) b.rgb[k][idx] += b.contrib[i][k];
+    }
+    totalraynum += b.p.raynum;
+    b.p.raynum = 0;
+  }
+  INLINE void addray(shadowbatch &b, vec3f org, vec3f dir, u32 idx, vec3f c) {
+    const auto id = b.p.raynum++;
+    b.p.vorg[0][id] = org.x;
+    b.p.vorg[1][id] = org.y;
+    b.p.vorg[2][id] = org.z;
+    b.p.setdir(dir, id);
+    b.s.t[id] = 1.f;
+    b.s.occluded[id] = 0;
+    b.pixel[id] = idx;
+    b.contrib[id] = c;
+    if (b.p.raynum == MAXRAYNUM) flush(b);
+  }
+  // shadow rays of all lights and ambient occlusion rays of the tile go
+  // together in full packets
+  void shadelights(shadowbatch &b, u32 tileID, const array3f &pos,
+                   const array3f &nor, const arrayi &mask) {
+    b.p.raynum = 0;
+    b.p.flags = 0;
+    const u32 aonum = rtaosamples;
+    const auto aocontrib = vec3f(aonum ? 0.01f*float(rtambient)/float(aonum) : 0.f);
+    const auto aodist = float(rtaodist);
+    loopi(s32(TILESIZE*TILESIZE)) {
+      loopk(3) b.rgb[k][i] = 0.f;
+      if (!mask[i]) continue;
+      const vec3f org(pos[0][i], pos[1][i], pos[2][i]);
+      const vec3f n(nor[0][i], nor[1][i], nor[2][i]);
+      if (lightnum == 0) {
+        const auto l = lpos-org;
+        const auto ndotl = dot(n, normalize(l));
+        if (ndotl > 0.f) addray(b, org, l, i, vec3f(ndotl));
+      } else loopj(s32(lightnum)) {
+        const auto l = lightpos[j]-org;
+        const auto len2 = dot(l,l);
+        const auto ndotl = dot(n, l);
+        if (ndotl > 0.f) addray(b, org, l, i, lightpow[j]*(ndotl/(len2*len2)));
+      }
+
+      // ambient light over the unoccluded part of the hemisphere
+      if (aonum == 0) continue;
+      const auto f = frame(n);
+      const auto seed = hashu32(tileID*TILESIZE*TILESIZE+i+pass*0x9e3779b9u);
+      vec3f dirs[MAXAOSAMPLES];
+      loopj(s32(aonum)) dirs[j] = aodir(j, aonum, seed) * aodist;
+      xfmvectors(f, dirs, dirs, aonum);
+      loopj(s32(aonum)) addray(b, org, dirs[j], i, aocontrib);
+    }
+    flush(b);
   }
   intersector *bvhisec;
-  const camera &cam;
+  camera cam;
   int *pixels;
   vec2i dim;
   vec2i tile;
+  u32 tilenum;        // tiles to trace
+  const u32 *tiles;   // in this order
+  u32 batch;          // tiles per task element
+  accumulation *acc;  // progressive mode only
+  atomic *pending;    // tiles not traced yet
+  u32 pass;           // varies the sampling of the passes
 };
 
-void raytrace(int *pixels, const vec3f &pos, const vec3f &ypr,
-              int w, int h, float fovy, float aspect)
-{
+static camera makecamera(const vec3f &pos, const vec3f &ypr, float fovy, float aspect) {
   const mat3x3f r = mat3x3f::rotate(-ypr.x,vec3f(0.f,1.f,0.f))*
                     mat3x3f::rotate(-ypr.y,vec3f(1.f,0.f,0.f))*
                     mat3x3f::rotate(-ypr.z,vec3f(0.f,0.f,1.f));
-  const camera cam(pos, -r.vy, -r.vz, fovy, aspect);
+  return camera(pos, -r.vy, -r.vz, fovy, aspect);
+}
+
+// sort the tiles by the given keys. low bits of the keys are the tile ids
+static void sorttiles(vector<u64> &keys, vector<u32> &order) {
+  if (keys.length()) {
+    vector<u64> tmp;
+    tmp.setsize(keys.length(), noinitialize);
+    radixsort(&keys[0], &tmp[0], keys.length());
+  }
+  order.setsize(keys.length());
+  loopv(keys) order[i] = u32(keys[i]);
+}
+
+static INLINE u32 tilebits(vec2i tile) {
+  u32 bits = 0;
+  while ((1 << bits) < max(tile.x, tile.y)) ++bits;
+  return bits;
+}
+
+// morton order: consecutive tiles are close on screen and so are the bvh
+// nodes they visit. four aligned tiles in a row make a 2x2 block
+static void mortonorder(vec2i tile, vector<u32> &order) {
+  const auto bits = tilebits(tile);
+  vector<u64> keys;
+  loopi(tile.y) loopj(tile.x) {
+    u32 key = 0;
+    loopk(s32(bits)) {
+      key |= ((u32(j)>>k)&1) << (2*k);
+      key |= ((u32(i)>>k)&1) << (2*k+1);
+    }
+    keys.add((u64(key)<<32) | u64(i*tile.x+j));
+  }
+  sorttiles(keys, order);
+}
+
+static struct scheduler {
+  vector<u32> order;
+  vec2i tile;
+  u32 batch;
+} sched;
+
+static void destroyscheduler() {
+  sched.order.destroy();
+  sched.tile = vec2i(zero);
+  tilestats.destroy();
+}
+
+// mostly empty frames have cheap tiles: they go by 32x32 blocks. busy ones
+// go by 16x16 tiles which balances the load better
+static INLINE u32 tilebatch() {
+  return rtbatch != 0 ? u32(rtbatch) : max(sched.batch, 1u);
+}
+
+void raytrace(int *pixels, const vec3f &pos, const vec3f &ypr,
+              int w, int h, float fovy, float aspect)
+{
+  const auto cam = makecamera(pos, ypr, fovy, aspect);
   const vec2i dim(w,h), tile(dim/int(TILESIZE));
+  if (any(tile != sched.tile)) {
+    mortonorder(tile, sched.order);
+    sched.tile = tile;
+  }
+  const auto tilenum = u32(sched.order.length());
+  if (tilenum == 0) return;
   totalraynum=0;
-  ref<task> isectask = NEW(raycasttask, world, cam, pixels, dim, tile);
+  emptytilenum=0;
+  if (rtstats) {
+    tilestats.setsize(tilenum);
+    tilestats.memset(0);
+    statsdim = tile*int(TILESIZE);
+  } else
+    tilestats.setsize(0);
+  ref<task> isectask = NEWTASK(raycasttask, traced(), cam, pixels, dim, tile,
+                           tilenum, &sched.order[0], tilebatch());
   isectask->scheduled();
   isectask->wait();
+  sched.batch = 2*u32(s32(emptytilenum)) > tilenum ? 4 : 1;
+}
+
+/*-------------------------------------------------------------------------
+ - shadow masks of the rasterized view
+ -------------------------------------------------------------------------*/
+// primary rays go from the eye to the far plane through the screen pixel
+// under the center of every mask pixel. their hits stand in for the depth
+// buffer such that nothing has to be read back from the gpu
+struct shadowmasktask : public task {
+  shadowmasktask(intersector *bvhisec, u16 *mask, vec2i dim, vec2i tile, int scale,
+                 const vec3f &org, const mat4x4f &invmvp, const vec3f *lpos,
+                 const float *lradius, u32 lightnum) :
+    task("shadowmasktask", u32(tile.x*tile.y), 1, 0, UNFAIR),
+    bvhisec(bvhisec), mask(mask), dim(dim), tile(tile), scale(scale),
+    org(org), invmvp(invmvp), lightnum(min(lightnum, MAXMASKLIGHTNUM))
+  {
+    loopi(s32(this->lightnum)) {
+      this->lpos[i] = lpos[i];
+      this->lradius[i] = lradius[i];
+    }
+  }
+  virtual void run(u32 tileID) {
+    const auto &k = kernel::get();
+    const vec2i tileorg = int(TILESIZE) * vec2i(tileID%tile.x, tileID/tile.x);
+    raypacket p;
+    packethit hit;
+    u32 idx = 0;
+    for (auto y = 0; y < int(TILESIZE); ++y)
+    for (auto x = 0; x < int(TILESIZE); ++x, ++idx) {
+      const auto px = float(scale) * (float(min(tileorg.x+x, dim.x-1)) + 0.5f);
+      const auto py = float(scale) * (float(min(tileorg.y+y, dim.y-1)) + 0.5f);
+      const auto end = invmvp * vec4f(px, py, 1.f, 1.f);
+      p.setdir(end.xyz()/end.w-org, idx);
+    }
+    p.raynum = TILESIZE*TILESIZE;
+    p.sharedorg = org;
+    p.flags = raypacket::SHAREDORG;
+    k.clearpackethit(hit);
+    if (widebvh == 2)
+      k.closest4(*bvhisec, p, hit);
+    else
+      k.closest(*bvhisec, p, hit);
+
+    array3f pos, nor;
+    arrayi valid;
+    u16 bits[TILESIZE*TILESIZE];
+    memset(bits, 0, sizeof(bits));
+    if (k.primarypoint(p, hit, pos, nor, valid) != 0) {
+      // only the lit points in the range of the light need a shadow ray
+      loopj(s32(lightnum)) {
+        arrayi lit;
+        loopi(s32(TILESIZE*TILESIZE)) {
+          lit[i] = 0;
+          if (!valid[i]) continue;
+          const vec3f pt(pos[0][i], pos[1][i], pos[2][i]);
+          const vec3f n(nor[0][i], nor[1][i], nor[2][i]);
+          const auto l = lpos[j]-pt;
+          if (dot(n,l) > 0.f && dot(l,l) < lradius[j]*lradius[j]) lit[i] = ~0x0;
+        }
+        raypacket shadow;
+        packetshadow occluded;
+        k.shadowpacket(pos, lit, lpos[j], shadow, occluded, TILESIZE*TILESIZE);
+        if (shadow.raynum == 0) continue;
+        if (widebvh != 0)
+          k.occluded4(*bvhisec, shadow, occluded);
+        else
+          k.occluded(*bvhisec, shadow, occluded);
+        loopi(s32(TILESIZE*TILESIZE)) {
+          const auto id = occluded.mapping[i];
+          if (id != -1 && occluded.occluded[id]) bits[i] |= u16(1<<j);
+        }
+      }
+    }
+
+    const auto w = min(int(TILESIZE), dim.x-tileorg.x);
+    const auto h = min(int(TILESIZE), dim.y-tileorg.y);
+    loopi(h) memcpy(mask+(tileorg.y+i)*dim.x+tileorg.x, bits+i*TILESIZE, w*sizeof(u16));
+  }
+  intersector *bvhisec;
+  u16 *mask;
+  vec2i dim, tile;
+  int scale;
+  vec3f org;
+  mat4x4f invmvp;
+  vec3f lpos[MAXMASKLIGHTNUM];
+  float lradius[MAXMASKLIGHTNUM];
+  u32 lightnum;
+};
+
+ref<task> shadowmask(u16 *mask, int w, int h, int scale, const vec3f &org,
+                     const mat4x4f &invmvp, const vec3f *lpos,
+                     const float *lradius, u32 lightnum)
+{
+  const vec2i dim(w,h), tile((dim+int(TILESIZE)-1)/int(TILESIZE));
+  ref<task> job = NEWTASK(shadowmasktask, traced(), mask, dim, tile,
+                      scale, org, invmvp, lpos, lradius, lightnum);
+  job->scheduled();
+  return job;
+}
+
+/*-------------------------------------------------------------------------
+ - irradiance probes
+ -------------------------------------------------------------------------*/
+// the mesh has no colors yet. every surface reflects that much of its light
+static const float PROBEALBEDO = 0.5f;
+// a probe seeing more back faces than that is inside a wall
+static const float PROBEBACKFACES = 0.25f;
+// a hit point lit less than that by a light does not trace its shadow ray
+static const float PROBEMINLIGHT = 1e-3f;
+
+// the sun only lights the sky. the rays going out bring a bit of it back
+static INLINE vec3f skyradiance(const vec3f &dir) {
+  return vec3f(0.1f,0.2f,0.3f) * max(dir.y, 0.f);
+}
+
+// a packet of MAXRAYNUM rays leaves the probe. the points it hits are lit by
+// the lights they see and false is returned when the probe is in a wall
+static bool bakeprobe(const intersector &isec, const vec3f &org, const vec3f *dir,
+                      const vec3f *lpos, const vec3f *lpow, u32 lightnum,
+                      vec4f *sh, u32 stride)
+{
+  const auto &k = kernel::get();
+  raypacket p;
+  packethit hit;
+  loopi(s32(MAXRAYNUM)) p.setdir(dir[i], i);
+  p.raynum = MAXRAYNUM;
+  p.sharedorg = org;
+  p.flags = raypacket::SHAREDORG;
+  k.clearpackethit(hit);
+  if (widebvh == 2)
+    k.closest4(isec, p, hit);
+  else
+    k.closest(isec, p, hit);
+
+  array3f pos, nor;
+  arrayi valid;
+  vec3f radiance[MAXRAYNUM];
+  u32 backfaces = 0;
+  k.primarypoint(p, hit, pos, nor, valid);
+  loopi(s32(MAXRAYNUM)) {
+    radiance[i] = valid[i] ? vec3f(zero) : skyradiance(dir[i]);
+    const vec3f n(nor[0][i], nor[1][i], nor[2][i]);
+    if (valid[i] && dot(n, dir[i]) > 0.f) {
+      valid[i] = 0;
+      ++backfaces;
+    }
+  }
+
+  loopj(s32(lightnum)) {
+    arrayi lit;
+    vec3f light[MAXRAYNUM];
+    loopi(s32(MAXRAYNUM)) {
+      lit[i] = 0;
+      if (!valid[i]) continue;
+      const vec3f pt(pos[0][i], pos[1][i], pos[2][i]);
+      const vec3f n(nor[0][i], nor[1][i], nor[2][i]);
+      const auto l = lpos[j]-pt;
+      const auto len2 = dot(l,l);
+      light[i] = PROBEALBEDO * max(dot(n,l), 0.f) / (len2*len2) * lpow[j];
+      if (max(light[i].x, max(light[i].y, light[i].z)) > PROBEMINLIGHT) lit[i] = ~0x0;
+    }
+    raypacket shadow;
+    packetshadow occluded;
+    k.shadowpacket(pos, lit, lpos[j], shadow, occluded, MAXRAYNUM);
+    if (shadow.raynum == 0) continue;
+    if (widebvh != 0)
+      k.occluded4(isec, shadow, occluded);
+    else
+      k.occluded(isec, shadow, occluded);
+    loopi(s32(MAXRAYNUM)) {
+      const auto id = occluded.mapping[i];
+      if (id != -1 && !occluded.occluded[id]) radiance[i] += light[i];
+    }
+  }
+
+  // first two bands of the radiance convolved with the cosine lobe
+  vec3f c0(zero), c1[3] = {vec3f(zero), vec3f(zero), vec3f(zero)};
+  loopi(s32(MAXRAYNUM)) {
+    c0 += radiance[i];
+    loopj(3) c1[j] += radiance[i][j] * dir[i];
+  }
+  const auto w = 1.f / float(MAXRAYNUM);
+  loopj(3) sh[j*stride] = vec4f(2.f*w*c1[j], w*c0[j]);
+  return float(backfaces) <= PROBEBACKFACES*float(MAXRAYNUM);
+}
+
+void bakeprobes(const intersector *isec, const vec3f &org, float spacing,
+                const vec3i &dim, const vec3f *lpos, const vec3f *lpow,
+                u32 lightnum, vec4f *sh)
+{
+  const auto start = sys::millis();
+  const auto n = u32(dim.x*dim.y*dim.z);
+  loopi(s32(3*n)) sh[i] = vec4f(zero);
+  if (isec == NULL || n == 0) return;
+
+  // same directions for all the probes, evenly spread on the sphere
+  vec3f dir[MAXRAYNUM];
+  const auto golden = float(pi) * (3.f - sqrt(5.f));
+  loopi(s32(MAXRAYNUM)) {
+    const auto y = 1.f - (2.f*float(i)+1.f) / float(MAXRAYNUM);
+    const auto r = sqrt(max(1.f-y*y, 0.f));
+    const auto phi = golden*float(i);
+    dir[i] = vec3f(cos(phi)*r, y, sin(phi)*r);
+  }
+  vector<u8> valid;
+  valid.setsize(n);
+  parallelfor("bakeprobes", n, 16, [&](u32 idx) {
+    const vec3i xyz(idx%dim.x, (idx/dim.x)%dim.y, idx/(dim.x*dim.y));
+    const auto pos = org + spacing*vec3f(xyz);
+    valid[idx] = bakeprobe(*isec, pos, dir, lpos, lpow, lightnum, sh+idx, n);
+  });
+
+  // probes in the walls would leak their darkness. they get the mean of their
+  // valid neighbors instead
+  u32 invalidnum = 0;
+  loopi(s32(n)) {
+    if (valid[i]) continue;
+    const vec3i xyz(i%dim.x, (i/dim.x)%dim.y, i/(dim.x*dim.y));
+    vec4f sum[3] = {vec4f(zero), vec4f(zero), vec4f(zero)};
+    auto num = 0;
+    loopj(6) {
+      auto p = xyz;
+      p[j/2] += j&1 ? 1 : -1;
+      if (any(lt(p, vec3i(zero))) || any(ge(p, dim))) continue;
+      const auto idx = p.x+dim.x*(p.y+dim.y*p.z);
+      if (!valid[idx]) continue;
+      loopk(3) sum[k] += sh[k*n+idx];
+      ++num;
+    }
+    loopk(3) sh[k*n+i] = num ? sum[k] / float(num) : vec4f(zero);
+    ++invalidnum;
+  }
+  con::out("rt: %u probes (%u in walls) baked in %f ms", n, invalidnum,
+           float(sys::millis()-start));
+}
+
+/*-------------------------------------------------------------------------
+ - progressive mode
+ -------------------------------------------------------------------------*/
+static struct progressive {
+  accumulation acc;
+  ref<task> job;
+  atomic pending;
+  vector<u32> order; // tiles in interleaved order
+  u32 next, pass;
+  vec2i dim;
+  vec3f pos, ypr;
+  float fovy, aspect;
+} prog;
+
+static void waitprogressive() {
+  if (prog.job) prog.job->wait();
+  prog.job = NULL;
+}
+
+static void destroyprogressive() {
+  prog.acc.sum.destroy();
+  prog.acc.samples.destroy();
+  prog.acc.display.destroy();
+  prog.acc.scratch.destroy();
+  prog.order.destroy();
+  prog.dim = vec2i(zero);
+}
+
+// lighting changed: the next call starts from scratch
+static void restartprogressive() {
+  waitprogressive();
+  prog.dim = vec2i(zero);
 }
 
+// bayer matrix order: every prefix of the sequence spreads over the screen
+static void makeorder(vec2i tile) {
+  const auto bits = tilebits(tile);
+  vector<u64> keys;
+  loopi(tile.y) loopj(tile.x) {
+    const auto a = u32(i^j), b = u32(i);
+    u32 key = 0;
+    loopk(s32(bits)) {
+      key |= ((a>>k)&1) << (2*(bits-1-k)+1);
+      key |= ((b>>k)&1) << (2*(bits-1-k));
+    }
+    keys.add((u64(key)<<32) | u64(i*tile.x+j));
+  }
+  sorttiles(keys, prog.order);
+}
+
+static void resetprogressive(vec2i dim) {
+  const auto tile = dim/int(TILESIZE);
+  if (any(dim != prog.dim)) {
+    const auto n = dim.x*dim.y;
+    prog.acc.sum.setsize(3*n);
+    prog.acc.display.setsize(n);
+    prog.acc.scratch.setsize(n);
+    prog.acc.samples.setsize(tile.x*tile.y);
+    prog.acc.display.memset(0);
+    makeorder(tile);
+    prog.dim = dim;
+  }
+  prog.acc.sum.memset(0);
+  prog.acc.samples.memset(0);
+  prog.next = prog.pass = 0;
+}
+
+void raytraceprogressive(int *pixels, const vec3f &pos, const vec3f &ypr,
+                         int w, int h, float fovy, float aspect, u32 tilenum)
+{
+  const vec2i dim(w,h);
+  if (prog.pending == 0) {
+    waitprogressive();
+    const auto isec = traced();
+    if (any(dim != prog.dim) || any(pos != prog.pos) || any(ypr != prog.ypr) ||
+        fovy != prog.fovy || aspect != prog.aspect)
+      resetprogressive(dim);
+    prog.pos = pos;
+    prog.ypr = ypr;
+    prog.fovy = fovy;
+    prog.aspect = aspect;
+    const auto tiles = u32(prog.order.length());
+    if (isec != NULL && tiles != 0) {
+      // the sub-pixel offset changes with the pass to antialias the average
+      auto cam = makecamera(pos, ypr, fovy, aspect);
+      if (prog.pass != 0) {
+        const auto seed = hashu32(prog.pass);
+        const auto jx = hashfloat(seed)-0.5f, jy = hashfloat(seed^0x9e3779b9u)-0.5f;
+        cam.imgplaneorg += jx/float(w)*cam.xaxis + jy/float(h)*cam.zaxis;
+      }
+      const auto num = min(tilenum, tiles-prog.next);
+      prog.pending = num;
+      prog.job = NEWTASK(raycasttask, isec, cam, &prog.acc.scratch[0], dim, dim/int(TILESIZE),
+                     num, &prog.order[prog.next], 1, &prog.acc, &prog.pending, prog.pass);
+      prog.job->scheduled();
+      prog.next += num;
+      if (prog.next == tiles) {
+        prog.next = 0;
+        ++prog.pass;
+      }
+    }
+  }
+  if (prog.acc.display.length() == w*h)
+    memcpy(pixels, &prog.acc.display[0], sizeof(int)*w*h);
+}
+
+u32 raynum() { return u32(s32(totalraynum)); }
+
 static int *pixels=NULL;
 void raytrace(const char *bmp, const vec3f &pos, const vec3f &ypr,
               int w, int h, float fovy, float aspect)
@@ -132,7 +1077,8 @@ void raytrace(const char *bmp, const vec3f &pos, const vec3f &ypr,
   raytrace(pixels, pos, ypr, w, h, fovy, aspect);
   const auto duration = float(sys::millis()-start);
   con::out("rt: %i ms, %f Mray/s", int(duration), 1000.f*(float(totalraynum)*1e-6f)/duration);
-  sys::writebmp(pixels, w, h, bmp);
+  capture::writeimage(pixels, w, h, bmp);
+  if (rtstats) rtheatmap("rtstats.bmp");
 }
 } /* namespace rt */
 } /* namespace q */
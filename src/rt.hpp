@@ -5,10 +5,14 @@
 #pragma once
 #include "base/math.hpp"
 #include "base/utility.hpp"
+#include "base/vector.hpp"
+#include "base/ref.hpp"
+#include "base/task.hpp"
 #include "soa.hpp"
 
 namespace q {
 namespace rt {
+struct intersector;
 struct ray {
   INLINE ray(void) {}
   INLINE ray(vec3f org, vec3f dir, float near = 0.f, float far = FLT_MAX)
@@ -76,6 +80,35 @@ struct CACHE_LINE_ALIGNED packedprimary : noncopyable {
   arrayi mapping;
 };
 
+// large soa buffer of arbitrary rays (ambient occlusion, reflections...).
+// rays are ordered by direction octant and by morton code of their origin
+// (see sortstream) and traced by filtering lists of active rays through the
+// bvh such that simd lanes stay full even for incoherent rays
+struct raystream : noncopyable {
+  INLINE void clear(void) {
+    loopk(3) {
+      org[k].setsize(0);
+      dir[k].setsize(0);
+    }
+    tfar.setsize(0);
+    order.setsize(0);
+  }
+  INLINE u32 add(const ray &r) {
+    loopk(3) {
+      org[k].add(r.org[k]);
+      dir[k].add(r.dir[k]);
+    }
+    tfar.add(r.tfar);
+    return u32(tfar.length()-1);
+  }
+  INLINE u32 length(void) const { return u32(tfar.length()); }
+  vector<float> org[3], dir[3], tfar; // rays
+  vector<float> t, u, v, n[3];        // closest hits. t is tfar without hit
+  vector<s32> id;                     // closest hits. -1 without hit
+  vector<s32> occluded;               // shadow rays. non zero if occluded
+  vector<u32> order;                  // traversal order of the rays
+};
+
 struct camera {
   camera(vec3f org, vec3f up, vec3f view, float fov, float ratio);
   INLINE ray generate(int w, int h, int x, int y) const {
@@ -90,13 +123,103 @@ struct camera {
 
 enum { TILESIZE = 16 };
 
+// immutable bvh of a map. worlds with a key (a hash of the map content) are
+// kept in a registry so everything running the same map shares one tree. the
+// current world is the one traced by the calls without intersector
+struct world : refcount {
+  world(u64 key, intersector *isec) : key(key), isec(isec) {}
+  virtual ~world();
+  u64 key; // 0 if not shared
+  intersector *isec;
+};
+// the registered world for a key or NULL
+ref<world> findworld(u64 key);
+// register the bvh for the key. if another one came first, isec is destroyed
+// and the registered world returned
+ref<world> makeworld(u64 key, intersector *isec);
+// drop the registered worlds nobody uses anymore
+void purgeworlds();
+void setworld(const ref<world> &w);
+ref<world> getworld();
+
 void start();
 void finish();
 void buildbvh(vec3f *v, u32 *idx, u32 idxnum);
+// same but only refit the current bvh when the mesh has the same triangles
+void refitbvh(vec3f *v, u32 *idx, u32 idxnum);
+// serialize the world bvh (NULL if none) and restore it from such buffer
+void *storebvh(u32 &size);
+bool loadbvh(const void *data, u32 size);
+// build or restore a bvh apart from the world such that tasks make it while
+// the world is traced. setbvh replaces the world bvh with it on the main thread
+intersector *makebvh(const vec3f *v, const u32 *idx, u32 idxnum);
+intersector *makebvh(const void *data, u32 size);
+void setbvh(intersector *isec);
+// trace instances of shared bvhs together with the world. the small top level
+// tree is rebuilt at each call such that moving instances can be set again
+// every frame. rebuilding or loading the world removes them
+void setinstances(const struct instance *inst, u32 num);
+// point lights used by raytrace. ambient occlusion is set by "rtaosamples"
+void setlights(const vec3f *pos, const vec3f *pow, u32 num);
+// sort the rays of the stream and trace them in the world (or instances)
+void sortstream(raystream &s);
+void closest(raystream &s);
+void occluded(raystream &s);
+// single ray queries against the world (or instances) for gameplay. closest
+// fills the hit and returns true when a triangle is found before tfar
+bool closest(const ray &r, struct hit &h);
+bool occluded(const ray &r);
+// closest hits of many rays. each hit starts at the tfar of its ray
+void closest(const ray *r, u32 n, struct hit *h);
+// many independent queries (per server tick). non zero when occluded
+void occluded(const ray *r, u32 n, s32 *occluded);
+// same queries against a given world bvh (NULL hits nothing) such that
+// several worlds are traced at once without the current one
+bool closest(const intersector *isec, const ray &r, struct hit &h);
+bool occluded(const intersector *isec, const ray &r);
+void closest(const intersector *isec, const ray *r, u32 n, struct hit *h);
+void occluded(const intersector *isec, const ray *r, u32 n, s32 *occluded);
 void raytrace(int *pixels, const vec3f &pos, const vec3f &ypr,
               int w, int h, float fovy, float aspect);
 void raytrace(const char *bmp, const vec3f &pos, const vec3f &ypr,
               int w, int h, float fovy, float aspect);
+// bit i of a mask pixel is set when the point seen through it is in the
+// shadow of light i. the mask is "scale" times smaller than the screen whose
+// pixels invmvp takes back to the world. points out of the radius of a light
+// or facing away from it are never masked. the returned task is already
+// scheduled and the mask is complete once it is done
+static const u32 MAXMASKLIGHTNUM = 16;
+ref<task> shadowmask(u16 *mask, int w, int h, int scale, const vec3f &org,
+                     const mat4x4f &invmvp, const vec3f *lpos,
+                     const float *lradius, u32 lightnum);
+// irradiance probes on the grid of dim points starting at org. every probe
+// traces MAXRAYNUM rays and lights their hits with the point lights. sh gets
+// 3*dim.x*dim.y*dim.z values: all the red probes, then green and blue. each
+// is (l1, l0) of the irradiance divided by pi, i.e. l0 + dot(l1, normal).
+// probes inside walls take the mean of their neighbors. the calling thread
+// waits for the bake and helps with it
+void bakeprobes(const intersector *isec, const vec3f &org, float spacing,
+                const vec3i &dim, const vec3f *lpos, const vec3f *lpow,
+                u32 lightnum, vec4f *sh);
+// rays traced by the last raytrace call
+u32 raynum();
+// traversal counters of the packet kernels. every thread adds to its own
+// ones and threadstats is NULL unless "rtstats" is set. raytrace gathers
+// them per tile and the "rtheatmap" command writes the last frame as a bmp
+struct raystats {
+  u64 nodes;  // nodes entered by a packet
+  u64 boxes;  // simd box tests
+  u64 tris;   // simd triangle tests
+  u64 lanes;  // lanes of the triangle tests
+  u64 active; // lanes of the triangle tests whose ray is in the leaf
+  u64 single; // rays that left their packet for the single ray kernel
+};
+raystats *threadstats();
+// progressive mode: "tilenum" tiles are traced per call in the background
+// and averaged with the previous passes until the view changes. pixels get
+// the current average and the call never waits for the tracing
+void raytraceprogressive(int *pixels, const vec3f &pos, const vec3f &ypr,
+                         int w, int h, float fovy, float aspect, u32 tilenum);
 } /* namespace rt */
 } /* namespace q */
 
@@ -0,0 +1,8 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - rtavx2.cpp -> instantiates avx2+fma routines
+ -------------------------------------------------------------------------*/
+#define NAMESPACE avx2
+#include "rtsimd.cxx"
+#undef avx2
+
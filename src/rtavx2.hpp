@@ -0,0 +1,13 @@
+/*-------------------------------------------------------------------------
+ - mini.q - a minimalistic multiplayer fps
+ - rtavx2.hpp -> exposes ray tracing avx2 routines
+ -------------------------------------------------------------------------*/
+#pragma once
+namespace q {
+namespace rt {
+namespace avx2 {
+#include "rtdecl.hxx"
+} /* namespace avx2 */
+} /* namespace rt */
+} /* namespace q */
+
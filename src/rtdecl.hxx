@@ -6,6 +6,23 @@
 void closest(const struct intersector&, const struct raypacket&, struct packethit&);
 void occluded(const struct intersector&, const struct raypacket&, struct packetshadow&);
 
+// same on the 4-wide bvh, ray by ray, which suits incoherent rays better. they
+// use the binary bvh if the intersector was not widened
+void closest4(const struct intersector&, const struct raypacket&, struct packethit&);
+void occluded4(const struct intersector&, const struct raypacket&, struct packetshadow&);
+
+// trace the rays order[first..first+num) of a stream (see raystream).
+// outputs must be allocated and t, id or occluded initialized
+void closeststream(const struct intersector&, struct raystream&, u32 first, u32 num);
+void occludedstream(const struct intersector&, struct raystream&, u32 first, u32 num);
+
+// single rays (gameplay queries). closest only updates the hit when a closer
+// triangle is found and occluded tests [0,tfar). the batched version writes
+// non zero flags for the occluded rays
+void closest(const struct intersector&, const struct ray&, struct hit&);
+bool occluded(const struct intersector&, const struct ray&);
+void occluded(const struct intersector&, const struct ray*, u32 n, s32 *occluded);
+
 // ray packet generation
 void visibilitypacket(const struct camera &RESTRICT cam,
                       struct raypacket &RESTRICT p,
@@ -36,6 +53,12 @@ void writenormal(const packethit &RESTRICT hit,
                  const vec2i &RESTRICT screensize,
                  int *RESTRICT pixels);
 
+// frame buffer write (rgb colors in [0,1] laid out as the primary packet)
+void writecolor(const array3f &RESTRICT rgb,
+                const vec2i &RESTRICT tileorg,
+                const vec2i &RESTRICT screensize,
+                int *RESTRICT pixels);
+
 // frame buffer write (just simple dot product)
 void writendotl(const raypacket &RESTRICT shadow,
                 const array3f &RESTRICT nor,
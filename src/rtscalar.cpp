@@ -62,6 +62,12 @@ void closest(const intersector &bvhtree, const ray &r, hit &hit) {
           const s32 n = tris->num;
           loopi(n) raytriangle<false>(tris[i], r.org, r.dir, &hit);
           break;
+        } else if (flag == intersector::INSTLEAF) {
+          const auto inst = node->getptr<instanceleaf>();
+          const auto t = hit.t;
+          closest(*inst->isec, xfmray(*inst, r), hit);
+          if (hit.t != t) hit.n = xfmvector(inst->tonormal, hit.n);
+          break;
         } else {
           node = node->getptr<intersector>()->root;
           goto processnode;
@@ -73,6 +79,7 @@ void closest(const intersector &bvhtree, const ray &r, hit &hit) {
 
 bool occluded(const intersector &bvhtree, const ray &r) {
   const intersector::node *stack[64];
+  hit shadow(r.tfar);
   const auto rdir = rcp(r.dir);
   stack[0] = bvhtree.root;
   u32 stacksz = 1;
@@ -92,7 +99,10 @@ bool occluded(const intersector &bvhtree, const ray &r) {
         if (flag == intersector::TRILEAF) {
           auto tris = node->getptr<waldtriangle>();
           const s32 n = tris->num;
-          loopi(n) if (raytriangle<true>(tris[i], r.org, r.dir)) return true;
+          loopi(n) if (raytriangle<true>(tris[i], r.org, r.dir, &shadow)) return true;
+        } else if (flag == intersector::INSTLEAF) {
+          const auto inst = node->getptr<instanceleaf>();
+          if (occluded(*inst->isec, xfmray(*inst, r))) return true;
         } else {
           node = node->getptr<intersector>()->root;
           goto processnode;
@@ -104,6 +114,10 @@ bool occluded(const intersector &bvhtree, const ray &r) {
   return false;
 }
 
+void occluded(const intersector &bvhtree, const ray *r, u32 n, s32 *occluded) {
+  loopi(s32(n)) occluded[i] = rt::occluded(bvhtree, r[i]) ? ~0x0 : 0;
+}
+
 /*-------------------------------------------------------------------------
  - packet ray tracing routines
  -------------------------------------------------------------------------*/
@@ -114,8 +128,8 @@ struct raypacketextra {
 };
 
 INLINE bool cullia(const aabb &box, const raypacket &p, const raypacketextra &extra) {
-  assert(false && "Not implemented");
-  return false;
+  const auto txyz = (makeinterval(box.pmin,box.pmax)-extra.iaorg)*extra.iardir;
+  return empty(I(txyz.x,txyz.y,txyz.z,intervalf(extra.iaminlen,extra.iamaxlen)));
 }
 
 INLINE vec3f get(const array3f &v, u32 idx) {
@@ -319,6 +333,27 @@ INLINE u32 initextra(raypacketextra &extra, const raypacket &p, const Hit &hit)
     return p.flags;
 }
 
+// trace the packet in the space of the instance
+void closest(const intersector&, const raypacket&, packethit&);
+void occluded(const intersector&, const raypacket&, packetshadow&);
+static void instanceclosest(const instanceleaf &inst, const raypacket &p, packethit &hit) {
+  CACHE_LINE_ALIGNED raypacket local;
+  arrayf oldt;
+  xfmpacket(inst, p, local);
+  loopi(s32(p.raynum)) oldt[i] = hit.t[i];
+  closest(*inst.isec, local, hit);
+  xfmnormals(inst, p, oldt, hit);
+}
+
+static u32 instanceoccluded(const instanceleaf &inst, const raypacket &p, packetshadow &s) {
+  CACHE_LINE_ALIGNED raypacket local;
+  xfmpacket(inst, p, local);
+  occluded(*inst.isec, local, s);
+  u32 occnum = 0;
+  loopi(s32(p.raynum)) occnum += s.occluded[i] ? 1 : 0;
+  return occnum;
+}
+
 template <u32 flags>
 static void closest(const intersector &RESTRICT bvhtree,
                     const raypacket &RESTRICT p,
@@ -373,6 +408,9 @@ static void closest(const intersector &RESTRICT bvhtree,
             slabfilter(node->box, p, extra, active, first+1, hit.t);
           loopi(n) closest<flags>(tris[i], p, active, first, hit);
           break;
+        } else if (flag == intersector::INSTLEAF) {
+          instanceclosest(*node->getptr<instanceleaf>(), p, hit);
+          break;
         } else {
           node = node->getptr<intersector>()->root;
           goto processnode;
@@ -450,6 +488,10 @@ static void occluded(const intersector &RESTRICT bvhtree,
           loopi(n) occnum += occluded<flags>(tris[i], p, active, first, s);
           if (occnum == p.raynum) return;
           break;
+        } else if (flag == intersector::INSTLEAF) {
+          occnum = instanceoccluded(*node->getptr<instanceleaf>(), p, s);
+          if (occnum == p.raynum) return;
+          break;
         } else {
           node = node->getptr<intersector>()->root;
           goto processnode;
@@ -475,6 +517,112 @@ void occluded(const intersector &bvhtree, const raypacket &p, packetshadow &s) {
 #undef CASE
 #undef CASE4
 
+/*-------------------------------------------------------------------------
+ - ray streams, ray by ray in the stream order
+ -------------------------------------------------------------------------*/
+INLINE u32 streamray(const raystream &s, u32 i) {
+  return s.order.length() != 0 ? s.order[i] : i;
+}
+
+INLINE ray getray(const raystream &s, u32 idx, float tfar) {
+  const vec3f org(s.org[0][idx], s.org[1][idx], s.org[2][idx]);
+  const vec3f dir(s.dir[0][idx], s.dir[1][idx], s.dir[2][idx]);
+  return ray(org, dir, 0.f, tfar);
+}
+
+void closeststream(const intersector &bvhtree, raystream &s, u32 first, u32 num) {
+  rangei(first, first+num) {
+    const auto idx = streamray(s, i);
+    hit h(s.t[idx]);
+    closest(bvhtree, getray(s, idx, s.t[idx]), h);
+    if (!h.is_hit()) continue;
+    s.t[idx] = h.t;
+    s.u[idx] = h.u;
+    s.v[idx] = h.v;
+    s.id[idx] = h.id;
+    loopk(3) s.n[k][idx] = h.n[k];
+  }
+}
+
+void occludedstream(const intersector &bvhtree, raystream &s, u32 first, u32 num) {
+  rangei(first, first+num) {
+    const auto idx = streamray(s, i);
+    if (s.occluded[idx]) continue;
+    if (occluded(bvhtree, getray(s, idx, s.tfar[idx]))) s.occluded[idx] = ~0x0;
+  }
+}
+
+/*-------------------------------------------------------------------------
+ - 4-wide bvh traversal, ray by ray. children are tested one after the other
+ -------------------------------------------------------------------------*/
+template <bool occludedonly>
+static bool traverse4(const intersector &bvhtree, const ray &r, hit &hit) {
+  pair<u32,float> stack[256];
+  const auto rdir = rcp(r.dir);
+  stack[0] = makepair(0u, 0.f);
+  u32 stacksz = 1;
+  auto found = false;
+  while (stacksz) {
+    const auto elem = stack[--stacksz];
+    if (elem.second > hit.t) continue;
+    const auto &node = bvhtree.root4[elem.first];
+    const auto first = stacksz;
+    loopi(s32(node.num)) {
+      const auto res = slab(node.getaabb(i), r.org, rdir, hit.t);
+      if (!res.isec) continue;
+      const auto child = node.child[i];
+      if (child & intersector::LEAF4) {
+        for (auto g = bvhtree.tris4 + (child & ~intersector::LEAF4);; ++g) {
+          loopj(s32(g->num)) {
+            const auto tri = gettri(*g, j);
+            if (!raytriangle<occludedonly>(tri, r.org, r.dir, &hit)) continue;
+            if (occludedonly) return true;
+            found = true;
+          }
+          if (g->last) break;
+        }
+      } else {
+        auto j = stacksz++;
+        for (; j > first && stack[j-1].second < res.t; --j) stack[j] = stack[j-1];
+        stack[j] = makepair(child, res.t);
+      }
+    }
+  }
+  return found;
+}
+
+void closest4(const intersector &bvhtree, const raypacket &p, packethit &hit) {
+  if (bvhtree.root4 == NULL) {
+    closest(bvhtree, p, hit);
+    return;
+  }
+  loopi(s32(p.raynum)) {
+    const auto org = (p.flags & raypacket::SHAREDORG) ? p.sharedorg : p.org(i);
+    const auto dir = (p.flags & raypacket::SHAREDDIR) ? p.shareddir : p.dir(i);
+    rt::hit h(hit.t[i]);
+    if (!traverse4<false>(bvhtree, ray(org, dir), h)) continue;
+    hit.t[i] = h.t;
+    hit.u[i] = h.u;
+    hit.v[i] = h.v;
+    hit.id[i] = h.id;
+    set(hit.n, h.n, i);
+  }
+}
+
+void occluded4(const intersector &bvhtree, const raypacket &p, packetshadow &s) {
+  if (bvhtree.root4 == NULL) {
+    occluded(bvhtree, p, s);
+    return;
+  }
+  loopi(s32(p.raynum)) {
+    if (s.occluded[i]) continue;
+    const auto org = (p.flags & raypacket::SHAREDORG) ? p.sharedorg : p.org(i);
+    const auto dir = (p.flags & raypacket::SHAREDDIR) ? p.shareddir : p.dir(i);
+    rt::hit h(s.t[i]);
+    if (traverse4<true>(bvhtree, ray(org, dir), h)) s.occluded[i] = ~0x0;
+  }
+}
+
 /*-------------------------------------------------------------------------
  - generation of packets
  -------------------------------------------------------------------------*/
@@ -574,6 +722,21 @@ void writenormal(const packethit &RESTRICT hit,
   }
 }
 
+void writecolor(const array3f &RESTRICT rgb,
+                const vec2i &RESTRICT tileorg,
+                const vec2i &RESTRICT screensize,
+                int *RESTRICT pixels)
+{
+  u32 idx = 0;
+  for (auto y = tileorg.y; y < tileorg.y+TILESIZE; ++y) {
+    const auto yoffset = screensize.x*y;
+    for (auto x = tileorg.x; x < tileorg.x+TILESIZE; ++x, ++idx) {
+      const auto c = vec3i(255.f*clamp(get(rgb, idx), vec3f(zero), vec3f(one)));
+      pixels[x+yoffset] = c.x|(c.y<<8)|(c.z<<16)|(0xff<<24);
+    }
+  }
+}
+
 void writendotl(const raypacket &RESTRICT shadow,
                 const array3f &nor,
                 const packetshadow &RESTRICT occluded,
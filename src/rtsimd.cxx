@@ -26,8 +26,8 @@ struct raypacketextra {
 };
 static const u32 waldmodulo[] = {1,2,0,1};
 INLINE bool cullia(const aabb &box, const raypacket &p, const raypacketextra &extra) {
-  assert(false && "Not implemented");
-  return false;
+  const auto txyz = (makeinterval(box.pmin,box.pmax)-extra.iaorg)*extra.iardir;
+  return empty(I(txyz.x,txyz.y,txyz.z,intervalf(extra.iaminlen,extra.iamaxlen)));
 }
 
 INLINE bool culliaco(const aabb &box, const raypacket &p, const raypacketextra &extra) {
@@ -86,14 +86,16 @@ INLINE bool slabone(const aabb &RESTRICT box,
   return any(slab(pmin, pmax, rd, t).isec);
 }
 
-INLINE void slabfilter(const aabb &RESTRICT box,
-                       const raypacket &RESTRICT p,
-                       const raypacketextra &RESTRICT extra,
-                       u32 *RESTRICT active,
-                       u32 first,
-                       const arrayf &RESTRICT hit)
+// return the number of lanes whose ray hits the box
+INLINE u32 slabfilter(const aabb &RESTRICT box,
+                      const raypacket &RESTRICT p,
+                      const raypacketextra &RESTRICT extra,
+                      u32 *RESTRICT active,
+                      u32 first,
+                      const arrayf &RESTRICT hit)
 {
   auto const packetnum = p.raynum / soaf::size;
+  u32 lanes = 0;
   for (u32 id = first; id < packetnum; ++id) {
     const auto org = sget(p.vorg,id);
     const auto rd = sget(extra.rdir,id);
@@ -102,7 +104,9 @@ INLINE void slabfilter(const aabb &RESTRICT box,
     const auto pmax = soa3f(box.pmax)-org;
     const auto res = slab(pmin, pmax, rd, t);
     active[id] = any(res.isec);
+    lanes += popcnt(res.isec);
   }
+  return lanes;
 }
 
 INLINE bool slabfirstco(const aabb &RESTRICT box,
@@ -135,22 +139,25 @@ INLINE bool slaboneco(const aabb &RESTRICT box,
   return any(slab(pmin, pmax, rd, t).isec);
 }
 
-INLINE void slabfilterco(const aabb &RESTRICT box,
-                         const raypacket &RESTRICT p,
-                         const raypacketextra &RESTRICT extra,
-                         u32 *RESTRICT active,
-                         u32 first,
-                         const arrayf &RESTRICT hit)
+INLINE u32 slabfilterco(const aabb &RESTRICT box,
+                        const raypacket &RESTRICT p,
+                        const raypacketextra &RESTRICT extra,
+                        u32 *RESTRICT active,
+                        u32 first,
+                        const arrayf &RESTRICT hit)
 {
   const auto packetnum = p.raynum / soaf::size;
   const auto pmin = soa3f(box.pmin - p.sharedorg);
   const auto pmax = soa3f(box.pmax - p.sharedorg);
+  u32 lanes = 0;
   for (u32 rayid = first; rayid < packetnum; ++rayid) {
     const auto rd = sget(extra.rdir,rayid);
     const auto t = sget(hit,rayid);
     const auto res = slab(pmin, pmax, rd, t);
     active[rayid] = any(res.isec);
+    lanes += popcnt(res.isec);
   }
+  return lanes;
 }
 
 INLINE float asfloat(u32 x) {union {float f; u32 u;}; u = x; return f;}
@@ -345,25 +352,134 @@ INLINE u32 initextra(raypacketextra &RESTRICT extra,
   return p.flags | raypacket::INTERVALARITH;
 }
 
+// trace the packet in the space of the instance
+void closest(const intersector&, const raypacket&, packethit&);
+void occluded(const intersector&, const raypacket&, packetshadow&);
+static void instanceclosest(const instanceleaf &inst, const raypacket &p, packethit &hit) {
+  CACHE_LINE_ALIGNED raypacket local;
+  arrayf oldt;
+  xfmpacket(inst, p, local);
+  loopi(s32(p.raynum)) oldt[i] = hit.t[i];
+  closest(*inst.isec, local, hit);
+  xfmnormals(inst, p, oldt, hit);
+}
+
+static u32 instanceoccluded(const instanceleaf &inst, const raypacket &p, packetshadow &s) {
+  CACHE_LINE_ALIGNED raypacket local;
+  xfmpacket(inst, p, local);
+  occluded(*inst.isec, local, s);
+  u32 occnum = 0;
+  loopi(s32(p.raynum)) occnum += s.occluded[i] ? 1 : 0;
+  return occnum;
+}
+
+/*-------------------------------------------------------------------------
+ - incoherent packets. every few levels, the rays still in the box of the
+ - node are counted. when only a few of them remain, they leave the packet
+ - and go through the subtree one by one with the single ray kernel
+ -------------------------------------------------------------------------*/
+static const u32 SINGLERAYDEPTH = 4;    // levels between two counts
+static const u32 SINGLERAYPERCENT = 12; // active rays below which we switch
+
+template <bool occludedonly>
+static bool traverse(const intersector::node *RESTRICT root, const ray &RESTRICT r, hit &RESTRICT h);
+
+struct packetentry {
+  INLINE packetentry(void) {}
+  INLINE packetentry(intersector::node *node, u32 first, u32 depth) :
+    node(node), first(first), depth(depth) {}
+  intersector::node *node;
+  u32 first, depth;
+};
+
+INLINE vec3f rayorg(const raypacket &p, u32 rayid) {
+  return (p.flags & raypacket::SHAREDORG) ? p.sharedorg : p.org(rayid);
+}
+INLINE vec3f raydir(const raypacket &p, u32 rayid) {
+  return (p.flags & raypacket::SHAREDDIR) ? p.shareddir : p.dir(rayid);
+}
+
+// list the rays that hit the box if they are few enough. ~0 otherwise
+template <u32 flags>
+INLINE u32 fewrays(const aabb &RESTRICT box,
+                   const raypacket &RESTRICT p,
+                   const raypacketextra &RESTRICT extra,
+                   u32 first, u32 depth,
+                   const arrayf &RESTRICT t,
+                   u32 *RESTRICT rays)
+{
+  if (depth == 0 || depth % SINGLERAYDEPTH != 0 || p.raynum <= soaf::size)
+    return ~0u;
+  const auto packetnum = p.raynum / soaf::size;
+  u32 num = 0;
+  rangej(first, packetnum) {
+    const auto org = getorg<0!=(flags&raypacket::SHAREDORG)>(p,j);
+    const auto res = slab(soa3f(box.pmin)-org, soa3f(box.pmax)-org, sget(extra.rdir,j), sget(t,j));
+    for (auto mask = u32(movemask(res.isec)); mask; mask &= mask-1)
+      rays[num++] = j*soaf::size + __bsf(mask);
+  }
+  return 100*num < SINGLERAYPERCENT*p.raynum ? num : ~0u;
+}
+
+INLINE void singleclosest(const intersector::node *RESTRICT node,
+                          const raypacket &RESTRICT p, u32 rayid,
+                          packethit &RESTRICT hit)
+{
+  rt::hit h(hit.t[rayid]);
+  if (!traverse<false>(node, ray(rayorg(p,rayid), raydir(p,rayid)), h)) return;
+  hit.t[rayid] = h.t;
+  hit.u[rayid] = h.u;
+  hit.v[rayid] = h.v;
+  hit.id[rayid] = h.id;
+  loopk(3) hit.n[k][rayid] = h.n[k];
+}
+
+INLINE u32 singleoccluded(const intersector::node *RESTRICT node,
+                          const raypacket &RESTRICT p, u32 rayid,
+                          packetshadow &RESTRICT s)
+{
+  if (s.occluded[rayid]) return 0;
+  rt::hit h(s.t[rayid]);
+  if (!traverse<true>(node, ray(rayorg(p,rayid), raydir(p,rayid)), h)) return 0;
+  s.occluded[rayid] = ~0x0;
+  return 1;
+}
+
+// packets entering a leaf test all its triangles on all their lanes
+INLINE void leafstats(raystats &st, const raypacket &p, const u32 *active,
+                      u32 first, u32 trinum, u32 lanes)
+{
+  const auto packetnum = p.raynum / soaf::size;
+  u32 num = 0;
+  rangej(first, packetnum) num += active[j];
+  st.boxes += packetnum - first;
+  st.tris += u64(num) * trinum;
+  st.lanes += u64(num) * trinum * soaf::size;
+  st.active += u64(lanes) * trinum;
+}
+
 template <u32 flags>
 void closest(const intersector &RESTRICT bvhtree,
              const raypacket &RESTRICT p,
              const raypacketextra &RESTRICT extra,
-             packethit &RESTRICT hit)
+             packethit &RESTRICT hit,
+             raystats *RESTRICT st)
 {
   assert(p.raynum%soaf::size == 0);
   const s32 signs[3] = {(p.dir().x>=0.f)&1, (p.dir().y>=0.f)&1, (p.dir().z>=0.f)&1};
-  pair<intersector::node*,u32> stack[64];
-  stack[0] = makepair(bvhtree.root, 0u);
+  packetentry stack[64];
+  stack[0] = packetentry(bvhtree.root, 0u, 0u);
   u32 stacksz = 1;
 
   while (stacksz) {
     const auto elem = stack[--stacksz];
-    auto node = elem.first;
-    auto first = elem.second;
+    auto node = elem.node;
+    auto first = elem.first;
+    auto depth = elem.depth;
     for (;;) {
       bool res = false;
       if (flags & raypacket::INTERVALARITH) {
+        if (st) ++st->boxes;
         if (flags & raypacket::SHAREDORG) {
           res = slaboneco(node->box, p, extra, first, hit.t);
           if (res) goto processnode;
@@ -375,31 +491,45 @@ void closest(const intersector &RESTRICT bvhtree,
         }
         ++first;
       }
-      if (flags & raypacket::SHAREDORG)
-        res = slabfirstco(node->box, p, extra, first, hit.t);
-      else
-        res = slabfirst(node->box, p, extra, first, hit.t);
+      {
+        const auto start = first;
+        if (flags & raypacket::SHAREDORG)
+          res = slabfirstco(node->box, p, extra, first, hit.t);
+        else
+          res = slabfirst(node->box, p, extra, first, hit.t);
+        if (st) st->boxes += first - start + (res ? 1 : 0);
+      }
       if (!res) break;
     processnode:
+      if (st) ++st->nodes;
       const u32 flag = node->getflag();
       if (flag == intersector::NONLEAF) {
+        u32 rays[MAXRAYNUM];
+        const auto num = fewrays<flags>(node->box, p, extra, first, depth, hit.t, rays);
+        if (num != ~0u) {
+          loopi(s32(num)) singleclosest(node, p, rays[i], hit);
+          if (st) st->single += num;
+          break;
+        }
         const s32 farindex = signs[node->getaxis()];
         const s32 nearindex = farindex^1;
         const u32 offset = node->getoffset();
-        stack[stacksz++] = makepair(node+offset+farindex, first);
+        stack[stacksz++] = packetentry(node+offset+farindex, first, ++depth);
         node = node+offset+nearindex;
       } else {
         if (flag == intersector::TRILEAF) {
           auto tris = node->getptr<waldtriangle>();
           const s32 n = tris->num;
           u32 active[MAXRAYNUM/soaf::size];
-          active[first] = 1;
-          if (flags & raypacket::SHAREDORG)
-            slabfilterco(node->box, p, extra, active, first+1, hit.t);
-          else
-            slabfilter(node->box, p, extra, active, first+1, hit.t);
+          const auto lanes = (flags & raypacket::SHAREDORG) ?
+            slabfilterco(node->box, p, extra, active, first, hit.t) :
+            slabfilter(node->box, p, extra, active, first, hit.t);
+          if (st) leafstats(*st, p, active, first, u32(n), lanes);
           loopi(n) closest<flags>(tris[i], p, active, first, hit);
           break;
+        } else if (flag == intersector::INSTLEAF) {
+          instanceclosest(*node->getptr<instanceleaf>(), p, hit);
+          break;
         } else {
           node = node->getptr<intersector>()->root;
           goto processnode;
@@ -409,7 +539,7 @@ void closest(const intersector &RESTRICT bvhtree,
   }
 }
 
-#define CASE(X) case X: closest<X>(bvhtree, p, extra, hit); break;
+#define CASE(X) case X: closest<X>(bvhtree, p, extra, hit, st); break;
 #define CASE4(X) CASE(X) CASE(X+1) CASE(X+2) CASE(X+3)
 void closest(const intersector &bvhtree, const raypacket &p, packethit &hit) {
   assert(p.raynum % soaf::size == 0);
@@ -417,6 +547,7 @@ void closest(const intersector &bvhtree, const raypacket &p, packethit &hit) {
   // build the extra data structures we need to intersect the bvh
   CACHE_LINE_ALIGNED raypacketextra extra;
   const auto flags = initextra(extra, p, hit);
+  const auto st = threadstats();
   switch (flags) {
     CASE4(0)
     CASE4(4)
@@ -432,19 +563,22 @@ template <u32 flags>
 void occluded(const intersector &RESTRICT bvhtree,
               const raypacket &RESTRICT p,
               const raypacketextra &RESTRICT extra,
-              packetshadow &RESTRICT s)
+              packetshadow &RESTRICT s,
+              raystats *RESTRICT st)
 {
-  pair<intersector::node*,u32> stack[64];
-  stack[0] = makepair(bvhtree.root, 0u);
+  packetentry stack[64];
+  stack[0] = packetentry(bvhtree.root, 0u, 0u);
   u32 stacksz = 1;
   u32 occnum = 0;
   while (stacksz) {
     const auto elem = stack[--stacksz];
-    auto node = elem.first;
-    auto first = elem.second;
+    auto node = elem.node;
+    auto first = elem.first;
+    auto depth = elem.depth;
     for (;;) {
       bool res = false;
       if (flags & raypacket::INTERVALARITH) {
+        if (st) ++st->boxes;
         if (flags & raypacket::SHAREDORG) {
           res = slaboneco(node->box, p, extra, first, s.t);
           if (res) goto processnode;
@@ -456,30 +590,46 @@ void occluded(const intersector &RESTRICT bvhtree,
         }
         ++first;
       }
-      if (flags & raypacket::SHAREDORG)
-        res = slabfirstco(node->box, p, extra, first, s.t);
-      else
-        res = slabfirst(node->box, p, extra, first, s.t);
+      {
+        const auto start = first;
+        if (flags & raypacket::SHAREDORG)
+          res = slabfirstco(node->box, p, extra, first, s.t);
+        else
+          res = slabfirst(node->box, p, extra, first, s.t);
+        if (st) st->boxes += first - start + (res ? 1 : 0);
+      }
       if (!res) break;
     processnode:
+      if (st) ++st->nodes;
       const u32 flag = node->getflag();
       if (flag == intersector::NONLEAF) {
+        u32 rays[MAXRAYNUM];
+        const auto num = fewrays<flags>(node->box, p, extra, first, depth, s.t, rays);
+        if (num != ~0u) {
+          loopi(s32(num)) occnum += singleoccluded(node, p, rays[i], s);
+          if (st) st->single += num;
+          if (occnum == p.raynum) return;
+          break;
+        }
         const u32 offset = node->getoffset();
-        stack[stacksz++] = makepair(node+offset+1, first);
+        stack[stacksz++] = packetentry(node+offset+1, first, ++depth);
         node = node+offset;
       } else {
         if (flag == intersector::TRILEAF) {
           auto tris = node->getptr<waldtriangle>();
           const s32 n = tris->num;
           u32 active[MAXRAYNUM];
-          active[first] = 1;
-          if (flags & raypacket::SHAREDORG)
-            slabfilterco(node->box, p, extra, active, first+1, s.t);
-          else
-            slabfilter(node->box, p, extra, active, first+1, s.t);
+          const auto lanes = (flags & raypacket::SHAREDORG) ?
+            slabfilterco(node->box, p, extra, active, first, s.t) :
+            slabfilter(node->box, p, extra, active, first, s.t);
+          if (st) leafstats(*st, p, active, first, u32(n), lanes);
           loopi(n) occnum += occluded<flags>(tris[i], p, active, first, s);
           if (occnum == p.raynum) return;
           break;
+        } else if (flag == intersector::INSTLEAF) {
+          occnum = instanceoccluded(*node->getptr<instanceleaf>(), p, s);
+          if (occnum == p.raynum) return;
+          break;
         } else {
           node = node->getptr<intersector>()->root;
           goto processnode;
@@ -503,7 +653,7 @@ static const avxb seqactivemask[] = {
   avxb(T,T,T,T,T,T,T,F),
   avxb(T,T,T,T,T,T,T,T)
 };
-#elif defined(__SSE__)
+#elif defined(__SSE2_INTRINSICS__)
 static const sseb seqactivemask[] = {
   sseb(F,F,F,F),
   sseb(T,F,F,F),
@@ -522,7 +672,7 @@ INLINE soa3f select(const soab &m, const soa3f &a, const soa3f &b) {
   return soa3f(select(m,a.x,b.x),select(m,a.y,b.y),select(m,a.z,b.z));
 }
 
-#define CASE(X) case X: occluded<X>(bvhtree, p, extra, s); break;
+#define CASE(X) case X: occluded<X>(bvhtree, p, extra, s, st); break;
 #define CASE4(X) CASE(X) CASE(X+1) CASE(X+2) CASE(X+3)
 void occluded(const intersector &bvhtree, const raypacket &p, packetshadow &s) {
 
@@ -547,6 +697,7 @@ void occluded(const intersector &bvhtree, const raypacket &p, packetshadow &s) {
   // build the extra data structures we need to intersect the bvh
   CACHE_LINE_ALIGNED raypacketextra extra;
   const auto flags = initextra(extra, p, s);
+  const auto st = threadstats();
   switch (flags) {
     CASE4(0)
     CASE4(4)
@@ -563,6 +714,565 @@ void occluded(const intersector &bvhtree, const raypacket &p, packetshadow &s) {
 #undef CASE
 #undef CASE4
 
+/*-------------------------------------------------------------------------
+ - 4-wide bvh traversal. rays are traced one by one and every step tests the
+ - four child boxes with one slab test
+ -------------------------------------------------------------------------*/
+struct ray4 {
+  INLINE ray4(const vec3f &org, const vec3f &dir) :
+    org(org), dir(dir), sorg(org), srdir(rcp(dir)) {}
+  vec3f org, dir;
+  vec3<ssef> sorg, srdir;
+};
+
+// decode four 8 bit planes. the product is exact and the traversal gets the
+// same boxes as the ones checked by the compiler
+INLINE ssef dequantize(const u8 *q, float org, float step) {
+  s32 packed;
+  memcpy(&packed, q, sizeof(packed));
+  const auto zeros = _mm_setzero_si128();
+  const auto bytes = _mm_cvtsi32_si128(packed);
+  const auto words = _mm_unpacklo_epi8(bytes, zeros);
+  return ssef(org) + ssef(_mm_unpacklo_epi16(words, zeros))*ssef(step);
+}
+
+INLINE u32 slab4(const intersector::node4 &RESTRICT node,
+                 const ray4 &RESTRICT r, float t, ssef &tnear)
+{
+  vec3<ssef> pmin, pmax;
+  loopk(3) {
+    const auto step = node.step(k);
+    pmin[k] = dequantize(node.qmin[k], node.org[k], step);
+    pmax[k] = dequantize(node.qmax[k], node.org[k], step);
+  }
+  const auto t0x = (pmin.x-r.sorg.x)*r.srdir.x;
+  const auto t1x = (pmax.x-r.sorg.x)*r.srdir.x;
+  const auto t0y = (pmin.y-r.sorg.y)*r.srdir.y;
+  const auto t1y = (pmax.y-r.sorg.y)*r.srdir.y;
+  const auto t0z = (pmin.z-r.sorg.z)*r.srdir.z;
+  const auto t1z = (pmax.z-r.sorg.z)*r.srdir.z;
+  const auto tfar = min(min(max(t0x,t1x),max(t0y,t1y)),min(max(t0z,t1z),ssef(t)));
+  tnear = max(max(min(t0x,t1x),min(t0y,t1y)),max(min(t0z,t1z),ssef(zero)));
+  return u32(movemask(tnear <= tfar)) & ((1u<<node.num)-1u);
+}
+
+// ray components along the projection axis of each lane and the two others
+INLINE ssef axisk(const sseb &k0, const sseb &k1, const vec3<ssef> &v) {
+  return select(k0, v.x, select(k1, v.y, v.z));
+}
+INLINE ssef axisu(const sseb &k0, const sseb &k1, const vec3<ssef> &v) {
+  return select(k0, v.y, select(k1, v.z, v.x));
+}
+INLINE ssef axisv(const sseb &k0, const sseb &k1, const vec3<ssef> &v) {
+  return select(k0, v.z, select(k1, v.x, v.y));
+}
+
+// return true if one triangle of the leaf is closer than t (then updated).
+// each group of four triangles is tested with one wald test in simd
+template <bool occludedonly>
+INLINE bool leaf4(const intersector::tri4 *RESTRICT g,
+                  const ray4 &RESTRICT r, float &t,
+                  packethit *RESTRICT hit, u32 rayid)
+{
+  const vec3<ssef> dir(r.dir);
+  auto found = false;
+  for (;; ++g) {
+    const auto k = ssei::load(g->k) & ssei(3);
+    const auto k0 = k == ssei(0), k1 = k == ssei(1);
+    const auto ok = axisk(k0,k1,r.sorg), ou = axisu(k0,k1,r.sorg), ov = axisv(k0,k1,r.sorg);
+    const auto dk = axisk(k0,k1,dir), du = axisu(k0,k1,dir), dv = axisv(k0,k1,dir);
+    const auto nu = ssef::load(g->nu), nv = ssef::load(g->nv);
+    const auto d = (ssef::load(g->nd)-ok-nu*ou-nv*ov) / (dk+nu*du+nv*dv);
+    const auto hu = ou + d*du - ssef::load(g->pu);
+    const auto hv = ov + d*dv - ssef::load(g->pv);
+    const auto u = hu*ssef::load(g->bu) + hv*ssef::load(g->bv);
+    const auto v = hu*ssef::load(g->cu) + hv*ssef::load(g->cv);
+    const auto m = (d<ssef(t)) & (d>ssef(zero)) &
+                   (u>=ssef(zero)) & (v>=ssef(zero)) & (u+v<=ssef(one));
+    auto mask = u32(movemask(m)) & ((1u<<g->num)-1u);
+    if (mask != 0) {
+      found = true;
+      if (occludedonly) break;
+
+      // keep the closest of the hit triangles
+      auto best = __bsf(mask);
+      for (mask &= mask-1; mask; mask &= mask-1) {
+        const auto j = __bsf(mask);
+        if (d[j] < d[best]) best = j;
+      }
+      const u32 kk = g->k[best] & 3, ku = waldmodulo[kk], kv = waldmodulo[kk+1];
+      const auto sign = (g->k[best] >> 2) ? -1.f : 1.f;
+      t = d[best];
+      hit->t[rayid] = t;
+      hit->u[rayid] = u[best];
+      hit->v[rayid] = v[best];
+      hit->id[rayid] = g->id[best];
+      hit->n[kk][rayid] = sign;
+      hit->n[ku][rayid] = sign*g->nu[best];
+      hit->n[kv][rayid] = sign*g->nv[best];
+    }
+    if (g->last) break;
+  }
+  return found;
+}
+
+template <bool occludedonly>
+static bool traverse4(const intersector &RESTRICT bvhtree, const ray4 &RESTRICT r,
+                      float t, packethit *RESTRICT hit, u32 rayid)
+{
+  pair<u32,float> stack[256];
+  stack[0] = makepair(0u, 0.f);
+  u32 stacksz = 1;
+  auto found = false;
+  while (stacksz) {
+    const auto elem = stack[--stacksz];
+    if (elem.second > t) continue;
+    const auto &node = bvhtree.root4[elem.first];
+    ssef tnear;
+    auto mask = slab4(node, r, t, tnear);
+    if (mask == 0) continue;
+    ALIGNED(16) float dist[4];
+    store4f(dist, tnear);
+
+    // leaves are intersected right away, inner nodes are pushed from the
+    // farthest to the nearest such that we pop the nearest first
+    const auto first = stacksz;
+    while (mask) {
+      const auto i = __bsf(mask);
+      mask &= mask-1;
+      const auto child = node.child[i];
+      if (child & intersector::LEAF4) {
+        const auto tris = bvhtree.tris4 + (child & ~intersector::LEAF4);
+        if (!leaf4<occludedonly>(tris, r, t, hit, rayid)) continue;
+        if (occludedonly) return true;
+        found = true;
+      } else {
+        auto j = stacksz++;
+        for (; j > first && stack[j-1].second < dist[i]; --j) stack[j] = stack[j-1];
+        stack[j] = makepair(child, dist[i]);
+      }
+    }
+  }
+  return found;
+}
+
+void closest4(const intersector &bvhtree, const raypacket &p, packethit &hit) {
+  if (bvhtree.root4 == NULL) {
+    closest(bvhtree, p, hit);
+    return;
+  }
+  loopi(s32(p.raynum)) {
+    const ray4 r(rayorg(p,i), raydir(p,i));
+    traverse4<false>(bvhtree, r, hit.t[i], &hit, i);
+  }
+  AVX_ZERO_UPPER();
+}
+
+void occluded4(const intersector &bvhtree, const raypacket &p, packetshadow &s) {
+  if (bvhtree.root4 == NULL) {
+    occluded(bvhtree, p, s);
+    return;
+  }
+  loopi(s32(p.raynum)) {
+    if (s.occluded[i]) continue;
+    const ray4 r(rayorg(p,i), raydir(p,i));
+    if (traverse4<true>(bvhtree, r, s.t[i], NULL, i)) s.occluded[i] = ~0x0;
+  }
+  AVX_ZERO_UPPER();
+}
+
+/*-------------------------------------------------------------------------
+ - single rays for gameplay queries. the boxes of both children are tested
+ - with one sse slab test and leaf triangles are intersected 4 by 4
+ -------------------------------------------------------------------------*/
+struct singleray {
+  INLINE singleray(const ray &r) {
+    const auto rdir = rcp(r.dir);
+    loopk(3) {
+      org[k] = ssef(r.org[k]);
+      this->rdir[k] = ssef(rdir[k]);
+    }
+  }
+  ssef org[3], rdir[3];
+};
+
+// lanes 0 and 1 of "tnear" get the entry distances of both boxes
+INLINE u32 slab2(const aabb &RESTRICT b0, const aabb &RESTRICT b1,
+                 const singleray &RESTRICT r, float t, ssef &tnear)
+{
+  auto tfar = ssef(t);
+  tnear = ssef(zero);
+  loopk(3) {
+    const auto l = (ssef(b0.pmin[k], b1.pmin[k], b0.pmax[k], b1.pmax[k])-r.org[k])*r.rdir[k];
+    const auto s = shuffle<2,3,0,1>(l);
+    tnear = max(tnear, min(l,s));
+    tfar = min(tfar, max(l,s));
+  }
+  return movemask(tnear <= tfar) & 3;
+}
+
+template <bool occludedonly>
+static bool raytriangles(const waldtriangle *RESTRICT tris, const ray &RESTRICT r, hit &RESTRICT h) {
+  const s32 n = tris->num;
+  auto found = false;
+  for (s32 i = 0; i < n; i += 4) {
+    // transpose the triangles. missing ones repeat the last one
+    CACHE_LINE_ALIGNED float nd[4], nu[4], nv[4], ok[4], ou[4], ov[4];
+    CACHE_LINE_ALIGNED float dk[4], du[4], dv[4], pu[4], pv[4];
+    CACHE_LINE_ALIGNED float bu[4], bv[4], cu[4], cv[4];
+    const auto num = min(n-i, 4);
+    loopj(4) {
+      const auto &tri = tris[i+min(j,num-1)];
+      const auto k = u32(tri.k), ku = waldmodulo[k], kv = waldmodulo[k+1];
+      nd[j] = tri.nd; nu[j] = tri.n.x; nv[j] = tri.n.y;
+      ok[j] = r.org[k]; ou[j] = r.org[ku]; ov[j] = r.org[kv];
+      dk[j] = r.dir[k]; du[j] = r.dir[ku]; dv[j] = r.dir[kv];
+      pu[j] = tri.vertk.x; pv[j] = tri.vertk.y;
+      bu[j] = tri.bn.x; bv[j] = tri.bn.y;
+      cu[j] = tri.cn.x; cv[j] = tri.cn.y;
+    }
+    const auto trinu = ssef::load(nu), trinv = ssef::load(nv);
+    const auto ku = ssef::load(ou), kv = ssef::load(ov);
+    const auto dirku = ssef::load(du), dirkv = ssef::load(dv);
+    const auto d = (ssef::load(nd)-ssef::load(ok)-trinu*ku-trinv*kv) /
+                   (ssef::load(dk)+trinu*dirku+trinv*dirkv);
+    const auto hu = ku + d*dirku - ssef::load(pu);
+    const auto hv = kv + d*dirkv - ssef::load(pv);
+    const auto u = hu*ssef::load(bu) + hv*ssef::load(bv);
+    const auto v = hu*ssef::load(cu) + hv*ssef::load(cv);
+    const auto m = (d<ssef(h.t)) & (d>=ssef(zero)) &
+                   (u>=ssef(zero)) & (v>=ssef(zero)) & (u+v<=ssef(one));
+    auto mask = u32(movemask(m)) & ((1u<<num)-1u);
+    if (mask == 0) continue;
+    if (occludedonly) return true;
+
+    // keep the closest of the hit triangles
+    auto best = __bsf(mask);
+    for (mask &= mask-1; mask; mask &= mask-1) {
+      const auto j = __bsf(mask);
+      if (d[j] < d[best]) best = j;
+    }
+    const auto &tri = tris[i+best];
+    const auto k = u32(tri.k);
+    h.t = d[best];
+    h.u = u[best];
+    h.v = v[best];
+    h.id = tri.id;
+    h.n[k] = tri.sign ? -1.f : 1.f;
+    h.n[waldmodulo[k]] = h.n[k]*tri.n.x;
+    h.n[waldmodulo[k+1]] = h.n[k]*tri.n.y;
+    found = true;
+  }
+  return found;
+}
+
+template <bool occludedonly>
+static bool traverse(const intersector::node *RESTRICT root, const ray &RESTRICT r, hit &RESTRICT h) {
+  const singleray sr(r);
+  pair<const intersector::node*,float> stack[64];
+  ssef tnear;
+  if (!slab2(root->box, root->box, sr, h.t, tnear)) return false;
+  stack[0] = makepair(root, 0.f);
+  u32 stacksz = 1;
+  auto found = false;
+  while (stacksz) {
+    const auto elem = stack[--stacksz];
+    if (elem.second > h.t) continue;
+    auto node = elem.first;
+    for (;;) {
+      const auto flag = node->getflag();
+      if (flag == intersector::NONLEAF) {
+        const auto children = node+node->getoffset();
+        const auto mask = slab2(children[0].box, children[1].box, sr, h.t, tnear);
+        if (mask == 0) break;
+        if (mask != 3) {
+          node = children + (mask>>1);
+          continue;
+        }
+        const auto nearindex = tnear[0] <= tnear[1] ? 0 : 1;
+        stack[stacksz++] = makepair(children+(nearindex^1), tnear[nearindex^1]);
+        node = children+nearindex;
+      } else if (flag == intersector::TRILEAF) {
+        if (raytriangles<occludedonly>(node->getptr<waldtriangle>(), r, h)) {
+          if (occludedonly) return true;
+          found = true;
+        }
+        break;
+      } else if (flag == intersector::INSTLEAF) {
+        const auto inst = node->getptr<instanceleaf>();
+        const auto local = xfmray(*inst, r);
+        if (occludedonly) {
+          if (traverse<true>(inst->isec->root, local, h)) return true;
+        } else if (traverse<false>(inst->isec->root, local, h)) {
+          h.n = xfmvector(inst->tonormal, h.n);
+          found = true;
+        }
+        break;
+      } else
+        node = node->getptr<intersector>()->root;
+    }
+  }
+  return found;
+}
+
+template <bool occludedonly>
+INLINE bool traverse(const intersector &RESTRICT bvhtree, const ray &RESTRICT r, hit &RESTRICT h) {
+  return traverse<occludedonly>(bvhtree.root, r, h);
+}
+
+void closest(const intersector &bvhtree, const ray &r, hit &h) {
+  traverse<false>(bvhtree, r, h);
+  AVX_ZERO_UPPER();
+}
+
+bool occluded(const intersector &bvhtree, const ray &r) {
+  hit shadow(r.tfar);
+  const auto res = traverse<true>(bvhtree, r, shadow);
+  AVX_ZERO_UPPER();
+  return res;
+}
+
+void occluded(const intersector &bvhtree, const ray *r, u32 n, s32 *occluded) {
+  loopi(s32(n)) {
+    hit shadow(r[i].tfar);
+    occluded[i] = traverse<true>(bvhtree, r[i], shadow) ? ~0x0 : 0;
+  }
+  AVX_ZERO_UPPER();
+}
+
+/*-------------------------------------------------------------------------
+ - ray streams. lists of active rays are filtered node after node such that
+ - every node only tests the rays that hit its parent. rays are gathered in
+ - soa form from the lists so lanes are full whatever the ray coherence
+ -------------------------------------------------------------------------*/
+struct streamentry {
+  const intersector::node *node;
+  u32 first, num; // active ray list
+};
+
+INLINE soaf gather(const vector<float> &v, const u32 *idx) {
+  CACHE_LINE_ALIGNED float x[soaf::size];
+  loopi(s32(soaf::size)) x[i] = v.begin()[idx[i]];
+  return soaf::load(x);
+}
+
+INLINE soa3f gather(const vector<float> *v, const u32 *idx) {
+  return soa3f(gather(v[0],idx), gather(v[1],idx), gather(v[2],idx));
+}
+
+// lanes of the last chunk are padded with its last ray
+INLINE u32 chunk(const u32 *list, u32 first, u32 num, u32 *idx) {
+  const auto n = min(num-first, u32(soaf::size));
+  loopi(s32(soaf::size)) idx[i] = list[first+min(u32(i),n-1)];
+  return n == soaf::size ? (1u<<soaf::size)-1u : (1u<<n)-1u;
+}
+
+// current distance of the rays: t for closest and tfar for shadow rays
+template <bool occludedonly>
+INLINE const vector<float> &raydist(const raystream &s) {
+  return occludedonly ? s.tfar : s.t;
+}
+
+// append to "out" the rays of "in" that hit the box
+template <bool occludedonly>
+static u32 streamfilter(const aabb &RESTRICT box, const raystream &RESTRICT s,
+                        const u32 *RESTRICT in, u32 num, u32 *RESTRICT out)
+{
+  u32 outnum = 0;
+  for (u32 j = 0; j < num; j += soaf::size) {
+    u32 idx[soaf::size];
+    const auto valid = chunk(in, j, num, idx);
+    const auto org = gather(s.org, idx);
+    const auto rdir = soaf(one) / gather(s.dir, idx);
+    const auto t = gather(raydist<occludedonly>(s), idx);
+    const auto res = slab(soa3f(box.pmin)-org, soa3f(box.pmax)-org, rdir, t);
+    auto mask = u32(movemask(res.isec)) & valid;
+    while (mask) {
+      const auto i = __bsf(mask);
+      mask &= mask-1;
+      if (!occludedonly || !s.occluded.begin()[idx[i]]) out[outnum++] = idx[i];
+    }
+  }
+  return outnum;
+}
+
+template <bool occludedonly>
+static void streamleaf(const waldtriangle *RESTRICT tris, raystream &RESTRICT s,
+                       const u32 *RESTRICT list, u32 num)
+{
+  const s32 n = tris->num;
+  for (u32 j = 0; j < num; j += soaf::size) {
+    u32 idx[soaf::size];
+    const auto valid = chunk(list, j, num, idx);
+    const auto rayorg = gather(s.org, idx);
+    const auto raydir = gather(s.dir, idx);
+    const auto oldt = gather(raydist<occludedonly>(s), idx);
+    auto t = oldt, u = soaf(zero), v = soaf(zero), id = soaf(zero);
+    soa3f nor(zero);
+    auto hitmask = 0u;
+    loopi(n) {
+      const auto &tri = tris[i];
+      const auto k = u32(tri.k), ku = waldmodulo[k], kv = waldmodulo[k+1];
+      const soa2f dir(raydir[ku], raydir[kv]);
+      const soa2f org(rayorg[ku], rayorg[kv]);
+      const auto d = (soaf(tri.nd)-rayorg[k]-dot(soa2f(tri.n),org))/(raydir[k]+dot(soa2f(tri.n),dir));
+      const auto tmask = (d<t) & (d>soaf(zero));
+      if (none(tmask)) continue;
+      const auto h = org + d*dir - soa2f(tri.vertk);
+      const auto hu = dot(h,soa2f(tri.bn));
+      const auto hv = dot(h,soa2f(tri.cn));
+      const auto m = (hu>=soaf(zero)) & (hv>=soaf(zero)) & (hu+hv<=soaf(one)) & tmask;
+      const auto mask = u32(movemask(m)) & valid;
+      if (mask == 0) continue;
+      hitmask |= mask;
+      if (occludedonly) {
+        if (hitmask == valid) break;
+        continue;
+      }
+      const auto sign = tri.sign ? -1.f : 1.f;
+      vec3f trinor;
+      trinor[k] = sign;
+      trinor[ku] = sign*tri.n.x;
+      trinor[kv] = sign*tri.n.y;
+      t = select(m, d, t);
+      u = select(m, hu, u);
+      v = select(m, hv, v);
+      id = select(m, soaf::broadcast(&tri.id), id);
+      loopk(3) nor[k] = select(m, soaf(trinor[k]), nor[k]);
+    }
+    if (hitmask == 0) continue;
+    CACHE_LINE_ALIGNED float tt[soaf::size], uu[soaf::size], vv[soaf::size];
+    CACHE_LINE_ALIGNED s32 ids[soaf::size];
+    CACHE_LINE_ALIGNED float nn[3][soaf::size];
+    if (!occludedonly) {
+      store(tt, t);
+      store(uu, u);
+      store(vv, v);
+      store(ids, id);
+      loopk(3) store(nn[k], nor[k]);
+    }
+    while (hitmask) {
+      const auto i = __bsf(hitmask);
+      hitmask &= hitmask-1;
+      const auto ray = idx[i];
+      if (occludedonly) {
+        s.occluded[ray] = ~0x0;
+        continue;
+      }
+      s.t[ray] = tt[i];
+      s.u[ray] = uu[i];
+      s.v[ray] = vv[i];
+      s.id[ray] = ids[i];
+      loopk(3) s.n[k][ray] = nn[k][i];
+    }
+  }
+}
+
+// trace the listed rays in the space of the instance with a smaller stream
+void closeststream(const intersector&, raystream&, u32, u32);
+void occludedstream(const intersector&, raystream&, u32, u32);
+template <bool occludedonly>
+static void streaminstance(const instanceleaf &inst, raystream &s,
+                           const u32 *list, u32 num)
+{
+  raystream local;
+  loopi(s32(num)) {
+    const auto idx = list[i];
+    const vec3f org(s.org[0][idx], s.org[1][idx], s.org[2][idx]);
+    const vec3f dir(s.dir[0][idx], s.dir[1][idx], s.dir[2][idx]);
+    const auto tfar = occludedonly ? s.tfar[idx] : s.t[idx];
+    local.add(xfmray(inst, ray(org, dir, 0.f, tfar)));
+  }
+  if (occludedonly) {
+    local.occluded.setsize(num);
+    local.occluded.memset(0);
+    occludedstream(*inst.isec, local, 0, num);
+    loopi(s32(num)) if (local.occluded[i]) s.occluded[list[i]] = ~0x0;
+    return;
+  }
+  local.t.setsize(num);
+  local.u.setsize(num);
+  local.v.setsize(num);
+  local.id.setsize(num);
+  loopk(3) local.n[k].setsize(num);
+  loopi(s32(num)) {
+    local.t[i] = local.tfar[i];
+    local.id[i] = -1;
+  }
+  closeststream(*inst.isec, local, 0, num);
+  loopi(s32(num)) {
+    if (local.id[i] == -1) continue;
+    const auto idx = list[i];
+    const vec3f n(local.n[0][i], local.n[1][i], local.n[2][i]);
+    const auto wn = xfmvector(inst.tonormal, n);
+    s.t[idx] = local.t[i];
+    s.u[idx] = local.u[i];
+    s.v[idx] = local.v[i];
+    s.id[idx] = local.id[i];
+    loopk(3) s.n[k][idx] = wn[k];
+  }
+}
+
+template <bool occludedonly>
+static void tracestream(const intersector &RESTRICT bvhtree, raystream &RESTRICT s,
+                        u32 first, u32 num)
+{
+  // lists are stacked: children of a node share the list of the rays that
+  // hit it and a popped entry drops all the lists above its own one
+  vector<u32> lists(2*num);
+  if (s.order.length() != 0)
+    memcpy(&lists[0], &s.order[first], sizeof(u32)*num);
+  else
+    loopi(s32(num)) lists[i] = first+i;
+  streamentry stack[128];
+  stack[0].node = bvhtree.root;
+  stack[0].first = 0;
+  stack[0].num = num;
+  u32 stacksz = 1;
+  while (stacksz) {
+    const auto elem = stack[--stacksz];
+    const auto top = elem.first + elem.num;
+    if (u32(lists.length()) < top + elem.num) lists.setsize(2*(top+elem.num));
+    const auto active = &lists[0] + top;
+    const auto activenum = streamfilter<occludedonly>(elem.node->box, s, &lists[0]+elem.first, elem.num, active);
+    if (activenum == 0) continue;
+    const auto node = elem.node;
+    const auto flag = node->getflag();
+    if (flag == intersector::NONLEAF) {
+      // rays are sorted by octant: the first one gives the near child
+      const auto axis = node->getaxis();
+      const s32 nearindex = s.dir[axis][*active] >= 0.f ? 0 : 1;
+      const auto offset = node->getoffset();
+      stack[stacksz].node = node+offset+(nearindex^1);
+      stack[stacksz].first = top;
+      stack[stacksz++].num = activenum;
+      stack[stacksz].node = node+offset+nearindex;
+      stack[stacksz].first = top;
+      stack[stacksz++].num = activenum;
+    } else if (flag == intersector::TRILEAF)
+      streamleaf<occludedonly>(node->getptr<waldtriangle>(), s, active, activenum);
+    else if (flag == intersector::INSTLEAF) {
+      vector<u32> copy(activenum);
+      memcpy(&copy[0], active, sizeof(u32)*activenum);
+      streaminstance<occludedonly>(*node->getptr<instanceleaf>(), s, &copy[0], activenum);
+    } else {
+      stack[stacksz].node = node->getptr<intersector>()->root;
+      stack[stacksz].first = top;
+      stack[stacksz++].num = activenum;
+    }
+  }
+}
+
+void closeststream(const intersector &bvhtree, raystream &s, u32 first, u32 num) {
+  if (num) tracestream<false>(bvhtree, s, first, num);
+  AVX_ZERO_UPPER();
+}
+
+void occludedstream(const intersector &bvhtree, raystream &s, u32 first, u32 num) {
+  if (num) tracestream<true>(bvhtree, s, first, num);
+  AVX_ZERO_UPPER();
+}
+
 /*-------------------------------------------------------------------------
  - generation of packets
  -------------------------------------------------------------------------*/
@@ -571,7 +1281,7 @@ static const soaf identityf(0.f,1.f,2.f,3.f,4.f,5.f,6.f,7.f);
 static const soai identityi(0,1,2,3,4,5,6,7);
 static const soaf packetx(0.f,1.f,2.f,3.f,0.f,1.f,2.f,3.f);
 static const soaf packety(0.f,0.f,0.f,0.f,1.f,1.f,1.f,1.f);
-#elif defined(__SSE__)
+#elif defined(__SSE2_INTRINSICS__)
 static const soaf identityf(0.f,1.f,2.f,3.f);
 static const soai identityi(0,1,2,3);
 #endif
@@ -753,6 +1463,36 @@ void writenormal(const packethit &RESTRICT hit,
   AVX_ZERO_UPPER();
 }
 
+void writecolor(const array3f &RESTRICT rgb,
+                const vec2i &RESTRICT tileorg,
+                const vec2i &RESTRICT screensize,
+                int *RESTRICT pixels)
+{
+  u32 idx = 0;
+  const auto w = screensize.x;
+#if defined(__AVX__)
+  auto yoffset0 = w*tileorg.y;
+  auto yoffset1 = w+yoffset0;
+  for (auto y = tileorg.y; y < tileorg.y+TILESIZE; y+=2, yoffset0+=2*w, yoffset1+=2*w) {
+    for (auto x = tileorg.x; x < tileorg.x+TILESIZE; x+=soaf::size/2, ++idx) {
+#else
+  auto yoffset = w*tileorg.y;
+  for (auto y = tileorg.y; y < tileorg.y+TILESIZE; ++y, yoffset+=w) {
+    for (auto x = tileorg.x; x < tileorg.x+TILESIZE; x+=soaf::size, ++idx) {
+#endif
+      const auto c = soa3i(clamp(sget(rgb, idx))*soaf(255.f));
+      const auto color = c.x | (c.y<<8) | (c.z<<16) | soai(0xff000000);
+#if defined(__AVX__)
+      storeu4i(pixels+yoffset0+x, extract<0>(color));
+      storeu4i(pixels+yoffset1+x, extract<1>(color));
+#else
+      storeui(pixels+yoffset+x, color);
+#endif
+    }
+  }
+  AVX_ZERO_UPPER();
+}
+
 void writendotl(const raypacket &RESTRICT shadow,
                 const array3f &nor,
                 const packetshadow &RESTRICT occluded,
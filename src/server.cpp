@@ -3,13 +3,34 @@
  - server.hpp -> implements server specific code
  -------------------------------------------------------------------------*/
 #include "mini.q.hpp"
+#include "base/timerwheel.hpp"
 #include "enet/enet.h"
+#include <SDL2/SDL_thread.h>
+#include <SDL2/SDL_timer.h>
 #include <time.h>
 
 namespace q {
 namespace server {
 
-enum { ST_EMPTY, ST_LOCAL, ST_TCPIP };
+enum { ST_EMPTY, ST_LOCAL, ST_TCPIP, ST_NULL }; // null ones only replay
+
+struct snapshot {
+  int id;
+  vector<snapentry> entries; // sorted by client number
+};
+
+// lag compensation. the server has no world to run the player physics so it
+// trusts the SV_POS states but records them at a fixed tick. a hitscan damage
+// is only accepted if the shot crosses the box of the target as the shooter
+// saw it, ping milliseconds ago
+enum {
+  SIMMILLIS = 16, // ~60 ticks per second
+  HISTORYNUM = 64, // ~1 second of boxes
+  MAXREWIND = SIMMILLIS*(HISTORYNUM-1)
+};
+static const float HITEXTENT = 2.5f; // player box in any orientation and some slack
+
+struct posrecord { u32 millis; aabb box; };
 
 struct drawarray { // server side version of "dynent" type
   int type;
@@ -18,34 +39,78 @@ struct drawarray { // server side version of "dynent" type
   fixedstring mapvote;
   fixedstring name;
   int modevote;
+  int pos[POSNUM]; // last SV_POS state
+  bool haspos;
+  int snapid, lastack; // next snapshot to send and last acknowledged one
+  snapshot sent[SNAPSHOTNUM];
+  int ping; // last SV_CLIENTPING
+  posrecord history[HISTORYNUM]; // ring indexed by tick number
+  int mapchunk; // next map chunk to send or -1
+  int bsend, brec; // bytes since the last metrics export
 };
 
-static vector<drawarray> clients;
-static int maxclients = 8;
-static fixedstring smapname;
-
 struct server_entity { // server side version of "entity" type
   bool spawned;
-  int spawnsecs;
 };
 
-static vector<server_entity> sents;
-static bool notgotitems = true; // true when map has changed and waiting for clients to send item
-static int mode = 0;
+// the scheduled events of a match, in seconds. items respawn with the key
+// TIMER_ITEM plus their index
+enum { TIMER_TIMEUP, TIMER_INTERMISSION, TIMER_ITEM };
 
-void restoreserverstate(vector<game::entity> &ents) { // hack: called from savegame code, only works in SP
-  loopv(sents) {
-    sents[i].spawned = ents[i].spawned;
-    sents[i].spawnsecs = 0;
-  }
-}
+// what the front thread needs to answer the server info requests
+struct matchstatus {
+  int mode, numplayers, minremain;
+  bool full;
+  fixedstring smapname;
+};
 
-static int interm = 0, minremain = 0, mapend = 0;
-static bool mapreload = false;
+// operations metrics of a match. they go to statsd every METRICSMILLIS: the
+// tick histogram and the bytes as counters, the peer states as gauges
+enum { METRICSMILLIS = 10000, TICKBUCKETNUM = 16 };
+struct metrics {
+  u32 ticks[TICKBUCKETNUM]; // tick durations by power of two microseconds
+  u32 maxtick;              // longest tick in microseconds
+  u32 msgbytes[SV_NUM];     // received bytes per message type
+  u32 sent, recv;           // bytes of the whole match
+  u32 lastexport;
+};
+
+// everything a match owns. a dedicated server may run several matches, each
+// one on its own thread with its own host. "cur" is the match of the thread
+struct match {
+  match(void) :
+    serverhost(NULL), id(0), maxclients(8), mode(0), minremain(0),
+    mapend(0), bsend(0), brec(0), laststatus(0), lastsec(0),
+    nonlocalclients(0), lastconnect(0), lastsnapshot(0), lastsim(0), simtick(0),
+    notgotitems(true), mapreload(false), statuslock(0) { ZERO(&stats); }
+  vector<drawarray> clients;
+  vector<server_entity> sents;
+  fixedstring smapname;
+  ENetHost *serverhost;
+  int id, maxclients, mode, minremain, mapend;
+  int bsend, brec, laststatus, lastsec, nonlocalclients, lastconnect;
+  u32 lastsnapshot, lastsim, simtick;
+  bool notgotitems; // true when map has changed and waiting for clients to send item
+  bool mapreload;
+  volatile s32 statuslock;
+  matchstatus status;
+  metrics stats;
+  timerwheel timers;
+  vector<int> due;
+};
+
+static match localmatch;
+static THREAD match *cur = &localmatch;
+static vector<match*> matches;
 static const char *serverpassword = "";
 static bool isdedicated;
-static ENetHost * serverhost = NULL;
-static int bsend = 0, brec = 0, laststatus = 0, lastsec = 0;
+
+void restoreserverstate(vector<game::entity> &ents) { // hack: called from savegame code, only works in SP
+  loopv(cur->sents) {
+    cur->sents[i].spawned = ents[i].spawned;
+    cur->timers.cancel(TIMER_ITEM+i);
+  }
+}
 
 #define MAXOBUF 100000
 
@@ -55,14 +120,19 @@ void disconnect_client(int n, const char *reason);
 
 void send(int n, ENetPacket *packet) {
   if (!packet) return;
-  switch (clients[n].type) {
+  switch (cur->clients[n].type) {
     case ST_TCPIP:
-      enet_peer_send(clients[n].peer, 0, packet);
-      bsend += packet->dataLength;
+      enet_peer_send(cur->clients[n].peer, 0, packet);
+      cur->bsend += packet->dataLength;
+      cur->stats.sent += packet->dataLength;
+      cur->clients[n].bsend += packet->dataLength;
       break;
     case ST_LOCAL:
       client::localservertoclient(packet->data, packet->dataLength);
       break;
+    case ST_NULL:
+      cur->stats.sent += packet->dataLength;
+      break;
   }
 }
 
@@ -93,34 +163,43 @@ void sendservmsg(const char *msg) {
 
 void disconnect_client(int n, const char *reason) {
   printf("client::disconnecting client (%s) [%s]\n",
-    clients[n].hostname.c_str(),
+    cur->clients[n].hostname.c_str(),
     reason);
-  enet_peer_disconnect(clients[n].peer);
-  clients[n].type = ST_EMPTY;
+  if (cur->clients[n].peer) enet_peer_disconnect(cur->clients[n].peer);
+  cur->clients[n].type = ST_EMPTY;
   send2(true, -1, SV_CDIS, n);
 }
 
-void resetitems() { sents.setsize(0); notgotitems = true; };
+void resetitems() {
+  loopv(cur->sents) cur->timers.cancel(TIMER_ITEM+i);
+  cur->sents.setsize(0);
+  cur->notgotitems = true;
+}
+
+// the next SV_TIMEUP is due when a minute of the remaining ones elapsed
+static void scheduletimeup(void) {
+  cur->timers.schedule(TIMER_TIMEUP, u32(cur->mapend-cur->minremain*60+1));
+}
 
 // server side item pickup, acknowledge first client that gets it
 void pickup(u32 i, int sec, int sender) {
-  if (i>=(u32)sents.length()) return;
-  if (sents[i].spawned) {
-    sents[i].spawned = false;
-    sents[i].spawnsecs = sec;
+  if (i>=(u32)cur->sents.length()) return;
+  if (cur->sents[i].spawned) {
+    cur->sents[i].spawned = false;
+    cur->timers.schedule(TIMER_ITEM+i, u32(cur->lastsec+sec));
     send2(true, sender, SV_ITEMACC, i);
   }
 }
 
-void resetvotes() { loopv(clients) clients[i].mapvote[0] = 0; }
+void resetvotes() { loopv(cur->clients) cur->clients[i].mapvote[0] = 0; }
 
 static bool vote(const char *map, int reqmode, int sender) {
-  strcpy_s(clients[sender].mapvote, map);
-  clients[sender].modevote = reqmode;
+  strcpy_s(cur->clients[sender].mapvote, map);
+  cur->clients[sender].modevote = reqmode;
   int yes = 0, no = 0; 
-  loopv(clients) if (clients[i].type!=ST_EMPTY) {
-    if (clients[i].mapvote[0]) {
-      if (strcmp(clients[i].mapvote.c_str(), map)==0 && clients[i].modevote==reqmode)
+  loopv(cur->clients) if (cur->clients[i].type!=ST_EMPTY) {
+    if (cur->clients[i].mapvote[0]) {
+      if (strcmp(cur->clients[i].mapvote.c_str(), map)==0 && cur->clients[i].modevote==reqmode)
         yes++;
       else
         no++;
@@ -129,7 +208,7 @@ static bool vote(const char *map, int reqmode, int sender) {
   }
   if (yes==1 && no==0) return true;  // single player
   fixedstring msg(fmt, "%s suggests %s on map %s (set map to vote)",
-    clients[sender].name.c_str(),
+    cur->clients[sender].name.c_str(),
     game::modestr(reqmode), map);
   sendservmsg(msg.c_str());
   if (yes/(float)(yes+no) <= 0.5f) return false;
@@ -138,9 +217,49 @@ static bool vote(const char *map, int reqmode, int sender) {
   return true;
 }
 
+static bool hitbox(const aabb &box, const vec3f &from, const vec3f &to) {
+  auto dir = to-from;
+  loopi(3) if (abs(dir[i])<1e-6f) dir[i] = 1e-6f;
+  return slab(box, from, vec3f(one)/dir, 1.f).isec;
+}
+
+// only hitscan shots sent in the same packet are checked. projectiles and
+// splash damages land long after their SV_SHOT
+static bool validhit(int shooter, int target, int gun, const vec3f &from, const vec3f &to) {
+  using namespace game;
+  if (gun!=GUN_FIST && gun!=GUN_CG && gun!=GUN_RIFLE && gun!=GUN_BITE) return true;
+  if (target<0 || target>=cur->clients.length()) return true;
+  const auto &t = cur->clients[target];
+  if (t.type==ST_EMPTY) return true;
+  const auto rewind = min(max(cur->clients[shooter].ping, 0)+int(SNAPSHOTMILLIS), int(MAXREWIND));
+  const auto millis = cur->lastsim-u32(rewind);
+  bool checked = false;
+  loopi(HISTORYNUM) {
+    const auto &r = t.history[i];
+    if (abs(int(r.millis-millis))>SIMMILLIS) continue;
+    if (hitbox(r.box, from, to)) return true;
+    checked = true;
+  }
+  return !checked;
+}
+
+// a replay also times the decoding of every message
+static bool replaying = false;
+static u64 lastmsgnanos = 0, msgnanos[SV_NUM], msgnum[SV_NUM];
+static void countmsg(int type, int bytes) {
+  if (u32(type) >= u32(SV_NUM)) return;
+  cur->stats.msgbytes[type] += bytes;
+  if (!replaying) return;
+  const auto now = sys::nanos();
+  msgnanos[type] += now-lastmsgnanos;
+  ++msgnum[type];
+  lastmsgnanos = now;
+}
+
 // server side processing of updates: does very little and most state is tracked
 // client only could be extended to move more gameplay to server (at expense of
 // lag)
+
 void process(ENetPacket * packet, int sender) { // sender may be -1
   const u16 len = *(u16*) packet->data;
   if (ENET_NET_TO_HOST_16(len)!=packet->dataLength) {
@@ -151,15 +270,22 @@ void process(ENetPacket * packet, int sender) { // sender may be -1
   u8 *end = packet->data+packet->dataLength;
   u8 *p = packet->data+2;
   char text[MAXTRANS];
+  if (replaying) lastmsgnanos = sys::nanos();
   int cn = -1, type;
-
-  while (p<end) switch (type = getint(p)) {
+  const int from = sender;
+  // positions, acks, map requests and rejected damages are not forwarded:
+  // positions go into the snapshots
+  struct posrange { u8 *begin, *end; int cn; } posranges[8];
+  int posrangenum = 0;
+  struct { int gun; vec3f from, to; } shot = {-1, vec3f(zero), vec3f(zero)};
+
+  for (u8 *msg = p; p<end; countmsg(type, p-msg), msg = p) switch (type = getint(p)) {
     case SV_TEXT:
       sgetstr();
     break;
     case SV_INITC2S:
       sgetstr();
-      strcpy_s(clients[cn].name, text);
+      strcpy_s(cur->clients[cn].name, text);
       sgetstr();
       getint(p);
     break;
@@ -167,25 +293,26 @@ void process(ENetPacket * packet, int sender) { // sender may be -1
       sgetstr();
       int reqmode = getint(p);
       if (reqmode<0) reqmode = 0;
-      if (smapname[0] && !mapreload && !vote(text, reqmode, sender)) return;
-      mapreload = false;
-      mode = reqmode;
-      minremain = mode&1 ? 15 : 10;
-      mapend = lastsec+minremain*60;
-      interm = 0;
-      strcpy_s(smapname, text);
+      if (cur->smapname[0] && !cur->mapreload && !vote(text, reqmode, sender)) return;
+      cur->mapreload = false;
+      cur->mode = reqmode;
+      cur->minremain = cur->mode&1 ? 15 : 10;
+      cur->mapend = cur->lastsec+cur->minremain*60;
+      cur->timers.cancel(TIMER_INTERMISSION);
+      scheduletimeup();
+      strcpy_s(cur->smapname, text);
       resetitems();
       sender = -1;
     }
     break;
     case SV_ITEMLIST: {
       int n;
-      while ((n = getint(p))!=-1) if (notgotitems) {
-        server_entity se = { false, 0 };
-        while (sents.length()<=n) sents.add(se);
-        sents[n].spawned = true;
+      while ((n = getint(p))!=-1) if (cur->notgotitems) {
+        server_entity se = { false };
+        while (cur->sents.length()<=n) cur->sents.add(se);
+        cur->sents[n].spawned = true;
       }
-      notgotitems = false;
+      cur->notgotitems = false;
     }
     break;
     case SV_ITEMPICKUP: {
@@ -197,14 +324,46 @@ void process(ENetPacket * packet, int sender) { // sender may be -1
       send2(false, cn, SV_PONG, getint(p));
     break;
     case SV_POS: {
+      u8 *begin = p-1;
       cn = getint(p);
-      if (cn<0 || cn>=clients.length() || clients[cn].type==ST_EMPTY) {
+      if (cn<0 || cn>=cur->clients.length() || cur->clients[cn].type==ST_EMPTY ||
+          posrangenum==int(ARRAY_ELEM_NUM(posranges))) {
         disconnect_client(sender, "client num");
         return;
       }
-      int size = msgsizelookup(type);
-      assert(size!=-1);
-      loopi(size-2) getint(p);
+      assert(msgsizelookup(type)==POSNUM+2);
+      loopi(POSNUM) cur->clients[cn].pos[i] = getint(p);
+      cur->clients[cn].haspos = true;
+      const posrange range = {begin, p, cn};
+      posranges[posrangenum++] = range;
+    }
+    break;
+    // the events of a client come apart from its movement
+    case SV_CLIENT: {
+      u8 *begin = p-1;
+      cn = getint(p);
+      if (cn<0 || cn>=cur->clients.length() || cur->clients[cn].type==ST_EMPTY ||
+          posrangenum==int(ARRAY_ELEM_NUM(posranges))) {
+        disconnect_client(sender, "client num");
+        return;
+      }
+      const posrange range = {begin, p, cn};
+      posranges[posrangenum++] = range;
+    }
+    break;
+    case SV_SNAPACK: {
+      u8 *begin = p-1;
+      const int ack = getint(p);
+      if (posrangenum==int(ARRAY_ELEM_NUM(posranges))) {
+        disconnect_client(sender, "snapshot ack");
+        return;
+      }
+      const posrange range = {begin, p, -1};
+      posranges[posrangenum++] = range;
+      if (from<0) break;
+      auto &c = cur->clients[from];
+      if (ack<0) c.lastack = -1; // the client lost its snapshots
+      else if (ack>c.lastack && ack<c.snapid) c.lastack = ack;
     }
     break;
     case SV_SENDMAP: {
@@ -213,9 +372,43 @@ void process(ENetPacket * packet, int sender) { // sender may be -1
       sendmaps(sender, text, mapsize, p);
     }
     return;
-    case SV_RECVMAP:
-      send(sender, recvmap(sender));
-    return;
+    case SV_RECVMAP: {
+      u8 *begin = p-1;
+      const auto hash = u32(getint(p));
+      const int first = getint(p);
+      if (posrangenum==int(ARRAY_ELEM_NUM(posranges))) {
+        disconnect_client(sender, "map request");
+        return;
+      }
+      const posrange range = {begin, p, -1};
+      posranges[posrangenum++] = range;
+      if (from>=0) cur->clients[from].mapchunk = hash==maphash() ? max(first, 0) : 0;
+    }
+    break;
+    case SV_SHOT:
+      shot.gun = getint(p);
+      loopi(3) shot.from[i] = float(getint(p))/DMF;
+      loopi(3) shot.to[i] = float(getint(p))/DMF;
+    break;
+    case SV_DAMAGE: {
+      u8 *begin = p-1;
+      const int target = getint(p);
+      getint(p);
+      getint(p);
+      if (from<0 || validhit(from, target, shot.gun, shot.from, shot.to)) break;
+      if (posrangenum==int(ARRAY_ELEM_NUM(posranges))) {
+        disconnect_client(sender, "damage");
+        return;
+      }
+      const posrange range = {begin, p, -1};
+      posranges[posrangenum++] = range;
+    }
+    break;
+    case SV_CLIENTPING: {
+      const int ping = getint(p);
+      if (from>=0) cur->clients[from].ping = ping;
+    }
+    break;
     case SV_EXT:   // allows for new features that require no server updates 
       for (int n = getint(p); n; n--) getint(p);
     break;
@@ -227,7 +420,133 @@ void process(ENetPacket * packet, int sender) { // sender may be -1
   }
 
   if (p>end) { disconnect_client(sender, "end of packet"); return; };
-  multicast(packet, sender);
+  if (posrangenum==0) {
+    multicast(packet, sender);
+    return;
+  }
+
+  // every SV_POS or SV_CLIENT becomes a SV_CLIENT that tells who sends the
+  // rest. the other ranges (cn is -1) are just dropped
+  auto fwd = enet_packet_create(NULL, packet->dataLength, packet->flags&ENET_PACKET_FLAG_RELIABLE);
+  u8 *start = fwd->data;
+  u8 *dst = start+2, *src = packet->data+2;
+  bool payload = false;
+  loopi(posrangenum) {
+    payload = payload || posranges[i].begin!=src;
+    memcpy(dst, src, posranges[i].begin-src);
+    dst += posranges[i].begin-src;
+    if (posranges[i].cn>=0) {
+      putint(dst, SV_CLIENT);
+      putint(dst, posranges[i].cn);
+    }
+    src = posranges[i].end;
+  }
+  payload = payload || src!=end;
+  memcpy(dst, src, end-src);
+  dst += end-src;
+  *(u16 *)start = ENET_HOST_TO_NET_16(dst-start);
+  enet_packet_resize(fwd, dst-start);
+  if (payload) multicast(fwd, sender);
+  if (fwd->referenceCount==0) enet_packet_destroy(fwd);
+}
+
+// interest management: cur->clients further than INTERESTRADIUS from the
+// receiver only get one update every FARSNAPSHOTS snapshots. the server has
+// no map so there is no visibility test, distance only
+static const float INTERESTRADIUS = 96.f;
+static const int FARSNAPSHOTS = 8;
+
+static bool interesting(const drawarray &receiver, const drawarray &other) {
+  if (!receiver.haspos) return true;
+  float d2 = 0.f;
+  loopi(3) {
+    const auto d = float(other.pos[i]-receiver.pos[i])/DMF;
+    d2 += d*d;
+  }
+  return d2 < INTERESTRADIUS*INTERESTRADIUS;
+}
+
+static const snapentry *findentry(const snapshot &snap, int cn) {
+  int lo = 0, hi = snap.entries.length();
+  while (lo<hi) {
+    const int mid = (lo+hi)/2;
+    if (snap.entries[mid].cn<cn) lo = mid+1; else hi = mid;
+  }
+  return lo<snap.entries.length() && snap.entries[lo].cn==cn ? &snap.entries[lo] : NULL;
+}
+
+// the new entries are merged with the base ones. unchanged entries are
+// skipped and the ones gone are sent with a -1 mask
+static void sendsnapshot(int n) {
+  auto &c = cur->clients[n];
+  const snapshot *base = NULL;
+  if (c.lastack>=0 && c.snapid-c.lastack<SNAPSHOTNUM &&
+      c.sent[c.lastack%SNAPSHOTNUM].id==c.lastack)
+    base = &c.sent[c.lastack%SNAPSHOTNUM];
+  auto &snap = c.sent[c.snapid%SNAPSHOTNUM];
+  snap.id = c.snapid;
+  snap.entries.setsize(0);
+  loopv(cur->clients) if (i!=n && cur->clients[i].type!=ST_EMPTY && cur->clients[i].haspos) {
+    auto &e = snap.entries.add();
+    e.cn = i;
+    // far cur->clients keep the state the client knows except on their own ticks
+    const snapentry *known;
+    if (base && (c.snapid+i)%FARSNAPSHOTS && !interesting(c, cur->clients[i]) &&
+        (known = findentry(*base, i)) != NULL)
+      memcpy(e.pos, known->pos, sizeof(e.pos));
+    else
+      memcpy(e.pos, cur->clients[i].pos, sizeof(e.pos));
+  }
+  const int basenum = base ? base->entries.length() : 0;
+  const int maxsize = 16+(snap.entries.length()+basenum)*(4+POSNUM*8);
+  auto packet = enet_packet_create(NULL, maxsize, 0);
+  u8 *start = packet->data;
+  u8 *p = start+2;
+  putint(p, SV_SNAPSHOT);
+  putint(p, snap.id);
+  putint(p, base ? base->id : -1);
+  // the entries are a bit stream after its size in two bytes
+  u8 *size = p;
+  bitwriter w(p+2);
+  const int zero[POSNUM] = {0};
+  int changed = 0, i = 0, j = 0;
+  while (i<snap.entries.length() || j<basenum) {
+    const snapentry *e = i<snap.entries.length() ? &snap.entries[i] : NULL;
+    const snapentry *b = j<basenum ? &base->entries[j] : NULL;
+    if (b && (!e || b->cn<e->cn)) {
+      w.put(1, 1);
+      w.put(b->cn, CNBITS);
+      putposremoved(w);
+      ++changed, ++j;
+    } else if (b && b->cn==e->cn) {
+      if (memcmp(b->pos, e->pos, sizeof(e->pos))) {
+        w.put(1, 1);
+        w.put(e->cn, CNBITS);
+        putposdelta(w, b->pos, e->pos);
+        ++changed;
+      }
+      ++i, ++j;
+    } else {
+      w.put(1, 1);
+      w.put(e->cn, CNBITS);
+      putposdelta(w, zero, e->pos);
+      ++changed, ++i;
+    }
+  }
+  w.put(0, 1);
+  p = w.flush();
+  size[0] = u8(p-size-2);
+  size[1] = u8((p-size-2)>>8);
+  // nothing new since the last snapshot which is also acknowledged
+  if (changed==0 && (base==NULL || base->id==c.snapid-1)) {
+    enet_packet_destroy(packet);
+    return;
+  }
+  *(u16 *)start = ENET_HOST_TO_NET_16(p-start);
+  enet_packet_resize(packet, p-start);
+  ++c.snapid;
+  send(n, packet);
+  if (packet->referenceCount==0) enet_packet_destroy(packet);
 }
 
 void send_welcome(int n) {
@@ -237,15 +556,15 @@ void send_welcome(int n) {
   putint(p, SV_INITS2C);
   putint(p, n);
   putint(p, PROTOCOL_VERSION);
-  putint(p, smapname[0]);
+  putint(p, cur->smapname[0]);
   sendstring(serverpassword, p);
-  putint(p, clients.length()>maxclients);
-  if (smapname[0]) {
+  putint(p, cur->clients.length()>cur->maxclients);
+  if (cur->smapname[0]) {
     putint(p, SV_MAPCHANGE);
-    sendstring(smapname.c_str(), p);
-    putint(p, mode);
+    sendstring(cur->smapname.c_str(), p);
+    putint(p, cur->mode);
     putint(p, SV_ITEMLIST);
-    loopv(sents) if (sents[i].spawned) putint(p, i);
+    loopv(cur->sents) if (cur->sents[i].spawned) putint(p, i);
     putint(p, -1);
   }
   *(u16 *)start = ENET_HOST_TO_NET_16(p-start);
@@ -254,7 +573,7 @@ void send_welcome(int n) {
 }
 
 void multicast(ENetPacket *packet, int sender) {
-  loopv(clients) {
+  loopv(cur->clients) {
     if (i==sender) continue;
     send(i, packet);
   }
@@ -265,155 +584,432 @@ void localclienttoserver(ENetPacket *packet) {
   if (!packet->referenceCount) enet_packet_destroy (packet);
 }
 
+static drawarray &resetclient(drawarray &c) {
+  c.haspos = false;
+  c.snapid = 0;
+  c.lastack = -1;
+  c.ping = 0;
+  c.mapchunk = -1;
+  c.bsend = c.brec = 0;
+  loopi(HISTORYNUM) c.history[i].millis = cur->lastsim-2*MAXREWIND; // unused
+  loopi(SNAPSHOTNUM) {
+    c.sent[i].id = -1;
+    c.sent[i].entries.setsize(0);
+  }
+  return c;
+}
+
+// stream the map chunks requested with SV_RECVMAP. only a few reliable
+// packets are queued per client at a time so that a download does not delay
+// the game traffic of the client
+static void sendmapchunks(void) {
+  loopv(cur->clients) {
+    auto &c = cur->clients[i];
+    if (c.type==ST_EMPTY || c.mapchunk<0) continue;
+    while (c.mapchunk<mapchunknum()) {
+      if (c.type==ST_TCPIP &&
+          enet_list_size(&c.peer->outgoingReliableCommands)>=size_t(MAPWINDOW))
+        break;
+      auto packet = mapchunk(c.mapchunk++);
+      if (c.type==ST_TCPIP) {
+        enet_peer_send(c.peer, MAPCHANNEL, packet);
+        cur->bsend += packet->dataLength;
+        cur->stats.sent += packet->dataLength;
+        c.bsend += packet->dataLength;
+      } else
+        send(i, packet);
+      if (packet->referenceCount==0) enet_packet_destroy(packet);
+    }
+    if (c.mapchunk>=mapchunknum()) c.mapchunk = -1;
+  }
+}
+
+// one fixed simulation tick: record the box of every client
+static void simulate(void) {
+  const auto slot = cur->simtick++ % HISTORYNUM;
+  loopv(cur->clients) {
+    auto &c = cur->clients[i];
+    if (c.type==ST_EMPTY || !c.haspos) continue;
+    const vec3f o(float(c.pos[0])/DMF, float(c.pos[1])/DMF, float(c.pos[2])/DMF);
+    c.history[slot].millis = cur->lastsim;
+    c.history[slot].box = aabb(o-vec3f(HITEXTENT), o+vec3f(HITEXTENT));
+  }
+}
+
 drawarray &addclient(void) {
-  loopv(clients) if (clients[i].type==ST_EMPTY) return clients[i];
-  return clients.add();
+  loopv(cur->clients) if (cur->clients[i].type==ST_EMPTY) return resetclient(cur->clients[i]);
+  return resetclient(cur->clients.add());
 }
 
 void checkintermission(void) {
-  if (!minremain) {
-    interm = lastsec+10;
-    mapend = lastsec+1000;
+  if (!cur->minremain) {
+    cur->timers.schedule(TIMER_INTERMISSION, u32(cur->lastsec+11));
+    cur->mapend = cur->lastsec+1000;
   }
-  send2(true, -1, SV_TIMEUP, minremain--);
+  send2(true, -1, SV_TIMEUP, cur->minremain--);
+  scheduletimeup();
 }
 
-void startintermission() { minremain = 0; checkintermission(); };
+void startintermission() { cur->minremain = 0; checkintermission(); };
 
 void resetserverifempty(void) {
-  loopv(clients) if (clients[i].type!=ST_EMPTY) return;
-  clients.setsize(0);
-  smapname[0] = 0;
+  loopv(cur->clients) if (cur->clients[i].type!=ST_EMPTY) return;
+  cur->clients.setsize(0);
+  cur->smapname[0] = 0;
   resetvotes();
   resetitems();
-  mode = 0;
-  mapreload = false;
-  minremain = 10;
-  mapend = lastsec+minremain*60;
-  interm = 0;
+  cur->mode = 0;
+  cur->mapreload = false;
+  cur->minremain = 10;
+  cur->mapend = cur->lastsec+cur->minremain*60;
+  cur->timers.cancel(TIMER_INTERMISSION);
+  scheduletimeup();
+}
+
+static void publishstatus(int numplayers) {
+  while (atomic_cmpxchg(&cur->statuslock, 1, 0)!=0);
+  cur->status.mode = cur->mode;
+  cur->status.numplayers = numplayers;
+  cur->status.minremain = cur->minremain;
+  cur->status.full = cur->clients.length()>=cur->maxclients;
+  strcpy_s(cur->status.smapname, cur->smapname.c_str());
+  storerelease(&cur->statuslock, 0);
+}
+
+// server info and master server for all the matches. the busiest match
+// gives the map and mode and the player number is the total
+static void front(int seconds) {
+  matchstatus best;
+  int numplayers = 0;
+  bool full = true;
+  best.numplayers = -1;
+  loopv(matches) {
+    auto m = matches[i];
+    while (atomic_cmpxchg(&m->statuslock, 1, 0)!=0);
+    if (m->status.numplayers>best.numplayers) best = m->status;
+    numplayers += m->status.numplayers;
+    full = full && m->status.full;
+    storerelease(&m->statuslock, 0);
+  }
+  serverms(best.mode, numplayers, best.minremain, best.smapname.c_str(), seconds, full);
+}
+
+/*-------------------------------------------------------------------------
+ - capture of the packets received by the first match. replay runs them
+ - through process with clients without transport, as fast as possible.
+ - records are the receive time in milliseconds, the sender and the length
+ - in host byte order, then the data
+ -------------------------------------------------------------------------*/
+static const u32 CAPTUREMAGIC = 0x5043514d; // "MQCP"
+static FILE *capturefile = NULL;
+
+bool capture(const char *filename) {
+  capturefile = fopen(filename, "wb");
+  if (capturefile == NULL) {
+    printf("could not open capture %s\n", filename);
+    return false;
+  }
+  fwrite(&CAPTUREMAGIC, sizeof(u32), 1, capturefile);
+  return true;
 }
 
-int nonlocalclients = 0;
-int lastconnect = 0;
+static void capturepacket(const ENetPacket *packet, int sender) {
+  if (capturefile == NULL || cur != &localmatch) return;
+  const u32 header[3] = {enet_time_get(), u32(sender), u32(packet->dataLength)};
+  fwrite(header, sizeof(header), 1, capturefile);
+  fwrite(packet->data, packet->dataLength, 1, capturefile);
+}
+
+bool replay(const char *filename, int loops) {
+  int size = 0;
+  const auto data = (u8*) sys::loadfile(filename, &size);
+  if (data == NULL || size < 4 || *(u32*)data != CAPTUREMAGIC) {
+    printf("replay: %s is not a capture\n", filename);
+    if (data) FREE(data);
+    return false;
+  }
+  int packetnum = 0, maxsender = -1, end = 4;
+  while (end+12 <= size) {
+    const auto header = (const u32*) (data+end);
+    if (end+12+int(header[2]) > size) break;
+    maxsender = max(maxsender, int(header[1]));
+    end += 12+int(header[2]);
+    ++packetnum;
+  }
+  cur = &localmatch;
+  loopi(maxsender+1) {
+    auto &c = addclient();
+    c.type = ST_NULL;
+    c.peer = NULL;
+    strcpy_s(c.hostname, "replay");
+  }
+  ZERO(&msgnanos);
+  ZERO(&msgnum);
+  replaying = true;
+  const auto start = sys::nanos();
+  loopj(max(loops, 1)) {
+    loopv(cur->clients) cur->clients[i].type = ST_NULL;
+    for (int at = 4; at < end;) {
+      const auto header = (const u32*) (data+at);
+      const auto packet = enet_packet_create(data+at+12, header[2], 0);
+      process(packet, int(header[1]));
+      if (packet->referenceCount==0) enet_packet_destroy(packet);
+      at += 12+int(header[2]);
+    }
+  }
+  const auto elapsed = max(sys::nanos()-start, u64(1));
+  replaying = false;
+  FREE(data);
+
+  u64 total = 0, decode = 0;
+  loopi(SV_NUM) total += msgnum[i], decode += msgnanos[i];
+  const auto packets = double(packetnum)*double(max(loops, 1));
+  printf("replay: %.0f packets, %.0f messages in %.1f ms\n", packets,
+         double(total), double(elapsed)*1e-6);
+  printf("replay: %.0f messages/s, %.0f ns per packet, %.0f ns of fan-out per packet\n",
+         double(total)*1e9/double(elapsed), double(elapsed)/max(packets, 1.0),
+         double(elapsed-min(decode, elapsed))/max(packets, 1.0));
+  loopi(SV_NUM) if (msgnum[i])
+    printf("replay: message %2d %10.0f decoded %8.1f ns each\n", i,
+           double(msgnum[i]), double(msgnanos[i])/double(msgnum[i]));
+  return true;
+}
 
 // main server update, called from cube main loop in sp, or dedicated server loop
-void slice(int seconds, unsigned int timeout) {
-  loopv(sents) { // spawn entities when timer reached
-    if (sents[i].spawnsecs && (sents[i].spawnsecs -= seconds-lastsec)<=0) {
-      sents[i].spawnsecs = 0;
-      sents[i].spawned = true;
-      send2(true, -1, SV_ITEMSPAWN, i);
+static void handleevent(ENetEvent &event, int &numplayers) {
+  switch (event.type) {
+    case ENET_EVENT_TYPE_CONNECT: {
+      drawarray &c = addclient();
+      c.type = ST_TCPIP;
+      c.peer = event.peer;
+      c.peer->data = (void *)(&c-&cur->clients[0]);
+      char hn[1024];
+      const auto host = enet_address_get_host(&c.peer->address,hn,sizeof(hn))==0;
+      strcpy_s(c.hostname, host ? hn : "localhost");
+      printf("client connected (%s)\n", c.hostname.c_str());
+      send_welcome(cur->lastconnect = &c-&cur->clients[0]);
+      if (++numplayers>cur->maxclients) {
+        disconnect_client(cur->lastconnect, "maxclients reached");
+        --numplayers;
+      }
+      break;
     }
+    case ENET_EVENT_TYPE_RECEIVE:
+      cur->brec += event.packet->dataLength;
+      cur->stats.recv += event.packet->dataLength;
+      if (intptr(event.peer->data)>=0)
+        cur->clients[intptr(event.peer->data)].brec += event.packet->dataLength;
+      capturepacket(event.packet, (intptr_t)event.peer->data);
+      process(event.packet, (intptr_t)event.peer->data); 
+      if (event.packet->referenceCount==0) enet_packet_destroy(event.packet);
+    break;
+    case ENET_EVENT_TYPE_DISCONNECT: 
+      if (intptr(event.peer->data)<0) break;
+      printf("client::disconnected client (%s)\n",
+        cur->clients[uintptr(event.peer->data)].hostname.c_str());
+      if (cur->clients[uintptr(event.peer->data)].type!=ST_EMPTY) --numplayers;
+      cur->clients[uintptr(event.peer->data)].type = ST_EMPTY;
+      send2(true, -1, SV_CDIS, intptr(event.peer->data));
+      event.peer->data = (void *)-1;
+    break;
+    default: break;
   }
+}
 
-  lastsec = seconds;
+static void recordtick(u64 nanos) {
+  const auto us = u32(min(nanos/1000, u64(0xffffffffu)));
+  const auto bucket = us == 0 ? 0u : min(u32(__bsr(size_t(us)))+1, u32(TICKBUCKETNUM-1));
+  ++cur->stats.ticks[bucket];
+  cur->stats.maxtick = max(cur->stats.maxtick, us);
+}
 
-  if ((mode>1 || (mode==0 && nonlocalclients)) && seconds>mapend-minremain*60)
-    checkintermission();
-  if (interm && seconds>interm) {
-    interm = 0;
-    loopv(clients) if (clients[i].type!=ST_EMPTY) {
-      send2(true, i, SV_MAPRELOAD, 0);    // ask a client to trigger map reload
-      mapreload = true;
-      break;
+static void exportmetrics(void) {
+  auto &s = cur->stats;
+  const auto now = enet_time_get();
+  if (!statsdon() || now-s.lastexport<u32(METRICSMILLIS)) return;
+  s.lastexport = now;
+  const auto m = cur->id;
+  int clientnum = 0;
+  loopi(TICKBUCKETNUM-1) if (s.ticks[i])
+    statsd("miniq.match%d.tick.lt%uus:%u|c", m, 1u<<i, s.ticks[i]);
+  if (s.ticks[TICKBUCKETNUM-1])
+    statsd("miniq.match%d.tick.inf:%u|c", m, s.ticks[TICKBUCKETNUM-1]);
+  statsd("miniq.match%d.tick.max_us:%u|g", m, s.maxtick);
+  statsd("miniq.match%d.sent_bytes:%u|c", m, s.sent);
+  statsd("miniq.match%d.recv_bytes:%u|c", m, s.recv);
+  loopi(SV_NUM) if (s.msgbytes[i])
+    statsd("miniq.match%d.msg.%d.recv_bytes:%u|c", m, i, s.msgbytes[i]);
+  loopv(cur->clients) {
+    auto &c = cur->clients[i];
+    if (c.type!=ST_TCPIP) continue;
+    const auto peer = c.peer;
+    ++clientnum;
+    statsd("miniq.match%d.client.%d.rtt_ms:%u|g", m, i, peer->roundTripTime);
+    statsd("miniq.match%d.client.%d.ping_ms:%d|g", m, i, c.ping);
+    statsd("miniq.match%d.client.%d.loss:%.4f|g", m, i,
+           double(peer->packetLoss)/double(ENET_PEER_PACKET_LOSS_SCALE));
+    statsd("miniq.match%d.client.%d.throttle:%.4f|g", m, i,
+           double(peer->packetThrottle)/double(ENET_PEER_PACKET_THROTTLE_SCALE));
+    statsd("miniq.match%d.client.%d.sent_bytes:%d|c", m, i, c.bsend);
+    statsd("miniq.match%d.client.%d.recv_bytes:%d|c", m, i, c.brec);
+    c.bsend = c.brec = 0;
+  }
+  statsd("miniq.match%d.clients:%d|g", m, clientnum);
+  statsdflush();
+  memset(s.ticks, 0, sizeof(s.ticks));
+  memset(s.msgbytes, 0, sizeof(s.msgbytes));
+  s.maxtick = s.sent = s.recv = 0;
+}
+
+// run a due timer of the match. the time is only counted down in the modes
+// with a time limit so the time up is checked again the next second
+static void expire(int key) {
+  switch (key) {
+    case TIMER_TIMEUP:
+      if (cur->mode>1 || (cur->mode==0 && cur->nonlocalclients))
+        checkintermission();
+      else
+        cur->timers.schedule(TIMER_TIMEUP, u32(cur->lastsec+1));
+    break;
+    case TIMER_INTERMISSION:
+      loopv(cur->clients) if (cur->clients[i].type!=ST_EMPTY) {
+        send2(true, i, SV_MAPRELOAD, 0);    // ask a client to trigger map reload
+        cur->mapreload = true;
+        break;
+      }
+    break;
+    default: {
+      const auto i = key-TIMER_ITEM;
+      if (i>=cur->sents.length()) break;
+      cur->sents[i].spawned = true;
+      send2(true, -1, SV_ITEMSPAWN, i);
     }
+    break;
+  }
+}
+
+void slice(int seconds, unsigned int timeout) {
+  MEMORY_TAG(MEM_NET);
+  const auto tickbegin = sys::nanos();
+  cur->lastsec = seconds;
+  cur->timers.advance(u32(seconds), cur->due);
+  loopv(cur->due) expire(cur->due[i]);
+  cur->due.setsize(0);
+
+  const auto now = enet_time_get();
+  if (now-cur->lastsim>u32(MAXREWIND)) cur->lastsim = now-SIMMILLIS; // way behind
+  while (now-cur->lastsim>=u32(SIMMILLIS)) {
+    cur->lastsim += SIMMILLIS;
+    simulate();
+  }
+  if (now-cur->lastsnapshot>=u32(SNAPSHOTMILLIS)) {
+    cur->lastsnapshot = now;
+    loopv(cur->clients) if (cur->clients[i].type!=ST_EMPTY) sendsnapshot(i);
   }
 
   resetserverifempty();
+  sendmapchunks();
 
   if (!isdedicated) return;     // below is network only
 
   int numplayers = 0;
-  loopv(clients) if (clients[i].type!=ST_EMPTY) ++numplayers;
-  serverms(mode, numplayers, minremain, smapname.c_str(),
-           seconds, clients.length()>=maxclients);
-
-  if (seconds-laststatus>60) { // display bandwidth stats, useful for server ops
-    nonlocalclients = 0;
-    loopv(clients) if (clients[i].type==ST_TCPIP) nonlocalclients++;
-    laststatus = seconds;
-    if (nonlocalclients || bsend || brec)
+  loopv(cur->clients) if (cur->clients[i].type!=ST_EMPTY) ++numplayers;
+  publishstatus(numplayers);
+  if (matches.length()==1) front(seconds);
+
+  if (seconds-cur->laststatus>60) { // display bandwidth stats, useful for server ops
+    cur->nonlocalclients = 0;
+    loopv(cur->clients) if (cur->clients[i].type==ST_TCPIP) cur->nonlocalclients++;
+    cur->laststatus = seconds;
+    if (cur->nonlocalclients || cur->bsend || cur->brec)
       printf("status: %d remote clients, %.1f send, %.1f rec (K/sec)\n",
-        nonlocalclients, bsend/60.0f/1024, brec/60.0f/1024);
-    bsend = brec = 0;
+        cur->nonlocalclients, cur->bsend/60.0f/1024, cur->brec/60.0f/1024);
+    cur->bsend = cur->brec = 0;
   }
 
+  // wait for the first event and then drain everything already received
+  // before replies go out together in one flush. the wait is not in the tick
   ENetEvent event;
-  if (enet_host_service(serverhost, &event, timeout) > 0) {
-    switch (event.type) {
-      case ENET_EVENT_TYPE_CONNECT: {
-        drawarray &c = addclient();
-        c.type = ST_TCPIP;
-        c.peer = event.peer;
-        c.peer->data = (void *)(&c-&clients[0]);
-        char hn[1024];
-        const auto host = enet_address_get_host(&c.peer->address,hn,sizeof(hn))==0;
-        strcpy_s(c.hostname, host ? hn : "localhost");
-        printf("client connected (%s)\n", c.hostname.c_str());
-        send_welcome(lastconnect = &c-&clients[0]);
-        break;
-      }
-      case ENET_EVENT_TYPE_RECEIVE:
-        brec += event.packet->dataLength;
-        process(event.packet, (intptr_t)event.peer->data); 
-        if (event.packet->referenceCount==0) enet_packet_destroy(event.packet);
-      break;
-      case ENET_EVENT_TYPE_DISCONNECT: 
-        if (intptr(event.peer->data)<0) break;
-        printf("client::disconnected client (%s)\n",
-          clients[uintptr(event.peer->data)].hostname.c_str());
-        clients[uintptr(event.peer->data)].type = ST_EMPTY;
-        send2(true, -1, SV_CDIS, intptr(event.peer->data));
-        event.peer->data = (void *)-1;
-      break;
-      default: break;
-    }
-    if (numplayers>maxclients)
-      disconnect_client(lastconnect, "maxclients reached");
-  }
+  auto tick = sys::nanos()-tickbegin;
+  auto ret = enet_host_service(cur->serverhost, &event, timeout);
+  const auto drainbegin = sys::nanos();
+  for (; ret > 0; ret = enet_host_check_events(cur->serverhost, &event))
+    handleevent(event, numplayers);
+  enet_host_flush(cur->serverhost);
+  tick += sys::nanos()-drainbegin;
+  recordtick(tick);
+  exportmetrics();
+  if (capturefile) fflush(capturefile);
 #if !defined(__WIN32__)
   fflush(stdout);
 #endif
 }
 
-void clean(void) { if (serverhost) enet_host_destroy(serverhost); }
+void clean(void) {
+  loopv(matches) if (matches[i]->serverhost) enet_host_destroy(matches[i]->serverhost);
+}
+
+static int matchthread(void *data) {
+  cur = (match*) data;
+  for (;;) slice(int(time(NULL)), 5);
+  return 0;
+}
 
 void localdisconnect(void) {
-  loopv(clients) if (clients[i].type==ST_LOCAL) clients[i].type = ST_EMPTY;
+  loopv(cur->clients) if (cur->clients[i].type==ST_LOCAL) cur->clients[i].type = ST_EMPTY;
 }
 
 void localconnect(void) {
   drawarray &c = addclient();
   c.type = ST_LOCAL;
   strcpy_s(c.hostname, "local");
-  send_welcome(&c-&clients[0]); 
+  send_welcome(&c-&cur->clients[0]); 
 }
 
-void init(bool dedicated, int uprate, const char *sdesc, const char *ip, const char *master, const char *passwd, int maxcl) {
+void init(bool dedicated, int uprate, const char *sdesc, const char *ip, const char *master, const char *passwd, int maxcl, int matchnum, const char *stats) {
   serverpassword = passwd;
-  maxclients = maxcl;
   servermsinit(master ? master : "wouter.fov120.com/cube/masterserver/", sdesc, dedicated);
 
-  if ((isdedicated = dedicated) != 0) {
-    ENetAddress address = { ENET_HOST_ANY, CUBE_SERVER_PORT };
+  if ((isdedicated = dedicated) == 0) {
+    cur->maxclients = maxcl;
+    resetserverifempty();
+    return;
+  }
+
+  if (stats && *stats) statsdinit(stats);
+
+  // match i listens on CUBE_SERVER_PORT+2*i, the server info port stays free
+  loopi(max(matchnum,1)) {
+    auto m = i==0 ? &localmatch : NEWE(match);
+    m->id = i;
+    m->maxclients = maxcl;
+    ENetAddress address = { ENET_HOST_ANY, enet_uint16(CUBE_SERVER_PORT+2*i) };
     if (*ip && enet_address_set_host(&address, ip)<0)
       printf("WARNING: server ip not resolved");
-    serverhost = enet_host_create(&address, MAXCLIENTS, 0, uprate);
-    if (!serverhost)
+    m->serverhost = enet_host_create(&address, MAXCLIENTS, 0, uprate);
+    if (!m->serverhost)
       sys::fatal("could not create server host\n");
-    loopi(MAXCLIENTS) serverhost->peers[i].data = (void *)-1;
+    loopj(MAXCLIENTS) m->serverhost->peers[j].data = (void *)-1;
+    cur = m;
+    resetserverifempty();
+    matches.add(m);
   }
+  cur = &localmatch;
 
-  resetserverifempty();
-
-  if (isdedicated) { // do not return, this becomes main loop
+  // do not return, this becomes main loop
 #if defined(__WIN32__)
-    SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS);
+  SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS);
 #endif
-    printf("dedicated server started, waiting for clients...\nCtrl-C to exit\n\n");
-    atexit(clean);
-    atexit(enet_deinitialize);
+  printf("dedicated server started with %d matches, waiting for clients...\nCtrl-C to exit\n\n",
+         matches.length());
+  atexit(clean);
+  atexit(enet_deinitialize);
+  if (matches.length()==1)
     for (;;) slice(/*enet_time_get_sec()*/int(time(NULL)), 5);
+  loopv(matches) SDL_CreateThread(matchthread, "match", matches[i]);
+  for (;;) {
+    front(int(time(NULL)));
+    SDL_Delay(5);
   }
 }
 } /* namespace server */
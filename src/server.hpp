@@ -10,19 +10,33 @@ typedef struct _ENetPacket ENetPacket;
 namespace q {
 namespace server {
 
-void init(bool dedicated, int uprate, const char *sdesc, const char *ip, const char *master, const char *passwd, int maxcl);
+// a dedicated server runs matchnum matches, each one on its own thread
+// stats, if any, is the statsd host[:port] the metrics go to
+void init(bool dedicated, int uprate, const char *sdesc, const char *ip, const char *master, const char *passwd, int maxcl, int matchnum = 1, const char *stats = NULL);
 void clean(void);
 void localconnect(void);
 void localdisconnect(void);
 void localclienttoserver(struct _ENetPacket *);
 void slice(int seconds, unsigned int timeout);
+// record what the first match receives. replay runs a capture loops times
+// through the message processing with a null transport and prints timings
+bool capture(const char *filename);
+bool replay(const char *filename, int loops = 1);
 void startintermission(void);
 void restoreserverstate(vector<game::entity> &ents);
 u8 *retrieveservers(u8 *buf, int buflen);
 void serverms(int mode, int numplayers, int minremain, char *smapname, int seconds, bool isfull);
 void servermsinit(const char *master, const char *sdesc, bool listen);
+// statsd export, target is host[:port]. lines are "name:value|type"
+void statsdinit(const char *target);
+bool statsdon(void);
+void statsd(const char *fmt, ...);
+void statsdflush(void);
 void sendmaps(int n, const char *mapname, int mapsize, u8 *mapdata);
-ENetPacket *recvmap(int n);
+// the last map sent with SV_SENDMAP, split in chunks for SV_MAPCHUNK
+u32 maphash(void);
+int mapchunknum(void);
+ENetPacket *mapchunk(int chunk);
 
 } /* namespace server */
 } /* namespace q */
@@ -5,22 +5,23 @@
 #include "mini.q.hpp"
 #include "enet/enet.h"
 #include "base/vector.hpp"
+#include "base/flat_map.hpp"
 #include <SDL2/SDL_thread.h>
 
 namespace q {
 namespace browser {
 
+// the resolver threads work on a copy of the name: the server list may grow
+// and move while they resolve. queries and results carry the server index
 struct resolverthread {
   SDL_Thread *thread;
-  char *query;
-  int starttime;
+  fixedstring query;
+  int server, starttime;
   volatile bool alive;
 };
 
-struct resolverresult {
-  char *query;
-  ENetAddress address;
-};
+struct resolverquery { fixedstring name; int server; };
+struct resolverresult { int server; ENetAddress address; };
 
 struct serverinfo {
   fixedstring name;
@@ -32,7 +33,7 @@ struct serverinfo {
 };
 
 static vector<resolverthread> resolverthreads;
-static vector<char*> resolverqueries;
+static vector<resolverquery> resolverqueries;
 static vector<resolverresult> resolverresults;
 static SDL_mutex *resolvermutex = NULL;
 static SDL_sem *resolversem = NULL;
@@ -47,16 +48,19 @@ static int resolverloop(void * data) {
       SDL_UnlockMutex(resolvermutex);
       continue;
     }
-    rt->query = resolverqueries.pop();
+    const auto &q = resolverqueries.last();
+    rt->query = q.name;
+    rt->server = q.server;
+    resolverqueries.setsize(resolverqueries.length()-1);
     rt->starttime = int(game::lastmillis());
     SDL_UnlockMutex(resolvermutex);
     ENetAddress address = {ENET_HOST_ANY, CUBE_SERVINFO_PORT};
-    enet_address_set_host(&address, rt->query);
+    enet_address_set_host(&address, rt->query.c_str());
     SDL_LockMutex(resolvermutex);
     resolverresult &rr = resolverresults.add();
-    rr.query = rt->query;
+    rr.server = rt->server;
     rr.address = address;
-    rt->query = NULL;
+    rt->server = -1;
     rt->starttime = 0;
     SDL_UnlockMutex(resolvermutex);
   }
@@ -70,7 +74,7 @@ static void resolverinit(int threads, int limit) {
 
   while (threads > 0) {
     resolverthread &rt = resolverthreads.add();
-    rt.query = NULL;
+    rt.server = -1;
     rt.alive = true;
     rt.starttime = 0;
     rt.thread = SDL_CreateThread(resolverloop, "browser thread", &rt);
@@ -83,10 +87,13 @@ static void resolverstop(resolverthread &rt, bool restart) {
   int status = 0;
   rt.alive = false;
   SDL_WaitThread(rt.thread, &status);
-  rt.query = NULL;
+  rt.server = -1;
   rt.starttime = 0;
   rt.thread = NULL;
-  if (restart) rt.thread = SDL_CreateThread(resolverloop, "browser thread", &rt);
+  if (restart) {
+    rt.alive = true;
+    rt.thread = SDL_CreateThread(resolverloop, "browser thread", &rt);
+  }
   SDL_UnlockMutex(resolvermutex);
 }
 
@@ -102,48 +109,60 @@ static void resolverclear(void) {
   SDL_UnlockMutex(resolvermutex);
 }
 
-static void resolverquery(char *name) {
+static void resolverask(const char *name, int server) {
   SDL_LockMutex(resolvermutex);
-  resolverqueries.add(name);
+  auto &q = resolverqueries.add();
+  q.name = name;
+  q.server = server;
   SDL_SemPost(resolversem);
   SDL_UnlockMutex(resolvermutex);
 }
 
-static bool resolvercheck(char **name, ENetAddress *address) {
+static bool resolvercheck(int *server, ENetAddress *address) {
   SDL_LockMutex(resolvermutex);
   if (!resolverresults.empty()) {
-    resolverresult &rr = resolverresults.pop();
-    *name = rr.query;
+    const auto &rr = resolverresults.last();
+    *server = rr.server;
     *address = rr.address;
+    resolverresults.setsize(resolverresults.length()-1);
     SDL_UnlockMutex(resolvermutex);
     return true;
   }
   loopv(resolverthreads) {
     resolverthread &rt = resolverthreads[i];
-      if (rt.query) {
-        if (game::lastmillis() - rt.starttime > resolverlimit) {
-          resolverstop(rt, true);
-          *name = rt.query;
-          SDL_UnlockMutex(resolvermutex);
-          return true;
-        }
-      }
+    if (rt.server>=0 && game::lastmillis() - rt.starttime > resolverlimit) {
+      *server = rt.server;
+      address->host = ENET_HOST_ANY;
+      resolverstop(rt, true);
+      SDL_UnlockMutex(resolvermutex);
+      return true;
+    }
   }
   SDL_UnlockMutex(resolvermutex);
-    return false;
+  return false;
 }
 
+// servers never move in the list so that the address lookup can point to
+// them. the menu shows the MAXMENU best ones, recomputed when pings change
+static const int MAXMENU = 16;
 static vector<serverinfo> servers;
+static flat_map<u64,int> serverlookup;
+static int shown[MAXMENU], shownnum = 0;
+static bool showndirty = true;
 static ENetSocket pingsock = ENET_SOCKET_NULL;
 static int lastinfo = 0;
 
-const char *getservername(int n) { return servers[n].name.c_str(); }
+static INLINE u64 addresskey(const ENetAddress &a) {
+  return (u64(a.host)<<16) | u64(a.port);
+}
+
+const char *getservername(int n) {
+  return n < shownnum ? servers[shown[n]].name.c_str() : "";
+}
 
 void addserver(const char *servername) {
   loopv(servers) if (strcmp(servers[i].name.c_str(), servername)==0) return;
-  // serverinfo &si = servers.insert(0, serverinfo());
-  servers.insert(0, serverinfo());
-  serverinfo &si = *servers.begin();
+  serverinfo &si = servers.add();
   strcpy_s(si.name, servername);
   si.full[0] = 0;
   si.mode = 0;
@@ -155,83 +174,151 @@ void addserver(const char *servername) {
   si.sdesc[0] = 0;
   si.address.host = ENET_HOST_ANY;
   si.address.port = CUBE_SERVINFO_PORT;
+  showndirty = true;
 }
 CMD(addserver);
 
-static void pingservers(void) {
-  ENetBuffer buf;
-  u8 ping[MAXTRANS];
-  u8 *p;
-  loopv(servers) {
-    serverinfo &si = servers[i];
-    if (si.address.host == ENET_HOST_ANY) continue;
-    p = ping;
-    putint(p, int(game::lastmillis()));
-    buf.data = ping;
-    buf.dataLength = p - ping;
-    enet_socket_send(pingsock, &si.address, &buf, 1);
+// one round of the browser network work off the main thread: ping all the
+// resolved servers when due and drain the replies. the task only touches
+// its own copies and the main thread merges the replies once it is done
+struct pingreply {
+  ENetAddress address;
+  int stamp, protocol, mode, numplayers, minremain;
+  fixedstring map, sdesc;
+};
+
+struct pingtask : public task {
+  INLINE pingtask(int now, bool sendpings) :
+    task("pingtask", 1, 1), now(now), sendpings(sendpings), done(0) {}
+  virtual void run(u32) {
+    if (sendpings) send();
+    receive();
+    storerelease(&done, 1);
+  }
+  void send(void) {
+    u8 ping[8], *p = ping;
+    putint(p, now);
+    ENetBuffer bufs[ENET_HOST_DATAGRAM_BATCH];
+    loopi(ENET_HOST_DATAGRAM_BATCH) {
+      bufs[i].data = ping;
+      bufs[i].dataLength = p-ping;
+    }
+    for (int i = 0; i < addresses.length(); i += ENET_HOST_DATAGRAM_BATCH) {
+      const auto n = min(addresses.length()-i, int(ENET_HOST_DATAGRAM_BATCH));
+      enet_socket_send_batch(pingsock, &addresses[i], bufs, n);
+    }
+  }
+  void receive(void) {
+    enet_uint32 events = ENET_SOCKET_WAIT_RECEIVE;
+    ENetAddress addrs[ENET_HOST_DATAGRAM_BATCH];
+    ENetBuffer bufs[ENET_HOST_DATAGRAM_BATCH];
+    char text[MAXTRANS];
+    while (enet_socket_wait(pingsock, &events, 0) >= 0 && events) {
+      loopi(ENET_HOST_DATAGRAM_BATCH) {
+        bufs[i].data = data[i];
+        bufs[i].dataLength = sizeof(data[i])-1;
+      }
+      const auto n = enet_socket_receive_batch(pingsock, addrs, bufs, ENET_HOST_DATAGRAM_BATCH);
+      if (n <= 0) return;
+      loopi(n) {
+        u8 *p = data[i];
+        p[bufs[i].dataLength] = 0; // unterminated strings stop here
+        auto &r = replies.add();
+        r.address = addrs[i];
+        r.stamp = getint(p);
+        r.protocol = getint(p);
+        r.mode = getint(p);
+        r.numplayers = getint(p);
+        r.minremain = getint(p);
+        sgetstr();
+        strcpy_s(r.map, text);
+        sgetstr();
+        strcpy_s(r.sdesc, text);
+      }
+    }
+  }
+  vector<ENetAddress> addresses;
+  vector<pingreply> replies;
+  u8 data[ENET_HOST_DATAGRAM_BATCH][MAXTRANS];
+  int now;
+  bool sendpings;
+  volatile s32 done;
+};
+static ref<pingtask> pingjob;
+
+static void mergepings(const pingtask &job) {
+  loopv(job.replies) {
+    const auto &r = job.replies[i];
+    const auto it = serverlookup.find(addresskey(r.address));
+    if (it == serverlookup.end()) continue;
+    serverinfo &si = servers[it->second];
+    si.ping = int(game::lastmillis()) - r.stamp;
+    si.protocol = r.protocol;
+    if (si.protocol!=PROTOCOL_VERSION) si.ping = 9998;
+    si.mode = r.mode;
+    si.numplayers = r.numplayers;
+    si.minremain = r.minremain;
+    si.map = r.map;
+    si.sdesc = r.sdesc;
+    showndirty = true;
   }
-  lastinfo = int(game::lastmillis());
+}
+
+static void schedulepings(void) {
+  const auto now = int(game::lastmillis());
+  const auto sendpings = now - lastinfo >= 5000;
+  pingjob = NEWTASK(pingtask, now, sendpings);
+  if (sendpings) {
+    loopv(servers) if (servers[i].address.host != ENET_HOST_ANY)
+      pingjob->addresses.add(servers[i].address);
+    lastinfo = now;
+  }
+  pingjob->scheduled();
 }
 
 static void checkresolver(void) {
-  char *name = NULL;
+  int server = -1;
   ENetAddress addr = {ENET_HOST_ANY, CUBE_SERVINFO_PORT};
-  while (resolvercheck(&name, &addr)) {
-    if (addr.host == ENET_HOST_ANY) continue;
-    loopv(servers) {
-      serverinfo &si = servers[i];
-      if (name == si.name.c_str()) {
-        si.address = addr;
-        addr.host = ENET_HOST_ANY;
-        break;
-      }
-    }
+  while (resolvercheck(&server, &addr)) {
+    if (addr.host == ENET_HOST_ANY || server >= servers.length()) continue;
+    servers[server].address = addr;
+    serverlookup[addresskey(addr)] = server;
+    showndirty = true;
   }
 }
 
 static void checkpings(void) {
-  enet_uint32 events = ENET_SOCKET_WAIT_RECEIVE;
-  ENetBuffer buf;
-  ENetAddress addr;
-  u8 ping[MAXTRANS], *p;
-  char text[MAXTRANS];
-  buf.data = ping;
-  buf.dataLength = sizeof(ping);
-  while (enet_socket_wait(pingsock, &events, 0) >= 0 && events) {
-    if (enet_socket_receive(pingsock, &addr, &buf, 1) <= 0) return;
-    loopv(servers) {
-      serverinfo &si = servers[i];
-      if (addr.host == si.address.host) {
-        p = ping;
-        si.ping = int(game::lastmillis()) - getint(p);
-        si.protocol = getint(p);
-        if (si.protocol!=PROTOCOL_VERSION) si.ping = 9998;
-        si.mode = getint(p);
-        si.numplayers = getint(p);
-        si.minremain = getint(p);
-        sgetstr();
-        strcpy_s(si.map, text);
-        sgetstr();
-        strcpy_s(si.sdesc, text);
-        break;
-      }
-    }
-  }
+  if (pingjob && !loadacquire(&pingjob->done)) return;
+  if (pingjob) mergepings(*pingjob);
+  schedulepings();
 }
 
 int sicompare(const serverinfo &a, const serverinfo &b) {
   return a.ping>b.ping ? 1 : (a.ping<b.ping ? -1 : strcmp(a.name.c_str(), b.name.c_str()));
 }
 
+// insertion into the MAXMENU best servers, O(servers*MAXMENU)
+static void updateshown(void) {
+  shownnum = 0;
+  loopv(servers) {
+    int j = shownnum;
+    while (j > 0 && sicompare(servers[i], servers[shown[j-1]]) < 0) --j;
+    if (j >= MAXMENU) continue;
+    const auto last = min(shownnum, MAXMENU-1);
+    for (int k = last; k > j; --k) shown[k] = shown[k-1];
+    shown[j] = i;
+    shownnum = min(shownnum+1, MAXMENU);
+  }
+  showndirty = false;
+}
+
 void refreshservers(void) {
   checkresolver();
   checkpings();
-  if (game::lastmillis() - lastinfo >= 5000) pingservers();
-  servers.sort((void*)sicompare);
-  int maxmenu = 16;
-  loopv(servers) {
-    serverinfo &si = servers[i];
+  if (!showndirty) return;
+  updateshown();
+  loopi(shownnum) {
+    serverinfo &si = servers[shown[i]];
     if (si.address.host != ENET_HOST_ANY && si.ping != 9999) {
       if (si.protocol!=PROTOCOL_VERSION)
         si.full.fmt("%s [different cube protocol]", si.name.c_str());
@@ -246,7 +333,6 @@ void refreshservers(void) {
         "%s [unknown host]\t", si.name.c_str());
     si.full[50] = 0; // cut off too long server descriptions
     menu::manual(1, i, si.full.c_str());
-    if (!--maxmenu) return;
   }
 }
 
@@ -256,7 +342,8 @@ static void servermenu(void) {
     resolverinit(1, 1000);
   }
   resolverclear();
-  loopv(servers) resolverquery(servers[i].name.c_str());
+  loopv(servers) resolverask(servers[i].name.c_str(), i);
+  showndirty = true;
   refreshservers();
   menu::set(1);
 }
@@ -271,7 +358,10 @@ static void updatefrommaster(void) {
       strstr(reply, "<HTML>"))
     con::out("master server not replying");
   else {
+    if (pingjob) pingjob->wait();
+    pingjob = NULL;
     servers.setsize(0);
+    serverlookup.clear();
     script::execstring(reply);
   }
   servermenu();
@@ -281,7 +371,7 @@ void writeservercfg(void) {
   FILE *f = fopen("servers.cfg", "w");
   if (!f) return;
   fprintf(f, "// servers connected to are added here automatically\n\n");
-  loopvrev(servers) fprintf(f, "addserver %s\n", servers[i].name.c_str());
+  loopv(servers) fprintf(f, "addserver %s\n", servers[i].name.c_str());
   fclose(f);
 }
 CMD(updatefrommaster);
@@ -96,36 +96,145 @@ u8 *retrieveservers(u8 *buf, int buflen) {
 static ENetSocket pongsock = ENET_SOCKET_NULL;
 static fixedstring serverdesc;
 
+// the info part of the reply is encoded again only when the status changes.
+// a query is answered with its own bytes followed by it
+static u8 inforeply[MAXTRANS];
+static int inforeplylen = -1;
+static int infomode, infonumplayers, infominremain;
+static bool infofull;
+static fixedstring infomap;
+
+static void updateinfo(int mode, int numplayers, int minremain, const char *smapname, bool isfull) {
+  if (inforeplylen >= 0 && mode == infomode && numplayers == infonumplayers &&
+      minremain == infominremain && isfull == infofull && !strcmp(smapname, infomap.c_str()))
+    return;
+  infomode = mode;
+  infonumplayers = numplayers;
+  infominremain = minremain;
+  infofull = isfull;
+  strcpy_s(infomap, smapname);
+  u8 *p = inforeply;
+  putint(p, PROTOCOL_VERSION);
+  putint(p, mode);
+  putint(p, numplayers);
+  putint(p, minremain);
+  fixedstring mname;
+  strcpy_s(mname, isfull ? "[FULL] " : "");
+  strcat_s(mname, smapname);
+  sendstring(mname.c_str(), p);
+  sendstring(serverdesc.c_str(), p);
+  inforeplylen = int(p-inforeply);
+}
+
+// every source may send QUERYBURST queries at once and then QUERYRATE per
+// second. sources are hashed in a small table and may share a bucket
+static const int QUERYBURST = 8, QUERYRATE = 4, QUERYSOURCENUM = 1024;
+static const int MAXQUERYNUM = 64; // queries answered per call at most
+struct querysource {
+  enet_uint32 host, last; // last refill time in milliseconds
+  int tokens;
+};
+static querysource querysources[QUERYSOURCENUM];
+
+static bool allowquery(const ENetAddress &addr, enet_uint32 now) {
+  auto &s = querysources[(addr.host * 2654435761u) >> 22];
+  if (s.host != addr.host) {
+    s.host = addr.host;
+    s.last = now;
+    s.tokens = QUERYBURST;
+  } else {
+    const auto refill = int((now-s.last)*QUERYRATE/1000);
+    if (refill > 0) {
+      s.tokens = min(s.tokens+refill, QUERYBURST);
+      s.last = now;
+    }
+  }
+  if (s.tokens == 0) return false;
+  --s.tokens;
+  return true;
+}
+
 void serverms(int mode, int numplayers, int minremain, char *smapname, int seconds, bool isfull) {
   checkmasterreply();
   updatemasterserver(seconds);
 
-  // reply all server info requests
+  // reply the server info requests waiting. a flood is dropped by the socket
+  // once its receive buffer is full and never delays the tick much
   ENetBuffer buf;
   ENetAddress addr;
-  u8 pong[MAXTRANS], *p;
-  int len;
-  enet_uint32 events = ENET_SOCKET_WAIT_RECEIVE;
+  u8 pong[MAXTRANS];
+  const auto now = enet_time_get();
   buf.data = pong;
-  while (enet_socket_wait(pongsock, &events, 0) >= 0 && events) {
+  for (int n = 0; n < MAXQUERYNUM; ++n) {
+    enet_uint32 events = ENET_SOCKET_WAIT_RECEIVE;
+    if (enet_socket_wait(pongsock, &events, 0) < 0 || !events) break;
     buf.dataLength = sizeof(pong);
-    len = enet_socket_receive(pongsock, &addr, &buf, 1);
+    const int len = enet_socket_receive(pongsock, &addr, &buf, 1);
     if (len < 0) return;
-    p = &pong[len];
-    putint(p, PROTOCOL_VERSION);
-    putint(p, mode);
-    putint(p, numplayers);
-    putint(p, minremain);
-    fixedstring mname;
-    strcpy_s(mname, isfull ? "[FULL] " : "");
-    strcat_s(mname, smapname);
-    sendstring(mname.c_str(), p);
-    sendstring(serverdesc.c_str(), p);
-    buf.dataLength = p - pong;
+    if (len == 0 || !allowquery(addr, now)) continue;
+    updateinfo(mode, numplayers, minremain, smapname, isfull);
+    if (len+inforeplylen > int(sizeof(pong))) continue;
+    memcpy(pong+len, inforeply, inforeplylen);
+    buf.dataLength = len+inforeplylen;
     enet_socket_send(pongsock, &addr, &buf, 1);
   }
 }
 
+/*-------------------------------------------------------------------------
+ - statsd export. every match thread fills its own datagram and sends it
+ - once full or flushed
+ -------------------------------------------------------------------------*/
+static ENetSocket statsdsock = ENET_SOCKET_NULL;
+static ENetAddress statsdaddr = { ENET_HOST_ANY, 8125 };
+static const int STATSDMTU = 1400;
+struct statsdpacket {
+  char data[STATSDMTU];
+  int len;
+};
+static THREAD statsdpacket statsdbuf;
+
+void statsdinit(const char *target) {
+  fixedstring host(target);
+  const auto colon = strchr(host.c_str(), ':');
+  if (colon) {
+    *colon = 0;
+    statsdaddr.port = enet_uint16(atoi(colon+1));
+  }
+  if (enet_address_set_host(&statsdaddr, host.c_str())<0) {
+    printf("WARNING: statsd host %s not resolved\n", host.c_str());
+    return;
+  }
+  statsdsock = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM, NULL);
+  if (statsdsock == ENET_SOCKET_NULL) printf("WARNING: could not create statsd socket\n");
+}
+
+bool statsdon(void) { return statsdsock != ENET_SOCKET_NULL; }
+
+void statsdflush(void) {
+  auto &b = statsdbuf;
+  if (b.len == 0 || !statsdon()) return;
+  ENetBuffer buf;
+  buf.data = b.data;
+  buf.dataLength = b.len;
+  enet_socket_send(statsdsock, &statsdaddr, &buf, 1);
+  b.len = 0;
+}
+
+void statsd(const char *fmt, ...) {
+  if (!statsdon()) return;
+  char line[256];
+  va_list args;
+  va_start(args, fmt);
+  const auto len = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  if (len <= 0 || len >= int(sizeof(line))) return;
+  auto &b = statsdbuf;
+  if (b.len+len+1 > STATSDMTU) statsdflush();
+  if (b.len) b.data[b.len++] = '\n';
+  memcpy(b.data+b.len, line, len);
+  b.len += len;
+}
+
 void servermsinit(const char *master, const char *sdesc, bool listen) {
   const char *mid = strstr(master, "/");
   if (!mid) mid = master;
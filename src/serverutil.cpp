@@ -6,6 +6,7 @@
 #include "server.hpp"
 #include "network.hpp"
 #include "enet/enet.h"
+#include <zlib.h>
 
 namespace q {
 #if defined(STANDALONE)
@@ -13,29 +14,56 @@ void finish() {}
 #endif
 namespace server {
 
-static fixedstring copyname;
-static int copysize;
-static u8 *copydata = NULL;
+// per thread since every match of a dedicated server has its own thread.
+// the map is kept as zlib compressed chunks of MAPCHUNKSIZE bytes, all in one
+// buffer. chunkoffsets has one more entry than there are chunks
+static THREAD char copyname[MAXDEFSTR];
+static THREAD int copysize, chunknum;
+static THREAD u32 copyhash;
+static THREAD u8 *chunkdata = NULL;
+static THREAD int *chunkoffsets = NULL;
+
+// the compress bound of zlib 1.1: 0.1% larger plus 12 bytes
+static const int CHUNKBOUND = MAPCHUNKSIZE+MAPCHUNKSIZE/1000+12;
 
 void sendmaps(int n, const char *mapname, int mapsize, u8 *mapdata) {
-  if (mapsize <= 0 || mapsize > 256*256) return;
-  strcpy_s(copyname, mapname);
+  if (mapsize <= 0 || mapsize > MAXMAPSIZE) return;
+  strn0cpy(copyname, mapname, sizeof(copyname));
   copysize = mapsize;
-  if (copydata) FREE(copydata);
-  copydata = (u8*)MALLOC(mapsize);
-  memcpy(copydata, mapdata, mapsize);
+  copyhash = u32(crc32(crc32(0L, Z_NULL, 0), mapdata, mapsize));
+  chunknum = (mapsize+MAPCHUNKSIZE-1)/MAPCHUNKSIZE;
+  if (chunkdata) FREE(chunkdata);
+  if (chunkoffsets) FREE(chunkoffsets);
+  chunkdata = (u8*)MALLOC(chunknum*CHUNKBOUND);
+  chunkoffsets = (int*)MALLOC((chunknum+1)*sizeof(int));
+  chunkoffsets[0] = 0;
+  loopi(chunknum) {
+    const auto size = min(int(MAPCHUNKSIZE), mapsize-i*MAPCHUNKSIZE);
+    uLongf dstsize = CHUNKBOUND;
+    compress2(chunkdata+chunkoffsets[i], &dstsize, mapdata+i*MAPCHUNKSIZE, size, 9);
+    chunkoffsets[i+1] = chunkoffsets[i]+int(dstsize);
+  }
 }
 
-ENetPacket *recvmap(int n) {
-  if (!copydata) return NULL;
-  ENetPacket *packet = enet_packet_create(NULL, MAXTRANS + copysize, ENET_PACKET_FLAG_RELIABLE);
+u32 maphash(void) { return chunkdata ? copyhash : 0; }
+int mapchunknum(void) { return chunkdata ? chunknum : 0; }
+
+ENetPacket *mapchunk(int chunk) {
+  if (!chunkdata || chunk<0 || chunk>=chunknum) return NULL;
+  // ints take at most 5 bytes and characters at most 3
+  const int namesize = 3*(int(strlen(copyname))+1);
+  const int datasize = chunkoffsets[chunk+1]-chunkoffsets[chunk];
+  ENetPacket *packet = enet_packet_create(NULL, 2+5+namesize+4*5+datasize, ENET_PACKET_FLAG_RELIABLE);
   u8 *start = packet->data;
   u8 *p = start+2;
-  putint(p, SV_RECVMAP);
-  sendstring(copyname.c_str(), p);
+  putint(p, SV_MAPCHUNK);
+  sendstring(copyname, p);
+  putint(p, int(copyhash));
   putint(p, copysize);
-  memcpy(p, copydata, copysize);
-  p += copysize;
+  putint(p, chunk);
+  putint(p, datasize);
+  memcpy(p, chunkdata+chunkoffsets[chunk], datasize);
+  p += datasize;
   *(u16 *)start = ENET_HOST_TO_NET_16(p-start);
   enet_packet_resize(packet, p-start);
   return packet;
@@ -51,8 +79,9 @@ void fatal(const char *s) {
 }
 
 static int main(int argc, char* argv[]) {
-  int uprate = 0, maxcl = 4;
-  const char *sdesc = "", *ip = "", *master = NULL, *passwd = "";
+  int uprate = 0, maxcl = 4, matchnum = 1, loops = 1;
+  const char *sdesc = "", *ip = "", *master = NULL, *passwd = "", *stats = NULL;
+  const char *capture = NULL, *replay = NULL;
 
   for (int i = 1; i<argc; i++) {
     char *a = &argv[i][2];
@@ -63,12 +92,23 @@ static int main(int argc, char* argv[]) {
       case 'm': master = a; break;
       case 'p': passwd = a; break;
       case 'c': maxcl  = atoi(a); break;
+      case 'x': matchnum = atoi(a); break;
+      case 's': stats = a; break;
+      case 'r': capture = a; break;
+      case 'b': replay = a; break;
+      case 'l': loops = atoi(a); break;
       default: printf("WARNING: unknown commandline option\n");
     }
   }
   if (enet_initialize()<0)
     fatal("unable to initialise network module");
-  server::init(true, uprate, sdesc, ip, master, passwd, maxcl);
+  if (replay) {
+    server::init(false, 0, sdesc, ip, master, passwd, MAXCLIENTS);
+    return server::replay(replay, loops) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (capture && !server::capture(capture))
+    fatal("unable to open the capture");
+  server::init(true, uprate, sdesc, ip, master, passwd, maxcl, matchnum, stats);
   return 0;
 }
 #endif
@@ -116,4 +116,5 @@ static const shaders::shaderregister
 #undef PUNIFORM
 #undef PUNIFORMARRAY
 #undef PINCLUDE
+#undef RULES
 
@@ -38,12 +38,13 @@ struct shaderdef {
   const shaderdesc *d;
   const char *n;
   u32 idx;
+  bool lazy; // permutation of an array of shaders
 };
 static vector<shaderdef> *allshaders = NULL;
 
 shaderregister::shaderregister(ogl::shadertype &s, const shaderdesc &desc, const char *name, u32 sz, u32) {
   if (allshaders == NULL) allshaders = NEWE(vector<shaderdef>);
-  allshaders->add({&s, &desc, name, 0u});
+  allshaders->add({&s, &desc, name, 0u, false});
 }
 
 shaderregister::shaderregister(void *s, const shaderdesc &desc, const char *name, u32 sz, u32 num) {
@@ -51,19 +52,56 @@ shaderregister::shaderregister(void *s, const shaderdesc &desc, const char *name
   if (allshaders == NULL) allshaders = NEWE(vector<shaderdef>);
   loopi(int(num)) {
     const auto shader = (ogl::shadertype*)(baseaddress+sz*i);
-    allshaders->add({shader, &desc, name, u32(i)});
+    allshaders->add({shader, &desc, name, u32(i), num > 1});
   }
 }
 
+// permutations are built at their first bind but the ones bound in the
+// previous run are built right away. the list has one "name index" per line
+static const char usedname[] = "shaders.used";
+static vector<pair<string,u32>> used;
+
+static void loadused() {
+  auto file = sys::loadfile(usedname);
+  if (file == NULL) return;
+  char name[64];
+  u32 idx;
+  int n = 0;
+  for (auto p = file; sscanf(p, " %63s %u%n", name, &idx, &n) == 2; p += n)
+    used.add(makepair(string(name), idx));
+  FREE(file);
+}
+
+static bool wasused(const shaderdef &def) {
+  loopv(used)
+    if (used[i].second == def.idx && !strcmp(used[i].first.c_str(), def.n))
+      return true;
+  return false;
+}
+
 void start() {
+  loadused();
   if (allshaders) loopv(*allshaders) {
     const auto &def = (*allshaders)[i];
     if (def.d->minglslversion > ogl::glslversion) continue;
     const auto b = NEW(builder, *def.d, def.idx);
     assert(def.s->program == 0 && "program is already built");
-    if (!b->build(*def.s, ogl::loadfromfile()))
+    if (def.lazy && !wasused(def))
+      b->defer(*def.s);
+    else if (!b->build(*def.s, ogl::loadfromfile()))
       ogl::shadererror(true, def.n);
   }
+  used.destroy();
+}
+void saveused() {
+  if (allshaders == NULL) return;
+  auto f = fopen(usedname, "w");
+  if (f == NULL) return;
+  loopv(*allshaders) {
+    const auto &def = (*allshaders)[i];
+    if (def.lazy && def.s->program != 0) fprintf(f, "%s %u\n", def.n, def.idx);
+  }
+  fclose(f);
 }
 void finish() {
   if (allshaders) loopv(*allshaders)
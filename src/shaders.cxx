@@ -49,15 +49,14 @@ const char debugunsplit_vp[] = {
 const char deferred_fp[] = {
 "void main() {\n"
 "  vec2 uv = gl_FragCoord.xy;\n"
-"  vec3 nor = normalize(2.0*texture2DRect(u_nortex, uv).xyz-1.0);\n"
 "  float depth = texture2DRect(u_depthtex, uv).r;\n"
 "  vec4 outcol;\n"
 "  if (depth != 1.0) {\n"
+"    vec3 nor = decodenormal(texture2DRect(u_nortex, uv));\n"
 "    vec4 posw = u_invmvp * vec4(uv, depth, 1.0);\n"
 "    vec3 pos = posw.xyz / posw.w;\n"
-"    vec4 diffuse = texture2DRect(u_diffusetex, uv);\n"
-"    // outcol = vec4(nor, 1.0); //diffuse*vec4(shade(pos, nor), 1.0);\n"
-"    outcol = diffuse*vec4(shade(pos, nor), 1.0);\n"
+"    vec3 diffuse = texture2DRect(u_diffusetex, uv).rgb;\n"
+"    outcol = vec4(diffuse*shade(pos, nor), 1.0);\n"
 "  } else {\n"
 "    vec4 rdh = u_dirinvmvp * vec4(uv, 0.0, 1.0);\n"
 "    vec3 rd = normalize(rdh.xyz/rdh.w);\n"
@@ -70,6 +69,42 @@ const char deferred_fp[] = {
 const char deferred_vp[] = {
 "void main() {gl_Position = vec4(vs_pos,0.0,1.0);}\n"
 
+};
+const char distfield[] = {
+"// distance to the scene from its sparse volume. the index gives the atlas\n"
+"// brick of the point or, far from the surface, only the sign of the distance.\n"
+"// an atlas brick has one more sample than its cells along each axis such\n"
+"// that the trilinear fetch stays in it. the shader declares u_distindex,\n"
+"// u_distatlas, u_distorg, u_rcpdistcell, u_distbrickdim and u_distmax\n"
+"float scenedist(vec3 pos) {\n"
+"  vec3 g = (pos-u_distorg) * u_rcpdistcell;\n"
+"  ivec3 brick = ivec3(floor(g / u_distbrickdim));\n"
+"  ivec3 dim = textureSize(u_distindex, 0);\n"
+"  if (any(lessThan(brick, ivec3(0))) || any(greaterThanEqual(brick, dim)))\n"
+"    return u_distmax;\n"
+"  int idx = int(texelFetch(u_distindex, brick, 0).r);\n"
+"  if (idx < 2) return idx == 0 ? u_distmax : -u_distmax;\n"
+"  int samples = int(u_distbrickdim)+1;\n"
+"  ivec3 atlassize = textureSize(u_distatlas, 0);\n"
+"  ivec3 atlasdim = atlassize / samples;\n"
+"  int slot = idx-2;\n"
+"  ivec3 atlas = ivec3(slot % atlasdim.x, (slot / atlasdim.x) % atlasdim.y,\n"
+"                      slot / (atlasdim.x*atlasdim.y));\n"
+"  vec3 local = g - vec3(brick)*u_distbrickdim;\n"
+"  vec3 texel = vec3(atlas*samples) + local + 0.5;\n"
+"  return texture(u_distatlas, texel / vec3(atlassize)).r;\n"
+"}\n"
+
+"// occlusion of a point by the distances along its normal at a few steps\n"
+"float distao(vec3 pos, vec3 nor, float step) {\n"
+"  float occ = 0.0, w = 0.5;\n"
+"  for (int i = 1; i <= 4; ++i) {\n"
+"    float h = step*float(i);\n"
+"    occ += w * max(h-scenedist(pos+h*nor), 0.0) / h;\n"
+"    w *= 0.5;\n"
+"  }\n"
+"  return clamp(1.0-occ, 0.0, 1.0);\n"
+"}\n"
 };
 const char fixed_fp[] = {
 "#if USE_DIFFUSETEX\n"
@@ -1111,6 +1146,34 @@ const char fxaa_fp[] = {
 const char fxaa_vp[] = {
 "void main() {gl_Position = vec4(vs_pos,0.0,1.0);}\n"
 
+};
+const char gbuffer[] = {
+"// the normals are stored as is in rgb8 or octahedron encoded in rg16 when\n"
+"// PACKEDGBUFFER is defined. the alpha of the diffuse target is the material\n"
+"vec4 encodenormal(vec3 n) {\n"
+"#if defined(PACKEDGBUFFER)\n"
+"  n /= abs(n.x)+abs(n.y)+abs(n.z);\n"
+"  vec2 s = 2.0*step(0.0, n.xy)-1.0;\n"
+"  vec2 e = n.z >= 0.0 ? n.xy : (1.0-abs(n.yx))*s;\n"
+"  return vec4(0.5*e+0.5, 0.0, 1.0);\n"
+"#else\n"
+"  return vec4(0.5*n+0.5, 1.0);\n"
+"#endif\n"
+"}\n"
+
+"vec3 decodenormal(vec4 t) {\n"
+"#if defined(PACKEDGBUFFER)\n"
+"  vec2 e = 2.0*t.xy-1.0;\n"
+"  vec3 n = vec3(e, 1.0-abs(e.x)-abs(e.y));\n"
+"  vec2 s = 2.0*step(0.0, n.xy)-1.0;\n"
+"  n.xy -= s*max(-n.z, 0.0);\n"
+"  return normalize(n);\n"
+"#else\n"
+"  return normalize(2.0*t.xyz-1.0);\n"
+"#endif\n"
+"}\n"
+
+"vec4 encodediffuse(vec3 col, float mat) { return vec4(col, mat/255.0); }\n"
 };
 const char hell[] = {
 "#if 0\n"
@@ -1210,6 +1273,20 @@ const char hell[] = {
 "}\n"
 "#endif\n"
 
+};
+const char hiz_fp[] = {
+"// farthest depth of the HIZSIZE x HIZSIZE block of pixels\n"
+"void main() {\n"
+"  vec2 org = floor(gl_FragCoord.xy)*float(HIZSIZE);\n"
+"  float depth = 0.0;\n"
+"  for (int j = 0; j < HIZSIZE; ++j)\n"
+"  for (int i = 0; i < HIZSIZE; ++i) {\n"
+"    vec2 uv = min(org+vec2(float(i),float(j))+0.5, u_depthdim-0.5);\n"
+"    depth = max(depth, texture2DRect(u_depthtex, uv).r);\n"
+"  }\n"
+"  SWITCH_WEBGL(gl_FragColor, rt_col) = vec4(depth);\n"
+"}\n"
+
 };
 const char lighting[] = {
 "vec3 diffuse(vec3 pos, vec3 nor, vec3 lpos, vec3 lpow) {\n"
@@ -1223,19 +1300,43 @@ const char md2_fp[] = {
 "PS_IN vec2 fs_tex;\n"
 "PS_IN vec3 fs_nor;\n"
 "void main() {\n"
-"  SWITCH_WEBGL(gl_FragData[0], rt_col) = texture2D(u_diffuse, fs_tex);\n"
-"  SWITCH_WEBGL(gl_FragData[1], rt_nor) = vec4(normalize(fs_nor), 1.0);\n"
+"  SWITCH_WEBGL(gl_FragData[0], rt_col) = encodediffuse(texture2D(u_diffuse, fs_tex).rgb, 0.0);\n"
+"  SWITCH_WEBGL(gl_FragData[1], rt_nor) = encodenormal(normalize(fs_nor));\n"
 "}\n"
 
 };
 const char md2_vp[] = {
 "VS_OUT vec2 fs_tex;\n"
 "VS_OUT vec3 fs_nor;\n"
+
+"vec4 instancedata(int base, int i) {\n"
+"  return texelFetch(u_instances, base+i);\n"
+"}\n"
+
+"// key frames store 8 bits positions and the index of their normal. the\n"
+"// transformation to model space is already in the instance matrices\n"
+"vec3 md2pos(uvec4 v, vec3 scale, vec3 translate) {\n"
+"  vec3 p = vec3(v.xyz)*scale;\n"
+"  if (u_snap != 0) p = vec3(ivec3(p+0.5*float(u_snap)) & ~(u_snap-1));\n"
+"  return p+translate;\n"
+"}\n"
 "void main() {\n"
+"  int base = INSTANCESZ*(u_firstinstance+gl_InstanceID);\n"
+"  mat4 mvp = mat4(instancedata(base,0), instancedata(base,1),\n"
+"                  instancedata(base,2), instancedata(base,3));\n"
+"  mat3 nortransform = mat3(instancedata(base,4).xyz, instancedata(base,5).xyz,\n"
+"                           instancedata(base,6).xyz);\n"
+"  vec4 frame = instancedata(base,7);\n"
+"  int idx = int(vs_vertex);\n"
+"  uvec4 v0 = texelFetch(u_vertices, int(frame.x)+idx);\n"
+"  uvec4 v1 = texelFetch(u_vertices, int(frame.y)+idx);\n"
+"  vec3 nor0 = texelFetch(u_normals, int(v0.w)).xyz;\n"
+"  vec3 nor1 = texelFetch(u_normals, int(v1.w)).xyz;\n"
+"  vec3 pos0 = md2pos(v0, instancedata(base,8).xyz, instancedata(base,9).xyz);\n"
+"  vec3 pos1 = md2pos(v1, instancedata(base,10).xyz, instancedata(base,11).xyz);\n"
 "  fs_tex = vs_tex;\n"
-"  fs_nor = u_nortransform*mix(vs_nor0,vs_nor1,u_delta);\n"
-"  vec3 vs_pos = mix(vs_pos0,vs_pos1,u_delta);\n"
-"  gl_Position = u_mvp*vec4(vs_pos,1.0);\n"
+"  fs_nor = nortransform*mix(nor0,nor1,frame.z);\n"
+"  gl_Position = mvp*vec4(mix(pos0,pos1,frame.z),1.0);\n"
 "}\n"
 
 };
@@ -1505,10 +1606,52 @@ const char noise_material_fp[] = {
 "  float dy = snoise(p+vec3(0.0,0.01,0.0));\n"
 "  float dz = snoise(p+vec3(0.0,0.0,0.01));\n"
 "  vec3 dn = normalize(vec3(c-dx, c-dy, c-dz));\n"
-"  vec3 n = 0.5*normalize(fs_nor + dn/2.0)+0.5;\n"
-"  //vec3 n = 0.5*normalize(-fs_nor)+0.5;\n"
-"  SWITCH_WEBGL(gl_FragData[0], rt_col) = vec4(1.0);\n"
-"  SWITCH_WEBGL(gl_FragData[1], rt_nor) = vec4(n, 1.0);\n"
+"  vec3 n = normalize(fs_nor + dn/2.0);\n"
+"  SWITCH_WEBGL(gl_FragData[0], rt_col) = encodediffuse(vec3(1.0), 1.0);\n"
+"  SWITCH_WEBGL(gl_FragData[1], rt_nor) = encodenormal(n);\n"
+"}\n"
+
+};
+const char packed_material_vp[] = {
+"VS_OUT vec3 fs_pos;\n"
+"VS_OUT vec3 fs_nor;\n"
+"// octahedral encoded normal: unfold the lower half of the octahedron\n"
+"vec3 octdecode(vec2 e) {\n"
+"  vec3 n = vec3(e, 1.0-abs(e.x)-abs(e.y));\n"
+"  if (n.z < 0.0) {\n"
+"    vec2 s = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n"
+"    n.xy = (1.0-abs(n.yx))*s;\n"
+"  }\n"
+"  return normalize(n);\n"
+"}\n"
+"void main() {\n"
+"  vec3 p = u_chunkorg+u_chunkscale*vs_pos;\n"
+"  fs_nor = octdecode(vs_nor);\n"
+"  fs_pos = p;\n"
+"  gl_Position = u_mvp*vec4(p,1.0);\n"
+"}\n"
+
+};
+const char particle_fp[] = {
+"PS_IN vec3 fs_tex;\n"
+"PS_IN vec3 fs_col;\n"
+"void main() {\n"
+"  vec4 col = texture(u_diffuse, fs_tex)*vec4(fs_col,1.0);\n"
+"  SWITCH_WEBGL(gl_FragColor, rt_col) = col;\n"
+"}\n"
+
+};
+const char particle_vp[] = {
+"VS_OUT vec3 fs_tex;\n"
+"VS_OUT vec3 fs_col;\n"
+"void main() {\n"
+"  // one instance per particle: position and size, color and sprite layer.\n"
+"  // the quad is a strip made from the vertex id\n"
+"  vec2 corner = vec2(float(gl_VertexID&1), float(gl_VertexID>>1));\n"
+"  vec2 offset = (2.0*corner-1.0)*vs_pos.w;\n"
+"  fs_tex = vec3(corner, vs_col.w);\n"
+"  fs_col = vs_col.xyz;\n"
+"  gl_Position = u_mvp*vec4(vs_pos.xyz+offset.x*u_right+offset.y*u_up,1.0);\n"
 "}\n"
 
 };
@@ -1525,9 +1668,8 @@ const char simple_material_fp[] = {
 "PS_IN vec3 fs_pos;\n"
 "void main() {\n"
 "  vec3 p = fs_pos*3.0;\n"
-"  vec3 n = 0.5*normalize(fs_nor)+0.5;\n"
-"  SWITCH_WEBGL(gl_FragData[0], rt_col) = vec4(1.0);\n"
-"  SWITCH_WEBGL(gl_FragData[1], rt_nor) = vec4(n, 1.0);\n"
+"  SWITCH_WEBGL(gl_FragData[0], rt_col) = encodediffuse(vec3(1.0), 2.0);\n"
+"  SWITCH_WEBGL(gl_FragData[1], rt_nor) = encodenormal(normalize(fs_nor));\n"
 "}\n"
 
 };
@@ -1573,7 +1715,7 @@ const char split_deferred_fp[] = {
 "  vec2 bufindex = uv * u_rcpsubbufferdim;\n"
 "  vec2 pixindex = mod(uv, u_subbufferdim);\n"
 "  vec2 splituv = SPLITNUM * pixindex + bufindex;\n"
-"  vec3 nor = normalize(2.0*texture2DRect(u_nortex, splituv).xyz-1.0);\n"
+"  vec3 nor = decodenormal(texture2DRect(u_nortex, splituv));\n"
 "  float depth = texture2DRect(u_depthtex, splituv).r;\n"
 "  vec4 posw = u_invmvp * vec4(splituv, depth, 1.0);\n"
 "  vec3 pos = posw.xyz / posw.w;\n"
@@ -1595,4 +1737,63 @@ const char texbuf_fp[] = {
 "}\n"
 
 };
+const char tiled_deferred_fp[] = {
+"// lights are binned in screen tiles of TILESIZE pixels. the grid starts with\n"
+"// the offset and the number of lights of each tile followed by light indices.\n"
+"// a light with a shadow bit (plus one, zero if none) is skipped when this bit\n"
+"// is set in the ray traced shadow mask\n"
+"vec3 shade(vec3 pos, vec3 nor) {\n"
+"  ivec2 tile = ivec2(gl_FragCoord.xy) / TILESIZE;\n"
+"  int idx = 2*(tile.x + tile.y*u_tilew);\n"
+"  int first = int(texelFetch(u_lightgrid, idx).r);\n"
+"  int num = int(texelFetch(u_lightgrid, idx+1).r);\n"
+"  uint shadowbits = 0u;\n"
+"  if (u_shadowscale != 0)\n"
+"    shadowbits = texelFetch(u_shadowmask, ivec2(gl_FragCoord.xy) / u_shadowscale, 0).r;\n"
+"  vec3 outcol = vec3(0.0);\n"
+"  for (int i = 0; i < num; ++i) {\n"
+"    int light = int(texelFetch(u_lightgrid, first+i).r);\n"
+"    vec4 lpow = texelFetch(u_lights, 2*light+1);\n"
+"    int shadow = int(lpow.w);\n"
+"    if (shadow != 0 && (shadowbits & (1u << uint(shadow-1))) != 0u) continue;\n"
+"    vec3 lpos = texelFetch(u_lights, 2*light).xyz;\n"
+"    outcol += diffuse(pos, nor, lpos, lpow.xyz);\n"
+"  }\n"
+"  return outcol;\n"
+"}\n"
+
+"// baked probes give l0 + dot(l1, normal) per color channel. their textures\n"
+"// are not bound and u_probescale is zero when the scene has none\n"
+"vec3 irradiance(vec3 pos, vec3 nor) {\n"
+"  if (u_probescale == 0.0) return vec3(0.0);\n"
+"  vec3 uvw = (pos - u_probeorg) * u_rcpprobeextent;\n"
+"  vec4 n = vec4(nor, 1.0);\n"
+"  vec3 sh = vec3(dot(texture(u_prober, uvw), n),\n"
+"                 dot(texture(u_probeg, uvw), n),\n"
+"                 dot(texture(u_probeb, uvw), n));\n"
+"  vec3 e = u_probescale * max(sh, vec3(0.0));\n"
+"  // the probes are coarse. the distance field darkens their light in corners\n"
+"  if (u_distao != 0.0) e *= mix(1.0, distao(pos, nor, 2.0/u_rcpdistcell), u_distao);\n"
+"  return e;\n"
+"}\n"
+
+"void main() {\n"
+"  vec2 uv = gl_FragCoord.xy;\n"
+"  float depth = texture(u_depthtex, uv).r;\n"
+"  vec4 outcol;\n"
+"  if (depth != 1.0) {\n"
+"    vec3 nor = decodenormal(texture(u_nortex, uv));\n"
+"    vec4 posw = u_invmvp * vec4(uv, depth, 1.0);\n"
+"    vec3 pos = posw.xyz / posw.w;\n"
+"    vec3 diffuse = texture(u_diffusetex, uv).rgb;\n"
+"    outcol = vec4(diffuse*(shade(pos, nor)+irradiance(pos, nor)), 1.0);\n"
+"  } else {\n"
+"    vec4 rdh = u_dirinvmvp * vec4(uv, 0.0, 1.0);\n"
+"    vec3 rd = normalize(rdh.xyz/rdh.w);\n"
+"    outcol = vec4(getsky(rd, u_sundir), 1.0);\n"
+"  }\n"
+"  rt_col = outcol;\n"
+"}\n"
+
+};
 
@@ -86,6 +86,8 @@ struct builder : ogl::shaderbuilder {
  -------------------------------------------------------------------------*/
 void start();
 void finish();
+// remember the permutations of this run to build them at the next start
+void saveused();
 } /* namespace shaders */
 } /* namespace q */
 
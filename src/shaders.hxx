@@ -9,6 +9,7 @@ extern const char debugunsplit_fp[];
 extern const char debugunsplit_vp[];
 extern const char deferred_fp[];
 extern const char deferred_vp[];
+extern const char distfield[];
 extern const char fixed_fp[];
 extern const char fixed_vp[];
 extern const char font_fp[];
@@ -17,7 +18,9 @@ extern const char forward_vp[];
 extern const char fxaa[];
 extern const char fxaa_fp[];
 extern const char fxaa_vp[];
+extern const char gbuffer[];
 extern const char hell[];
+extern const char hiz_fp[];
 extern const char lighting[];
 extern const char md2_fp[];
 extern const char md2_vp[];
@@ -25,6 +28,9 @@ extern const char noise2D[];
 extern const char noise3D[];
 extern const char noise4D[];
 extern const char noise_material_fp[];
+extern const char packed_material_vp[];
+extern const char particle_fp[];
+extern const char particle_vp[];
 extern const char shadertoy_fp[];
 extern const char shadertoy_vp[];
 extern const char simple_material_fp[];
@@ -33,6 +39,7 @@ extern const char sky[];
 extern const char split_deferred_fp[];
 extern const char split_deferred_vp[];
 extern const char texbuf_fp[];
+extern const char tiled_deferred_fp[];
 } /* namespace shaders */
 } /* namespace q */
 
@@ -28,7 +28,7 @@ INLINE soaf splat(const soaf &v) {
   const auto s = shuffle<0,0,0,0>(p,p);
   return s;
 }
-#elif defined(__SSE__)
+#elif defined(__SSE2_INTRINSICS__)
 typedef ssef soaf;
 typedef ssei soai;
 typedef sseb soab;
@@ -47,6 +47,7 @@ INLINE soaf splat(const soaf &v) {return shuffle<0,0,0,0>(v,v);}
 typedef vec3<soai> soa3i;
 typedef vec3<soaf> soa3f;
 typedef vec2<soaf> soa2f;
+typedef vec4<soaf> soa4f;
 
 /*-------------------------------------------------------------------------
  - define soa structures based on array which are oblivious to the
@@ -78,5 +79,53 @@ INLINE void sset(array3f<n> &out, const soa3f &v, u32 idx) {
   store(&out[1][idx*soaf::size], v.y);
   store(&out[2][idx*soaf::size], v.z);
 }
-} /* namespace q */
 
+/*-------------------------------------------------------------------------
+ - batched transforms of vector arrays. soaf::size vectors are gathered in
+ - soa form, go through the splatted matrix columns and are scattered back.
+ - the tail is done with the scalar routines. points keep their w for the
+ - perspective divide
+ -------------------------------------------------------------------------*/
+INLINE soa3f soagather(const vec3f *v) {
+  float DEFAULT_ALIGNED x[soaf::size], y[soaf::size], z[soaf::size];
+  loopi(int(soaf::size)) {
+    x[i] = v[i].x;
+    y[i] = v[i].y;
+    z[i] = v[i].z;
+  }
+  return soa3f(soaf::load(x), soaf::load(y), soaf::load(z));
+}
+INLINE void soascatter(vec3f *v, const soa3f &p) {
+  float DEFAULT_ALIGNED x[soaf::size], y[soaf::size], z[soaf::size];
+  store(x, p.x);
+  store(y, p.y);
+  store(z, p.z);
+  loopi(int(soaf::size)) v[i] = vec3f(x[i], y[i], z[i]);
+}
+INLINE void soascatter(vec4f *v, const soa4f &p) {
+  float DEFAULT_ALIGNED x[soaf::size], y[soaf::size], z[soaf::size], w[soaf::size];
+  store(x, p.x);
+  store(y, p.y);
+  store(z, p.z);
+  store(w, p.w);
+  loopi(int(soaf::size)) v[i] = vec4f(x[i], y[i], z[i], w[i]);
+}
+INLINE soa3f xfmvector(const mat3x3f &m, const soa3f &v) {
+  return v.x*soa3f(m.vx) + v.y*soa3f(m.vy) + v.z*soa3f(m.vz);
+}
+INLINE soa4f xfmpoint(const mat4x4f &m, const soa3f &p) {
+  return p.x*soa4f(m.vx) + p.y*soa4f(m.vy) + p.z*soa4f(m.vz) + soa4f(m.vw);
+}
+INLINE void xfmpoints(const mat4x4f &m, const vec3f *in, vec4f *out, u32 n) {
+  u32 i = 0;
+  for (; i+soaf::size <= n; i += soaf::size)
+    soascatter(out+i, xfmpoint(m, soagather(in+i)));
+  for (; i < n; ++i) out[i] = m*vec4f(in[i],1.f);
+}
+INLINE void xfmvectors(const mat3x3f &m, const vec3f *in, vec3f *out, u32 n) {
+  u32 i = 0;
+  for (; i+soaf::size <= n; i += soaf::size)
+    soascatter(out+i, xfmvector(m, soagather(in+i)));
+  for (; i < n; ++i) out[i] = xfmvector(m, in[i]);
+}
+} /* namespace q */
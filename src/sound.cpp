@@ -5,6 +5,7 @@
 #include "mini.q.hpp"
 #include "base/vector.hpp"
 #include "base/allocator.hpp"
+#include "base/task.hpp"
 #include <SDL2/SDL_mixer.h>
 
 #define MAXCHAN 32
@@ -23,13 +24,64 @@ static bool nosound = false;
 static Mix_Music *mod = NULL;
 static void *stream = NULL;
 static vector<Mix_Chunk*> samples;
+static vector<u8> sstates; // see preload
+static vector<u8*> pools;  // pcm of the decoded samples, one per preload
 static cvector snames;
 static int soundsatonce = 0;
 static int lastsoundmillis = 0;
-static struct { vec3f loc; bool inuse; } soundlocs[MAXCHAN];
+
+// every channel plays one voice. sounds too far to be heard are dropped before
+// their sample is even loaded. a sound has at most MAXINSTANCES voices and
+// when no channel is free the new sound takes the one of the quietest voice
+// if it is louder. vol and pan are only sent to the mixer when they change
+static const int MAXINSTANCES = 4;
+static struct voice {
+  vec3f loc;
+  int n, vol, pan;
+  bool inuse, located;
+} voices[MAXCHAN];
+
+// music files are opened by a task and the mixer decodes them while they
+// play. a music asked for while another one loads starts once it is done
+struct musicload : public task {
+  INLINE musicload(const char *path) :
+    task("musicload", 1, 1), path(path), mus(NULL), done(0) {}
+  virtual void run(u32) {
+    mus = Mix_LoadMUS(path.c_str());
+    storerelease(&done, 1);
+  }
+  fixedstring path;
+  Mix_Music *mus;
+  volatile s32 done;
+};
+static ref<musicload> musicjob;
+static fixedstring musicpath; // empty when no music is wanted
+
+static void startmusic() {
+  musicjob = NEWTASK(musicload, musicpath.c_str());
+  musicjob->scheduled();
+}
+
+static void adoptmusic(bool block) {
+  if (!musicjob || (!block && !loadacquire(&musicjob->done))) return;
+  musicjob->wait();
+  const auto mus = musicjob->mus;
+  const auto wanted = !strcmp(musicjob->path.c_str(), musicpath.c_str());
+  musicjob = nil;
+  if (!wanted) {
+    if (mus) Mix_FreeMusic(mus);
+    if (musicpath[0] != '\0' && !block) startmusic();
+    return;
+  }
+  if ((mod = mus)) {
+    Mix_PlayMusic(mod, -1);
+    Mix_VolumeMusic((musicvol*MAXVOL)/255);
+  }
+}
 
 void stop(void) {
   if (nosound) return;
+  musicpath[0] = '\0';
   if (mod) {
     Mix_HaltMusic();
     Mix_FreeMusic(mod);
@@ -39,7 +91,7 @@ void stop(void) {
 }
 
 void start(void) {
-  memset(soundlocs, 0, sizeof(soundlocs));
+  loopi(MAXCHAN) voices[i] = voice();
   if (Mix_OpenAudio(SOUNDFREQ, MIX_DEFAULT_FORMAT, 2, soundbufferlen) < 0) {
     con::out("sound init failed (SDL_mixer): %s", (size_t)Mix_GetError());
     nosound = true;
@@ -51,13 +103,9 @@ static void music(const char *name) {
   if (nosound) return;
   stop();
   if (soundvol && musicvol) {
-    fixedstring sn;
-    strcpy_s(sn, "packages/");
-    strcat_s(sn, name);
-    if ((mod = Mix_LoadMUS(sys::path(sn.c_str())))) {
-      Mix_PlayMusic(mod, -1);
-      Mix_VolumeMusic((musicvol*MAXVOL)/255);
-    }
+    musicpath.fmt("packages/%s", name);
+    sys::path(musicpath.c_str());
+    if (!musicjob) startmusic();
   }
 }
 
@@ -66,55 +114,243 @@ static void registersound(const char *name) {
   loopv(snames) if (strcmp(snames[i], name)==0) return;
   snames.add(lin.newstring(name));
   samples.add(NULL);
+  sstates.add(0);
 }
 
+static void adoptsamples(bool block);
 void finish(void) {
   if (nosound) return;
+  adoptsamples(true);
   stop();
+  adoptmusic(true);
+  Mix_HaltChannel(-1);
+  loopv(samples) if (samples[i]) Mix_FreeChunk(samples[i]);
+  samples.destroy();
+  sstates.destroy();
   Mix_CloseAudio();
+  loopv(pools) FREE(pools[i]);
+  pools.destroy();
 }
 
-static void updatechanvol(int chan, const vec3f *loc) {
-  int vol = soundvol, pan = 255/2;
-  if (loc) {
-    const auto v = game::player1->o-*loc;
-    const auto dist = length(v);
+// packed samples are already in the format the mixer was opened with. the
+// chunk points into the pack. another format means a new decode of the wav
+struct packedsample { u32 freq; u16 format, channels; };
+
+// the wav converted to the given format after "header" bytes left to the
+// caller. null if it cannot be read or converted
+static u8 *convertwav(const char *name, u16 format, int channels, int freq,
+                      u32 header, u32 &len) {
+  SDL_AudioSpec spec;
+  u8 *buf = NULL;
+  len = 0;
+  if (SDL_LoadWAV(name, &spec, &buf, &len) == NULL) return NULL;
+  SDL_AudioCVT cvt;
+  if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq,
+                        format, u8(channels), freq) < 0) {
+    SDL_FreeWAV(buf);
+    return NULL;
+  }
+  const auto size = header + size_t(len)*max(cvt.len_mult, 1);
+  const auto data = (u8*) MALLOC(size);
+  memcpy(data+header, buf, len);
+  SDL_FreeWAV(buf);
+  cvt.buf = data+header;
+  cvt.len = int(len);
+  cvt.len_cvt = int(len);
+  if (cvt.needed && SDL_ConvertAudio(&cvt) != 0) {
+    FREE(data);
+    return NULL;
+  }
+  len = u32(cvt.len_cvt);
+  return data;
+}
+
+bool packsample(const char *name, pack::writer &w) {
+  u32 len;
+  const auto data = convertwav(name, MIX_DEFAULT_FORMAT, 2, SOUNDFREQ,
+                               sizeof(packedsample), len);
+  if (data == NULL) return false;
+  const packedsample s = {u32(SOUNDFREQ), u16(MIX_DEFAULT_FORMAT), 2};
+  memcpy(data, &s, sizeof(s));
+  w.add(name, pack::SOUND, data, u32(sizeof(s))+len);
+  FREE(data);
+  return true;
+}
+
+// a sample is missing, queued in a preload or failed. it is ready once it
+// has its chunk
+enum { SAMPLE_MISSING, SAMPLE_QUEUED, SAMPLE_FAILED };
+
+// pcm of one sample in the mixer format. packed ones stay in the pack
+struct pcm {
+  u8 *data;
+  u32 len;
+  bool packed;
+};
+
+static pcm decode(const char *name, int freq, u16 format, int channels) {
+  pcm p = {NULL, 0, false};
+  pack::entry e;
+  if (pack::find(name, pack::SOUND, e) && e.size >= sizeof(packedsample)) {
+    const auto s = (const packedsample*) e.data;
+    if (s->freq == u32(freq) && s->format == format && s->channels == channels) {
+      p.data = (u8*) (s+1);
+      p.len = e.size-u32(sizeof(packedsample));
+      p.packed = true;
+      return p;
+    }
+  }
+  p.data = convertwav(name, format, channels, freq, 0, p.len);
+  return p;
+}
 
-    // simple mono distance attenuation
-    vol -= int(int(dist)*3*soundvol/255);
-    if (stereo && (v.x != 0.f || v.y != 0.f)) {
-      // relative angle of sound along X-Z axis
-      const auto yaw = -atan2(v.x,v.z)-game::player1->ypr.x*float(pi)/180.0f;
-      // range is from 0 (left) to 255 (right)
-      pan = int(255.9f*(0.5f*sin(yaw)+0.5f));
+// the missing samples are decoded in parallel and copied in one pool that
+// lives until the end. play adopts them once the job is done and never
+// decodes a sample itself
+struct sampleload : public task {
+  INLINE sampleload() : task("sampleload", 1, 1), pool(NULL), done(0) {}
+  virtual void run(u32) {
+    int freq = SOUNDFREQ, channels = 2;
+    u16 format = MIX_DEFAULT_FORMAT;
+    Mix_QuerySpec(&freq, &format, &channels);
+    vector<pcm> decoded;
+    decoded.setsize(paths.length());
+    parallelfor("sampledecode", u32(paths.length()), 1, [&](u32 i) {
+      decoded[i] = decode(paths[i].c_str(), freq, format, channels);
+    });
+    size_t size = 0;
+    loopv(decoded) if (!decoded[i].packed) size += decoded[i].len;
+    if (size != 0) pool = (u8*) MALLOC(size);
+    size_t offset = 0;
+    loopv(decoded) {
+      auto &d = decoded[i];
+      if (d.data == NULL) {
+        chunks.add(NULL);
+        continue;
+      }
+      auto data = d.data;
+      if (!d.packed) {
+        memcpy(pool+offset, d.data, d.len);
+        FREE(d.data);
+        data = pool+offset;
+        offset += d.len;
+      }
+      chunks.add(Mix_QuickLoad_RAW(data, d.len));
     }
+    storerelease(&done, 1);
   }
-  vol = (vol*MAXVOL)/255;
+  vector<fixedstring> paths;
+  vector<int> ids;
+  vector<Mix_Chunk*> chunks;
+  u8 *pool;
+  volatile s32 done;
+};
+static ref<sampleload> samplejob;
 
+void preload(void) {
+  if (nosound) return;
+  adoptsamples(false);
+  if (samplejob) return;
+  ref<sampleload> job = NEWTASKE(sampleload);
+  loopv(snames) {
+    if (samples[i] != NULL || sstates[i] != SAMPLE_MISSING) continue;
+    fixedstring path(fmt, "data/sounds/%s.wav", snames[i]);
+    sys::path(path.c_str());
+    job->paths.add(path);
+    job->ids.add(i);
+    sstates[i] = SAMPLE_QUEUED;
+  }
+  if (job->ids.length() == 0) return;
+  samplejob = job;
+  samplejob->scheduled();
+}
+
+static void adoptsamples(bool block) {
+  if (!samplejob || (!block && !loadacquire(&samplejob->done))) return;
+  samplejob->wait();
+  const auto &chunks = samplejob->chunks;
+  loopv(chunks) {
+    const auto n = samplejob->ids[i];
+    samples[n] = chunks[i];
+    sstates[n] = chunks[i] ? SAMPLE_MISSING : SAMPLE_FAILED;
+    if (!chunks[i]) con::out("failed to load sample: %s", samplejob->paths[i].c_str());
+  }
+  if (samplejob->pool) pools.add(samplejob->pool);
+  samplejob = nil;
+}
+
+// volume in [0,255] and pan from 0 (left) to 255 (right) heard by player1
+static void mix(const vec3f *loc, int &vol, int &pan) {
+  vol = soundvol;
+  pan = 255/2;
+  if (!loc) return;
+  const auto v = game::player1->o-*loc;
+  const auto dist = length(v);
+
+  // simple mono distance attenuation
+  vol -= int(int(dist)*3*soundvol/255);
+  if (stereo && (v.x != 0.f || v.y != 0.f)) {
+    // relative angle of sound along X-Z axis
+    const auto yaw = -atan2(v.x,v.z)-game::player1->ypr.x*float(pi)/180.0f;
+    pan = int(255.9f*(0.5f*sin(yaw)+0.5f));
+  }
+}
+
+static void setvoice(int chan, int vol, int pan) {
+  auto &v = voices[chan];
+  v.vol = vol;
+  v.pan = pan;
 #if !defined(__JAVASCRIPT__)
   // crashed (out of bound access) happens here.
   // I do not know why unfortunately
-  Mix_Volume(chan, vol);
+  Mix_Volume(chan, (vol*MAXVOL)/255);
   Mix_SetPanning(chan, 255-pan, pan);
 #endif /* __JAVASCRIPT__ */
 }
 
-static void newsoundloc(int chan, const vec3f *loc) {
-  assert(chan>=0 && chan<MAXCHAN);
-  soundlocs[chan].loc = *loc;
-  soundlocs[chan].inuse = true;
-}
-
 void updatevol(void) {
   if (nosound) return;
-  loopi(MAXCHAN) if (soundlocs[i].inuse) {
-    if (Mix_Playing(i))
-      updatechanvol(i, &soundlocs[i].loc);
-    else
-      soundlocs[i].inuse = false;
+  adoptmusic(false);
+  loopi(MAXCHAN) {
+    auto &v = voices[i];
+    if (!v.inuse) continue;
+    if (!Mix_Playing(i)) {
+      v.inuse = false;
+      continue;
+    }
+    if (!v.located) continue;
+    int vol, pan;
+    mix(&v.loc, vol, pan);
+    if (vol<=0) { // out of earshot, no need to mix it anymore
+      Mix_HaltChannel(i);
+      v.inuse = false;
+    } else if (vol!=v.vol || pan!=v.pan)
+      setvoice(i, vol, pan);
   }
 }
 
+// a free channel or the quietest voice quieter than vol. same sounds only
+// steal each other once there are too many of them
+static int getchannel(int n, int vol) {
+  int freechan = -1, quietest = -1, same = -1, instances = 0;
+  loopi(MAXCHAN) {
+    auto &v = voices[i];
+    if (v.inuse && !Mix_Playing(i)) v.inuse = false;
+    if (!v.inuse) {
+      if (freechan<0) freechan = i;
+      continue;
+    }
+    if (v.n==n) {
+      ++instances;
+      if (same<0 || v.vol<voices[same].vol) same = i;
+    }
+    if (quietest<0 || v.vol<voices[quietest].vol) quietest = i;
+  }
+  if (instances>=MAXINSTANCES) return voices[same].vol<vol ? same : -1;
+  if (freechan>=0) return freechan;
+  return voices[quietest].vol<vol ? quietest : -1;
+}
+
 void playc(int n) {
   // client::addmsg(0, 2, SV_SOUND, n);
   play(n);
@@ -133,20 +369,28 @@ void play(int n, const vec3f *loc) {
     con::out("unregistered sound: %d", n);
     return;
   }
+  int vol, pan;
+  mix(loc, vol, pan);
+  if (vol<=0) return;
+  const int chan = getchannel(n, vol);
+  if (chan<0) return;
 
+  // a sample not decoded yet is queued and the sound dropped
+  adoptsamples(false);
   if (!samples[n]) {
-    fixedstring buf(fmt, "data/sounds/%s.wav", snames[n]);
-    samples[n] = Mix_LoadWAV(sys::path(buf.c_str()));
-    if (!samples[n]) {
-      con::out("failed to load sample: %s", buf.c_str());
-      return;
-    }
+    if (sstates[n] == SAMPLE_MISSING) preload();
+    return;
   }
 
-  const int chan = Mix_PlayChannel(-1, samples[n], 0);
-  if (chan<0) return;
-  if (loc) newsoundloc(chan, loc);
-  updatechanvol(chan, loc);
+  auto &v = voices[chan];
+  if (v.inuse) Mix_HaltChannel(chan);
+  v.inuse = false;
+  setvoice(chan, vol, pan);
+  if (Mix_PlayChannel(chan, samples[n], 0)<0) return;
+  v.n = n;
+  v.inuse = true;
+  v.located = loc!=NULL;
+  if (loc) v.loc = *loc;
 }
 
 static void sound(int n) { play(n, NULL); }
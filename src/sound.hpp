@@ -1,5 +1,6 @@
 #pragma once
 #include "base/math.hpp"
+#include "base/pack.hpp"
 
 namespace q {
 namespace sound {
@@ -30,12 +31,17 @@ enum {
 void start(void);
 // stop the sound module
 void finish(void);
+// decode the registered samples not loaded yet in a task. play never loads
+// a sample itself and drops the sound until it is ready
+void preload(void);
 // play sound n at given location
 void play(int n, const vec3f *loc = NULL);
 // play sound n and send message to the server
 void playc(int n);
-// update the overall volume
+// update the overall volume and start the music loaded in the background
 void updatevol(void);
+// resample the wav once to the mixer format and store it in the pack
+bool packsample(const char *name, pack::writer &w);
 } /* namespace sound */
 } /* namespace q */
 
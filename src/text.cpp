@@ -8,6 +8,7 @@
 #include "shaders.hpp"
 #include "base/math.hpp"
 #include "base/string.hpp"
+#include "base/vector.hpp"
 
 namespace q {
 namespace text {
@@ -40,8 +41,20 @@ void start() {
   buildfont();
   font::s.fixedfunction = true;
 }
+
+// glyphs are queued until flush and drawn in one call. they are moved to clip
+// space when queued such that a batch survives changes of the matrices
+struct glyphvertex { float u, v; vec4f col; float x, y; };
+typedef u16 indextype;
+static const int MAXGLYPHVERTS = 0x10000;
+static vector<glyphvertex> glyphverts;
+static vector<indextype> glyphindices;
+
 #if !defined(RELEASE)
-void finish() {}
+void finish() {
+  glyphverts.destroy();
+  glyphindices.destroy();
+}
 #endif
 
 // font parameters
@@ -53,20 +66,20 @@ vec2f fontdim() { return charwh; }
 vec2f displaydim() { return vec2f(displayw, displayh); }
 float fontratio() { return float(charh) / float(charw); }
 void displaywidth(float w) { displayw = w; displayh = w * fontratio(); }
-void thickness(float t) { fontthickness = t; }
-void outlinecolor(const vec4f &c) { fontoutlinecolor = c; }
-void outlinewidth(float w) { fontoutlinewidth = w; }
+void thickness(float t) { flush(); fontthickness = t; }
+void outlinecolor(const vec4f &c) { flush(); fontoutlinecolor = c; }
+void outlinewidth(float w) { flush(); fontoutlinewidth = w; }
 void resetdefaultwidth() {displaywidth(float(charw));}
 static void bindfontshader() {
   ogl::bindshader(font::s);
-  OGL(Uniform2f, font::s.u_fontwh, float(fontw), float(fonth));
-  OGL(Uniform1f, font::s.u_font_thickness, fontthickness);
-  OGL(Uniform4fv, font::s.u_outline_color, 1, &fontoutlinecolor.x);
-  OGL(Uniform1f, font::s.u_outline_width, fontoutlinewidth);
+  ogl::uniform2f(font::s.u_fontwh, float(fontw), float(fonth));
+  ogl::uniform1f(font::s.u_font_thickness, fontthickness);
+  ogl::uniform4fv(font::s.u_outline_color, 1, &fontoutlinecolor.x);
+  ogl::uniform1f(font::s.u_outline_width, fontoutlinewidth);
 }
 
-typedef u16 indextype;
 static const indextype twotriangles[] = {0,1,2,0,2,3};
+static const vec4f white(1.f), highlight(0.25f,1.f,0.5f,1.f);
 
 float width(const char *str) {
   float x = 0.f;
@@ -92,21 +105,41 @@ void drawf(const char *fstr, float x, float y, ...) {
   draw(str.c_str(), x, y);
 }
 
-void draw(const char *str, vec2f pos) {
+void flush() {
+  if (glyphindices.length() == 0) return;
   ogl::bindtexture(GL_TEXTURE_2D, ogl::coretex(ogl::TEX_CHARACTERS));
+  ogl::pushmode(ogl::MODELVIEW);
+  ogl::identity();
+  ogl::pushmode(ogl::PROJECTION);
+  ogl::identity();
+  bindfontshader();
+  ogl::immdrawelememts("Tst2c4p2", glyphindices.length(), &glyphindices[0],
+                       &glyphverts[0].u, glyphverts.length());
+  ogl::popmode(ogl::PROJECTION);
+  ogl::popmode(ogl::MODELVIEW);
+  glyphverts.setsize(0);
+  glyphindices.setsize(0);
+}
+
+static INLINE void addvertex(const mat4x4f &m, float u, float v, const vec4f &col,
+                             float x, float y) {
+  const auto p = m.vx*x + m.vy*y + m.vw;
+  const glyphvertex g = {u, v, col, p.x/p.w, p.y/p.w};
+  glyphverts.add(g);
+}
 
-  // use a triangle mesh to display the text
-  const auto len = strlen(str);
-  auto indices = (indextype*) alloca(len*sizeof(int[6]));
-  auto verts = (vec4f*) alloca(len*sizeof(vec4f[4]));
+void draw(const char *str, vec2f pos) {
+  const auto len = int(strlen(str));
+  if (glyphverts.length()+4*len > MAXGLYPHVERTS) flush();
+  const auto mvp = ogl::matrix(ogl::PROJECTION)*ogl::matrix(ogl::MODELVIEW);
 
-  // traverse the string and build the mesh
-  auto index = 0, vert = 0;
+  // traverse the string and append its glyphs to the batch
+  auto col = white;
   auto x = pos.x, y = pos.y;
   for (int i = 0; str[i] != 0; ++i) {
     int c = str[i];
     if (c=='\t') {x = (x-pos.y+rr::PIXELTAB)/rr::PIXELTAB*rr::PIXELTAB+pos.y; continue;}
-    if (c=='\f') {OGL(VertexAttrib3f,ogl::ATTRIB_COL,0.25f,1.f,0.5f); continue;}
+    if (c=='\f') {col = highlight; continue;}
     if (c==' ')  {x += displayw; continue;}
     c -= 32;
     if (c<0 || c>=95) continue;
@@ -116,18 +149,14 @@ void draw(const char *str, vec2f pos) {
     const auto in_right  = in_left + (float(charw)-EPS)/float(fontw);
     const auto in_bottom = in_top + (float(charh)-EPS)/float(fonth);
 
-    loopj(6) indices[index+j] = vert+twotriangles[j];
-    verts[vert+0] = vec4f(in_left, in_bottom,   x,         y);
-    verts[vert+1] = vec4f(in_right,in_bottom,   x+displayw,y);
-    verts[vert+2] = vec4f(in_right,in_top,x+displayw,y+displayh);
-    verts[vert+3] = vec4f(in_left, in_top,x,         y+displayh);
-
+    const auto vert = glyphverts.length();
+    loopj(6) glyphindices.add(indextype(vert+twotriangles[j]));
+    addvertex(mvp, in_left, in_bottom, col, x,         y);
+    addvertex(mvp, in_right,in_bottom, col, x+displayw,y);
+    addvertex(mvp, in_right,in_top,    col, x+displayw,y+displayh);
+    addvertex(mvp, in_left, in_top,    col, x,         y+displayh);
     x += displayw;
-    index += 6;
-    vert += 4;
   }
-  bindfontshader();
-  ogl::immdrawelememts("Tst2p2", index, indices, &verts[0].x);
 }
 } /* namespace text */
 } /* namespace q */
@@ -26,6 +26,8 @@ void drawf(const char *fstr, float x, float y, ...);
 INLINE void draw(const char *str, float x, float y) {
   draw(str, vec2f(x,y));
 }
+// strings are batched. flush draws them before any state change
+void flush();
 } /* namespace text */
 } /* namespace q */
 
@@ -155,6 +155,16 @@ static float tempnormals[TEMP_COORD_COUNT*2];
 static float circleverts[CIRCLE_VERTS*2];
 static bool initcircleverts = true;
 
+// shapes are batched until the scissor changes
+typedef array<float,6> verttype;
+static vector<verttype> shapeverts;
+static void flushshapes() {
+  if (shapeverts.length() == 0) return;
+  ogl::bindfixedshader(ogl::FIXED_COLOR);
+  ogl::immdraw("Tc4p2", shapeverts.length(), &shapeverts[0][0]);
+  shapeverts.setsize(0);
+}
+
 static void drawpoly(const float *coords, u32 numCoords, float r, u32 col) {
   if (numCoords > TEMP_COORD_COUNT) numCoords = TEMP_COORD_COUNT;
 
@@ -194,24 +204,19 @@ static void drawpoly(const float *coords, u32 numCoords, float r, u32 col) {
   const auto colTrans = vec4f(float(col&0xff), float((col>>8)&0xff), float((col>>16)&0xff), 0.f) / 255.f;
   const auto colf = vec4f(float(col&0xff), float((col>>8)&0xff), float((col>>16)&0xff), float(col>>24)) / 255.f;
 
-  typedef array<float,6> verttype;
-  // XXX remove this and use a static array as the rest
-  vector<verttype> verts;
   for (u32 i = 0, j = numCoords-1; i < numCoords; j=i++) {
-    verts.add(verttype(colf,coords[i*2+0],coords[i*2+1]));
-    verts.add(verttype(colf,coords[j*2+0],coords[j*2+1]));
-    verts.add(verttype(colTrans,tempcoords[j*2+0],tempcoords[j*2+1]));
-    verts.add(verttype(colTrans,tempcoords[j*2+0],tempcoords[j*2+1]));
-    verts.add(verttype(colTrans,tempcoords[i*2+0],tempcoords[i*2+1]));
-    verts.add(verttype(colf,coords[i*2+0],coords[i*2+1]));
+    shapeverts.add(verttype(colf,coords[i*2+0],coords[i*2+1]));
+    shapeverts.add(verttype(colf,coords[j*2+0],coords[j*2+1]));
+    shapeverts.add(verttype(colTrans,tempcoords[j*2+0],tempcoords[j*2+1]));
+    shapeverts.add(verttype(colTrans,tempcoords[j*2+0],tempcoords[j*2+1]));
+    shapeverts.add(verttype(colTrans,tempcoords[i*2+0],tempcoords[i*2+1]));
+    shapeverts.add(verttype(colf,coords[i*2+0],coords[i*2+1]));
   }
   for (u32 i = 2; i < numCoords; ++i) {
-    verts.add(verttype(colf, coords[0], coords[1]));
-    verts.add(verttype(colf, coords[(i-1)*2], coords[(i-1)*2+1]));
-    verts.add(verttype(colf, coords[i*2], coords[i*2+1]));
+    shapeverts.add(verttype(colf, coords[0], coords[1]));
+    shapeverts.add(verttype(colf, coords[(i-1)*2], coords[(i-1)*2+1]));
+    shapeverts.add(verttype(colf, coords[i*2], coords[i*2+1]));
   }
-  ogl::bindfixedshader(ogl::FIXED_COLOR);
-  ogl::immdraw("Tc4p2", verts.length(), &verts[0][0]);
 }
 
 static void drawrect(float x, float y, float w, float h, float fth, u32 col) {
@@ -306,7 +311,7 @@ void draw(int width, int height) {
   const auto nq = getrenderqueuesize();
   const auto s = 1.0f/8.0f;
 
-  OGL(Disable, GL_SCISSOR_TEST);
+  ogl::disable(GL_SCISSOR_TEST);
   for (int i = 0; i < nq; ++i) {
     const gfx& cmd = q[i];
     if (cmd.type == GFX_RECT) {
@@ -341,14 +346,19 @@ void draw(int width, int height) {
     } else if (cmd.type == GFX_TEXT)
       drawtext(cmd.text.x, cmd.text.y, cmd.text.text, cmd.text.align, cmd.col);
     else if (cmd.type == GFX_SCISSOR) {
+      // text goes over the shapes of its scissor region
+      flushshapes();
+      text::flush();
       if (cmd.flags) {
-        OGL(Enable, GL_SCISSOR_TEST);
+        ogl::enable(GL_SCISSOR_TEST);
         OGL(Scissor, cmd.rect.x, cmd.rect.y, cmd.rect.w, cmd.rect.h);
       } else
-        OGL(Disable, GL_SCISSOR_TEST);
+        ogl::disable(GL_SCISSOR_TEST);
     }
   }
-  OGL(Disable, GL_SCISSOR_TEST);
+  flushshapes();
+  text::flush();
+  ogl::disable(GL_SCISSOR_TEST);
 }
 
 /*-------------------------------------------------------------------------
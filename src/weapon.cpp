@@ -10,6 +10,9 @@
 #include "game.hpp"
 #include "client.hpp"
 #include "demo.hpp"
+#include "bvh.hpp"
+#include "rt.hpp"
+#include "physics.hpp"
 #include "base/script.hpp"
 
 namespace q {
@@ -61,6 +64,17 @@ static void weapon(const char *a1, const char *a2, const char *a3) {
 
 CMD(weapon);
 
+// shots stop at the world geometry: segments from "from" to "to[i]" are
+// traced together and shortened to their first hit
+static void clipshots(const vec3f &from, vec3f *to, u32 n) {
+  rt::ray r[SGRAYS];
+  rt::hit h[SGRAYS];
+  assert(n <= u32(SGRAYS));
+  loopi(s32(n)) r[i] = rt::ray(from, to[i]-from, 0.f, 1.f);
+  rt::closest(r, n, h);
+  loopi(s32(n)) if (h[i].is_hit()) to[i] = from + h[i].t*r[i].dir;
+}
+
 // create random spread of rays for the shotgun
 void createrays(const vec3f &from, const vec3f &to) {
   const float dist = distance(from, to);
@@ -72,9 +86,11 @@ void createrays(const vec3f &from, const vec3f &to) {
     sg[i] += r;
   }
 #undef RNDD
+  clipshots(from, sg, SGRAYS);
 }
-// if lineseg hits entity bounding box
-bool intersect(dynent *d, vec3f &from, const vec3f &to) {
+// if a sphere moving along lineseg hits entity bounding box. the point of the
+// segment closest to the entity is tested against the box grown by radius
+static bool sweep(const dynent *d, const vec3f &from, const vec3f &to, float radius) {
   vec3f v = to, w = d->o;
   const vec3f *p;
   v -= from;
@@ -93,12 +109,17 @@ bool intersect(dynent *d, vec3f &from, const vec3f &to) {
     }
   }
 
-  return p->x <= d->o.x+d->radius
-      && p->x >= d->o.x-d->radius
-      && p->y <= d->o.y+d->radius
-      && p->y >= d->o.y-d->radius
-      && p->z <= d->o.z+d->aboveeye
-      && p->z >= d->o.z-d->eyeheight;
+  return p->x <= d->o.x+d->radius+radius
+      && p->x >= d->o.x-d->radius-radius
+      && p->y <= d->o.y+d->radius+radius
+      && p->y >= d->o.y-d->radius-radius
+      && p->z <= d->o.z+d->aboveeye+radius
+      && p->z >= d->o.z-d->eyeheight-radius;
+}
+
+// if lineseg hits entity bounding box
+bool intersect(dynent *d, vec3f &from, const vec3f &to) {
+  return sweep(d, from, to, 0.f);
 }
 
 const char *playerincrosshair(void) {
@@ -114,6 +135,7 @@ const char *playerincrosshair(void) {
 }
 
 static const int MAXPROJ = 100;
+static const float PROJRADIUS = 0.3f;
 struct projectile { vec3f o, to; float speed; dynent *owner; int gun; bool inuse, local; };
 static projectile projs[MAXPROJ];
 
@@ -170,21 +192,21 @@ static void splash(projectile *p, const vec3f &v, const vec3f &vold, int notthis
     sound::play(sound::RLHIT, &v);
     // TODO newsphere(v, RL_RADIUS, 0);
     if (!p->local) return;
-    radialeffect(player1, v, -1, qdam, p->owner);
-    loopv(players) {
-      if (i==notthisplayer) continue;
-      dynent *o = players[i];
-      if (!o) continue;
-      radialeffect(o, v, i, qdam, p->owner);
+    physics::entref near[physics::MAXNEAR];
+    const auto num = physics::gather(aabb(v-(RL_DAMRAD+2.f), v+(RL_DAMRAD+2.f)), near, physics::MAXNEAR);
+    loopi(s32(num)) {
+      const auto &e = near[i];
+      if (e.monster>=0) {
+        if (e.monster!=notthismonster) radialeffect(e.d, v, e.monster, qdam, p->owner);
+      } else if (e.cn==-1 || e.cn!=notthisplayer)
+        radialeffect(e.d, v, e.cn, qdam, p->owner);
     }
-    dvector &mv = getmonsters();
-    loopv(mv) if (i!=notthismonster) radialeffect(mv[i], v, i, qdam, p->owner);
   }
 }
 
 INLINE void projdamage(dynent *o, projectile *p, const vec3f &v, int i, int im, int qdam) {
   if (o->state!=CS_ALIVE) return;
-  if (intersect(o, p->o, v)) {
+  if (sweep(o, p->o, v, PROJRADIUS)) {
     splash(p, v, p->o, i, im, qdam);
     hit(i, qdam, o, p->owner);
   }
@@ -194,29 +216,56 @@ INLINE bool rejectxy(vec3f u, vec3f v, float m) {
   return abs(v.x-u.x)>m || abs(v.y-u.y)>m;
 }
 
+// every projectile sweeps its whole step so nothing is skipped at low frame
+// rates. the steps against the world are traced together first and stop at
+// the first wall, then the dynents are found with the broadphase
 void moveprojectiles(float time) {
+  rt::ray r[MAXPROJ];
+  rt::hit h[MAXPROJ];
+  vec3f to[MAXPROJ];
+  bool last[MAXPROJ];
+  int active[MAXPROJ], num = 0;
   loopi(MAXPROJ) {
-    projectile *p = &projs[i];
+    const auto p = projs+i;
     if (!p->inuse) continue;
-    int qdam = guns[p->gun].damage*(p->owner->quadmillis ? 4 : 1);
-    if (p->owner->monsterstate) qdam /= MONSTERDAMAGEFACTOR;
-    vec3f v = p->to-p->o;
+    const auto v = p->to-p->o;
     auto dtime = length(v)*1000.f/p->speed;
     if (time>dtime) dtime = time;
-    v *= time/dtime;
-    v += p->o;
+    last[num] = time==dtime;
+    to[num] = p->o + v*(time/dtime);
+    r[num] = rt::ray(p->o, to[num]-p->o, 0.f, 1.f);
+    active[num++] = i;
+  }
+  rt::closest(r, num, h);
+
+  loopi(num) {
+    const auto p = projs+active[i];
+    auto v = to[i];
+    if (h[i].is_hit()) {
+      // back off the wall so that the splash is not inside of it
+      const auto len = length(r[i].dir);
+      const auto t = len > 0.f ? max(h[i].t-PROJRADIUS/len, 0.f) : 0.f;
+      v = p->o + t*r[i].dir;
+      last[i] = true;
+    }
+    int qdam = guns[p->gun].damage*(p->owner->quadmillis ? 4 : 1);
+    if (p->owner->monsterstate) qdam /= MONSTERDAMAGEFACTOR;
     if (p->local) {
-      loopv(players) {
-        if (!players[i]) continue;
-        projdamage(players[i], p, v, i, -1, qdam);
+      const auto ext = vec3f(PROJRADIUS);
+      physics::entref near[physics::MAXNEAR];
+      const auto box = aabb(min(p->o,v)-ext, max(p->o,v)+ext);
+      const auto nearnum = physics::gather(box, near, physics::MAXNEAR);
+      loopj(s32(nearnum)) {
+        const auto &e = near[j];
+        if (e.monster>=0) {
+          if (!rejectxy(e.d->o, v, 10.0f) && e.d!=p->owner)
+            projdamage(e.d, p, v, -1, e.monster, qdam);
+        } else if (e.cn>=0 || p->owner!=player1)
+          projdamage(e.d, p, v, e.cn, -1, qdam);
       }
-      if (p->owner!=player1) projdamage(player1, p, v, -1, -1, qdam);
-      auto &mv = getmonsters();
-      loopv(mv) if (!rejectxy(mv[i]->o, v, 10.0f) && mv[i]!=p->owner)
-        projdamage(mv[i], p, v, -1, i, qdam);
     }
     if (p->inuse) {
-      if (time==dtime)
+      if (last[i])
         splash(p, v, p->o, -1, -1, qdam);
       else {
         if (p->gun==GUN_RL)
@@ -260,7 +309,8 @@ void shootv(int gun, const vec3f &from, const vec3f &to, dynent *d, bool local)
 void hitpush(int target, int damage, dynent *d, dynent *at, vec3f &from, vec3f &to) {
   hit(target, damage, d, at);
   const auto v = to-from;
-  d->vel += damage/length(v)/50.f*v;
+  const auto len = length(v);
+  if (len > 0.f) d->vel += damage/len/50.f*v;
 }
 
 void raydamage(dynent *o, vec3f &from, vec3f &to, dynent *d, int i) {
@@ -304,6 +354,7 @@ void shoot(dynent *d, vec3f &targ) {
     to += unitv;
   }
   if (d->gunselect==GUN_SG) createrays(from, to);
+  else if (!guns[d->gunselect].projspeed) clipshots(from, &to, 1);
 
   if (d->quadmillis && attacktime>200) sound::playc(sound::ITEMPUP);
   shootv(d->gunselect, from, to, d, true);
@@ -315,16 +366,18 @@ void shoot(dynent *d, vec3f &targ) {
 
   if (guns[d->gunselect].projspeed) return;
 
-  loopv(players) {
-    dynent *o = players[i];
-    if (!o) continue;
-    raydamage(o, from, to, d, i);
+  // only the dynents around the shot are tested
+  auto box = aabb(min(from,to), max(from,to));
+  if (d->gunselect==GUN_SG) loopi(SGRAYS) box = sum(box, aabb(sg[i], sg[i]));
+  physics::entref near[physics::MAXNEAR];
+  const auto num = physics::gather(box, near, physics::MAXNEAR);
+  loopi(s32(num)) {
+    const auto &e = near[i];
+    if (e.monster>=0) {
+      if (e.d!=d) raydamage(e.d, from, to, d, -2);
+    } else if (e.cn>=0 || d->monsterstate)
+      raydamage(e.d, from, to, d, e.cn);
   }
-
-  dvector &v = getmonsters();
-  loopv(v) if (v[i]!=d) raydamage(v[i], from, to, d, -2);
-
-  if (d->monsterstate) raydamage(player1, from, to, d, -1);
 }
 } /* namespace game */
 } /* namespace q */
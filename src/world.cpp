@@ -4,12 +4,27 @@
  -------------------------------------------------------------------------*/
 #include "world.hpp"
 #include "game.hpp"
+#include "physics.hpp"
+#include "renderer.hpp"
+#include "base/pack.hpp"
+#include "base/string.hpp"
 
 namespace q {
 namespace world {
+// a map with its own scene script loads it in the background. the current
+// scene stays drawn and collided until the renderer swaps the new one in
+static bool loadmapscene(const char *mname) {
+  fixedstring name(fmt, "data/maps/%s.lua", mname);
+  const auto buf = pack::loadfile(sys::path(name.c_str()), NULL);
+  if (buf == NULL) return false;
+  FREE(buf);
+  rr::loadscene(name.c_str());
+  return true;
+}
+
 void load(const char *mname) {
+  if (!loadmapscene(mname)) physics::resetworld();
   game::startmap(mname);
 }
 } /* namespace world */
 } /* namespace q */
-